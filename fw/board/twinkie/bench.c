@@ -0,0 +1,489 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * On-target benchmarks of the hot paths.
+ *
+ * Each run of a routine is timed in core cycles with the SysTick down-counter
+ * (the Cortex-M0 has no cycle counter), the interrupts disabled unless the
+ * routine needs them, and the cost of an empty run is removed. The routines
+ * work on synthetic data and leave no side effect, but the PD PHY ones use
+ * the packet buffer : they are refused while a packet is sent or received.
+ */
+
+#include "clock.h"
+#include "common.h"
+#include "console.h"
+#include "cpu.h"
+#include "crc.h"
+#include "dma.h"
+#include "ina2xx.h"
+#include "injector.h"
+#include "link_defs.h"
+#include "printf.h"
+#include "task.h"
+#include "usb_descriptor.h"
+#include "usb_hw.h"
+#include "usb_pd.h"
+#include "usb_pd_tcpm.h"
+#include "util.h"
+
+#define BENCH_PORT 0
+/* Runs of the empty routine, the fastest one is the overhead */
+#define BENCH_BASE_RUNS 16
+#define BENCH_WORDS 16
+/* VBUS monitor, see powermon.c */
+#define BENCH_INA 0
+/* Bytes of the trace line, all its fields have a fixed width */
+#define BENCH_LINE_LEN 32
+
+struct bench {
+	const char *name;
+	/*
+	 * Prepare a run, not timed, returns the bytes the run processes or
+	 * -EC_ERROR_x to stop the benchmark.
+	 */
+	int (*setup)(void);
+	void (*run)(void);
+	/* undo the side effects of the run, not timed */
+	void (*done)(void);
+	int irq; /* runs with the interrupts enabled */
+};
+
+static uint32_t words[BENCH_WORDS] = {
+	0x0001912c, 0x0002d12c, 0x0003c12c, 0x0004b12c,
+	0x0005a12c, 0x000640c8, 0xc8dc213c, 0x00000000,
+	0x12345678, 0x9abcdef0, 0x0f1e2d3c, 0x4b5a6978,
+	0xdeadbeef, 0xcafef00d, 0x55aa55aa, 0xffffffff,
+};
+static uint32_t saved[BENCH_WORDS];
+static volatile uint32_t sink;
+static int bench_fail;
+
+/* --- memcpy_to_usbram() --- */
+
+/* The command endpoint TX buffer is written with its own content */
+static void *usbram_buf(void)
+{
+	return (void *)(uintptr_t)btable_ep[USB_EP_COMMAND].tx_addr;
+}
+
+static int usbram_setup(void)
+{
+	memcpy_from_usbram(saved, usbram_buf(), sizeof(saved));
+	return sizeof(saved);
+}
+
+static void usbram_run(void)
+{
+	memcpy_to_usbram(usbram_buf(), saved, sizeof(saved));
+}
+
+/* --- prepare_message() and pd_analyze_rx() --- */
+
+static const uint16_t bench_header = PD_HEADER(PD_DATA_SOURCE_CAP,
+					       PD_ROLE_SOURCE, PD_ROLE_DFP,
+					       0, 7);
+static int bit_len;
+
+static int encode_setup(void)
+{
+	if (pd_phy_busy(BENCH_PORT))
+		return -EC_ERROR_BUSY;
+	return 2 + 7 * sizeof(uint32_t);
+}
+
+static void encode_run(void)
+{
+	bit_len = prepare_message(BENCH_PORT, bench_header, 7, words);
+}
+
+#ifdef CONFIG_USB_PD_RX_REPLAY
+static struct rx_header decoded;
+
+static int decode_setup(void)
+{
+	int rv;
+
+	if (pd_phy_busy(BENCH_PORT))
+		return -EC_ERROR_BUSY;
+	rv = pd_rx_load_image(BENCH_PORT,
+			      prepare_message(BENCH_PORT, bench_header, 7,
+					      words));
+	return rv < 0 ? rv : 2 + 7 * sizeof(uint32_t);
+}
+
+static void decode_run(void)
+{
+	decoded = pd_analyze_rx(BENCH_PORT, saved);
+}
+
+static void decode_done(void)
+{
+	pd_rx_load_image(BENCH_PORT, 0);
+	if (decoded.packet_type != TCPC_TX_SOP ||
+	    decoded.head != bench_header ||
+	    memcmp(saved, words, 7 * sizeof(uint32_t)))
+		bench_fail = 1;
+}
+#endif
+
+/* --- CRC-32 --- */
+
+static int crc_setup(void)
+{
+	return sizeof(words);
+}
+
+#ifdef CONFIG_HW_CRC
+static uint32_t crc_state;
+
+static int crc_hw_setup(void)
+{
+	/* keep the computation of the stateful interface users */
+	crc_state = crc32_hw_exchange(0xffffffff);
+	return sizeof(words);
+}
+
+static void crc_hw_run(void)
+{
+	int i;
+
+	for (i = 0; i < BENCH_WORDS; i++)
+		crc32_hash32(words[i]);
+	sink = crc32_result();
+}
+
+static void crc_hw_done(void)
+{
+	crc32_hw_exchange(crc_state);
+}
+#endif
+
+/* Reflected CRC-32 of the PD CRC unit, 4 bits at a time */
+static const uint32_t crc_nibble[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static void crc_sw_run(void)
+{
+	uint32_t crc = 0xffffffff;
+	int i, j;
+
+	for (i = 0; i < BENCH_WORDS; i++) {
+		crc ^= words[i];
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 4) ^ crc_nibble[crc & 0xf];
+	}
+	sink = crc ^ 0xffffffff;
+}
+
+/* --- vfnprintf() --- */
+
+static int printf_setup(void)
+{
+	return BENCH_LINE_LEN;
+}
+
+static void printf_run(void)
+{
+	char line[BENCH_LINE_LEN + 1];
+
+	snprintf(line, sizeof(line), "%08x %04x %5d mV %5d mA\n",
+		 words[8], bench_header, 20000, -3000);
+	sink = line[0];
+}
+
+/* --- ina2xx_read() --- */
+
+static int ina_setup(void)
+{
+	return sizeof(uint16_t);
+}
+
+static void ina_run(void)
+{
+	sink = ina2xx_read(BENCH_INA, INA2XX_REG_BUS_VOLT);
+}
+
+/* --- capture DMA latency --- */
+
+#ifdef CONFIG_DMA_CHANNEL_PRIORITY
+/*
+ * A single memory copy on the CC2 capture channel, started while the USB
+ * copy channel moves a block : its completion time is the latency of a
+ * capture request behind a bulk copy, with the levels of
+ * dma_channel_priority[]. Refused while the sniffer uses either channel.
+ */
+#define BENCH_DMA_COPY  STM32_DMAC_CH5
+#define BENCH_DMA_PROBE STM32_DMAC_CH7
+/* half-words of the block, a few thousand cycles */
+#define BENCH_DMA_BULK  256
+#define BENCH_DMA_SPINS 10000
+
+static uint16_t dma_dst;
+
+static void dma_copy_prepare(enum dma_channel ch, const void *src, int count)
+{
+	stm32_dma_chan_t *chan = dma_get_channel(ch);
+
+	/* the same half-word over and over, no buffer needed */
+	chan->cpar = (uint32_t)src;
+	chan->cmar = (uint32_t)&dma_dst;
+	chan->cndtr = count;
+	chan->ccr = STM32_DMA_CCR_MEM2MEM | dma_channel_priority[ch] |
+		    STM32_DMA_CCR_MSIZE_16_BIT | STM32_DMA_CCR_PSIZE_16_BIT;
+}
+
+static int dma_done_flag(enum dma_channel ch)
+{
+	return !!(STM32_DMA1_REGS->isr & STM32_DMA_ISR_TCIF(ch));
+}
+
+static int dma_setup(void)
+{
+	if ((dma_get_channel(BENCH_DMA_COPY)->ccr |
+	     dma_get_channel(BENCH_DMA_PROBE)->ccr) & STM32_DMA_CCR_EN)
+		return -EC_ERROR_BUSY;
+	dma_copy_prepare(BENCH_DMA_COPY, words, BENCH_DMA_BULK);
+	dma_copy_prepare(BENCH_DMA_PROBE, words + 1, 1);
+	dma_go(dma_get_channel(BENCH_DMA_COPY));
+	return sizeof(uint16_t);
+}
+
+static void dma_run(void)
+{
+	int i;
+
+	dma_go(dma_get_channel(BENCH_DMA_PROBE));
+	for (i = 0; i < BENCH_DMA_SPINS; i++)
+		if (dma_done_flag(BENCH_DMA_PROBE))
+			return;
+	bench_fail = 1;
+}
+
+static void dma_done(void)
+{
+	int i;
+
+	/* the probe must not have waited for the whole block */
+	if (dma_done_flag(BENCH_DMA_COPY))
+		bench_fail = 1;
+	for (i = 0; i < BENCH_DMA_SPINS; i++)
+		if (dma_done_flag(BENCH_DMA_COPY))
+			break;
+	dma_disable(BENCH_DMA_COPY);
+	dma_disable(BENCH_DMA_PROBE);
+	dma_clear_isr(BENCH_DMA_COPY);
+	dma_clear_isr(BENCH_DMA_PROBE);
+}
+#endif
+
+/* --- console command lookup --- */
+
+static void find_cmd_run(void)
+{
+	static char name[] = "bench";
+
+	sink = (uintptr_t)console_find_command(name);
+}
+
+static const struct bench benches[INJ_BENCH_COUNT] = {
+	[INJ_BENCH_USBRAM] = {"usbram", usbram_setup, usbram_run},
+#ifdef CONFIG_USB_PD_RX_REPLAY
+	[INJ_BENCH_DECODE] = {"decode", decode_setup, decode_run,
+			      decode_done},
+#endif
+#ifdef CONFIG_HW_CRC
+	[INJ_BENCH_CRC_HW] = {"crc_hw", crc_hw_setup, crc_hw_run,
+			      crc_hw_done},
+#endif
+	[INJ_BENCH_CRC_SW] = {"crc_sw", crc_setup, crc_sw_run},
+	[INJ_BENCH_ENCODE] = {"encode", encode_setup, encode_run},
+	[INJ_BENCH_PRINTF] = {"printf", printf_setup, printf_run},
+	[INJ_BENCH_INA] = {"ina", ina_setup, ina_run, NULL, 1},
+	[INJ_BENCH_FIND_CMD] = {"findcmd", NULL, find_cmd_run},
+#ifdef CONFIG_DMA_CHANNEL_PRIORITY
+	[INJ_BENCH_DMA] = {"dma", dma_setup, dma_run, dma_done},
+#endif
+};
+
+static void empty_run(void)
+{
+}
+
+static const struct bench empty = {"empty", NULL, empty_run};
+
+/*
+ * Run the SysTick on the core clock unless it is running already (task
+ * profiling), returns 1 if it was started.
+ */
+static int systick_start(void)
+{
+	if (CPU_SYSTICK_CSR & CPU_SYSTICK_CSR_ENABLE)
+		return 0;
+	CPU_SYSTICK_RVR = CPU_SYSTICK_MASK;
+	CPU_SYSTICK_CVR = 0;
+	CPU_SYSTICK_CSR = CPU_SYSTICK_CSR_CLKSOURCE | CPU_SYSTICK_CSR_ENABLE;
+	return 1;
+}
+
+/* Time one run, returns its bytes or -EC_ERROR_x */
+static int bench_once(const struct bench *b, uint32_t *cycles)
+{
+	uint32_t t0, t1;
+	int rv;
+
+	if (!b->irq)
+		interrupt_disable();
+	rv = b->setup ? b->setup() : 0;
+	if (rv >= 0) {
+		t0 = CPU_SYSTICK_CVR;
+		b->run();
+		t1 = CPU_SYSTICK_CVR;
+		if (b->done)
+			b->done();
+		/* the counter goes down and wraps every 2^24 cycles */
+		*cycles = (t0 - t1) & CPU_SYSTICK_MASK;
+	}
+	if (!b->irq)
+		interrupt_enable();
+	return rv;
+}
+
+int bench_run(int id, int runs, struct inj_bench *res)
+{
+	const struct bench *b;
+	uint32_t base = CPU_SYSTICK_MASK, c;
+	int i, rv = 0, started;
+
+	memset(res, 0, sizeof(*res));
+	res->clock = clock_get_freq();
+	if (id < 0 || id >= INJ_BENCH_COUNT)
+		return EC_ERROR_INVAL;
+	b = benches + id;
+	if (!b->run)
+		return EC_ERROR_UNIMPLEMENTED;
+
+	started = systick_start();
+	for (i = 0; i < BENCH_BASE_RUNS; i++)
+		if (bench_once(&empty, &c) >= 0)
+			base = MIN(base, c);
+	bench_fail = 0;
+	for (i = 0; i < runs; i++) {
+		rv = bench_once(b, &c);
+		if (rv < 0)
+			break;
+		res->cycles += c > base ? c - base : 0;
+		res->bytes = rv;
+	}
+	if (started)
+		CPU_SYSTICK_CSR = 0;
+
+	res->runs = i;
+	if (bench_fail)
+		return EC_ERROR_UNKNOWN;
+	return rv < 0 ? -rv : EC_SUCCESS;
+}
+
+#ifdef CONFIG_USB_PD_RX_REPLAY
+/* Runs of a recorded packet, the fastest one is kept */
+#define BENCH_DECODE_RUNS 4
+
+int bench_decode(const uint8_t *samples, int count, struct inj_decode *res)
+{
+	uint32_t base = CPU_SYSTICK_MASK, c, t0, t1;
+	struct rx_header rx;
+	int i, rv = 0, started;
+
+	memset(res, 0, sizeof(*res));
+	res->clock = clock_get_freq();
+	res->cycles = CPU_SYSTICK_MASK;
+	started = systick_start();
+	for (i = 0; i < BENCH_BASE_RUNS; i++)
+		if (bench_once(&empty, &c) >= 0)
+			base = MIN(base, c);
+
+	for (i = 0; i < BENCH_DECODE_RUNS && rv >= 0; i++) {
+		interrupt_disable();
+		rv = pd_rx_load_samples(BENCH_PORT, samples, count);
+		if (rv >= 0) {
+			t0 = CPU_SYSTICK_CVR;
+			rx = pd_analyze_rx(BENCH_PORT, res->payload);
+			t1 = CPU_SYSTICK_CVR;
+			pd_rx_load_samples(BENCH_PORT, NULL, 0);
+			c = (t0 - t1) & CPU_SYSTICK_MASK;
+			res->cycles = MIN(res->cycles, c > base ? c - base : 0);
+			res->samples = rv;
+			res->type = rx.packet_type;
+			res->head = rx.head;
+			res->error = pd_rx_last_error(BENCH_PORT);
+		}
+		interrupt_enable();
+	}
+	if (started)
+		CPU_SYSTICK_CSR = 0;
+
+	if (rv < 0) {
+		res->cycles = 0;
+		return -rv;
+	}
+	return EC_SUCCESS;
+}
+#endif
+
+static void bench_print(int id, int runs)
+{
+	struct inj_bench res;
+	uint32_t cyc;
+	int rv;
+
+	rv = bench_run(id, runs, &res);
+	if (!res.runs) {
+		ccprintf("%-8s error %d\n", benches[id].name, rv);
+		return;
+	}
+	cyc = MAX(res.cycles / res.runs, 1);
+	/* bytes per millisecond is kB/s */
+	ccprintf("%-8s %5d %9d %9d %9d%s\n", benches[id].name, res.runs, cyc,
+		 cyc * 1000 / (res.clock / 1000000),
+		 res.bytes * (res.clock / 1000) / cyc,
+		 rv ? " FAILED" : "");
+	cflush();
+}
+
+static int command_bench(int argc, char **argv)
+{
+	int runs = INJ_BENCH_RUNS;
+	int id = -1, i;
+	char *e;
+
+	if (argc >= 2 && strcasecmp(argv[1], "all")) {
+		for (i = 0; i < INJ_BENCH_COUNT; i++)
+			if (benches[i].name &&
+			    !strcasecmp(argv[1], benches[i].name))
+				id = i;
+		if (id < 0)
+			return EC_ERROR_PARAM1;
+	}
+	if (argc >= 3) {
+		runs = strtoi(argv[2], &e, 0);
+		if (*e || runs <= 0)
+			return EC_ERROR_PARAM2;
+	}
+
+	/* the hot paths run from RAM on the boards with CONFIG_RAM_CODE */
+	ccprintf("Code in RAM: %d bytes\n", (uintptr_t)&__iram_text_end -
+		 (uintptr_t)&__iram_text_start);
+	ccprintf("bench     runs cycles/op     ns/op      kB/s\n");
+	for (i = 0; i < INJ_BENCH_COUNT; i++)
+		if ((id < 0 && benches[i].name) || i == id)
+			bench_print(i, runs);
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(bench, command_bench,
+			"[<name>|all] [runs]",
+			"Time the hot paths in core cycles");
@@ -8,6 +8,7 @@
 #include "adc_chip.h"
 #include "common.h"
 #include "console.h"
+#include "dma.h"
 #include "ec_version.h"
 #include "gpio.h"
 #include "hooks.h"
@@ -17,21 +18,57 @@
 #include "registers.h"
 #include "system.h"
 #include "task.h"
+#include "timer.h"
 #include "usb_descriptor.h"
 #include "util.h"
 
 void cc2_event(enum gpio_signal signal)
 {
-	ccprintf("INA!\n");
+	/* no alert function is enabled on the VCONN INA */
 }
 
 void vbus_event(enum gpio_signal signal)
 {
-	ccprintf("INA!\n");
+	/* active low : the release of the pin is not an event */
+	if (!gpio_get_level(signal))
+		powermon_alert();
+}
+
+void sync_event(enum gpio_signal signal)
+{
+#ifdef HAS_TASK_SNIFFER
+	sniffer_sync_event();
+#endif
 }
 
 #include "gpio_list.h"
 
+uint64_t ts_extend(uint32_t raw)
+{
+	timestamp_t ts = get_time();
+
+	/* the 32 LSBs wrapped since 'raw' was read */
+	if (ts.le.lo < raw)
+		ts.le.hi--;
+	ts.le.lo = raw;
+	return ts.val;
+}
+
+/*
+ * DMA priorities by use case : the arbiter serves the highest level first,
+ * then the lowest channel number. The CC captures never wait behind another
+ * transfer, the PD TX and RX before the ADC, the copies last.
+ */
+const uint32_t dma_channel_priority[STM32_DMAC_COUNT] = {
+	[STM32_DMAC_CH1] = STM32_DMA_CCR_PL_MEDIUM,    /* ADC, CC records */
+	[STM32_DMAC_CH2] = STM32_DMA_CCR_PL_HIGH,      /* PD RX, TIM1 */
+	[STM32_DMAC_CH3] = STM32_DMA_CCR_PL_HIGH,      /* PD TX, SPI1 */
+	[STM32_DMAC_CH4] = STM32_DMA_CCR_PL_LOW,       /* console TX */
+	[STM32_DMAC_CH5] = STM32_DMA_CCR_PL_LOW,       /* USB packet copy */
+	[STM32_DMAC_CH6] = STM32_DMA_CCR_PL_VERY_HIGH, /* CC1 capture */
+	[STM32_DMAC_CH7] = STM32_DMA_CCR_PL_VERY_HIGH, /* CC2 capture */
+};
+
 /* Initialize board. */
 void board_config_pre_init(void)
 {
@@ -44,6 +81,12 @@ void board_config_pre_init(void)
 	STM32_GPIO_OSPEEDR(GPIO_A) |= 0x003C0000;
 	/* 40 MHz pin speed on TX clock out PB9 */
 	STM32_GPIO_OSPEEDR(GPIO_B) |= 0x000C0000;
+	/*
+	 * No flash interface clock while the CPU waits in WFI (FLITFEN), the
+	 * SRAM one stays for the capture DMA. Nothing is copied by the DMA
+	 * from the flash, the CPU gets it back as it wakes up.
+	 */
+	STM32_RCC_AHBENR &= ~(1 << 4);
 }
 
 static void board_init(void)
@@ -69,7 +112,7 @@ BUILD_ASSERT(ARRAY_SIZE(adc_channels) == ADC_CH_COUNT);
 
 /* I2C ports */
 const struct i2c_port_t i2c_ports[] = {
-	{"master", I2C_PORT_MASTER, 100, GPIO_I2C_SCL, GPIO_I2C_SDA},
+	{"master", I2C_PORT_MASTER, 400, GPIO_I2C_SCL, GPIO_I2C_SDA},
 };
 const unsigned int i2c_ports_used = ARRAY_SIZE(i2c_ports);
 
@@ -82,6 +125,7 @@ const void * const usb_strings[] = {
 	[USB_STR_CONSOLE_NAME] = USB_STRING_DESC("Shell"),
 	[USB_STR_COMMAND_NAME] = USB_STRING_DESC("Commands"),
 	[USB_STR_SERIALNO] = USB_STRING_DESC(""),
+	[USB_STR_I2C_NAME] = USB_STRING_DESC("I2C"),
 };
 BUILD_ASSERT(ARRAY_SIZE(usb_strings) == USB_STR_COUNT);
 
@@ -13,6 +13,13 @@
 
 /* the UART console is on USART1 (PA9/PA10) */
 #define CONFIG_UART_CONSOLE 1
+/*
+ * The console output is sent by DMA (channel 4, remapped) from the TX
+ * buffer : make it large enough to absorb the bursts of mirrored output
+ * while the sniffer is busy.
+ */
+#undef CONFIG_UART_TX_BUF_SIZE
+#define CONFIG_UART_TX_BUF_SIZE 1024
 
 /* Optional features */
 #define CONFIG_CONSOLE_PACKETS
@@ -23,6 +30,7 @@
 /* Replaced at runtime (board_read_serial) by chip unique-id-based number. */
 #define DEFAULT_SERIALNO ""
 #define CONFIG_WEBUSB_URL "twebkie.org"
+#define CONFIG_WEBUSB_WINUSB_GUID "{61DEC44B-7FBD-4305-AD4B-737CF285B070}"
 
 #define CONFIG_USB_POWER_DELIVERY
 #define CONFIG_USB_PD_ALT_MODE
@@ -35,24 +43,168 @@
 #define CONFIG_USB_PD_VBUS_DETECT_GPIO
 #define CONFIG_PD_USE_DAC_AS_REF
 #define CONFIG_HW_CRC
+#define CONFIG_USB_PD_4B5B_TABLE
+#define CONFIG_USB_PD_RX_RETRY
 
 #ifndef HAS_TASK_PD_C0 /* PD sniffer mode */
 #undef CONFIG_DMA_DEFAULT_HANDLERS
+/* CC voltage records of the sniffer stream */
+#define CONFIG_ADC_CAPTURE
 #define CONFIG_USB_PD_TX_PHY_ONLY
 /* override the comparator interrupt handler */
 #undef CONFIG_USB_PD_RX_COMP_IRQ
+#else /* PD sink : ADC watchdog on the CC lines while disconnected */
+#define CONFIG_USB_PD_CC_WATCHDOG
+#define CONFIG_ADC_WATCHDOG_COMP_IRQ
+/*
+ * The PD task runs the protocol layer of a message before reading the next
+ * one, a console command or a flash write can hold it for a few ms : room
+ * for a VDM burst or the chunks of an extended message meanwhile.
+ */
+#define CONFIG_USB_PD_TCPC_RX_DEPTH 4
+#endif
+
+/* PD sink image : PD events log read over the command endpoint ('pdlog') */
+#ifdef SECTION_IS_RW
+#define CONFIG_USB_PD_LOGGING
+#define CONFIG_USB_PD_LOG_SIZE 512
+#define CONFIG_USB_PD_LOG_STATES
+#define CONFIG_USB_PD_RX_BER
+#define CONFIG_USB_PD_FAST_RESPONSE
+#define CONFIG_USB_PD_RX_REPLAY
+/*
+ * USB-I2C bridge to the INAs for the host tools, with batched transactions.
+ * Not in the sniffer image : its USB packet memory goes to the bulk ring.
+ */
+#define CONFIG_STREAM_USB
+#define CONFIG_USB_I2C
+#define CONFIG_USB_I2C_BATCH
 #endif
 
+/*
+ * The injector script slots use the last flash erase pages, taken from the
+ * end of the RW image.
+ */
+#define INJ_SCRIPT_SLOT_SIZE    CONFIG_FLASH_ERASE_SIZE
+#define INJ_SCRIPT_SLOTS        2
+#define INJ_SCRIPT_STORAGE_SIZE (INJ_SCRIPT_SLOTS * INJ_SCRIPT_SLOT_SIZE)
+#define INJ_SCRIPT_STORAGE_OFF  (CONFIG_FLASH_SIZE - INJ_SCRIPT_STORAGE_SIZE)
+/*
+ * The capture profile page and the capture log pages come right before
+ * them, the RW image keeps a whole number of protection banks.
+ */
+#define INJ_PROFILE_SIZE        CONFIG_FLASH_ERASE_SIZE
+#define INJ_PROFILE_OFF         (INJ_SCRIPT_STORAGE_OFF - INJ_PROFILE_SIZE)
+#define CAPLOG_PAGE_SIZE        CONFIG_FLASH_ERASE_SIZE
+#define CAPLOG_PAGES            3
+#define CAPLOG_SIZE             (CAPLOG_PAGES * CAPLOG_PAGE_SIZE)
+#define CAPLOG_OFF              (INJ_PROFILE_OFF - CAPLOG_SIZE)
+#undef CONFIG_RW_SIZE
+#define CONFIG_RW_SIZE (CONFIG_FLASH_SIZE - CONFIG_RW_MEM_OFF - \
+			INJ_SCRIPT_STORAGE_SIZE - INJ_PROFILE_SIZE - \
+			CAPLOG_SIZE)
+
 #define CONFIG_ADC
 #define CONFIG_BOARD_PRE_INIT
+/* the CC captures first, the copies last : dma_channel_priority[] */
+#define CONFIG_DMA_CHANNEL_PRIORITY
 #define CONFIG_CMD_REBOOT_DFU
+#define CONFIG_CMD_STACKINFO
+#define CONFIG_CMD_USB_MEMCPY
 #define CONFIG_CMD_USB_PD_PE
+#define CONFIG_CMD_I2C_SPEED
 #define CONFIG_I2C
 #define CONFIG_I2C_MASTER
+#define CONFIG_I2C_ASYNC
+#ifdef BOARD_TWONKIE
+#define CONFIG_INA260
+#else
 #define CONFIG_INA231
+#endif
+#define CONFIG_MEMPOOL
 #undef CONFIG_WATCHDOG_HELP
+/*
+ * Quiet idle : the only periodic hook is the watchdog reload, run it along
+ * with the HOOK_SECOND ones so the hook task wakes up once a second. The
+ * other tasks sleep until an event, the CPU stays clocked in WFI so the
+ * first edges of a message are still captured. The system clock cannot be
+ * lowered meanwhile : the capture, TX and timebase timers run off PCLK.
+ */
+#undef HOOK_TICK_INTERVAL_MS
+#define HOOK_TICK_INTERVAL_MS 1000
+#undef CONFIG_WATCHDOG_PERIOD_MS
+#define CONFIG_WATCHDOG_PERIOD_MS 2600
 #undef CONFIG_LID_SWITCH
+/*
+ * RAM budget : 4 lines of console history, and at least 512 bytes left for
+ * the shared memory (flash console commands) or the link fails. Both images
+ * print their RAM usage when linked.
+ */
+#undef CONFIG_CONSOLE_HISTORY
+#define CONFIG_CONSOLE_HISTORY 4
+#define CONFIG_RAM_REPORT
+#define CONFIG_SHAREDMEM_MINIMUM_SIZE 512
+/*
+ * Twonkie runs the capture interrupts and the BMC decoder from RAM : the
+ * flash takes a wait state at 48 MHz and the Cortex-M0 has no cache.
+ */
+#ifdef BOARD_TWONKIE
+#define CONFIG_RAM_CODE
+#endif
+/*
+ * Lean sniffer image (LEAN=1 in build.mk) : only what the sniffer, the
+ * tracer and the injector use. No alternate modes, which only the PD sink
+ * enters, and no generic debug commands, so the linker drops the PD state
+ * machine and its state. A single line of console history, the RAM goes to
+ * the capture buffers. The RW image (PD sink) is unchanged.
+ */
+#ifdef TWINKIE_LEAN
+#undef CONFIG_USB_PD_ALT_MODE
+#undef CONFIG_USB_PD_ALT_MODE_DFP
+#undef CONFIG_CMD_PD
+#undef CONFIG_CMD_USB_PD_PE
+#undef CONFIG_CMD_TYPEC
+#undef CONFIG_CMD_USBMUX
+#undef CONFIG_CMD_HASH
+#undef CONFIG_CMD_HCDEBUG
+#undef CONFIG_CMD_CRASH
+#undef CONFIG_CMD_I2C_SCAN
+#undef CONFIG_CMD_I2C_SPEED
+#undef CONFIG_CMD_I2C_XFER
+#undef CONFIG_CMD_IDLE_STATS
+#undef CONFIG_CMD_INA
+#undef CONFIG_CMD_MMAPINFO
+#undef CONFIG_CMD_SHMEM
+#undef CONFIG_CMD_STACKINFO
+#undef CONFIG_CMD_TIMERINFO
+#undef CONFIG_CMD_USB_MEMCPY
+#undef CONFIG_CMD_WAITMS
+#undef CONFIG_CONSOLE_HISTORY
+#define CONFIG_CONSOLE_HISTORY 1
+#endif
+/*
+ * The task profiling costs IRQ latency the capture cannot afford, it comes in
+ * a separate build : make EXTRA_CFLAGS=-DTWINKIE_PROFILING
+ */
+#ifdef TWINKIE_PROFILING
+#define CONFIG_TASK_PROFILING_CYCLES
+#else
 #undef CONFIG_TASK_PROFILING
+#endif
+/*
+ * Event tracepoints of the capture and PD paths, in a separate build too :
+ * make EXTRA_CFLAGS=-DTWINKIE_TRACEPOINTS
+ */
+#ifdef TWINKIE_TRACEPOINTS
+#define CONFIG_TRACEPOINTS
+#endif
+/*
+ * Tokenized logging of the hot path messages (token_log.h), decoded on the
+ * host by util/detokenize.py : make EXTRA_CFLAGS=-DTWINKIE_TOKEN_LOG
+ */
+#ifdef TWINKIE_TOKEN_LOG
+#define CONFIG_TOKEN_LOG
+#endif
 
 /* I2C ports configuration */
 #define I2C_PORT_MASTER 0
@@ -75,22 +227,467 @@ struct rx_header;
 void sniffer_init(void);
 
 int wait_packet(int pol, uint32_t min_edges, uint32_t timeout_us);
+/*
+ * Wait for 'idle_us' without any edge on the CC line 'pol' : returns the us
+ * the line was busy (0 if it is not captured), -1 after 'timeout_us'.
+ */
+int wait_bus_idle(int pol, uint32_t idle_us, uint32_t timeout_us);
 
 int expect_packet(int pol, uint8_t cmd, uint32_t timeout_us);
 
+/* FSM command/data buffer of injector_buffer_size() words */
+uint32_t *injector_buffer(void);
+int injector_buffer_size(void);
+
+/* Return 1 while an FSM script is running in the injector task */
+int injector_busy(void);
+
+/*
+ * Execute the non-blocking FSM word 'w' now and put its result in 'result' :
+ * GET value, LOAD register or SEND bit length (0 for the other commands).
+ */
+int injector_exec(uint32_t w, uint32_t *result);
+
+/* Take the oldest INJ_CMD_GET result from the ring, return 0 if empty */
+struct inj_result;
+int injector_result_get(struct inj_result *res);
+
+/*
+ * Replay ring : free space in words (-1 if no replay is running), stage
+ * 'count' little-endian words 'offset' words after the end of the ring and
+ * make them available to the player.
+ */
+int injector_replay_space(void);
+void injector_replay_write(int offset, const uint8_t *data, int count);
+void injector_replay_commit(int count);
+
+/* Header and 7-word payload of the last packet decoded by the tracer */
+struct rx_header trace_last_packet(uint32_t *payload);
+
+/* Number of packets decoded by the tracer so far */
+uint32_t trace_rx_count(void);
+
+/* VBUS power monitor reading */
+struct power_sample {
+	uint64_t ts;  /* system clock at the start of the reading */
+	uint16_t mv;
+	int16_t ma;
+	int32_t mw;
+};
+
+/* Aggregates of the readings in the ring */
+struct power_stats {
+	int count;
+	uint64_t first;
+	uint64_t last;
+	int min_mv, max_mv, avg_mv;
+	int min_ma, max_ma, avg_ma;
+};
+
+/*
+ * Totals of every reading since the session start, the ring overruns
+ * included : energy and charge are the readings integrated over the time
+ * elapsed since the previous one.
+ */
+struct power_energy {
+	uint64_t start;     /* system clock of the session start */
+	uint64_t last;      /* time of the last reading */
+	uint32_t count;     /* readings */
+	int64_t energy_nj;  /* integrated mW * us */
+	int64_t charge_nc;  /* integrated mA * us */
+	int min_mv, max_mv;
+	int min_ma, max_ma;
+	int min_mw, max_mw;
+};
+
+/* Readings kept in the ring (power of 2) */
+#define POWERMON_DEPTH 64
+/* Shortest sampling period in us : bus and shunt fastest conversions */
+#define POWERMON_MIN_PERIOD 300
+
+/*
+ * Start sampling every 'period_us', stop if 0. If 'alert' is set, the
+ * readings are done on the conversion ready alerts of the INA instead, with
+ * conversions completing within 'period_us'.
+ */
+int powermon_set_period(int period_us, int alert);
+int powermon_get_period(void);
+/* Oldest reading of the ring, returns 0 if empty */
+int powermon_peek(struct power_sample *s);
+/* Take up to 'count' readings from the ring, returns how many */
+int powermon_read(struct power_sample *s, int count);
+/* Readings dropped as the ring was full */
+uint32_t powermon_overruns(void);
+void powermon_stats(struct power_stats *st);
+/* Session totals, restarted by powermon_energy_reset() */
+void powermon_energy(struct power_energy *en);
+void powermon_energy_reset(void);
+/* Alert limits of the VBUS INA */
+enum power_limit {
+	POWER_LIMIT_OFF = 0,
+	POWER_LIMIT_V_OVER,  /* VBUS above the limit in mV */
+	POWER_LIMIT_V_UNDER, /* VBUS below the limit in mV */
+	POWER_LIMIT_I_OVER,  /* current above the limit in mA */
+	POWER_LIMIT_I_UNDER, /* current below the limit in mA */
+	POWER_LIMIT_COUNT
+};
+/*
+ * Alert when the VBUS readings cross 'limit', the INA compares every
+ * conversion : sniffer_power_alert() is called once per excursion.
+ */
+int powermon_set_limit(enum power_limit kind, int limit);
+enum power_limit powermon_get_limit(int *limit);
+/* Interrupt handler of the VBUS INA alert */
+void powermon_alert(void);
+/*
+ * Timing of the VBUS INA conversions (INA2XX_PRESET_x), or -1 to fit them to
+ * the sampling period. A running monitor then samples once per fresh
+ * reading of the preset.
+ */
+int powermon_set_preset(int preset);
+int powermon_get_preset(void);
+
+/* VCONN INA operation */
+enum vconn_monitor {
+	VCONN_MON_OFF = 0, /* powered down, a one-shot conversion per read */
+	VCONN_MON_DUTY,    /* a one-shot conversion every period */
+	VCONN_MON_CONT,    /* continuous conversions read every period */
+	VCONN_MON_COUNT
+};
+/* Shortest VCONN monitor period in us : 2 conversions of 1.1 ms */
+#define VCONN_MON_MIN_PERIOD (5 * MSEC)
+int vconn_monitor_set(enum vconn_monitor mode, int period_us);
+enum vconn_monitor vconn_monitor_get_mode(int *period_us);
+/*
+ * Latest VCONN reading, at most one period old when monitoring. When off,
+ * runs a short one-shot conversion, sleeping for it : task context only.
+ * Returns EC_SUCCESS, or EC_ERROR_BUSY if the monitor has no reading yet.
+ */
+int vconn_monitor_read(int *mv, int *ma);
+/* A new reading is in the ring */
+void sniffer_power_sample(void);
+/* The sniffer task consumes the readings of the ring */
+int sniffer_power_streaming(void);
+
+/* PD sink : new contract on PS_RDY, 0 mV when it is lost */
+void pdsweep_contract(int mv);
+
+/* Trace a fuzzer mutant which got a FUZZ_x anomalous response */
+void trace_fuzz_report(int anomaly, uint16_t header, int cnt,
+		       const uint32_t *payload);
+
 uint8_t recording_enable(uint8_t mask);
 
+/* Set the input filter (TIMx ICxF value) of the RX capture timers */
+void sniffer_set_rx_filter(int filter);
+
+int sniffer_get_rx_filter(void);
+
+/* Channel mask of the sniffer recording */
+uint8_t sniffer_get_recording(void);
+
+/* Number of glitch edges seen in the samples since the last filter change */
+uint32_t sniffer_glitch_count(void);
+
+/* Free-running counters of the sniffer stream */
+struct sniffer_counters {
+	uint32_t edges;         /* edges captured while counting them */
+	uint32_t usb_bytes;     /* bytes handed to the bulk endpoint */
+	uint32_t packets;       /* packets handed to the bulk endpoint */
+	uint32_t oflow;         /* half-buffers overwritten before being sent */
+	uint32_t decoded;       /* packets decoded by the sniffer decoder */
+	uint32_t decode_errors; /* packets dropped on a symbol error */
+};
+void sniffer_get_counters(struct sniffer_counters *c);
+/* Count the edges of the captured samples, costs a pass on each of them */
+void sniffer_count_edges(int enable);
+
 void trace_packets(void);
 
 void set_trace_mode(int mode);
 
-void sniffer_trace_packet(struct rx_header rx, uint32_t *payload);
+/* Trace filter rules (see TRACE_RULE_x in injector.h) */
+void set_trace_rule(int idx, uint16_t rule);
+uint16_t get_trace_rule(int idx);
+/* Count the consecutive identical packets instead of tracing them */
+void set_trace_coalesce(int enable);
+int get_trace_coalesce(void);
+
+/* Copy the timing histogram 'idx' (INJ_TIMING_x) as INJ_TIMING_WORDS words */
+void get_trace_timing(int idx, uint32_t *words);
+/* Copy the edge intervals histogram of the tracing session */
+struct pd_decode_hist;
+void get_trace_jitter(struct pd_decode_hist *hist);
+
+/*
+ * Trace a frame sent by the injector on the CC line 'line' (1 or 2), from
+ * its first edge at 'ts' to its EOP 'us' later.
+ */
+void trace_tx_packet(uint64_t ts, uint32_t us, struct rx_header rx,
+		     const uint32_t *payload, int line);
+
+/*
+ * Send the GoodCRC of a message received by the tracer on the CC line 'line'
+ * if the automatic acknowledgement is on (INJ_SET_GOODCRC).
+ */
+void injector_goodcrc(struct rx_header rx, int line);
+
+/*
+ * Answer a SOP' message received by the tracer on the CC line 'line' as the
+ * cable plug if the e-marker emulation is on (INJ_SET_EMARKER), and the
+ * SOP* types the tracer has to decode for it (1 << TCPC_TX_x).
+ */
+void injector_emarker(struct rx_header rx, const uint32_t *payload, int line);
+uint8_t injector_emarker_sops(void);
+
+/*
+ * Post the event 'type' (INJ_NOTIFY_x) with its argument 'arg', which
+ * happened at 'ts' (us of the system clock), on the notification endpoint :
+ * from any context.
+ */
+void notify_post(int type, uint32_t arg, uint64_t ts);
+/* 'tw notify' console subcommand */
+int notify_command(int argc, char **argv);
+
+/* Raw timer value (us) at the EOP of the last packet decoded by the tracer */
+uint32_t trace_last_eop(void);
+
+/*
+ * Conformance checker (check.c) : go through the packet 'rx' traced on the CC
+ * line 'line', received or sent, from the raw timer value 'start' to 'eop'.
+ */
+void check_packet(uint32_t start, uint32_t eop, struct rx_header rx, int line);
+/* The checker is on and the packets are not traced, only its violations */
+int check_only(void);
+/* Violations found since the checker was started or cleared */
+uint32_t check_violations(void);
+/* Short name of the violation 'kind' (CHECK_x) */
+const char *check_name(int kind);
+/*
+ * Trace the violation 'kind' (CHECK_x) of the message 'rx' at the raw timer
+ * value 'start', 'value' being a delay in us or a count.
+ */
+void trace_check_report(int kind, uint32_t start, struct rx_header rx,
+			uint32_t value, int line);
+
+/*
+ * Scope trigger (scope.c) : pulse the SYNC pin a fixed delay after the raw
+ * timer value 'eop' of the packet 'rx' traced, if it matches the filter.
+ */
+void scope_packet(struct rx_header rx, uint32_t eop);
+
+/*
+ * Session tracker (session.c) : update the session summary with the packet
+ * 'rx' traced on the CC line 'line', received or sent at the raw timer value
+ * 'start'.
+ */
+void session_packet(uint32_t start, struct rx_header rx,
+		    const uint32_t *payload, int line);
+struct inj_session;
+/* Consistent copy of the session summary */
+void session_get(struct inj_session *out);
+/*
+ * PPS APDO of the last Source_Capabilities the request 'rdo' refers to, 0 if
+ * it is another kind of object : sniffer task only.
+ */
+uint32_t session_pps_apdo(uint32_t rdo);
+
+/*
+ * PPS step response (pps.c) : the source was asked at the raw timer value
+ * 'start' to move VBUS to 'mv', then every VBUS reading is checked against
+ * it by pps_power_sample().
+ */
+void pps_step(uint32_t start, int mv);
+void pps_power_sample(const struct power_sample *s);
+
+/*
+ * Power transition analyzer (ptrans.c) : one record per contract change or
+ * hard reset, from the VBUS readings around its Accept and PS_RDY. The
+ * times are in 100 us from the Accept (or the hard reset), PTRANS_NONE when
+ * the event did not happen in the window.
+ */
+struct power_transition {
+	uint32_t accept_us; /* Accept before the end of the window */
+	uint16_t flags;     /* PTRANS_x */
+	uint16_t from_mv;   /* last reading before the Accept */
+	uint16_t to_mv;     /* middle of the accepted range */
+	uint16_t band_mv;   /* half-width of the accepted range */
+	uint16_t ps_rdy;
+	uint16_t leave;     /* first reading out of the previous level */
+	uint16_t settle;    /* first reading of the last run in the range */
+	uint16_t safe0;     /* last reading at vSafe0V */
+	uint16_t out;       /* duration out of the range after the PS_RDY */
+	uint16_t slew;      /* steepest mV/ms between two readings */
+	int16_t over_mv;    /* farthest reading past the range */
+} __packed;
+#define PTRANS_NONE       0xffff
+#define PTRANS_PPS        (1 << 0) /* Request of a PPS APDO */
+#define PTRANS_HARD_RESET (1 << 1) /* back to vSafe5V after a hard reset */
+#define PTRANS_CUT        (1 << 2) /* ended by the next transition */
+
+/*
+ * The Request 'rdo' of the object 'pdo' was accepted, the PS_RDY was sent
+ * or the hard reset signaled at the raw timer value 'start' : sniffer task.
+ */
+void ptrans_accept(uint32_t start, uint32_t pdo, uint32_t rdo);
+void ptrans_ps_rdy(uint32_t start);
+void ptrans_hard_reset(uint32_t start);
+void ptrans_power_sample(const struct power_sample *s);
+/* Stream the record 't' of the window ended at 'ts' : hook task */
+void sniffer_power_transition(uint64_t ts, const struct power_transition *t);
+/*
+ * Stream a bookmark record of the host 'tag' and 'seq' received at the raw
+ * timer value 'ts' (INJ_BIN_BOOKMARK), from the USB interrupt too.
+ */
+void sniffer_bookmark(uint32_t ts, uint32_t tag, uint16_t seq);
+
+/*
+ * Traffic statistics (stats.c) : count the packet 'head' of the type 'sop'
+ * (TCPC_TX_x) decoded on the RX path, or a decoding error INJ_STATS_ERR_x.
+ */
+void stats_packet(int sop, uint16_t head);
+void stats_error(int err);
+struct inj_stats;
+void stats_get(struct inj_stats *out);
+/* 'sniffer stats' console subcommand */
+int stats_command(int argc, char **argv);
+
+/*
+ * Flight recorder (flight.c) : keep the packet 'head' of the type 'sop'
+ * (TCPC_TX_x) with its first data object 'obj', or the decoding error
+ * INJ_STATS_ERR_x, seen at the raw timer value 'ts' on the CC line 'line'.
+ */
+#define FLIGHT_RECS 64
+void flight_packet(uint32_t ts, int line, int sop, uint16_t head,
+		   uint32_t obj);
+void flight_error(uint32_t ts, int line, int err);
+/* Number of records written since boot, the overwritten ones included */
+uint32_t flight_written(void);
+/* The sniffer capture trigger fired */
+void flight_trigger(void);
+struct inj_flight_rec;
+/*
+ * Copy up to 'max' records from the record 'first' (0 is the oldest) to
+ * 'out', returns their number and the number of records held in 'held'.
+ */
+int flight_read(int first, int max, struct inj_flight_rec *out, int *held);
+/* 'sniffer flight' console subcommand */
+int flight_command(int argc, char **argv);
+
+/*
+ * Eye opening of CC1 (eye.c) : a packet decoded on the sniffer stream 'ch'
+ * (SNIFFER_CHANNEL_CCx) from the half-buffer completed at 'tstamp', and
+ * that half-buffer decoded. The comparators are set up again for the eye
+ * by eye_comparators() when it runs.
+ */
+void eye_packet(int ch, uint64_t tstamp);
+void eye_scanned(int ch, uint64_t tstamp);
+void eye_comparators(void);
+/* 'sniffer eye' console subcommand */
+int eye_command(int argc, char **argv);
+
+/*
+ * Binary trace of a packet received on the CC line 'line' (1 or 2), starting
+ * at 'ts' with its EOP 'eop16' 1/16 us later (0 if it was not decoded).
+ */
+void sniffer_trace_packet(uint64_t ts, uint16_t eop16, struct rx_header rx,
+			  uint32_t *payload, int line);
+/* Binary trace of a frame sent at 'ts' on the CC line 'line', 'us' long */
+void sniffer_trace_tx(uint64_t ts, uint16_t us, struct rx_header rx,
+		      const uint32_t *payload, int line);
+/* Binary trace of a violation found by the checker */
+void sniffer_trace_viol(uint64_t ts, int kind, struct rx_header rx,
+			uint32_t value, int line);
+/* Binary trace of 'count' repeats of the packet 'rx', the last one at 'ts' */
+void sniffer_trace_repeat(uint64_t ts, struct rx_header rx, uint32_t count,
+			  int line);
+/*
+ * Keep the edges of a packet which failed to decode, 'count' of them were
+ * captured (before pd_rx_complete()), then trace them after its record.
+ */
+void sniffer_trace_errwin_latch(int count);
+void sniffer_trace_errwin(uint64_t ts, struct rx_header rx, int line);
+/*
+ * Pulse the SYNC pin for an external instrument, returns EC_ERROR_BUSY if it
+ * carries the sync pulses.
+ */
+int sniffer_sync_trigger(void);
+/* Trace the data of a reassembled chunked extended message */
+void sniffer_trace_ext(struct rx_header rx, uint16_t ext_head,
+		       const uint8_t *data, int len, int line);
+/* Trace a packet decoded by the sniffer on the CC line 'ch' */
+void trace_line_packet(int ch, uint64_t ts, int sop, const uint8_t *data,
+		       int len);
 void sniffer_trace_reload(void);
+/*
+ * Events of the sniffer task, which also runs the packet tracer
+ * (simpletrace.c), one bit per source.
+ */
+/* USB transfers freed ring slots, or the DMA copy to USB RAM is done */
+#define SNIFFER_EVENT_USB     TASK_EVENT_CUSTOM(1 << 0)
+/* Tracer : packet captured on CC1 (line 0) or CC2 (line 1) */
+#define SNIFFER_EVENT_RX(line) TASK_EVENT_CUSTOM(1 << (2 + (line)))
+#define SNIFFER_EVENT_RX_ANY  (SNIFFER_EVENT_RX(0) | SNIFFER_EVENT_RX(1))
+/* Samples or records to process */
+#define SNIFFER_EVENT_DMA     TASK_EVENT_CUSTOM(1 << 4)
+/* Tracer : frame sent by the injector */
+#define SNIFFER_EVENT_TX      TASK_EVENT_CUSTOM(1 << 5)
+/* The VBUS readings crossed the power monitor limit at 'ts' */
+void sniffer_power_alert(uint64_t ts);
+/* Edge on the SYNC pin */
+void sniffer_sync_event(void);
+
+/*
+ * Offline capture log : append a decoded packet (FUZZ_x anomaly 'fuzz'), a
+ * reassembled extended message, a count of lost packets, a violation found
+ * by the checker or a count of coalesced repeats, while armed.
+ */
+void caplog_packet(uint64_t ts, struct rx_header rx, const uint32_t *payload,
+		   int line, int fuzz);
+void caplog_ext(uint64_t ts, struct rx_header rx, uint16_t ext_head,
+		const uint8_t *data, int len, int line);
+void caplog_drops(int count);
+void caplog_viol(uint64_t ts, struct rx_header rx, int kind, uint32_t value,
+		 int line);
+void caplog_repeat(uint64_t ts, struct rx_header rx, uint32_t count,
+		   int line);
+/*
+ * Write the buffered records to flash then point 'ptr' to the 'count' words
+ * of the log region starting at the word 'idx'.
+ */
+int caplog_read(int idx, int count, const uint32_t **ptr);
+
+/*
+ * Timestamps : the sniffer stream, the trace records, and the power and CC
+ * readings are all in us of the system clock (get_time()). ts_raw() only
+ * reads its 32 LSBs, the hardware clock source : the cheap read for the
+ * interrupt handlers and the hot paths (it needs hwtimer.h). ts_extend()
+ * rebuilds the full time of a value read in the last 71 minutes, once out
+ * of the interrupt.
+ */
+#define ts_raw() __hw_clock_source_read()
+uint64_t ts_extend(uint32_t raw);
 
 /* Timer selection */
 #define TIM_CLOCK_MSB  3
 #define TIM_CLOCK_LSB 15
 #define TIM_ADC       16
+#define TIM_RES_SCHED 14
+#define TIM_WAIT       7
+#define TIM_PROF       6
+/*
+ * Trigger input capture : on Twinkie, the SYNC pin (PB10) is TIM2_CH3 with
+ * the alternate function 2, a spare channel of the CC2 RX timer latching
+ * its edges. Twonkie has it on PB1, without timer channel. Plain constants,
+ * the code of the other board is folded away by the compiler.
+ */
+#ifdef BOARD_TWONKIE
+#define SYNC_CAPTURE    0
+#define SYNC_CAPTURE_AF 0
+#else
+#define SYNC_CAPTURE    1
+#define SYNC_CAPTURE_AF 2
+#endif
 
 #include "gpio_signal.h"
 
@@ -112,6 +709,7 @@ enum usb_strings {
 	USB_STR_CONSOLE_NAME,
 	USB_STR_COMMAND_NAME,
 	USB_STR_SERIALNO,
+	USB_STR_I2C_NAME,
 
 	USB_STR_COUNT
 };
@@ -136,6 +734,9 @@ enum usb_strings {
 #define USB_IFACE_CONSOLE 0
 #define USB_IFACE_VENDOR  1
 
+/* Event records of the interrupt IN endpoint (struct inj_notify) */
+#define NOTIFY_PACKET_SIZE 16
+
 /* USB endpoint indexes (use define rather than enum to expand them) */
 #define USB_EP_CONTROL   0
 #define USB_EP_CONSOLE   1
@@ -143,19 +744,71 @@ enum usb_strings {
 
 #ifdef HAS_TASK_SNIFFER
 #define USB_EP_SNIFFER   3
-#define USB_EP_COUNT     4
+#define USB_EP_NOTIFY    4
+#define USB_EP_COUNT     5
 
 #define USB_IFACE_COMMAND 2
 #define USB_IFACE_COUNT   3
+
+/*
+ * Keep the Commands response buffer small in the sniffer image, the rest of
+ * the USB packet memory is used by the sniffer bulk endpoint ring.
+ */
+#define USB_COMMAND_TX_SIZE 256
+/* Commands OUT packets held while the console runs the previous ones */
+#define USB_COMMAND_QUEUE 2
+/* Copy the sniffer payloads into the USB packet memory with DMA channel 5 */
+#define SNIFFER_DMA_COPY
+/*
+ * Experimental 'sniffer zerocopy' : single line samples written by the RX
+ * DMA straight into the USB packet memory
+ */
+#define SNIFFER_ZERO_COPY
+/* Clock correlation records on the SOF */
+#define CONFIG_USB_SOF_LATCH
+/* Capture through a host suspend, waking the host up when needed */
+#define CONFIG_USB_SUSPEND
+#define CONFIG_USB_REMOTE_WAKEUP
+/* CPU idle time of the health records */
+#define CONFIG_IDLE_TIME
+/*
+ * RAM budget of the sniffer image : the capture buffers take what the trimmed
+ * console history leaves (24 USB payloads per CC line instead of 16), and
+ * what the lean image drops. The rings of the debug builds take theirs : 8
+ * payloads per CC line for the tracepoints (768 bytes), 4 for the token log
+ * (256 bytes), and 8 for both with a shorter tracepoint ring, the trace
+ * records fall back to 16 payloads.
+ */
+#if defined(CONFIG_TRACEPOINTS) && defined(CONFIG_TOKEN_LOG)
+#define CONFIG_TRACEPOINT_RECS 32
+#define SNIFFER_DEBUG_PAYLOADS 8
+#elif defined(CONFIG_TRACEPOINTS)
+#define SNIFFER_DEBUG_PAYLOADS 8
+#elif defined(CONFIG_TOKEN_LOG)
+#define SNIFFER_DEBUG_PAYLOADS 4
+#else
+#define SNIFFER_DEBUG_PAYLOADS 0
+#endif
+#ifdef TWINKIE_LEAN
+#define SNIFFER_RX_PAYLOADS (26 - SNIFFER_DEBUG_PAYLOADS)
+#else
+#define SNIFFER_RX_PAYLOADS (24 - SNIFFER_DEBUG_PAYLOADS)
+#endif
 #else
-#define USB_EP_COUNT     3
+#define USB_EP_I2C       3
+#define USB_EP_NOTIFY    4
+#define USB_EP_COUNT     5
 /* No IFACE_VENDOR for the sniffer */
 #define USB_IFACE_COMMAND 1
-#define USB_IFACE_COUNT   2
+#define USB_IFACE_I2C     2
+#define USB_IFACE_COUNT   3
+
+#define USB_COMMAND_TX_SIZE 512
+#define USB_COMMAND_QUEUE 4
 #endif
 
 #ifdef BOARD_TWONKIE
-#define INA_SENSE_MOHMS 2   /* that's mOhms not MOhms */
+#define INA_SENSE_MOHMS 2   /* internal shunt of the INA260 */
 #else /* Twinkie */
 #define INA_SENSE_MOHMS 15
 #endif
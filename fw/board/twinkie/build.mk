@@ -11,4 +11,14 @@ CHIP_FAMILY:=stm32f0
 CHIP_VARIANT:=stm32f07x
 
 board-y=board.o usb_pd_policy.o injector.o simpletrace.o usb_commands.o
-board-$(HAS_TASK_SNIFFER)+=sniffer.o
+board-y+=powermon.o bench.o impair.o prof.o notify.o vdm_dict.o
+board-$(HAS_TASK_SNIFFER)+=sniffer.o caplog.o check.o
+board-$(HAS_TASK_SNIFFER)+=session.o stats.o flight.o pps.o eye.o scope.o
+board-$(HAS_TASK_SNIFFER)+=ptrans.o
+board-$(HAS_TASK_PD_C0)+=pdsweep.o
+
+# Lean sniffer image (RO) without the generic commands and the PD sink
+# features : make BOARD=twonkie LEAN=1 out=build/twonkie-lean
+ifeq ($(LEAN),1)
+CPPFLAGS_RO+=-DTWINKIE_LEAN
+endif
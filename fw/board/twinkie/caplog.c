@@ -0,0 +1,450 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Offline capture log : the packets decoded by the text trace ('trace on'
+ * or 'trace dual') are appended to a ring of flash pages, so a twinkie
+ * powered from the port under test captures with no host attached. The log
+ * is read back later in bulk over the command endpoint (INJ_BIN_LOG_READ).
+ *
+ * The records are gathered in a RAM buffer and written a chunk at a time,
+ * the first halfword of the chunk last : a write torn by a power loss
+ * leaves an invisible chunk, the boot scan then carries on in a new page.
+ *
+ * The arming is kept in the log itself as state records, repeated at the
+ * start of every page : an armed twinkie starts tracing again at boot.
+ *
+ * The CPU stalls on its instruction fetches while the flash is programmed
+ * (about 50 us per halfword) or erased (about 20 ms per page), whichever
+ * task does it : a packet arriving then is lost. The writes are left to
+ * the moments the CC lines are idle : the buffer is written as one burst
+ * once no packet came for CAPLOG_IDLE, and the next page is erased ahead
+ * at the same time once the current one is half full. Only a buffer or a
+ * page filling up during a long burst of traffic writes or erases at once.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "flash.h"
+#include "hooks.h"
+#include "injector.h"
+#include "task.h"
+#include "timer.h"
+#include "usb_pd.h"
+#include "util.h"
+
+/* RAM buffer of the records not written yet */
+#define CAPLOG_BUF_SIZE 192
+/* Time without any record before the flash is written */
+#define CAPLOG_IDLE (200 * MSEC)
+
+/* The header and the padding of the records keep them word-aligned */
+BUILD_ASSERT(sizeof(struct caplog_rec) % sizeof(uint32_t) == 0);
+BUILD_ASSERT(sizeof(struct caplog_page) % sizeof(uint32_t) == 0);
+
+/* Records waiting in RAM, written at the page offset 'log_off' */
+static uint32_t log_buf[CAPLOG_BUF_SIZE / sizeof(uint32_t)];
+static int buf_len;
+/* Page being written (-1 until the first one is open) and its counter */
+static int log_page = -1;
+static uint32_t log_seq;
+/* Offset of the first free byte of the page, the buffer excluded */
+static int log_off;
+static int log_armed;
+/* The page after the current one is erased already */
+static int next_erased;
+/* Records appended, and lost on flash errors */
+static uint32_t log_records;
+static uint32_t log_errors;
+/* Pages erased ahead while idle, and when opening them */
+static uint32_t early_erases;
+static uint32_t late_erases;
+/* Taken by the hook task appending and the console task reading */
+static struct mutex log_lock;
+
+extern int trace_mode;
+
+static int page_offset(int page)
+{
+	return CAPLOG_OFF + page * CAPLOG_PAGE_SIZE;
+}
+
+static const struct caplog_page *page_header(int page)
+{
+	const char *ptr;
+
+	if (flash_dataptr(page_offset(page), CAPLOG_PAGE_SIZE, 4, &ptr) < 0)
+		return NULL;
+	return (const struct caplog_page *)ptr;
+}
+
+/* Write 'len' bytes at the offset 'off' of the page, the first halfword last */
+static int log_commit(int off, const void *data, int len)
+{
+	const char *ptr = data;
+	int rv;
+
+	rv = flash_write(page_offset(log_page) + off + 2, len - 2, ptr + 2);
+	if (rv == EC_SUCCESS)
+		rv = flash_write(page_offset(log_page) + off, 2, ptr);
+	return rv;
+}
+
+/* Record the failure and leave the rest of the page alone */
+static void log_failed(void)
+{
+	log_errors++;
+	log_off = CAPLOG_PAGE_SIZE;
+}
+
+static void log_flush(void)
+{
+	if (!buf_len)
+		return;
+	if (log_commit(log_off, log_buf, buf_len) == EC_SUCCESS)
+		log_off += buf_len;
+	else
+		log_failed();
+	buf_len = 0;
+}
+
+/* Oldest page of the ring : the next one to be written */
+static int log_next_page(void)
+{
+	return log_page < 0 ? 0 : (log_page + 1) % CAPLOG_PAGES;
+}
+
+/*
+ * Erase the next page once the current one is half full : the oldest page
+ * goes a bit early, the log keeps more than CAPLOG_PAGES - 1 pages.
+ */
+static void log_pre_erase(void)
+{
+	if (next_erased || log_off < CAPLOG_PAGE_SIZE / 2)
+		return;
+	if (flash_erase(page_offset(log_next_page()), CAPLOG_PAGE_SIZE) ==
+	    EC_SUCCESS) {
+		next_erased = 1;
+		early_erases++;
+	}
+}
+
+/* No record for CAPLOG_IDLE : write the buffer and get the next page ready */
+static void log_idle(void)
+{
+	mutex_lock(&log_lock);
+	log_flush();
+	log_pre_erase();
+	mutex_unlock(&log_lock);
+}
+DECLARE_DEFERRED(log_idle);
+
+/* Make the oldest page the current one, erasing it unless done already */
+static int log_open_page(void)
+{
+	struct caplog_page hdr = {
+		.magic = CAPLOG_MAGIC,
+		.seq = log_seq + 1,
+	};
+	int page = log_next_page();
+	int off = page_offset(page);
+	int rv;
+
+	if (!next_erased) {
+		rv = flash_erase(off, CAPLOG_PAGE_SIZE);
+		if (rv != EC_SUCCESS)
+			return rv;
+		late_erases++;
+	}
+	next_erased = 0;
+	/* counter first : a torn header has no valid magic */
+	rv = flash_write(off + sizeof(hdr.magic), sizeof(hdr.seq),
+			 (const char *)&hdr.seq);
+	if (rv == EC_SUCCESS)
+		rv = flash_write(off, sizeof(hdr.magic),
+				 (const char *)&hdr.magic);
+	if (rv != EC_SUCCESS)
+		return rv;
+
+	log_page = page;
+	log_seq = hdr.seq;
+	log_off = sizeof(hdr);
+	return EC_SUCCESS;
+}
+
+static void log_state(void);
+
+/*
+ * Append the record 'rec' followed by 'len' bytes of 'data', which must be
+ * readable up to the next multiple of 4 bytes. Called with the lock held.
+ */
+static void log_append(struct caplog_rec *rec, const void *data, int len)
+{
+	int size = sizeof(*rec) + ((len + 3) & ~3);
+	uint8_t *dst;
+	int rv;
+
+	rec->size = size;
+	if (log_page < 0 || log_off + buf_len + size > CAPLOG_PAGE_SIZE) {
+		log_flush();
+		if (log_open_page() != EC_SUCCESS) {
+			log_failed();
+			return;
+		}
+		if (log_armed)
+			log_state();
+	}
+	if (buf_len + size > sizeof(log_buf))
+		log_flush();
+
+	if (size > sizeof(log_buf)) {
+		/* too long for the buffer : the data then the header */
+		rv = flash_write(page_offset(log_page) + log_off + sizeof(*rec),
+				 size - sizeof(*rec), data);
+		if (rv == EC_SUCCESS)
+			rv = log_commit(log_off, rec, sizeof(*rec));
+		if (rv == EC_SUCCESS) {
+			log_off += size;
+			log_records++;
+		} else {
+			log_failed();
+		}
+		return;
+	}
+
+	dst = (uint8_t *)log_buf + buf_len;
+	memcpy(dst, rec, sizeof(*rec));
+	if (len)
+		memcpy(dst + sizeof(*rec), data, len);
+	memset(dst + sizeof(*rec) + len, 0, size - sizeof(*rec) - len);
+	/* postponed by every record until the traffic pauses */
+	hook_call_deferred(&log_idle_data, CAPLOG_IDLE);
+	buf_len += size;
+	log_records++;
+}
+
+static void log_rec_init(struct caplog_rec *rec, int type, uint64_t ts,
+			 int line)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->type = type;
+	rec->line = line;
+	rec->ts_lo = ts;
+	rec->ts_hi = ts >> 32;
+}
+
+static void log_state(void)
+{
+	struct caplog_rec rec;
+
+	log_rec_init(&rec, CAPLOG_REC_STATE, get_time().val, 0);
+	rec.arg = log_armed;
+	log_append(&rec, NULL, 0);
+}
+
+void caplog_packet(uint64_t ts, struct rx_header rx, const uint32_t *payload,
+		   int line, int fuzz)
+{
+	struct caplog_rec rec;
+
+	if (!log_armed)
+		return;
+	log_rec_init(&rec, CAPLOG_REC_PACKET, ts, line);
+	rec.head = rx.head;
+	rec.sop = rx.packet_type;
+	rec.arg = fuzz;
+	mutex_lock(&log_lock);
+	log_append(&rec, payload, rx.packet_type < 0 ? 0 :
+		   PD_HEADER_CNT(rx.head) * sizeof(uint32_t));
+	mutex_unlock(&log_lock);
+}
+
+void caplog_ext(uint64_t ts, struct rx_header rx, uint16_t ext_head,
+		const uint8_t *data, int len, int line)
+{
+	struct caplog_rec rec;
+
+	if (!log_armed)
+		return;
+	log_rec_init(&rec, CAPLOG_REC_EXT, ts, line);
+	rec.head = rx.head;
+	rec.sop = rx.packet_type;
+	rec.arg = ext_head;
+	mutex_lock(&log_lock);
+	log_append(&rec, data, len);
+	mutex_unlock(&log_lock);
+}
+
+void caplog_drops(int count)
+{
+	struct caplog_rec rec;
+
+	if (!log_armed)
+		return;
+	log_rec_init(&rec, CAPLOG_REC_DROPS, get_time().val, 0);
+	rec.arg = MIN(count, 0xffff);
+	mutex_lock(&log_lock);
+	log_append(&rec, NULL, 0);
+	mutex_unlock(&log_lock);
+}
+
+void caplog_viol(uint64_t ts, struct rx_header rx, int kind, uint32_t value,
+		 int line)
+{
+	struct caplog_rec rec;
+
+	if (!log_armed)
+		return;
+	log_rec_init(&rec, CAPLOG_REC_VIOL, ts, line);
+	rec.head = rx.head;
+	rec.sop = rx.packet_type;
+	rec.arg = kind;
+	mutex_lock(&log_lock);
+	log_append(&rec, &value, sizeof(value));
+	mutex_unlock(&log_lock);
+}
+
+void caplog_repeat(uint64_t ts, struct rx_header rx, uint32_t count,
+		   int line)
+{
+	struct caplog_rec rec;
+
+	if (!log_armed)
+		return;
+	log_rec_init(&rec, CAPLOG_REC_REPEAT, ts, line);
+	rec.head = rx.head;
+	rec.sop = rx.packet_type;
+	mutex_lock(&log_lock);
+	log_append(&rec, &count, sizeof(count));
+	mutex_unlock(&log_lock);
+}
+
+int caplog_read(int idx, int count, const uint32_t **ptr)
+{
+	const char *p;
+
+	if (idx < 0 || count < 0 ||
+	    (idx + count) * sizeof(uint32_t) > CAPLOG_SIZE)
+		return EC_ERROR_OVERFLOW;
+	mutex_lock(&log_lock);
+	log_flush();
+	mutex_unlock(&log_lock);
+	if (flash_dataptr(CAPLOG_OFF + idx * sizeof(uint32_t),
+			  count * sizeof(uint32_t), 4, &p) < 0)
+		return EC_ERROR_INVAL;
+	*ptr = (const uint32_t *)p;
+	return EC_SUCCESS;
+}
+
+static void log_set_armed(int armed)
+{
+	mutex_lock(&log_lock);
+	if (armed != log_armed) {
+		log_armed = armed;
+		/* written at once : the next boot must see the change */
+		log_state();
+		log_flush();
+	}
+	mutex_unlock(&log_lock);
+	/* the records come from the text trace */
+	if (armed && trace_mode != TRACE_MODE_ON &&
+	    trace_mode != TRACE_MODE_DUAL)
+		set_trace_mode(TRACE_MODE_ON);
+}
+
+static int log_erase(void)
+{
+	int rv;
+
+	mutex_lock(&log_lock);
+	rv = flash_erase(CAPLOG_OFF, CAPLOG_SIZE);
+	/* carry on from the next page : the ring wears evenly */
+	log_off = CAPLOG_PAGE_SIZE;
+	next_erased = rv == EC_SUCCESS;
+	buf_len = 0;
+	log_armed = 0;
+	log_records = 0;
+	log_errors = 0;
+	mutex_unlock(&log_lock);
+	return rv;
+}
+
+/* Find the page being written and where its records end */
+static void caplog_init(void)
+{
+	const struct caplog_page *hdr;
+	const struct caplog_rec *rec;
+	const uint8_t *base;
+	int page, off;
+
+	for (page = 0; page < CAPLOG_PAGES; page++) {
+		hdr = page_header(page);
+		if (hdr && hdr->magic == CAPLOG_MAGIC &&
+		    (log_page < 0 || (int32_t)(hdr->seq - log_seq) > 0)) {
+			log_page = page;
+			log_seq = hdr->seq;
+		}
+	}
+	next_erased = flash_is_erased(page_offset(log_next_page()),
+				     CAPLOG_PAGE_SIZE);
+	if (log_page < 0)
+		return;
+
+	base = (const uint8_t *)page_header(log_page);
+	off = sizeof(*hdr);
+	while (off + sizeof(*rec) <= CAPLOG_PAGE_SIZE) {
+		rec = (const struct caplog_rec *)(base + off);
+		if (rec->size == CAPLOG_END)
+			break;
+		if (rec->size < sizeof(*rec) || (rec->size & 3) ||
+		    off + rec->size > CAPLOG_PAGE_SIZE) {
+			off = CAPLOG_PAGE_SIZE;
+			break;
+		}
+		if (rec->type == CAPLOG_REC_STATE)
+			log_armed = rec->arg;
+		off += rec->size;
+	}
+	/* a torn write past the last record : start a new page */
+	if (off < CAPLOG_PAGE_SIZE &&
+	    !flash_is_erased(page_offset(log_page) + off,
+			     CAPLOG_PAGE_SIZE - off))
+		off = CAPLOG_PAGE_SIZE;
+	log_off = off;
+
+	/* after the saved profile : an armed log wins over its trace mode */
+	if (log_armed)
+		set_trace_mode(TRACE_MODE_ON);
+}
+DECLARE_HOOK(HOOK_INIT, caplog_init, HOOK_PRIO_LAST);
+
+static int command_caplog(int argc, char **argv)
+{
+	int rv = EC_SUCCESS;
+
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "on"))
+			log_set_armed(1);
+		else if (!strcasecmp(argv[1], "off"))
+			log_set_armed(0);
+		else if (!strcasecmp(argv[1], "erase"))
+			rv = log_erase();
+		else if (!strcasecmp(argv[1], "flush"))
+			log_idle();
+		else
+			return EC_ERROR_PARAM1;
+	}
+
+	ccprintf("Capture log: %s, %d records, %d errors\n",
+		 log_armed ? "armed" : "off", log_records, log_errors);
+	if (log_page >= 0)
+		ccprintf("  page %d seq %d: %d/%d bytes, %d buffered\n",
+			 log_page, log_seq, log_off, CAPLOG_PAGE_SIZE,
+			 buf_len);
+	ccprintf("  erases: %d ahead, %d on demand, next page %s\n",
+		 early_erases, late_erases, next_erased ? "ready" : "used");
+	return rv;
+}
+DECLARE_CONSOLE_COMMAND(caplog, command_caplog,
+			"[on|off|erase|flush]",
+			"Log the traced packets to flash");
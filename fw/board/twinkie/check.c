@@ -0,0 +1,313 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Protocol conformance checker : the packets decoded by the tracer ('trace
+ * on' or 'trace raw') and the frames sent by the injector go through a model
+ * of both ends of each SOP* link, which reports the CHECK_x violations as
+ * they happen instead of leaving them to a host pass over the whole trace :
+ * - a MessageID other than the previous acknowledged one + 1, Soft_Reset and
+ *   Hard Reset restarting the counters,
+ * - a message with no GoodCRC within tReceive,
+ * - more transmissions of a message than 1 + nRetryCount,
+ * - a GoodCRC with no message waiting for it,
+ * - a response coming after its sender timer (tSenderResponse, or
+ *   tPSTransition for the PS_RDY after the Accept of a Request), or none.
+ *
+ * The model only knows what the tracer decoded : a decoding error loses the
+ * state of the links rather than raising false violations. The late or
+ * missing GoodCRC and responses are found when the next packet comes.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "injector.h"
+#include "timer.h"
+#include "usb_pd.h"
+#include "usb_pd_tcpm.h"
+#include "util.h"
+
+/* An end of a SOP* link : SOP type * 2 + power role or cable plug bit */
+#define CHECK_ENDS 6
+#define END_OF(rx) ((rx).packet_type * 2 + (((rx).head >> 8) & 1))
+/* The other end of the same link */
+#define PEER(end) ((end) ^ 1)
+
+#define ACK_MASK ((1 << PD_CTRL_ACCEPT) | (1 << PD_CTRL_REJECT) | \
+		  (1 << PD_CTRL_WAIT))
+
+enum check_mode {
+	CHECK_MODE_OFF = 0,
+	CHECK_MODE_ON,   /* traced along with the packets */
+	CHECK_MODE_ONLY, /* only the violations are traced */
+};
+
+static const char * const viol_name[] = {
+	[CHECK_OK]         = "OK",
+	[CHECK_MSGID]      = "MSGID",
+	[CHECK_NO_GOODCRC] = "NOCRC",
+	[CHECK_RETRIES]    = "RETRIES",
+	[CHECK_GOODCRC]    = "GOODCRC",
+	[CHECK_RESPONSE]   = "RESPONSE",
+};
+BUILD_ASSERT(ARRAY_SIZE(viol_name) == CHECK_COUNT);
+
+/* Messages arming a sender timer once acknowledged, and their responses */
+static const struct response {
+	uint8_t data;       /* the trigger is a data message */
+	uint8_t type;
+	uint32_t ctrl_mask; /* control messages answering it */
+	uint32_t data_mask; /* data messages answering it */
+} responses[] = {
+	{1, PD_DATA_SOURCE_CAP, 0, 1 << PD_DATA_REQUEST},
+	{1, PD_DATA_REQUEST, ACK_MASK, 0},
+	{0, PD_CTRL_GET_SOURCE_CAP, 0, 1 << PD_DATA_SOURCE_CAP},
+	{0, PD_CTRL_GET_SINK_CAP, 0, 1 << PD_DATA_SINK_CAP},
+	{0, PD_CTRL_DR_SWAP, ACK_MASK, 0},
+	{0, PD_CTRL_PR_SWAP, ACK_MASK, 0},
+	{0, PD_CTRL_VCONN_SWAP, ACK_MASK, 0},
+	{0, PD_CTRL_SOFT_RESET, 1 << PD_CTRL_ACCEPT, 0},
+};
+
+static struct {
+	enum check_mode mode;
+	uint8_t trigger;    /* pulse the SYNC pin on a violation */
+	uint8_t blind;      /* packets were lost since the last message */
+	uint32_t count[CHECK_COUNT];
+	struct {
+		uint8_t id_valid;
+		uint8_t id;      /* MessageID of the last acknowledged message */
+		uint8_t pending; /* a message is waiting for its GoodCRC */
+		uint8_t tries;   /* transmissions of that message */
+		uint8_t late;    /* its missing GoodCRC was reported */
+		uint8_t ps_rdy;  /* it accepts a Request : PS_RDY follows */
+		uint16_t head;
+		uint32_t eop;
+	} ends[CHECK_ENDS];
+	/* response awaited after a sender timer started */
+	struct {
+		uint8_t on;
+		uint8_t from;    /* end expected to answer */
+		uint16_t head;   /* message which started the timer */
+		uint32_t ctrl_mask;
+		uint32_t data_mask;
+		uint32_t since;
+		uint32_t limit;
+	} expect;
+} check;
+
+const char *check_name(int kind)
+{
+	return kind < CHECK_COUNT ? viol_name[kind] : "?";
+}
+
+int check_only(void)
+{
+	return check.mode == CHECK_MODE_ONLY;
+}
+
+uint32_t check_violations(void)
+{
+	uint32_t total = 0;
+	int i;
+
+	for (i = CHECK_OK + 1; i < CHECK_COUNT; i++)
+		total += check.count[i];
+	return total;
+}
+
+static void check_reset(void)
+{
+	memset(check.ends, 0, sizeof(check.ends));
+	check.expect.on = 0;
+	check.blind = 0;
+}
+
+static void report(int kind, uint32_t ts, int end, uint16_t head,
+		   uint32_t value, int line)
+{
+	struct rx_header rx = RX_HEADER(end / 2, head);
+
+	check.count[kind]++;
+	if (check.trigger)
+		sniffer_sync_trigger();
+	notify_post(INJ_NOTIFY_CHECK, kind | line << 8, ts_extend(ts));
+	trace_check_report(kind, ts, rx, value, line);
+}
+
+static int is_type(uint16_t head, int data, int type)
+{
+	return !PD_HEADER_CNT(head) == !data && PD_HEADER_TYPE(head) == type;
+}
+
+/* Report the GoodCRC and responses which should have come before 'now' */
+static void check_timeouts(uint32_t now, int line)
+{
+	int i;
+
+	for (i = 0; i < CHECK_ENDS; i++)
+		if (check.ends[i].pending && !check.ends[i].late &&
+		    now - check.ends[i].eop > GOODCRC_RECEIVE_US) {
+			check.ends[i].late = 1;
+			report(CHECK_NO_GOODCRC, check.ends[i].eop, i,
+			       check.ends[i].head, check.ends[i].tries, line);
+		}
+	if (check.expect.on && now - check.expect.since > check.expect.limit) {
+		check.expect.on = 0;
+		report(CHECK_RESPONSE, check.expect.since, PEER(check.expect.from),
+		       check.expect.head, now - check.expect.since, line);
+	}
+}
+
+static void expect_arm(int from, uint16_t head, uint32_t ctrl_mask,
+		       uint32_t data_mask, uint32_t since, uint32_t limit)
+{
+	check.expect.on = 1;
+	check.expect.from = from;
+	check.expect.head = head;
+	check.expect.ctrl_mask = ctrl_mask;
+	check.expect.data_mask = data_mask;
+	check.expect.since = since;
+	check.expect.limit = limit;
+}
+
+/* GoodCRC of the message of the end 'end' */
+static void check_goodcrc(int end, uint16_t head, uint32_t eop, int line)
+{
+	int i;
+	uint16_t msg = check.ends[end].head;
+
+	if (!check.ends[end].pending ||
+	    PD_HEADER_ID(msg) != PD_HEADER_ID(head)) {
+		/* the message might have been lost to a decoding error */
+		if (!check.blind)
+			report(CHECK_GOODCRC, eop, PEER(end), head,
+			       PD_HEADER_ID(head), line);
+		return;
+	}
+	check.ends[end].pending = 0;
+	check.ends[end].id = PD_HEADER_ID(msg);
+	check.ends[end].id_valid = 1;
+
+	/* the sender timers start at the end of the GoodCRC */
+	if (check.ends[end].ps_rdy) {
+		check.ends[end].ps_rdy = 0;
+		expect_arm(end, msg, 1 << PD_CTRL_PS_RDY, 0, eop,
+			   PD_T_PS_TRANSITION);
+		return;
+	}
+	for (i = 0; i < ARRAY_SIZE(responses); i++)
+		if (is_type(msg, responses[i].data, responses[i].type))
+			expect_arm(PEER(end), msg, responses[i].ctrl_mask,
+				   responses[i].data_mask, eop,
+				   PD_T_SENDER_RESPONSE);
+}
+
+void check_packet(uint32_t start, uint32_t eop, struct rx_header rx, int line)
+{
+	uint16_t head = rx.head;
+	int id = PD_HEADER_ID(head);
+	int end, retries;
+
+	if (check.mode == CHECK_MODE_OFF)
+		return;
+	if (rx.packet_type < 0) {
+		/* nothing to trust until the links start again */
+		check_reset();
+		check.blind = 1;
+		return;
+	}
+	check_timeouts(start, line);
+	if (rx.packet_type == TCPC_TX_HARD_RESET) {
+		check_reset();
+		return;
+	}
+	if (rx.packet_type == TCPC_TX_CABLE_RESET) {
+		/* only the cable plugs restart */
+		memset(check.ends + 2, 0, sizeof(check.ends) - 2 *
+		       sizeof(check.ends[0]));
+		if (check.expect.from >= 2)
+			check.expect.on = 0;
+		return;
+	}
+	/* the debug SOP* are not modelled */
+	if (rx.packet_type > TCPC_TX_SOP_PRIME_PRIME)
+		return;
+
+	end = END_OF(rx);
+	if (is_type(head, 0, PD_CTRL_GOOD_CRC)) {
+		check_goodcrc(PEER(end), head, eop, line);
+		return;
+	}
+
+	if (check.ends[end].pending && check.ends[end].head == head) {
+		/* retry : nRetryCount is 3 in PD 2.0, 2 in PD 3.0 */
+		retries = ((head >> 6) & 3) >= PD_REV30 ? 2 : 3;
+		if (++check.ends[end].tries == 2 + retries)
+			report(CHECK_RETRIES, start, end, head,
+			       check.ends[end].tries, line);
+	} else {
+		if (is_type(head, 0, PD_CTRL_SOFT_RESET)) {
+			/* both counters restart, the Accept has the ID 0 */
+			if (id)
+				report(CHECK_MSGID, start, end, head, 0, line);
+			check.ends[PEER(end)].id_valid = 1;
+			check.ends[PEER(end)].id = 7;
+		} else if (check.ends[end].id_valid &&
+			   id != ((check.ends[end].id + 1) & 7)) {
+			report(CHECK_MSGID, start, end, head,
+			       (check.ends[end].id + 1) & 7, line);
+		}
+		check.ends[end].tries = 1;
+		check.ends[end].late = 0;
+	}
+	check.ends[end].pending = 1;
+	check.ends[end].head = head;
+	check.ends[end].eop = eop;
+	check.blind = 0;
+
+	if (check.expect.on && check.expect.from == end &&
+	    (PD_HEADER_CNT(head) ? check.expect.data_mask
+				 : check.expect.ctrl_mask) &
+	    (1 << PD_HEADER_TYPE(head))) {
+		check.expect.on = 0;
+		/* the source switches its supply once the Accept is acked */
+		if (is_type(check.expect.head, 1, PD_DATA_REQUEST) &&
+		    is_type(head, 0, PD_CTRL_ACCEPT))
+			check.ends[end].ps_rdy = 1;
+	}
+}
+
+static int command_check(int argc, char **argv)
+{
+	int i;
+
+	if (argc >= 2 && !strcasecmp(argv[1], "trigger")) {
+		if (argc < 3)
+			return EC_ERROR_PARAM_COUNT;
+		check.trigger = !strcasecmp(argv[2], "on");
+	} else if (argc >= 2) {
+		if (!strcasecmp(argv[1], "on"))
+			check.mode = CHECK_MODE_ON;
+		else if (!strcasecmp(argv[1], "only"))
+			check.mode = CHECK_MODE_ONLY;
+		else if (!strcasecmp(argv[1], "off"))
+			check.mode = CHECK_MODE_OFF;
+		else if (strcasecmp(argv[1], "clear"))
+			return EC_ERROR_PARAM1;
+		memset(check.count, 0, sizeof(check.count));
+		check_reset();
+	}
+
+	ccprintf("Check: %s%s, %d violations:",
+		 check.mode == CHECK_MODE_OFF ? "off" :
+		 check.mode == CHECK_MODE_ON ? "on" : "only",
+		 check.trigger ? " trigger" : "", check_violations());
+	for (i = CHECK_OK + 1; i < CHECK_COUNT; i++)
+		ccprintf(" %s %d", viol_name[i], check.count[i]);
+	ccputs("\n");
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(check, command_check,
+			"[on|only|off|clear|trigger on|off]",
+			"Check the protocol of the traced packets");
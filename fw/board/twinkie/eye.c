@@ -0,0 +1,237 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Eye opening of CC1 : in the comparator window mode, COMP2 watches CC1
+ * too, at its usual threshold, while COMP1 compares CC1 to the DAC. The
+ * sniffer decoder runs on both capture streams : a packet decoded on the
+ * CC2 stream is a reference, the same packet decoded on the CC1 stream
+ * passes at the DAC threshold.
+ *
+ * The DAC steps through EYE_LEVELS thresholds, staying at each one for
+ * EYE_DWELL reference packets. Its range of thresholds where every packet
+ * passes is the eye height, the extent of the high and low signal levels
+ * around the thresholds.
+ *
+ * The packets of the half-buffers captured while the DAC changed are not
+ * counted : a stream counts its packets again from its second half-buffer
+ * completed after the change.
+ *
+ * In calibration, the middle of the eye of each sweep becomes the RX
+ * threshold, the DAC value restored when the eye stops, used by the tracer,
+ * the PD sink and the injector checks.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "registers.h"
+#include "timer.h"
+#include "util.h"
+
+#define EYE_MIN_MV  200
+#define EYE_STEP_MV 50
+#define EYE_LEVELS  19
+/* Reference packets decoded at each threshold */
+#define EYE_DWELL   4
+
+#define EYE_PROBE 0 /* CC1 stream : DAC threshold */
+#define EYE_REF   1 /* CC2 stream : usual threshold */
+
+/* Calibration of the RX threshold */
+#define EYE_CAL_OFF   0
+#define EYE_CAL_ONCE  1 /* after the next sweep, then stop the eye */
+#define EYE_CAL_TRACK 2 /* after every sweep */
+
+static struct {
+	uint8_t on;
+	uint8_t cal;
+	uint8_t level;
+	uint8_t closing;      /* got the reference packets of the level */
+	uint8_t counting[2];  /* a half-buffer completed after the change */
+	uint8_t ref;
+	uint8_t probe;
+	uint64_t change;      /* time of the last DAC change */
+	uint64_t close;       /* time of the last reference half-buffer */
+	uint32_t sweeps;
+	uint32_t saved_csr;
+	uint32_t saved_dac;
+	uint16_t tries[EYE_LEVELS];
+	uint16_t passes[EYE_LEVELS];
+} eye;
+
+static int level_mv(int level)
+{
+	return EYE_MIN_MV + level * EYE_STEP_MV;
+}
+
+static void eye_set_level(int level)
+{
+	eye.level = level;
+	eye.ref = eye.probe = 0;
+	eye.closing = 0;
+	eye.counting[EYE_PROBE] = eye.counting[EYE_REF] = 0;
+	eye.change = get_time().val;
+	/* DAC1 on the COMP1 inverting input (Vref = 3.3V) */
+	STM32_DAC_DHR12RD = level_mv(level) * 4096 / 3300;
+}
+
+/* Lowest and highest thresholds where every packet passed */
+static int eye_range(int *low, int *high)
+{
+	int i;
+
+	*low = *high = -1;
+	for (i = 0; i < EYE_LEVELS; i++) {
+		if (!eye.tries[i] || eye.passes[i] < eye.tries[i])
+			continue;
+		if (*low < 0)
+			*low = level_mv(i);
+		*high = level_mv(i);
+	}
+	return *low >= 0;
+}
+
+static void eye_print(void)
+{
+	int low, high;
+
+	if (eye_range(&low, &high))
+		ccprintf("Eye: %d-%d mV, height %d mV\n", low, high,
+			 high - low);
+	else
+		ccputs("Eye: closed\n");
+}
+
+static int dac_mv(uint32_t dac)
+{
+	return (dac * 3300 + 2048) / 4096;
+}
+
+static void eye_start(void)
+{
+	eye.saved_csr = STM32_COMP_CSR;
+	eye.saved_dac = STM32_DAC_DHR12RD;
+	eye.on = 1;
+	eye_comparators();
+	eye_set_level(0);
+}
+
+static void eye_stop(void)
+{
+	eye.on = 0;
+	eye.cal = EYE_CAL_OFF;
+	STM32_COMP_CSR = eye.saved_csr;
+	STM32_DAC_DHR12RD = eye.saved_dac;
+}
+
+/* Center the RX threshold in the eye of the sweep just done */
+static void eye_calibrate(void)
+{
+	int low, high, mv;
+
+	if (!eye_range(&low, &high)) {
+		ccprints("RX threshold kept at %d mV : eye closed",
+			 dac_mv(eye.saved_dac));
+	} else {
+		mv = (low + high) / 2;
+		if (mv != dac_mv(eye.saved_dac))
+			ccprints("RX threshold %d -> %d mV",
+				 dac_mv(eye.saved_dac), mv);
+		eye.saved_dac = mv * 4096 / 3300;
+	}
+	/* the next sweep gives the next eye */
+	memset(eye.tries, 0, sizeof(eye.tries));
+	memset(eye.passes, 0, sizeof(eye.passes));
+}
+
+void eye_comparators(void)
+{
+	if (!eye.on)
+		return;
+	STM32_COMP_CSR = (STM32_COMP_CSR & ~STM32_COMP_CMP1INSEL_MASK) |
+			 STM32_COMP_CMP1INSEL_INM4 | STM32_COMP_WNDWEN;
+}
+
+void eye_packet(int ch, uint64_t tstamp)
+{
+	if (!eye.on || !eye.counting[ch])
+		return;
+	if (ch == EYE_REF && !eye.closing) {
+		eye.ref++;
+		eye.closing = eye.ref >= EYE_DWELL;
+		eye.close = tstamp;
+	} else if (ch == EYE_PROBE) {
+		eye.probe++;
+	}
+}
+
+void eye_scanned(int ch, uint64_t tstamp)
+{
+	if (!eye.on)
+		return;
+	if (tstamp > eye.change)
+		eye.counting[ch] = 1;
+	/* the probe stream has caught up with the last reference packet */
+	if (!eye.closing || ch != EYE_PROBE || tstamp <= eye.close)
+		return;
+
+	eye.tries[eye.level] += eye.ref;
+	eye.passes[eye.level] += MIN(eye.probe, eye.ref);
+	if (eye.level + 1 < EYE_LEVELS) {
+		eye_set_level(eye.level + 1);
+		return;
+	}
+	eye.sweeps++;
+	eye_print();
+	if (eye.cal == EYE_CAL_ONCE) {
+		eye_calibrate();
+		eye_stop();
+		return;
+	}
+	if (eye.cal == EYE_CAL_TRACK)
+		eye_calibrate();
+	eye_set_level(0);
+}
+
+int eye_command(int argc, char **argv)
+{
+	int i;
+
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "on") && !eye.on) {
+			eye_start();
+		} else if (!strcasecmp(argv[0], "off") && eye.on) {
+			eye_stop();
+		} else if (!strcasecmp(argv[0], "cal")) {
+			if (argc >= 2 && strcasecmp(argv[1], "track"))
+				return EC_ERROR_PARAM3;
+			/* a fresh sweep from the lowest threshold */
+			if (eye.on)
+				eye_stop();
+			memset(eye.tries, 0, sizeof(eye.tries));
+			memset(eye.passes, 0, sizeof(eye.passes));
+			eye_start();
+			eye.cal = argc >= 2 ? EYE_CAL_TRACK : EYE_CAL_ONCE;
+		} else if (!strcasecmp(argv[0], "clear")) {
+			memset(eye.tries, 0, sizeof(eye.tries));
+			memset(eye.passes, 0, sizeof(eye.passes));
+			eye.sweeps = 0;
+		} else if (strcasecmp(argv[0], "on") &&
+			   strcasecmp(argv[0], "off")) {
+			return EC_ERROR_PARAM2;
+		}
+	}
+
+	ccprintf("Eye on CC1: %s, probe at %d mV, %d sweeps\n",
+		 eye.on ? "on" : "off", level_mv(eye.level), eye.sweeps);
+	ccprintf("RX threshold %d mV%s\n",
+		 dac_mv(eye.on ? eye.saved_dac : STM32_DAC_DHR12RD),
+		 eye.cal == EYE_CAL_TRACK ? ", tracking" :
+		 eye.cal == EYE_CAL_ONCE ? ", calibrating" : "");
+	for (i = 0; i < EYE_LEVELS; i++)
+		if (eye.tries[i])
+			ccprintf("%5d mV %d/%d\n", level_mv(i), eye.passes[i],
+				 eye.tries[i]);
+	eye_print();
+	return EC_SUCCESS;
+}
@@ -0,0 +1,161 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Flight recorder : the last packets decoded on the RX path (the sniffer
+ * decoder, or the tracer while it runs) and their decoding errors are kept
+ * in a RAM ring at all times, so what happened just before a failure can be
+ * read back although no trace was running.
+ *
+ * The ring stops recording when it is frozen : on request, or on a Hard
+ * Reset or the capture trigger if they are enabled as freeze sources. The
+ * frozen ring is then printed on the console by the hook task.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "hooks.h"
+#include "injector.h"
+#include "task.h"
+#include "usb_pd.h"
+#include "usb_pd_tcpm.h"
+#include "util.h"
+
+/* the sniffer task is the only writer */
+static struct inj_flight_rec ring[FLIGHT_RECS];
+static uint32_t next;
+static uint8_t full;
+static uint8_t frozen;
+static uint8_t freeze_sources;
+static uint32_t written;
+
+BUILD_ASSERT(POWER_OF_TWO(FLIGHT_RECS));
+
+/* Copy up to 'max' records from the record 'first', oldest first */
+int flight_read(int first, int max, struct inj_flight_rec *out, int *held)
+{
+	int start, n, i;
+
+	interrupt_disable();
+	n = full ? FLIGHT_RECS : next;
+	start = full ? next : 0;
+	*held = n;
+	n = first < n ? MIN(n - first, max) : 0;
+	for (i = 0; i < n; i++)
+		out[i] = ring[(start + first + i) % FLIGHT_RECS];
+	interrupt_enable();
+	return n;
+}
+
+static void flight_dump(void)
+{
+	struct inj_flight_rec rec;
+	int i, held;
+
+	for (i = 0; flight_read(i, 1, &rec, &held); i++) {
+		ccprintf("%10u CC%d ", rec.ts, rec.line);
+		if (rec.kind & INJ_FLIGHT_ERROR(0))
+			ccprintf("%s error\n",
+				 inj_stats_err_name[rec.kind & 0x7f]);
+		else if (rec.kind > TCPC_TX_SOP_DEBUG_PRIME_PRIME)
+			ccprintf("%s\n", inj_stats_sop_name[rec.kind]);
+		else
+			ccprintf("%s %04x %08x\n", inj_stats_sop_name[rec.kind],
+				 rec.head, rec.obj);
+		cflush();
+	}
+	ccprintf("Flight: %d records%s\n", held, frozen ? ", frozen" : "");
+}
+DECLARE_DEFERRED(flight_dump);
+
+static void flight_freeze(void)
+{
+	if (frozen)
+		return;
+	frozen = 1;
+	hook_call_deferred(&flight_dump_data, 0);
+}
+
+static void flight_add(uint32_t ts, int line, int kind, uint16_t head,
+		       uint32_t obj)
+{
+	struct inj_flight_rec *rec = ring + next;
+
+	if (frozen)
+		return;
+	rec->ts = ts;
+	rec->kind = kind;
+	rec->line = line;
+	rec->head = head;
+	rec->obj = obj;
+	next = (next + 1) % FLIGHT_RECS;
+	if (!next)
+		full = 1;
+	written++;
+}
+
+uint32_t flight_written(void)
+{
+	return written;
+}
+
+void flight_packet(uint32_t ts, int line, int sop, uint16_t head,
+		   uint32_t obj)
+{
+	if (sop < 0 || sop > TCPC_TX_CABLE_RESET)
+		return;
+	flight_add(ts, line, sop, head, obj);
+	if (sop == TCPC_TX_HARD_RESET &&
+	    (freeze_sources & INJ_FLIGHT_FREEZE_HRST))
+		flight_freeze();
+}
+
+void flight_error(uint32_t ts, int line, int err)
+{
+	if (err >= 0 && err < INJ_STATS_ERR_COUNT)
+		flight_add(ts, line, INJ_FLIGHT_ERROR(err), 0, 0);
+}
+
+void flight_trigger(void)
+{
+	if (freeze_sources & INJ_FLIGHT_FREEZE_TRIG)
+		flight_freeze();
+}
+
+int flight_command(int argc, char **argv)
+{
+	int i;
+
+	if (argc >= 1 && !strcasecmp(argv[0], "clear")) {
+		interrupt_disable();
+		next = 0;
+		full = 0;
+		frozen = 0;
+		interrupt_enable();
+	} else if (argc >= 1 && !strcasecmp(argv[0], "freeze")) {
+		interrupt_disable();
+		frozen = 1;
+		interrupt_enable();
+	} else if (argc >= 1 && !strcasecmp(argv[0], "auto")) {
+		uint8_t sources = 0;
+
+		for (i = 1; i < argc; i++) {
+			if (!strcasecmp(argv[i], "hrst"))
+				sources |= INJ_FLIGHT_FREEZE_HRST;
+			else if (!strcasecmp(argv[i], "trigger"))
+				sources |= INJ_FLIGHT_FREEZE_TRIG;
+			else if (strcasecmp(argv[i], "off"))
+				return EC_ERROR_PARAM3;
+		}
+		freeze_sources = sources;
+		ccprintf("Freeze on:%s%s\n",
+			 sources & INJ_FLIGHT_FREEZE_HRST ? " hrst" : "",
+			 sources & INJ_FLIGHT_FREEZE_TRIG ? " trigger" : "");
+		return EC_SUCCESS;
+	} else if (argc >= 1) {
+		return EC_ERROR_PARAM2;
+	}
+
+	flight_dump();
+	return EC_SUCCESS;
+}
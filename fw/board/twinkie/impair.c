@@ -0,0 +1,216 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * TX impairments : the bit image of a message encoded by prepare_message()
+ * is rewritten before being sent, to test the tolerance of a receiver.
+ *
+ * The image is handled as the list of its edges (a toggle per raw bit), so
+ * removing or moving an edge keeps the rest of the message consistent. It is
+ * oversampled IMPAIR_OS times into the spare part of the packet buffer and
+ * sent with the TX clock multiplied as much, which gives the edge jitter its
+ * resolution : 1/IMPAIR_OS of a half bit, 417ns at the nominal rate.
+ * Random draws come from a xorshift32 generator restarted by each new seed,
+ * so a run is reproducible.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "injector.h"
+#include "usb_pd.h"
+#include "util.h"
+
+#define IMPAIR_PORT 0
+/* Output bits per raw bit */
+#define IMPAIR_OS 4
+/* Largest edge jitter : the edges may meet, never cross */
+#define IMPAIR_JITTER_MAX (IMPAIR_OS / 2)
+/* Raw bits before the EOP : preamble, SOP, header and CRC */
+#define IMPAIR_EOP_OFF(cnt) (2 * 64 + 4 * 10 + 4 * 10 + (cnt) * 80 + 80)
+
+static struct {
+	uint16_t seed;
+	uint32_t rnd;       /* generator state */
+	uint8_t jitter;     /* largest edge shift in 1/IMPAIR_OS half bits */
+	int8_t ui;          /* bit period stretch in % */
+	uint16_t drop;      /* edge drop probability in 1/65536 */
+	uint8_t preamble;   /* preamble bits removed */
+	uint8_t eop;        /* EOP symbol | INJ_IMPAIR_EOP_ON, 0 : unchanged */
+	int clock;          /* nominal TX clock while an image is sent */
+	uint8_t oversampled;/* the last image was rewritten */
+} impair = {
+	.rnd = 0x9e3779b9,
+};
+
+static uint32_t impair_rand(void)
+{
+	/* xorshift32 : the state must never be 0 */
+	impair.rnd ^= impair.rnd << 13;
+	impair.rnd ^= impair.rnd >> 17;
+	impair.rnd ^= impair.rnd << 5;
+	return impair.rnd;
+}
+
+int impair_set(int knob, int val)
+{
+	switch (knob) {
+	case INJ_IMPAIR_SEED:
+		impair.seed = val;
+		impair.rnd = 0x9e3779b9 ^ val;
+		break;
+	case INJ_IMPAIR_JITTER:
+		if (val < 0 || val > IMPAIR_JITTER_MAX)
+			return EC_ERROR_INVAL;
+		impair.jitter = val;
+		break;
+	case INJ_IMPAIR_UI:
+		/* the knob is a 16-bit field */
+		val = (int16_t)val;
+		if (val < -50 || val > 100)
+			return EC_ERROR_INVAL;
+		impair.ui = val;
+		break;
+	case INJ_IMPAIR_DROP:
+		impair.drop = val;
+		break;
+	case INJ_IMPAIR_PREAMBLE:
+		if (val < 0 || val > 63)
+			return EC_ERROR_INVAL;
+		impair.preamble = val;
+		break;
+	case INJ_IMPAIR_EOP:
+		impair.eop = val & (INJ_IMPAIR_EOP_ON | 0x1f);
+		break;
+	case INJ_IMPAIR_CLEAR:
+		impair.jitter = impair.ui = impair.drop = 0;
+		impair.preamble = impair.eop = 0;
+		break;
+	default:
+		return EC_ERROR_INVAL;
+	}
+	return EC_SUCCESS;
+}
+
+static int impair_active(void)
+{
+	return impair.jitter || impair.ui || impair.drop || impair.preamble ||
+	       impair.eop;
+}
+
+/* Set the output bits [from, to[ */
+static void set_bits(uint32_t *out, int from, int to)
+{
+	for (; from < to; from++)
+		out[from / 32] |= 1 << (from % 32);
+}
+
+const uint32_t *impair_image(const uint32_t *raw, int *bit_len,
+			     uint16_t header)
+{
+	int eop = IMPAIR_EOP_OFF(PD_HEADER_CNT(header));
+	int start = impair.preamble * 2;
+	int len = *bit_len;
+	int prev = 0, level = 0, out_pos = 0;
+	int spare, b, i, t;
+	uint32_t *out;
+
+	impair.oversampled = 0;
+	if (!impair_active() || len <= start)
+		return raw;
+	out = pd_get_tx_spare(IMPAIR_PORT, len, &spare);
+	if ((len - start) * IMPAIR_OS + 32 > spare)
+		return raw;
+	memset(out, 0, DIV_ROUND_UP((len - start) * IMPAIR_OS, 32) * 4 + 4);
+
+	for (i = 0; i < len; i++) {
+		int cur = (raw[i / 32] >> (i % 32)) & 1;
+
+		/* edge at the start of this raw bit */
+		t = cur ^ prev;
+		prev = cur;
+		if (i < start)
+			continue;
+		/* the middle of a BMC bit has an edge for a 1 */
+		if ((impair.eop & INJ_IMPAIR_EOP_ON) && i >= eop &&
+		    i < eop + 10 && (i - eop) & 1)
+			t = (impair.eop >> ((i - eop) / 2)) & 1;
+		if (t && impair.drop && (impair_rand() & 0xffff) < impair.drop)
+			t = 0;
+		b = (i - start) * IMPAIR_OS;
+		if (t && impair.jitter)
+			b += (int)(impair_rand() % (2 * impair.jitter + 1)) -
+			     impair.jitter;
+		b = MAX(b, out_pos);
+		if (level)
+			set_bits(out, out_pos, b);
+		out_pos = b;
+		level ^= t;
+	}
+	b = (len - start) * IMPAIR_OS;
+	if (level)
+		set_bits(out, out_pos, b);
+
+	impair.oversampled = 1;
+	*bit_len = b;
+	return out;
+}
+
+void impair_clock(int on)
+{
+	if (!impair.oversampled)
+		return;
+	if (on) {
+		impair.clock = pd_get_clock(IMPAIR_PORT);
+		pd_set_clock(IMPAIR_PORT, impair.clock * IMPAIR_OS * 100 /
+			     (100 + impair.ui));
+	} else {
+		pd_set_clock(IMPAIR_PORT, impair.clock);
+		impair.oversampled = 0;
+	}
+}
+
+static int command_impair(int argc, char **argv)
+{
+	static const char * const knobs[] = {
+		[INJ_IMPAIR_SEED] = "seed",
+		[INJ_IMPAIR_JITTER] = "jitter",
+		[INJ_IMPAIR_UI] = "ui",
+		[INJ_IMPAIR_DROP] = "drop",
+		[INJ_IMPAIR_PREAMBLE] = "preamble",
+		[INJ_IMPAIR_EOP] = "eop",
+	};
+	char *e;
+	int i, val;
+
+	if (argc >= 2 && !strcasecmp(argv[1], "off")) {
+		impair_set(INJ_IMPAIR_CLEAR, 0);
+	} else if (argc >= 3) {
+		for (i = 0; i < ARRAY_SIZE(knobs); i++)
+			if (!strcasecmp(argv[1], knobs[i]))
+				break;
+		if (i == ARRAY_SIZE(knobs))
+			return EC_ERROR_PARAM1;
+		val = strtoi(argv[2], &e, 0);
+		if (*e)
+			return EC_ERROR_PARAM2;
+		/* a symbol given for the EOP replaces it */
+		if (i == INJ_IMPAIR_EOP && val)
+			val |= INJ_IMPAIR_EOP_ON;
+		if (impair_set(i, val))
+			return EC_ERROR_PARAM2;
+	} else if (argc == 2) {
+		return EC_ERROR_PARAM_COUNT;
+	}
+
+	ccprintf("seed %d jitter %d/%d ui %d%% drop %d/65536 preamble -%d",
+		 impair.seed, impair.jitter, IMPAIR_OS, impair.ui, impair.drop,
+		 impair.preamble);
+	if (impair.eop)
+		ccprintf(" eop %02x", impair.eop & 0x1f);
+	ccputs(impair_active() ? "\n" : " (off)\n");
+
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(impair, command_impair,
+			"[off|seed|jitter|ui|drop|preamble|eop <val>]",
+			"Impair the messages sent by the injector");
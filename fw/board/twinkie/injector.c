@@ -4,28 +4,122 @@
  */
 
 #include "adc.h"
+#include "adc_chip.h"
+#include "clock.h"
 #include "common.h"
 #include "console.h"
+#include "crc.h"
 #include "dma.h"
+#include "flash.h"
 #include "gpio.h"
 #include "hooks.h"
 #include "hwtimer.h"
 #include "injector.h"
+#include "queue.h"
 #include "registers.h"
+#include "shared_mem.h"
 #include "system.h"
 #include "task.h"
 #include "timer.h"
 #include "usb_pd.h"
 #include "usb_pd_config.h"
+#include "usb_pd_decode.h"
+#include "usb_pd_tcpm.h"
 #include "util.h"
 #include "watchdog.h"
 
-/* FSM command/data buffer */
-static uint32_t inj_cmds[INJ_CMD_COUNT];
+/*
+ * FSM command/data buffer : the static one by default, a larger one from the
+ * shared memory if requested.
+ */
+static uint32_t inj_cmds_default[INJ_CMD_COUNT];
+static uint32_t *inj_cmds = inj_cmds_default;
+static int inj_cmd_count = INJ_CMD_COUNT;
 
 /* Current polarity for sending operations */
 static enum inj_pol inj_polarity = INJ_POL_CC1;
 
+/* Resistor connected on each CC line */
+static enum inj_res inj_resistor[2];
+
+/* CC readings : samples averaged (1 for a single conversion), sample time */
+static int cc_avg = 1;
+static int cc_smpr = STM32_ADC_SMPR_239_5_CY;
+
+/* FSM scratch registers */
+static uint32_t inj_regs[INJ_REG_COUNT];
+
+/* INJ_CMD_GET results waiting to be drained by the host */
+static struct queue const inj_results =
+	QUEUE_NULL(INJ_RESULT_COUNT, struct inj_result);
+static uint16_t inj_result_seq;
+
+int injector_result_get(struct inj_result *res)
+{
+	return queue_remove_unit(&inj_results, res);
+}
+
+uint32_t *injector_buffer(void)
+{
+	return inj_cmds;
+}
+
+int injector_buffer_size(void)
+{
+	return inj_cmd_count;
+}
+
+/* Asynchronous execution of the FSM in the injector task */
+enum fsm_state {
+	FSM_IDLE,
+	FSM_RUNNING,
+	FSM_ABORTING,
+};
+static volatile int fsm_state;
+/* index of the FSM word being executed (or to start from) */
+static volatile int fsm_pc;
+/* index where the last run stopped, -1 if it has never run */
+static int fsm_result = -1;
+/* job of the injector task (INJ_JOB_x) */
+static int inj_job;
+
+int injector_busy(void)
+{
+	return fsm_state != FSM_IDLE;
+}
+
+/* Resize the FSM buffer to 'words' words : its content is cleared */
+static int injector_buffer_resize(int words)
+{
+	char *mem;
+
+	if (injector_busy())
+		return EC_ERROR_BUSY;
+
+	/* the FSM words address the buffer with 16-bit indexes */
+	if (words < 0 || words > 0x10000)
+		return EC_ERROR_INVAL;
+
+	if (inj_cmds != inj_cmds_default)
+		shared_mem_release(inj_cmds);
+	inj_cmds = inj_cmds_default;
+	inj_cmd_count = INJ_CMD_COUNT;
+
+	if (words > INJ_CMD_COUNT) {
+		if (shared_mem_acquire(words * sizeof(uint32_t), &mem))
+			return EC_ERROR_BUSY;
+		inj_cmds = (uint32_t *)mem;
+		inj_cmd_count = words;
+	}
+	memset(inj_cmds, 0, inj_cmd_count * sizeof(uint32_t));
+	return EC_SUCCESS;
+}
+
+/* Outcome of the last INJ_CMD_EXPCT : 1 if the packet was received */
+static int inj_expect_ok;
+/* Transmissions of the last INJ_CMD_SEND_RETRY, 0 if it was never acked */
+static int inj_send_tries;
+
 /*
  * CCx Resistors control definition
  *
@@ -103,27 +197,142 @@ static inline void enable_tracing_ifneeded(int flag)
 		pd_rx_enable_monitoring(0);
 }
 
-static int send_message(int polarity, uint16_t header,
-			uint8_t cnt, const uint32_t *data)
+/*
+ * Trace a frame we have sent, started at the hardware timer value 'start'.
+ * The comparator is masked while sending (the TX image lives in the RX
+ * buffer), so the frame is traced from what we encoded.
+ */
+static void trace_tx(int pol, uint32_t start, int type, uint16_t header,
+		     int cnt, const uint32_t *data, int bit_len)
 {
-	int bit_len;
+	timestamp_t ts = get_time();
+	uint32_t payload[7] = { 0 };
+
+	if (bit_len <= 0)
+		return;
+	/* the hardware timer is the low word of the system time */
+	if (ts.le.lo < start)
+		ts.le.hi--;
+	ts.le.lo = start;
+	if (data)
+		memcpy(payload, data, MIN(cnt, 7) * sizeof(uint32_t));
+	/* 2 raw bits per wire bit at 600kHz */
+	trace_tx_packet(ts.val, bit_len * 10 / 6, RX_HEADER(type, header),
+			payload, pol + 1);
+}
+
+#ifdef HAS_TASK_SNIFFER
+/*
+ * Cache of the encoded bit images of the short messages (GoodCRC, control
+ * messages, requests...) which are re-sent over and over during a test.
+ * Only used in the sniffer image : the PD task is not running there, the
+ * messages are encoded with the ordered set of their SOP* type.
+ */
+#define TX_CACHE_SIZE 8
+/* largest payload of a cached message in 32-bit objects */
+#define TX_CACHE_MAX_CNT 2
+/*
+ * preamble + SOP + header + objects + CRC + EOP + last edge
+ * (+1 word cleared by pd_write_last_edge)
+ */
+#define TX_CACHE_BITS(cnt) (2*64 + 4*10 + 4*10 + (cnt)*80 + 80 + 10 + 3)
+#define TX_CACHE_WORDS (DIV_ROUND_UP(TX_CACHE_BITS(TX_CACHE_MAX_CNT), 32) + 1)
+
+static struct tx_cache_entry {
+	uint16_t header;
+	uint8_t type; /* TCPC_TX_SOP* */
+	uint8_t cnt;
+	uint16_t bit_len; /* 0 if the entry is unused */
+	uint32_t data[TX_CACHE_MAX_CNT];
+	uint32_t raw[TX_CACHE_WORDS];
+} tx_cache[TX_CACHE_SIZE];
+static int tx_cache_next;
+
+static const uint32_t *tx_cache_lookup_sop(int type, uint16_t header,
+					   uint8_t cnt, const uint32_t *data,
+					   int *bit_len)
+{
+	struct tx_cache_entry *e;
+	int i;
 
+	if (cnt > TX_CACHE_MAX_CNT)
+		goto encode_only;
+
+	for (i = 0, e = tx_cache; i < TX_CACHE_SIZE; i++, e++)
+		if (e->bit_len && e->header == header && e->type == type &&
+		    e->cnt == cnt &&
+		    !memcmp(e->data, data, cnt * sizeof(uint32_t))) {
+			*bit_len = e->bit_len;
+			return e->raw;
+		}
+
+	/* Miss : encode the message and keep a copy of its bit image */
+	e = tx_cache + tx_cache_next;
+	tx_cache_next = (tx_cache_next + 1) % TX_CACHE_SIZE;
+	*bit_len = prepare_message_sop(0, type, header, cnt, data);
+	e->header = header;
+	e->type = type;
+	e->cnt = cnt;
+	e->bit_len = *bit_len;
+	memcpy(e->data, data, cnt * sizeof(uint32_t));
+	memcpy(e->raw, pd_get_raw_samples(0), sizeof(e->raw));
+	return e->raw;
+
+encode_only:
+	*bit_len = prepare_message_sop(0, type, header, cnt, data);
+	return pd_get_raw_samples(0);
+}
+#else
+static const uint32_t *tx_cache_lookup_sop(int type, uint16_t header,
+					   uint8_t cnt, const uint32_t *data,
+					   int *bit_len)
+{
+	*bit_len = prepare_message_sop(0, type, header, cnt, data);
+	return pd_get_raw_samples(0);
+}
+#endif
+
+static const uint32_t *tx_cache_lookup(uint16_t header, uint8_t cnt,
+				       const uint32_t *data, int *bit_len)
+{
+	return tx_cache_lookup_sop(TCPC_TX_SOP, header, cnt, data, bit_len);
+}
+
+static int send_message_sop(int polarity, int type, uint16_t header,
+			    uint8_t cnt, const uint32_t *data)
+{
+	int bit_len, tx_len;
+	const uint32_t *raw;
+	uint32_t start;
 	/* Don't get preempted by the tracing */
 	int flag = disable_tracing_save();
 
-	bit_len = prepare_message(0, header, cnt, data);
+	raw = tx_cache_lookup_sop(type, header, cnt, data, &bit_len);
+	tx_len = bit_len;
+	raw = impair_image(raw, &tx_len, header);
 	/* Transmit the packet */
-	pd_start_tx(0, polarity, bit_len);
+	impair_clock(1);
+	start = ts_raw();
+	pd_start_tx_buf(0, polarity, raw, tx_len);
 	pd_tx_done(0, polarity);
+	impair_clock(0);
 
 	enable_tracing_ifneeded(flag);
+	trace_tx(polarity, start, type, header, cnt, data, bit_len);
 
 	return bit_len;
 }
 
+static int send_message(int polarity, uint16_t header,
+			uint8_t cnt, const uint32_t *data)
+{
+	return send_message_sop(polarity, TCPC_TX_SOP, header, cnt, data);
+}
+
 static int send_hrst(int polarity)
 {
 	int off;
+	uint32_t start;
 	int flag = disable_tracing_save();
 	/* 64-bit preamble */
 	off = pd_write_preamble(0);
@@ -135,13 +344,189 @@ static int send_hrst(int polarity)
 	/* Ensure that we have a final edge */
 	off = pd_write_last_edge(0, off);
 	/* Transmit the packet */
+	start = ts_raw();
 	pd_start_tx(0, polarity, off);
 	pd_tx_done(0, polarity);
 	enable_tracing_ifneeded(flag);
+	trace_tx(polarity, start, TCPC_TX_HARD_RESET, 0, 0, NULL, off);
 
 	return off;
 }
 
+#ifdef HAS_TASK_SNIFFER
+/* tTransmit : from the EOP of a message to the start of its GoodCRC */
+#define GOODCRC_MAX_US 195
+
+/* Automatic GoodCRC of the messages received by the tracer */
+static struct {
+	uint8_t on;
+	uint32_t count;
+	uint32_t late; /* sent later than tTransmit */
+	uint32_t last, max; /* us from the EOP to the GoodCRC start */
+} goodcrc;
+
+void injector_goodcrc(struct rx_header rx, int line)
+{
+	uint16_t head = rx.head;
+	uint16_t header;
+	uint32_t delay;
+
+	if (!goodcrc.on || rx.packet_type != TCPC_TX_SOP ||
+	    (PD_HEADER_TYPE(head) == PD_CTRL_GOOD_CRC && !PD_HEADER_CNT(head)))
+		return;
+
+	/* answer as the partner : opposite roles, same revision */
+	header = PD_HEADER(PD_CTRL_GOOD_CRC, !(head & (1 << 8)),
+			   !(head & (1 << 5)), PD_HEADER_ID(head), 0);
+	header = (header & ~(3 << 6)) | (head & (3 << 6));
+	delay = ts_raw() - trace_last_eop();
+	send_message(line - 1, header, 0, NULL);
+
+	goodcrc.count++;
+	goodcrc.last = delay;
+	if (delay > goodcrc.max)
+		goodcrc.max = delay;
+	if (delay > GOODCRC_MAX_US)
+		goodcrc.late++;
+}
+
+/*
+ * Cable e-marker emulation : the SOP' messages received by the tracer get
+ * their GoodCRC from the cable plug, and the structured VDM requests the
+ * response loaded for their command, right from the RX completion.
+ */
+#define EMARKER_RESPS 4
+#define EMARKER_VDOS 5
+
+static struct {
+	uint8_t on;
+	uint8_t msg_id;  /* MessageID of the next response */
+	int8_t last_id;  /* MessageID of the last request, -1 after a reset */
+	uint32_t requests, responses, late;
+	uint32_t last, max; /* us from the EOP to the GoodCRC start */
+	struct {
+		uint8_t cmd;  /* VDM command, 0 for an unused entry */
+		uint8_t cmdt; /* CMDT_RSP_x */
+		uint8_t cnt;  /* VDOs after the VDM header */
+		uint32_t vdo[EMARKER_VDOS];
+	} resp[EMARKER_RESPS];
+} emarker;
+
+static void emarker_reset(void)
+{
+	emarker.msg_id = 0;
+	emarker.last_id = -1;
+}
+
+/* Load the response to the VDM command 'cmd', in its entry or a free one */
+static int emarker_load(int cmd, int cmdt, int cnt, const uint32_t *vdo)
+{
+	int i, free = -1;
+
+	if (cmd <= 0 || cmd > 0x1f || cmdt == CMDT_INIT || cnt > EMARKER_VDOS)
+		return EC_ERROR_INVAL;
+	for (i = EMARKER_RESPS - 1; i >= 0; i--) {
+		if (emarker.resp[i].cmd == cmd)
+			break;
+		if (!emarker.resp[i].cmd)
+			free = i;
+	}
+	if (i < 0)
+		i = free;
+	if (i < 0)
+		return EC_ERROR_OVERFLOW;
+	emarker.resp[i].cmd = cmd;
+	emarker.resp[i].cmdt = cmdt;
+	emarker.resp[i].cnt = cnt;
+	memcpy(emarker.resp[i].vdo, vdo, cnt * sizeof(uint32_t));
+	return EC_SUCCESS;
+}
+
+/* Discover Identity ACK of a passive Type-C cable carrying 'cur' */
+static void emarker_preset(int cur)
+{
+	const uint32_t ident[] = {
+		VDO_IDH(0, 0, IDH_PTYPE_PCABLE, 0, USB_VID_GOOGLE),
+		VDO_CSTAT(0),
+		VDO_PRODUCT(CONFIG_USB_PID, 0),
+		VDO_CABLE(1, 0, CABLE_CTYPE, CABLE_PLUG, 1, 0, 0, 0, 0, 0,
+			  cur, 1, 0, CABLE_USBSS_U31_GEN2),
+	};
+
+	emarker_load(CMD_DISCOVER_IDENT, CMDT_RSP_ACK, ARRAY_SIZE(ident),
+		     ident);
+}
+
+static void emarker_send(int pol, uint16_t head, int type, int cnt,
+			 const uint32_t *data)
+{
+	/* the cable plug : power role bit set, no data role */
+	uint16_t header = PD_HEADER(type, 1, 0, emarker.msg_id, cnt);
+
+	header = (header & ~(3 << 6)) | (head & (3 << 6));
+	send_message_sop(pol, TCPC_TX_SOP_PRIME, header, cnt, data);
+	emarker.msg_id = (emarker.msg_id + 1) & 7;
+}
+
+void injector_emarker(struct rx_header rx, const uint32_t *payload, int line)
+{
+	uint16_t head = rx.head;
+	int type = PD_HEADER_TYPE(head);
+	int cnt = PD_HEADER_CNT(head);
+	uint32_t data[1 + EMARKER_VDOS];
+	uint16_t header;
+	uint32_t delay;
+	int i;
+
+	if (!emarker.on || rx.packet_type != TCPC_TX_SOP_PRIME ||
+	    (type == PD_CTRL_GOOD_CRC && !cnt))
+		return;
+
+	header = PD_HEADER(PD_CTRL_GOOD_CRC, 1, 0, PD_HEADER_ID(head), 0);
+	header = (header & ~(3 << 6)) | (head & (3 << 6));
+	delay = ts_raw() - trace_last_eop();
+	send_message_sop(line - 1, TCPC_TX_SOP_PRIME, header, 0, NULL);
+	emarker.last = delay;
+	if (delay > emarker.max)
+		emarker.max = delay;
+	if (delay > GOODCRC_MAX_US)
+		emarker.late++;
+
+	if (!cnt && type == PD_CTRL_SOFT_RESET) {
+		emarker_reset();
+		emarker_send(line - 1, head, PD_CTRL_ACCEPT, 0, NULL);
+		return;
+	}
+	/* a retry of the last request only gets its GoodCRC again */
+	if (PD_HEADER_ID(head) == emarker.last_id)
+		return;
+	emarker.last_id = PD_HEADER_ID(head);
+	if (!cnt || type != PD_DATA_VENDOR_DEF || !PD_VDO_SVDM(payload[0]) ||
+	    PD_VDO_CMDT(payload[0]) != CMDT_INIT)
+		return;
+
+	emarker.requests++;
+	/* NAK for the commands with no response loaded */
+	data[0] = (payload[0] & ~VDO_CMDT_MASK) | VDO_CMDT(CMDT_RSP_NAK);
+	cnt = 0;
+	for (i = 0; i < EMARKER_RESPS; i++)
+		if (emarker.resp[i].cmd == PD_VDO_CMD(payload[0])) {
+			data[0] = (payload[0] & ~VDO_CMDT_MASK) |
+				  VDO_CMDT(emarker.resp[i].cmdt);
+			cnt = emarker.resp[i].cnt;
+			memcpy(data + 1, emarker.resp[i].vdo,
+			       cnt * sizeof(uint32_t));
+		}
+	emarker_send(line - 1, head, PD_DATA_VENDOR_DEF, 1 + cnt, data);
+	emarker.responses++;
+}
+
+uint8_t injector_emarker_sops(void)
+{
+	return emarker.on ? 1 << TCPC_TX_SOP_PRIME : 0;
+}
+#endif
+
 static void set_resistor(int pol, enum inj_res res)
 {
 	/* reset everything on one CC to high impedance */
@@ -155,6 +540,138 @@ static void set_resistor(int pol, enum inj_res res)
 	if (res != INJ_RES_NONE)
 		gpio_set_flags(res_cfg[res].cfgs[pol].signal,
 			       res_cfg[res].cfgs[pol].flags);
+	inj_resistor[pol] = res;
+}
+
+/*
+ * Timed resistor schedule (INJ_SET_RES_SCHED) : each step is applied by the
+ * interrupt of a one-shot microsecond timer, so the CC lines change within a
+ * few microseconds of their offset whatever the tasks are doing. The start
+ * and the time each step was applied are read on the hardware timer, the
+ * timebase of the capture timestamps.
+ */
+static struct {
+	int count;          /* steps of the schedule */
+	volatile int done;  /* steps applied */
+	uint32_t start;     /* hardware timer at the start */
+	uint32_t steps[INJ_RES_SCHED_MAX];
+	uint32_t applied[INJ_RES_SCHED_MAX]; /* hardware timer at each step */
+} res_sched;
+
+static void res_sched_run(void)
+{
+	while (res_sched.done < res_sched.count) {
+		uint32_t step = res_sched.steps[res_sched.done];
+		int32_t left = INJ_RES_SCHED_US(step) -
+			       (ts_raw() - res_sched.start);
+		int pol;
+
+		if (left > 0) {
+			/*
+			 * update event after 'left' ticks (the counter does not
+			 * run with a null reload), the longer waits go through
+			 * several of them
+			 */
+			STM32_TIM_ARR(TIM_RES_SCHED) =
+				MAX(MIN(left, 0x10000) - 1, 1);
+			STM32_TIM_CNT(TIM_RES_SCHED) = 0;
+			/* one-pulse mode, update event on overflow only */
+			STM32_TIM_CR1(TIM_RES_SCHED) = 0x000D;
+			return;
+		}
+		for (pol = 0; pol < 2; pol++)
+			if (INJ_RES_SCHED_CC(step, pol) != INJ_RES_KEEP)
+				set_resistor(pol, INJ_RES_SCHED_CC(step, pol));
+		res_sched.applied[res_sched.done++] = ts_raw();
+	}
+}
+
+void res_sched_interrupt(void)
+{
+	STM32_TIM_SR(TIM_RES_SCHED) = 0;
+	res_sched_run();
+}
+DECLARE_IRQ(STM32_IRQ_TIM14, res_sched_interrupt, 1);
+
+static void res_sched_stop(void)
+{
+	STM32_TIM_CR1(TIM_RES_SCHED) = 0;
+	task_disable_irq(STM32_IRQ_TIM14);
+	STM32_TIM_SR(TIM_RES_SCHED) = 0;
+	task_clear_pending_irq(STM32_IRQ_TIM14);
+	res_sched.count = res_sched.done;
+}
+
+static int res_sched_start(const uint32_t *steps, int count)
+{
+	int i;
+
+	if (count < 1 || count > INJ_RES_SCHED_MAX)
+		return EC_ERROR_INVAL;
+	for (i = 0; i < count; i++)
+		if ((INJ_RES_SCHED_CC(steps[i], 0) > INJ_RES_RP3A0 &&
+		     INJ_RES_SCHED_CC(steps[i], 0) != INJ_RES_KEEP) ||
+		    (INJ_RES_SCHED_CC(steps[i], 1) > INJ_RES_RP3A0 &&
+		     INJ_RES_SCHED_CC(steps[i], 1) != INJ_RES_KEEP))
+			return EC_ERROR_INVAL;
+
+	res_sched_stop();
+	/* 1us ticks */
+	__hw_timer_enable_clock(TIM_RES_SCHED, 1);
+	STM32_TIM_PSC(TIM_RES_SCHED) = clock_get_freq() / 1000000 - 1;
+	STM32_TIM_CR1(TIM_RES_SCHED) = 0x0004;
+	/* reload the pre-scaler, then clear the update event */
+	STM32_TIM_EGR(TIM_RES_SCHED) = 0x0001;
+	STM32_TIM_SR(TIM_RES_SCHED) = 0;
+	STM32_TIM_DIER(TIM_RES_SCHED) = 0x0001;
+
+	memcpy(res_sched.steps, steps, count * sizeof(uint32_t));
+	res_sched.count = count;
+	res_sched.done = 0;
+	res_sched.start = ts_raw();
+	/* the steps at offset 0 are applied right away */
+	interrupt_disable();
+	res_sched_run();
+	interrupt_enable();
+	task_enable_irq(STM32_IRQ_TIM14);
+	return EC_SUCCESS;
+}
+
+static int set_cc_avg(int count, int smpr)
+{
+	if (count < 1 || count > INJ_CC_AVG_MAX ||
+	    smpr < STM32_ADC_SMPR_1_5_CY || smpr > STM32_ADC_SMPR_239_5_CY)
+		return EC_ERROR_INVAL;
+	cc_avg = count;
+	cc_smpr = smpr;
+	return EC_SUCCESS;
+}
+
+/* CC1/CC2 voltages in mV, averaged over a DMA burst if requested */
+static void read_cc(int *cc1_volt, int *cc2_volt)
+{
+	const struct adc_t *adc1 = adc_channels + ADC_CH_CC1_PD;
+	const struct adc_t *adc2 = adc_channels + ADC_CH_CC2_PD;
+	uint32_t sum[2];
+	uint32_t div;
+	int first;
+
+	if (cc_avg == 1 ||
+	    adc_read_burst_sum((1 << adc1->channel) | (1 << adc2->channel),
+			       cc_smpr, cc_avg, sum)) {
+		*cc1_volt = pd_adc_read(0, 0);
+		*cc2_volt = pd_adc_read(0, 1);
+		return;
+	}
+
+	/* the sums come in increasing AIN ID order, rounded to the mV */
+	first = adc1->channel > adc2->channel;
+	div = adc1->factor_div * cc_avg;
+	*cc1_volt = ((uint64_t)sum[first] * adc1->factor_mul + div / 2) / div +
+		    adc1->shift;
+	div = adc2->factor_div * cc_avg;
+	*cc2_volt = ((uint64_t)sum[!first] * adc2->factor_mul + div / 2) /
+		    div + adc2->shift;
 }
 
 static enum inj_pol guess_polarity(enum inj_pol pol)
@@ -164,24 +681,466 @@ static enum inj_pol guess_polarity(enum inj_pol pol)
 	if (pol == INJ_POL_CC1 || pol == INJ_POL_CC2)
 		return pol;
 	/* Auto-detection */
-	cc1_volt = pd_adc_read(0, 0);
-	cc2_volt = pd_adc_read(0, 1);
+	read_cc(&cc1_volt, &cc2_volt);
 	return GET_POLARITY(cc1_volt, cc2_volt);
 }
 
+/*
+ * Collision avoidance (INJ_SET_TX_GUARD) : the messages of the scripts, of
+ * 'tw send' and of the periodic jobs wait for the CC line to be idle, and
+ * for the source to allow a sink to start an AMS (PD 3.0 collision
+ * avoidance, Rp at SinkTxOk), so they do not land on a frame of the
+ * partner. The Hard Resets, timed sends and the GoodCRC or e-marker answers
+ * are not deferred.
+ */
+/* no edge for tTransitionWindow : the line is idle */
+#define TX_GUARD_IDLE_US 20
+#define TX_GUARD_LIMIT_US (10 * MSEC)
+/* SinkTxOk (Rp 3.0A) above vRd-1.5 max, SinkTxNG (Rp 1.5A) below */
+#define TX_GUARD_SINKTX_MV 1230
+/* Rp only changes tSinkTx (16 ms) before the source transmits */
+#define TX_GUARD_SINKTX_POLL_US 500
+
+static struct {
+	uint8_t mode;      /* INJ_TX_GUARD_x */
+	uint32_t limit_us; /* longest deferral, then the message is sent */
+	uint32_t deferred; /* messages which waited */
+	uint32_t forced;   /* messages sent at the limit */
+	uint32_t max_us;   /* longest deferral */
+} tx_guard = {
+	.limit_us = TX_GUARD_LIMIT_US,
+};
+
+static void tx_guard_set(int mode, uint32_t limit_us)
+{
+	tx_guard.mode = mode & (INJ_TX_GUARD_IDLE | INJ_TX_GUARD_SINKTX);
+	tx_guard.limit_us = limit_us ? limit_us : TX_GUARD_LIMIT_US;
+	tx_guard.deferred = tx_guard.forced = tx_guard.max_us = 0;
+}
+
+/* Wait until a message can be sent on the CC line 'pol' */
+static void tx_guard_wait(int pol)
+{
+	uint32_t start = ts_raw();
+	uint32_t waited;
+	int cc[2];
+	int forced = 0;
+
+	if (!tx_guard.mode)
+		return;
+	if (tx_guard.mode & INJ_TX_GUARD_SINKTX) {
+		read_cc(&cc[0], &cc[1]);
+		while (cc[pol] < TX_GUARD_SINKTX_MV) {
+			if (ts_raw() - start >= tx_guard.limit_us) {
+				forced = 1;
+				break;
+			}
+			usleep(TX_GUARD_SINKTX_POLL_US);
+			read_cc(&cc[0], &cc[1]);
+		}
+	}
+	waited = ts_raw() - start;
+	if ((tx_guard.mode & INJ_TX_GUARD_IDLE) && !forced) {
+#ifdef HAS_TASK_SNIFFER
+		forced = wait_bus_idle(pol, TX_GUARD_IDLE_US,
+				       tx_guard.limit_us - waited) < 0;
+#else
+		/* the PD receiver samples a frame its comparator caught */
+		while (pd_rx_started(0) && !forced)
+			forced = ts_raw() - start >= tx_guard.limit_us;
+#endif
+		waited = ts_raw() - start;
+	}
+	/* the idle window itself is not a deferral */
+	if (waited > TX_GUARD_IDLE_US) {
+		tx_guard.deferred++;
+		tx_guard.max_us = MAX(tx_guard.max_us, waited);
+	}
+	tx_guard.forced += forced;
+}
+
+/* Return 1 if a message can be sent on the CC line 'pol' right now */
+static int tx_guard_clear(int pol)
+{
+	int cc[2];
+
+	if (tx_guard.mode & INJ_TX_GUARD_SINKTX) {
+		read_cc(&cc[0], &cc[1]);
+		if (cc[pol] < TX_GUARD_SINKTX_MV)
+			return 0;
+	}
+	if (tx_guard.mode & INJ_TX_GUARD_IDLE)
+#ifdef HAS_TASK_SNIFFER
+		return wait_bus_idle(pol, TX_GUARD_IDLE_US,
+				     TX_GUARD_IDLE_US) >= 0;
+#else
+		return !pd_rx_started(0);
+#endif
+	return 1;
+}
+
+/*
+ * tx_guard_wait() for the hook task, which must not sleep : return 1 if the
+ * message deferred for 'waited' us can be sent on the CC line 'pol' now, 0 if
+ * the caller tries again later.
+ */
+static int tx_guard_poll(int pol, uint32_t waited)
+{
+	int clear = tx_guard_clear(pol);
+
+	if (!clear && waited < tx_guard.limit_us)
+		return 0;
+	if (waited > TX_GUARD_IDLE_US) {
+		tx_guard.deferred++;
+		tx_guard.max_us = MAX(tx_guard.max_us, waited);
+	}
+	tx_guard.forced += !clear;
+	return 1;
+}
+
+/* ------ Periodic messages ------ */
+
+/*
+ * Periodic messages (INJ_SET_PERIODIC, 'tw periodic') : each job sends its
+ * message every period in the background, while the scripts and the
+ * captures run. The send times are deadlines on the hardware timer counted
+ * from the start of the job, so a late message does not delay the next
+ * ones; the deferred call of the hook task serving them wakes up on the
+ * earliest one. The messages go through the collision avoidance checks
+ * and are traced as the other ones sent. The hook task does not wait for
+ * the line : a message it defers is tried again every PERIODIC_BUSY_US.
+ *
+ * A message is sent with the interrupts disabled, as spin_until() and
+ * send_raw_at() do for the timed sends : the tasks above the hook one
+ * cannot start their own in the middle. One due while a waveform or a replay
+ * is being played waits for PERIODIC_BUSY_US as well.
+ */
+#define PERIODIC_BUSY_US 100
+
+static struct periodic_job {
+	uint8_t on;
+	uint32_t period;   /* us */
+	uint32_t count;    /* messages to send, 0 until stopped */
+	uint32_t sent;
+	uint32_t skipped;  /* periods without message, after a late one */
+	uint32_t max_late; /* us past the deadline */
+	uint64_t next;     /* deadline of the next message */
+	uint64_t guarded;  /* since the collision avoidance defers it, or 0 */
+	uint16_t header;
+	uint8_t pol;
+	uint8_t flags;     /* INJ_PERIODIC_x */
+	uint8_t id;        /* MessageID of the next message */
+	uint8_t cnt;
+	uint32_t data[7];
+} periodic[INJ_PERIODIC_MAX];
+
+static void periodic_run(void);
+DECLARE_DEFERRED(periodic_run);
+
+/*
+ * Send the message of the job, returns 0 if the TX is busy or the collision
+ * avoidance defers it
+ */
+static int periodic_send(struct periodic_job *j, uint64_t *start)
+{
+	uint16_t header = j->header;
+	int busy;
+
+	if (j->flags & INJ_PERIODIC_ID)
+		header = (header & ~(7 << 9)) | (j->id << 9);
+	*start = get_time().val;
+	if (tx_guard.mode) {
+		if (!j->guarded)
+			j->guarded = *start;
+		if (!tx_guard_poll(j->pol, *start - j->guarded))
+			return 0;
+		j->guarded = 0;
+		*start = get_time().val;
+	}
+	interrupt_disable();
+	/* the TX timer is stopped at the end of each transmission */
+	busy = STM32_TIM_CR1(TIM_CLOCK_PD_TX(0)) & 1;
+	if (!busy)
+		send_message(j->pol, header, j->cnt, j->data);
+	interrupt_enable();
+	if (busy)
+		return 0;
+	j->id = (j->id + 1) & 7;
+	return 1;
+}
+
+static void periodic_run(void)
+{
+	struct periodic_job *j;
+	uint64_t now, start, wake = 0, next;
+
+	for (j = periodic; j < periodic + INJ_PERIODIC_MAX; j++) {
+		if (!j->on)
+			continue;
+		next = j->next;
+		now = get_time().val;
+		if (now >= j->next) {
+			if (periodic_send(j, &start)) {
+				j->sent++;
+				j->max_late = MAX(j->max_late,
+						  (uint32_t)(start - j->next));
+				if (j->count && j->sent >= j->count) {
+					j->on = 0;
+					continue;
+				}
+				/* keep the rate : the periods gone are lost */
+				now = get_time().val;
+				for (j->next += j->period; j->next <= now;
+				     j->next += j->period)
+					j->skipped++;
+				next = j->next;
+			} else {
+				next = now + PERIODIC_BUSY_US;
+			}
+		}
+		if (!wake || next < wake)
+			wake = next;
+	}
+	if (!wake)
+		return;
+	now = get_time().val;
+	hook_call_deferred(&periodic_run_data, wake > now ? wake - now : 0);
+}
+
+/*
+ * Start the job 'job' sending 'cnt' objects after the header every
+ * 'period_us', 'count' times (0 : until stopped), a null period stops it.
+ */
+static int periodic_set(int job, int pol, uint32_t period_us, uint32_t count,
+			int flags, uint16_t header, int cnt,
+			const uint32_t *data)
+{
+	struct periodic_job *j = periodic + job;
+
+	if (job < 0 || job >= INJ_PERIODIC_MAX || cnt > 7)
+		return EC_ERROR_INVAL;
+	/* stopped : its counters stay for the console */
+	if (!period_us) {
+		j->on = 0;
+		return EC_SUCCESS;
+	}
+	interrupt_disable();
+	memset(j, 0, sizeof(*j));
+	j->pol = pol;
+	j->flags = flags;
+	j->header = header;
+	j->cnt = cnt;
+	memcpy(j->data, data, cnt * sizeof(uint32_t));
+	j->period = period_us;
+	j->count = count;
+	j->next = get_time().val;
+	j->on = 1;
+	interrupt_enable();
+	/* the first message goes right away */
+	hook_call_deferred(&periodic_run_data, 0);
+	return EC_SUCCESS;
+}
+
 /* ------ FSM commands ------ */
 
-static void fsm_send(uint32_t w)
+/* Header bits of the roles and spec revision */
+#define HEADER_ROLES_MASK ((1 << 8) | (3 << 6) | (1 << 5))
+
+/* Header fields filled by the device (INJ_SET_HEADER) */
+static struct {
+	uint8_t fields; /* INJ_HEADER_x */
+	uint8_t id;     /* MessageID of the next message */
+	uint16_t roles; /* header with the roles and revision */
+} inj_header;
+
+static uint16_t header_fill(uint16_t header)
+{
+	if (inj_header.fields & INJ_HEADER_ID)
+		header = (header & ~(7 << 9)) | (inj_header.id << 9);
+	if (inj_header.fields & INJ_HEADER_ROLES)
+		header = (header & ~HEADER_ROLES_MASK) |
+			 (inj_header.roles & HEADER_ROLES_MASK);
+	return header;
+}
+
+/* The message has been sent (or given up) : next MessageID */
+static void header_sent(void)
+{
+	inj_header.id = (inj_header.id + 1) & 7;
+}
+
+/*
+ * Back-to-back burst (INJ_SET_BURST) : the messages are queued, then their
+ * images are copied one after the other, with the gap as idle bits in
+ * between, into the spare part of the packet buffer and sent by a single
+ * DMA transfer. The line is driven low during the gaps instead of being
+ * released. The images are only built once the RX is stopped, since it
+ * shares the packet buffer.
+ */
+/* Room left for the longest message image at the start of the buffer */
+#define BURST_IMAGE_BITS (2*64 + 4*10 + 4*10 + 7*80 + 80 + 10 + 3)
+
+static struct {
+	int left;      /* messages still to queue */
+	int gap;       /* raw bits between 2 frames */
+	int n;         /* messages queued */
+	struct {
+		uint16_t header;
+		uint8_t cnt;
+		const uint32_t *data;
+		int off; /* bits from the burst start */
+		int bit_len;
+	} frames[INJ_BURST_MAX];
+} burst;
+
+static void burst_arm(int n, uint32_t gap_us)
+{
+	memset(&burst, 0, sizeof(burst));
+	burst.left = MIN(n, INJ_BURST_MAX);
+	/* 2 raw bits per period of the TX clock */
+	burst.gap = gap_us * (pd_get_clock(0) / 1000) / 500;
+}
+
+static void burst_send(void)
+{
+	int spare;
+	uint32_t *buf = pd_get_tx_spare(0, BURST_IMAGE_BITS, &spare);
+	int flag;
+	/* us per 100 raw bits */
+	int rate = 50000000 / pd_get_clock(0);
+	const uint32_t *raw;
+	uint32_t start;
+	int len = 0, off = 0;
+	int i, b, n;
+
+	/* before the image is built : in the PD sink, RX shares its buffer */
+	tx_guard_wait(inj_polarity);
+	flag = disable_tracing_save();
+	memset(buf, 0, spare / 8);
+	for (n = 0; n < burst.n; n++) {
+		raw = tx_cache_lookup(burst.frames[n].header,
+				      burst.frames[n].cnt, burst.frames[n].data,
+				      &burst.frames[n].bit_len);
+		if (off + burst.frames[n].bit_len + 32 > spare)
+			break;
+		for (i = 0, b = off; i < burst.frames[n].bit_len; i++, b++)
+			if (raw[i / 32] & (1 << (i % 32)))
+				buf[b / 32] |= 1 << (b % 32);
+		burst.frames[n].off = off;
+		len = off + burst.frames[n].bit_len;
+		off = len + burst.gap;
+	}
+
+	start = ts_raw();
+	pd_start_tx_buf(0, inj_polarity, buf, len);
+	pd_tx_done(0, inj_polarity);
+	enable_tracing_ifneeded(flag);
+
+	/* the frames which did not fit were not sent */
+	for (i = 0; i < n; i++)
+		trace_tx(inj_polarity, start + burst.frames[i].off * rate / 100,
+			 TCPC_TX_SOP, burst.frames[i].header,
+			 burst.frames[i].cnt, burst.frames[i].data,
+			 burst.frames[i].bit_len);
+	burst.n = 0;
+}
+
+/* Queue a message, the last one sends the burst */
+static void burst_add(uint16_t header, uint8_t cnt, const uint32_t *data)
+{
+	burst.frames[burst.n].header = header;
+	burst.frames[burst.n].cnt = cnt;
+	burst.frames[burst.n].data = data;
+	burst.n++;
+	if (!--burst.left)
+		burst_send();
+}
+
+static int fsm_send(uint32_t w)
+{
+	uint16_t header = header_fill(INJ_ARG0(w));
+	int idx = INJ_ARG1(w);
+	uint8_t cnt = INJ_ARG2(w);
+	int bit_len;
+
+	/* Buffer overflow */
+	if (idx > inj_cmd_count)
+		return 0;
+
+	if (burst.left) {
+		burst_add(header, cnt, inj_cmds + idx);
+		bit_len = 0;
+	} else {
+		tx_guard_wait(inj_polarity);
+		bit_len = send_message(inj_polarity, header, cnt,
+				       inj_cmds + idx);
+	}
+	header_sent();
+	return bit_len;
+}
+
+/*
+ * Wait for the GoodCRC of the message 'header' sent when the tracer had
+ * received 'rx_count' packets, the text tracer must be running.
+ */
+static int wait_goodcrc(int pol, uint16_t header, uint32_t rx_count)
+{
+	uint32_t start = ts_raw();
+	uint32_t elapsed;
+	uint32_t payload[7];
+	struct rx_header rx;
+
+	while ((elapsed = ts_raw() - start) <
+	       GOODCRC_RECEIVE_US) {
+		/* it might have been decoded before we get there */
+		if (trace_rx_count() == rx_count &&
+		    !expect_packet(pol, PD_CTRL_GOOD_CRC,
+				   GOODCRC_RECEIVE_US - elapsed))
+			return 0;
+		if (trace_rx_count() == rx_count)
+			continue;
+		rx_count = trace_rx_count();
+		rx = trace_last_packet(payload);
+		if (rx.packet_type == TCPC_TX_SOP && !PD_HEADER_CNT(rx.head) &&
+		    PD_HEADER_TYPE(rx.head) == PD_CTRL_GOOD_CRC &&
+		    PD_HEADER_ID(rx.head) == PD_HEADER_ID(header))
+			return 1;
+	}
+	return 0;
+}
+
+/* Send a message until its GoodCRC comes, returns the transmissions */
+static int send_retry(int pol, uint16_t header, uint8_t cnt,
+		      const uint32_t *data)
+{
+	/* nRetryCount : 3 in PD 2.0, 2 in PD 3.0 */
+	int retries = ((header >> 6) & 3) >= PD_REV30 ? 2 : 3;
+	uint32_t rx_count;
+	int n;
+
+	for (n = 1; n <= 1 + retries; n++) {
+		tx_guard_wait(pol);
+		rx_count = trace_rx_count();
+		send_message(pol, header, cnt, data);
+		if (wait_goodcrc(pol, header, rx_count))
+			return n;
+	}
+	return 0;
+}
+
+static void fsm_send_retry(uint32_t w)
 {
-	uint16_t header = INJ_ARG0(w);
+	uint16_t header = header_fill(INJ_ARG0(w));
 	int idx = INJ_ARG1(w);
 	uint8_t cnt = INJ_ARG2(w);
 
 	/* Buffer overflow */
-	if (idx > INJ_CMD_COUNT)
+	if (idx > inj_cmd_count)
 		return;
 
-	send_message(inj_polarity, header, cnt, inj_cmds + idx);
+	/* the retries keep the MessageID */
+	inj_send_tries = send_retry(inj_polarity, header, cnt, inj_cmds + idx);
+	header_sent();
 }
 
 static void fsm_wave(uint32_t w)
@@ -194,7 +1153,7 @@ static void fsm_wave(uint32_t w)
 	int flag;
 
 	/* Buffer overflow */
-	if (idx + nbwords > INJ_CMD_COUNT)
+	if (idx + nbwords > inj_cmd_count)
 		return;
 
 	flag = disable_tracing_save();
@@ -209,8 +1168,82 @@ static void fsm_wave(uint32_t w)
 	enable_tracing_ifneeded(flag);
 }
 
-static void fsm_wait(uint32_t w)
-{
+/* Delay from the EOP to the start of the last INJ_CMD_SEND_AT message */
+static uint32_t send_at_delay;
+
+/* Time left before the target when we stop sleeping and start spinning */
+#define SEND_AT_SPIN_US 200
+/* A message sent later than this after its target time is late */
+#define SEND_AT_LATE_US 10
+
+/*
+ * Wait until 'delay_us' after the time 't0' of the hardware timer and return
+ * the actual delay, with the interrupts disabled.
+ */
+static uint32_t spin_until(uint32_t t0, uint32_t delay_us)
+{
+	uint32_t left = delay_us - (ts_raw() - t0);
+
+	if ((int32_t)left > SEND_AT_SPIN_US)
+		usleep(left - SEND_AT_SPIN_US);
+
+	/* spin on the hardware timer until the target to avoid any jitter */
+	interrupt_disable();
+	while ((int32_t)(ts_raw() - t0 - delay_us) < 0)
+		;
+	return ts_raw() - t0;
+}
+
+/*
+ * Transmit the encoded message 'delay_us' after the time 't0' of the hardware
+ * timer and return the actual delay.
+ */
+static uint32_t send_raw_at(int pol, uint32_t t0, uint32_t delay_us,
+			    const uint32_t *raw, int bit_len)
+{
+	uint32_t delay = spin_until(t0, delay_us);
+
+	pd_start_tx_buf(0, pol, raw, bit_len);
+	interrupt_enable();
+
+	pd_tx_done(0, pol);
+	impair_clock(0);
+	return delay;
+}
+
+static void fsm_send_at(uint32_t w)
+{
+	uint32_t delay_us = INJ_ARG0(w);
+	int idx = INJ_ARG1(w);
+	uint8_t cnt = INJ_ARG2(w);
+	const uint32_t *raw;
+	uint16_t header;
+	uint32_t t0;
+	int bit_len, tx_len;
+	int flag;
+
+	/* Buffer overflow */
+	if (idx + 1 + cnt > inj_cmd_count)
+		return;
+
+	flag = disable_tracing_save();
+
+	/* encode the message beforehand */
+	header = header_fill(inj_cmds[idx] & 0xffff);
+	raw = tx_cache_lookup(header, cnt, inj_cmds + idx + 1, &bit_len);
+	tx_len = bit_len;
+	raw = impair_image(raw, &tx_len, header);
+	impair_clock(1);
+	t0 = trace_last_eop();
+	send_at_delay = send_raw_at(inj_polarity, t0, delay_us, raw, tx_len);
+	enable_tracing_ifneeded(flag);
+	header_sent();
+	trace_tx(inj_polarity, t0 + send_at_delay, TCPC_TX_SOP, header, cnt,
+		 inj_cmds + idx + 1, bit_len);
+}
+
+static void fsm_wait(uint32_t w)
+{
 #ifdef HAS_TASK_SNIFFER
 	uint32_t timeout_ms = INJ_ARG0(w);
 	uint32_t min_edges = INJ_ARG12(w);
@@ -224,39 +1257,156 @@ static void fsm_expect(uint32_t w)
 	uint32_t timeout_ms = INJ_ARG0(w);
 	uint8_t cmd = INJ_ARG2(w);
 
-	expect_packet(inj_polarity,  cmd, timeout_ms * 1000);
+	inj_expect_ok = expect_packet(inj_polarity,  cmd, timeout_ms * 1000);
 }
-static void fsm_get(uint32_t w)
+
+static void fsm_load(uint32_t w)
 {
-	int store_idx = INJ_ARG0(w);
-	int param_idx = INJ_ARG1(w);
-	uint32_t *store_ptr = inj_cmds + store_idx;
+	int reg = INJ_ARG2(w) % INJ_REG_COUNT;
+	int arg = INJ_ARG0(w);
+	uint32_t payload[7];
+	struct rx_header rx = trace_last_packet(payload);
+	uint32_t val = 0;
+
+	switch (INJ_ARG1(w)) {
+	case INJ_SRC_IMM:
+		val = arg;
+		break;
+	case INJ_SRC_REG:
+		val = inj_regs[arg % INJ_REG_COUNT];
+		break;
+	case INJ_SRC_BUF:
+		if (arg < inj_cmd_count)
+			val = inj_cmds[arg];
+		break;
+	case INJ_SRC_RX_HEAD:
+		val = rx.head;
+		break;
+	case INJ_SRC_RX_TYPE:
+		val = PD_HEADER_TYPE(rx.head);
+		break;
+	case INJ_SRC_RX_CNT:
+		val = PD_HEADER_CNT(rx.head);
+		break;
+	case INJ_SRC_RX_DATA:
+		if (arg < ARRAY_SIZE(payload))
+			val = payload[arg];
+		break;
+	case INJ_SRC_EXPCT:
+		val = inj_expect_ok;
+		break;
+	case INJ_SRC_TRIES:
+		val = inj_send_tries;
+		break;
+#ifdef HAS_TASK_SNIFFER
+	case INJ_SRC_VIOLS:
+		val = check_violations();
+		break;
+#endif
+	}
+	inj_regs[reg] = val;
+}
 
-	/* Buffer overflow */
-	if (store_idx > INJ_CMD_COUNT)
-		return;
+static int fsm_branch(uint32_t w)
+{
+	uint32_t a = inj_regs[INJ_ARG2(w) % INJ_REG_COUNT];
+	uint32_t b = inj_regs[(INJ_ARG1(w) & 0xF) % INJ_REG_COUNT];
+
+	switch (INJ_ARG1(w) >> 4) {
+	case INJ_COND_EQ:
+		return a == b;
+	case INJ_COND_NE:
+		return a != b;
+	case INJ_COND_LT:
+		return a < b;
+	case INJ_COND_GE:
+		return a >= b;
+	case INJ_COND_ANY:
+		return (a & b) != 0;
+	case INJ_COND_NONE:
+		return (a & b) == 0;
+	default:
+		return 0;
+	}
+}
+static int get_param(int param_idx, uint32_t *val)
+{
+	int mv, ma, cc1, cc2;
 
 	switch (param_idx) {
 	case INJ_GET_CC:
-		*store_ptr = pd_adc_read(0, 0) | (pd_adc_read(0, 1) << 16);
+		read_cc(&cc1, &cc2);
+		*val = (cc1 & 0xffff) | ((cc2 & 0xffff) << 16);
 		break;
 	case INJ_GET_VBUS:
-		*store_ptr = (ina2xx_get_voltage(0) & 0xffff) |
-			 ((ina2xx_get_current(0) & 0xffff) << 16);
+		*val = (ina2xx_get_voltage(0) & 0xffff) |
+		       ((ina2xx_get_current(0) & 0xffff) << 16);
 		break;
 	case INJ_GET_VCONN:
-		*store_ptr = (ina2xx_get_voltage(1) & 0xffff) |
-			 ((ina2xx_get_current(1) & 0xffff) << 16);
+		vconn_monitor_read(&mv, &ma);
+		*val = (mv & 0xffff) | ((ma & 0xffff) << 16);
 		break;
 	case INJ_GET_POLARITY:
-		*store_ptr = inj_polarity;
+		*val = inj_polarity;
 		break;
-	default:
-		/* Do nothing */
+	case INJ_GET_SEND_AT:
+		*val = send_at_delay;
+		break;
+	case INJ_GET_RES_SCHED:
+		*val = res_sched.done | (res_sched.count << 8);
 		break;
+	default:
+		return EC_ERROR_INVAL;
+	}
+	return EC_SUCCESS;
+}
+
+static void fsm_get(uint32_t w)
+{
+	int store_idx = INJ_ARG0(w);
+	int param_idx = INJ_ARG1(w);
+	uint32_t val;
+
+	if (param_idx == INJ_GET_TIMING) {
+		if (store_idx + INJ_TIMING_WORDS <= inj_cmd_count)
+			get_trace_timing(INJ_ARG2(w), inj_cmds + store_idx);
+		return;
+	}
+	if (get_param(param_idx, &val))
+		return;
+
+	if (param_idx == INJ_GET_RES_SCHED && store_idx != INJ_GET_RING &&
+	    store_idx + 2 + res_sched.done <= inj_cmd_count) {
+		inj_cmds[store_idx] = val;
+		inj_cmds[store_idx + 1] = res_sched.start;
+		memcpy(inj_cmds + store_idx + 2, res_sched.applied,
+		       (val & 0xff) * sizeof(uint32_t));
+		return;
+	}
+
+	if (store_idx == INJ_GET_RING) {
+		struct inj_result res = {
+			.ts = ts_raw(),
+			.param = param_idx,
+			.seq = inj_result_seq++,
+			.value = val,
+		};
+		/* a full ring drops the result, the host sees the seq gap */
+		queue_add_unit(&inj_results, &res);
+	} else if (store_idx < inj_cmd_count) {
+		inj_cmds[store_idx] = val;
 	}
 }
 
+/* Image of the INJ_SET_ROLE request, run once the request is answered */
+static enum system_image_copy_t role_image;
+
+static void role_jump(void)
+{
+	system_run_image_copy(role_image);
+}
+DECLARE_DEFERRED(role_jump);
+
 static void fsm_set(uint32_t w)
 {
 	int val = INJ_ARG0(w);
@@ -265,6 +1415,7 @@ static void fsm_set(uint32_t w)
 	switch (idx) {
 	case INJ_SET_RESISTOR1:
 	case INJ_SET_RESISTOR2:
+		res_sched_stop();
 		set_resistor(idx - INJ_SET_RESISTOR1, val);
 		break;
 	case INJ_SET_RECORD:
@@ -285,17 +1436,132 @@ static void fsm_set(uint32_t w)
 	case INJ_SET_TRACE:
 		set_trace_mode(val);
 		break;
+	case INJ_SET_TRACE_RULE:
+		set_trace_rule(INJ_ARG2(w), val);
+		break;
+	case INJ_SET_TRACE_COALESCE:
+		set_trace_coalesce(!!val);
+		break;
+	case INJ_SET_RX_FILTER:
+#ifdef HAS_TASK_SNIFFER
+		sniffer_set_rx_filter(val);
+#endif
+		break;
+	case INJ_SET_CC_AVG:
+		set_cc_avg(val, INJ_ARG2(w));
+		break;
+	case INJ_SET_ROLE:
+		role_image = val ? SYSTEM_IMAGE_RW : SYSTEM_IMAGE_RO;
+		hook_call_deferred(&role_jump_data, 10 * MSEC);
+		break;
+	case INJ_SET_GOODCRC:
+#ifdef HAS_TASK_SNIFFER
+		goodcrc.on = !!val;
+#endif
+		break;
+	case INJ_SET_EMARKER:
+#ifdef HAS_TASK_SNIFFER
+		if (!INJ_ARG2(w) && val == 2)
+			memset(emarker.resp, 0, sizeof(emarker.resp));
+		else if (!INJ_ARG2(w))
+			emarker.on = !!val;
+		else if (val + INJ_ARG2(w) <= inj_cmd_count)
+			emarker_load(PD_VDO_CMD(inj_cmds[val]),
+				     PD_VDO_CMDT(inj_cmds[val]),
+				     INJ_ARG2(w) - 1, inj_cmds + val + 1);
+		emarker_reset();
+#endif
+		break;
+	case INJ_SET_TX_GUARD:
+		tx_guard_set(INJ_ARG2(w), val);
+		break;
+	case INJ_SET_HEADER:
+		inj_header.fields = INJ_ARG2(w);
+		inj_header.roles = val;
+		inj_header.id = 0;
+		break;
+	case INJ_SET_IMPAIR:
+		impair_set(INJ_ARG2(w), val);
+		break;
+	case INJ_SET_BURST:
+		burst_arm(INJ_ARG2(w), val);
+		break;
+	case INJ_SET_RES_SCHED:
+		if (!INJ_ARG2(w))
+			res_sched_stop();
+		else if (val + INJ_ARG2(w) <= inj_cmd_count)
+			res_sched_start(inj_cmds + val, INJ_ARG2(w));
+		break;
+	case INJ_SET_PERIODIC:
+		if (val + 3 <= inj_cmd_count &&
+		    val + 3 + PD_HEADER_CNT(inj_cmds[val + 2]) <= inj_cmd_count)
+			periodic_set(INJ_ARG2(w), inj_polarity, inj_cmds[val],
+				     inj_cmds[val + 1], inj_cmds[val + 2] >> 16,
+				     inj_cmds[val + 2] & 0xffff,
+				     PD_HEADER_CNT(inj_cmds[val + 2]),
+				     inj_cmds + val + 3);
+		break;
 	default:
 		/* Do nothing */
 		break;
 	}
 }
 
+static void fsm_store(uint32_t w)
+{
+	if (INJ_ARG0(w) < inj_cmd_count)
+		inj_cmds[INJ_ARG0(w)] = inj_regs[INJ_ARG2(w) % INJ_REG_COUNT];
+}
+
+int injector_exec(uint32_t w, uint32_t *result)
+{
+	*result = 0;
+	/* the injector task might be using the PHY */
+	if (injector_busy())
+		return EC_ERROR_BUSY;
+
+	switch (INJ_CMD(w)) {
+	case INJ_CMD_NOP:
+		break;
+	case INJ_CMD_SEND:
+		*result = fsm_send(w);
+		break;
+	case INJ_CMD_WAVE:
+		fsm_wave(w);
+		break;
+	case INJ_CMD_HRST:
+		send_hrst(inj_polarity);
+		break;
+	case INJ_CMD_GET:
+		if (INJ_ARG1(w) == INJ_GET_TIMING) {
+			fsm_get(w);
+			break;
+		}
+		return get_param(INJ_ARG1(w), result);
+	case INJ_CMD_SET:
+		fsm_set(w);
+		break;
+	case INJ_CMD_LOAD:
+		fsm_load(w);
+		*result = inj_regs[INJ_ARG2(w) % INJ_REG_COUNT];
+		break;
+	case INJ_CMD_STORE:
+		fsm_store(w);
+		break;
+	default:
+		/* waits and flow control only make sense in a script */
+		return EC_ERROR_INVAL;
+	}
+	return EC_SUCCESS;
+}
+
 static int fsm_run(int index)
 {
-	while (index < INJ_CMD_COUNT) {
+	while (index < inj_cmd_count && fsm_state == FSM_RUNNING) {
 		uint32_t w = inj_cmds[index];
 		int cmd = INJ_CMD(w);
+
+		fsm_pc = index;
 		switch (cmd) {
 		case INJ_CMD_END:
 			return index;
@@ -317,12 +1583,38 @@ static int fsm_run(int index)
 		case INJ_CMD_SET:
 			fsm_set(w);
 			break;
+		case INJ_CMD_SEND_AT:
+			fsm_send_at(w);
+			break;
 		case INJ_CMD_JUMP:
 			index = INJ_ARG0(w);
 			continue; /* do not increment index */
+		case INJ_CMD_LOOP:
+			if (--inj_regs[INJ_ARG2(w) % INJ_REG_COUNT]) {
+				index = INJ_ARG0(w);
+				watchdog_reload();
+				continue;
+			}
+			break;
+		case INJ_CMD_LOAD:
+			fsm_load(w);
+			break;
+		case INJ_CMD_BRANCH:
+			if (fsm_branch(w)) {
+				index = INJ_ARG0(w);
+				watchdog_reload();
+				continue;
+			}
+			break;
 		case INJ_CMD_EXPCT:
 			fsm_expect(w);
 			break;
+		case INJ_CMD_STORE:
+			fsm_store(w);
+			break;
+		case INJ_CMD_SEND_RETRY:
+			fsm_send_retry(w);
+			break;
 		case INJ_CMD_NOP:
 		default:
 			/* Do nothing */
@@ -334,6 +1626,610 @@ static int fsm_run(int index)
 	return index;
 }
 
+/* ------ Fuzzer ------ */
+
+/* state of the simple text tracer */
+extern int trace_mode;
+
+/* Answer timeout : tReceive max + margin */
+#define FUZZ_TIMEOUT_US 1500
+
+static struct {
+	int pol;
+	int index;  /* seed message in the FSM buffer */
+	int count;  /* number of mutants to send */
+	int policy; /* FUZZ_x mutations */
+	uint32_t seed;
+	int gap_ms; /* idle time between 2 mutants */
+	int sent;
+	int anomalies;
+} fuzz;
+
+static uint32_t fuzz_rand(void)
+{
+	/* xorshift32 : the state must never be 0 */
+	fuzz.seed ^= fuzz.seed << 13;
+	fuzz.seed ^= fuzz.seed >> 17;
+	fuzz.seed ^= fuzz.seed << 5;
+	return fuzz.seed;
+}
+
+/* Header fields randomized by FUZZ_HEADER : (shift, width) */
+static const uint8_t fuzz_fields[][2] = {
+	{0, 5},  /* message type (PD3 5-bit) */
+	{5, 1},  /* data role */
+	{6, 2},  /* specification revision */
+	{8, 1},  /* power role */
+	{9, 3},  /* message ID */
+	{12, 3}, /* number of objects */
+	{15, 1}, /* extended */
+};
+
+/*
+ * Send a message and classify the answer of the DUT as FUZZ_x,
+ * the text tracer must be running to catch it.
+ */
+static int send_checked(int pol, uint16_t header, int cnt,
+			const uint32_t *data, uint32_t crc_xor)
+{
+	struct rx_header rx;
+	uint32_t payload[7];
+	uint32_t rx_count = trace_rx_count();
+	int flag = disable_tracing_save();
+	int bit_len = prepare_message_crc(0, header, cnt, data, crc_xor);
+	uint32_t start = ts_raw();
+
+	pd_start_tx_buf(0, pol, pd_get_raw_samples(0), bit_len);
+	pd_tx_done(0, pol);
+	enable_tracing_ifneeded(flag);
+	trace_tx(pol, start, TCPC_TX_SOP, header, cnt, data, bit_len);
+	/*
+	 * The GoodCRC might have been decoded before we get there, the packet
+	 * counter of the tracer tells us for sure.
+	 */
+	if (trace_rx_count() == rx_count)
+		expect_packet(pol, PD_CTRL_GOOD_CRC, FUZZ_TIMEOUT_US);
+
+	if (trace_rx_count() == rx_count)
+		return crc_xor ? FUZZ_OK : FUZZ_NO_GOODCRC;
+
+	rx = trace_last_packet(payload);
+	if (rx.packet_type == TCPC_TX_HARD_RESET)
+		return FUZZ_HARD_RESET;
+	if (PD_HEADER_CNT(rx.head) ||
+	    PD_HEADER_TYPE(rx.head) != PD_CTRL_GOOD_CRC)
+		return FUZZ_UNEXPECTED;
+	return crc_xor ? FUZZ_ACKED_CRC : FUZZ_OK;
+}
+
+static int fuzz_one(uint16_t seed_head, const uint32_t *seed_data)
+{
+	uint32_t data[7];
+	uint16_t header = seed_head;
+	int cnt = PD_HEADER_CNT(seed_head);
+	uint32_t crc_xor = 0;
+	uint32_t rnd;
+	int flag, i;
+	int op;
+
+	memcpy(data, seed_data, cnt * sizeof(uint32_t));
+	for (i = cnt; i < ARRAY_SIZE(data); i++)
+		data[i] = fuzz_rand();
+
+	/* pick one of the enabled mutations */
+	do {
+		op = 1 << (fuzz_rand() % 4);
+	} while (!(op & fuzz.policy));
+	rnd = fuzz_rand();
+	switch (op) {
+	case FUZZ_BIT_FLIP:
+		for (i = rnd % 3; i >= 0; i--) {
+			int bit = fuzz_rand() % (16 + 32 * cnt);
+
+			if (bit < 16)
+				header ^= 1 << bit;
+			else
+				data[(bit - 16) / 32] ^= 1 << ((bit - 16) % 32);
+		}
+		break;
+	case FUZZ_HEADER:
+		i = (rnd >> 16) % ARRAY_SIZE(fuzz_fields);
+		header &= ~(((1 << fuzz_fields[i][1]) - 1) << fuzz_fields[i][0]);
+		header |= (rnd & ((1 << fuzz_fields[i][1]) - 1))
+			  << fuzz_fields[i][0];
+		/* the payload follows the new count */
+		cnt = PD_HEADER_CNT(header);
+		break;
+	case FUZZ_LENGTH:
+		/* any other number of objects than the header one */
+		cnt = (cnt + 1 + rnd % 7) % 8;
+		break;
+	case FUZZ_BAD_CRC:
+		crc_xor = 1 << (rnd % 32);
+		break;
+	}
+
+	flag = send_checked(fuzz.pol, header, cnt, data, crc_xor);
+	if (flag != FUZZ_OK)
+		trace_fuzz_report(flag, header, cnt, data);
+	return flag;
+}
+
+static int fuzz_run(void)
+{
+	uint16_t seed_head = inj_cmds[fuzz.index] & 0xffff;
+	const uint32_t *seed_data = inj_cmds + fuzz.index + 1;
+
+	fuzz.sent = 0;
+	fuzz.anomalies = 0;
+	while (fuzz.sent < fuzz.count && fsm_state == FSM_RUNNING) {
+		if (fuzz_one(seed_head, seed_data) != FUZZ_OK)
+			fuzz.anomalies++;
+		fuzz.sent++;
+		if (fuzz.gap_ms)
+			msleep(fuzz.gap_ms);
+		watchdog_reload();
+	}
+	return fuzz.sent;
+}
+
+/* ------ RX margin scan ------ */
+
+static struct {
+	int pol;
+	int index;   /* probe message in the FSM buffer */
+	int packets; /* number of probes per point */
+	int khz_min, khz_step, khz_n;
+	int mv_min, mv_step, mv_n;
+	int res;     /* matrix location in the FSM buffer */
+} margin;
+
+/*
+ * Send the probe message at each (TX frequency, RX threshold) point of the
+ * grid and store the count of GoodCRC received as a byte matrix, one row per
+ * frequency, after the probe message in the FSM buffer.
+ */
+static int margin_run(void)
+{
+	uint16_t header = inj_cmds[margin.index] & 0xffff;
+	const uint32_t *data = inj_cmds + margin.index + 1;
+	uint8_t *res = (uint8_t *)(inj_cmds + margin.res);
+	uint32_t dac = STM32_DAC_DHR12RD;
+	int freq = pd_get_clock(0);
+	int f, t, i, ok;
+
+	for (f = 0; f < margin.khz_n && fsm_state == FSM_RUNNING; f++) {
+		pd_set_clock(0, (margin.khz_min + f * margin.khz_step) * 1000);
+		for (t = 0; t < margin.mv_n; t++) {
+			STM32_DAC_DHR12RD = (margin.mv_min + t * margin.mv_step)
+					    * 4096 / 3300;
+			for (i = ok = 0; i < margin.packets; i++)
+				if (send_checked(margin.pol, header,
+						 PD_HEADER_CNT(header), data,
+						 0) == FUZZ_OK)
+					ok++;
+			res[f * margin.mv_n + t] = ok;
+			watchdog_reload();
+		}
+	}
+
+	pd_set_clock(0, freq);
+	STM32_DAC_DHR12RD = dac;
+	return f;
+}
+
+/* ------ Replay ------ */
+
+/*
+ * The FSM buffer is used as a ring of INJ_REPLAY_x records, filled from the
+ * USB command endpoint (console task) and played by the injector task.
+ */
+static struct {
+	int pol;
+	volatile int head; /* next word written by the host */
+	volatile int tail; /* next word to play */
+	int sent;
+	int late;     /* records sent after their deadline */
+	int underruns;/* times the ring went empty before the end record */
+} replay;
+
+static int replay_used(void)
+{
+	int used = replay.head - replay.tail;
+
+	return used < 0 ? used + inj_cmd_count : used;
+}
+
+static uint32_t replay_word(int offset)
+{
+	int i = replay.tail + offset;
+
+	return inj_cmds[i >= inj_cmd_count ? i - inj_cmd_count : i];
+}
+
+int injector_replay_space(void)
+{
+	if (!injector_busy() ||
+	    (inj_job != INJ_JOB_REPLAY && inj_job != INJ_JOB_WAVE))
+		return -1;
+	/* keep one word free to tell a full ring from an empty one */
+	return inj_cmd_count - 1 - replay_used();
+}
+
+void injector_replay_write(int offset, const uint8_t *data, int count)
+{
+	int i = replay.head + offset;
+
+	while (i >= inj_cmd_count)
+		i -= inj_cmd_count;
+	for (; count > 0; count--, data += sizeof(uint32_t)) {
+		memcpy(inj_cmds + i, data, sizeof(uint32_t));
+		if (++i == inj_cmd_count)
+			i = 0;
+	}
+}
+
+void injector_replay_commit(int count)
+{
+	int head = replay.head + count;
+
+	replay.head = head >= inj_cmd_count ? head - inj_cmd_count : head;
+	task_wake(TASK_ID_INJECTOR);
+}
+
+static void replay_run(void)
+{
+	uint32_t t = 0;
+	uint32_t data[7];
+	uint32_t delay_us, delay;
+	uint16_t header;
+	const uint32_t *raw;
+	int bit_len, cnt, i;
+	int flag, starved = 0;
+
+	while (fsm_state == FSM_RUNNING) {
+		/* the end record is a single word, whatever follows it */
+		if (replay_used() && replay_word(0) == INJ_REPLAY_END)
+			break;
+		if (replay_used() < 2 || replay_used() <
+		    INJ_REPLAY_WORDS(PD_HEADER_CNT(replay_word(1)))) {
+			/* wait for the host, the ring has been drained */
+			if (replay.sent && !starved)
+				replay.underruns++;
+			starved = 1;
+			task_wait_event(-1);
+			continue;
+		}
+		starved = 0;
+		/* the first delay counts from the arrival of the first record */
+		if (!replay.sent)
+			t = ts_raw();
+		delay_us = replay_word(0);
+		header = replay_word(1) & 0xffff;
+		cnt = PD_HEADER_CNT(header);
+		for (i = 0; i < cnt; i++)
+			data[i] = replay_word(2 + i);
+		/* the space is available to the host again */
+		i = replay.tail + INJ_REPLAY_WORDS(cnt);
+		replay.tail = i >= inj_cmd_count ? i - inj_cmd_count : i;
+
+		flag = disable_tracing_save();
+		raw = tx_cache_lookup(header, cnt, data, &bit_len);
+		/* keep the original spacing even if one message was late */
+		delay = send_raw_at(replay.pol, t, delay_us, raw, bit_len);
+		if (delay > delay_us + SEND_AT_LATE_US)
+			replay.late++;
+		enable_tracing_ifneeded(flag);
+		trace_tx(replay.pol, t + delay, TCPC_TX_SOP, header, cnt, data,
+			 bit_len);
+		t += delay_us;
+		replay.sent++;
+		watchdog_reload();
+	}
+}
+
+/* ------ Waveform streaming ------ */
+
+/*
+ * The replay ring carries a raw bit image (2 bits per BMC bit, the first one
+ * in the LSB of the first word) and the SPI TX DMA reads it in circular mode
+ * as the host fills it. The words read are cleared and given back to the
+ * host, so an underrun plays a low level rather than stale bits.
+ */
+static struct {
+	uint32_t bytes;    /* waveform length */
+	uint32_t played;   /* bytes read by the DMA */
+	int underrun;
+} wave;
+
+/* Period of the DMA position checks : 37 bytes at 600kHz */
+#define WAVE_POLL_US 500
+
+static void wave_run(void)
+{
+	stm32_dma_chan_t *chan = dma_get_channel(DMAC_SPI_TX(0));
+	int size = inj_cmd_count * sizeof(uint32_t);
+	uint32_t freed = 0; /* words given back to the host */
+	int pos, last = 0;
+	int flag;
+
+	/* start with half a ring of bits, or the whole waveform */
+	while (fsm_state == FSM_RUNNING && replay_used() * sizeof(uint32_t) <
+	       MIN(wave.bytes, size / 2))
+		task_wait_event(-1);
+	if (fsm_state != FSM_RUNNING)
+		return;
+
+	flag = disable_tracing_save();
+	pd_tx_set_circular_mode(0);
+	if (pd_start_tx_buf(0, replay.pol, inj_cmds, size * 8) < 0) {
+		pd_tx_clear_circular_mode(0);
+		enable_tracing_ifneeded(flag);
+		return;
+	}
+
+	while (wave.played < wave.bytes && fsm_state == FSM_RUNNING) {
+		usleep(WAVE_POLL_US);
+		pos = dma_bytes_done(chan, size);
+		wave.played += pos >= last ? pos - last : pos + size - last;
+		last = pos;
+		/* give back the words fully read */
+		for (; freed < wave.played / sizeof(uint32_t); freed++) {
+			inj_cmds[replay.tail] = 0;
+			replay.tail = replay.tail + 1 == inj_cmd_count ?
+				      0 : replay.tail + 1;
+		}
+		/* the DMA caught up with the host */
+		if (wave.played < wave.bytes &&
+		    wave.played > (freed + replay_used()) * sizeof(uint32_t)) {
+			wave.underrun = 1;
+			break;
+		}
+		watchdog_reload();
+	}
+
+	pd_tx_clear_circular_mode(0);
+	pd_tx_done(0, replay.pol);
+	enable_tracing_ifneeded(flag);
+}
+
+/* ------ Throughput soak test ------ */
+
+#ifdef HAS_TASK_SNIFFER
+/*
+ * Send a message from the FSM buffer at a steady rate while the sniffer
+ * captures the same CC line, then compare the sniffer counters before and
+ * after the run.
+ */
+static struct {
+	int pol;
+	int index;     /* message in the FSM buffer */
+	int rate;      /* messages per second */
+	int count;     /* messages to send */
+	int sent;
+	int late;      /* messages sent later than SEND_AT_LATE_US */
+	uint32_t us;   /* duration of the run */
+	struct sniffer_counters start, end;
+} soak;
+
+/* Time for the sniffer to stream the last half-buffers of the run */
+#define SOAK_DRAIN_MS 50
+/* Longest run : keeps the message count well within an int */
+#define SOAK_MAX_SECS 3600
+
+static void soak_run(void)
+{
+	uint16_t header = inj_cmds[soak.index] & 0xffff;
+	uint32_t period = SECOND / soak.rate;
+	const uint32_t *raw;
+	uint32_t t0, t;
+	int bit_len, flag;
+
+	sniffer_count_edges(1);
+	sniffer_get_counters(&soak.start);
+	flag = disable_tracing_save();
+	raw = tx_cache_lookup(header, PD_HEADER_CNT(header),
+			      inj_cmds + soak.index + 1, &bit_len);
+	/* the first message goes right away */
+	t0 = t = ts_raw() - period;
+	for (soak.sent = 0; soak.sent < soak.count &&
+	     fsm_state == FSM_RUNNING; soak.sent++) {
+		/* keep the rate even if one message was late */
+		if (send_raw_at(soak.pol, t, period, raw, bit_len) >
+		    period + SEND_AT_LATE_US)
+			soak.late++;
+		t += period;
+		watchdog_reload();
+	}
+	enable_tracing_ifneeded(flag);
+	soak.us = ts_raw() - t0 - period;
+	msleep(SOAK_DRAIN_MS);
+	sniffer_get_counters(&soak.end);
+	sniffer_count_edges(0);
+}
+
+/* 'delta' events over the run, per second */
+static uint32_t soak_per_sec(uint32_t delta)
+{
+	return soak.us ? (uint64_t)delta * SECOND / soak.us : 0;
+}
+
+static void soak_print(void)
+{
+	const struct sniffer_counters *a = &soak.start, *b = &soak.end;
+
+	ccprintf("SOAK CC%d %d/s: %d/%d sent, %d late in %d ms\n",
+		 soak.pol + 1, soak.rate, soak.sent, soak.count, soak.late,
+		 soak.us / MSEC);
+	ccprintf("  %d edges/s, %d USB bytes/s, %d packets\n",
+		 soak_per_sec(b->edges - a->edges),
+		 soak_per_sec(b->usb_bytes - a->usb_bytes),
+		 b->packets - a->packets);
+	ccprintf("  %d overflows, %d decoded, %d decode errors\n",
+		 b->oflow - a->oflow, b->decoded - a->decoded,
+		 b->decode_errors - a->decode_errors);
+}
+#endif
+
+/* ------ BIST traffic generator ------ */
+
+/*
+ * BIST Carrier Mode 2 bursts or BIST Test Data frames sent at a steady rate,
+ * for the bit error rate measurement of a receiver ('tcpc <port> ber on' on
+ * another twinkie).
+ *
+ * The carrier is a single image byte repeated by the DMA : the end of the
+ * DMA transfer stops the transmission after exactly the requested number of
+ * bits. A burst longer than one transfer is sent as back-to-back transfers.
+ */
+static struct {
+	int pol;
+	int data;      /* Test Data frames rather than the carrier */
+	int ms;        /* duration of a carrier burst */
+	int rate;      /* bursts or frames per second */
+	int count;     /* bursts or frames to send */
+	int sent;
+	int late;      /* sent later than SEND_AT_LATE_US */
+	uint32_t us;   /* duration of the run */
+} bist;
+
+/* alternating 1's and 0's, BMC encoded : 4 bits of image per bit */
+#define BIST_CARRIER_BYTE 0x2d
+/* image bytes per ms at 600kHz */
+#define BIST_BYTES_PER_MS 75
+/* longest DMA transfer, within its 16-bit counter */
+#define BIST_TRANSFER_MS 800
+
+/* data objects of the Test Data frames */
+static const uint32_t bist_test_data[7] = {
+	BDO(BDO_MODE_TEST_DATA, 0), 0xaaaaaaaa, 0x00000000, 0xffffffff,
+	0x12345678, 0xedcba987, 0x55555555,
+};
+
+static uint16_t bist_header(int id)
+{
+	return header_fill(PD_HEADER(PD_DATA_BIST, PD_ROLE_SOURCE, PD_ROLE_DFP,
+				     id, 7));
+}
+
+static int bist_carrier(uint32_t t, uint32_t period)
+{
+	int left = bist.ms * BIST_BYTES_PER_MS;
+	uint32_t delay;
+	int n;
+
+	delay = spin_until(t, period);
+	for (; left > 0; left -= n) {
+		n = MIN(left, BIST_TRANSFER_MS * BIST_BYTES_PER_MS);
+		if (pd_start_tx_fill(0, bist.pol, BIST_CARRIER_BYTE, n) < 0)
+			break;
+		/* the next transfer starts as soon as this one stops */
+		interrupt_enable();
+		pd_tx_done(0, bist.pol);
+		interrupt_disable();
+	}
+	interrupt_enable();
+	return delay;
+}
+
+static void bist_run(void)
+{
+	uint32_t period = SECOND / bist.rate;
+	const uint32_t *raw;
+	uint32_t t0, t, delay;
+	int bit_len, flag;
+
+	flag = disable_tracing_save();
+	/* the first burst or frame goes right away */
+	t0 = t = ts_raw() - period;
+	for (bist.sent = 0; bist.sent < bist.count &&
+	     fsm_state == FSM_RUNNING; bist.sent++) {
+		if (bist.data) {
+			raw = tx_cache_lookup(bist_header(bist.sent & 7), 7,
+					      bist_test_data, &bit_len);
+			delay = send_raw_at(bist.pol, t, period, raw, bit_len);
+			header_sent();
+		} else {
+			delay = bist_carrier(t, period);
+		}
+		/* keep the rate even if one of them was late */
+		if (delay > period + SEND_AT_LATE_US)
+			bist.late++;
+		t += period;
+		watchdog_reload();
+	}
+	enable_tracing_ifneeded(flag);
+	bist.us = ts_raw() - t0 - period;
+}
+
+static void bist_print(void)
+{
+	ccprintf("BIST CC%d %s: %d/%d sent at %d/s, %d late in %d ms\n",
+		 bist.pol + 1, bist.data ? "data" : "carrier", bist.sent,
+		 bist.count, bist.rate, bist.late, bist.us / MSEC);
+}
+
+void injector_task(void)
+{
+	uint32_t done;
+
+	while (1) {
+		task_wait_event(-1);
+		if (fsm_state != FSM_RUNNING)
+			continue;
+		switch (inj_job) {
+		case INJ_JOB_FUZZ:
+			fuzz_run();
+			ccprintf("FUZZ %s %d sent, %d anomalies\n",
+				 fsm_state == FSM_RUNNING ? "Done" : "Aborted",
+				 fuzz.sent, fuzz.anomalies);
+			break;
+		case INJ_JOB_REPLAY:
+			replay_run();
+			ccprintf("REPLAY %s %d sent, %d late, %d underruns\n",
+				 fsm_state == FSM_RUNNING ? "Done" : "Aborted",
+				 replay.sent, replay.late, replay.underruns);
+			break;
+#ifdef HAS_TASK_SNIFFER
+		case INJ_JOB_SOAK:
+			soak_run();
+			ccprintf("SOAK %s\n", fsm_state == FSM_RUNNING ?
+				 "Done" : "Aborted");
+			soak_print();
+			break;
+#endif
+		case INJ_JOB_WAVE:
+			wave_run();
+			ccprintf("WAVE %s %d/%d bytes\n", wave.underrun ?
+				 "Underrun" : fsm_state == FSM_RUNNING ?
+				 "Done" : "Aborted", wave.played, wave.bytes);
+			break;
+		case INJ_JOB_BIST:
+			bist_run();
+			ccprintf("BIST %s\n", fsm_state == FSM_RUNNING ?
+				 "Done" : "Aborted");
+			bist_print();
+			break;
+		case INJ_JOB_MARGIN:
+			ccprintf("MARGIN %s %d rows at %d\n",
+				 margin_run() == margin.khz_n ?
+				 "Done" : "Aborted", margin.khz_n, margin.res);
+			break;
+		default:
+			fsm_result = fsm_run(fsm_pc);
+			ccprintf("FSM %s %d\n", fsm_state == FSM_RUNNING ?
+				 "Done" : "Aborted", fsm_result);
+		}
+		done = inj_job;
+		if (fsm_state != FSM_RUNNING)
+			done |= INJ_NOTIFY_ABORTED;
+		if (inj_job == INJ_JOB_FSM)
+			done |= (uint32_t)fsm_result << 16;
+		notify_post(INJ_NOTIFY_FSM_DONE, done, get_time().val);
+		fsm_state = FSM_IDLE;
+	}
+}
+
 /* ------ Console commands ------ */
 
 static int hex8tou32(char *str, uint32_t *val)
@@ -358,23 +2254,374 @@ static int hex8tou32(char *str, uint32_t *val)
 	return EC_SUCCESS;
 }
 
-static int cmd_fsm(int argc, char **argv)
+static int cmd_fsm(int argc, char **argv)
+{
+	int index;
+	char *e;
+
+	if (argc < 1)
+		return EC_ERROR_PARAM2;
+
+	if (!strcasecmp(argv[0], "status")) {
+		if (injector_busy())
+			ccprintf("FSM running at %d\n", fsm_pc);
+		else
+			ccprintf("FSM idle, last run stopped at %d\n",
+				 fsm_result);
+		return EC_SUCCESS;
+	}
+	if (!strcasecmp(argv[0], "abort")) {
+		if (fsm_state == FSM_RUNNING) {
+			fsm_state = FSM_ABORTING;
+			/* interrupt a pending INJ_CMD_EXPCT */
+			task_wake(TASK_ID_INJECTOR);
+		}
+		return EC_SUCCESS;
+	}
+
+	index = strtoi(argv[0], &e, 10);
+	if (*e || index < 0)
+		return EC_ERROR_PARAM2;
+	if (injector_busy())
+		return EC_ERROR_BUSY;
+	fsm_pc = index;
+	inj_job = INJ_JOB_FSM;
+	fsm_state = FSM_RUNNING;
+	task_wake(TASK_ID_INJECTOR);
+
+	return EC_SUCCESS;
+}
+
+static int cmd_fuzz(int argc, char **argv)
+{
+	char *e;
+	int pol, index, count;
+
+	if (argc < 1) {
+		ccprintf("FUZZ %d/%d sent, %d anomalies\n", fuzz.sent,
+			 fuzz.count, fuzz.anomalies);
+		return EC_SUCCESS;
+	}
+	if (argc < 3)
+		return EC_ERROR_PARAM_COUNT;
+	if (injector_busy())
+		return EC_ERROR_BUSY;
+	/* the answers are caught by the text tracer */
+	if (trace_mode != TRACE_MODE_ON)
+		return EC_ERROR_NOT_POWERED;
+
+	pol = strtoi(argv[0], &e, 10) - 1;
+	if (*e || pol > 1 || pol < 0)
+		return EC_ERROR_PARAM2;
+	index = strtoi(argv[1], &e, 10);
+	if (*e || index < 0 || index >= inj_cmd_count ||
+	    index + 1 + PD_HEADER_CNT(inj_cmds[index]) > inj_cmd_count)
+		return EC_ERROR_PARAM3;
+	count = strtoi(argv[2], &e, 10);
+	if (*e || count < 1)
+		return EC_ERROR_PARAM4;
+
+	fuzz.policy = FUZZ_ALL;
+	fuzz.seed = ts_raw();
+	fuzz.gap_ms = 0;
+	if (argc > 3) {
+		fuzz.policy = strtoi(argv[3], &e, 16) & FUZZ_ALL;
+		if (*e || !fuzz.policy)
+			return EC_ERROR_PARAM5;
+	}
+	if (argc > 4) {
+		fuzz.seed = strtoi(argv[4], &e, 16);
+		if (*e)
+			return EC_ERROR_PARAM6;
+	}
+	if (argc > 5) {
+		fuzz.gap_ms = strtoi(argv[5], &e, 10);
+		if (*e || fuzz.gap_ms < 0)
+			return EC_ERROR_PARAM7;
+	}
+	if (!fuzz.seed)
+		fuzz.seed = 1;
+	fuzz.pol = pol;
+	fuzz.index = index;
+	fuzz.count = count;
+	ccprintf("FUZZ seed %08x policy %x\n", fuzz.seed, fuzz.policy);
+
+	inj_job = INJ_JOB_FUZZ;
+	fsm_state = FSM_RUNNING;
+	task_wake(TASK_ID_INJECTOR);
+
+	return EC_SUCCESS;
+}
+
+static int cmd_margin(int argc, char **argv)
+{
+	char *e;
+	int i, words;
+	int v[9];
+
+	/* Display the last matrix */
+	if (argc < 1) {
+		const uint8_t *res = (const uint8_t *)(inj_cmds + margin.res);
+		int f, t;
+
+		if (injector_busy())
+			return EC_ERROR_BUSY;
+		if (!margin.khz_n)
+			return EC_ERROR_INVAL;
+		ccprintf("kHz\\mV");
+		for (t = 0; t < margin.mv_n; t++)
+			ccprintf(" %4d", margin.mv_min + t * margin.mv_step);
+		for (f = 0; f < margin.khz_n; f++) {
+			ccprintf("\n%6d ", margin.khz_min + f * margin.khz_step);
+			for (t = 0; t < margin.mv_n; t++)
+				ccprintf(" %4d", res[f * margin.mv_n + t]);
+			cflush();
+		}
+		ccprintf("\n");
+		return EC_SUCCESS;
+	}
+
+	/* <cc> <index> <packets> <kHz min> <max> <step> <mV min> <max> <step> */
+	if (argc < ARRAY_SIZE(v))
+		return EC_ERROR_PARAM_COUNT;
+	if (injector_busy())
+		return EC_ERROR_BUSY;
+	/* the GoodCRCs are caught by the text tracer */
+	if (trace_mode != TRACE_MODE_ON)
+		return EC_ERROR_NOT_POWERED;
+	for (i = 0; i < ARRAY_SIZE(v); i++) {
+		v[i] = strtoi(argv[i], &e, 10);
+		if (*e || v[i] < 0)
+			return MIN(EC_ERROR_PARAM2 + i, EC_ERROR_PARAM9);
+	}
+	if (v[0] < 1 || v[0] > 2)
+		return EC_ERROR_PARAM2;
+	if (v[1] >= inj_cmd_count)
+		return EC_ERROR_PARAM3;
+	if (!v[2] || v[2] > 255)
+		return EC_ERROR_PARAM4;
+	if (!v[3] || v[4] < v[3] || !v[5])
+		return EC_ERROR_PARAM5;
+	if (v[7] < v[6] || !v[8])
+		return EC_ERROR_PARAM8;
+
+	margin.pol = v[0] - 1;
+	margin.index = v[1];
+	margin.packets = v[2];
+	margin.khz_min = v[3];
+	margin.khz_step = v[5];
+	margin.khz_n = (v[4] - v[3]) / v[5] + 1;
+	margin.mv_min = v[6];
+	margin.mv_step = v[8];
+	margin.mv_n = (v[7] - v[6]) / v[8] + 1;
+	margin.res = margin.index + 1 + PD_HEADER_CNT(inj_cmds[margin.index]);
+	words = DIV_ROUND_UP(margin.khz_n * margin.mv_n, 4);
+	if (margin.res + words > inj_cmd_count) {
+		margin.khz_n = 0;
+		return EC_ERROR_OVERFLOW;
+	}
+	memset(inj_cmds + margin.res, 0, words * sizeof(uint32_t));
+
+	inj_job = INJ_JOB_MARGIN;
+	fsm_state = FSM_RUNNING;
+	task_wake(TASK_ID_INJECTOR);
+
+	return EC_SUCCESS;
+}
+
+static int cmd_replay(int argc, char **argv)
+{
+	char *e;
+	int pol;
+
+	if (argc < 1) {
+		ccprintf("REPLAY %d sent, %d late, %d underruns, %d free\n",
+			 replay.sent, replay.late, replay.underruns,
+			 injector_replay_space());
+		return EC_SUCCESS;
+	}
+	if (injector_busy())
+		return EC_ERROR_BUSY;
+
+	pol = strtoi(argv[0], &e, 10) - 1;
+	if (*e || pol > 1 || pol < 0)
+		return EC_ERROR_PARAM2;
+
+	memset(&replay, 0, sizeof(replay));
+	replay.pol = pol;
+	inj_job = INJ_JOB_REPLAY;
+	fsm_state = FSM_RUNNING;
+	task_wake(TASK_ID_INJECTOR);
+
+	return EC_SUCCESS;
+}
+
+static int cmd_wave(int argc, char **argv)
+{
+	char *e;
+	int pol, bits;
+
+	if (argc < 2) {
+		ccprintf("WAVE %d/%d bytes%s, %d free\n", wave.played,
+			 wave.bytes, wave.underrun ? ", underrun" : "",
+			 injector_replay_space());
+		return EC_SUCCESS;
+	}
+	if (injector_busy())
+		return EC_ERROR_BUSY;
+
+	pol = strtoi(argv[0], &e, 10) - 1;
+	if (*e || pol > 1 || pol < 0)
+		return EC_ERROR_PARAM2;
+	bits = strtoi(argv[1], &e, 10);
+	if (*e || bits <= 0)
+		return EC_ERROR_PARAM3;
+
+	memset(&replay, 0, sizeof(replay));
+	memset(&wave, 0, sizeof(wave));
+	/* a ring of zeros : the DMA reads what is past the host data */
+	memset(inj_cmds, 0, inj_cmd_count * sizeof(uint32_t));
+	replay.pol = pol;
+	wave.bytes = DIV_ROUND_UP(bits, 8);
+	inj_job = INJ_JOB_WAVE;
+	fsm_state = FSM_RUNNING;
+	task_wake(TASK_ID_INJECTOR);
+
+	return EC_SUCCESS;
+}
+
+#ifdef HAS_TASK_SNIFFER
+static int cmd_soak(int argc, char **argv)
 {
-	int index;
 	char *e;
+	int pol, index, rate, secs, bit_len;
+
+	if (argc < 1) {
+		if (injector_busy() && inj_job == INJ_JOB_SOAK)
+			ccprintf("SOAK running, %d/%d sent\n", soak.sent,
+				 soak.count);
+		else if (soak.count)
+			soak_print();
+		return EC_SUCCESS;
+	}
+	/* <cc> <index> <msgs/s> <seconds> */
+	if (argc < 4)
+		return EC_ERROR_PARAM_COUNT;
+	if (injector_busy())
+		return EC_ERROR_BUSY;
 
-	if (argc < 1)
+	pol = strtoi(argv[0], &e, 10) - 1;
+	if (*e || pol > 1 || pol < 0)
 		return EC_ERROR_PARAM2;
+	index = strtoi(argv[1], &e, 10);
+	if (*e || index < 0 || index >= inj_cmd_count ||
+	    index + 1 + PD_HEADER_CNT(inj_cmds[index]) > inj_cmd_count)
+		return EC_ERROR_PARAM3;
+	rate = strtoi(argv[2], &e, 10);
+	if (*e || rate < 1)
+		return EC_ERROR_PARAM4;
+	secs = strtoi(argv[3], &e, 10);
+	if (*e || secs < 1 || secs > SOAK_MAX_SECS)
+		return EC_ERROR_PARAM5;
+	/* the frames must not overlap : 300 kbps, 10/3 us per bit */
+	bit_len = prepare_message(0, inj_cmds[index] & 0xffff,
+				  PD_HEADER_CNT(inj_cmds[index]),
+				  inj_cmds + index + 1);
+	if (SECOND / rate <= bit_len * 10 / 3)
+		return EC_ERROR_PARAM4;
+
+	memset(&soak, 0, sizeof(soak));
+	soak.pol = pol;
+	soak.index = index;
+	soak.rate = rate;
+	soak.count = rate * secs;
+	inj_job = INJ_JOB_SOAK;
+	fsm_state = FSM_RUNNING;
+	task_wake(TASK_ID_INJECTOR);
 
-	index = strtoi(argv[0], &e, 10);
-	if (*e)
+	return EC_SUCCESS;
+}
+#endif
+
+static int cmd_bist(int argc, char **argv)
+{
+	char *e;
+	int pol, data, val, rate, count, us;
+
+	if (argc < 1) {
+		if (injector_busy() && inj_job == INJ_JOB_BIST)
+			ccprintf("BIST running, %d/%d sent\n", bist.sent,
+				 bist.count);
+		else if (bist.count)
+			bist_print();
+		return EC_SUCCESS;
+	}
+	/* <cc> carrier <ms> [<count> <bursts/s>] | <cc> data <count> <frames/s> */
+	if (argc < 3)
+		return EC_ERROR_PARAM_COUNT;
+	if (injector_busy())
+		return EC_ERROR_BUSY;
+
+	pol = strtoi(argv[0], &e, 10) - 1;
+	if (*e || pol > 1 || pol < 0)
 		return EC_ERROR_PARAM2;
-	index = fsm_run(index);
-	ccprintf("FSM Done %d\n", index);
+	if (!strcasecmp(argv[1], "data"))
+		data = 1;
+	else if (!strcasecmp(argv[1], "carrier"))
+		data = 0;
+	else
+		return EC_ERROR_PARAM3;
+	val = strtoi(argv[2], &e, 10);
+	if (*e || val < 1)
+		return EC_ERROR_PARAM4;
+	count = data ? val : 1;
+	rate = 1;
+	if (argc >= 5 || data) {
+		if (argc < (data ? 4 : 5))
+			return EC_ERROR_PARAM_COUNT;
+		if (!data) {
+			count = strtoi(argv[3], &e, 10);
+			if (*e || count < 1)
+				return EC_ERROR_PARAM5;
+		}
+		rate = strtoi(argv[data ? 3 : 4], &e, 10);
+		if (*e || rate < 1)
+			return data ? EC_ERROR_PARAM5 : EC_ERROR_PARAM6;
+	}
+	/* the bursts or frames must not overlap : 300 kbps, 10/3 us per bit */
+	if (data)
+		us = prepare_message(0, bist_header(0), 7, bist_test_data) *
+		     10 / 3;
+	else
+		us = val * MSEC;
+	if (count > 1 && SECOND / rate <= us)
+		return EC_ERROR_INVAL;
+
+	memset(&bist, 0, sizeof(bist));
+	bist.pol = pol;
+	bist.data = data;
+	bist.ms = val;
+	bist.rate = rate;
+	bist.count = count;
+	inj_job = INJ_JOB_BIST;
+	fsm_state = FSM_RUNNING;
+	task_wake(TASK_ID_INJECTOR);
 
 	return EC_SUCCESS;
 }
 
+static int cmd_results(int argc, char **argv)
+{
+	struct inj_result res;
+
+	while (injector_result_get(&res)) {
+		ccprintf("%5d %10u GET%d %08x\n", res.seq, res.ts, res.param,
+			 res.value);
+		cflush();
+	}
+
+	return EC_SUCCESS;
+}
 
 static int cmd_send(int argc, char **argv)
 {
@@ -399,16 +2646,104 @@ static int cmd_send(int argc, char **argv)
 		if (hex8tou32(argv[i+2], data + i))
 			return EC_ERROR_INVAL;
 
+	tx_guard_wait(pol);
 	bit_len = send_message(pol, header, cnt, data);
 	ccprintf("Sent CC%d %04x + %d = %d\n", pol + 1, header, cnt, bit_len);
 
 	return EC_SUCCESS;
 }
 
+static int cmd_periodic(int argc, char **argv)
+{
+	const struct periodic_job *j;
+	uint32_t data[7], period, count;
+	int job, pol, flags = 0, cnt, i;
+	uint16_t header;
+	char *e;
+
+	if (argc >= 1 && !strcasecmp(argv[0], "stop")) {
+		/* all of them, or the one given */
+		if (argc < 2) {
+			for (job = 0; job < INJ_PERIODIC_MAX; job++)
+				periodic_set(job, 0, 0, 0, 0, 0, 0, NULL);
+		} else {
+			job = strtoi(argv[1], &e, 10);
+			if (*e || periodic_set(job, 0, 0, 0, 0, 0, 0, NULL))
+				return EC_ERROR_PARAM2;
+		}
+	} else if (argc >= 1) {
+		/* <job> <cc> <ms> <count>|<secs>s [id] <header> [objects] */
+		if (argc < 5)
+			return EC_ERROR_PARAM_COUNT;
+		job = strtoi(argv[0], &e, 10);
+		if (*e || job < 0 || job >= INJ_PERIODIC_MAX)
+			return EC_ERROR_PARAM2;
+		pol = strtoi(argv[1], &e, 10) - 1;
+		if (*e || pol > 1 || pol < 0)
+			return EC_ERROR_PARAM3;
+		period = strtoi(argv[2], &e, 10);
+		if (*e || period < 1)
+			return EC_ERROR_PARAM4;
+		period *= MSEC;
+		count = strtoi(argv[3], &e, 10);
+		if (*e == 's' && !e[1] && count > 0)
+			/* a partial period still sends its message */
+			count = DIV_ROUND_UP((uint64_t)count * SECOND, period);
+		else if (*e)
+			return EC_ERROR_PARAM5;
+		argc -= 4;
+		argv += 4;
+		if (!strcasecmp(argv[0], "id")) {
+			flags = INJ_PERIODIC_ID;
+			argc--;
+			argv++;
+		}
+		cnt = argc - 1;
+		if (cnt < 0 || cnt > 7)
+			return EC_ERROR_PARAM_COUNT;
+		header = strtoi(argv[0], &e, 16);
+		if (*e)
+			return EC_ERROR_PARAM6;
+		for (i = 0; i < cnt; i++)
+			if (hex8tou32(argv[i + 1], data + i))
+				return EC_ERROR_INVAL;
+		/* the object count of the header is the one sent */
+		header = (header & ~(7 << 12)) | (cnt << 12);
+		return periodic_set(job, pol, period, count, flags, header, cnt,
+				    data);
+	}
+
+	for (job = 0, j = periodic; job < INJ_PERIODIC_MAX; job++, j++)
+		ccprintf("%d: %s CC%d %04x + %d every %d us, %d/%d sent, "
+			 "%d skipped, max %d us late\n", job,
+			 j->on ? "on" : "off", j->pol + 1, j->header,
+			 j->cnt, j->period, j->sent, j->count, j->skipped,
+			 j->max_late);
+	return EC_SUCCESS;
+}
+
 static int cmd_cc_level(int argc, char **argv)
 {
-	ccprintf("CC1 = %d mV ; CC2 = %d mV\n",
-		pd_adc_read(0, 0), pd_adc_read(0, 1));
+	int count, smpr = cc_smpr;
+	int cc1_volt, cc2_volt;
+	char *e;
+
+	if (argc >= 1) {
+		count = strtoi(argv[0], &e, 10);
+		if (*e)
+			return EC_ERROR_PARAM2;
+		if (argc >= 2) {
+			smpr = strtoi(argv[1], &e, 10);
+			if (*e)
+				return EC_ERROR_PARAM3;
+		}
+		if (set_cc_avg(count, smpr))
+			return EC_ERROR_INVAL;
+	}
+
+	read_cc(&cc1_volt, &cc2_volt);
+	ccprintf("CC1 = %d mV ; CC2 = %d mV (avg %d smpr %d)\n",
+		 cc1_volt, cc2_volt, cc_avg, cc_smpr);
 
 	return EC_SUCCESS;
 }
@@ -420,6 +2755,7 @@ static int cmd_resistor(int argc, char **argv)
 	if (argc < 2)
 		return EC_ERROR_PARAM_COUNT;
 
+	res_sched_stop();
 	for (p = 0; p < 2; p++) {
 		int is_set = 0;
 		for (r = 0; r < ARRAY_SIZE(res_cfg); r++)
@@ -435,6 +2771,45 @@ static int cmd_resistor(int argc, char **argv)
 	return EC_SUCCESS;
 }
 
+static int cmd_ccsched(int argc, char **argv)
+{
+	char *e;
+	int idx, count, i;
+
+	if (argc >= 1 && !strcasecmp(argv[0], "stop")) {
+		res_sched_stop();
+	} else if (argc >= 2) {
+		idx = strtoi(argv[0], &e, 0);
+		if (*e || idx < 0)
+			return EC_ERROR_PARAM2;
+		count = strtoi(argv[1], &e, 0);
+		if (*e || idx + count > inj_cmd_count)
+			return EC_ERROR_PARAM3;
+		if (res_sched_start(inj_cmds + idx, count))
+			return EC_ERROR_PARAM3;
+		return EC_SUCCESS;
+	} else if (argc == 1) {
+		return EC_ERROR_PARAM_COUNT;
+	}
+
+	ccprintf("CCSCHED %d/%d steps from %u\n", res_sched.done,
+		 res_sched.count, res_sched.start);
+	for (i = 0; i < res_sched.done; i++) {
+		uint32_t step = res_sched.steps[i];
+		int cc1 = INJ_RES_SCHED_CC(step, 0);
+		int cc2 = INJ_RES_SCHED_CC(step, 1);
+
+		/* actual offset and lateness of each step */
+		ccprintf("%2d: +%d us (%+d) %s %s\n", i,
+			 res_sched.applied[i] - res_sched.start,
+			 (int)(res_sched.applied[i] - res_sched.start -
+			       INJ_RES_SCHED_US(step)),
+			 cc1 == INJ_RES_KEEP ? "-" : res_cfg[cc1].name,
+			 cc2 == INJ_RES_KEEP ? "-" : res_cfg[cc2].name);
+	}
+	return EC_SUCCESS;
+}
+
 static int cmd_tx_clock(int argc, char **argv)
 {
 	int freq;
@@ -471,22 +2846,151 @@ static int cmd_rx_threshold(int argc, char **argv)
 	return EC_SUCCESS;
 }
 
+static int cmd_txguard(int argc, char **argv)
+{
+	static const char * const mode_name[] = {
+		"off", "idle", "sinktx", "both"
+	};
+	uint32_t limit = 0;
+	int mode;
+	char *e;
+
+	if (argc >= 1) {
+		for (mode = 0; mode < ARRAY_SIZE(mode_name); mode++)
+			if (!strcasecmp(argv[0], mode_name[mode]))
+				break;
+		if (mode == ARRAY_SIZE(mode_name))
+			return EC_ERROR_PARAM2;
+		if (argc >= 2) {
+			limit = strtoi(argv[1], &e, 10);
+			if (*e || limit > 0xffff)
+				return EC_ERROR_PARAM3;
+		}
+		tx_guard_set(mode, limit);
+	}
+
+	ccprintf("TX guard %s, up to %d us : %d deferred, %d forced, "
+		 "max %d us\n", mode_name[tx_guard.mode], tx_guard.limit_us,
+		 tx_guard.deferred, tx_guard.forced, tx_guard.max_us);
+
+	return EC_SUCCESS;
+}
+
+#ifdef HAS_TASK_SNIFFER
+static int cmd_rx_filter(int argc, char **argv)
+{
+	int filter;
+	char *e;
+
+	if (argc >= 1) {
+		filter = strtoi(argv[0], &e, 10);
+		if (*e || filter < 0 || filter > 15)
+			return EC_ERROR_PARAM2;
+		sniffer_set_rx_filter(filter);
+	}
+
+	ccprintf("RX filter = %d ; %d glitch edges\n",
+		 sniffer_get_rx_filter(), sniffer_glitch_count());
+
+	return EC_SUCCESS;
+}
+
+static int cmd_goodcrc(int argc, char **argv)
+{
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "on"))
+			goodcrc.on = 1;
+		else if (!strcasecmp(argv[0], "off"))
+			goodcrc.on = 0;
+		else if (!strcasecmp(argv[0], "clear"))
+			goodcrc.count = goodcrc.late = goodcrc.last =
+				goodcrc.max = 0;
+		else
+			return EC_ERROR_PARAM2;
+	}
+
+	ccprintf("GoodCRC %s : %d sent, %d late, last %d max %d us\n",
+		 goodcrc.on ? "on" : "off", goodcrc.count, goodcrc.late,
+		 goodcrc.last, goodcrc.max);
+
+	return EC_SUCCESS;
+}
+
+static int cmd_emarker(int argc, char **argv)
+{
+	static const char * const cmdt_name[] = { "-", "ACK", "NAK", "BUSY" };
+	uint32_t vdo[EMARKER_VDOS];
+	int i, cmd, cmdt, rv;
+	char *e;
+
+	if (argc >= 2) {
+		cmd = strtoi(argv[0], &e, 0);
+		if (*e)
+			return EC_ERROR_PARAM2;
+		for (cmdt = CMDT_RSP_ACK; cmdt <= CMDT_RSP_BUSY; cmdt++)
+			if (!strcasecmp(argv[1], cmdt_name[cmdt]))
+				break;
+		if (cmdt > CMDT_RSP_BUSY)
+			return EC_ERROR_PARAM3;
+		if (argc - 2 > EMARKER_VDOS)
+			return EC_ERROR_PARAM_COUNT;
+		for (i = 0; i < argc - 2; i++) {
+			vdo[i] = strtoi(argv[2 + i], &e, 0);
+			if (*e)
+				return EC_ERROR_PARAM4;
+		}
+		rv = emarker_load(cmd, cmdt, argc - 2, vdo);
+		if (rv)
+			return rv;
+	} else if (argc == 1) {
+		if (!strcasecmp(argv[0], "on"))
+			emarker.on = 1;
+		else if (!strcasecmp(argv[0], "off"))
+			emarker.on = 0;
+		else if (!strcasecmp(argv[0], "clear"))
+			memset(emarker.resp, 0, sizeof(emarker.resp));
+		else if (!strcasecmp(argv[0], "3a"))
+			emarker_preset(CABLE_CURR_3A);
+		else if (!strcasecmp(argv[0], "5a"))
+			emarker_preset(CABLE_CURR_5A);
+		else
+			return EC_ERROR_PARAM2;
+	}
+	if (argc)
+		emarker_reset();
+
+	ccprintf("E-marker %s : %d requests, %d responses, GoodCRC %d late, "
+		 "last %d max %d us\n", emarker.on ? "on" : "off",
+		 emarker.requests, emarker.responses, emarker.late,
+		 emarker.last, emarker.max);
+	for (i = 0; i < EMARKER_RESPS; i++) {
+		if (!emarker.resp[i].cmd)
+			continue;
+		ccprintf("  cmd %2d %-4s", emarker.resp[i].cmd,
+			 cmdt_name[emarker.resp[i].cmdt]);
+		for (cmd = 0; cmd < emarker.resp[i].cnt; cmd++)
+			ccprintf(" %08x", emarker.resp[i].vdo[cmd]);
+		ccputs("\n");
+	}
+	return EC_SUCCESS;
+}
+#endif
+
 static int cmd_ina_dump(int argc, char **argv, int index)
 {
-	if (index == 1) { /* VCONN INA is off by default, switch it on */
-		ina2xx_write(index, INA2XX_REG_CONFIG, 0x4123);
-		/*
-		 * wait for the end of conversion : 2x 1.1ms as defined
-		 * by the Vb and Vsh CT bits in the CONFIG register above.
-		 */
-		udelay(2200);
+	int mv, ma;
+
+	if (index == 1) {
+		/* cached by the VCONN monitor, or a short one-shot when off */
+		if (vconn_monitor_read(&mv, &ma))
+			return EC_ERROR_BUSY;
+	} else {
+		mv = ina2xx_get_voltage(index);
+		ma = ina2xx_get_current(index);
 	}
 
 	ccprintf("%s = %d mV ; %d mA\n", index == 0 ? "VBUS" : "VCONN",
-		ina2xx_get_voltage(index), ina2xx_get_current(index));
-
-	if (index == 1) /* power off VCONN INA */
-		ina2xx_write(index, INA2XX_REG_CONFIG, 0);
+		mv, ma);
 
 	return EC_SUCCESS;
 }
@@ -497,11 +3001,11 @@ static int cmd_bufwr(int argc, char **argv)
 	char *e;
 
 	cnt = argc - 1;
-	if (argc < 2 || cnt > INJ_CMD_COUNT)
+	if (argc < 2 || cnt > inj_cmd_count)
 		return EC_ERROR_PARAM_COUNT;
 
 	idx = strtoi(argv[0], &e, 10);
-	if (*e || idx + cnt > INJ_CMD_COUNT)
+	if (*e || idx + cnt > inj_cmd_count)
 		return EC_ERROR_PARAM2;
 
 	for (i = 0; i < cnt; i++)
@@ -521,13 +3025,13 @@ static int cmd_bufrd(int argc, char **argv)
 		return EC_ERROR_PARAM_COUNT;
 
 	idx = strtoi(argv[0], &e, 10);
-	if (*e || idx > INJ_CMD_COUNT)
+	if (*e || idx > inj_cmd_count)
 		return EC_ERROR_PARAM2;
 
 	if (argc >= 2)
 		cnt = strtoi(argv[1], &e, 10);
 
-	if (*e || idx + cnt > INJ_CMD_COUNT)
+	if (*e || idx + cnt > inj_cmd_count)
 		return EC_ERROR_PARAM3;
 
 	for (i = idx; i < idx + cnt; i++)
@@ -537,6 +3041,318 @@ static int cmd_bufrd(int argc, char **argv)
 	return EC_SUCCESS;
 }
 
+static int cmd_bufsize(int argc, char **argv)
+{
+	int words, rv;
+	char *e;
+
+	if (argc >= 1) {
+		words = strtoi(argv[0], &e, 10);
+		if (*e || words < 1)
+			return EC_ERROR_PARAM2;
+		rv = injector_buffer_resize(words);
+		if (rv != EC_SUCCESS)
+			return rv;
+	}
+	ccprintf("FSM buffer: %d words\n", inj_cmd_count);
+
+	return EC_SUCCESS;
+}
+
+/* ------ Script slots in flash ------ */
+
+static const struct inj_script *script_at(int off)
+{
+	const char *ptr;
+
+	if (flash_dataptr(off, INJ_SCRIPT_SLOT_SIZE, 4, &ptr) < 0)
+		return NULL;
+	return (const struct inj_script *)ptr;
+}
+
+static const struct inj_script *script_slot(int slot)
+{
+	if (slot < 0 || slot >= INJ_SCRIPT_SLOTS)
+		return NULL;
+	return script_at(INJ_SCRIPT_STORAGE_OFF + slot * INJ_SCRIPT_SLOT_SIZE);
+}
+
+static uint32_t script_crc(const uint32_t *words, int count)
+{
+	uint32_t crc;
+	int i;
+
+	crc32_ctx_init(&crc);
+	for (i = 0; i < count; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	return crc32_ctx_result(&crc);
+}
+
+/* Return 'scr' if it holds valid words under 'magic', else NULL */
+static const struct inj_script *script_check(const struct inj_script *scr,
+					     uint32_t magic)
+{
+	if (!scr || scr->magic != magic ||
+	    scr->count > INJ_SCRIPT_MAX_WORDS ||
+	    script_crc(scr->words, scr->count) != scr->crc)
+		return NULL;
+	return scr;
+}
+
+/* Return the slot header if it holds a valid script, else NULL */
+static const struct inj_script *script_get(int slot)
+{
+	return script_check(script_slot(slot), INJ_SCRIPT_MAGIC);
+}
+
+static int script_load(int slot)
+{
+	const struct inj_script *scr = script_get(slot);
+	int rv;
+
+	if (!scr)
+		return EC_ERROR_INVAL;
+	/* grow the buffer if needed */
+	if (scr->count > inj_cmd_count) {
+		rv = injector_buffer_resize(scr->count);
+		if (rv != EC_SUCCESS)
+			return rv;
+	}
+	memcpy(inj_cmds, scr->words, scr->count * sizeof(uint32_t));
+	return EC_SUCCESS;
+}
+
+/* Write the 'count' words in the erase page at 'off' under 'magic' */
+static int script_write(int off, uint32_t magic, const char *name,
+			const uint32_t *words, int count, int flags)
+{
+	struct inj_script hdr;
+	int rv;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = magic;
+	strzcpy(hdr.name, name, sizeof(hdr.name));
+	hdr.count = count;
+	hdr.flags = flags;
+	hdr.crc = script_crc(words, count);
+
+	rv = flash_erase(off, INJ_SCRIPT_SLOT_SIZE);
+	if (rv != EC_SUCCESS)
+		return rv;
+	rv = flash_write(off + sizeof(hdr), count * sizeof(uint32_t),
+			 (const char *)words);
+	if (rv != EC_SUCCESS)
+		return rv;
+	/* header last : an interrupted save leaves an empty slot */
+	return flash_write(off, sizeof(hdr), (const char *)&hdr);
+}
+
+static int script_save(int slot, const char *name, int count, int flags)
+{
+	/* checked before the slot is erased */
+	if (slot < 0 || slot >= INJ_SCRIPT_SLOTS || count <= 0 ||
+	    count > MIN(inj_cmd_count, INJ_SCRIPT_MAX_WORDS))
+		return EC_ERROR_INVAL;
+
+	return script_write(INJ_SCRIPT_STORAGE_OFF +
+			    slot * INJ_SCRIPT_SLOT_SIZE, INJ_SCRIPT_MAGIC,
+			    name, inj_cmds, count, flags);
+}
+
+static void script_boot(void)
+{
+	const struct inj_script *scr;
+	int slot;
+
+	for (slot = 0; slot < INJ_SCRIPT_SLOTS; slot++) {
+		scr = script_get(slot);
+		if (scr && (scr->flags & INJ_SCRIPT_BOOT)) {
+			script_load(slot);
+			return;
+		}
+	}
+}
+DECLARE_HOOK(HOOK_INIT, script_boot, HOOK_PRIO_DEFAULT);
+
+static int cmd_script(int argc, char **argv)
+{
+	const struct inj_script *scr;
+	int slot, count, flags = 0;
+	char *e;
+
+	if (argc < 1 || !strcasecmp(argv[0], "list")) {
+		for (slot = 0; slot < INJ_SCRIPT_SLOTS; slot++) {
+			scr = script_get(slot);
+			if (scr)
+				ccprintf("%d: %-16s %d words%s\n", slot,
+					 scr->name, scr->count,
+					 scr->flags & INJ_SCRIPT_BOOT ?
+					 " (boot)" : "");
+			else
+				ccprintf("%d: <empty>\n", slot);
+		}
+		return EC_SUCCESS;
+	}
+
+	if (argc < 2)
+		return EC_ERROR_PARAM_COUNT;
+	slot = strtoi(argv[1], &e, 10);
+	if (*e || slot < 0 || slot >= INJ_SCRIPT_SLOTS)
+		return EC_ERROR_PARAM3;
+
+	if (!strcasecmp(argv[0], "load"))
+		return script_load(slot);
+	if (!strcasecmp(argv[0], "erase"))
+		return flash_erase(INJ_SCRIPT_STORAGE_OFF +
+				   slot * INJ_SCRIPT_SLOT_SIZE,
+				   INJ_SCRIPT_SLOT_SIZE);
+	if (strcasecmp(argv[0], "save"))
+		return EC_ERROR_PARAM2;
+
+	/* save <slot> <name> [<count>] [boot] */
+	if (argc < 3)
+		return EC_ERROR_PARAM_COUNT;
+	count = MIN(inj_cmd_count, INJ_SCRIPT_MAX_WORDS);
+	if (argc >= 4 && strcasecmp(argv[3], "boot")) {
+		count = strtoi(argv[3], &e, 10);
+		if (*e)
+			return EC_ERROR_PARAM4;
+	}
+	if (!strcasecmp(argv[argc - 1], "boot"))
+		flags |= INJ_SCRIPT_BOOT;
+	return script_save(slot, argv[2], count, flags);
+}
+
+/* ------ Capture profile in flash ------ */
+
+BUILD_ASSERT(INJ_PROFILE_SIZE == INJ_SCRIPT_SLOT_SIZE);
+BUILD_ASSERT(CONFIG_RW_SIZE % CONFIG_FLASH_BANK_SIZE == 0);
+
+/* Setup words carried over a jump between the images */
+#define INJ_SETUP_SYSJUMP_TAG 0x5349 /* "IS" */
+#define INJ_SETUP_HOOK_VERSION 1
+
+#ifndef HAS_TASK_SNIFFER
+/* Sniffer setup received from the RO image, handed back on the way back */
+static uint32_t sniffer_words[2];
+static int sniffer_word_count;
+#endif
+
+static uint32_t set_word(int param, int arg2, int val)
+{
+	return (INJ_CMD_SET << 28) | ((arg2 & 0xf) << 24) |
+	       ((param & 0xff) << 16) | (val & 0xffff);
+}
+
+/* Fill 'words' with the SET words restoring the current setup */
+static int profile_words(uint32_t *words)
+{
+	int n = 0;
+	int i;
+
+	words[n++] = set_word(INJ_SET_RESISTOR1, 0, inj_resistor[0]);
+	words[n++] = set_word(INJ_SET_RESISTOR2, 0, inj_resistor[1]);
+	words[n++] = set_word(INJ_SET_TX_SPEED, 0, pd_get_clock(0) / 1000);
+	words[n++] = set_word(INJ_SET_RX_THRESH, 0,
+			      (STM32_DAC_DHR12RD * 3300 + 2048) / 4096);
+	words[n++] = set_word(INJ_SET_POLARITY, 0, inj_polarity);
+	words[n++] = set_word(INJ_SET_CC_AVG, cc_smpr, cc_avg);
+	for (i = 0; i < TRACE_RULE_COUNT; i++)
+		if (get_trace_rule(i))
+			words[n++] = set_word(INJ_SET_TRACE_RULE, i,
+					      get_trace_rule(i));
+#ifdef HAS_TASK_SNIFFER
+	words[n++] = set_word(INJ_SET_RX_FILTER, 0, sniffer_get_rx_filter());
+	words[n++] = set_word(INJ_SET_RECORD, 0, sniffer_get_recording());
+#else
+	for (i = 0; i < sniffer_word_count; i++)
+		words[n++] = sniffer_words[i];
+#endif
+	/* last : the tracer starts with everything else in place */
+	words[n++] = set_word(INJ_SET_TRACE, 0, trace_mode);
+	return n;
+}
+
+static const struct inj_script *profile_get(void)
+{
+	return script_check(script_at(INJ_PROFILE_OFF), INJ_PROFILE_MAGIC);
+}
+
+static void profile_apply(const uint32_t *words, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		/* never jump again from the boot */
+		if (INJ_CMD(words[i]) != INJ_CMD_SET ||
+		    INJ_ARG1(words[i]) == INJ_SET_ROLE)
+			continue;
+#ifndef HAS_TASK_SNIFFER
+		if ((INJ_ARG1(words[i]) == INJ_SET_RECORD ||
+		     INJ_ARG1(words[i]) == INJ_SET_RX_FILTER) &&
+		    sniffer_word_count < ARRAY_SIZE(sniffer_words))
+			sniffer_words[sniffer_word_count++] = words[i];
+#endif
+		fsm_set(words[i]);
+	}
+}
+
+/*
+ * Restore the setup as soon as the hardware is initialized : the one of the
+ * other image after a role switch, else the saved profile.
+ */
+static void profile_boot(void)
+{
+	const struct inj_script *prf = profile_get();
+	uint32_t words[INJ_PROFILE_MAX_WORDS];
+	const uint8_t *prev;
+	int version, size;
+
+	prev = system_get_jump_tag(INJ_SETUP_SYSJUMP_TAG, &version, &size);
+	if (prev && version == INJ_SETUP_HOOK_VERSION &&
+	    size <= sizeof(words) && !(size % sizeof(uint32_t))) {
+		memcpy(words, prev, size);
+		profile_apply(words, size / sizeof(uint32_t));
+	} else if (prf) {
+		profile_apply(prf->words, prf->count);
+	}
+}
+DECLARE_HOOK(HOOK_INIT, profile_boot, HOOK_PRIO_DEFAULT + 1);
+
+static void profile_preserve(void)
+{
+	uint32_t words[INJ_PROFILE_MAX_WORDS];
+
+	system_add_jump_tag(INJ_SETUP_SYSJUMP_TAG, INJ_SETUP_HOOK_VERSION,
+			    profile_words(words) * sizeof(uint32_t), words);
+}
+DECLARE_HOOK(HOOK_SYSJUMP, profile_preserve, HOOK_PRIO_DEFAULT);
+
+static int cmd_profile(int argc, char **argv)
+{
+	uint32_t words[INJ_PROFILE_MAX_WORDS];
+	const struct inj_script *prf;
+	int i;
+
+	if (argc >= 1 && !strcasecmp(argv[0], "save"))
+		return script_write(INJ_PROFILE_OFF, INJ_PROFILE_MAGIC,
+				    "profile", words, profile_words(words), 0);
+	if (argc >= 1 && !strcasecmp(argv[0], "erase"))
+		return flash_erase(INJ_PROFILE_OFF, INJ_PROFILE_SIZE);
+	if (argc >= 1)
+		return EC_ERROR_PARAM2;
+
+	prf = profile_get();
+	if (!prf) {
+		ccprintf("No saved profile\n");
+		return EC_SUCCESS;
+	}
+	for (i = 0; i < prf->count; i++)
+		ccprintf("SET %d arg2 %d = %d\n", INJ_ARG1(prf->words[i]),
+			 INJ_ARG2(prf->words[i]), INJ_ARG0(prf->words[i]));
+	return EC_SUCCESS;
+}
+
 static int cmd_sink(int argc, char **argv)
 {
 	/*
@@ -548,16 +3364,139 @@ static int cmd_sink(int argc, char **argv)
 	return EC_SUCCESS;
 }
 
+static int cmd_sniffer(int argc, char **argv)
+{
+	/* Back to the RO section, with the sniffer */
+	return system_run_image_copy(SYSTEM_IMAGE_RO);
+}
+
+static int cmd_trace_filter(int argc, char **argv)
+{
+	int idx, rule;
+	char *e;
+
+	if (argc >= 1 && !strcasecmp(argv[0], "clear")) {
+		for (idx = 0; idx < TRACE_RULE_COUNT; idx++)
+			set_trace_rule(idx, 0);
+	} else if (argc >= 2) {
+		idx = strtoi(argv[0], &e, 10);
+		if (*e || idx < 0 || idx >= TRACE_RULE_COUNT)
+			return EC_ERROR_PARAM3;
+		rule = strtoi(argv[1], &e, 16);
+		if (*e || rule < 0 || rule > 0xffff)
+			return EC_ERROR_PARAM4;
+		set_trace_rule(idx, rule);
+	} else if (argc == 1) {
+		return EC_ERROR_PARAM_COUNT;
+	}
+
+	for (idx = 0; idx < TRACE_RULE_COUNT; idx++)
+		if (get_trace_rule(idx) & TRACE_RULE_ENABLE)
+			ccprintf("rule %d: %04x\n", idx, get_trace_rule(idx));
+
+	return EC_SUCCESS;
+}
+
+static int cmd_trace_timing(int argc, char **argv)
+{
+	static const char * const name[] = {
+		[INJ_TIMING_GOODCRC]  = "GoodCRC",
+		[INJ_TIMING_RESPONSE] = "Response",
+		[INJ_TIMING_GAP]      = "Gap",
+	};
+	uint32_t words[INJ_TIMING_WORDS];
+	int i, b;
+
+	for (i = 0; i < INJ_TIMING_COUNT; i++) {
+		get_trace_timing(i, words);
+		ccprintf("%-8s: %d msgs", name[i], words[0]);
+		if (words[0])
+			ccprintf(" min %d max %d avg %d us", words[1],
+				 words[2], words[3] / words[0]);
+		ccputs("\n ");
+		for (b = 0; b < INJ_TIMING_BINS; b++)
+			ccprintf(" %d", words[4 + b]);
+		ccputs("\n");
+		cflush();
+	}
+
+	return EC_SUCCESS;
+}
+
+/* Print the intervals of one class : mean and spread in ns, then the bins */
+static void jitter_print(const char *name, const uint32_t *bins)
+{
+	uint32_t n = 0, sum = 0;
+	int i, lo = -1, hi = 0;
+
+	for (i = 0; i < PD_DECODE_CLASS_COUNT; i++) {
+		if (!bins[i])
+			continue;
+		if (lo < 0)
+			lo = i;
+		hi = i;
+		n += bins[i];
+		sum += bins[i] * i;
+	}
+	ccprintf("%-4s: %d edges", name, n);
+	if (n)
+		ccprintf(" avg %d ns, %d-%d ns", sum * 10000 / 24 / n,
+			 lo * 10000 / 24, hi * 10000 / 24);
+	ccputs("\n ");
+	for (i = lo; i >= 0 && i <= hi; i++)
+		ccprintf(" %d:%d", i, bins[i]);
+	ccputs("\n");
+}
+
+static int cmd_trace_jitter(int argc, char **argv)
+{
+	struct pd_decode_hist hist;
+
+	get_trace_jitter(&hist);
+	ccputs("Edge intervals in 2.4MHz ticks (417 ns)\n");
+	jitter_print("UI/2", hist.half);
+	jitter_print("UI", hist.full);
+	return EC_SUCCESS;
+}
+
+static int cmd_trace_coalesce(int argc, char **argv)
+{
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "on"))
+			set_trace_coalesce(1);
+		else if (!strcasecmp(argv[0], "off"))
+			set_trace_coalesce(0);
+		else
+			return EC_ERROR_PARAM3;
+	}
+
+	ccprintf("Repeat coalescing %s\n", get_trace_coalesce() ? "on" : "off");
+	return EC_SUCCESS;
+}
+
 static int cmd_trace(int argc, char **argv)
 {
 	if (argc < 1)
 		return EC_ERROR_PARAM_COUNT;
 
+	if (!strcasecmp(argv[0], "filter"))
+		return cmd_trace_filter(argc - 1, argv + 1);
+	if (!strcasecmp(argv[0], "timing"))
+		return cmd_trace_timing(argc - 1, argv + 1);
+	if (!strcasecmp(argv[0], "jitter"))
+		return cmd_trace_jitter(argc - 1, argv + 1);
+	if (!strcasecmp(argv[0], "coalesce"))
+		return cmd_trace_coalesce(argc - 1, argv + 1);
+
 	if (!strcasecmp(argv[0], "on") ||
 	    !strcasecmp(argv[0], "1"))
 		set_trace_mode(TRACE_MODE_ON);
 	else if (!strcasecmp(argv[0], "raw"))
 		set_trace_mode(TRACE_MODE_RAW);
+#ifdef HAS_TASK_SNIFFER
+	else if (!strcasecmp(argv[0], "dual"))
+		set_trace_mode(TRACE_MODE_DUAL);
+#endif
 	else if (!strcasecmp(argv[0], "off") ||
 		 !strcasecmp(argv[0], "0"))
 		set_trace_mode(TRACE_MODE_OFF);
@@ -573,22 +3512,62 @@ static int command_tw(int argc, char **argv)
 		return cmd_send(argc - 2, argv + 2);
 	else if (!strcasecmp(argv[1], "fsm"))
 		return cmd_fsm(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "fuzz"))
+		return cmd_fuzz(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "margin"))
+		return cmd_margin(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "replay"))
+		return cmd_replay(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "wave"))
+		return cmd_wave(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "bist"))
+		return cmd_bist(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "results"))
+		return cmd_results(argc - 2, argv + 2);
+#ifdef HAS_TASK_SNIFFER
+	else if (!strcasecmp(argv[1], "soak"))
+		return cmd_soak(argc - 2, argv + 2);
+#endif
 	else if (!strcasecmp(argv[1], "bufwr"))
 		return cmd_bufwr(argc - 2, argv + 2);
 	else if (!strcasecmp(argv[1], "bufrd"))
 		return cmd_bufrd(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "bufsize"))
+		return cmd_bufsize(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "script"))
+		return cmd_script(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "profile"))
+		return cmd_profile(argc - 2, argv + 2);
 	else if (!strcasecmp(argv[1], "cc"))
 		return cmd_cc_level(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "ccsched"))
+		return cmd_ccsched(argc - 2, argv + 2);
 	else if (!strncasecmp(argv[1], "resistor", 3))
 		return cmd_resistor(argc - 2, argv + 2);
 	else if (!strcasecmp(argv[1], "sink"))
 		return cmd_sink(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "sniffer"))
+		return cmd_sniffer(argc - 2, argv + 2);
 	else if (!strcasecmp(argv[1], "trace"))
 		return cmd_trace(argc - 2, argv + 2);
 	else if (!strcasecmp(argv[1], "txclock"))
 		return cmd_tx_clock(argc - 2, argv + 2);
 	else if (!strncasecmp(argv[1], "rxthresh", 8))
 		return cmd_rx_threshold(argc - 2, argv + 2);
+#ifdef HAS_TASK_SNIFFER
+	else if (!strncasecmp(argv[1], "rxfilter", 8))
+		return cmd_rx_filter(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "goodcrc"))
+		return cmd_goodcrc(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "emarker"))
+		return cmd_emarker(argc - 2, argv + 2);
+#endif
+	else if (!strcasecmp(argv[1], "txguard"))
+		return cmd_txguard(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "periodic"))
+		return cmd_periodic(argc - 2, argv + 2);
+	else if (!strcasecmp(argv[1], "notify"))
+		return notify_command(argc - 2, argv + 2);
 	else if (!strcasecmp(argv[1], "vbus"))
 		return cmd_ina_dump(argc - 2, argv + 2, 0);
 	else if (!strcasecmp(argv[1], "vconn"))
@@ -599,5 +3578,7 @@ static int command_tw(int argc, char **argv)
 	return EC_SUCCESS;
 }
 DECLARE_CONSOLE_COMMAND(twinkie, command_tw,
-			"[send|fsm|cc|resistor|txclock|rxthresh|vbus|vconn]",
+			"[send|fsm|fuzz|margin|replay|wave|soak|bist|results|bufsize|script|profile|cc|ccsched|resistor|txclock|rxthresh|"
+			"rxfilter|goodcrc|emarker|txguard|periodic|notify|vbus|vconn|sink|"
+			"sniffer]",
 			"Manual Twinkie tweaking");
@@ -37,10 +37,24 @@ enum inj_cmd {
 	INJ_CMD_WAIT  = 0x4, /* Wait for arg12 edges if arg12 != 0 */
 			     /* and timeout after arg0 ms */
 	INJ_CMD_GET   = 0x5, /* Get parameter arg1 (INJ_GET_x) at index arg0 */
+			     /* (or in the result ring : INJ_GET_RING) */
 	INJ_CMD_SET   = 0x6, /* Set parameter arg1 (INJ_SET_x) with arg0 */
+	INJ_CMD_SEND_AT = 0x7, /* Send message arg0 us after the last EOP */
+			       /* header at index arg1, arg2 payload words */
+			       /* right after it */
 	INJ_CMD_JUMP  = 0x8, /* Jump to index (as arg0) */
+	INJ_CMD_LOOP  = 0x9, /* Decrement register arg2, jump to index arg0 */
+			     /* if it is not zero */
+	INJ_CMD_LOAD  = 0xA, /* Load register arg2 from source arg1 */
+			     /* (INJ_SRC_x) with argument arg0 */
+	INJ_CMD_BRANCH = 0xB, /* Jump to index arg0 if register arg2 and */
+			      /* register arg1[3:0] meet condition */
+			      /* arg1[7:4] (INJ_COND_x) */
 	INJ_CMD_EXPCT = 0xC, /* Expect a packet with command arg2 */
 			     /* and timeout after arg0 ms */
+	INJ_CMD_STORE = 0xD, /* Store register arg2 at index arg0 */
+	INJ_CMD_SEND_RETRY = 0xE, /* INJ_CMD_SEND, then wait for its GoodCRC */
+				  /* and retry up to nRetryCount times */
 	INJ_CMD_NOP   = 0xF, /* No-Operation */
 };
 
@@ -52,13 +66,172 @@ enum inj_set {
 	INJ_SET_RX_THRESH  = 4, /* RX voltage threshold is arg0 mV */
 	INJ_SET_POLARITY   = 5, /* Polarity for other operations (INJ_POL_CC) */
 	INJ_SET_TRACE      = 6, /* Text packet trace on/raw/off */
+	INJ_SET_RX_FILTER  = 7, /* RX timers input filter is arg0 (ICxF) */
+	INJ_SET_TRACE_RULE = 8, /* Trace filter rule arg2 is arg0 */
+	INJ_SET_CC_AVG     = 9, /* Average the CC readings over arg0 samples */
+				/* with the sample time arg2 (0-7) */
+	INJ_SET_ROLE       = 10, /* Run the sniffer (0) or the sink (1) image */
+	INJ_SET_GOODCRC    = 11, /* Acknowledge the received SOP messages */
+				 /* while tracing on/raw (0 off, 1 on) */
+	INJ_SET_HEADER     = 12, /* Fill the fields arg2 (INJ_HEADER_x) of */
+				 /* the sent headers, roles and revision */
+				 /* from the header arg0 */
+	INJ_SET_IMPAIR     = 13, /* Set the TX impairment arg2 (INJ_IMPAIR_x) */
+				 /* to arg0 */
+	INJ_SET_BURST      = 14, /* Queue the next arg2 INJ_CMD_SEND and send */
+				 /* them back to back, arg0 us apart */
+	INJ_SET_RES_SCHED  = 15, /* Run the arg2 resistor steps at the index */
+				 /* arg0 (INJ_RES_SCHED_STEP) in the */
+				 /* background, 0 steps stops them */
+	INJ_SET_TRACE_COALESCE = 16, /* Count the repeated packets instead */
+				     /* of tracing them (0 off, 1 on) */
+	INJ_SET_EMARKER    = 17, /* Cable e-marker emulation : with arg2 0, */
+				 /* off (arg0 0), on (1), clear the */
+				 /* responses (2), */
+				 /* else load the response at the index arg0 */
+				 /* (VDM header, arg2 - 1 VDOs) */
+	INJ_SET_TX_GUARD   = 18, /* Defer the messages sent for the checks */
+				 /* arg2 (INJ_TX_GUARD_x), up to arg0 us */
+				 /* (0 : 10 ms) before sending anyway */
+	INJ_SET_PERIODIC   = 19, /* Start the periodic message job arg2 */
+				 /* described at the index arg0, on the */
+				 /* current polarity */
 };
 
+/* Collision avoidance checks before sending a message (INJ_SET_TX_GUARD) */
+#define INJ_TX_GUARD_IDLE   (1 << 0) /* no edge on the CC line for 20 us */
+#define INJ_TX_GUARD_SINKTX (1 << 1) /* PD 3.0 Rp at SinkTxOk (3.0A) */
+
+/*
+ * Periodic message job (INJ_SET_PERIODIC) : period in us (0 stops the job),
+ * messages to send (0 : until stopped), then the INJ_PERIODIC_x flags in
+ * the bits 31:16 of the header word, followed by its data objects.
+ */
+#define INJ_PERIODIC_WORDS(cnt) (3 + (cnt))
+#define INJ_PERIODIC_ID (1 << 0) /* MessageID incremented at each message */
+/* Jobs running at the same time */
+#define INJ_PERIODIC_MAX 4
+
+/* Most messages in a burst */
+#define INJ_BURST_MAX 8
+
+/*
+ * Step of a resistor schedule : the CC1/CC2 resistors (INJ_RES_x, or
+ * INJ_RES_KEEP to leave one as it is) set 'us' microseconds after the start
+ * of the schedule, up to 16.7s.
+ */
+#define INJ_RES_SCHED_STEP(us, cc1, cc2) (((us) << 8) | ((cc2) << 4) | (cc1))
+#define INJ_RES_SCHED_US(s)       ((s) >> 8)
+#define INJ_RES_SCHED_CC(s, pol)  (((s) >> ((pol) * 4)) & 0xf)
+#define INJ_RES_KEEP 0xf
+/* Most steps in a schedule */
+#define INJ_RES_SCHED_MAX 15
+
+/* Header fields of the FSM messages filled by the device */
+#define INJ_HEADER_ID    (1 << 0) /* MessageID counter, reset by the SET */
+#define INJ_HEADER_ROLES (1 << 1) /* power role, data role, spec revision */
+
+/*
+ * TX impairments of the messages sent by the injector (see impair.c), they
+ * stay until INJ_IMPAIR_CLEAR.
+ */
+enum inj_impair {
+	INJ_IMPAIR_SEED     = 0, /* restart the random draws from a seed */
+	INJ_IMPAIR_JITTER   = 1, /* largest shift of each edge, 0-2 quarters */
+				 /* of a half bit */
+	INJ_IMPAIR_UI       = 2, /* bit period stretch in %, -50 to 100 */
+	INJ_IMPAIR_DROP     = 3, /* edge drop probability in 1/65536 */
+	INJ_IMPAIR_PREAMBLE = 4, /* preamble bits removed, 0-63 */
+	INJ_IMPAIR_EOP      = 5, /* EOP replaced by the 5b symbol in the */
+				 /* bits 4:0 if INJ_IMPAIR_EOP_ON is set */
+	INJ_IMPAIR_CLEAR    = 15, /* back to the unimpaired messages */
+};
+#define INJ_IMPAIR_EOP_ON 0x20
+
+/* Set the impairment 'knob' (INJ_IMPAIR_x), returns EC_SUCCESS or EC_ERROR_x */
+int impair_set(int knob, int val);
+/*
+ * Apply the impairments to the bit image 'raw' of the message 'header', the
+ * result is in the spare part of the packet buffer (or 'raw' if there is
+ * nothing to do) and 'bit_len' is updated.
+ */
+const uint32_t *impair_image(const uint32_t *raw, int *bit_len,
+			     uint16_t header);
+/* Around the transmission of the last image : TX clock to its rate and back */
+void impair_clock(int on);
+
+/* Largest number of samples averaged by the CC readings */
+#define INJ_CC_AVG_MAX 256
+
 enum inj_get {
 	INJ_GET_CC       = 0,  /* CC1/CC2 voltages in mV */
 	INJ_GET_VBUS     = 1,  /* VBUS voltage in mV and current in mA */
 	INJ_GET_VCONN    = 2, /* VCONN voltage in mV and current in mA */
 	INJ_GET_POLARITY = 3, /* Current polarity (INJ_POL_CC) */
+	INJ_GET_TIMING   = 4, /* Timing histogram arg2 (INJ_TIMING_x) */
+			      /* as INJ_TIMING_WORDS words */
+	INJ_GET_SEND_AT  = 5, /* Last INJ_CMD_SEND_AT actual delay in us */
+	INJ_GET_RES_SCHED = 6, /* Resistor steps applied, and steps of the */
+			       /* schedule in the bits 15:8. At an index, */
+			       /* the hardware timer at the start then at */
+			       /* each step applied follow */
+};
+
+/* INJ_CMD_GET index appending the value to the result ring instead */
+#define INJ_GET_RING 0xffff
+
+/* Size of the result ring (power of 2) */
+#define INJ_RESULT_COUNT 32
+
+/* Timestamped INJ_CMD_GET result, drained with INJ_BIN_RESULTS */
+struct inj_result {
+	uint32_t ts;    /* hardware timer in us */
+	uint16_t param; /* INJ_GET_x */
+	uint16_t seq;   /* result counter : a gap means dropped results */
+	uint32_t value;
+} __packed;
+
+/*
+ * Message timing histograms of the tracing session, in microseconds :
+ * count, min, max, sum, then INJ_TIMING_BINS bins where the bin N counts
+ * the values in [2^N, 2^(N+1)[ (the first and last bins are open-ended).
+ */
+enum inj_timing {
+	INJ_TIMING_GOODCRC  = 0, /* end of a message to the GoodCRC start */
+	INJ_TIMING_RESPONSE = 1, /* end of a Request to Accept/Reject/Wait */
+	INJ_TIMING_GAP      = 2, /* end of a frame to the next frame start */
+	INJ_TIMING_COUNT
+};
+
+#define INJ_TIMING_BINS  16
+#define INJ_TIMING_WORDS (4 + INJ_TIMING_BINS)
+
+/* FSM scratch registers */
+#define INJ_REG_COUNT 8
+
+/* Sources for INJ_CMD_LOAD */
+enum inj_src {
+	INJ_SRC_IMM     = 0, /* arg0 value */
+	INJ_SRC_REG     = 1, /* register arg0 */
+	INJ_SRC_BUF     = 2, /* command buffer word at index arg0 */
+	INJ_SRC_RX_HEAD = 3, /* header of the last received packet */
+	INJ_SRC_RX_TYPE = 4, /* message type of the last received packet */
+	INJ_SRC_RX_CNT  = 5, /* data objects count of the last packet */
+	INJ_SRC_RX_DATA = 6, /* data object arg0 of the last packet */
+	INJ_SRC_EXPCT   = 7, /* 1 if the last INJ_CMD_EXPCT got its packet */
+	INJ_SRC_TRIES   = 8, /* transmissions of the last INJ_CMD_SEND_RETRY */
+			     /* until its GoodCRC, 0 if none came */
+	INJ_SRC_VIOLS   = 9, /* violations found by the conformance checker */
+};
+
+/* Conditions for INJ_CMD_BRANCH, comparisons are unsigned */
+enum inj_cond {
+	INJ_COND_EQ   = 0, /* equal */
+	INJ_COND_NE   = 1, /* not equal */
+	INJ_COND_LT   = 2, /* lower than */
+	INJ_COND_GE   = 3, /* greater or equal */
+	INJ_COND_ANY  = 4, /* at least one bit in common */
+	INJ_COND_NONE = 5, /* no bit in common */
 };
 
 enum inj_res {
@@ -80,9 +253,468 @@ enum trace_mode {
 	TRACE_MODE_OFF = 0,
 	TRACE_MODE_RAW = 1,
 	TRACE_MODE_ON  = 2,
+	TRACE_MODE_DUAL = 3, /* text trace of both CC lines from the sniffer */
+};
+
+/*
+ * Trace filter rule : the rules are checked in order before tracing a packet,
+ * the first matching one decides and the packets matching none are traced.
+ *   [15]    action : 1 = trace, 0 = drop
+ *   [14]    match the SOP type
+ *   [13]    match the power role
+ *   [12]    match the data role
+ *   [11]    match the message type
+ *   [10:8]  SOP type (TCPC_TX_x), 7 for RX errors
+ *   [7]     rule enabled
+ *   [6]     power role
+ *   [5]     data role
+ *   [4]     data message
+ *   [3:0]   message type
+ */
+#define TRACE_RULE_PASS       (1 << 15)
+#define TRACE_RULE_MATCH_SOP  (1 << 14)
+#define TRACE_RULE_MATCH_PR   (1 << 13)
+#define TRACE_RULE_MATCH_DR   (1 << 12)
+#define TRACE_RULE_MATCH_TYPE (1 << 11)
+#define TRACE_RULE_SOP(s)     (((s) & 7) << 8)
+#define TRACE_RULE_ENABLE     (1 << 7)
+#define TRACE_RULE_PR         (1 << 6)
+#define TRACE_RULE_DR         (1 << 5)
+#define TRACE_RULE_DATA       (1 << 4)
+#define TRACE_RULE_TYPE(t)    ((t) & 0xF)
+
+/* Fuzzer mutation policy : mask of the mutations applied to the seed */
+#define FUZZ_BIT_FLIP   (1 << 0) /* flip 1 to 3 header or payload bits */
+#define FUZZ_HEADER     (1 << 1) /* randomize one header field */
+#define FUZZ_LENGTH     (1 << 2) /* send a payload not matching the count */
+#define FUZZ_BAD_CRC    (1 << 3) /* flip one CRC bit */
+#define FUZZ_ALL        0xf
+
+/* Fuzzer anomalous responses, reported through the packet trace */
+enum fuzz_anomaly {
+	FUZZ_OK = 0,
+	FUZZ_NO_GOODCRC,  /* no answer to a valid packet */
+	FUZZ_HARD_RESET,  /* the DUT sent a Hard Reset */
+	FUZZ_UNEXPECTED,  /* answer other than a GoodCRC */
+	FUZZ_ACKED_CRC,   /* GoodCRC for a packet with a bad CRC */
+};
+
+/* tReceive max : from the end of a message to the end of its GoodCRC */
+#define GOODCRC_RECEIVE_US 1100
+
+/* Protocol violations found by the conformance checker ('check') */
+enum check_viol {
+	CHECK_OK = 0,
+	CHECK_MSGID,      /* MessageID other than the previous one + 1 */
+	CHECK_NO_GOODCRC, /* no GoodCRC within tReceive */
+	CHECK_RETRIES,    /* more transmissions than 1 + nRetryCount */
+	CHECK_GOODCRC,    /* GoodCRC acknowledging no pending message */
+	CHECK_RESPONSE,   /* response after its sender timer, or none */
+	CHECK_COUNT
 };
 
-/* Number of words in the FSM command/data buffer  */
+/* Number of trace filter rules */
+#define TRACE_RULE_COUNT 8
+
+/* Number of words in the default FSM command/data buffer */
 #define INJ_CMD_COUNT 128
 
+/*
+ * Script slot in flash : a copy of the first 'count' words of the FSM buffer,
+ * checked by the CRC-32 of the words.
+ */
+struct inj_script {
+	uint32_t magic;   /* INJ_SCRIPT_MAGIC */
+	char name[16];
+	uint16_t count;   /* number of words */
+	uint16_t flags;   /* INJ_SCRIPT_x */
+	uint32_t crc;
+	uint32_t reserved;
+	uint32_t words[0];
+};
+
+#define INJ_SCRIPT_MAGIC 0x54504353 /* "SCPT" */
+#define INJ_SCRIPT_BOOT  (1 << 0)   /* loaded in the FSM buffer at boot */
+
+#define INJ_SCRIPT_MAX_WORDS ((INJ_SCRIPT_SLOT_SIZE - \
+			       sizeof(struct inj_script)) / sizeof(uint32_t))
+
+/*
+ * Capture profile : a struct inj_script with the INJ_CMD_SET words
+ * restoring the setup saved by 'tw profile save', executed at boot.
+ */
+#define INJ_PROFILE_MAGIC 0x4c465250 /* "PRFL" */
+/*
+ * A word per INJ_SET_x parameter and per trace filter rule at most, the
+ * image switches (INJ_SET_ROLE) carry the same words over the jump.
+ */
+#define INJ_PROFILE_MAX_WORDS (INJ_SET_CC_AVG + 1 + TRACE_RULE_COUNT)
+
+/*
+ * Offline capture log in flash ('caplog') : CAPLOG_PAGES erase pages used
+ * as a ring, the page with the highest 'seq' is the one being written. Each
+ * page starts with a struct caplog_page, followed by the records up to the
+ * first one whose 'size' is CAPLOG_END (still erased). A record is visible
+ * only once its first halfword is written, which is done last.
+ */
+struct caplog_page {
+	uint32_t magic;   /* CAPLOG_MAGIC */
+	uint32_t seq;     /* page counter, bumped at each new page */
+};
+
+#define CAPLOG_MAGIC 0x474f4c43 /* "CLOG" */
+#define CAPLOG_END   0xffff
+
+enum caplog_type {
+	CAPLOG_REC_PACKET = 1, /* PD header, then its data objects */
+	CAPLOG_REC_EXT    = 2, /* reassembled extended message data */
+	CAPLOG_REC_STATE  = 3, /* 'arg' : 1 if armed, 0 if disarmed */
+	CAPLOG_REC_DROPS  = 4, /* 'arg' : packets lost before this record */
+	CAPLOG_REC_VIOL   = 5, /* 'arg' : CHECK_x violation of the message */
+				 /* 'head', then its 32-bit value */
+	CAPLOG_REC_REPEAT = 6, /* repeats of the message 'head' until 'ts', */
+				 /* then their 32-bit count */
+};
+
+struct caplog_rec {
+	uint16_t size;    /* bytes with the header, multiple of 4 */
+	uint8_t type;     /* CAPLOG_REC_x */
+	uint8_t line;     /* CC line 1 or 2 in dual-line mode, else 0 */
+	uint32_t ts_lo;   /* system clock in us */
+	uint16_t ts_hi;   /* bits 32-47 of the system clock */
+	uint16_t head;    /* PD header */
+	int16_t sop;      /* packet type (TCPC_TX_x) or PD_RX_ERR_x */
+	uint16_t arg;     /* extended header, FUZZ_x anomaly, state, drops */
+			  /* or CHECK_x violation */
+	uint8_t data[0];  /* padded to a multiple of 4 bytes */
+} __packed;
+
+/*
+ * Binary transfers of the FSM command/data buffer on the USB command
+ * endpoint : a packet starting with INJ_BIN_MAGIC (which never starts a text
+ * command) is a struct inj_bin_req.
+ * - INJ_BIN_WRITE : the request is followed by 'count' words, in the same
+ *   packet and the next ones (every packet but the last one is full).
+ * - INJ_BIN_READ : the response is followed by 'count' words.
+ * - INJ_BIN_REPLAY : same as INJ_BIN_WRITE, but the words are appended to the
+ *   replay ring ('idx' must be 0). If the ring has not room for 'count'
+ *   words, the request is refused with EC_ERROR_BUSY and the host retries
+ *   later. The 'idx' of the response is the free space left in words.
+ *   It also feeds the raw bit image of a streamed waveform ('tw wave').
+ * - INJ_BIN_RESULTS : the response is followed by up to 'count' struct
+ *   inj_result taken from the result ring, its 'count' is the number of
+ *   results and 'crc' covers their words.
+ * - INJ_BIN_EXEC : the request is followed in the same packet by 'count'
+ *   FSM words executed at once by injector_exec() (the blocking and flow
+ *   control commands are refused), the response is followed by the result
+ *   of each word executed.
+ * - INJ_BIN_LOG_READ : the response is followed by the 'count' words of
+ *   the capture log region starting at the word 'idx', the records still
+ *   buffered in RAM are written to flash first. The words beyond the first
+ *   packet are streamed from the flash by the TX interrupt, so 'count' is
+ *   only bounded by the region, an interrupted read is resumed by a new
+ *   request from the first word missing.
+ * - INJ_BIN_BENCH : runs the benchmark 'idx' (INJ_BENCH_x, or INJ_BENCH_ALL
+ *   for all of them) 'count' times (0 for INJ_BENCH_RUNS), the response is
+ *   followed by a struct inj_bench per benchmark, 'count' is their words.
+ * - INJ_BIN_SESSION : the response is followed by the struct inj_session
+ *   summary of the traced PD session, 'count' is its words.
+ * - INJ_BIN_STATS : the response is followed by the struct inj_stats
+ *   traffic counters, 'count' is its words.
+ * - INJ_BIN_FLIGHT : the response is followed by up to 'count' words of the
+ *   struct inj_flight_rec held by the flight recorder, oldest first, from
+ *   the record 'idx'. Its 'idx' is the number of records held, its 'count'
+ *   the words returned.
+ * - INJ_BIN_TRACEPOINTS : same as INJ_BIN_FLIGHT for the struct
+ *   tracepoint_rec of the tracepoint ring (tracepoint.h), refused with
+ *   EC_ERROR_UNIMPLEMENTED without CONFIG_TRACEPOINTS.
+ * - INJ_BIN_TOKEN_LOG : the response is followed by up to 'count' words of
+ *   whole token log records (token_log.h), oldest first, which leave the
+ *   ring. Its 'count' is the words returned. Refused with
+ *   EC_ERROR_UNIMPLEMENTED without CONFIG_TOKEN_LOG.
+ * - INJ_BIN_UPDATE : same as INJ_BIN_WRITE ('idx' must be 0), the 'count'
+ *   words are the RW image, programmed as they arrive. The sniffer (RO) must
+ *   be running : EC_ERROR_ACCESS_DENIED from RW, the RO image is updated
+ *   with DFU. The whole image comes in one stream with no
+ *   acknowledgement but the USB flow control, the response 'crc' is the one
+ *   of the image read back from the flash once it is programmed.
+ * - INJ_BIN_FLASH_READ : same as INJ_BIN_LOG_READ for the whole flash,
+ *   'idx' is the word offset from its start.
+ * - INJ_BIN_DECODE : same as INJ_BIN_WRITE, but the 'count' words are the
+ *   'idx' 8-bit RX timer samples of a recorded packet (as dumped by
+ *   'tcpc dump 2'). Once all are received, they replace the RX buffer and
+ *   the unmodified pd_analyze_rx() decodes them as a received packet, timed
+ *   like the benchmarks. The response is followed by the struct inj_decode,
+ *   'count' is its words. PD sink image only (CONFIG_USB_PD_RX_REPLAY),
+ *   refused with EC_ERROR_UNIMPLEMENTED otherwise.
+ * - INJ_BIN_BOOKMARK : a packet holding the request alone, 'crc' is a tag
+ *   streamed with 'seq' by the sniffer as a bookmark record timestamped at
+ *   the reception of the packet. It is posted right from the endpoint
+ *   interrupt when no other packet is waiting, there is no response.
+ * - INJ_BIN_ECHO : the request is followed in the same packet by 'count'
+ *   words, sent back as they are after the response. The round trip of the
+ *   binary requests, with no other work on the device.
+ * - INJ_BIN_SINK : same as INJ_BIN_WRITE ('idx' is ignored), but the words
+ *   only go through the CRC, nothing is written : 'count' is not bounded by
+ *   the FSM buffer, the OUT bandwidth of the endpoint.
+ * 'seq' is a free tag from the host echoed in the response.
+ * 'crc' is the CRC-32 (as used by PD and zlib) of the little-endian words.
+ * Every other request gets a struct inj_bin_resp, all fields are
+ * little-endian.
+ */
+#define INJ_BIN_MAGIC 0xB1
+
+enum inj_bin_op {
+	INJ_BIN_WRITE  = 1,
+	INJ_BIN_READ   = 2,
+	INJ_BIN_REPLAY = 3,
+	INJ_BIN_RESULTS = 4,
+	INJ_BIN_EXEC    = 5,
+	INJ_BIN_LOG_READ = 6,
+	INJ_BIN_BENCH    = 7,
+	INJ_BIN_SESSION  = 8,
+	INJ_BIN_STATS    = 9,
+	INJ_BIN_FLIGHT   = 10,
+	INJ_BIN_TRACEPOINTS = 11,
+	INJ_BIN_TOKEN_LOG   = 12,
+	INJ_BIN_UPDATE      = 13,
+	INJ_BIN_FLASH_READ  = 14,
+	INJ_BIN_DECODE      = 15,
+	INJ_BIN_BOOKMARK    = 16,
+	INJ_BIN_ECHO        = 17,
+	INJ_BIN_SINK        = 18,
+};
+
+struct inj_bin_req {
+	uint8_t magic;
+	uint8_t op;       /* INJ_BIN_x */
+	uint16_t idx;     /* first word index */
+	uint16_t count;   /* number of words */
+	uint16_t seq;
+	uint32_t crc;     /* CRC-32 of the written words */
+} __packed;
+
+/*
+ * Replay record : delay in microseconds from the start of the previous
+ * message (or the start of the replay), PD header in the low 16 bits of the
+ * next word, then the payload objects. INJ_REPLAY_END as the delay ends the
+ * replay, it can be sent alone.
+ */
+#define INJ_REPLAY_END 0xffffffff
+#define INJ_REPLAY_WORDS(cnt) (2 + (cnt))
+
+struct inj_bin_resp {
+	uint8_t magic;
+	uint8_t op;
+	uint16_t status;  /* EC_SUCCESS or EC_ERROR_x */
+	uint16_t idx;
+	uint16_t count;
+	uint32_t crc;     /* CRC-32 of the words written or read */
+	uint16_t seq;
+	uint16_t reserved;
+} __packed;
+
+/* Benchmarks of the hot paths, see bench.c */
+enum inj_bench_id {
+	INJ_BENCH_USBRAM = 0, /* memcpy_to_usbram() of a 64-byte packet */
+	INJ_BENCH_DECODE,     /* pd_analyze_rx() of a 7-object message */
+	INJ_BENCH_CRC_HW,     /* CRC-32 of 64 bytes, CRC unit */
+	INJ_BENCH_CRC_SW,     /* CRC-32 of 64 bytes, nibble table */
+	INJ_BENCH_ENCODE,     /* prepare_message() of a 7-object message */
+	INJ_BENCH_PRINTF,     /* snprintf() of a trace line */
+	INJ_BENCH_INA,        /* ina2xx_read() of the VBUS voltage */
+	INJ_BENCH_FIND_CMD,   /* console command lookup */
+	INJ_BENCH_DMA,        /* capture DMA request behind a bulk copy */
+	INJ_BENCH_COUNT
+};
+#define INJ_BENCH_ALL 0xffff
+#define INJ_BENCH_RUNS 64
+
+/* INJ_BIN_BENCH result, 'runs' is 0 if the benchmark could not run */
+struct inj_bench {
+	uint32_t runs;
+	uint32_t cycles; /* core cycles of all the runs, loop overhead removed */
+	uint32_t bytes;  /* processed by each run */
+	uint32_t clock;  /* core clock in Hz */
+};
+
+/* Run the benchmark 'id' 'runs' times, returns EC_SUCCESS or EC_ERROR_x */
+int bench_run(int id, int runs, struct inj_bench *res);
+
+/* Samples of an INJ_BIN_DECODE packet, the RX buffer takes fewer */
+#define INJ_DECODE_MAX_SAMPLES 1024
+
+/* INJ_BIN_DECODE result */
+struct inj_decode {
+	int16_t type;      /* TCPC_TX_x, or PD_RX_ERR_x if negative */
+	uint16_t head;     /* PD header */
+	uint16_t error;    /* PD_DECODE_x : where the decoding stopped */
+	uint16_t samples;  /* loaded into the RX buffer */
+	uint32_t cycles;   /* core cycles of pd_analyze_rx(), fastest run */
+	uint32_t clock;    /* core clock in Hz */
+	uint32_t payload[7];
+};
+
+/*
+ * Decode the 'count' recorded RX samples 'samples' with pd_analyze_rx(),
+ * returns EC_SUCCESS or EC_ERROR_x
+ */
+int bench_decode(const uint8_t *samples, int count, struct inj_decode *res);
+
+/* inj_session flags : the fields which are filled */
+#define INJ_SESSION_CAPS     (1 << 0) /* Source_Capabilities seen */
+#define INJ_SESSION_RDO      (1 << 1) /* a Request was accepted */
+#define INJ_SESSION_CONTRACT (1 << 2) /* PS_RDY after the Accept */
+#define INJ_SESSION_SRC_DFP  (1 << 3) /* the source is the DFP */
+#define INJ_SESSION_SWAPPED  (1 << 4) /* a PR_Swap was accepted */
+/* inj_session ident[] and svids[] are filled */
+#define INJ_SESSION_IDENT(sop) (1 << (8 + (sop)))
+#define INJ_SESSION_SVIDS(sop) (1 << (10 + (sop)))
+
+/* Alternate modes entered at once */
+#define INJ_SESSION_MODES 4
+
+/* Cached ACK of a structured VDM : header then the VDOs */
+struct inj_session_vdm {
+	uint8_t cnt;       /* data objects */
+	uint8_t reserved[3];
+	uint32_t vdo[7];
+};
+
+/*
+ * Summary of the PD session seen by the tracer ('trace on' or 'trace raw'),
+ * from its decoded SOP and SOP' messages, reset by 'session clear'. The
+ * times are the raw microsecond timer values of the message starts, to be
+ * compared with 'now'.
+ */
+struct inj_session {
+	uint32_t seq;      /* changes with every update */
+	uint32_t now;      /* raw timer value when read */
+	uint16_t flags;    /* INJ_SESSION_x */
+	uint8_t line;      /* CC line of the last Source_Capabilities */
+	uint8_t rev;       /* specification revision of the last SOP header */
+	uint8_t caps_cnt;
+	uint8_t mode_cnt;
+	uint16_t hard_resets;
+	uint32_t caps[7];  /* last Source_Capabilities PDOs */
+	uint32_t rdo;      /* accepted Request */
+	uint32_t caps_ts;
+	uint32_t accept_ts;
+	uint32_t ps_rdy_ts;
+	uint32_t modes[INJ_SESSION_MODES]; /* SVID << 16 | object position */
+	struct inj_session_vdm ident[2];   /* Discover Identity, SOP / SOP' */
+	struct inj_session_vdm svids[2];   /* Discover SVIDs, SOP / SOP' */
+};
+
+/* inj_stats errors[] : where the decoding of a packet stopped */
+enum inj_stats_err {
+	INJ_STATS_ERR_PREAMBLE = 0,
+	INJ_STATS_ERR_SOP,
+	INJ_STATS_ERR_DATA,     /* invalid symbol or too long */
+	INJ_STATS_ERR_CRC,
+	INJ_STATS_ERR_EOP,
+	INJ_STATS_ERR_COUNT
+};
+/* Names of the errors and of the inj_stats sop[] packet types (stats.c) */
+extern const char * const inj_stats_err_name[INJ_STATS_ERR_COUNT];
+extern const char * const inj_stats_sop_name[7];
+
+/* Sliding windows of the CC bus utilization, in seconds */
+#define INJ_STATS_WINDOWS { 1, 10, 60 }
+#define INJ_STATS_WINDOW_COUNT 3
+
+/*
+ * Traffic counters kept by the sniffer image whether or not a trace runs,
+ * from the packets decoded by the sniffer or the tracer. They wrap around :
+ * the host takes the difference between two samples.
+ */
+struct inj_stats {
+	uint32_t uptime;   /* seconds since boot when read */
+	uint32_t sop[7];   /* per TCPC_TX_SOP* type, Hard and Cable Resets */
+	uint32_t errors[INJ_STATS_ERR_COUNT];
+	/* CC busy time over the INJ_STATS_WINDOWS, in 1/100 % */
+	uint16_t util[INJ_STATS_WINDOW_COUNT];
+	uint16_t reserved;
+	/* per message type : control, data and extended (types 0-15) */
+	uint16_t ctrl[32];
+	uint16_t data[32];
+	uint16_t ext[16];
+};
+
+/* inj_flight_rec kind : TCPC_TX_x packet type, or error INJ_STATS_ERR_x */
+#define INJ_FLIGHT_ERROR(err) (0x80 | (err))
+/* Freeze sources of the flight recorder */
+#define INJ_FLIGHT_FREEZE_HRST (1 << 0) /* Hard Reset received */
+#define INJ_FLIGHT_FREEZE_TRIG (1 << 1) /* sniffer capture trigger fired */
+
+/*
+ * Flight recorder record : a packet decoded on the RX path (the sniffer
+ * decoder, or the tracer while it runs), or where its decoding failed.
+ */
+struct inj_flight_rec {
+	uint32_t ts;   /* hardware timer in us */
+	uint8_t kind;  /* TCPC_TX_x or INJ_FLIGHT_ERROR(INJ_STATS_ERR_x) */
+	uint8_t line;  /* CC line 1 or 2 */
+	uint16_t head; /* PD header, 0 for the resets and errors */
+	uint32_t obj;  /* first data object, 0 if none */
+};
+
+/*
+ * Vendor control requests to the command interface : each one executes a
+ * single FSM word with injector_exec(), e.g. INJ_SET_RECORD (channel mask),
+ * INJ_SET_TRACE, INJ_SET_RX_THRESH or INJ_SET_RESISTORx, without the
+ * console parser.
+ * - bRequest : INJ_CMD_x, the command of the word
+ * - wValue   : arg0
+ * - wIndex   : interface number, arg1 and arg2 (INJ_CTRL_INDEX())
+ * - wLength  : 0 for an OUT request, or at least 4 for an IN request whose
+ *   data stage is the 32-bit result of the word
+ * The status (or data) stage is NAKed until the word has been executed and
+ * STALLed if it failed.
+ */
+#define INJ_CTRL_INDEX(iface, arg1, arg2) \
+	((iface) | (((arg1) & 0xf) << 8) | ((arg2) << 12))
+
+/*
+ * Event notifications : one record per transfer of the interrupt IN endpoint
+ * USB_EP_NOTIFY of the command interface (polled every frame), so the host
+ * learns of them without polling the console or the command endpoints.
+ */
+enum inj_notify_type {
+	INJ_NOTIFY_TRIGGER = 1, /* capture trigger fired, arg : its sources */
+	INJ_NOTIFY_FSM_DONE,    /* job of the injector task over (see below) */
+	INJ_NOTIFY_OFLOW,       /* arg : sniffer half-buffers overwritten */
+	INJ_NOTIFY_MODE,        /* arg : INJ_NOTIFY_MODE_x << 16 | new value */
+	INJ_NOTIFY_CHECK,       /* arg : CHECK_x violation | CC line << 8 */
+};
+/* Jobs of the injector task */
+enum inj_job {
+	INJ_JOB_FSM,
+	INJ_JOB_FUZZ,
+	INJ_JOB_MARGIN,
+	INJ_JOB_REPLAY,
+	INJ_JOB_SOAK,
+	INJ_JOB_WAVE,
+	INJ_JOB_BIST,
+};
+/* INJ_NOTIFY_FSM_DONE arg : INJ_JOB_x, aborted, and the FSM result */
+#define INJ_NOTIFY_JOB(arg)     ((arg) & 0x7f)
+#define INJ_NOTIFY_ABORTED      (1 << 7)
+#define INJ_NOTIFY_RESULT(arg)  ((int16_t)((arg) >> 16))
+/* INJ_NOTIFY_MODE arg : what changed */
+enum inj_notify_mode {
+	INJ_NOTIFY_MODE_TRACE = 0, /* trace mode, TRACE_MODE_x */
+	INJ_NOTIFY_MODE_QOS,       /* sniffer stream level, SNIFFER_QOS_x */
+	INJ_NOTIFY_MODE_ZEROCOPY,  /* 'sniffer zerocopy' line, 0 when off */
+};
+
+struct inj_notify {
+	uint8_t type;   /* INJ_NOTIFY_x */
+	uint8_t lost;   /* events dropped before this one, 255 for more */
+	uint16_t seq;   /* number of the event, the dropped ones counted */
+	uint32_t ts_lo; /* time of the event in us of the system clock */
+	uint32_t ts_hi;
+	uint32_t arg;
+} __packed;
+
 #endif /* __CROS_EC_INJECTOR_H */
@@ -0,0 +1,147 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Event notifications : a few events a host tool waits for (the capture
+ * trigger, the end of an injector job, a sniffer overflow, a mode change, a
+ * violation found by the checker) are posted as timestamped 16-byte records
+ * on an interrupt IN endpoint of the command interface. The host polls it
+ * every frame, so it learns of them within a millisecond and without
+ * reading the console or the command responses.
+ *
+ * The records wait in a RAM queue while the endpoint holds the previous one.
+ * When it is full, the new events are dropped and counted in the 'lost'
+ * field of the next record, the overflows are merged into the last one
+ * queued.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "injector.h"
+#include "registers.h"
+#include "task.h"
+#include "timer.h"
+#include "usb_descriptor.h"
+#include "usb_hw.h"
+#include "util.h"
+
+#define NOTIFY_QUEUE 8
+BUILD_ASSERT(POWER_OF_TWO(NOTIFY_QUEUE));
+BUILD_ASSERT(sizeof(struct inj_notify) == NOTIFY_PACKET_SIZE);
+
+const struct usb_endpoint_descriptor USB_EP_DESC(USB_IFACE_COMMAND, 2) = {
+	.bLength            = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType    = USB_DT_ENDPOINT,
+	.bEndpointAddress   = 0x80 | USB_EP_NOTIFY,
+	.bmAttributes       = 0x03 /* Interrupt IN */,
+	.wMaxPacketSize     = NOTIFY_PACKET_SIZE,
+	.bInterval          = 1
+};
+
+static usb_uint ep_buf[NOTIFY_PACKET_SIZE / sizeof(usb_uint)] __usb_ram;
+
+/* free running indexes, only updated with the interrupts disabled */
+static struct inj_notify queue[NOTIFY_QUEUE];
+static uint32_t q_head;
+static uint32_t q_tail;
+/* a record is armed on the endpoint */
+static int busy;
+static uint16_t seq;
+/* events dropped since the last record queued */
+static uint32_t lost;
+static uint32_t sent;
+static uint32_t dropped;
+
+/* Arm the oldest queued record, interrupts disabled */
+static void notify_send(void)
+{
+	if (q_head == q_tail)
+		return;
+	memcpy_to_usbram((void *)usb_sram_addr(ep_buf),
+			 &queue[q_tail % NOTIFY_QUEUE], NOTIFY_PACKET_SIZE);
+	q_tail++;
+	btable_ep[USB_EP_NOTIFY].tx_addr  = usb_sram_addr(ep_buf);
+	btable_ep[USB_EP_NOTIFY].tx_count = NOTIFY_PACKET_SIZE;
+	STM32_TOGGLE_EP(USB_EP_NOTIFY, EP_TX_MASK, EP_TX_VALID, 0);
+	busy = 1;
+}
+
+void notify_post(int type, uint32_t arg, uint64_t ts)
+{
+	uint32_t mask = get_int_mask();
+	struct inj_notify *n;
+
+	interrupt_disable();
+	n = &queue[(q_head - 1) % NOTIFY_QUEUE];
+	if (type == INJ_NOTIFY_OFLOW && q_head != q_tail &&
+	    n->type == INJ_NOTIFY_OFLOW) {
+		n->arg += arg;
+	} else if (q_head - q_tail >= NOTIFY_QUEUE) {
+		seq++;
+		lost++;
+		dropped++;
+	} else {
+		n = &queue[q_head % NOTIFY_QUEUE];
+		n->type = type;
+		n->lost = MIN(lost, 255);
+		n->seq = seq++;
+		n->ts_lo = ts;
+		n->ts_hi = ts >> 32;
+		n->arg = arg;
+		lost = 0;
+		q_head++;
+		if (!busy)
+			notify_send();
+	}
+	set_int_mask(mask);
+}
+
+static void notify_ep_tx(void)
+{
+	uint32_t mask = get_int_mask();
+
+	interrupt_disable();
+	STM32_TOGGLE_EP(USB_EP_NOTIFY, 0, 0, 0);
+	sent++;
+	busy = 0;
+	notify_send();
+	set_int_mask(mask);
+}
+
+static void notify_ep_event(enum usb_ep_event evt)
+{
+	if (evt != USB_EVENT_RESET)
+		return;
+
+	/* the events from before the enumeration are stale */
+	interrupt_disable();
+	q_tail = q_head;
+	busy = 0;
+	interrupt_enable();
+
+	btable_ep[USB_EP_NOTIFY].tx_addr  = usb_sram_addr(ep_buf);
+	btable_ep[USB_EP_NOTIFY].tx_count = 0;
+	STM32_USB_EP(USB_EP_NOTIFY) = (USB_EP_NOTIFY | /* Endpoint Addr */
+				       (2 << 4)      | /* TX NAK        */
+				       (3 << 9)      | /* Interrupt EP  */
+				       (0 << 12));     /* RX Disabled   */
+}
+
+USB_DECLARE_EP(USB_EP_NOTIFY, notify_ep_tx, notify_ep_tx, notify_ep_event);
+
+int notify_command(int argc, char **argv)
+{
+	if (argc >= 1) {
+		if (strcasecmp(argv[0], "clear"))
+			return EC_ERROR_PARAM2;
+		interrupt_disable();
+		/* the armed record stays, the host may be reading it */
+		q_tail = q_head;
+		lost = 0;
+		sent = dropped = 0;
+		interrupt_enable();
+	}
+	ccprintf("notify: %d sent, %d dropped, %d queued%s\n", sent, dropped,
+		 q_head - q_tail, busy ? ", 1 armed" : "");
+	return EC_SUCCESS;
+}
@@ -0,0 +1,258 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Charger characterization in the PD sink image : every capability
+ * advertised by the source is requested in turn, and the VBUS power monitor
+ * readings give the transition and the steady state of each contract.
+ *
+ * A step times the PS_RDY and the VBUS entering the PDO voltage range from
+ * the moment the new request is asked, then takes a window of readings once
+ * settled : average voltage, peak-to-peak ripple and average current. The
+ * console task runs the sweep, the PD task negotiates every contract as
+ * usual with the PDO forced by pd_set_request_pdo().
+ */
+
+#include "common.h"
+#include "console.h"
+#include "task.h"
+#include "timer.h"
+#include "usb_pd.h"
+#include "util.h"
+
+#define SWEEP_PORT 0
+/* Reading period when the power monitor is not running already */
+#define SWEEP_PERIOD 1000 /* us */
+/* Longest wait for the PS_RDY and the new VBUS level */
+#define SWEEP_TIMEOUT (PD_T_SENDER_RESPONSE + PD_T_PS_TRANSITION + \
+		       100 * MSEC)
+/* Delay after the PS_RDY before the steady state readings */
+#define SWEEP_SETTLE (20 * MSEC)
+/* Readings of the steady state window */
+#define SWEEP_WINDOW 32
+/* VBUS tolerance around the PDO voltage : 5% */
+#define SWEEP_TOLERANCE(mv) ((mv) / 20)
+
+enum sweep_status {
+	SWEEP_OK = 0,
+	SWEEP_SAME,      /* already the PDO voltage, nothing was requested */
+	SWEEP_SKIPPED,   /* augmented PDO, not requested */
+	SWEEP_NO_PS_RDY, /* rejected or no answer from the source */
+	SWEEP_NO_VBUS,   /* PS_RDY, but VBUS out of the PDO range */
+	SWEEP_OTHER,     /* PS_RDY for another voltage */
+	SWEEP_STATUS_COUNT
+};
+
+static const char * const status_names[SWEEP_STATUS_COUNT] = {
+	"ok", "same", "skipped", "no PS_RDY", "no VBUS", "other"
+};
+
+struct sweep_step {
+	uint32_t pdo;
+	uint8_t status;
+	uint32_t ps_rdy_us; /* from the request to the PS_RDY */
+	uint32_t vbus_us;   /* from the request to VBUS in the PDO range */
+	uint16_t mv;        /* steady state average */
+	uint16_t ripple_mv; /* steady state peak-to-peak */
+	int16_t ma;         /* steady state average */
+};
+
+/* Results of the last sweep */
+static struct sweep_step steps[PDO_MAX_OBJECTS];
+static int step_count;
+
+/* Contract of the last PS_RDY, 0 mV when there is none */
+static int contract_mv;
+static uint32_t contract_ts;
+static uint32_t contract_count;
+
+void pdsweep_contract(int mv)
+{
+	contract_mv = mv;
+	if (!mv)
+		return;
+	contract_ts = get_time().le.lo;
+	contract_count++;
+}
+
+static const char *pdo_type(uint32_t pdo)
+{
+	switch (pdo & PDO_TYPE_MASK) {
+	case PDO_TYPE_FIXED:
+		return "fix ";
+	case PDO_TYPE_BATTERY:
+		return "batt";
+	case PDO_TYPE_VARIABLE:
+		return "var ";
+	default:
+		return "aug ";
+	}
+}
+
+/* Voltage range of the PDO */
+static void pdo_voltages(uint32_t pdo, int *min_mv, int *max_mv)
+{
+	*min_mv = ((pdo >> 10) & 0x3ff) * 50;
+	if ((pdo & PDO_TYPE_MASK) == PDO_TYPE_FIXED)
+		*max_mv = *min_mv;
+	else
+		*max_mv = ((pdo >> 20) & 0x3ff) * 50;
+}
+
+static void sweep_flush(void)
+{
+	struct power_sample s;
+
+	while (powermon_read(&s, 1))
+		;
+}
+
+/* Average, ripple and current over a window of steady state readings */
+static void sweep_steady(struct sweep_step *st)
+{
+	struct power_sample s;
+	int n = 0, sum_mv = 0, sum_ma = 0;
+	int min_mv = 0, max_mv = 0;
+	uint64_t deadline;
+
+	sweep_flush();
+	deadline = get_time().val + SWEEP_WINDOW * 2 * powermon_get_period() +
+		   100 * MSEC;
+	while (n < SWEEP_WINDOW && get_time().val < deadline) {
+		if (!powermon_read(&s, 1)) {
+			msleep(1);
+			continue;
+		}
+		if (!n || s.mv < min_mv)
+			min_mv = s.mv;
+		if (!n || s.mv > max_mv)
+			max_mv = s.mv;
+		sum_mv += s.mv;
+		sum_ma += s.ma;
+		n++;
+	}
+	if (!n)
+		return;
+	st->mv = sum_mv / n;
+	st->ripple_mv = max_mv - min_mv;
+	st->ma = sum_ma / n;
+}
+
+static void sweep_step(int idx, uint32_t pdo, struct sweep_step *st)
+{
+	struct power_sample s;
+	uint32_t count = contract_count;
+	int reached = 0;
+	uint64_t t0;
+	int min_mv, max_mv, lo, hi;
+
+	memset(st, 0, sizeof(*st));
+	st->pdo = pdo;
+	if ((pdo & PDO_TYPE_MASK) == PDO_TYPE_AUGMENTED) {
+		st->status = SWEEP_SKIPPED;
+		return;
+	}
+	/* the protocol layer does not request the same voltage again */
+	pdo_voltages(pdo, &min_mv, &max_mv);
+	if (contract_mv == min_mv) {
+		st->status = SWEEP_SAME;
+		sweep_steady(st);
+		return;
+	}
+
+	lo = min_mv - SWEEP_TOLERANCE(min_mv);
+	hi = max_mv + SWEEP_TOLERANCE(max_mv);
+	sweep_flush();
+	t0 = get_time().val;
+	pd_set_request_pdo(idx);
+	pd_set_external_voltage_limit(SWEEP_PORT, PD_MAX_VOLTAGE_MV);
+
+	while (get_time().val < t0 + SWEEP_TIMEOUT &&
+	       (contract_count == count || !reached)) {
+		while (powermon_read(&s, 1))
+			if (!reached && s.ts >= t0 && s.mv >= lo &&
+			    s.mv <= hi) {
+				st->vbus_us = s.ts - t0;
+				reached = 1;
+			}
+		msleep(1);
+	}
+
+	if (contract_count == count) {
+		st->status = SWEEP_NO_PS_RDY;
+		return;
+	}
+	st->ps_rdy_us = contract_ts - (uint32_t)t0;
+	if (contract_mv != min_mv)
+		st->status = SWEEP_OTHER;
+	else if (!reached)
+		st->status = SWEEP_NO_VBUS;
+	msleep(SWEEP_SETTLE / MSEC);
+	sweep_steady(st);
+}
+
+static void sweep_print(void)
+{
+	const struct sweep_step *st;
+	int i, min_mv, max_mv;
+
+	ccprintf("#  PDO      type  mV          status    PS_RDY us VBUS us "
+		 "   mV  ripple    mA\n");
+	for (i = 0; i < step_count; i++) {
+		st = steps + i;
+		pdo_voltages(st->pdo, &min_mv, &max_mv);
+		ccprintf("%d  %08x %s %5d-%-5d %-9s %9d %7d %5d %7d %5d\n",
+			 i + 1, st->pdo, pdo_type(st->pdo), min_mv, max_mv,
+			 status_names[st->status], st->ps_rdy_us, st->vbus_us,
+			 st->mv, st->ripple_mv, st->ma);
+		cflush();
+	}
+}
+
+static int command_pdsweep(int argc, char **argv)
+{
+	const uint32_t *src_caps;
+	uint32_t caps[PDO_MAX_OBJECTS];
+	unsigned max_mv;
+	int i, cnt, started;
+
+	if (argc >= 2) {
+		if (strcasecmp(argv[1], "show"))
+			return EC_ERROR_PARAM1;
+		sweep_print();
+		return EC_SUCCESS;
+	}
+
+	/* a new Source_Capabilities may come along the sweep */
+	cnt = MIN(pd_get_src_caps(SWEEP_PORT, &src_caps), PDO_MAX_OBJECTS);
+	if (!cnt || !contract_mv) {
+		ccprintf("No contract\n");
+		return EC_ERROR_NOT_POWERED;
+	}
+	memcpy(caps, src_caps, cnt * sizeof(uint32_t));
+
+	started = !powermon_get_period();
+	if (started && powermon_set_period(SWEEP_PERIOD, 0))
+		return EC_ERROR_BUSY;
+	max_mv = pd_get_max_voltage();
+
+	step_count = 0;
+	for (i = 0; i < cnt && contract_mv; i++) {
+		sweep_step(i, caps[i], steps + i);
+		step_count++;
+	}
+
+	/* back to the contract of the usual policy */
+	pd_set_request_pdo(-1);
+	pd_set_external_voltage_limit(SWEEP_PORT, max_mv);
+	if (started)
+		powermon_set_period(0, 0);
+
+	sweep_print();
+	if (!contract_mv)
+		ccprintf("Contract lost\n");
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(pdsweep, command_pdsweep,
+			"[show]",
+			"Request every source PDO and measure VBUS");
@@ -0,0 +1,770 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * VBUS power monitor : periodic INA readings into a timestamped ring.
+ *
+ * In the alert mode, the INA asserts its ALERT pin when a conversion is
+ * ready and its interrupt schedules the reading, stamped with the time of
+ * the alert : no polling, and no I2C traffic between the conversions.
+ *
+ * The registers are read by a chain of interrupt-driven transfers : the hook
+ * task only starts the chain and stores the result, it does not wait for
+ * the bus in between.
+ *
+ * The INA also compares its conversions to an alert limit, the sniffer
+ * stream gets a record of every crossing (and may trigger on it) without
+ * any sampling going on.
+ *
+ * Every reading also goes into the session totals (energy, charge and
+ * extrema) so long soak tests need no reading stream to the host.
+ *
+ * The VCONN INA is powered down by default against leakage, the VCONN
+ * monitor keeps its latest reading cached when enabled so the readers do
+ * not wait for a conversion.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "hooks.h"
+#include "i2c.h"
+#include "ina2xx.h"
+#include "queue.h"
+#include "task.h"
+#include "timer.h"
+#include "util.h"
+
+/* Ring of readings, filled by the hook task */
+static struct queue const power_queue =
+	QUEUE_NULL(POWERMON_DEPTH, struct power_sample);
+/* Sampling period in us, 0 when stopped */
+static int power_period;
+/* Readings dropped because the ring was full */
+static uint32_t power_overruns;
+/* Sampling on the conversion ready alerts rather than on a timer */
+static int power_alert;
+/* Alert limit and its INA function (INA2XX_MASK_EN_x) */
+static enum power_limit limit_kind;
+static int limit_value;
+static uint16_t alert_functions;
+/* The last reading was beyond the limit */
+static int limit_hit;
+/* Time of the last conversion ready alert */
+static uint64_t alert_ts;
+/* Readings lost on I2C errors or timeouts */
+static uint32_t power_errors;
+/* Session totals, updated by the hook task */
+static struct power_energy power_energy;
+
+/* Registers read by a chain : the mask is only read in the alert mode */
+static const uint8_t chain_regs[] = {
+	INA2XX_REG_BUS_VOLT, INA2XX_REG_CURRENT, INA2XX_REG_MASK
+};
+static uint8_t chain_buf[ARRAY_SIZE(chain_regs)][2];
+static int chain_step;
+static int chain_len;
+static int chain_rv;
+/* Set while the chain holds the I2C lock */
+static int chain_busy;
+/* A chain of 3 reads takes 1.5 ms at 100 kHz, a stuck one is cancelled */
+#define CHAIN_TIMEOUT_US (10 * MSEC)
+static uint64_t chain_ts;
+
+/* INA readings of the VBUS line */
+#define POWERMON_INA 0
+/* INA readings of the VCONN line */
+#define VCONN_INA 1
+
+/* Conversion timing of the VBUS INA (INA2XX_PRESET_x), -1 to fit the period */
+static int power_preset = -1;
+
+/*
+ * Continuous bus and shunt conversions with the longest conversion time
+ * completing both within 'period' : every reading is a fresh sample, with
+ * the least noise the rate allows. A preset sets the timing instead.
+ */
+static void powermon_config(int period)
+{
+	int t = INA2XX_CONV_TIME_8244;
+
+	while (t > 0 && 2 * ina2xx_conv_time_us(t) > period)
+		t--;
+	ina2xx_write(POWERMON_INA, INA2XX_REG_CONFIG,
+		     INA2XX_CONFIG_MODE_SHUNT | INA2XX_CONFIG_MODE_BUS |
+		     INA2XX_CONFIG_MODE_CONT |
+		     INA2XX_CONFIG_SHUNT_CONV_TIME(t) |
+		     INA2XX_CONFIG_BUS_CONV_TIME(t) | INA2XX_CONFIG_AVG_1);
+	if (power_preset >= 0)
+		ina2xx_set_preset(POWERMON_INA, power_preset);
+}
+
+static int alert_sampling(void)
+{
+	return power_period && power_alert;
+}
+
+static void powermon_write_mask(void)
+{
+	ina2xx_write(POWERMON_INA, INA2XX_REG_MASK, alert_functions |
+		     (alert_sampling() ? INA2XX_MASK_EN_CNVR : 0));
+}
+
+int powermon_set_limit(enum power_limit kind, int limit)
+{
+	static const uint16_t functions[POWER_LIMIT_COUNT] = {
+		[POWER_LIMIT_V_OVER] = INA2XX_MASK_EN_BOL,
+		[POWER_LIMIT_V_UNDER] = INA2XX_MASK_EN_BUL,
+		[POWER_LIMIT_I_OVER] = INA2XX_MASK_EN_SOL,
+		[POWER_LIMIT_I_UNDER] = INA2XX_MASK_EN_SUL,
+	};
+	int reg;
+
+	switch (kind) {
+	case POWER_LIMIT_OFF:
+		reg = 0;
+		break;
+	case POWER_LIMIT_V_OVER:
+	case POWER_LIMIT_V_UNDER:
+		/* bus voltage, 1.25 mV/bit */
+		reg = limit * 100 / 125;
+		if (limit < 0 || reg > 0x7fff)
+			return EC_ERROR_INVAL;
+		break;
+	case POWER_LIMIT_I_OVER:
+	case POWER_LIMIT_I_UNDER:
+		/* shunt voltage, or current on the INA260 */
+		reg = INA2XX_ALERT_MA(limit, INA_SENSE_MOHMS);
+		if (reg < -32768 || reg > 32767)
+			return EC_ERROR_INVAL;
+		break;
+	default:
+		return EC_ERROR_INVAL;
+	}
+
+	limit_kind = kind;
+	limit_value = kind ? limit : 0;
+	limit_hit = 0;
+	alert_functions = functions[kind];
+	ina2xx_write(POWERMON_INA, INA2XX_REG_ALERT, reg);
+	powermon_write_mask();
+	return EC_SUCCESS;
+}
+
+enum power_limit powermon_get_limit(int *limit)
+{
+	*limit = limit_value;
+	return limit_kind;
+}
+
+static void powermon_sample(void);
+DECLARE_DEFERRED(powermon_sample);
+
+void powermon_alert(void)
+{
+	if (!alert_sampling()) {
+		/* transparent alert pin : asserted once per excursion */
+#ifdef HAS_TASK_SNIFFER
+		sniffer_power_alert(get_time().val);
+#endif
+		return;
+	}
+	alert_ts = get_time().val;
+	hook_call_deferred(&powermon_sample_data, 0);
+}
+
+static uint16_t chain_reg(int step)
+{
+	return (chain_buf[step][0] << 8) | chain_buf[step][1];
+}
+
+static void energy_add(const struct power_sample *s)
+{
+	struct power_energy *en = &power_energy;
+	int64_t dt;
+
+	if (!en->count) {
+		en->min_mv = en->max_mv = s->mv;
+		en->min_ma = en->max_ma = s->ma;
+		en->min_mw = en->max_mw = s->mw;
+		/* nothing to integrate before the first reading */
+		dt = 0;
+	} else {
+		en->min_mv = MIN(en->min_mv, s->mv);
+		en->max_mv = MAX(en->max_mv, s->mv);
+		en->min_ma = MIN(en->min_ma, s->ma);
+		en->max_ma = MAX(en->max_ma, s->ma);
+		en->min_mw = MIN(en->min_mw, s->mw);
+		en->max_mw = MAX(en->max_mw, s->mw);
+		dt = s->ts - en->last;
+	}
+	en->energy_nj += dt * s->mw;
+	en->charge_nc += dt * s->ma;
+	en->last = s->ts;
+	en->count++;
+}
+
+void powermon_energy(struct power_energy *en)
+{
+	/* consistent copy against the hook task */
+	interrupt_disable();
+	*en = power_energy;
+	interrupt_enable();
+}
+
+void powermon_energy_reset(void)
+{
+	interrupt_disable();
+	memset(&power_energy, 0, sizeof(power_energy));
+	power_energy.start = get_time().val;
+	interrupt_enable();
+}
+
+static void powermon_done(void);
+DECLARE_DEFERRED(powermon_done);
+
+/*
+ * The chain is stuck : its cancelled read completes it with an error, which
+ * releases the bus. Nothing else does in the alert mode, as no alert comes.
+ */
+static void powermon_timeout(void)
+{
+	if (chain_busy)
+		i2c_xfer_async_cancel(I2C_PORT_MASTER);
+}
+DECLARE_DEFERRED(powermon_timeout);
+
+/* Called from the I2C interrupt : start the next read of the chain */
+static void powermon_read_done(void *priv, int rv)
+{
+	if (!rv && ++chain_step < chain_len) {
+		rv = ina2xx_read_async(POWERMON_INA, chain_regs[chain_step],
+				       chain_buf[chain_step], powermon_read_done,
+				       NULL);
+		if (!rv)
+			return;
+	}
+	chain_rv = rv;
+	hook_call_deferred(&powermon_done_data, 0);
+}
+
+static void powermon_done(void)
+{
+	struct power_sample s;
+	uint16_t mask;
+
+	hook_call_deferred(&powermon_timeout_data, -1);
+	i2c_lock(I2C_PORT_MASTER, 0);
+	chain_busy = 0;
+	if (chain_rv) {
+		power_errors++;
+		return;
+	}
+	if (!power_period)
+		return;
+
+	/* the power is computed rather than read */
+	s.mv = INA2XX_BUS_MV((int)chain_reg(0));
+	s.ma = INA2XX_CURR_MA((int)(int16_t)chain_reg(1));
+	s.mw = (int)s.mv * s.ma / 1000;
+	s.ts = chain_ts;
+	if (chain_len > 2) {
+		/* reading the flags has released the ALERT pin */
+		mask = chain_reg(2);
+#ifdef HAS_TASK_SNIFFER
+		/* the flag is set on every conversion beyond the limit */
+		if ((mask & INA2XX_MASK_EN_AFF) && !limit_hit)
+			sniffer_power_alert(chain_ts);
+#endif
+		limit_hit = !!(mask & INA2XX_MASK_EN_AFF);
+		if (!(mask & INA2XX_MASK_EN_CVRF))
+			return;
+	}
+	interrupt_disable();
+	energy_add(&s);
+	interrupt_enable();
+#ifdef HAS_TASK_SNIFFER
+	pps_power_sample(&s);
+	ptrans_power_sample(&s);
+#endif
+	if (!queue_add_unit(&power_queue, &s)) {
+		power_overruns++;
+		return;
+	}
+#ifdef HAS_TASK_SNIFFER
+	sniffer_power_sample();
+#endif
+}
+
+static void powermon_sample(void)
+{
+	if (!power_period)
+		return;
+	if (!power_alert)
+		hook_call_deferred(&powermon_sample_data, power_period);
+
+	if (chain_busy) {
+		/* the bus has been stuck for a whole period : give up */
+		i2c_xfer_async_cancel(I2C_PORT_MASTER);
+		return;
+	}
+
+	i2c_lock(I2C_PORT_MASTER, 1);
+	chain_busy = 1;
+	chain_step = 0;
+	chain_len = power_alert ? 3 : 2;
+	chain_ts = power_alert ? alert_ts : get_time().val;
+	if (ina2xx_read_async(POWERMON_INA, chain_regs[0], chain_buf[0],
+			      powermon_read_done, NULL)) {
+		chain_busy = 0;
+		i2c_lock(I2C_PORT_MASTER, 0);
+		power_errors++;
+		return;
+	}
+	hook_call_deferred(&powermon_timeout_data, CHAIN_TIMEOUT_US);
+}
+
+/* I2C bit times of a register read : 2 addresses, pointer and 2 bytes */
+#define READ_BITS 50
+
+/* Shortest period leaving the bus time for the reads of a sample */
+static int powermon_min_period(int alert)
+{
+	int khz = i2c_freq_to_khz(i2c_get_freq(I2C_PORT_MASTER));
+	int t = (alert ? 3 : 2) * READ_BITS * 1000 / khz;
+
+	return MAX(t, POWERMON_MIN_PERIOD);
+}
+
+int powermon_set_period(int period_us, int alert)
+{
+	if (period_us && period_us < powermon_min_period(alert))
+		return EC_ERROR_INVAL;
+
+	/* a new session when starting */
+	if (period_us && !power_period)
+		powermon_energy_reset();
+	power_period = period_us;
+	power_alert = alert;
+	powermon_write_mask();
+	if (period_us) {
+		queue_advance_head(&power_queue, queue_count(&power_queue));
+		power_overruns = 0;
+		power_errors = 0;
+		powermon_config(period_us);
+		alert_ts = get_time().val;
+		/* timer : first reading now, alert : clear a pending flag */
+		hook_call_deferred(&powermon_sample_data, 0);
+	} else {
+		hook_call_deferred(&powermon_sample_data, -1);
+		/* back to the board default : 1.1 ms conversions */
+		ina2xx_write(POWERMON_INA, INA2XX_REG_CONFIG, 0x8000);
+	}
+	return EC_SUCCESS;
+}
+
+int powermon_get_period(void)
+{
+	return power_period;
+}
+
+int powermon_set_preset(int preset)
+{
+	int period;
+
+	if (preset >= INA2XX_PRESET_COUNT)
+		return EC_ERROR_INVAL;
+	power_preset = preset < 0 ? -1 : preset;
+	if (!power_period)
+		return EC_SUCCESS;
+	if (power_preset < 0) {
+		powermon_config(power_period);
+		return EC_SUCCESS;
+	}
+	/* one reading per averaged conversion, no more */
+	period = MAX(ina2xx_preset_period(power_preset),
+		     powermon_min_period(power_alert));
+	return powermon_set_period(period, power_alert);
+}
+
+int powermon_get_preset(void)
+{
+	return power_preset;
+}
+
+int powermon_peek(struct power_sample *s)
+{
+	return queue_peek_units(&power_queue, s, 0, 1);
+}
+
+int powermon_read(struct power_sample *s, int count)
+{
+	return queue_remove_units(&power_queue, s, count);
+}
+
+uint32_t powermon_overruns(void)
+{
+	return power_overruns;
+}
+
+void powermon_stats(struct power_stats *st)
+{
+	struct power_sample s;
+	int i, n = queue_count(&power_queue);
+	int sum_mv = 0, sum_ma = 0;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < n; i++) {
+		if (!queue_peek_units(&power_queue, &s, i, 1))
+			break;
+		if (!i || s.mv < st->min_mv)
+			st->min_mv = s.mv;
+		if (!i || s.mv > st->max_mv)
+			st->max_mv = s.mv;
+		if (!i || s.ma < st->min_ma)
+			st->min_ma = s.ma;
+		if (!i || s.ma > st->max_ma)
+			st->max_ma = s.ma;
+		if (!i)
+			st->first = s.ts;
+		st->last = s.ts;
+		sum_mv += s.mv;
+		sum_ma += s.ma;
+		st->count++;
+	}
+	if (st->count) {
+		st->avg_mv = sum_mv / st->count;
+		st->avg_ma = sum_ma / st->count;
+	}
+}
+
+/* Print 'v' in thousandths of 'unit' with the sign */
+static void print_milli(const char *name, int64_t v, const char *unit)
+{
+	uint64_t a = v < 0 ? -v : v;
+
+	ccprintf("  %s: %s%d.%03d %s\n", name, v < 0 ? "-" : "",
+		 (int)(a / 1000), (int)(a % 1000), unit);
+}
+
+static int command_energy(int argc, char **argv)
+{
+	struct power_energy en;
+
+	if (argc >= 3) {
+		if (strcasecmp(argv[2], "reset"))
+			return EC_ERROR_PARAM2;
+		powermon_energy_reset();
+	}
+
+	powermon_energy(&en);
+	ccprintf("Session: %d readings over %d s\n", en.count,
+		 en.count ? (int)((en.last - en.start) / SECOND) : 0);
+	if (!en.count)
+		return EC_SUCCESS;
+	/* nJ and nC to uWh and uAh */
+	print_milli("Energy", en.energy_nj / 3600000, "mWh");
+	print_milli("Charge", en.charge_nc / 3600000, "mAh");
+	ccprintf("  VBUS: %d..%d mV\n", en.min_mv, en.max_mv);
+	ccprintf("  Current: %d..%d mA\n", en.min_ma, en.max_ma);
+	ccprintf("  Power: %d..%d mW\n", en.min_mw, en.max_mw);
+	return EC_SUCCESS;
+}
+
+/*
+ * VCONN monitor
+ */
+static enum vconn_monitor vconn_mode;
+static int vconn_period;
+static struct {
+	uint64_t ts; /* 0 until the first reading */
+	int mv;
+	int ma;
+} vconn_last;
+
+/* Bus and shunt conversions of 1.1 ms, as the board default */
+#define VCONN_CONFIG(mode) \
+	(INA2XX_CONFIG_MODE_SHUNT | INA2XX_CONFIG_MODE_BUS | (mode) | \
+	 INA2XX_CONFIG_SHUNT_CONV_TIME(INA2XX_CONV_TIME_1100) | \
+	 INA2XX_CONFIG_BUS_CONV_TIME(INA2XX_CONV_TIME_1100) | INA2XX_CONFIG_AVG_1)
+
+static void vconn_sample(void);
+DECLARE_DEFERRED(vconn_sample);
+
+static void vconn_sample(void)
+{
+	if (vconn_mode == VCONN_MON_OFF)
+		return;
+	/* the hook task holds the bus for a power reading : come back */
+	if (chain_busy) {
+		hook_call_deferred(&vconn_sample_data, POWERMON_MIN_PERIOD);
+		return;
+	}
+	hook_call_deferred(&vconn_sample_data, vconn_period);
+
+	/* results of the previous one-shot, or of the continuous conversions */
+	if (INA2XX_MASK_EN_CVRF & ina2xx_read(VCONN_INA, INA2XX_REG_MASK) ||
+	    vconn_mode == VCONN_MON_CONT) {
+		vconn_last.mv = ina2xx_get_voltage(VCONN_INA);
+		vconn_last.ma = ina2xx_get_current(VCONN_INA);
+		vconn_last.ts = get_time().val;
+	}
+	if (vconn_mode == VCONN_MON_DUTY)
+		ina2xx_write(VCONN_INA, INA2XX_REG_CONFIG,
+			     VCONN_CONFIG(INA2XX_CONFIG_MODE_TRG));
+}
+
+int vconn_monitor_set(enum vconn_monitor mode, int period_us)
+{
+	if (mode >= VCONN_MON_COUNT ||
+	    (mode && period_us < VCONN_MON_MIN_PERIOD))
+		return EC_ERROR_INVAL;
+
+	vconn_mode = mode;
+	vconn_period = mode ? period_us : 0;
+	vconn_last.ts = 0;
+	switch (mode) {
+	case VCONN_MON_OFF:
+		hook_call_deferred(&vconn_sample_data, -1);
+		break;
+	case VCONN_MON_DUTY:
+		ina2xx_write(VCONN_INA, INA2XX_REG_CONFIG,
+			     VCONN_CONFIG(INA2XX_CONFIG_MODE_TRG));
+		break;
+	default:
+		ina2xx_write(VCONN_INA, INA2XX_REG_CONFIG,
+			     VCONN_CONFIG(INA2XX_CONFIG_MODE_CONT));
+		break;
+	}
+	if (mode)
+		/* the first conversions are done by then */
+		hook_call_deferred(&vconn_sample_data, VCONN_MON_MIN_PERIOD);
+	else
+		ina2xx_write(VCONN_INA, INA2XX_REG_CONFIG,
+			     INA2XX_CONFIG_MODE_PWRDWN);
+	return EC_SUCCESS;
+}
+
+enum vconn_monitor vconn_monitor_get_mode(int *period_us)
+{
+	*period_us = vconn_period;
+	return vconn_mode;
+}
+
+int vconn_monitor_read(int *mv, int *ma)
+{
+	int i;
+
+	if (vconn_mode != VCONN_MON_OFF) {
+		*mv = vconn_last.mv;
+		*ma = vconn_last.ma;
+		return vconn_last.ts ? EC_SUCCESS : EC_ERROR_BUSY;
+	}
+
+	/* fastest one-shot : 2 conversions of 140 us, then power down */
+	ina2xx_write(VCONN_INA, INA2XX_REG_CONFIG, INA2XX_CONFIG_MODE_SHUNT |
+		     INA2XX_CONFIG_MODE_BUS | INA2XX_CONFIG_MODE_TRG |
+		     INA2XX_CONFIG_SHUNT_CONV_TIME(INA2XX_CONV_TIME_140) |
+		     INA2XX_CONFIG_BUS_CONV_TIME(INA2XX_CONV_TIME_140));
+	for (i = 0; i < 4; i++) {
+		usleep(2 * 140);
+		if (INA2XX_MASK_EN_CVRF &
+		    ina2xx_read(VCONN_INA, INA2XX_REG_MASK))
+			break;
+	}
+	*mv = ina2xx_get_voltage(VCONN_INA);
+	*ma = ina2xx_get_current(VCONN_INA);
+	ina2xx_write(VCONN_INA, INA2XX_REG_CONFIG, INA2XX_CONFIG_MODE_PWRDWN);
+	return EC_SUCCESS;
+}
+
+static int command_vconn(int argc, char **argv)
+{
+	static const char * const mode_names[VCONN_MON_COUNT] = {
+		[VCONN_MON_OFF] = "off",
+		[VCONN_MON_DUTY] = "duty",
+		[VCONN_MON_CONT] = "cont",
+	};
+	int mode, period = 0;
+	char *e;
+
+	if (argc >= 3) {
+		for (mode = 0; mode < VCONN_MON_COUNT; mode++)
+			if (!strcasecmp(argv[2], mode_names[mode]))
+				break;
+		if (mode == VCONN_MON_COUNT)
+			return EC_ERROR_PARAM2;
+		if (mode) {
+			if (argc < 4)
+				return EC_ERROR_PARAM_COUNT;
+			period = strtoi(argv[3], &e, 10) * MSEC;
+			if (*e)
+				return EC_ERROR_PARAM3;
+		}
+		if (vconn_monitor_set(mode, period))
+			return EC_ERROR_PARAM3;
+	}
+
+	mode = vconn_monitor_get_mode(&period);
+	ccprintf("VCONN monitor: %s", mode_names[mode]);
+	if (mode)
+		ccprintf(" every %d ms", period / MSEC);
+	if (vconn_last.ts)
+		ccprintf(", %d mV %d mA %d ms ago", vconn_last.mv,
+			 vconn_last.ma,
+			 (int)((get_time().val - vconn_last.ts) / MSEC));
+	ccprintf("\n");
+	return EC_SUCCESS;
+}
+
+static const char * const limit_names[POWER_LIMIT_COUNT] = {
+	[POWER_LIMIT_OFF] = "off",
+	[POWER_LIMIT_V_OVER] = "vover",
+	[POWER_LIMIT_V_UNDER] = "vunder",
+	[POWER_LIMIT_I_OVER] = "iover",
+	[POWER_LIMIT_I_UNDER] = "iunder",
+};
+
+static int command_limit(int argc, char **argv)
+{
+	int kind, limit = 0;
+	char *e;
+
+	if (argc >= 3) {
+		for (kind = 0; kind < POWER_LIMIT_COUNT; kind++)
+			if (!strcasecmp(argv[2], limit_names[kind]))
+				break;
+		if (kind == POWER_LIMIT_COUNT)
+			return EC_ERROR_PARAM2;
+		if (kind) {
+			if (argc < 4)
+				return EC_ERROR_PARAM_COUNT;
+			limit = strtoi(argv[3], &e, 10);
+			if (*e)
+				return EC_ERROR_PARAM3;
+		}
+		if (powermon_set_limit(kind, limit))
+			return EC_ERROR_PARAM3;
+	}
+
+	kind = powermon_get_limit(&limit);
+	ccprintf("Limit: %s", limit_names[kind]);
+	if (kind)
+		ccprintf(" %d %s", limit, kind <= POWER_LIMIT_V_UNDER ?
+			 "mV" : "mA");
+	ccprintf("\n");
+	return EC_SUCCESS;
+}
+
+static const char * const preset_names[INA2XX_PRESET_COUNT] = {
+	[INA2XX_PRESET_FAST] = "fast",
+	[INA2XX_PRESET_DEFAULT] = "default",
+	[INA2XX_PRESET_SMOOTH] = "smooth",
+	[INA2XX_PRESET_PRECISE] = "precise",
+};
+
+static int command_preset(int argc, char **argv)
+{
+	int preset;
+
+	if (argc >= 3) {
+		for (preset = 0; preset < INA2XX_PRESET_COUNT; preset++)
+			if (!strcasecmp(argv[2], preset_names[preset]))
+				break;
+		if (preset == INA2XX_PRESET_COUNT) {
+			if (strcasecmp(argv[2], "auto"))
+				return EC_ERROR_PARAM2;
+			preset = -1;
+		}
+		if (powermon_set_preset(preset))
+			return EC_ERROR_PARAM2;
+	}
+
+	preset = powermon_get_preset();
+	if (preset < 0)
+		ccprintf("Preset: auto\n");
+	else
+		ccprintf("Preset: %s, a reading every %d us\n",
+			 preset_names[preset], ina2xx_preset_period(preset));
+	return EC_SUCCESS;
+}
+
+/*
+ * Reading 'i' of a dump : the ring has a single consumer, the console only
+ * looks at the readings while the sniffer task streams them.
+ */
+static int dump_sample(struct power_sample *s, int i)
+{
+#ifdef HAS_TASK_SNIFFER
+	if (sniffer_power_streaming())
+		return queue_peek_units(&power_queue, s, i, 1);
+#endif
+	return powermon_read(s, 1);
+}
+
+static int command_powermon(int argc, char **argv)
+{
+	struct power_sample s;
+	struct power_stats st;
+	char *e;
+	int i, n;
+
+	if (argc >= 2 && !strcasecmp(argv[1], "energy"))
+		return command_energy(argc, argv);
+	if (argc >= 2 && !strcasecmp(argv[1], "limit"))
+		return command_limit(argc, argv);
+	if (argc >= 2 && !strcasecmp(argv[1], "vconn"))
+		return command_vconn(argc, argv);
+	if (argc >= 2 && !strcasecmp(argv[1], "preset"))
+		return command_preset(argc, argv);
+
+	if (argc >= 2 && !strcasecmp(argv[1], "dump")) {
+		n = POWERMON_DEPTH;
+		if (argc >= 3) {
+			n = strtoi(argv[2], &e, 10);
+			if (*e || n <= 0)
+				return EC_ERROR_PARAM2;
+		}
+		for (i = 0; i < n && dump_sample(&s, i); i++) {
+			ccprintf("%.6ld %5d mV %5d mA %6d mW\n",
+				 s.ts, s.mv, s.ma, s.mw);
+			cflush();
+		}
+		return EC_SUCCESS;
+	}
+
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "off")) {
+			n = 0;
+		} else {
+			n = strtoi(argv[1], &e, 10);
+			if (*e || n <= 0)
+				return EC_ERROR_PARAM1;
+		}
+		if (argc >= 3 && strcasecmp(argv[2], "alert"))
+			return EC_ERROR_PARAM2;
+		if (powermon_set_period(n, argc >= 3))
+			return EC_ERROR_PARAM1;
+	}
+
+	if (!power_period) {
+		ccprintf("Power monitor: off\n");
+		return EC_SUCCESS;
+	}
+	powermon_stats(&st);
+	ccprintf("Power monitor: %s %d us, %d/%d readings, %d overruns, "
+		 "%d errors\n", power_alert ? "conversions within" : "every",
+		 power_period, st.count, POWERMON_DEPTH, power_overruns,
+		 power_errors);
+	if (st.count)
+		ccprintf("  %d..%d mV (avg %d) %d..%d mA (avg %d) "
+			 "over %d us\n", st.min_mv, st.max_mv, st.avg_mv,
+			 st.min_ma, st.max_ma, st.avg_ma,
+			 (int)(st.last - st.first));
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(powermon, command_powermon,
+			"[off|<period us> [alert]|dump [<count>]|"
+			"energy [reset]|limit [off|vover|vunder|iover|iunder "
+			"<mV|mA>]|vconn [off|duty|cont <ms>]|"
+			"preset [auto|fast|default|smooth|precise]]",
+			"VBUS power sampling into the reading ring");
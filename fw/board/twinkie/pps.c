@@ -0,0 +1,172 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * PPS step response : every accepted Request of a Programmable Power Supply
+ * APDO seen by the session tracker starts a step towards the requested
+ * voltage, measured on the VBUS readings of the power monitor.
+ *
+ * A step lasts PPS_WINDOW_US from the Accept, or until the next one. It has
+ * settled when the readings stay within the band around the target until
+ * its end : the settling time is the first reading of that last run. The
+ * overshoot is the farthest reading past the target, in the direction of
+ * the step.
+ *
+ * The session tracker (sniffer task) only posts the steps, the hook task
+ * reading the INA owns the measurement.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "task.h"
+#include "timer.h"
+#include "util.h"
+
+#define PPS_WINDOW_US (500 * MSEC)
+/* VBUS sampling period started by 'pps on' */
+#define PPS_PERIOD_US 1000
+/* Steps kept for the console */
+#define PPS_RESULTS 8
+
+struct pps_result {
+	uint32_t start;   /* raw timer value of the Accept */
+	uint16_t from_mv;
+	uint16_t to_mv;
+	int32_t settle;   /* us from the Accept, -1 if it never settled */
+	int16_t over_mv;  /* past the target, 0 if it never went past */
+};
+
+static int pps_enabled;
+/* band around the target in mV, 0 for 5 % of the target */
+static int pps_band;
+
+/* step posted by the session tracker */
+static struct {
+	uint32_t start;
+	uint16_t mv;
+	uint8_t pending;
+} post;
+
+/* step being measured by the hook task */
+static struct {
+	struct pps_result res;
+	uint8_t active;
+	uint8_t in_band;
+} step;
+static int last_mv;
+
+static struct pps_result results[PPS_RESULTS];
+static int result_count;
+
+void pps_step(uint32_t start, int mv)
+{
+	if (!pps_enabled)
+		return;
+	interrupt_disable();
+	post.start = start;
+	post.mv = mv;
+	post.pending = 1;
+	interrupt_enable();
+}
+
+static void print_result(const struct pps_result *r)
+{
+	ccprintf("PPS %d->%d mV: ", r->from_mv, r->to_mv);
+	if (r->settle < 0)
+		ccprintf("not settled in %d ms", PPS_WINDOW_US / MSEC);
+	else
+		ccprintf("settled in %d.%d ms", r->settle / MSEC,
+			 r->settle % MSEC / 100);
+	ccprintf(", overshoot %d mV\n", r->over_mv);
+}
+
+static void step_close(void)
+{
+	if (!step.in_band)
+		step.res.settle = -1;
+	results[result_count++ % PPS_RESULTS] = step.res;
+	step.active = 0;
+	print_result(&step.res);
+}
+
+void pps_power_sample(const struct power_sample *s)
+{
+	struct pps_result *r = &step.res;
+	int32_t elapsed;
+	int band, dev;
+
+	if (post.pending) {
+		if (step.active)
+			step_close();
+		interrupt_disable();
+		r->start = post.start;
+		r->to_mv = post.mv;
+		post.pending = 0;
+		interrupt_enable();
+		r->from_mv = last_mv;
+		r->over_mv = 0;
+		step.in_band = 0;
+		step.active = 1;
+	}
+	last_mv = s->mv;
+	elapsed = (uint32_t)s->ts - r->start;
+	/* the reading started before the Accept */
+	if (!step.active || elapsed < 0)
+		return;
+
+	dev = s->mv - r->to_mv;
+	band = pps_band ? pps_band : r->to_mv / 20;
+	if (dev <= band && dev >= -band) {
+		if (!step.in_band)
+			r->settle = elapsed;
+		step.in_band = 1;
+	} else {
+		step.in_band = 0;
+	}
+	/* past the target, going down for a step down */
+	if (r->to_mv < r->from_mv)
+		dev = -dev;
+	if (dev > r->over_mv)
+		r->over_mv = dev;
+
+	if (elapsed >= PPS_WINDOW_US)
+		step_close();
+}
+
+static int command_pps(int argc, char **argv)
+{
+	char *e;
+	int i;
+
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "on")) {
+			pps_enabled = 1;
+			if (!powermon_get_period())
+				powermon_set_period(PPS_PERIOD_US, 0);
+		} else if (!strcasecmp(argv[1], "off")) {
+			pps_enabled = 0;
+		} else if (!strcasecmp(argv[1], "clear")) {
+			result_count = 0;
+		} else if (!strcasecmp(argv[1], "band") && argc >= 3) {
+			i = strtoi(argv[2], &e, 0);
+			if (*e || i < 0)
+				return EC_ERROR_PARAM2;
+			pps_band = i;
+		} else {
+			return EC_ERROR_PARAM1;
+		}
+	}
+
+	ccprintf("PPS steps: %s, band ", pps_enabled ? "on" : "off");
+	if (pps_band)
+		ccprintf("%d mV", pps_band);
+	else
+		ccputs("5%");
+	ccprintf(", VBUS every %d us\n", powermon_get_period());
+	for (i = MAX(result_count - PPS_RESULTS, 0); i < result_count; i++)
+		print_result(results + i % PPS_RESULTS);
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(pps, command_pps,
+			"[on|off|clear|band <mV>]",
+			"Measure the VBUS steps of the PPS requests");
@@ -0,0 +1,257 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Statistical profiler : a timer interrupt above all the others samples the
+ * program counter it interrupted, in a task or in another interrupt handler.
+ * The samples of the flash code are counted in a histogram of the image, in
+ * bins of a power of two bytes, the last ones are kept as they are for the
+ * host to resolve against the ELF file (addr2line -e ec.RO.elf).
+ *
+ * The histogram and the raw samples live in the shared memory, from 'prof
+ * start' until 'prof off'.
+ *
+ * The handler reads EXC_RETURN in LR at the entry of the interrupt : the IRQ
+ * wrapper of the profiling build (CONFIG_TASK_PROFILING) hides it, the
+ * sampler is not available there.
+ */
+
+#include "clock.h"
+#include "common.h"
+#include "console.h"
+#include "hwtimer.h"
+#include "link_defs.h"
+#include "registers.h"
+#include "shared_mem.h"
+#include "task.h"
+#include "util.h"
+
+#define PROF_HZ_DEFAULT 1000
+#define PROF_HZ_MAX     20000
+/* Raw samples kept, the newest ones */
+#define PROF_RAW 128
+/* Smallest histogram bin : 16 bytes */
+#define PROF_SHIFT_MIN 4
+/* Bins printed by the console */
+#define PROF_TOP 10
+
+static struct {
+	uint16_t *bins;        /* histogram in the shared memory, NULL if off */
+	uint32_t *raw;         /* last raw samples, after the bins */
+	uint32_t nbins;
+	uint8_t shift;         /* log2 of the bin size */
+	uint8_t running;
+	uint16_t hz;
+	uint32_t samples;
+	uint32_t idle;         /* in the idle task */
+	uint32_t irq;          /* in an interrupt handler */
+	uint32_t ram;          /* in the code copied to RAM (__ram_code) */
+	uint32_t other;        /* out of the image */
+} prof = {
+	.hz = PROF_HZ_DEFAULT,
+};
+
+static uint32_t text_start(void)
+{
+	return (uint32_t)&__text_start;
+}
+
+static void prof_add(uint32_t pc, int handler)
+{
+	uint32_t bin = (pc - text_start()) >> prof.shift;
+
+	prof.raw[prof.samples++ % PROF_RAW] = pc;
+	if (handler)
+		prof.irq++;
+	if (pc >= (uint32_t)&__iram_text_start &&
+	    pc < (uint32_t)&__iram_text_end)
+		prof.ram++;
+	else if (bin < prof.nbins && prof.bins[bin] < 0xffff)
+		prof.bins[bin]++;
+	else if (bin >= prof.nbins)
+		prof.other++;
+}
+
+/*
+ * 'exc_return' is the EXC_RETURN of the interrupt, 'msp' and 'psp' the stack
+ * pointers at its entry : the exception frame is on the process stack if its
+ * bit 2 is set, the interrupted PC is its 7th word.
+ */
+void prof_sample(uint32_t exc_return, const uint32_t *msp,
+		 const uint32_t *psp)
+{
+	const uint32_t *frame = exc_return & 4 ? psp : msp;
+
+	STM32_TIM_SR(TIM_PROF) = 0;
+	if (!prof.running)
+		return;
+	/* thread mode : a task */
+	if ((exc_return & 8) && task_get_current() == TASK_ID_IDLE) {
+		prof.idle++;
+		return;
+	}
+	prof_add(frame[6], !(exc_return & 8));
+}
+
+#ifndef CONFIG_TASK_PROFILING
+/* Keep EXC_RETURN and the stack pointers as they were at the entry */
+void __attribute__((naked)) prof_interrupt(void)
+{
+	asm volatile(
+		"mov r0, lr\n"
+		"mrs r1, msp\n"
+		"mrs r2, psp\n"
+		"push {r0, lr}\n"
+		"bl prof_sample\n"
+		"pop {r0, pc}\n");
+}
+DECLARE_IRQ(STM32_IRQ_TIM6_DAC, prof_interrupt, 0);
+#endif
+
+static void prof_timer(int enable)
+{
+	if (!enable) {
+		STM32_TIM_CR1(TIM_PROF) = 0;
+		task_disable_irq(STM32_IRQ_TIM6_DAC);
+		__hw_timer_enable_clock(TIM_PROF, 0);
+		return;
+	}
+	/* 1us ticks */
+	__hw_timer_enable_clock(TIM_PROF, 1);
+	STM32_TIM_CR1(TIM_PROF) = 0x0004;
+	STM32_TIM_PSC(TIM_PROF) = clock_get_freq() / 1000000 - 1;
+	STM32_TIM_ARR(TIM_PROF) = 1000000 / prof.hz - 1;
+	/* reload the pre-scaler, then clear the update event */
+	STM32_TIM_EGR(TIM_PROF) = 0x0001;
+	STM32_TIM_SR(TIM_PROF) = 0;
+	STM32_TIM_DIER(TIM_PROF) = 0x0001;
+	task_enable_irq(STM32_IRQ_TIM6_DAC);
+	STM32_TIM_CR1(TIM_PROF) = 0x0005;
+}
+
+static void prof_release(void)
+{
+	prof_timer(0);
+	prof.running = 0;
+	if (prof.bins)
+		shared_mem_release(prof.bins);
+	prof.bins = NULL;
+}
+
+/* Take the shared memory : the raw samples, then the smallest bins fitting */
+static int prof_start(void)
+{
+	uint32_t size = (uint32_t)&__text_end - text_start();
+	uint32_t room = shared_mem_size() - PROF_RAW * sizeof(uint32_t);
+	char *mem;
+	int shift = PROF_SHIFT_MIN;
+
+#ifdef CONFIG_TASK_PROFILING
+	return EC_ERROR_UNIMPLEMENTED;
+#endif
+	while (((size >> shift) + 1) * sizeof(uint16_t) > room)
+		shift++;
+	prof.shift = shift;
+	prof.nbins = (size >> shift) + 1;
+	if (shared_mem_acquire(PROF_RAW * sizeof(uint32_t) +
+			       prof.nbins * sizeof(uint16_t), &mem))
+		return EC_ERROR_BUSY;
+	prof.raw = (uint32_t *)mem;
+	prof.bins = (uint16_t *)(prof.raw + PROF_RAW);
+	memset(prof.bins, 0, prof.nbins * sizeof(uint16_t));
+	prof.samples = prof.idle = prof.irq = prof.ram = prof.other = 0;
+	prof.running = 1;
+	prof_timer(1);
+	return EC_SUCCESS;
+}
+
+static void prof_print(void)
+{
+	uint32_t busy = prof.samples ? prof.samples : 1;
+	uint32_t mark = 0;
+	int i, top, best;
+
+	ccprintf("Profiler: %s at %d Hz, %d samples, %d idle\n",
+		 prof.running ? "on" : "off", prof.hz, prof.samples, prof.idle);
+	if (!prof.bins)
+		return;
+	ccprintf("%d in interrupts, %d in RAM code, %d elsewhere\n", prof.irq,
+		 prof.ram, prof.other);
+	/* the hottest bins, from the hottest one */
+	for (top = 0; top < PROF_TOP; top++) {
+		best = -1;
+		for (i = 0; i < prof.nbins; i++) {
+			if (!prof.bins[i] ||
+			    (mark && prof.bins[i] >= mark) ||
+			    (best >= 0 && prof.bins[i] <= prof.bins[best]))
+				continue;
+			best = i;
+		}
+		if (best < 0)
+			break;
+		/* equal counts : print all of them at this step */
+		for (i = best; i < prof.nbins; i++) {
+			if (prof.bins[i] != prof.bins[best])
+				continue;
+			ccprintf("%08x-%08x %5d %3d%%\n",
+				 text_start() + (i << prof.shift),
+				 text_start() + ((i + 1) << prof.shift) - 1,
+				 prof.bins[i], prof.bins[i] * 100 / busy);
+		}
+		mark = prof.bins[best];
+		cflush();
+	}
+}
+
+/* The raw samples, oldest first, 8 per line */
+static void prof_dump(void)
+{
+	uint32_t n = MIN(prof.samples, PROF_RAW);
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		ccprintf("%08x%c", prof.raw[(prof.samples - n + i) % PROF_RAW],
+			 (i % 8 == 7 || i == n - 1) ? '\n' : ' ');
+		if (i % 8 == 7)
+			cflush();
+	}
+}
+
+static int command_prof(int argc, char **argv)
+{
+	char *e;
+	int hz, rv;
+
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "start")) {
+			if (argc >= 3) {
+				hz = strtoi(argv[2], &e, 0);
+				if (*e || hz <= 0 || hz > PROF_HZ_MAX)
+					return EC_ERROR_PARAM2;
+				prof.hz = hz;
+			}
+			prof_release();
+			rv = prof_start();
+			if (rv)
+				return rv;
+		} else if (!strcasecmp(argv[1], "stop")) {
+			prof.running = 0;
+			prof_timer(0);
+		} else if (!strcasecmp(argv[1], "off")) {
+			prof_release();
+		} else if (!strcasecmp(argv[1], "dump")) {
+			if (!prof.bins)
+				return EC_ERROR_INVAL;
+			prof_dump();
+			return EC_SUCCESS;
+		} else {
+			return EC_ERROR_PARAM1;
+		}
+	}
+
+	prof_print();
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(prof, command_prof,
+			"[start [<hz>]|stop|off|dump]",
+			"Sample the interrupted program counter");
@@ -0,0 +1,326 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Power transition analyzer : every Request accepted and every hard reset
+ * seen by the session tracker opens a window on the VBUS readings of the
+ * power monitor, closed PTRANS_WINDOW_US later (PTRANS_RESET_WINDOW_US for a
+ * hard reset) or by the next one. The window is summed up in a single
+ * struct power_transition, printed and streamed as a record, so the host
+ * gets the timings of the contract changes without the raw readings.
+ *
+ * The accepted range is the voltage of a fixed PDO or of a PPS Request, the
+ * range of a variable or battery PDO, widened by the band : 5% by default.
+ * A hard reset goes back to vSafe5V, and its vSafe0V time gives the turn-on
+ * time of the source up to the settling.
+ *
+ * As for the PPS steps, the session tracker (sniffer task) only posts the
+ * events, the hook task reading the INA owns the measurement.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "task.h"
+#include "timer.h"
+#include "usb_pd.h"
+#include "util.h"
+
+/* tPSTransition is 550 ms at most, some more to watch VBUS after PS_RDY */
+#define PTRANS_WINDOW_US (1000 * MSEC)
+/* tSrcRecover is 1 s at most, then tSrcTurnOn 275 ms */
+#define PTRANS_RESET_WINDOW_US (2000 * MSEC)
+/* VBUS sampling period started by 'ptrans on' */
+#define PTRANS_PERIOD_US 1000
+#define PTRANS_VSAFE0_MV 800
+#define PTRANS_VSAFE5_MIN_MV 4750
+#define PTRANS_VSAFE5_MAX_MV 5500
+/* Transitions kept for the console */
+#define PTRANS_RESULTS 8
+
+static int ptrans_enabled;
+/* band around the accepted range in mV, 0 for 5 % of its top */
+static int ptrans_band;
+
+/* events posted by the session tracker */
+static struct {
+	uint32_t start;
+	uint32_t ps_rdy;
+	uint16_t lo_mv;
+	uint16_t hi_mv;
+	uint16_t flags;
+	uint8_t pending;
+	uint8_t ps_rdy_pending;
+} post;
+
+/* transition being measured by the hook task */
+static struct {
+	struct power_transition rec;
+	uint32_t start;
+	int32_t window;
+	uint32_t ps_rdy;
+	uint32_t prev_ts;
+	uint32_t settle_us;
+	uint32_t out_us;
+	int lo_mv;
+	int hi_mv;
+	uint8_t active;
+	uint8_t readings;
+	uint8_t in_band;
+} step;
+static int last_mv;
+
+static struct power_transition results[PTRANS_RESULTS];
+static int result_count;
+
+static void post_event(uint32_t start, int lo_mv, int hi_mv, int flags)
+{
+	if (!ptrans_enabled)
+		return;
+	interrupt_disable();
+	post.start = start;
+	post.lo_mv = lo_mv;
+	post.hi_mv = hi_mv;
+	post.flags = flags;
+	post.pending = 1;
+	post.ps_rdy_pending = 0;
+	interrupt_enable();
+}
+
+void ptrans_accept(uint32_t start, uint32_t pdo, uint32_t rdo)
+{
+	int min_mv = ((pdo >> 10) & 0x3ff) * 50;
+	int max_mv = ((pdo >> 20) & 0x3ff) * 50;
+
+	switch (pdo & PDO_TYPE_MASK) {
+	case PDO_TYPE_FIXED:
+		post_event(start, min_mv, min_mv, 0);
+		break;
+	case PDO_TYPE_AUGMENTED:
+		if (PDO_IS_PPS(pdo))
+			post_event(start, RDO_PPS_MV(rdo), RDO_PPS_MV(rdo),
+				   PTRANS_PPS);
+		break;
+	default:
+		post_event(start, min_mv, max_mv, 0);
+		break;
+	}
+}
+
+void ptrans_ps_rdy(uint32_t start)
+{
+	if (!ptrans_enabled)
+		return;
+	interrupt_disable();
+	post.ps_rdy = start;
+	post.ps_rdy_pending = 1;
+	interrupt_enable();
+}
+
+void ptrans_hard_reset(uint32_t start)
+{
+	post_event(start, PTRANS_VSAFE5_MIN_MV, PTRANS_VSAFE5_MAX_MV,
+		   PTRANS_HARD_RESET);
+}
+
+/* 'us' in 100 us, below PTRANS_NONE */
+static uint16_t to_100us(uint32_t us)
+{
+	return MIN(us / 100, PTRANS_NONE - 1);
+}
+
+static void print_time(const char *name, uint16_t t)
+{
+	if (t == PTRANS_NONE)
+		ccprintf(", no %s", name);
+	else
+		ccprintf(", %s %d.%d ms", name, t / 10, t % 10);
+}
+
+static void print_result(const struct power_transition *t)
+{
+	ccprintf("%s %d->%d mV (+/-%d)",
+		 t->flags & PTRANS_HARD_RESET ? "Hard reset" :
+		 t->flags & PTRANS_PPS ? "PPS" : "Contract",
+		 t->from_mv, t->to_mv, t->band_mv);
+	if (!(t->flags & PTRANS_HARD_RESET))
+		print_time("PS_RDY", t->ps_rdy);
+	print_time("left", t->leave);
+	if (t->flags & PTRANS_HARD_RESET)
+		print_time("vSafe0V", t->safe0);
+	print_time("in range", t->settle);
+	if (t->ps_rdy != PTRANS_NONE)
+		ccprintf(", out %d.%d ms after PS_RDY", t->out / 10,
+			 t->out % 10);
+	ccprintf(", slew %d mV/ms, overshoot %d mV%s\n", t->slew, t->over_mv,
+		 t->flags & PTRANS_CUT ? ", cut" : "");
+}
+
+static void step_close(uint64_t ts)
+{
+	struct power_transition *t = &step.rec;
+
+	t->accept_us = (uint32_t)ts - step.start;
+	t->settle = step.in_band ? to_100us(step.settle_us) : PTRANS_NONE;
+	t->out = to_100us(step.out_us);
+	results[result_count++ % PTRANS_RESULTS] = *t;
+	step.active = 0;
+	sniffer_power_transition(ts, t);
+	print_result(t);
+}
+
+static void step_open(void)
+{
+	struct power_transition *t = &step.rec;
+	int band;
+
+	interrupt_disable();
+	step.start = post.start;
+	step.lo_mv = post.lo_mv;
+	step.hi_mv = post.hi_mv;
+	t->flags = post.flags;
+	post.pending = 0;
+	interrupt_enable();
+
+	if (!(t->flags & PTRANS_HARD_RESET)) {
+		band = ptrans_band ? ptrans_band : step.hi_mv / 20;
+		step.lo_mv -= band;
+		step.hi_mv += band;
+	}
+	t->from_mv = last_mv;
+	t->to_mv = (step.lo_mv + step.hi_mv) / 2;
+	t->band_mv = (step.hi_mv - step.lo_mv) / 2;
+	t->ps_rdy = t->leave = t->safe0 = PTRANS_NONE;
+	t->slew = 0;
+	t->over_mv = 0;
+	step.window = t->flags & PTRANS_HARD_RESET ? PTRANS_RESET_WINDOW_US :
+						     PTRANS_WINDOW_US;
+	step.out_us = 0;
+	step.readings = 0;
+	step.in_band = 0;
+	step.active = 1;
+}
+
+/* Account the PS_RDY posted, if it belongs to the transition measured */
+static void step_ps_rdy(void)
+{
+	struct power_transition *t = &step.rec;
+	uint32_t ps_rdy;
+
+	interrupt_disable();
+	ps_rdy = post.ps_rdy;
+	post.ps_rdy_pending = 0;
+	interrupt_enable();
+
+	if (!step.active || (t->flags & PTRANS_HARD_RESET) ||
+	    t->ps_rdy != PTRANS_NONE || (int32_t)(ps_rdy - step.start) < 0)
+		return;
+	step.ps_rdy = ps_rdy;
+	t->ps_rdy = to_100us(ps_rdy - step.start);
+}
+
+void ptrans_power_sample(const struct power_sample *s)
+{
+	struct power_transition *t = &step.rec;
+	uint32_t now = s->ts;
+	int32_t elapsed, since;
+	int prev_mv = last_mv;
+	int dev, tol;
+
+	if (post.pending) {
+		if (step.active) {
+			t->flags |= PTRANS_CUT;
+			step_close(s->ts);
+		}
+		step_open();
+	}
+	if (post.ps_rdy_pending)
+		step_ps_rdy();
+	last_mv = s->mv;
+	elapsed = now - step.start;
+	/* the reading started before the Accept */
+	if (!step.active || elapsed < 0)
+		return;
+
+	tol = ptrans_band ? ptrans_band : t->from_mv / 20;
+	dev = s->mv - t->from_mv;
+	if (t->leave == PTRANS_NONE && (dev > tol || dev < -tol))
+		t->leave = to_100us(elapsed);
+	if (s->mv <= PTRANS_VSAFE0_MV)
+		t->safe0 = to_100us(elapsed);
+
+	if (s->mv >= step.lo_mv && s->mv <= step.hi_mv) {
+		if (!step.in_band)
+			step.settle_us = elapsed;
+		step.in_band = 1;
+	} else {
+		step.in_band = 0;
+	}
+	/* past the range, below it for a step down */
+	if (t->to_mv < t->from_mv)
+		dev = step.lo_mv - s->mv;
+	else
+		dev = s->mv - step.hi_mv;
+	if (dev > t->over_mv)
+		t->over_mv = dev;
+
+	if (step.readings && now != step.prev_ts) {
+		dev = s->mv - prev_mv;
+		if (dev < 0)
+			dev = -dev;
+		dev = dev * MSEC / (int32_t)(now - step.prev_ts);
+		if (dev > t->slew)
+			t->slew = MIN(dev, 0xffff);
+	}
+	/* out of the range since the previous reading, after the PS_RDY */
+	if (t->ps_rdy != PTRANS_NONE && !step.in_band) {
+		since = now - step.ps_rdy;
+		if (step.readings && (int32_t)(now - step.prev_ts) < since)
+			since = now - step.prev_ts;
+		if (since > 0)
+			step.out_us += since;
+	}
+	step.prev_ts = now;
+	step.readings = 1;
+
+	if (elapsed >= step.window)
+		step_close(s->ts);
+}
+
+static int command_ptrans(int argc, char **argv)
+{
+	char *e;
+	int i;
+
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "on")) {
+			ptrans_enabled = 1;
+			if (!powermon_get_period())
+				powermon_set_period(PTRANS_PERIOD_US, 0);
+		} else if (!strcasecmp(argv[1], "off")) {
+			ptrans_enabled = 0;
+		} else if (!strcasecmp(argv[1], "clear")) {
+			result_count = 0;
+		} else if (!strcasecmp(argv[1], "band") && argc >= 3) {
+			i = strtoi(argv[2], &e, 0);
+			if (*e || i < 0)
+				return EC_ERROR_PARAM2;
+			ptrans_band = i;
+		} else {
+			return EC_ERROR_PARAM1;
+		}
+	}
+
+	ccprintf("Power transitions: %s, band ",
+		 ptrans_enabled ? "on" : "off");
+	if (ptrans_band)
+		ccprintf("%d mV", ptrans_band);
+	else
+		ccputs("5%");
+	ccprintf(", VBUS every %d us\n", powermon_get_period());
+	for (i = MAX(result_count - PTRANS_RESULTS, 0); i < result_count; i++)
+		print_result(results + i % PTRANS_RESULTS);
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(ptrans, command_ptrans,
+			"[on|off|clear|band <mV>]",
+			"Time the VBUS transitions of the contract changes");
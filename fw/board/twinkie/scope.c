@@ -0,0 +1,124 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Scope trigger : a pulse on the SYNC pin for each packet of the tracer
+ * matching the filter, a Hard Reset, a CRC error, any decoding error or a
+ * message header, so a scope on CC captures the frames of interest only.
+ *
+ * The tracer decodes a packet after its EOP, in a time depending on its
+ * length and on the other tasks : the pulse waits until a fixed delay after
+ * the EOP, the frame then sits at the same place on the scope screen for
+ * every trigger. A packet decoded past that delay still gets its pulse,
+ * counted as late.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "hwtimer.h"
+#include "usb_pd.h"
+#include "usb_pd_tcpm.h"
+#include "util.h"
+
+#define SCOPE_HRST   (1 << 0) /* Hard Reset */
+#define SCOPE_CRC    (1 << 1) /* CRC error */
+#define SCOPE_ERROR  (1 << 2) /* any decoding error */
+#define SCOPE_HEADER (1 << 3) /* message header matching mask/value */
+
+/* Pulse delay from the EOP in us, past the decoding and the GoodCRC */
+#define SCOPE_DELAY_DEFAULT 400
+#define SCOPE_DELAY_MAX     5000
+
+static struct {
+	uint8_t sources;
+	uint16_t mask;
+	uint16_t value;
+	uint16_t delay;
+	uint32_t pulses;
+	uint32_t late;   /* decoded past the delay */
+	uint32_t busy;   /* the SYNC pin was used by the sync pulses */
+} scope = {
+	.delay = SCOPE_DELAY_DEFAULT,
+};
+
+static int scope_match(struct rx_header rx)
+{
+	if (rx.packet_type == TCPC_TX_HARD_RESET)
+		return scope.sources & SCOPE_HRST;
+	if (rx.packet_type == PD_RX_ERR_CRC &&
+	    (scope.sources & SCOPE_CRC))
+		return 1;
+	if (rx.packet_type < 0)
+		return scope.sources & SCOPE_ERROR;
+	return rx.packet_type <= TCPC_TX_SOP_DEBUG_PRIME_PRIME &&
+	       (scope.sources & SCOPE_HEADER) &&
+	       (rx.head & scope.mask) == scope.value;
+}
+
+void scope_packet(struct rx_header rx, uint32_t eop)
+{
+	uint32_t at = eop + scope.delay;
+
+	if (!scope.sources || !scope_match(rx))
+		return;
+	if ((int32_t)(ts_raw() - at) > 0)
+		scope.late++;
+	else
+		while ((int32_t)(ts_raw() - at) < 0)
+			;
+	if (sniffer_sync_trigger())
+		scope.busy++;
+	else
+		scope.pulses++;
+}
+
+static int command_scope(int argc, char **argv)
+{
+	char *e;
+	int i;
+
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "off")) {
+			scope.sources = 0;
+		} else if (!strcasecmp(argv[1], "hrst")) {
+			scope.sources |= SCOPE_HRST;
+		} else if (!strcasecmp(argv[1], "crc")) {
+			scope.sources |= SCOPE_CRC;
+		} else if (!strcasecmp(argv[1], "error")) {
+			scope.sources |= SCOPE_ERROR;
+		} else if (!strcasecmp(argv[1], "header") && argc >= 4) {
+			scope.mask = strtoi(argv[2], &e, 16);
+			if (*e)
+				return EC_ERROR_PARAM2;
+			scope.value = strtoi(argv[3], &e, 16);
+			if (*e)
+				return EC_ERROR_PARAM3;
+			scope.value &= scope.mask;
+			scope.sources |= SCOPE_HEADER;
+		} else if (!strcasecmp(argv[1], "delay") && argc >= 3) {
+			i = strtoi(argv[2], &e, 0);
+			if (*e || i < 0 || i > SCOPE_DELAY_MAX)
+				return EC_ERROR_PARAM2;
+			scope.delay = i;
+		} else if (!strcasecmp(argv[1], "clear")) {
+			scope.pulses = scope.late = scope.busy = 0;
+		} else {
+			return EC_ERROR_PARAM1;
+		}
+	}
+
+	ccprintf("Scope trigger:%s%s%s", scope.sources & SCOPE_HRST ?
+		 " hrst" : "", scope.sources & SCOPE_CRC ? " crc" : "",
+		 scope.sources & SCOPE_ERROR ? " error" : "");
+	if (scope.sources & SCOPE_HEADER)
+		ccprintf(" header %04x/%04x", scope.value, scope.mask);
+	ccprintf("%s, %d us after the EOP\n", scope.sources ? "" : " off",
+		 scope.delay);
+	ccprintf("%d pulses, %d late, %d busy\n", scope.pulses, scope.late,
+		 scope.busy);
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(scope, command_scope,
+			"[off|hrst|crc|error|header <mask> <val>|delay <us>"
+			"|clear]",
+			"Pulse the SYNC pin on the matching traced packets");
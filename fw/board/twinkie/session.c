@@ -0,0 +1,267 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Session tracker : the SOP and SOP' messages decoded by the tracer and sent
+ * by the injector keep a struct inj_session up to date (capabilities,
+ * contract, roles, alternate modes and discovery responses), so the host
+ * gets the state of the link in a single INJ_BIN_SESSION request instead of
+ * parsing the whole trace.
+ *
+ * The sniffer task is the only writer. 'seq' is odd while it updates the
+ * summary, the readers (running at a lower priority) copy it again until
+ * they get a stable one.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "hwtimer.h"
+#include "injector.h"
+#include "task.h"
+#include "timer.h"
+#include "usb_pd.h"
+#include "usb_pd_tcpm.h"
+#include "util.h"
+
+static struct inj_session session;
+
+/* messages waiting for their Accept */
+static uint32_t pending_rdo;
+static uint8_t request_pending;
+static uint8_t swap_pending;
+/* the PS_RDY will close the negotiation */
+static uint8_t ps_rdy_pending;
+
+void session_get(struct inj_session *out)
+{
+	uint32_t seq;
+
+	do {
+		seq = *(volatile uint32_t *)&session.seq;
+		memcpy(out, &session, sizeof(*out));
+	} while ((seq & 1) || seq != *(volatile uint32_t *)&session.seq);
+	out->now = ts_raw();
+}
+
+static void session_vdm(int sop, const uint32_t *payload, int cnt)
+{
+	uint32_t head = payload[0];
+	uint32_t mode = (head & 0xffff0000) | PD_VDO_OPOS(head);
+	struct inj_session_vdm *vdm;
+	int i, all;
+
+	if (!(head & VDO_SVDM_TYPE) || PD_VDO_CMDT(head) != CMDT_RSP_ACK)
+		return;
+
+	switch (PD_VDO_CMD(head)) {
+	case CMD_DISCOVER_IDENT:
+		vdm = session.ident + sop;
+		session.flags |= INJ_SESSION_IDENT(sop);
+		break;
+	case CMD_DISCOVER_SVID:
+		vdm = session.svids + sop;
+		session.flags |= INJ_SESSION_SVIDS(sop);
+		break;
+	case CMD_ENTER_MODE:
+		for (i = 0; i < session.mode_cnt; i++)
+			if (session.modes[i] == mode)
+				return;
+		if (sop == TCPC_TX_SOP && i < INJ_SESSION_MODES)
+			session.modes[session.mode_cnt++] = mode;
+		return;
+	case CMD_EXIT_MODE:
+		/* the object position 7 exits all the modes of the SVID */
+		all = PD_VDO_OPOS(head) == 7;
+		for (i = 0; i < session.mode_cnt; )
+			if (session.modes[i] == mode ||
+			    (all && session.modes[i] >> 16 == PD_VDO_VID(head)))
+				session.modes[i] =
+					session.modes[--session.mode_cnt];
+			else
+				i++;
+		return;
+	default:
+		return;
+	}
+	vdm->cnt = cnt;
+	memcpy(vdm->vdo, payload, cnt * sizeof(uint32_t));
+}
+
+/* Object of the last Source_Capabilities 'rdo' refers to, 0 if none */
+static uint32_t rdo_pdo(const struct inj_session *s, uint32_t rdo)
+{
+	int pos = RDO_POS(rdo);
+
+	if (!(s->flags & INJ_SESSION_CAPS) || !pos || pos > s->caps_cnt)
+		return 0;
+	return s->caps[pos - 1];
+}
+
+static uint32_t pps_apdo(const struct inj_session *s, uint32_t rdo)
+{
+	uint32_t pdo = rdo_pdo(s, rdo);
+
+	return PDO_IS_PPS(pdo) ? pdo : 0;
+}
+
+uint32_t session_pps_apdo(uint32_t rdo)
+{
+	return pps_apdo(&session, rdo);
+}
+
+static void session_ctrl(int type, uint32_t start)
+{
+	switch (type) {
+	case PD_CTRL_ACCEPT:
+		if (request_pending && session_pps_apdo(pending_rdo))
+			pps_step(start, RDO_PPS_MV(pending_rdo));
+		if (request_pending && rdo_pdo(&session, pending_rdo))
+			ptrans_accept(start, rdo_pdo(&session, pending_rdo),
+				      pending_rdo);
+		if (request_pending) {
+			session.rdo = pending_rdo;
+			session.accept_ts = start;
+			session.flags |= INJ_SESSION_RDO;
+			session.flags &= ~INJ_SESSION_CONTRACT;
+			ps_rdy_pending = 1;
+		}
+		if (swap_pending)
+			session.flags ^= INJ_SESSION_SWAPPED;
+		break;
+	case PD_CTRL_PS_RDY:
+		if (ps_rdy_pending) {
+			ptrans_ps_rdy(start);
+			session.ps_rdy_ts = start;
+			session.flags |= INJ_SESSION_CONTRACT;
+		}
+		ps_rdy_pending = 0;
+		break;
+	case PD_CTRL_PR_SWAP:
+		swap_pending = 1;
+		return;
+	}
+	request_pending = 0;
+	swap_pending = 0;
+}
+
+static void session_hard_reset(uint32_t start)
+{
+	ptrans_hard_reset(start);
+	session.flags &= ~(INJ_SESSION_RDO | INJ_SESSION_CONTRACT |
+			   INJ_SESSION_SWAPPED);
+	session.mode_cnt = 0;
+	session.hard_resets++;
+	request_pending = swap_pending = ps_rdy_pending = 0;
+}
+
+void session_packet(uint32_t start, struct rx_header rx,
+		    const uint32_t *payload, int line)
+{
+	uint16_t head = rx.head;
+	int cnt = PD_HEADER_CNT(head);
+	int type = PD_HEADER_TYPE(head);
+	int sop = rx.packet_type;
+
+	if (sop < 0 || (sop > TCPC_TX_SOP_PRIME && sop != TCPC_TX_HARD_RESET))
+		return;
+	if (sop != TCPC_TX_HARD_RESET && !cnt && type == PD_CTRL_GOOD_CRC)
+		return;
+
+	session.seq++;
+	if (sop == TCPC_TX_HARD_RESET) {
+		session_hard_reset(start);
+	} else if (sop == TCPC_TX_SOP_PRIME) {
+		if (cnt && type == PD_DATA_VENDOR_DEF)
+			session_vdm(sop, payload, cnt);
+	} else {
+		session.rev = (head >> 6) & 3;
+		/* the power role bit is only set by the source */
+		if (head & (1 << 8)) {
+			if (head & (1 << 5))
+				session.flags |= INJ_SESSION_SRC_DFP;
+			else
+				session.flags &= ~INJ_SESSION_SRC_DFP;
+		}
+		if (!cnt) {
+			session_ctrl(type, start);
+		} else if (type == PD_DATA_SOURCE_CAP) {
+			memcpy(session.caps, payload, cnt * sizeof(uint32_t));
+			session.caps_cnt = cnt;
+			session.caps_ts = start;
+			session.line = line;
+			session.flags |= INJ_SESSION_CAPS;
+			request_pending = 0;
+		} else if (type == PD_DATA_REQUEST) {
+			pending_rdo = payload[0];
+			request_pending = 1;
+		} else if (type == PD_DATA_VENDOR_DEF) {
+			session_vdm(sop, payload, cnt);
+		}
+	}
+	session.seq++;
+}
+
+static void print_vdm(const char *name, int filled,
+		      const struct inj_session_vdm *vdm)
+{
+	int i;
+
+	if (!filled)
+		return;
+	ccprintf("%s:", name);
+	for (i = 0; i < vdm->cnt; i++)
+		ccprintf(" %08x", vdm->vdo[i]);
+	ccputs("\n");
+}
+
+static int command_session(int argc, char **argv)
+{
+	struct inj_session s;
+	int i;
+
+	if (argc >= 2) {
+		if (strcasecmp(argv[1], "clear"))
+			return EC_ERROR_PARAM1;
+		/* the sniffer task must not update it meanwhile */
+		interrupt_disable();
+		memset((uint8_t *)&session + sizeof(session.seq), 0,
+		       sizeof(session) - sizeof(session.seq));
+		request_pending = swap_pending = ps_rdy_pending = 0;
+		session.seq += 2;
+		interrupt_enable();
+	}
+
+	session_get(&s);
+	ccprintf("PD rev %d, CC%d, %d hard resets, source %s%s\n",
+		 s.rev + 1, s.line, s.hard_resets,
+		 s.flags & INJ_SESSION_SRC_DFP ? "DFP" : "UFP",
+		 s.flags & INJ_SESSION_SWAPPED ? " (swapped)" : "");
+	if (s.flags & INJ_SESSION_CAPS) {
+		ccprintf("SRC_CAP -%d ms:", (s.now - s.caps_ts) / MSEC);
+		for (i = 0; i < s.caps_cnt; i++)
+			ccprintf(" %08x", s.caps[i]);
+		ccputs("\n");
+	}
+	if (s.flags & INJ_SESSION_RDO) {
+		ccprintf("RDO {%d} %08x accepted -%d ms", RDO_POS(s.rdo),
+			 s.rdo, (s.now - s.accept_ts) / MSEC);
+		if (pps_apdo(&s, s.rdo))
+			ccprintf(", PPS %dmV/%dmA", RDO_PPS_MV(s.rdo),
+				 RDO_PPS_MA(s.rdo));
+		if (s.flags & INJ_SESSION_CONTRACT)
+			ccprintf(", PS_RDY %d ms later",
+				 (s.ps_rdy_ts - s.accept_ts) / MSEC);
+		ccputs("\n");
+	}
+	for (i = 0; i < s.mode_cnt; i++)
+		ccprintf("mode %04x:%d\n", s.modes[i] >> 16,
+			 s.modes[i] & 0xffff);
+	print_vdm("DISCID", s.flags & INJ_SESSION_IDENT(0), s.ident);
+	print_vdm("DISCID'", s.flags & INJ_SESSION_IDENT(1), s.ident + 1);
+	print_vdm("DISCSVID", s.flags & INJ_SESSION_SVIDS(0), s.svids);
+	print_vdm("DISCSVID'", s.flags & INJ_SESSION_SVIDS(1), s.svids + 1);
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(session, command_session,
+			"[clear]",
+			"Show the PD session seen by the tracer");
@@ -4,6 +4,7 @@
  */
 
 #include "adc.h"
+#include "atomic.h"
 #include "common.h"
 #include "console.h"
 #include "dma.h"
@@ -11,20 +12,47 @@
 #include "hooks.h"
 #include "hwtimer.h"
 #include "injector.h"
+#include "mempool.h"
+#include "queue.h"
 #include "registers.h"
 #include "system.h"
 #include "task.h"
 #include "timer.h"
 #include "usb_pd.h"
 #include "usb_pd_config.h"
+#include "usb_pd_decode.h"
 #include "usb_pd_tcpm.h"
 #include "util.h"
+#include "vdm_dict.h"
 
-/* PD packet text tracing state : TRACE_MODE_OFF/RAW/ON */
+/* PD packet text tracing state : TRACE_MODE_OFF/RAW/ON/DUAL */
 int trace_mode;
 
+#ifndef HAS_TASK_SNIFFER
+/* the conformance checker only comes with the sniffer image */
+#define check_only() 0
+#endif
+
 /* The FSM is waiting for the following command (0 == None) */
 uint8_t expected_cmd;
+/* task blocked in expect_packet() */
+static task_id_t expected_task = TASK_ID_INVALID;
+
+/* Last packet successfully decoded by the tracer */
+static struct rx_header last_rx;
+static uint32_t last_payload[7];
+static uint32_t last_rx_count;
+
+struct rx_header trace_last_packet(uint32_t *payload)
+{
+	memcpy(payload, last_payload, sizeof(last_payload));
+	return last_rx;
+}
+
+uint32_t trace_rx_count(void)
+{
+	return last_rx_count;
+}
 
 static const char * const ctrl_msg_name[] = {
 	[0]                      = "RSVD-C0",
@@ -55,6 +83,25 @@ static const char * const data_msg_name[] = {
 	[PD_DATA_VENDOR_DEF]     = "VDM",
 };
 
+static const char * const ext_msg_name[] = {
+	[0]                            = "RSVD-E0",
+	[PD_EXT_SOURCE_CAP]            = "SRCCAPEXT",
+	[PD_EXT_STATUS]                = "STATUS",
+	[PD_EXT_GET_BATTERY_CAP]       = "GBATCAP",
+	[PD_EXT_GET_BATTERY_STATUS]    = "GBATSTAT",
+	[PD_EXT_BATTERY_CAP]           = "BATCAP",
+	[PD_EXT_GET_MANUFACTURER_INFO] = "GMFRINFO",
+	[PD_EXT_MANUFACTURER_INFO]     = "MFRINFO",
+	[PD_EXT_SECURITY_REQUEST]      = "SECREQ",
+	[PD_EXT_SECURITY_RESPONSE]     = "SECRSP",
+	[PD_EXT_FW_UPDATE_REQUEST]     = "FWUPREQ",
+	[PD_EXT_FW_UPDATE_RESPONSE]    = "FWUPRSP",
+	[PD_EXT_PPS_STATUS]            = "PPSSTAT",
+	[PD_EXT_COUNTRY_INFO]          = "CTRYINFO",
+	[PD_EXT_COUNTRY_CODES]         = "CTRYCODE",
+	[15]                           = "RSVD-E15",
+};
+
 static const char * const svdm_cmd_name[] = {
 	[CMD_DISCOVER_IDENT]     = "DISCID",
 	[CMD_DISCOVER_SVID]	 = "DISCSVID",
@@ -75,22 +122,73 @@ static const char * const svdm_cmdt_name[] = {
 
 static void print_pdo(uint32_t word)
 {
-	if ((word & PDO_TYPE_MASK) == PDO_TYPE_BATTERY)
-		ccprintf(" %dmV/%dmW", ((word>>10)&0x3ff)*50,
-			 (word&0x3ff)*250);
-	else
-		ccprintf(" %dmV/%dmA", ((word>>10)&0x3ff)*50,
-			 (word&0x3ff)*10);
+	int min_mv = ((word >> 10) & 0x3ff) * 50;
+	int max_mv = ((word >> 20) & 0x3ff) * 50;
+
+	switch (word & PDO_TYPE_MASK) {
+	case PDO_TYPE_FIXED:
+		ccprintf(" %dmV/%dmA", min_mv, (word & 0x3ff) * 10);
+		break;
+	case PDO_TYPE_BATTERY:
+		ccprintf(" %d-%dmV/%dmW", min_mv, max_mv,
+			 (word & 0x3ff) * 250);
+		break;
+	case PDO_TYPE_VARIABLE:
+		ccprintf(" %d-%dmV/%dmA", min_mv, max_mv,
+			 (word & 0x3ff) * 10);
+		break;
+	default:
+		if (PDO_IS_PPS(word))
+			ccprintf(" PPS %d-%dmV/%dmA", PDO_AUG_MIN_MV(word),
+				 PDO_AUG_MAX_MV(word), PDO_AUG_MAX_MA(word));
+		else
+			ccprintf(" APDO %08x", word);
+	}
 }
 
 static void print_rdo(uint32_t word)
 {
 	ccprintf("{%d} %08x", RDO_POS(word), word);
+#ifdef HAS_TASK_SNIFFER
+	/* the position is one of the last Source_Capabilities seen */
+	if (session_pps_apdo(word))
+		ccprintf(" PPS %dmV/%dmA", RDO_PPS_MV(word),
+			 RDO_PPS_MA(word));
+#endif
 }
 
-static void print_vdo(int idx, uint32_t word)
+static void print_fields(const struct vdm_dict *d, uint32_t word)
 {
-	if (idx == 0 && (word & VDO_SVDM_TYPE)) {
+	const struct vdo_field *f;
+	const char *sep = "{";
+	uint32_t val;
+
+	for (f = d->fields; f < d->fields + d->count; f++) {
+		val = f->width == 32 ? word :
+		      (word >> f->shift) & ((1 << f->width) - 1);
+		if (f->width == 1) {
+			if (!val)
+				continue;
+			ccprintf("%s%s", sep, f->name);
+		} else {
+			ccprintf("%s%s=%x", sep, f->name, val);
+		}
+		sep = " ";
+	}
+	ccputs(*sep == '{' ? "{}" : "}");
+}
+
+static void print_vdo(int sop, const uint32_t *payload, int idx)
+{
+	uint32_t word = payload[idx];
+	const struct vdm_dict *d;
+
+	if (idx && (payload[0] & VDO_SVDM_TYPE)) {
+		ccprintf(" %08x", word);
+		d = vdm_dict_find(sop, payload[0], idx);
+		if (d)
+			print_fields(d, word);
+	} else if (idx == 0 && (word & VDO_SVDM_TYPE)) {
 		const char *cmd = svdm_cmd_name[PD_VDO_CMD(word)];
 		const char *cmdt = svdm_cmdt_name[PD_VDO_CMDT(word)];
 		uint16_t vid = PD_VDO_VID(word);
@@ -102,7 +200,8 @@ static void print_vdo(int idx, uint32_t word)
 	}
 }
 
-static void print_packet(struct rx_header rx, uint32_t *payload)
+static void print_packet(timestamp_t ts, struct rx_header rx,
+			 uint32_t *payload)
 {
 	int i;
 	uint16_t head = rx.head;
@@ -116,24 +215,31 @@ static void print_packet(struct rx_header rx, uint32_t *payload)
 	case TCPC_TX_SOP:
 	case TCPC_TX_SOP_PRIME:
 	case TCPC_TX_SOP_PRIME_PRIME:
+	case TCPC_TX_SOP_DEBUG_PRIME:
+	case TCPC_TX_SOP_DEBUG_PRIME_PRIME:
 		break;
 	case PD_RX_ERR_INVAL:
-		ccprintf("%T TMOUT\n"); return;
+		ccprintf("%.6ld TMOUT\n", ts.val); return;
 	case TCPC_TX_HARD_RESET:
-		ccprintf("%T HARD-RST\n"); return;
+		ccprintf("%.6ld HARD-RST\n", ts.val); return;
 	case TCPC_TX_CABLE_RESET:
-		ccprintf("%T CABLE-RST\n"); return;
+		ccprintf("%.6ld CABLE-RST\n", ts.val); return;
 	default:
 		ccprintf("ERR %d\n", rx.packet_type); return;
 	}
 
-	name = cnt ? data_msg_name[typ] : ctrl_msg_name[typ];
+	if (cnt && PD_HEADER_EXT(head))
+		name = ext_msg_name[typ];
+	else
+		name = cnt ? data_msg_name[typ] : ctrl_msg_name[typ];
 	prole = head & (PD_ROLE_SOURCE << 8) ? "SRC" : "SNK";
-	ccprintf("%T %s/%d [%04x]%s", prole, id, head, name);
+	ccprintf("%.6ld %s/%d [%04x]%s", ts.val, prole, id, head, name);
 	if (!cnt) { /* Control message : we are done */
 		ccputs("\n");
 		return;
 	}
+	if (PD_HEADER_EXT(head)) /* single chunk : raw words */
+		typ = 0;
 	/* Print payload for data message */
 	for (i = 0; i < cnt; i++)
 		switch (typ) {
@@ -149,7 +255,7 @@ static void print_packet(struct rx_header rx, uint32_t *payload)
 				 payload[i] & 0xffff);
 			break;
 		case PD_DATA_VENDOR_DEF:
-			print_vdo(i, payload[i]);
+			print_vdo(rx.packet_type, payload, i);
 			break;
 		default:
 			ccprintf(" %08x", payload[i]);
@@ -157,11 +263,621 @@ static void print_packet(struct rx_header rx, uint32_t *payload)
 	ccputs("\n");
 }
 
-/* keep track of RX edge timing in order to trigger receive */
-static timestamp_t rx_edge_ts[2][PD_RX_TRANSITION_COUNT];
+/* Chunked extended message being reassembled from its chunks */
+static struct trace_ext {
+	struct rx_header rx; /* header of the first chunk */
+	uint16_t ext_head;   /* extended header of the first chunk */
+	uint16_t len;        /* data bytes received so far */
+	uint8_t next_chunk;  /* 0 if no message is in progress */
+	uint8_t busy;        /* complete message waiting to be printed */
+	uint8_t line;        /* CC line of the first chunk */
+	uint8_t data[PD_MAX_EXTENDED_MSG_LEN];
+} trace_ext;
+
+static void print_ext(timestamp_t ts)
+{
+	uint16_t head = trace_ext.rx.head;
+
+	ccprintf("%.6ld %s/%d [%04x]%s [%04x] %.*h\n", ts.val,
+		 head & (PD_ROLE_SOURCE << 8) ? "SRC" : "SNK",
+		 PD_HEADER_ID(head), head, ext_msg_name[PD_HEADER_TYPE(head)],
+		 trace_ext.ext_head, trace_ext.len, trace_ext.data);
+}
+
+/* Packet decoded in text trace mode, waiting to be printed */
+struct trace_rec {
+	timestamp_t ts;
+	struct rx_header rx;
+	uint8_t line; /* 1 for CC1, 2 for CC2 in dual-line mode, else 0 */
+	uint8_t ext;  /* the content is the reassembled trace_ext message */
+	uint8_t fuzz; /* FUZZ_x anomaly caused by this sent mutant, else 0 */
+	uint8_t tx;   /* frame sent by the injector */
+	uint16_t tx_us; /* its time on the line */
+	uint8_t viol; /* CHECK_x violation of this message, value in payload */
+	uint8_t repeat; /* repeats of this message, count in payload[0] */
+	uint32_t payload[7];
+};
+
+static const char * const fuzz_anomaly_name[] = {
+	[FUZZ_NO_GOODCRC] = "NOCRC",
+	[FUZZ_HARD_RESET] = "HRST",
+	[FUZZ_UNEXPECTED] = "UNEXP",
+	[FUZZ_ACKED_CRC]  = "BADCRC-ACK",
+};
+
+/*
+ * Decoded packets : filled in place in a pool block by the trace loop, queued
+ * and printed later by the hook task, so the console formatting does not delay
+ * the next reception.
+ */
+#define TRACE_REC_COUNT 8
+MEMPOOL(trace_pool, struct trace_rec, TRACE_REC_COUNT);
+static struct queue const trace_queue =
+	QUEUE_NULL(TRACE_REC_COUNT, struct trace_rec *);
+/* Packets decoded while the queue was full */
+static uint32_t trace_drops;
+
+static void trace_print(void)
+{
+	struct trace_rec *rec;
+	uint32_t drops;
+
+	while (queue_remove_unit(&trace_queue, &rec)) {
+#ifdef HAS_TASK_SNIFFER
+		if (rec->viol) {
+			caplog_viol(rec->ts.val, rec->rx, rec->viol,
+				    rec->payload[0], rec->line);
+			ccprintf("%.6ld VIOL %s [%04x] %d\n", rec->ts.val,
+				 check_name(rec->viol), rec->rx.head,
+				 rec->payload[0]);
+			mempool_free(&trace_pool, rec);
+			continue;
+		}
+		if (rec->repeat)
+			caplog_repeat(rec->ts.val, rec->rx, rec->payload[0],
+				      rec->line);
+		else if (rec->ext)
+			caplog_ext(rec->ts.val, trace_ext.rx, trace_ext.ext_head,
+				   trace_ext.data, trace_ext.len, rec->line);
+		else if (!rec->tx)
+			caplog_packet(rec->ts.val, rec->rx, rec->payload,
+				      rec->line, rec->fuzz);
+#endif
+		if (rec->line)
+			ccprintf("CC%d ", rec->line);
+		if (rec->tx)
+			ccputs("TX ");
+		if (rec->fuzz)
+			ccprintf("FUZZ %s ", fuzz_anomaly_name[rec->fuzz]);
+		if (rec->repeat) {
+			ccprintf("%.6ld REPEAT [%04x] %d\n", rec->ts.val,
+				 rec->rx.head, rec->payload[0]);
+		} else if (rec->ext) {
+			print_ext(rec->ts);
+			trace_ext.busy = 0;
+		} else {
+			print_packet(rec->ts, rec->rx, rec->payload);
+		}
+		mempool_free(&trace_pool, rec);
+	}
+
+	drops = atomic_read_clear(&trace_drops);
+	if (drops) {
+		ccprintf("%d packets not printed\n", drops);
+#ifdef HAS_TASK_SNIFFER
+		caplog_drops(drops);
+#endif
+	}
+}
+DECLARE_DEFERRED(trace_print);
+
+/* Queue the record 'rec' for printing, or count it as dropped if NULL */
+static void trace_queue_rec(struct trace_rec *rec)
+{
+	/* the queue has room for all the pool blocks */
+	if (rec && queue_add_unit(&trace_queue, &rec))
+		hook_call_deferred(&trace_print_data, 0);
+	else
+		atomic_add(&trace_drops, 1);
+}
+
+static void trace_queue_packet(timestamp_t ts, struct rx_header rx,
+			       uint32_t *payload, int line)
+{
+	struct trace_rec *rec = mempool_alloc(&trace_pool);
+
+	if (!rec) {
+		if (!payload)
+			trace_ext.busy = 0;
+		trace_queue_rec(NULL);
+		return;
+	}
+	rec->ts = ts;
+	rec->rx = rx;
+	rec->line = line;
+	rec->ext = !payload;
+	rec->fuzz = 0;
+	rec->tx = 0;
+	rec->viol = 0;
+	rec->repeat = 0;
+	if (payload)
+		memcpy(rec->payload, payload, sizeof(rec->payload));
+	trace_queue_rec(rec);
+}
+
+void trace_fuzz_report(int anomaly, uint16_t header, int cnt,
+		       const uint32_t *payload)
+{
+	struct trace_rec *rec = mempool_alloc(&trace_pool);
+
+	if (rec) {
+		rec->ts = get_time();
+		rec->rx = RX_HEADER(TCPC_TX_SOP, header);
+		rec->line = 0;
+		rec->ext = 0;
+		rec->fuzz = anomaly;
+		rec->tx = 0;
+		rec->viol = 0;
+		rec->repeat = 0;
+		memset(rec->payload, 0, sizeof(rec->payload));
+		memcpy(rec->payload, payload,
+		       MIN(cnt, 7) * sizeof(uint32_t));
+	}
+	trace_queue_rec(rec);
+}
+
+/*
+ * Frames sent by the injector, handed to the trace task so they are traced
+ * in order with the received packets (after the CC line events of
+ * rx_event()).
+ */
+static struct queue const trace_tx_queue =
+	QUEUE_NULL(TRACE_REC_COUNT, struct trace_rec *);
+/*
+ * Taken by the producers : the injector, console and sniffer (GoodCRC of the
+ * received packets) tasks all send frames.
+ */
+static struct mutex trace_tx_lock;
+
+void trace_tx_packet(uint64_t ts, uint32_t us, struct rx_header rx,
+		     const uint32_t *payload, int line)
+{
+#ifdef HAS_TASK_SNIFFER
+	struct trace_rec *rec;
+
+	if (trace_mode != TRACE_MODE_ON && trace_mode != TRACE_MODE_RAW)
+		return;
+	rec = mempool_alloc(&trace_pool);
+	if (!rec) {
+		atomic_add(&trace_drops, 1);
+		return;
+	}
+	rec->ts.val = ts;
+	rec->rx = rx;
+	rec->line = line;
+	rec->ext = 0;
+	rec->fuzz = 0;
+	rec->tx = 1;
+	rec->tx_us = MIN(us, 0xffff);
+	rec->viol = 0;
+	rec->repeat = 0;
+	memcpy(rec->payload, payload, sizeof(rec->payload));
+	/* the queue has room for all the pool blocks */
+	mutex_lock(&trace_tx_lock);
+	queue_add_unit(&trace_tx_queue, &rec);
+	mutex_unlock(&trace_tx_lock);
+	task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_TX, 0);
+#endif
+}
+
+/*
+ * Reassemble the chunks of the extended messages : the intermediate chunks
+ * are swallowed and the last one emits the record of the whole message.
+ *
+ * Return non-zero if the packet has been consumed.
+ */
+static int trace_ext_chunk(timestamp_t ts, struct rx_header rx,
+			   uint32_t *payload, int line)
+{
+	uint16_t head = rx.head;
+	int cnt = PD_HEADER_CNT(head);
+	uint16_t ext;
+	int size, n;
+
+	if (rx.packet_type < 0 ||
+	    rx.packet_type > TCPC_TX_SOP_DEBUG_PRIME_PRIME ||
+	    !PD_HEADER_EXT(head) || !cnt)
+		return 0;
+	ext = payload[0] & 0xffff;
+	size = PD_EXT_HEADER_DATA_SIZE(ext);
+	/* chunk requests and single chunk messages are traced as is */
+	if (!PD_EXT_HEADER_CHUNKED(ext) || PD_EXT_HEADER_REQ_CHUNK(ext) ||
+	    size <= PD_MAX_EXTENDED_MSG_CHUNK_LEN ||
+	    size > PD_MAX_EXTENDED_MSG_LEN)
+		return 0;
+
+	if (PD_EXT_HEADER_CHUNK_NUM(ext) == 0) {
+		/* the previous message is not printed yet */
+		if (trace_ext.busy) {
+			atomic_add(&trace_drops, 1);
+			trace_ext.next_chunk = 0;
+			return 1;
+		}
+		trace_ext.rx = rx;
+		trace_ext.line = line;
+		trace_ext.ext_head = ext;
+		trace_ext.len = 0;
+	} else if (!trace_ext.next_chunk ||
+		   PD_EXT_HEADER_CHUNK_NUM(ext) != trace_ext.next_chunk ||
+		   PD_HEADER_TYPE(head) != PD_HEADER_TYPE(trace_ext.rx.head)) {
+		/* out of sequence : trace the fragment alone */
+		return 0;
+	}
+
+	n = MIN(cnt * 4 - 2, size - trace_ext.len);
+	memcpy(trace_ext.data + trace_ext.len, (uint8_t *)payload + 2, n);
+	trace_ext.len += n;
+	trace_ext.next_chunk = PD_EXT_HEADER_CHUNK_NUM(ext) + 1;
+	if (trace_ext.len < size)
+		return 1;
+
+	/* the whole message is there */
+	trace_ext.next_chunk = 0;
+	if (trace_mode == TRACE_MODE_RAW) {
+		sniffer_trace_ext(trace_ext.rx, trace_ext.ext_head,
+				  trace_ext.data, trace_ext.len, trace_ext.line);
+	} else {
+		trace_ext.busy = 1;
+		trace_queue_packet(ts, trace_ext.rx, NULL, 0);
+	}
+	return 1;
+}
+
+/*
+ * Repeat coalescing : a packet identical to the last one traced (same SOP*,
+ * CC line, header but its MessageID, and data objects) is only counted. The
+ * end of the run is traced as a REPEAT record with the header, the count and
+ * the timestamp of the last repeat, the first one being traced as usual.
+ */
+#define TRACE_REPEAT_IDLE (500 * MSEC)
+/* MessageID field of the header */
+#define TRACE_REPEAT_ID_MASK (7 << 9)
+
+static int trace_coalesce;
+static struct {
+	struct rx_header rx;
+	uint32_t payload[7];
+	timestamp_t last;
+	uint32_t count;
+	uint8_t line;
+	uint8_t valid;  /* 'rx' can be repeated */
+} trace_rep;
+
+void set_trace_coalesce(int enable)
+{
+	trace_coalesce = enable;
+}
+
+int get_trace_coalesce(void)
+{
+	return trace_coalesce;
+}
+
+/* Trace the repeats counted so far, ending the run if 'end' */
+static void trace_repeat_flush(int end)
+{
+	struct trace_rec *rec;
+
+	if (end)
+		trace_rep.valid = 0;
+	if (!trace_rep.count)
+		return;
+	if (trace_mode == TRACE_MODE_RAW) {
+		sniffer_trace_repeat(trace_rep.last.val, trace_rep.rx,
+				     trace_rep.count, trace_rep.line);
+	} else {
+		rec = mempool_alloc(&trace_pool);
+		if (rec) {
+			rec->ts = trace_rep.last;
+			rec->rx = trace_rep.rx;
+			rec->line = trace_rep.line;
+			rec->ext = 0;
+			rec->fuzz = 0;
+			rec->tx = 0;
+			rec->viol = 0;
+			rec->repeat = 1;
+			memset(rec->payload, 0, sizeof(rec->payload));
+			rec->payload[0] = trace_rep.count;
+		}
+		trace_queue_rec(rec);
+	}
+	trace_rep.count = 0;
+}
+
+/* Return 1 if the packet to trace repeats the last one and is only counted */
+static int trace_repeat(timestamp_t ts, struct rx_header rx,
+			const uint32_t *payload, int line)
+{
+	int cnt = PD_HEADER_CNT(rx.head);
+
+	if (trace_coalesce && trace_rep.valid &&
+	    rx.packet_type == trace_rep.rx.packet_type &&
+	    line == trace_rep.line &&
+	    !((rx.head ^ trace_rep.rx.head) & ~TRACE_REPEAT_ID_MASK) &&
+	    !memcmp(payload, trace_rep.payload, cnt * sizeof(uint32_t))) {
+		trace_rep.count++;
+		trace_rep.last = ts;
+		return 1;
+	}
+
+	trace_repeat_flush(1);
+	/* the chunks of the extended messages are reassembled instead */
+	if (!trace_coalesce || rx.packet_type < 0 ||
+	    (cnt && PD_HEADER_EXT(rx.head)))
+		return 0;
+	trace_rep.rx = rx;
+	trace_rep.line = line;
+	memcpy(trace_rep.payload, payload, cnt * sizeof(uint32_t));
+	trace_rep.valid = 1;
+	return 0;
+}
+
+/* Filter rules checked before tracing each packet (TRACE_RULE_x) */
+static uint16_t trace_rules[TRACE_RULE_COUNT];
+
+/* the decoding steps are in the same order as the statistics errors */
+BUILD_ASSERT(PD_DECODE_ERR_EOP - PD_DECODE_ERR_PREAMBLE == INJ_STATS_ERR_EOP);
+
+/* SOP* types the decoder of the tracer stops at (1 << TCPC_TX_x) */
+static uint8_t trace_sop_skip;
+
+/*
+ * The SOP* types whose packets the rules all drop, whatever their header :
+ * they are not decoded past their ordered set, so the checker and the
+ * session tracker do not see them either.
+ */
+static uint8_t trace_skipped_sops(void)
+{
+	uint8_t skip = 0;
+	uint16_t rule;
+	int sop, i;
+
+	for (sop = TCPC_TX_SOP; sop <= TCPC_TX_SOP_DEBUG_PRIME_PRIME; sop++)
+		for (i = 0; i < TRACE_RULE_COUNT; i++) {
+			rule = trace_rules[i];
+			if (!(rule & TRACE_RULE_ENABLE) ||
+			    ((rule & TRACE_RULE_MATCH_SOP) &&
+			     (rule & TRACE_RULE_SOP(7)) != TRACE_RULE_SOP(sop)))
+				continue;
+			/* a rule on the header may let some of them pass */
+			if (rule & (TRACE_RULE_MATCH_PR | TRACE_RULE_MATCH_DR |
+				    TRACE_RULE_MATCH_TYPE)) {
+				if (rule & TRACE_RULE_PASS)
+					break;
+				continue;
+			}
+			if (!(rule & TRACE_RULE_PASS))
+				skip |= 1 << sop;
+			break;
+		}
+	return skip;
+}
+
+void set_trace_rule(int idx, uint16_t rule)
+{
+	if (idx >= 0 && idx < TRACE_RULE_COUNT)
+		trace_rules[idx] = rule;
+	trace_sop_skip = trace_skipped_sops();
+}
+
+uint16_t get_trace_rule(int idx)
+{
+	return idx >= 0 && idx < TRACE_RULE_COUNT ? trace_rules[idx] : 0;
+}
+
+/* Return non-zero if the packet should be traced */
+static int trace_filter(struct rx_header rx)
+{
+	uint16_t head = rx.head;
+	uint16_t key, mask, rule;
+	int i;
+
+	/* same layout as the rules */
+	if (rx.packet_type < 0) {
+		key = TRACE_RULE_SOP(7);
+	} else if (rx.packet_type > TCPC_TX_SOP_DEBUG_PRIME_PRIME) {
+		key = TRACE_RULE_SOP(rx.packet_type);
+	} else {
+		key = TRACE_RULE_SOP(rx.packet_type) |
+		      TRACE_RULE_TYPE(PD_HEADER_TYPE(head));
+		if (PD_HEADER_CNT(head))
+			key |= TRACE_RULE_DATA;
+		if (head & (PD_ROLE_DFP << 5))
+			key |= TRACE_RULE_DR;
+		if (head & (PD_ROLE_SOURCE << 8))
+			key |= TRACE_RULE_PR;
+	}
+
+	for (i = 0; i < TRACE_RULE_COUNT; i++) {
+		rule = trace_rules[i];
+		if (!(rule & TRACE_RULE_ENABLE))
+			continue;
+		mask = 0;
+		if (rule & TRACE_RULE_MATCH_SOP)
+			mask |= TRACE_RULE_SOP(7);
+		if (rule & TRACE_RULE_MATCH_PR)
+			mask |= TRACE_RULE_PR;
+		if (rule & TRACE_RULE_MATCH_DR)
+			mask |= TRACE_RULE_DR;
+		if (rule & TRACE_RULE_MATCH_TYPE)
+			mask |= TRACE_RULE_DATA | TRACE_RULE_TYPE(0xF);
+		if ((key & mask) == (rule & mask))
+			return rule & TRACE_RULE_PASS;
+	}
+	return 1;
+}
+
+/* Message timing histograms of the current tracing session */
+struct trace_hist {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t sum;
+	uint32_t bins[INJ_TIMING_BINS];
+};
+BUILD_ASSERT(sizeof(struct trace_hist) == INJ_TIMING_WORDS * 4);
+
+static struct trace_hist trace_timing[INJ_TIMING_COUNT];
+/* edge intervals of the packets decoded in the tracing session */
+static struct pd_decode_hist trace_jitter;
+/* estimated end of the last frame and of the last Request */
+static uint32_t frame_end, request_end;
+static int frame_seen, request_seen;
+
+void get_trace_timing(int idx, uint32_t *words)
+{
+	if (idx >= 0 && idx < INJ_TIMING_COUNT)
+		memcpy(words, trace_timing + idx, sizeof(struct trace_hist));
+	else
+		memset(words, 0, sizeof(struct trace_hist));
+}
+
+void get_trace_jitter(struct pd_decode_hist *hist)
+{
+	interrupt_disable();
+	*hist = trace_jitter;
+	interrupt_enable();
+}
+
+static void timing_add(int idx, uint32_t us)
+{
+	struct trace_hist *h = trace_timing + idx;
+	int bin = us ? 31 - __builtin_clz(us) : 0;
+
+	if (!h->count || us < h->min)
+		h->min = us;
+	if (us > h->max)
+		h->max = us;
+	h->count++;
+	h->sum += us;
+	h->bins[MIN(bin, INJ_TIMING_BINS - 1)]++;
+}
+
+/* Time on the line in us : preamble, SOP, header, payload, CRC and EOP */
+static uint32_t frame_duration(int cnt)
+{
+	return (64 + 20 + 20 + cnt * 40 + 40 + 5) * 10 / 3;
+}
+
+/* Update the timing histograms with a frame starting at 'start' */
+static void trace_frame_timing(uint32_t start, struct rx_header rx)
+{
+	uint16_t head = rx.head;
+	int cnt = PD_HEADER_CNT(head);
+	int typ = PD_HEADER_TYPE(head);
+	int32_t gap = start - frame_end;
+
+	/* the start time of a timed out frame is meaningless */
+	if (rx.packet_type < 0)
+		return;
+	/* the start is detected on the preamble, after the previous end */
+	if (gap < 0)
+		gap = 0;
+	if (frame_seen)
+		timing_add(INJ_TIMING_GAP, gap);
+	frame_seen = 1;
+
+	if (rx.packet_type > TCPC_TX_SOP_DEBUG_PRIME_PRIME) {
+		/* Hard/Cable Reset : preamble and ordered set only */
+		frame_end = start + (64 + 20) * 10 / 3;
+		request_seen = 0;
+		return;
+	}
+	frame_end = start + frame_duration(cnt);
+
+	if (!cnt && typ == PD_CTRL_GOOD_CRC) {
+		timing_add(INJ_TIMING_GOODCRC, gap);
+	} else if (request_seen && !cnt && (typ == PD_CTRL_ACCEPT ||
+		   typ == PD_CTRL_REJECT || typ == PD_CTRL_WAIT)) {
+		timing_add(INJ_TIMING_RESPONSE, start - request_end);
+		request_seen = 0;
+	} else if (cnt && typ == PD_DATA_REQUEST) {
+		request_end = frame_end;
+		request_seen = 1;
+	}
+}
+
+void trace_line_packet(int ch, uint64_t ts, int sop, const uint8_t *data,
+		       int len)
+{
+	uint32_t payload[7] = { 0 };
+	struct rx_header rx;
+	timestamp_t t;
+	int cnt;
+
+	rx.head = len >= 2 ? data[0] | (data[1] << 8) : 0;
+	rx.packet_type = sop;
+	cnt = PD_HEADER_CNT(rx.head);
+	/* header, data objects and CRC (which is not checked) */
+	if (len != 2 + cnt * 4 + 4)
+		rx.packet_type = PD_RX_ERR_INVAL;
+	else
+		memcpy(payload, data + 2, cnt * 4);
+
+	t.val = ts;
+	if (trace_filter(rx))
+		trace_queue_packet(t, rx, payload, ch + 1);
+}
+
+/*
+ * keep track of RX edge timing in order to trigger receive : the raw 32-bit
+ * timer is enough for a window of a few microseconds and much cheaper to
+ * read in the IRQ than get_time().
+ */
+static uint32_t rx_edge_ts[2][PD_RX_TRANSITION_COUNT];
 static int rx_edge_ts_idx[2];
+/* raw timer value when the sampling of the current packet started */
+static uint32_t rx_start_ts;
+/* raw timer value at the first preamble edge seen by the comparator */
+static uint32_t rx_pre_ts;
+/* raw timer value at the EOP of the last packet decoded by the tracer */
+static uint32_t rx_eop_ts;
+
+uint32_t trace_last_eop(void)
+{
+	return rx_eop_ts;
+}
+
+void trace_check_report(int kind, uint32_t start, struct rx_header rx,
+			uint32_t value, int line)
+{
+#ifdef HAS_TASK_SNIFFER
+	struct trace_rec *rec;
+	timestamp_t ts = { .val = ts_extend(start) };
+
+	trace_repeat_flush(1);
+	if (trace_mode == TRACE_MODE_RAW) {
+		sniffer_trace_viol(ts.val, kind, rx, value, line);
+		return;
+	}
+	rec = mempool_alloc(&trace_pool);
+	if (rec) {
+		rec->ts = ts;
+		rec->rx = rx;
+		rec->line = line;
+		rec->ext = 0;
+		rec->fuzz = 0;
+		rec->tx = 0;
+		rec->viol = kind;
+		rec->repeat = 0;
+		memset(rec->payload, 0, sizeof(rec->payload));
+		rec->payload[0] = value;
+	}
+	trace_queue_rec(rec);
+#endif
+}
 
-void rx_event(void)
+void __ram_code rx_event(void)
 {
 	int pending, i;
 	int next_idx;
@@ -170,7 +886,8 @@ void rx_event(void)
 	/* Iterate over the 2 CC lines */
 	for (i = 0; i < 2; i++) {
 		if (pending & (1 << (21 + i))) {
-			rx_edge_ts[i][rx_edge_ts_idx[i]].val = get_time().val;
+			rx_edge_ts[i][rx_edge_ts_idx[i]] =
+				ts_raw();
 			next_idx = (rx_edge_ts_idx[i] ==
 					PD_RX_TRANSITION_COUNT - 1) ?
 						0 : rx_edge_ts_idx[i] + 1;
@@ -179,13 +896,15 @@ void rx_event(void)
 			 * If we have seen enough edges in a certain amount of
 			 * time, then trigger RX start.
 			 */
-			if ((rx_edge_ts[i][rx_edge_ts_idx[i]].val -
-			     rx_edge_ts[i][next_idx].val)
+			if ((rx_edge_ts[i][rx_edge_ts_idx[i]] -
+			     rx_edge_ts[i][next_idx])
 			     < PD_RX_TRANSITION_WINDOW) {
 				/* acquire the message only on the active CC */
 				STM32_COMP_CSR &= ~(i ? STM32_COMP_CMP1EN
 						      : STM32_COMP_CMP2EN);
 				/* start sampling */
+				rx_start_ts = rx_edge_ts[i][rx_edge_ts_idx[i]];
+				rx_pre_ts = rx_edge_ts[i][next_idx];
 				pd_rx_start(0);
 				/*
 				 * ignore the comparator IRQ until we are done
@@ -194,7 +913,8 @@ void rx_event(void)
 				pd_rx_disable_monitoring(0);
 				/* trigger the analysis in the task */
 #ifdef HAS_TASK_SNIFFER
-				task_set_event(TASK_ID_SNIFFER, 4 << i, 0);
+				task_set_event(TASK_ID_SNIFFER,
+					       SNIFFER_EVENT_RX(i), 0);
 #endif
 				/* start reception only one CC line */
 				break;
@@ -210,11 +930,49 @@ void rx_event(void)
 DECLARE_IRQ(STM32_IRQ_COMP, rx_event, 1);
 #endif
 
+/* Trace the frames sent since the last call, drop them if not tracing */
+static void trace_tx_flush(void)
+{
+	struct trace_rec *rec;
+
+	while (queue_remove_unit(&trace_tx_queue, &rec)) {
+		if (trace_mode != TRACE_MODE_ON &&
+		    trace_mode != TRACE_MODE_RAW) {
+			mempool_free(&trace_pool, rec);
+			continue;
+		}
+#ifdef HAS_TASK_SNIFFER
+		check_packet(rec->ts.le.lo, rec->ts.le.lo + rec->tx_us,
+			     rec->rx, rec->line);
+		session_packet(rec->ts.le.lo, rec->rx, rec->payload,
+			       rec->line);
+#endif
+		if (!trace_filter(rec->rx) || check_only()) {
+			mempool_free(&trace_pool, rec);
+			continue;
+		}
+		/* our own frames end the runs of repeats */
+		trace_repeat_flush(1);
+		if (trace_mode == TRACE_MODE_RAW) {
+#ifdef HAS_TASK_SNIFFER
+			sniffer_trace_tx(rec->ts.val, rec->tx_us, rec->rx,
+					 rec->payload, rec->line);
+#endif
+			mempool_free(&trace_pool, rec);
+		} else {
+			trace_queue_rec(rec);
+		}
+	}
+}
+
 void trace_packets(void)
 {
 	struct rx_header rx;
 	uint32_t payload[7];
 	uint32_t evt;
+	timestamp_t ts;
+	uint32_t ticks, eop, eop16;
+	int line;
 
 #ifdef HAS_TASK_SNIFFER
 	/* Disable sniffer DMA configuration */
@@ -232,31 +990,123 @@ void trace_packets(void)
 	STM32_COMP_CSR |= STM32_COMP_CMP2EN | STM32_COMP_CMP1EN;
 	/* Enable the RX interrupts */
 	pd_rx_enable_monitoring(0);
+	/* new tracing session */
+	memset(trace_timing, 0, sizeof(trace_timing));
+	memset(&trace_jitter, 0, sizeof(trace_jitter));
+	pd_get_decoder(0)->hist = &trace_jitter;
+	frame_seen = 0;
+	request_seen = 0;
+	trace_ext.next_chunk = 0;
+	memset(&trace_rep, 0, sizeof(trace_rep));
 
 	while (1) {
-		evt = task_wait_event(-1);
-		if (trace_mode == TRACE_MODE_OFF)
+		/* wake up to end the run of repeats once the line is quiet */
+		evt = task_wait_event(trace_rep.count ? TRACE_REPEAT_IDLE : -1);
+		if (trace_mode == TRACE_MODE_OFF ||
+		    trace_mode == TRACE_MODE_DUAL)
 			break;
-		if (evt < 4) { /* USB event only */
+		if (evt & TASK_EVENT_TIMER)
+			trace_repeat_flush(1);
+		/* our own frames went out before the packet which woke us */
+		if (evt & SNIFFER_EVENT_TX)
+			trace_tx_flush();
+		if (!(evt & SNIFFER_EVENT_RX_ANY)) { /* no packet */
 			sniffer_trace_reload();
 			continue;
 		}
-		/* incoming packet processing */
+		/* incoming packet processing, rx_event() tags the CC line */
+		line = evt & SNIFFER_EVENT_RX(1) ? 2 : 1;
+		pd_get_decoder(0)->sop_skip = trace_sop_skip;
+#ifdef HAS_TASK_SNIFFER
+		pd_get_decoder(0)->sop_skip &= ~injector_emarker_sops();
+#endif
 		rx = pd_analyze_rx(0, payload);
+		/* the packet starts at its first edges, not once decoded */
+		ts.val = ts_extend(rx_pre_ts);
+		eop16 = 0;
+		/* 2.4MHz RX timer ticks since the sampling start */
+		ticks = pd_rx_last_edge(0);
+		eop = rx_start_ts + ticks * 10 / 24;
+		if (rx.packet_type >= 0) {
+			rx_eop_ts = eop;
+			/* EOP in 1/16 us from the first edge */
+			eop16 = MIN((rx_start_ts - rx_pre_ts) * 16 +
+				    ticks * 20 / 3, 0xffff);
+		}
+#ifdef HAS_TASK_SNIFFER
+		/* the next packet reuses the buffer of the edges */
+		if (rx.packet_type < 0 &&
+		    rx.packet_type != PD_RX_ERR_UNSUPPORTED_SOP)
+			sniffer_trace_errwin_latch(pd_rx_edge_count(0));
+#endif
 		pd_rx_complete(0);
+#ifdef HAS_TASK_SNIFFER
+		/* acknowledge it right away, as the partner would */
+		injector_goodcrc(rx, line);
+		injector_emarker(rx, payload, line);
+#endif
 		/* re-enabled detection on both CCx lines */
 		STM32_COMP_CSR |= STM32_COMP_CMP2EN | STM32_COMP_CMP1EN;
 		pd_rx_enable_monitoring(0);
-		/* print the last packet content */
-		if (trace_mode == TRACE_MODE_RAW)
-			sniffer_trace_packet(rx, payload);
-		else
-			print_packet(rx, payload);
+		/* stopped at its ordered set : the rules drop it anyway */
+		if (rx.packet_type == PD_RX_ERR_UNSUPPORTED_SOP)
+			continue;
+#ifdef HAS_TASK_SNIFFER
+		/* errored packets too, before the slower processing */
+		scope_packet(rx, eop);
+#endif
+#ifdef HAS_TASK_SNIFFER
+		if (rx.packet_type >= 0) {
+			stats_packet(rx.packet_type, rx.head);
+			flight_packet(ts.le.lo, line, rx.packet_type, rx.head,
+				      PD_HEADER_CNT(rx.head) ? payload[0] : 0);
+		} else {
+			int err = rx.packet_type == PD_RX_ERR_CRC ?
+				  INJ_STATS_ERR_CRC :
+				  pd_rx_last_error(0) - PD_DECODE_ERR_PREAMBLE;
+
+			stats_error(err);
+			flight_error(ts.le.lo, line, err);
+		}
+#endif
+		trace_frame_timing(ts.le.lo, rx);
+#ifdef HAS_TASK_SNIFFER
+		check_packet(ts.le.lo, rx_eop_ts, rx, line);
+		session_packet(ts.le.lo, rx, payload, line);
+#endif
+		/* print the last packet content unless filtered out */
+		if (trace_filter(rx) && !check_only() &&
+		    !trace_repeat(ts, rx, payload, line) &&
+		    !trace_ext_chunk(ts, rx, payload, line)) {
+			if (trace_mode == TRACE_MODE_RAW) {
+				sniffer_trace_packet(ts.val, eop16, rx, payload,
+						     line);
+#ifdef HAS_TASK_SNIFFER
+				if (rx.packet_type < 0)
+					sniffer_trace_errwin(ts.val, rx, line);
+#endif
+			} else {
+				trace_queue_packet(ts, rx, payload, 0);
+			}
+		}
+		if (rx.packet_type >= 0) {
+			last_rx = rx;
+			memcpy(last_payload, payload, sizeof(last_payload));
+			last_rx_count++;
+		}
 		if (rx.packet_type >= 0 &&
-		    expected_cmd == PD_HEADER_TYPE(rx.head))
-			task_wake(TASK_ID_CONSOLE);
+		    expected_cmd == PD_HEADER_TYPE(rx.head) &&
+		    expected_task != TASK_ID_INVALID)
+			task_wake(expected_task);
 	}
 
+	/* the repeats counted until now are printed */
+	trace_repeat_flush(1);
+	/* drop the frames sent since the mode change */
+	trace_tx_flush();
+	/* the PD sink decodes every packet */
+	pd_get_decoder(0)->sop_skip = 0;
+	pd_get_decoder(0)->hist = NULL;
 	task_disable_irq(STM32_IRQ_COMP);
 	/* Disable tracer DMA configuration */
 	dma_disable(STM32_DMAC_CH2);
@@ -271,7 +1121,9 @@ int expect_packet(int pol, uint8_t cmd, uint32_t timeout_us)
 	uint32_t evt;
 
 	expected_cmd = cmd;
+	expected_task = task_get_current();
 	evt = task_wait_event(timeout_us);
+	expected_task = TASK_ID_INVALID;
 
 	return !(evt == TASK_EVENT_TIMER);
 }
@@ -283,6 +1135,8 @@ void set_trace_mode(int mode)
 		return;
 
 	trace_mode = mode;
+	notify_post(INJ_NOTIFY_MODE, INJ_NOTIFY_MODE_TRACE << 16 | mode,
+		    get_time().val);
 	/* kick the task to take into account the new value */
 #ifdef HAS_TASK_SNIFFER
 	task_wake(TASK_ID_SNIFFER);
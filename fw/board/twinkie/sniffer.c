@@ -3,74 +3,304 @@
  * found in the LICENSE file.
  */
 
-#include "atomic.h"
+#include "adc.h"
+#include "adc_chip.h"
 #include "clock.h"
 #include "common.h"
 #include "console.h"
+#include "crc.h"
 #include "dma.h"
 #include "gpio.h"
 #include "hwtimer.h"
 #include "hooks.h"
 #include "injector.h"
 #include "link_defs.h"
+#include "queue.h"
+#include "queue_policies.h"
 #include "registers.h"
+#include "shared_mem.h"
 #include "task.h"
 #include "timer.h"
+#include "tracepoint.h"
+#include "usb_api.h"
 #include "usb_descriptor.h"
 #include "usb_hw.h"
 #include "usb_pd.h"
+#include "usb_pd_tcpm.h"
 #include "util.h"
-#include "ina2xx.h"
 
 /* Size of one USB packet buffer */
 #define EP_BUF_SIZE 64
 
-#define EP_PACKET_HEADER_SIZE 4
+/*
+ * Packet header (v4), 16-bit little-endian words :
+ *   [0] bits 7:0 : SNIFFER_MAGIC, bits 15:8 : header version
+ *   [1] flags word : SNIFFER_FLAG_x, channel, resolution, sub-buffer index
+ *   [2] packet sequence number, incremented by one on every packet
+ *   [3] bits 7:0 : payload length in bytes
+ *       bits 15:8 : wrap epoch, bits 7:0 of the upper 32 bits of the
+ *                   system clock
+ *   [4] timestamp bits 15:0  : lower 32 bits of the system clock in us
+ *   [5] timestamp bits 31:16
+ *   [6] CRC-32 bits 15:0
+ *   [7] CRC-32 bits 31:16
+ * The CRC-32 (USB-PD/Ethernet one) covers the words 0 to 5 then the
+ * payload, padded with a zero byte if its length is odd.
+ *
+ * The packets of both CC lines are merged into a single stream sent in
+ * timestamp order, the channel is tagged in the flags word.
+ */
+#define EP_PACKET_HEADER_SIZE 16
+/* Sniffer interface protocol and header version : v4 header */
+#define SNIFFER_USB_PROTOCOL 4
+#define SNIFFER_MAGIC 0xD5
+
+/* Header flags word */
+#define SNIFFER_FLAG_OFLOW   0x8000 /* samples lost before this one */
+#define SNIFFER_FLAG_PACKED  0x4000 /* packed format (SNIFFER_FORMAT_x) */
+#define SNIFFER_FLAG_IDLE    0x2000 /* idle marker */
+#define SNIFFER_FLAG_CC2     0x1000 /* samples of CC2, else CC1 */
+#define SNIFFER_FLAG_TRIGGER 0x0800 /* sent in the trigger post window */
+#define SNIFFER_FLAG_RES(r)  ((r) << 9)  /* RX timer resolution */
+#define SNIFFER_FLAG_SUB_MASK 0x00ff     /* sub-buffer index */
 /* Size of the payload (packet minus the header) */
 #define EP_PAYLOAD_SIZE (EP_BUF_SIZE - EP_PACKET_HEADER_SIZE)
 
-/* Buffer enough to avoid overflowing due to USB latencies on both sides */
-#define RX_COUNT (16 * EP_PAYLOAD_SIZE)
-
-/* Task event for the USB transfer interrupt */
-#define USB_EVENTS TASK_EVENT_CUSTOM(3)
+/*
+ * Buffer enough to avoid overflowing due to USB latencies on both sides :
+ * SNIFFER_RX_PAYLOADS USB packet payloads per CC line, the board sizes it
+ * to its RAM budget.
+ */
+#ifndef SNIFFER_RX_PAYLOADS
+#define SNIFFER_RX_PAYLOADS 16
+#endif
+#define RX_COUNT (SNIFFER_RX_PAYLOADS * EP_PAYLOAD_SIZE)
 
 /* Bitmap of enabled capture channels : CC1+CC2 by default */
 static uint8_t channel_mask = 0x3;
 
 /* edge timing samples */
-static uint8_t samples[2][RX_COUNT];
-/* bitmap of the samples sub-buffer filled with DMA data */
-static volatile uint32_t filled_dma;
-/* timestamps of the beginning of DMA buffers */
-static uint16_t sample_tstamp[4];
-/* sequence number of the beginning of DMA buffers */
-static uint16_t sample_seq[4];
+static uint8_t samples[2][RX_COUNT] __aligned(4);
+
+/*
+ * Line captured alone with the samples of both lines as one circular DMA
+ * buffer (SNIFFER_CHANNEL_CCx), or RX_LINE_BOTH. The task switches to
+ * 'rx_line_next' once it holds no half-buffer.
+ */
+#define RX_LINE_BOTH 2
+static int rx_line = RX_LINE_BOTH;
+static int rx_line_next = RX_LINE_BOTH;
+/* Time of the last half-buffer with edges on each line */
+static uint64_t line_busy[2];
+
+/* Number of samples in one DMA half-buffer */
+#define HALF_BUF_SIZE (RX_COUNT / 2)
+/* Number of sub-buffers (one USB packet payload each) in a half-buffer */
+#define SUB_BUF_COUNT (HALF_BUF_SIZE / EP_PAYLOAD_SIZE)
+BUILD_ASSERT(SNIFFER_RX_PAYLOADS % 2 == 0);
+BUILD_ASSERT(SUB_BUF_COUNT <= SNIFFER_FLAG_SUB_MASK + 1);
+
+/* Descriptor of a DMA half-buffer filled with samples */
+struct rx_desc {
+	uint8_t *samples;   /* first sample of the half-buffer */
+	timestamp_t tstamp; /* time when the DMA completed the half-buffer */
+	uint16_t flags;     /* packet header flags word (SNIFFER_FLAG_x) */
+	uint8_t channel;    /* SNIFFER_CHANNEL_CCx */
+	uint8_t gen;        /* rx_gen of the channel once it was completed */
+	uint8_t lead;       /* completed with the next one, 'tstamp' is its own */
+};
+
+/*
+ * Filled half-buffers in capture order : the DMA interrupt is the only
+ * producer, the sniffer task the only consumer.
+ */
+static struct queue const rx_queue = QUEUE_NULL(8, struct rx_desc);
+/*
+ * Half-buffers queued by the DMA interrupt and released by the sniffer task
+ * on each channel, they differ while the task still owns a half-buffer.
+ */
+static volatile uint32_t rx_queued[2];
+static volatile uint32_t rx_released[2];
+/* Half-buffers completed by the DMA on each channel, wrapping */
+static volatile uint8_t rx_gen[2];
+/* Sub-buffers dropped, and packets not decoded, as the DMA wrote them again */
+static uint32_t torn;
+static uint32_t torn_pkts;
+/* Samples of the channel were not streamed : flag the next ones sent */
+static uint8_t rx_gap[2];
+
+/*
+ * USB packet memory already used by the other endpoints :
+ * buffer descriptor table, EP0 and console (64-byte RX + TX each),
+ * Commands (TX response buffer + 64-byte RX) and its notifications.
+ */
+#define USB_RAM_USED (USB_EP_COUNT * sizeof(struct stm32_endpoint) + \
+		      4 * USB_MAX_PACKET_SIZE + \
+		      USB_COMMAND_TX_SIZE + USB_MAX_PACKET_SIZE + \
+		      NOTIFY_PACKET_SIZE)
+
+/* Number of bulk endpoint buffers : all the remaining USB packet memory */
+#define EP_BUF_COUNT ((CONFIG_USB_RAM_SIZE - USB_RAM_USED) / EP_BUF_SIZE)
+BUILD_ASSERT(EP_BUF_COUNT >= 2);
+
+/*
+ * Isochronous packet : consecutive ring slots, up to half of the ring so
+ * that both hardware buffers can be armed at once.
+ */
+#define EP_ISO_SLOTS (EP_BUF_COUNT / 2)
+
+/* Bulk endpoint ring of packet buffers */
+static usb_uint ep_buf[EP_BUF_COUNT][EP_BUF_SIZE / 2] __usb_ram;
+/*
+ * Ring indices running from 0 to 2*EP_BUF_COUNT-1, so a full ring can be told
+ * apart from an empty one without sharing a counter :
+ * ep_head is only advanced by the sniffer task when a buffer is filled,
+ * ep_tail is only advanced by the USB interrupt when a buffer is transmitted.
+ */
+static volatile uint32_t ep_head;
+static volatile uint32_t ep_tail;
+/* Number of bytes to transmit from each buffer of the ring */
+static uint8_t ep_len[EP_BUF_COUNT];
+/* Highest count of filled buffers, for the health records */
+static uint8_t ep_hwm;
+
+static inline uint32_t ep_ring_next(uint32_t idx)
+{
+	return idx == 2 * EP_BUF_COUNT - 1 ? 0 : idx + 1;
+}
+
+static inline uint32_t ep_ring_slot(uint32_t idx)
+{
+	return idx >= EP_BUF_COUNT ? idx - EP_BUF_COUNT : idx;
+}
+
+static inline usb_uint *ep_ring_buf(uint32_t idx)
+{
+	return ep_buf[ep_ring_slot(idx)];
+}
+
+/* Number of filled buffers waiting to be transmitted */
+static inline uint32_t ep_ring_used(void)
+{
+	uint32_t head = ep_head;
+	uint32_t tail = ep_tail;
+
+	return head >= tail ? head - tail : head + 2 * EP_BUF_COUNT - tail;
+}
 
-/* Bulk endpoint double buffer */
-static usb_uint ep_buf[2][EP_BUF_SIZE / 2] __usb_ram;
-/* USB Buffers not used, ready to be filled */
-static volatile uint32_t free_usb = 3;
+static inline int ep_ring_full(void)
+{
+	return ep_ring_used() == EP_BUF_COUNT;
+}
+
+static inline int ep_ring_empty(void)
+{
+	return ep_head == ep_tail;
+}
+
+/* Hand the buffer at the head of the ring over to the USB interrupt */
+static inline void ep_ring_push(int len)
+{
+	ep_len[ep_ring_slot(ep_head)] = len;
+	ep_head = ep_ring_next(ep_head);
+	ep_hwm = MAX(ep_hwm, ep_ring_used());
+}
 
-static inline void led_set_activity(int ch)
+/*
+ * Wake-ups of the task by the USB transfers, coalesced : in the streaming
+ * loop (ep_coalesce), only once the task is stopped on a full ring and
+ * 'ep_wake_slots' slots are free again, which it then fills in one go. The
+ * ring drains at the USB rate, so the wait is bounded. The other loops of
+ * the task (tracer) are woken by every transfer.
+ */
+static uint8_t ep_wake_slots = EP_BUF_COUNT / 2;
+static uint8_t ep_coalesce;
+static uint8_t ep_starved;
+static uint32_t ep_wakeups;
+static uint32_t ep_coalesced;
+
+static inline void ep_wake(void)
+{
+	if (ep_coalesce && (!ep_starved ||
+			    EP_BUF_COUNT - ep_ring_used() < ep_wake_slots)) {
+		ep_coalesced++;
+		return;
+	}
+	ep_starved = 0;
+	ep_wakeups++;
+	task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_USB, 0);
+}
+
+/* The streaming loop goes to sleep : wake it for ring room if it is full */
+static void ep_wait_room(int coalesce)
 {
-	static int accumul[2];
-	static uint32_t last_ts[2];
-	uint32_t now = __hw_clock_source_read();
-	int delta = now - last_ts[ch];
-	last_ts[ch] = now;
-	accumul[ch] = MAX(0, accumul[ch] + (30000 - delta));
-	gpio_set_level(ch ? GPIO_LED_R_L : GPIO_LED_G_L, !accumul[ch]);
+	interrupt_disable();
+	ep_coalesce = coalesce;
+	ep_starved = ep_ring_full();
+	interrupt_enable();
 }
 
-static inline void led_set_record(void)
+#ifdef SNIFFER_DMA_COPY
+/* Memory-to-memory DMA channel copying payloads into the USB packet memory */
+#define DMAC_USB_COPY STM32_DMAC_CH5
+/* Shorter payloads are copied faster by the CPU */
+#define DMA_COPY_MIN 16
+
+/* A copy into the buffer at the head of the ring is in progress */
+static volatile int ep_copying;
+/* Number of bytes to transmit once the copy is done */
+static uint8_t ep_copy_len;
+#endif
+
+static int ep_copy_intact(void);
+
+#ifdef SNIFFER_DMA_COPY
+/* DMA copy completed : the head buffer is ready for the USB interrupt */
+static void ep_copy_done(void)
 {
-	gpio_set_level(GPIO_LED_B_L, 0);
+	dma_disable(DMAC_USB_COPY);
+	dma_clear_isr(DMAC_USB_COPY);
+	if (ep_copy_intact())
+		ep_ring_push(ep_copy_len);
+	ep_copying = 0;
+	task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_USB, 0);
 }
+#else
+#define ep_copying 0
+#endif
 
-static inline void led_reset_record(void)
+/*
+ * Copy 'size' bytes from 'src' at the byte offset 'offset' of the buffer at
+ * the head of the ring, then hand 'len' bytes of it over to the USB
+ * interrupt : either now or when the DMA copy completes.
+ * 'src' must stay untouched until ep_copying is cleared.
+ */
+static void ep_ring_fill(int offset, const void *src, int size, int len)
 {
-	gpio_set_level(GPIO_LED_B_L, 1);
+	usb_uint *buf = ep_ring_buf(ep_head) + (offset >> 1);
+#ifdef SNIFFER_DMA_COPY
+	stm32_dma_chan_t *chan = dma_get_channel(DMAC_USB_COPY);
+
+	if (size >= DMA_COPY_MIN) {
+		ep_copy_len = len;
+		ep_copying = 1;
+		/* the packet memory only supports half-word accesses */
+		chan->cpar = (uint32_t)src;
+		chan->cmar = (uint32_t)buf;
+		chan->cndtr = (size + 1) / 2;
+		chan->ccr = STM32_DMA_CCR_MEM2MEM |
+			    dma_channel_priority[DMAC_USB_COPY] |
+			    STM32_DMA_CCR_MSIZE_16_BIT |
+			    STM32_DMA_CCR_PSIZE_16_BIT |
+			    STM32_DMA_CCR_MINC | STM32_DMA_CCR_PINC |
+			    STM32_DMA_CCR_TCIE;
+		dma_go(chan);
+		return;
+	}
+#endif
+	memcpy_to_usbram((void *)usb_sram_addr(buf), src, size);
+	if (ep_copy_intact())
+		ep_ring_push(len);
 }
 
 /* USB descriptors */
@@ -82,7 +312,7 @@ const struct usb_interface_descriptor USB_IFACE_DESC(USB_IFACE_VENDOR) = {
 	.bNumEndpoints = 1,
 	.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
 	.bInterfaceSubClass = USB_CLASS_VENDOR_SPEC,
-	.bInterfaceProtocol = 0,
+	.bInterfaceProtocol = SNIFFER_USB_PROTOCOL,
 	.iInterface = USB_STR_SNIFFER,
 };
 const struct usb_endpoint_descriptor USB_EP_DESC(USB_IFACE_VENDOR,
@@ -95,36 +325,243 @@ const struct usb_endpoint_descriptor USB_EP_DESC(USB_IFACE_VENDOR,
 	.bInterval = 1
 };
 
+/*
+ * Alternate setting 1 : the same stream on an isochronous endpoint, with
+ * its bandwidth reserved in every frame by the host.
+ */
+#define SNIFFER_ALT_BULK 0
+#define SNIFFER_ALT_ISO  1
+const struct usb_interface_descriptor
+	USB_CONF_DESC(CONCAT3(iface, USB_IFACE_VENDOR, _3alt)) = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = USB_IFACE_VENDOR,
+	.bAlternateSetting = SNIFFER_ALT_ISO,
+	.bNumEndpoints = 1,
+	.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+	.bInterfaceSubClass = USB_CLASS_VENDOR_SPEC,
+	.bInterfaceProtocol = SNIFFER_USB_PROTOCOL,
+	.iInterface = USB_STR_SNIFFER,
+};
+const struct usb_endpoint_descriptor
+	USB_CONF_DESC(CONCAT3(iface, USB_IFACE_VENDOR, _4altep)) = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = 0x80 | USB_EP_SNIFFER,
+	.bmAttributes = 0x01 /* Isochronous IN, no synchronization */,
+	.wMaxPacketSize = EP_ISO_SLOTS * EP_BUF_SIZE,
+	.bInterval = 1
+};
+
+/*
+ * Boot milestones ('sniffer boot'), system clock in us (0 until reached) :
+ * the capture starts before the host has enumerated the device, the first
+ * half-buffers wait in the queue (the newest ones overflow) until it reads.
+ */
+static struct {
+	uint32_t capture;   /* sniffer_init() started the DMA */
+	uint32_t first_dma; /* first half-buffer of samples */
+	uint32_t usb_reset; /* first bus reset : the host starts enumerating */
+	uint32_t first_in;  /* first data packet read by the host */
+} boot_ts;
+
+/*
+ * The bulk endpoint is double-buffered in hardware : the USB peripheral
+ * sends the buffer selected by DTOG_TX while the interrupt arms the other
+ * one (selected by SW_BUF), so the next packet is already queued when the
+ * current one completes. Both buffer descriptors point straight into the
+ * ring slots. A zero-length packet is armed when the ring is empty, to keep
+ * the host transfers completing and the interrupt running.
+ * These are only used by the USB interrupt.
+ */
+/* Number of hardware buffers armed (0 to 2) */
+static uint8_t ep_armed;
+/* Armed buffers being zero-length packets, bit 0 is the oldest one */
+static uint8_t ep_armed_zlp;
+/* Next filled ring buffer to arm */
+static uint32_t ep_next;
+/* Current alternate setting (SNIFFER_ALT_x) */
+static uint8_t ep_alt;
+/* Ring slots held by each isochronous hardware buffer */
+static uint8_t ep_iso_slots[2];
+
+#ifdef SNIFFER_ZERO_COPY
+/* The RX DMA writes into the packet memory, see zc_half_done() */
+static volatile uint8_t zc_active;
+/*
+ * Packet memory slots of the zero-copy packets, in order : zc_head is
+ * advanced by the DMA interrupt, zc_next when a slot is armed and zc_tail
+ * when it is transmitted (free-running, ZC_QUEUE entries).
+ */
+#define ZC_QUEUE 8
+static uint8_t zc_queue[ZC_QUEUE];
+static uint8_t zc_head, zc_next, zc_tail;
+/* Slots of the packet of each DMA half not transmitted yet */
+static uint8_t zc_left[2];
+
+static void zc_tx(void);
+static void zc_half_done(int ch, int half);
+
+/* The slots not sent yet are dropped */
+static void zc_flush(void)
+{
+	zc_next = zc_tail = zc_head;
+	zc_left[0] = zc_left[1] = 0;
+}
+#else
+#define zc_active 0
+#endif
+
+/* EP_TYPE of the isochronous endpoint */
+#define EP_TYPE_ISO 0x0400
+
+static void ep_arm(usb_uint *buf, int len)
+{
+	struct stm32_endpoint *ep = btable_ep + USB_EP_SNIFFER;
+
+	/* the RX descriptor is the second TX buffer */
+	if (STM32_USB_EP(USB_EP_SNIFFER) & EP_TX_SWBUF) {
+		ep->rx_addr = usb_sram_addr(buf);
+		ep->rx_count = len;
+	} else {
+		ep->tx_addr = usb_sram_addr(buf);
+		ep->tx_count = len;
+	}
+	if (!len)
+		ep_armed_zlp |= 1 << ep_armed;
+	ep_armed++;
+	/* hand it over by toggling SW_BUF, keep the completion flags */
+	STM32_TOGGLE_EP(USB_EP_SNIFFER, EP_TX_MASK, EP_TX_VALID,
+			EP_TX_SWBUF | EP_CTR_RX | EP_CTR_TX);
+}
+
+/*
+ * The isochronous endpoint sends one packet per frame from the buffer
+ * selected by DTOG_TX, which toggles after each transaction : the buffer
+ * just sent is refilled while the other one waits for the next frame. With
+ * no handshake, a buffer is sent as it is armed, a zero-length packet when
+ * the ring is empty. A packet lost on the bus is not sent again, the host
+ * sees the gap in the sequence numbers.
+ */
+static void __ram_code ep_tx_iso(void)
+{
+	struct stm32_endpoint *ep = btable_ep + USB_EP_SNIFFER;
+	int sent = !(STM32_USB_EP(USB_EP_SNIFFER) & EP_TX_DTOG);
+	uint32_t first = ep_next;
+	int n = 0, len = 0, slot;
+
+	/* acknowledge the completion */
+	STM32_TOGGLE_EP(USB_EP_SNIFFER, 0, 0, EP_CTR_RX);
+	/* release the ring slots of the buffer sent */
+	if (ep_iso_slots[sent] && !boot_ts.first_in)
+		boot_ts.first_in = ts_raw();
+	for (; ep_iso_slots[sent]; ep_iso_slots[sent]--)
+		ep_tail = ep_ring_next(ep_tail);
+	/* the next filled slots contiguous in memory, up to a short one */
+	while (n < EP_ISO_SLOTS && ep_next != ep_head) {
+		slot = ep_ring_slot(ep_next);
+		if (slot != ep_ring_slot(first) + n)
+			break;
+		len += ep_len[slot];
+		n++;
+		ep_next = ep_ring_next(ep_next);
+		if (ep_len[slot] < EP_BUF_SIZE)
+			break;
+	}
+	ep_iso_slots[sent] = n;
+	/* the second buffer uses the RX descriptor */
+	if (sent) {
+		ep->rx_addr = usb_sram_addr(ep_ring_buf(first));
+		ep->rx_count = len;
+	} else {
+		ep->tx_addr = usb_sram_addr(ep_ring_buf(first));
+		ep->tx_count = len;
+	}
+	/* wake up the processing */
+	ep_wake();
+}
+
 /* USB callbacks */
-static void ep_tx(void)
-{
-	static int b; /* current buffer index */
-	if (btable_ep[USB_EP_SNIFFER].tx_count) {
-		/* we have transmitted the previous buffer, toggle it */
-		free_usb |= 1 << b;
-		b = b ? 0 : 1;
-		btable_ep[USB_EP_SNIFFER].tx_addr = usb_sram_addr(ep_buf[b]);
-	}
-	/* re-enable data transmission if we have available data */
-	btable_ep[USB_EP_SNIFFER].tx_count = (free_usb & (1<<b)) ? 0
-								 : EP_BUF_SIZE;
-	STM32_TOGGLE_EP(USB_EP_SNIFFER, EP_TX_MASK, EP_TX_VALID, 0);
+static void __ram_code ep_tx(void)
+{
+	TRACEPOINT(TP_EP_TX, ep_armed);
+	if (ep_alt == SNIFFER_ALT_ISO) {
+		ep_tx_iso();
+		return;
+	}
+#ifdef SNIFFER_ZERO_COPY
+	if (zc_active) {
+		zc_tx();
+		return;
+	}
+#endif
+	/* acknowledge the completion */
+	STM32_TOGGLE_EP(USB_EP_SNIFFER, 0, 0, EP_CTR_RX);
+	if (ep_armed) {
+		/* the oldest buffer was transmitted, release its ring slot */
+		if (!(ep_armed_zlp & 1)) {
+			ep_tail = ep_ring_next(ep_tail);
+			if (!boot_ts.first_in)
+				boot_ts.first_in = ts_raw();
+		}
+		ep_armed_zlp >>= 1;
+		ep_armed--;
+	}
+	/* queue the available data in the free hardware buffers */
+	while (ep_armed < 2 && ep_next != ep_head) {
+		ep_arm(ep_ring_buf(ep_next), ep_len[ep_ring_slot(ep_next)]);
+		ep_next = ep_ring_next(ep_next);
+	}
+	if (!ep_armed)
+		ep_arm(ep_ring_buf(ep_tail), 0);
 	/* wake up the processing */
-	task_set_event(TASK_ID_SNIFFER, 1 << b, 0);
+	ep_wake();
+}
+
+/*
+ * Restart the endpoint for the alternate setting 'alt', dropping the
+ * buffers not sent yet.
+ */
+static void ep_setup(int alt)
+{
+	struct stm32_endpoint *ep = btable_ep + USB_EP_SNIFFER;
+	/* writing the toggle bits with their value clears them */
+	uint16_t toggles = STM32_USB_EP(USB_EP_SNIFFER) &
+			   (EP_TX_MASK | EP_TX_DTOG | EP_RX_MASK | EP_RX_DTOG);
+
+	ep_alt = alt;
+	ep_tail = ep_head;
+	ep_next = ep_head;
+	ep_armed = 0;
+	ep_armed_zlp = 0;
+	ep_iso_slots[0] = ep_iso_slots[1] = 0;
+#ifdef SNIFFER_ZERO_COPY
+	zc_flush();
+#endif
+	STM32_USB_EP(USB_EP_SNIFFER) = (USB_EP_SNIFFER << 0) /*Endpoint Num*/ |
+				       (toggles ^ EP_TX_NAK) /* TX NAK */ |
+				       (alt == SNIFFER_ALT_ISO ? EP_TYPE_ISO :
+					EP_DBL_BUF /* Double-buffered bulk */) |
+				       (0 << 12) /* RX Disabled */;
+	if (alt == SNIFFER_ALT_BULK) {
+		/* Bulk IN endpoint : start with a zero-length packet */
+		ep_arm(ep_ring_buf(ep_tail), 0);
+		return;
+	}
+	/* Isochronous IN endpoint : zero-length packets until refilled */
+	ep->tx_addr = ep->rx_addr = usb_sram_addr(ep_ring_buf(ep_tail));
+	ep->tx_count = ep->rx_count = 0;
+	STM32_TOGGLE_EP(USB_EP_SNIFFER, EP_TX_MASK, EP_TX_VALID, 0);
 }
 
 static void ep_event(enum usb_ep_event evt)
 {
 	if (evt != USB_EVENT_RESET)
 		return;
+	if (!boot_ts.usb_reset)
+		boot_ts.usb_reset = ts_raw();
 
-	/* Bulk IN endpoint */
-	btable_ep[USB_EP_SNIFFER].tx_addr = usb_sram_addr(ep_buf[0]);
-	btable_ep[USB_EP_SNIFFER].tx_count = EP_BUF_SIZE;
-	STM32_USB_EP(USB_EP_SNIFFER) = (USB_EP_SNIFFER << 0) /*Endpoint Num*/ |
-				       (3 << 4) /* TX Valid */ |
-				       (0 << 9) /* Bulk EP */ |
-				       (0 << 12) /* RX Disabled */;
+	ep_setup(SNIFFER_ALT_BULK);
 }
 USB_DECLARE_EP(USB_EP_SNIFFER, ep_tx, ep_tx, ep_event);
 
@@ -139,123 +576,554 @@ USB_DECLARE_EP(USB_EP_SNIFFER, ep_tx, ep_tx, ep_event);
 #define DMAC_TIM_RX2 STM32_DMAC_CH7
 #define TIM_RX2_CCR_IDX 4
 
-/* Clock divider for RX edges timings (2.4Mhz counter from 48Mhz clock) */
-#define RX_CLOCK_DIV (20 - 1)
+/* RX edges timings resolutions, recorded in the packet header */
+enum sniffer_res {
+	SNIFFER_RES_NORMAL = 0, /* 2.4Mhz counter, 8-bit samples */
+	SNIFFER_RES_FINE,       /* 48Mhz counter, 16-bit samples */
+	SNIFFER_RES_COARSE,     /* 1.2Mhz counter, 8-bit samples */
+	SNIFFER_RES_COUNT
+};
+
+static const struct {
+	const char *name;
+	uint8_t div;   /* clock divider : the counter runs at 48Mhz / div */
+	uint8_t wide;  /* 16-bit captures instead of 8-bit ones */
+	uint8_t ticks; /* half UI at 300 kbps in counter ticks */
+} res_table[SNIFFER_RES_COUNT] = {
+	[SNIFFER_RES_NORMAL] = {"normal", 20, 0, 4},
+	[SNIFFER_RES_FINE]   = {"fine",    1, 1, 80},
+	[SNIFFER_RES_COARSE] = {"coarse", 40, 0, 2},
+};
+
+/* Active resolution and the one requested by the console */
+static int rx_res = SNIFFER_RES_NORMAL;
+static int rx_res_next = SNIFFER_RES_NORMAL;
+
+#define RX_WIDE() (res_table[rx_res].wide)
+
+/* Read the sample 'i' of the buffer 'buf' at the active resolution */
+static inline uint16_t sample_get(const uint8_t *buf, int i)
+{
+	return RX_WIDE() ? ((const uint16_t *)buf)[i] : buf[i];
+}
+
+/* First sample of the DMA buffer of the channel 'ch' */
+static inline uint8_t *rx_base(int ch)
+{
+	return rx_line == RX_LINE_BOTH ? samples[ch] : samples[0];
+}
+
+/* Number of samples in the DMA buffer of a channel */
+static inline uint32_t rx_total(void)
+{
+	return (rx_line == RX_LINE_BOTH ? RX_COUNT : 2 * RX_COUNT) >>
+		RX_WIDE();
+}
+
+#define RX_DMA_FLAGS (STM32_DMA_CCR_CIRC | STM32_DMA_CCR_TCIE | \
+		      STM32_DMA_CCR_HTIE)
 
-static const struct dma_option dma_tim_cc1 = {
+/* the transfer size is set according to the resolution */
+static struct dma_option dma_tim_cc1 = {
 	DMAC_TIM_RX1, (void *)&STM32_TIM_CCRx(TIM_RX1, TIM_RX1_CCR_IDX),
-	STM32_DMA_CCR_MSIZE_8_BIT | STM32_DMA_CCR_PSIZE_8_BIT |
-	STM32_DMA_CCR_CIRC | STM32_DMA_CCR_TCIE | STM32_DMA_CCR_HTIE
+	RX_DMA_FLAGS
 };
 
-static const struct dma_option dma_tim_cc2 = {
+static struct dma_option dma_tim_cc2 = {
 	DMAC_TIM_RX2, (void *)&STM32_TIM_CCRx(TIM_RX2, TIM_RX2_CCR_IDX),
-	STM32_DMA_CCR_MSIZE_8_BIT | STM32_DMA_CCR_PSIZE_8_BIT |
-	STM32_DMA_CCR_CIRC | STM32_DMA_CCR_TCIE | STM32_DMA_CCR_HTIE
+	RX_DMA_FLAGS
 };
 
 /* sequence number for sample buffers */
 static volatile uint32_t seq;
-/* Buffer overflow count */
+/* Buffer overflow count, and per channel for the health records */
 static uint32_t oflow;
+static uint32_t oflow_ch[2];
+/* Highest count of DMA half-buffers waiting, for the health records */
+static uint8_t rx_queue_hwm;
 
 #define SNIFFER_CHANNEL_CC1 0
 #define SNIFFER_CHANNEL_CC2 1
 
-#define get_channel(b)   (((b) >> 12) & 0x1)
+/*
+ * Idle marker (SNIFFER_FLAG_IDLE) : the payload is the 32-bit number of
+ * suppressed samples followed by their 16-bit capture value, all the
+ * samples of the run are identical (counter overflows only, no edge).
+ * The header carries the flags and timestamp of the first suppressed DMA
+ * half-buffer.
+ */
+/*
+ * Both packed and idle flags set mark a typed record : the payload starts
+ * with the 16-bit record type (SNIFFER_REC_x).
+ */
+#define SNIFFER_FLAG_RECORD (SNIFFER_FLAG_PACKED | SNIFFER_FLAG_IDLE)
+/* VBUS record : 16-bit voltage in mV then 16-bit signed current in mA */
+#define SNIFFER_REC_VBUS 1
+/*
+ * Decoded packet record : 16-bit SOP type (0 SOP, 1 SOP', 2 SOP''), 16-bit
+ * index of the last sample of the packet in the half-buffer of the header
+ * timestamp, then the packet bytes as received (header, data objects, CRC).
+ * The flags word tags the channel.
+ */
+#define SNIFFER_REC_PACKET 2
+/*
+ * Clock sync record : 16-bit USB frame number (11 bits) of the start of
+ * frame at the header timestamp. The host maps the device clock to its own
+ * time through the frame counter of its USB controller.
+ */
+#define SNIFFER_REC_SYNC 3
+/*
+ * Sync pulse record : 16-bit pulse number, 16-bit role (SNIFFER_PULSE_x)
+ * of the device, the header timestamp is the rising edge of the pulse on
+ * the SYNC pin. The master numbers its pulses with 16 bits and encodes the
+ * number modulo PULSE_CODES in the pulse width, the slaves decode it so the
+ * host can pair the records of several devices wired together and map their
+ * clocks to the master one.
+ */
+#define SNIFFER_REC_PULSE 4
+/*
+ * Power alert record : 16-bit limit type (POWER_LIMIT_x), 16-bit limit
+ * (unsigned mV or signed mA), the header timestamp is the first conversion
+ * of the INA beyond the limit.
+ */
+#define SNIFFER_REC_POWER 5
+/*
+ * CC voltage record : 16-bit sample period in 1/8 us, 16-bit sample count,
+ * then the samples as pairs of 12-bit CC1 and CC2 ADC readings (3.3 V full
+ * scale). The header timestamp is the first sample.
+ */
+#define SNIFFER_REC_CC 6
+/*
+ * Quality of service record : 16-bit level (SNIFFER_QOS_x) the stream
+ * switched to at the header timestamp, 16-bit count of the half-buffers
+ * decoded but not streamed since the previous QoS record (saturated).
+ */
+#define SNIFFER_REC_QOS 7
+/*
+ * Event record, sent instead of the samples while degraded : 16-bit kind,
+ * TCPC_TX_HARD_RESET or TCPC_TX_CABLE_RESET for a reset, or
+ * INJ_FLIGHT_ERROR(INJ_STATS_ERR_x) for a packet which failed to decode.
+ * The flags word tags the channel, the header timestamp is the half-buffer.
+ */
+#define SNIFFER_REC_EVENT 8
+/*
+ * Comparator record : 16-bit CC1 then CC2 comparator setting (SNIFFER_COMP),
+ * in effect from the header timestamp. Sent when a setting changes and when
+ * the recording starts.
+ */
+#define SNIFFER_REC_COMP 9
+/*
+ * Clock record : 16-bit HSI48 trim of the Clock Recovery System, 16-bit
+ * signed frequency error in ppm (positive when fast) measured on the last
+ * USB start of frame. Sent with the sync records when the trim changes,
+ * and at least every second.
+ */
+#define SNIFFER_REC_CLOCK 10
+/*
+ * Trigger input record : 16-bit level of the SYNC pin after the edge,
+ * 16-bit time of the edge after the header timestamp in 1/48 us. Sent for
+ * each edge on the pin while its role is SNIFFER_PULSE_INPUT.
+ */
+#define SNIFFER_REC_INPUT 11
+/*
+ * Health record, every second : 16-bit CPU idle time in % since the
+ * previous one, 16-bit CC1 then CC2 overflows, 16-bit free USB buffers,
+ * 16-bit highest count of USB buffers then of DMA half-buffers waiting,
+ * 16-bit decoding errors, then 16-bit modes (SNIFFER_HEALTH_x). The counts
+ * are since the previous health record, saturated.
+ */
+#define SNIFFER_REC_HEALTH 12
+#define SNIFFER_HEALTH_RES(r)  ((r) << 0) /* SNIFFER_RES_x */
+#define SNIFFER_HEALTH_PACKED  (1 << 2)   /* packed sample format */
+#define SNIFFER_HEALTH_CH(m)   ((m) << 3) /* recorded channels mask */
+#define SNIFFER_HEALTH_QOS(l)  ((l) << 5) /* SNIFFER_QOS_x */
+#define SNIFFER_HEALTH_ISO     (1 << 7)   /* isochronous endpoint */
+#define SNIFFER_HEALTH_DECODE  (1 << 8)   /* decoded packet records */
+/*
+ * Suspend record, sent once the host resumed the bus : 32-bit time spent
+ * suspended in ms, 16-bit flight recorder records written meanwhile and
+ * still held, 16-bit ones overwritten, 16-bit wake-up reason
+ * (SNIFFER_WAKE_x). The header timestamp is the start of the suspend.
+ */
+#define SNIFFER_REC_SUSPEND 13
+#define SNIFFER_WAKE_HOST    0 /* resumed by the host itself */
+#define SNIFFER_WAKE_TRIGGER 1 /* the capture trigger fired */
+#define SNIFFER_WAKE_FULL    2 /* the flight recorder was filling up */
+/*
+ * Power transition record, once the window of a contract change or hard
+ * reset is over : the struct power_transition (board.h) of the window, its
+ * first field is the time of the Accept before the header timestamp, the
+ * last VBUS reading of the window.
+ */
+#define SNIFFER_REC_TRANSITION 14
+/*
+ * Bookmark record : 32-bit tag then 16-bit 'seq' of the INJ_BIN_BOOKMARK
+ * request of the host, the header timestamp is the reception of the request
+ * by the command endpoint.
+ */
+#define SNIFFER_REC_BOOKMARK 15
+
+/* Stream levels of the QoS records, from the richest one */
+#define SNIFFER_QOS_SAMPLES 0 /* samples and every record */
+#define SNIFFER_QOS_PACKETS 1 /* decoded packet and event records */
+#define SNIFFER_QOS_EVENTS  2 /* event records */
 
-void tim_rx1_handler(uint32_t stat)
+/*
+ * Sample stream formats on the bulk endpoint :
+ *
+ * SNIFFER_FORMAT_RAW : each packet carries one sub-buffer of 48 raw 8-bit
+ * timer captures.
+ *
+ * SNIFFER_FORMAT_PACKED : (8-bit samples only, 16-bit ones are sent raw)
+ * each packet carries 1 to 4 consecutive sub-buffers
+ * of the same DMA half-buffer, every capture encoded as a 2-bit interval
+ * class (LSB first) relative to the value rebuilt so far by the decoder :
+ *   0 : same value (counter overflow, no edge)
+ *   1 : half UI interval (+4 ticks at normal resolution, +2 coarse)
+ *   2 : full UI interval (+8 ticks at normal resolution, +4 coarse)
+ *   3 : escape, the next 8 bits are the raw capture value
+ * The first capture of a packet is always escaped and each class code is
+ * within 1 tick of the real capture. Each sub-buffer encoding is a whole
+ * number of bytes, the USB packet length gives the payload size.
+ */
+#define SNIFFER_FORMAT_RAW    0
+#define SNIFFER_FORMAT_PACKED 1
+
+#define PACK_CODE_SAME  0
+#define PACK_CODE_SHORT 1
+#define PACK_CODE_LONG  2
+#define PACK_CODE_ESC   3
+
+/* Nominal intervals in RX timer ticks at 300 kbps */
+#define PACK_TICKS_SHORT (res_table[rx_res].ticks)
+#define PACK_TICKS_LONG  (2 * PACK_TICKS_SHORT)
+/* A class code is used if the capture is within 1 tick of its interval */
+#define PACK_CLASS(delta, ticks) ((uint8_t)((delta) - (ticks) + 1) <= 2)
+
+static int sniffer_format = SNIFFER_FORMAT_RAW;
+
+/*
+ * Latency histograms : the bin N counts the values in [2^N, 2^(N+1)[ (the
+ * first and last bins are open-ended).
+ */
+#define LAT_BINS 16
+struct lat_hist {
+	uint32_t count;
+	uint32_t max;
+	uint32_t bins[LAT_BINS];
+};
+/* samples the DMA had already written past the half-buffer at ISR entry */
+static struct lat_hist rx_lag;
+/* us from the DMA interrupt to the task releasing the half-buffer */
+static struct lat_hist rx_wait;
+
+static void lat_add(struct lat_hist *h, uint32_t val)
 {
-	stm32_dma_regs_t *dma = STM32_DMA1_REGS;
-	int idx = !(stat & STM32_DMA_ISR_HTIF(DMAC_TIM_RX1));
-	uint32_t mask = idx ? 0xFF00 : 0x00FF;
-	uint32_t next = idx ? 0x0001 : 0x0100;
-
-	sample_tstamp[idx] = __hw_clock_source_read();
-	sample_seq[idx] = ((seq++ << 3) & 0x0ff8) |
-			(SNIFFER_CHANNEL_CC1<<12);
-	if (filled_dma & next) {
+	int bin = val ? 31 - __builtin_clz(val) : 0;
+
+	if (val > h->max)
+		h->max = val;
+	h->count++;
+	h->bins[MIN(bin, LAT_BINS - 1)]++;
+}
+
+/* The task gives the half-buffer of 'desc' back to the DMA */
+static void rx_release(const struct rx_desc *desc)
+{
+	lat_add(&rx_wait, ts_raw() - desc->tstamp.le.lo);
+	rx_released[desc->channel]++;
+}
+
+/* The DMA has completed the half-buffer 'half' of the channel 'ch' */
+static void rx_half_done(int ch, int half)
+{
+	stm32_dma_chan_t *chan = dma_get_channel(
+		ch == SNIFFER_CHANNEL_CC2 ? DMAC_TIM_RX2 : DMAC_TIM_RX1);
+	uint32_t total = rx_total();
+	/* position of the DMA in the buffer, from the end of the half */
+	uint32_t lag = total - chan->cndtr + (half ? 0 : total / 2);
+	/* half-buffers in each half of the DMA buffer */
+	int count = rx_line == RX_LINE_BOTH ? 1 : 2;
+	uint16_t flags = ch == SNIFFER_CHANNEL_CC2 ? SNIFFER_FLAG_CC2 : 0;
+	uint32_t lost = oflow;
+	struct rx_desc desc;
+	int i;
+
+#ifdef SNIFFER_ZERO_COPY
+	if (zc_active) {
+		zc_half_done(ch, half);
+		return;
+	}
+#endif
+	TRACEPOINT(TP_RX_HALF, ch << 16 | half);
+	lat_add(&rx_lag, lag >= total ? lag - total : lag);
+	if (rx_queued[ch] != rx_released[ch]) {
+		/* the task has not released the other half-buffers yet */
 		oflow++;
-		sample_seq[idx] |= 0x8000;
-	} else {
-		led_set_record();
+		oflow_ch[ch]++;
+		flags |= SNIFFER_FLAG_OFLOW;
+	}
+	desc.tstamp = get_time();
+	desc.channel = ch;
+	desc.gen = ++rx_gen[ch];
+	for (i = 0; i < count; i++) {
+		desc.samples = rx_base(ch) +
+			       (half * count + i) * HALF_BUF_SIZE;
+		desc.flags = i ? flags & ~SNIFFER_FLAG_OFLOW : flags;
+		desc.lead = i < count - 1;
+		seq++;
+		if (queue_add_unit(&rx_queue, &desc)) {
+			rx_queued[ch]++;
+		} else {
+			oflow++;
+			oflow_ch[ch]++;
+		}
 	}
-	filled_dma |= mask;
+	rx_queue_hwm = MAX(rx_queue_hwm, queue_count(&rx_queue));
+	if (oflow != lost)
+		notify_post(INJ_NOTIFY_OFLOW, oflow - lost, desc.tstamp.val);
+}
+
+/*
+ * Has the DMA written the samples of 'desc' from the index 'idx' again ?
+ * It gets back to the half-buffer once it has filled the other one, a
+ * half-buffer still held by the task is overwritten on overflow.
+ */
+static int rx_torn(const struct rx_desc *desc, int idx)
+{
+	stm32_dma_chan_t *chan = dma_get_channel(
+		desc->channel == SNIFFER_CHANNEL_CC2 ? DMAC_TIM_RX2 :
+						       DMAC_TIM_RX1);
+	uint32_t half = rx_total() / 2;
+	/* the half of the DMA buffer holding the half-buffer */
+	uint32_t at = (desc->samples - rx_base(desc->channel)) >> RX_WIDE();
+	uint32_t start = at < half ? 0 : half;
+	uint32_t pos;
+	uint8_t laps;
+
+	idx += at - start;
+	/* the completion count and the position of the same instant */
+	interrupt_disable();
+	laps = rx_gen[desc->channel] - desc->gen;
+	pos = 2 * half - chan->cndtr;
+	interrupt_enable();
+
+	if (laps > 1)
+		return 1;
+	/* in the other half : not there yet, or done with ours already */
+	if (pos < start || pos >= start + half)
+		return laps == 1;
+	return pos - start > idx;
+}
+
+/* The samples of the channel 'ch' left in a half-buffer are dropped */
+static void rx_tear(int ch)
+{
+	torn++;
+	rx_gap[ch] = 1;
+}
+
+/*
+ * Samples being copied into the head buffer of the ring, from the index
+ * 'copy_idx' of 'copy_desc' (-1 for any other payload).
+ */
+static struct rx_desc copy_desc;
+static int copy_idx = -1;
+
+/* Were the samples intact until the end of the copy ? Else drop the buffer */
+static int ep_copy_intact(void)
+{
+	int idx = copy_idx;
+
+	copy_idx = -1;
+	if (idx < 0 || !rx_torn(&copy_desc, idx))
+		return 1;
+	rx_tear(copy_desc.channel);
+	return 0;
+}
+
+void tim_rx1_handler(uint32_t stat)
+{
+	stm32_dma_regs_t *dma = STM32_DMA1_REGS;
+
+	if (!boot_ts.first_dma)
+		boot_ts.first_dma = ts_raw();
+	rx_half_done(SNIFFER_CHANNEL_CC1,
+		     !(stat & STM32_DMA_ISR_HTIF(DMAC_TIM_RX1)));
 	dma->ifcr = STM32_DMA_ISR_ALL(DMAC_TIM_RX1);
-	led_set_activity(0);
 }
 
 void tim_rx2_handler(uint32_t stat)
 {
 	stm32_dma_regs_t *dma = STM32_DMA1_REGS;
-	int idx = !(stat & STM32_DMA_ISR_HTIF(DMAC_TIM_RX2));
-	uint32_t mask = idx ? 0xFF000000 : 0x00FF0000;
-	uint32_t next = idx ? 0x00010000 : 0x01000000;
-
-	idx += 2;
-	sample_tstamp[idx] = __hw_clock_source_read();
-	sample_seq[idx] = ((seq++ << 3) & 0x0ff8) |
-			(SNIFFER_CHANNEL_CC2<<12);
-	if (filled_dma & next) {
-		oflow++;
-		sample_seq[idx] |= 0x8000;
-	} else {
-		led_set_record();
-	}
-	filled_dma |= mask;
+
+	if (!boot_ts.first_dma)
+		boot_ts.first_dma = ts_raw();
+	rx_half_done(SNIFFER_CHANNEL_CC2,
+		     !(stat & STM32_DMA_ISR_HTIF(DMAC_TIM_RX2)));
 	dma->ifcr = STM32_DMA_ISR_ALL(DMAC_TIM_RX2);
-	led_set_activity(1);
 }
 
-void tim_dma_handler(void)
+void __ram_code tim_dma_handler(void)
 {
 	stm32_dma_regs_t *dma = STM32_DMA1_REGS;
 	uint32_t stat = dma->isr & (STM32_DMA_ISR_HTIF(DMAC_TIM_RX1)
 				  | STM32_DMA_ISR_TCIF(DMAC_TIM_RX1)
 				  | STM32_DMA_ISR_HTIF(DMAC_TIM_RX2)
 				  | STM32_DMA_ISR_TCIF(DMAC_TIM_RX2));
+#ifdef SNIFFER_DMA_COPY
+	if (dma->isr & STM32_DMA_ISR_TCIF(DMAC_USB_COPY))
+		ep_copy_done();
+#endif
+	/* or the RX DMA was restarted meanwhile */
+	if (!stat)
+		return;
 	if (stat & STM32_DMA_ISR_ALL(DMAC_TIM_RX2))
 		tim_rx2_handler(stat);
 	else
 		tim_rx1_handler(stat);
-	/* time to process the samples */
-	task_set_event(TASK_ID_SNIFFER, TASK_EVENT_CUSTOM(stat), 0);
+	/* time to process the samples, already on their way in zero-copy */
+	if (!zc_active)
+		task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
 }
 DECLARE_IRQ(STM32_IRQ_DMA_CHANNEL_4_7, tim_dma_handler, 1);
 
+/*
+ * Activity LEDs, out of the DMA interrupt : every LED_PERIOD the hook task
+ * counts the edges the DMA captured on each line, from the half-buffer
+ * completions and its position in the current one. The green (CC1) and red
+ * (CC2) LEDs are lit for at least LED_EDGES_MIN edges in the period, the
+ * blue one while samples are captured without overflow. The updates stop
+ * with the edges, the sniffer task and the HOOK_SECOND restart them.
+ */
+#define LED_PERIOD (50 * MSEC)
+#define LED_EDGES_MIN 16
+
+static struct {
+	uint8_t running;
+	uint8_t gen[2];
+	uint32_t pos[2];
+	uint32_t oflow;
+} led;
+
+/* Samples written by the DMA on the channel 'ch' since the last update */
+static uint32_t led_edges(int ch)
+{
+	stm32_dma_chan_t *chan = dma_get_channel(
+		ch == SNIFFER_CHANNEL_CC2 ? DMAC_TIM_RX2 : DMAC_TIM_RX1);
+	uint32_t half = rx_total() / 2;
+	uint32_t pos = (rx_total() - chan->cndtr) % half;
+	uint8_t gen = rx_gen[ch];
+	uint32_t edges = (uint8_t)(gen - led.gen[ch]) * half + pos -
+			 led.pos[ch];
+
+	led.gen[ch] = gen;
+	led.pos[ch] = pos;
+	return edges;
+}
+
+static void led_update(void);
+DECLARE_DEFERRED(led_update);
+
+static void led_update(void)
+{
+	int ch, active = 0;
+	uint32_t edges;
+
+	for (ch = 0; ch < 2; ch++) {
+		edges = led_edges(ch);
+		gpio_set_level(ch ? GPIO_LED_R_L : GPIO_LED_G_L,
+			       edges < LED_EDGES_MIN);
+		active |= !!edges;
+	}
+	gpio_set_level(GPIO_LED_B_L, !active || oflow != led.oflow);
+	led.oflow = oflow;
+	led.running = active;
+	if (active)
+		hook_call_deferred(&led_update_data, LED_PERIOD);
+}
+
+static void led_kick(void)
+{
+	if (led.running)
+		return;
+	led.running = 1;
+	hook_call_deferred(&led_update_data, LED_PERIOD);
+}
+DECLARE_HOOK(HOOK_SECOND, led_kick, HOOK_PRIO_DEFAULT);
+
+/*
+ * Comparator setting of a CC line : bits 1:0 hysteresis (0 none, 1 low,
+ * 2 medium, 3 high), bits 3:2 mode (0 high speed, 1 medium speed, 2 low
+ * power, 3 ultra-low power), as in the COMP_CSR fields.
+ */
+#define SNIFFER_COMP(hyst, mode) ((hyst) | ((mode) << 2))
+#define SNIFFER_COMP_HYST(s) ((s) & 3)
+#define SNIFFER_COMP_MODE(s) (((s) >> 2) & 3)
+/* the COMP2 fields are the COMP1 ones 16 bits higher */
+#define COMP_CSR_BITS(ch, s) (((SNIFFER_COMP_HYST(s) << 12) | \
+			       (SNIFFER_COMP_MODE(s) << 2)) << (16 * (ch)))
+BUILD_ASSERT(COMP_CSR_BITS(0, SNIFFER_COMP(3, 3)) ==
+	     (STM32_COMP_CMP1HYST_HI | STM32_COMP_CMP1MODE_VLSPEED));
+BUILD_ASSERT(COMP_CSR_BITS(1, SNIFFER_COMP(3, 3)) ==
+	     (STM32_COMP_CMP2HYST_HI | STM32_COMP_CMP2MODE_VLSPEED));
+
+/* best edge fidelity : high hysteresis, high speed */
+static uint8_t comp_setting[2] = {
+	SNIFFER_COMP(3, 0), SNIFFER_COMP(3, 0)
+};
+
+/* TIMx ICxF input filter of the RX captures */
+static int rx_filter;
+/* Captures within a quarter of UI of the previous one since the last change */
+static uint32_t rx_glitches;
+
 static void rx_timer_init(int tim_id, timer_ctlr_t *tim, int ch_idx, int up_idx)
 {
 	int bit_idx = 8 * ((ch_idx - 1) % 2);
-	/* --- set counter for RX timing : 2.4Mhz rate, free-running --- */
+	uint16_t top = RX_WIDE() ? 0xFFFF : 0xFF;
+	/* --- set counter for RX timing : free-running --- */
 	__hw_timer_enable_clock(tim_id, 1);
 	/* Timer configuration */
 	tim->cr1 = 0x0004;
 	tim->cr2 = 0x0000;
-	/* Auto-reload value : 8-bit free running counter */
-	tim->arr = 0xFF;
-	/* Counter reloading event after 106us */
-	tim->ccr[1] = 0xFF;
-	/* Timer ICx input configuration */
+	/* Auto-reload value : 8 or 16-bit free running counter */
+	tim->arr = top;
+	/* Counter reloading event (after 106us at normal resolution) */
+	tim->ccr[1] = top;
+	/* Timer ICx input configuration with its ICxF input filter */
 	if (ch_idx <= 2)
-		tim->ccmr1 = 1 << bit_idx;
+		tim->ccmr1 = (1 | (rx_filter << 4)) << bit_idx;
 	else
-		tim->ccmr2 = 1 << bit_idx;
+		tim->ccmr2 = (1 | (rx_filter << 4)) << bit_idx;
 	tim->ccer = 0xB << ((ch_idx - 1) * 4);
-	/* TODO: add input filtering */
 	/* configure DMA request on CCRx update and overflow/update event */
 	tim->dier = (1 << (8 + ch_idx)) | (1 << (8 + up_idx));
-	/* set prescaler to /26 (F=2.4Mhz, T=0.4us) */
-	tim->psc = RX_CLOCK_DIV;
+	/* set prescaler (F=2.4Mhz, T=0.4us at normal resolution) */
+	tim->psc = res_table[rx_res].div - 1;
 	/* Reload the pre-scaler and reset the counter, clear CCRx */
 	tim->egr = 0x001F;
 	/* clear update event from reloading */
 	tim->sr = 0;
 }
 
+/* Start the RX DMA of the captured lines */
+static void rx_dma_start(void)
+{
+	if (rx_line != SNIFFER_CHANNEL_CC2)
+		dma_start_rx(&dma_tim_cc1, rx_total(), rx_base(0));
+	if (rx_line != SNIFFER_CHANNEL_CC1)
+		dma_start_rx(&dma_tim_cc2, rx_total(), rx_base(1));
+}
 
+static void input_timer_init(void);
 
 void sniffer_init(void)
 {
+	uint32_t size = RX_WIDE() ?
+		STM32_DMA_CCR_MSIZE_16_BIT | STM32_DMA_CCR_PSIZE_16_BIT :
+		STM32_DMA_CCR_MSIZE_8_BIT | STM32_DMA_CCR_PSIZE_8_BIT;
+
 	/* remap TIM1 CH1/2/3 to DMA channel 6 */
 	STM32_SYSCFG_CFGR1 |= 1 << 28;
 
@@ -265,148 +1133,2723 @@ void sniffer_init(void)
 	/* TIM3 CH4 for CC2 RX */
 	rx_timer_init(TIM_RX2, (void *)STM32_TIM_BASE(TIM_RX2),
 		      TIM_RX2_CCR_IDX, 2);
+	/* and its CH3 for the trigger input */
+	input_timer_init();
 
 	/* turn on COMP/SYSCFG */
 	STM32_RCC_APB2ENR |= 1 << 0;
-	STM32_COMP_CSR = STM32_COMP_CMP1EN | STM32_COMP_CMP1MODE_HSPEED |
+	STM32_COMP_CSR = STM32_COMP_CMP1EN |
 			 STM32_COMP_CMP1INSEL_VREF12 |
 			 STM32_COMP_CMP1OUTSEL_TIM1_IC1 |
-			 STM32_COMP_CMP1HYST_HI |
-			 STM32_COMP_CMP2EN | STM32_COMP_CMP2MODE_HSPEED |
+			 COMP_CSR_BITS(0, comp_setting[0]) |
+			 STM32_COMP_CMP2EN |
 			 STM32_COMP_CMP2INSEL_VREF12 |
 			 STM32_COMP_CMP2OUTSEL_TIM2_IC4 |
-			 STM32_COMP_CMP2HYST_HI;
+			 COMP_CSR_BITS(1, comp_setting[1]);
+	eye_comparators();
 
 	/* start sampling the edges on the CC lines using the RX timers */
-	dma_start_rx(&dma_tim_cc1, RX_COUNT, samples[0]);
-	dma_start_rx(&dma_tim_cc2, RX_COUNT, samples[1]);
+	dma_tim_cc1.flags = RX_DMA_FLAGS | size;
+	dma_tim_cc2.flags = RX_DMA_FLAGS | size;
+	rx_dma_start();
 	task_enable_irq(STM32_IRQ_DMA_CHANNEL_4_7);
 	/* start RX timers on CC1 and CC2 */
 	STM32_TIM_CR1(TIM_RX1) |= 1;
 	STM32_TIM_CR1(TIM_RX2) |= 1;
+	if (!boot_ts.capture)
+		boot_ts.capture = ts_raw();
 }
-DECLARE_HOOK(HOOK_INIT, sniffer_init, HOOK_PRIO_DEFAULT);
-
-/* state of the simple text tracer */
-extern int trace_mode;
-
-/* Index of the next buffer to use inside the 'samples' array */
-static uint32_t sp_idx;
-/* bitmap of the 'samples' sub-buffer filled with packet binary traces */
-static volatile uint32_t filled_pkt;
+/*
+ * First of the init hooks : the DMA and the clocks are set up by main()
+ * before the tasks start, nothing else is needed to capture and the first
+ * negotiation happens while USB and the other modules are initializing.
+ */
+DECLARE_HOOK(HOOK_INIT, sniffer_init, HOOK_PRIO_FIRST);
 
-/* Task to post-process the samples and copy them the USB endpoint buffer */
-void sniffer_task(void)
+void sniffer_set_rx_filter(int filter)
 {
-	int u = 0; /* current USB buffer index */
-	int d = 0; /* current DMA buffer index */
-	int off = 0; /* DMA buffer offset */
-
-	while (1) {
-		/* Wait for a new buffer of samples or a new USB free buffer */
-		task_wait_event(-1);
-		/* send the available samples over USB if we have a buffer*/
-		while (filled_dma && free_usb) {
-			while (!(filled_dma & (1 << d))) {
-				d = (d + 1) & 31;
-				off += EP_PAYLOAD_SIZE;
-				if (off >= RX_COUNT)
-					off = 0;
-			}
-
-			ep_buf[u][0] = sample_seq[d >> 3] | (d & 7);
-			ep_buf[u][1] = sample_tstamp[d >> 3];
-
-			memcpy_to_usbram(
-					((void *)usb_sram_addr(ep_buf[u]
-						+ (EP_PACKET_HEADER_SIZE>>1))),
-					samples[d >> 4]+off,
-					EP_PAYLOAD_SIZE);
-			atomic_clear((uint32_t *)&free_usb, 1 << u);
-			u = !u;
-			atomic_clear(&filled_dma, 1 << d);
-		}
-		led_reset_record();
+	timer_ctlr_t *tim1 = (void *)STM32_TIM_BASE(TIM_RX1);
+	timer_ctlr_t *tim2 = (void *)STM32_TIM_BASE(TIM_RX2);
 
-		if (trace_mode != TRACE_MODE_OFF) {
-			uint8_t curr = recording_enable(0);
-			filled_pkt = 0;
-			trace_packets();
-			filled_dma = 0;
-			recording_enable(curr);
-		}
-	}
+	rx_filter = filter & 0xF;
+	/* ICxF can be changed while capturing : IC1F on TIM1, IC4F on TIM2 */
+	tim1->ccmr1 = (tim1->ccmr1 & ~0x00F0) | (rx_filter << 4);
+	tim2->ccmr2 = (tim2->ccmr2 & ~0xF000) | (rx_filter << 12);
+	rx_glitches = 0;
 }
 
-void sniffer_trace_reload(void)
+int sniffer_get_rx_filter(void)
 {
-	static uint32_t u;
-	/* copy a new buffer to send over USB if needed */
-	while (free_usb && filled_pkt) {
-		static int idx;
-		uint8_t *buff;
-
-		while (!(filled_pkt & (1 << idx)))
-			idx = (idx + 1) & 31;
-		buff = &samples[idx >> 4][(idx & 0xF) * EP_PAYLOAD_SIZE];
-		/* it's faster to let some junk at the end of the buffer */
-		memcpy_to_usbram(((void *)usb_sram_addr(ep_buf[u])), buff, 40);
-		atomic_clear((uint32_t *)&free_usb, 1 << u);
-		u = !u;
-		filled_pkt &= ~(1 << idx);
-	}
+	return rx_filter;
 }
 
-void sniffer_trace_packet(struct rx_header rx, uint32_t *payload)
+uint8_t sniffer_get_recording(void)
 {
-	uint32_t tstamp = __hw_clock_source_read();
-	uint32_t *buf = (uint32_t *)
-		&samples[sp_idx >> 4][(sp_idx & 0xF) * EP_PAYLOAD_SIZE];
-
-	buf[0] = tstamp;
-	buf[1] = sp_idx | 0xfada0000; /* reserved */
-	buf[2] = *(uint32_t *)&rx;
-	memcpy(buf + 3, payload, 7 * sizeof(uint32_t));
-	filled_pkt |= 1 << sp_idx;
-	sp_idx = (sp_idx + 1) & 31;
-
-	/* copy a new buffer to send over USB if starved */
-	if (free_usb == 3)
-		sniffer_trace_reload();
+	return channel_mask;
 }
 
-int wait_packet(int pol, uint32_t min_edges, uint32_t timeout_us)
+uint32_t sniffer_glitch_count(void)
 {
-	stm32_dma_chan_t *chan = dma_get_channel(pol ? DMAC_TIM_RX2
-						     : DMAC_TIM_RX1);
-	uint32_t t0 = __hw_clock_source_read();
-	uint32_t c0 = chan->cndtr;
-	uint32_t t_gap = t0;
-	uint32_t c_gap = c0;
-	uint32_t total_edges = 0;
+	return rx_glitches;
+}
+
+/* state of the simple text tracer */
+extern int trace_mode;
+
+/*
+ * Binary trace record, 32-bit words :
+ *   [0] timestamp bits 31:0 in us
+ *   [1] bits 31:16 : 0xfada, bits 15:0 : records dropped before this one
+ *       or 0xfadc for a frame sent by the injector, bits 15:0 : its time
+ *       on the line in us, the timestamp being its first edge
+ *       or 0xfadd for a violation found by the checker, bits 15:0 : its
+ *       CHECK_x kind, [2] being the message and [3] its value
+ *       or 0xfade for the repeats of the message [2] coalesced by the
+ *       tracer, [3] being their count and [0] the time of the last one
+ *       or 0xfadf for the edges of the packet [2] which failed to decode
+ *       (TRACE_ERRWIN_x), bits 15:0 : format, record number and count of
+ *       the edges in [3..9], [10] bits 31:16 being the index of its first
+ *       edge in the capture
+ *   [2] RX header (PD header, TCPC_TX_x packet type)
+ *   [3..9] payload
+ *   [10] bits 7:0 : timestamp bits 39:32, bits 15:8 : CC line (1 or 2),
+ *        bits 31:16 : for a received packet, its EOP in 1/16 us after the
+ *        timestamp, which is its first preamble edge (0 : not decoded)
+ */
+#define TRACE_REC_SIZE 44
+#define TRACE_REC_PAYLOAD (7 * sizeof(uint32_t))
+/* Default number of trace records buffered in the shared memory */
+#define TRACE_DEPTH_DEFAULT 64
+/* Records fitting in the 'samples' array if the shared memory is busy */
+#define TRACE_DEPTH_FALLBACK 32
+BUILD_ASSERT(TRACE_DEPTH_FALLBACK * TRACE_REC_SIZE <= sizeof(samples));
+
+/* Packet binary traces waiting for USB, the buffer is set by trace_start() */
+static struct queue_state trace_state;
+static struct queue trace_queue = {
+	.state      = &trace_state,
+	.policy     = &queue_policy_null,
+	.unit_bytes = TRACE_REC_SIZE,
+};
+/* Number of records requested for the trace buffer (a power of two) */
+static int trace_depth = TRACE_DEPTH_DEFAULT;
+/* Shared memory backing the trace buffer, NULL when using 'samples' */
+static char *trace_mem;
+/* Records dropped since the last queued record and since the trace start */
+static uint32_t trace_dropped;
+static uint32_t trace_drop_total;
+/* The record at the head of the queue is being copied to the USB memory */
+static int trace_sending;
+
+/*
+ * Packed records ('sniffer trace packed') : the trailing zero words of the
+ * payload are trimmed and as many whole records as fit go in each USB
+ * packet, a short one as soon as the queue runs dry. A packed record has
+ * TRACE_TAG_PACKED set in its tag, its word [10] follows the RX header with
+ * the number of payload words in its bits 15:12, then the payload words.
+ */
+#define TRACE_TAG_PACKED 0x01000000
+static int trace_packed;
+/* USB packet of packed records, untouched until ep_copying is cleared */
+static uint32_t trace_pack_buf[EP_BUF_SIZE / sizeof(uint32_t)];
+
+/* Sequence number of the next packet */
+static uint16_t ep_seq;
+/* Bytes handed to the bulk endpoint, headers included */
+static uint32_t ep_bytes;
+/* Packets handed to the bulk endpoint, ep_seq wraps within seconds */
+static uint32_t ep_packets;
+
+static int trigger_window(void);
+
+/*
+ * CRC-32 of the header words 0 to 5 followed by the payload.
+ * The CRC unit is shared with the PD messages processing of the other
+ * tasks : its state is saved and restored around the computation, which
+ * is done in one go rather than through the per-word crc32_ctx_ calls.
+ */
+static uint32_t packet_crc(const uint16_t *hdr, const uint8_t *payload,
+			   int len)
+{
+	uint32_t state, crc;
+	int i;
+
+	interrupt_disable();
+	state = crc32_hw_exchange(0xFFFFFFFF);
+	for (i = 0; i < 6; i++)
+		crc32_hash16(hdr[i]);
+	for (i = 0; i + 1 < len; i += 2)
+		crc32_hash16(payload[i] | (payload[i + 1] << 8));
+	if (len & 1)
+		crc32_hash16(payload[len - 1]);
+	crc = crc32_result();
+	crc32_hw_exchange(state);
+	interrupt_enable();
+
+	return crc;
+}
+
+/*
+ * Send a packet with the header flags 'flags' and timestamp 'tstamp' and a
+ * payload of 'len' bytes from 'payload', which must stay untouched until
+ * ep_copying is cleared.
+ */
+static void ep_send(uint16_t flags, timestamp_t tstamp, const void *payload,
+		    int len)
+{
+	usb_uint *buf = ep_ring_buf(ep_head);
+	uint16_t hdr[EP_PACKET_HEADER_SIZE / 2];
+	uint32_t crc;
+	int i;
+
+	if (trigger_window())
+		flags |= SNIFFER_FLAG_TRIGGER;
+	hdr[0] = SNIFFER_MAGIC | (SNIFFER_USB_PROTOCOL << 8);
+	hdr[1] = flags | SNIFFER_FLAG_RES(rx_res);
+	hdr[2] = ep_seq++;
+	hdr[3] = len | ((tstamp.le.hi & 0xff) << 8);
+	hdr[4] = tstamp.le.lo & 0xffff;
+	hdr[5] = tstamp.le.lo >> 16;
+	crc = packet_crc(hdr, payload, len);
+	hdr[6] = crc & 0xffff;
+	hdr[7] = crc >> 16;
+
+	for (i = 0; i < ARRAY_SIZE(hdr); i++)
+		buf[i] = hdr[i];
+	ep_bytes += EP_PACKET_HEADER_SIZE + len;
+	ep_packets++;
+	ep_ring_fill(EP_PACKET_HEADER_SIZE, payload, len,
+		     EP_PACKET_HEADER_SIZE + len);
+}
+
+#ifdef SNIFFER_ZERO_COPY
+/*
+ * Zero-copy capture (experimental) : the RX DMA of one CC line writes its
+ * samples straight into the USB packet memory, the DMA interrupt writes the
+ * header of each device packet in place and arms the endpoint with it, the
+ * task has nothing to copy and sleeps.
+ *
+ * The circular DMA needs contiguous memory, so the headers cannot sit
+ * between the samples : the ring slots are split into 2 header slots and a
+ * DMA buffer of 4 slots, each half of it the samples of 2 USB packets. The
+ * device packet of a half is its header slot followed by its 2 slots of
+ * samples, ZC_PAD_SIZE bytes of padding after the header (SNIFFER_FLAG_PAD)
+ * keep its USB packets full so that a short one does not split it across
+ * host transfers.
+ *
+ * The packet memory takes the byte and half-word writes of the DMA, and is
+ * contiguous when accessed by half-words : no word access here. Just the
+ * samples are sent, no idle marker, record, trigger flag or decoding.
+ */
+#define ZC_RING_SLOT 2
+#define ZC_SLOTS (ZC_RING_SLOT + 4)
+#define ZC_HALF_SIZE (2 * EP_BUF_SIZE)
+#define ZC_PAD_SIZE EP_PAYLOAD_SIZE
+#define ZC_LEN (ZC_PAD_SIZE + ZC_HALF_SIZE)
+#define SNIFFER_FLAG_PAD 0x0100 /* ZC_PAD_SIZE bytes before the samples */
+BUILD_ASSERT(EP_BUF_COUNT >= ZC_SLOTS);
+BUILD_ASSERT(CONFIG_USB_RAM_ACCESS_SIZE == 2);
+BUILD_ASSERT(ZC_LEN <= 0xff);
+
+/* Line captured, requested by the console : SNIFFER_CHANNEL_x or -1 */
+static int zc_line = -1;
+/* Header flag of the next packet after a drop */
+static uint16_t zc_gap;
+static uint32_t zc_packets;
+static uint32_t zc_dropped;
+static uint32_t zc_late;
+
+/* Arm the queued slots in the free hardware buffers */
+static void zc_arm(void)
+{
+	while (ep_armed < 2 && zc_next != zc_head)
+		ep_arm(ep_buf[zc_queue[zc_next++ % ZC_QUEUE]], EP_BUF_SIZE);
+}
+
+/* DMA half of the samples or the header held by the slot 'slot' */
+static inline int zc_half(int slot)
+{
+	return slot < ZC_RING_SLOT ? slot : (slot - ZC_RING_SLOT) / 2;
+}
+
+static void __ram_code zc_tx(void)
+{
+	/* acknowledge the completion */
+	STM32_TOGGLE_EP(USB_EP_SNIFFER, 0, 0, EP_CTR_RX);
+	if (ep_armed) {
+		if (!(ep_armed_zlp & 1))
+			zc_left[zc_half(zc_queue[zc_tail++ % ZC_QUEUE])]--;
+		ep_armed_zlp >>= 1;
+		ep_armed--;
+	}
+	zc_arm();
+	if (!ep_armed)
+		ep_arm(ep_buf[0], 0);
+}
+
+static void zc_drop(int ch)
+{
+	zc_dropped++;
+	oflow++;
+	notify_post(INJ_NOTIFY_OFLOW, 1, get_time().val);
+	oflow_ch[ch]++;
+	zc_gap = SNIFFER_FLAG_OFLOW;
+}
+
+/* The DMA has filled the half 'half' : send it, the next one is going on */
+static void zc_half_done(int ch, int half)
+{
+	usb_uint *hdr = ep_buf[half];
+	const usb_uint *s = ep_buf[ZC_RING_SLOT + 2 * half];
+	timestamp_t tstamp = get_time();
+	uint32_t state, crc;
+	int i;
+
+	rx_gen[ch]++;
+	if (zc_left[half] || ep_alt != SNIFFER_ALT_BULK) {
+		/* its slots are still held by the packet of the previous lap */
+		zc_drop(ch);
+		return;
+	}
+	if (zc_left[!half]) {
+		if ((uint8_t)(zc_head - zc_next) == 3) {
+			/* the DMA is overwriting it : drop it, not armed yet */
+			zc_head -= 3;
+			zc_next = zc_head;
+			zc_left[!half] = 0;
+			zc_drop(ch);
+		} else {
+			/* already going out, torn : the host sees a bad CRC */
+			zc_late++;
+		}
+	}
+
+	hdr[0] = SNIFFER_MAGIC | (SNIFFER_USB_PROTOCOL << 8);
+	hdr[1] = zc_gap | SNIFFER_FLAG_PAD | SNIFFER_FLAG_RES(rx_res) |
+		 (ch == SNIFFER_CHANNEL_CC2 ? SNIFFER_FLAG_CC2 : 0);
+	hdr[2] = ep_seq++;
+	hdr[3] = ZC_LEN | ((tstamp.le.hi & 0xff) << 8);
+	hdr[4] = tstamp.le.lo & 0xffff;
+	hdr[5] = tstamp.le.lo >> 16;
+	zc_gap = 0;
+	/* as packet_crc(), from the packet memory : the padding, the samples */
+	state = crc32_hw_exchange(0xFFFFFFFF);
+	for (i = 0; i < 6; i++)
+		crc32_hash16(hdr[i]);
+	for (i = EP_PACKET_HEADER_SIZE / 2; i < EP_BUF_SIZE / 2; i++)
+		crc32_hash16(hdr[i]);
+	for (i = 0; i < ZC_HALF_SIZE / 2; i++)
+		crc32_hash16(s[i]);
+	crc = crc32_result();
+	crc32_hw_exchange(state);
+	hdr[6] = crc & 0xffff;
+	hdr[7] = crc >> 16;
+
+	zc_queue[zc_head++ % ZC_QUEUE] = half;
+	zc_queue[zc_head++ % ZC_QUEUE] = ZC_RING_SLOT + 2 * half;
+	zc_queue[zc_head++ % ZC_QUEUE] = ZC_RING_SLOT + 2 * half + 1;
+	zc_left[half] = 3;
+	zc_packets++;
+	ep_bytes += EP_PACKET_HEADER_SIZE + ZC_LEN;
+	ep_packets++;
+	zc_arm();
+}
+#endif
+
+/* Samples of the sub-buffer 'sub' of the half-buffer 'desc' */
+#define SUB_BUF(desc, sub) ((desc)->samples + (sub) * EP_PAYLOAD_SIZE)
+/* Index of the first sample of the sub-buffer 'sub' */
+#define SUB_IDX(sub) (((sub) * EP_PAYLOAD_SIZE) >> RX_WIDE())
+
+/*
+ * Header flags of the sub-buffer 'sub' of 'desc', about to be copied :
+ * the copy is checked against the DMA once done.
+ */
+static uint16_t sub_flags(const struct rx_desc *desc, int sub)
+{
+	uint16_t flags = desc->flags | sub;
+
+	if (rx_gap[desc->channel])
+		flags |= SNIFFER_FLAG_OFLOW;
+	rx_gap[desc->channel] = 0;
+	copy_desc = *desc;
+	copy_idx = SUB_IDX(sub);
+	return flags;
+}
+
+/* Longest run of idle samples reported by one marker (~1s at normal res) */
+#define IDLE_MAX_COUNT (20 * HALF_BUF_SIZE)
+
+/* Run of idle half-buffers not reported yet on each CC line */
+static struct idle_run {
+	uint32_t count; /* number of suppressed samples (0 if no run) */
+	uint16_t flags;
+	uint16_t value;
+	timestamp_t tstamp;
+} idle_run[2];
+
+/* Does the half-buffer 'desc' only hold overflows ? */
+static int half_buf_idle(const struct rx_desc *desc)
+{
+	const uint32_t *w = (const uint32_t *)desc->samples;
+	uint32_t v = sample_get(desc->samples, 0) *
+		     (RX_WIDE() ? 0x00010001 : 0x01010101);
+	int i;
+
+	for (i = 0; i < HALF_BUF_SIZE / 4; i++)
+		if (w[i] != v)
+			return 0;
+	return 1;
+}
+
+/* Report the pending idle run of the channel 'ch' */
+static void send_idle(int ch)
+{
+	struct idle_run *run = idle_run + ch;
+	/* short payload : copied right away */
+	uint16_t payload[3] = { run->count & 0xffff, run->count >> 16,
+				run->value };
+
+	ep_send(run->flags | SNIFFER_FLAG_IDLE, run->tstamp, payload,
+		sizeof(payload));
+	run->count = 0;
+}
+
+/*
+ * Report the idle run of the channel 'ch' keeping the stream in timestamp
+ * order : an older run of the other channel is reported first.
+ * Sends a single packet, returns 1 if it was the run of 'ch'.
+ */
+static int report_idle(int ch)
+{
+	struct idle_run *other = idle_run + !ch;
+
+	if (other->count && other->tstamp.val < idle_run[ch].tstamp.val) {
+		send_idle(!ch);
+		return 0;
+	}
+	send_idle(ch);
+	return 1;
+}
+
+/*
+ * Fold the idle half-buffer 'desc' into the idle run of its channel,
+ * returns 1 if it was consumed or 0 if the previous run had to be reported
+ * first.
+ */
+static int add_idle(const struct rx_desc *desc)
+{
+	struct idle_run *run = idle_run + desc->channel;
+	uint16_t value = sample_get(desc->samples, 0);
+	uint32_t count = HALF_BUF_SIZE >> RX_WIDE();
+
+	/*
+	 * there was a single edge or the run is long enough :
+	 * close the previous run
+	 */
+	if (run->count && (run->value != value ||
+			   run->count + count > IDLE_MAX_COUNT)) {
+		report_idle(desc->channel);
+		return 0;
+	}
+	if (!run->count) {
+		run->flags = desc->flags;
+		run->tstamp = desc->tstamp;
+		run->value = value;
+	}
+	run->count += count;
+
+	return 1;
+}
+
+/*
+ * Encode the samples of one DMA sub-buffer in the packed format.
+ *
+ * 'last' is the capture value rebuilt by the decoder so far, it is updated
+ * only if the whole sub-buffer fits into 'room' bytes.
+ * Returns the number of bytes written or -1 if there is not enough room.
+ */
+static int pack_samples(uint8_t *out, int room, const uint8_t *in,
+			uint8_t *last, int escape_first)
+{
+	uint8_t prev = *last;
+	uint32_t acc = 0;
+	int bits = 0;
+	int len = 0;
+	int i;
+
+	for (i = 0; i < EP_PAYLOAD_SIZE; i++) {
+		uint8_t delta = in[i] - prev;
+
+		if (i == 0 && escape_first) {
+			acc |= (PACK_CODE_ESC | (in[i] << 2)) << bits;
+			bits += 10;
+			prev = in[i];
+		} else if (delta == 0) {
+			acc |= PACK_CODE_SAME << bits;
+			bits += 2;
+		} else if (PACK_CLASS(delta, PACK_TICKS_SHORT)) {
+			acc |= PACK_CODE_SHORT << bits;
+			bits += 2;
+			prev += PACK_TICKS_SHORT;
+		} else if (PACK_CLASS(delta, PACK_TICKS_LONG)) {
+			acc |= PACK_CODE_LONG << bits;
+			bits += 2;
+			prev += PACK_TICKS_LONG;
+		} else {
+			acc |= (PACK_CODE_ESC | (in[i] << 2)) << bits;
+			bits += 10;
+			prev = in[i];
+		}
+		for (; bits >= 8; bits -= 8, acc >>= 8) {
+			if (len == room)
+				return -1;
+			out[len++] = acc;
+		}
+	}
+	*last = prev;
+	return len;
+}
+
+/*
+ * Send the sub-buffer 'sub' of the half-buffer 'desc' as is,
+ * returns the next sub-buffer index.
+ */
+static int send_raw(const struct rx_desc *desc, int sub)
+{
+	ep_send(sub_flags(desc, sub), desc->tstamp, SUB_BUF(desc, sub),
+		EP_PAYLOAD_SIZE);
+
+	return sub + 1;
+}
+
+/*
+ * Pack as many sub-buffers of the half-buffer 'desc' as possible starting
+ * from 'sub' into one USB packet, returns the next sub-buffer index.
+ */
+static int send_packed(const struct rx_desc *desc, int sub)
+{
+	/* static : the DMA copy may still be reading it after we return */
+	static uint8_t payload[EP_PAYLOAD_SIZE] __aligned(2);
+	uint8_t last = 0;
+	int len = 0;
+	int n;
+
+	/* stay inside the half-buffer described by the packet header */
+	for (n = sub; n < SUB_BUF_COUNT; n++) {
+		int ret = pack_samples(payload + len, EP_PAYLOAD_SIZE - len,
+				       SUB_BUF(desc, n), &last, n == sub);
+		if (ret < 0)
+			break;
+		len += ret;
+	}
+	/* too many odd intervals to save anything */
+	if (n == sub)
+		return send_raw(desc, sub);
+
+	ep_send(sub_flags(desc, sub) | SNIFFER_FLAG_PACKED, desc->tstamp,
+		payload, len);
+
+	return n;
+}
+
+/*
+ * Capture trigger
+ *
+ * When armed, the half-buffers are only scanned for the trigger conditions
+ * and recycled by the DMA, nothing is sent over USB. The half-buffer where
+ * the trigger fires is sent entirely, it holds the pre-trigger window, then
+ * everything captured during the post-trigger window is streamed as usual.
+ */
+enum trigger_state {
+	TRIG_OFF = 0, /* no trigger : stream everything */
+	TRIG_ARMED,   /* waiting for a trigger condition */
+	TRIG_FIRED,   /* streaming the post-trigger window */
+	TRIG_DONE,    /* capture done, waiting to be re-armed */
+};
+
+/* Trigger sources */
+#define TRIG_SRC_RESET  (1 << 0) /* Hard Reset or Cable Reset ordered set */
+#define TRIG_SRC_HEADER (1 << 1) /* message header matching mask/value */
+#define TRIG_SRC_VBUS   (1 << 2) /* VBUS crossing the power monitor limit */
+
+/* Default post-trigger window */
+#define TRIG_POST_DEFAULT_US (100 * MSEC)
+
+static struct {
+	enum trigger_state state;
+	uint8_t sources;
+	uint16_t hdr_mask;
+	uint16_t hdr_value;
+	uint32_t post_us;
+	timestamp_t fired;
+	volatile int vbus_hit;
+	int hit; /* trigger condition found in the last decoded half-buffer */
+} trig = {
+	.post_us = TRIG_POST_DEFAULT_US,
+};
+
+/*
+ * USB quality of service : when the host does not read the stream fast
+ * enough, the half-buffers pile up in rx_queue and the DMA overwrites the
+ * ones not given back. Rather than losing everything in that window, the
+ * task steps down to the decoded packet records only, then to the event
+ * records only, giving the half-buffers back as soon as they are decoded.
+ * It steps back up once the USB ring has stayed mostly empty for
+ * QOS_RECOVER_US.
+ */
+/* Half-buffers waiting in rx_queue to step down */
+#define QOS_DOWN_DEPTH 4
+#define QOS_RECOVER_US (200 * MSEC)
+
+static struct {
+	uint8_t enabled;
+	uint8_t level;     /* SNIFFER_QOS_x */
+	uint8_t pending;   /* the QoS record of 'level' is not sent yet */
+	uint16_t dropped;  /* half-buffers not streamed, for the record */
+	uint32_t oflow;    /* overflow count at the last update */
+	uint32_t drops;    /* decode_drops at the last update */
+	timestamp_t since; /* time of the last change */
+	timestamp_t calm;  /* start of the low USB usage, 0 if busy */
+	uint32_t downs;    /* number of step downs */
+} qos = {
+	.enabled = 1,
+};
+
+/*
+ * USB suspend : the sleeping host no longer drains the endpoint. The stream
+ * steps down to the event records, the decoded packets go on filling the
+ * flight recorder, and the device wakes the host up (if it allowed remote
+ * wake-up) when the trigger fires or before the recorder overwrites the
+ * records of the suspend. The host reads them back with INJ_BIN_FLIGHT.
+ */
+#define SUSP_WAKE_ON_TRIGGER (1 << 0)
+#define SUSP_WAKE_ON_FULL    (1 << 1)
+/* Flight records written during the suspend to wake the host up */
+#define SUSP_WAKE_RECS (FLIGHT_RECS * 3 / 4)
+
+static struct {
+	uint8_t active;    /* the bus is suspended */
+	uint8_t wake_on;   /* SUSP_WAKE_ON_x */
+	uint8_t reason;    /* SNIFFER_WAKE_x of the current suspend */
+	uint8_t pending;   /* the suspend record is not sent yet */
+	uint32_t written;  /* flight_written() at the start of the suspend */
+	timestamp_t since; /* start of the suspend */
+	uint16_t kept;     /* for the record : flight records held */
+	uint16_t lost;     /* and overwritten */
+	uint32_t ms;       /* and duration */
+	uint32_t count;    /* number of suspends */
+	uint32_t wakes;    /* remote wake-ups requested */
+} susp = {
+	.wake_on = SUSP_WAKE_ON_TRIGGER | SUSP_WAKE_ON_FULL,
+};
+
+static int trigger_header_match(uint16_t header)
+{
+	return (header & trig.hdr_mask) == trig.hdr_value;
+}
+
+/*
+ * On-device BMC decoder
+ *
+ * Each non-idle half-buffer is decoded once before being sent : for the
+ * trigger conditions when armed and into packet records queued after its
+ * samples when the decoding is enabled. The raw samples are still streamed.
+ */
+
+/*
+ * Interval classification for the decoder in RX timer ticks, from the half
+ * UI 'ticks' of the resolution
+ */
+#define BMC_SHORT_MAX(ticks) (((ticks) + 2 * (ticks)) / 2)
+#define BMC_LONG_MAX(ticks)  (3 * (ticks))
+
+/* Longest packet : header, 7 data objects and CRC */
+#define BMC_MAX_BYTES (2 + 7 * 4 + 4)
+
+/* Bit decoder state on each CC line */
+static struct bmc_decoder {
+	uint32_t bits;   /* last 20 bits received, first one in bit 0 */
+	uint16_t last;   /* previous capture value */
+	uint8_t half;    /* got the first half of a '1' bit */
+	uint8_t ovf;     /* counter overflows since the last edge */
+	uint8_t in_pkt;  /* got a SOP, decoding the packet symbols */
+	uint8_t sop;     /* SOP type of the packet : 0 SOP, 1 SOP', 2 SOP'' */
+	uint8_t nbits;   /* bits received of the current symbol */
+	uint8_t nibbles; /* nibbles decoded since the SOP */
+	uint8_t data[BMC_MAX_BYTES];
+} bmc_dec[2];
+
+/* Decoded packet waiting for the samples it was decoded from to be sent */
+struct pkt_rec {
+	timestamp_t tstamp; /* timestamp of the half-buffer with the EOP */
+	uint16_t flags;     /* channel flag of that half-buffer */
+	uint16_t end;       /* index of the EOP last sample in the half-buffer */
+	uint8_t sop;       /* or kind of an event record */
+	uint8_t len;
+	uint8_t event;     /* SNIFFER_REC_EVENT, else SNIFFER_REC_PACKET */
+	uint8_t data[BMC_MAX_BYTES];
+};
+
+static struct queue const pkt_queue = QUEUE_NULL(4, struct pkt_rec);
+/* Send the decoded packet records */
+static int decode_enabled;
+/* Decoded packets, symbol errors and records dropped as the queue is full */
+static uint32_t decode_count;
+static uint32_t decode_errors;
+static uint32_t decode_drops;
+
+/* Queue the event record 'kind' of the half-buffer 'desc' while degraded */
+static void bmc_event(const struct rx_desc *desc, int kind)
+{
+	struct pkt_rec rec;
+
+	if (qos.level == SNIFFER_QOS_SAMPLES)
+		return;
+	rec.tstamp = desc->tstamp;
+	rec.flags = desc->flags & SNIFFER_FLAG_CC2;
+	rec.sop = kind;
+	rec.event = 1;
+	if (!queue_add_unit(&pkt_queue, &rec))
+		decode_drops++;
+}
+
+/* Count the decoding error 'err' of the packet ending in 'desc' */
+static void bmc_error(const struct rx_desc *desc, int err)
+{
+	stats_error(err);
+	flight_error(desc->tstamp.le.lo, desc->channel + 1, err);
+	bmc_event(desc, INJ_FLIGHT_ERROR(err));
+}
+
+static void bmc_reset(const struct rx_desc *desc, struct bmc_decoder *dec)
+{
+	/* the line went idle or garbled in the middle of a packet */
+	if (dec->in_pkt)
+		bmc_error(desc, INJ_STATS_ERR_EOP);
+	dec->bits = 0;
+	dec->half = 0;
+	dec->in_pkt = 0;
+}
+
+/* Queue the record of the packet ending at the sample 'i' of 'desc' */
+static void bmc_packet(const struct rx_desc *desc, struct bmc_decoder *dec,
+		       int i)
+{
+	struct pkt_rec rec;
+	uint16_t head = dec->data[0] | (dec->data[1] << 8);
+	int len = dec->nibbles >> 1;
+	uint32_t crc, crc_rx;
+	int n;
+
+	/* the samples may have changed under the decoder */
+	if (rx_torn(desc, 0)) {
+		torn_pkts++;
+		return;
+	}
+
+	/* header, data objects and CRC */
+	if (len < 6 || len != 2 + PD_HEADER_CNT(head) * 4 + 4) {
+		bmc_error(desc, INJ_STATS_ERR_DATA);
+	} else {
+		crc32_ctx_init(&crc);
+		crc32_ctx_hash16(&crc, head);
+		for (n = 2; n < len - 4; n += 4) {
+			memcpy(&crc_rx, dec->data + n, 4);
+			crc32_ctx_hash32(&crc, crc_rx);
+		}
+		memcpy(&crc_rx, dec->data + len - 4, 4);
+		if (crc32_ctx_result(&crc) == crc_rx) {
+			eye_packet(desc->channel, desc->tstamp.val);
+			stats_packet(dec->sop, head);
+			/* the first data object, or the CRC if there is none */
+			memcpy(&crc_rx, dec->data + 2, 4);
+			flight_packet(desc->tstamp.le.lo, desc->channel + 1,
+				      dec->sop, head,
+				      PD_HEADER_CNT(head) ? crc_rx : 0);
+		} else {
+			bmc_error(desc, INJ_STATS_ERR_CRC);
+		}
+	}
+
+	if (trace_mode == TRACE_MODE_DUAL) {
+		decode_count++;
+		trace_line_packet(desc->channel, desc->tstamp.val, dec->sop,
+				  dec->data, dec->nibbles >> 1);
+		return;
+	}
+	/* the packets are what the host gets first while degraded */
+	if (qos.level == SNIFFER_QOS_EVENTS ||
+	    (!decode_enabled && qos.level != SNIFFER_QOS_PACKETS))
+		return;
+
+	decode_count++;
+	rec.tstamp = desc->tstamp;
+	rec.flags = desc->flags & SNIFFER_FLAG_CC2;
+	rec.end = i;
+	rec.sop = dec->sop;
+	rec.len = dec->nibbles >> 1;
+	rec.event = 0;
+	memcpy(rec.data, dec->data, rec.len);
+	if (!queue_add_unit(&pkt_queue, &rec))
+		decode_drops++;
+}
+
+/*
+ * Decode the 5-bit symbol just received at the sample 'i' of 'desc'
+ * after a SOP, returns 1 if the packet header matches the trigger.
+ */
+static int bmc_symbol(const struct rx_desc *desc, struct bmc_decoder *dec,
+		      int i)
+{
+	uint8_t sym = dec->bits >> 15;
+	uint8_t nib = dec4b5b[sym];
+
+	dec->nbits = 0;
+	if (sym == PD_EOP) {
+		bmc_packet(desc, dec, i);
+		dec->in_pkt = 0;
+		return 0;
+	}
+	if (nib >= 0x10 || dec->nibbles == 2 * BMC_MAX_BYTES) {
+		/* not a data symbol or too long : drop the packet */
+		decode_errors++;
+		bmc_error(desc, INJ_STATS_ERR_DATA);
+		dec->in_pkt = 0;
+		return 0;
+	}
+
+	if (dec->nibbles & 1)
+		dec->data[dec->nibbles >> 1] |= nib << 4;
+	else
+		dec->data[dec->nibbles >> 1] = nib;
+	dec->nibbles++;
+
+	/* got the message header */
+	return dec->nibbles == 4 && (trig.sources & TRIG_SRC_HEADER) &&
+	       trigger_header_match(dec->data[0] | (dec->data[1] << 8));
+}
+
+/*
+ * Decode the bits of the half-buffer 'desc' captured at the resolution
+ * 'res' : 1 if triggered. Always inlined with a constant 'res', so that each
+ * instance below gets its sample width and thresholds as immediates.
+ */
+static inline __attribute__((always_inline))
+int bmc_scan_res(const struct rx_desc *desc, const int res)
+{
+	struct bmc_decoder *dec = bmc_dec + desc->channel;
+	const int wide = res_table[res].wide;
+	const int ticks = res_table[res].ticks;
+	uint16_t mask = wide ? 0xFFFF : 0xFF;
+	int hit = 0;
+	int i;
+
+	for (i = 0; i < HALF_BUF_SIZE >> wide; i++) {
+		uint16_t in = wide ? ((const uint16_t *)desc->samples)[i] :
+				     desc->samples[i];
+		uint16_t delta = (in - dec->last) & mask;
+		int bit;
+
+		dec->last = in;
+		if (!delta) {
+			/* counter overflow : idle line if there is a second one */
+			if (++dec->ovf >= 2)
+				bmc_reset(desc, dec);
+			continue;
+		}
+		dec->ovf = 0;
+		if (delta > BMC_LONG_MAX(ticks)) {
+			/* garbage : restart from scratch */
+			bmc_reset(desc, dec);
+			continue;
+		}
+		if (delta <= BMC_SHORT_MAX(ticks)) {
+			dec->half = !dec->half;
+			if (dec->half)
+				continue;
+			bit = 1;
+		} else {
+			dec->half = 0;
+			bit = 0;
+		}
+		dec->bits = (dec->bits >> 1) | (bit << 19);
+
+		if (dec->in_pkt) {
+			if (++dec->nbits == 5)
+				hit |= bmc_symbol(desc, dec, i);
+		} else if (dec->bits == PD_HARD_RESET ||
+			   dec->bits == PD_CABLE_RESET) {
+			int sop = dec->bits == PD_HARD_RESET ?
+				  TCPC_TX_HARD_RESET : TCPC_TX_CABLE_RESET;
+
+			stats_packet(sop, 0);
+			flight_packet(desc->tstamp.le.lo, desc->channel + 1,
+				      sop, 0, 0);
+			bmc_event(desc, sop);
+			if (trig.sources & TRIG_SRC_RESET)
+				hit = 1;
+		} else if (dec->bits == PD_SOP || dec->bits == PD_SOP_PRIME ||
+			   dec->bits == PD_SOP_PRIME_PRIME) {
+			dec->in_pkt = 1;
+			dec->sop = dec->bits == PD_SOP ? 0 :
+				   dec->bits == PD_SOP_PRIME ? 1 : 2;
+			dec->nbits = 0;
+			dec->nibbles = 0;
+		}
+	}
+	return hit;
+}
+
+static int bmc_scan_normal(const struct rx_desc *desc)
+{
+	return bmc_scan_res(desc, SNIFFER_RES_NORMAL);
+}
+
+static int bmc_scan_fine(const struct rx_desc *desc)
+{
+	return bmc_scan_res(desc, SNIFFER_RES_FINE);
+}
+
+static int bmc_scan_coarse(const struct rx_desc *desc)
+{
+	return bmc_scan_res(desc, SNIFFER_RES_COARSE);
+}
+
+static int (*const bmc_scans[SNIFFER_RES_COUNT])(const struct rx_desc *) = {
+	[SNIFFER_RES_NORMAL] = bmc_scan_normal,
+	[SNIFFER_RES_FINE]   = bmc_scan_fine,
+	[SNIFFER_RES_COARSE] = bmc_scan_coarse,
+};
+
+/* Decoder instance of the active resolution, set by rx_set_resolution() */
+static int (*bmc_scan)(const struct rx_desc *desc) = bmc_scan_normal;
+
+/* Decode the half-buffer 'desc' once before sending it */
+static void rx_scan(const struct rx_desc *desc)
+{
+	struct bmc_decoder *dec = bmc_dec + desc->channel;
+
+	trig.hit = 0;
+	if (half_buf_idle(desc)) {
+		bmc_reset(desc, dec);
+		dec->last = sample_get(desc->samples, 0);
+	} else {
+		line_busy[desc->channel] = desc->tstamp.val;
+		/* always decoded for the traffic statistics */
+		trig.hit = bmc_scan(desc);
+	}
+	eye_scanned(desc->channel, desc->tstamp.val);
+	/* no packet goes on with samples which may have changed */
+	if (rx_torn(desc, 0)) {
+		dec->bits = 0;
+		dec->half = 0;
+		dec->in_pkt = 0;
+	}
+}
+
+/* Send the oldest decoded packet record, returns 1 if a packet was sent */
+static int pkt_process(const struct rx_desc *desc)
+{
+	/* static : the DMA copy may still be reading it after we return */
+	static uint16_t payload[3 + BMC_MAX_BYTES / 2];
+	struct pkt_rec rec;
+
+	/* nothing is streamed outside of the trigger window */
+	if (trig.state == TRIG_ARMED || trig.state == TRIG_DONE) {
+		queue_advance_head(&pkt_queue, queue_count(&pkt_queue));
+		return 0;
+	}
+
+	if (!queue_remove_unit(&pkt_queue, &rec))
+		return 0;
+
+	if (rec.event) {
+		payload[0] = SNIFFER_REC_EVENT;
+		payload[1] = rec.sop;
+		ep_send(SNIFFER_FLAG_RECORD | rec.flags, rec.tstamp, payload,
+			4);
+		return 1;
+	}
+	payload[0] = SNIFFER_REC_PACKET;
+	payload[1] = rec.sop;
+	payload[2] = rec.end;
+	memcpy(payload + 3, rec.data, rec.len);
+	ep_send(SNIFFER_FLAG_RECORD | rec.flags, rec.tstamp, payload,
+		6 + rec.len);
+
+	return 1;
+}
+
+static int trigger_window(void)
+{
+	return trig.state == TRIG_FIRED;
+}
+
+/*
+ * Apply the trigger state to the half-buffer 'desc' from its sub-buffer
+ * 'sub' : returns 1 if the rest of it must be dropped, 0 if it must be
+ * streamed.
+ */
+static int trigger_hold(const struct rx_desc *desc, int sub)
+{
+	if (trig.state == TRIG_FIRED && !sub &&
+	    desc->tstamp.val - trig.fired.val > trig.post_us)
+		trig.state = TRIG_DONE;
+
+	if (trig.state == TRIG_ARMED && !sub &&
+	    (trig.hit || trig.vbus_hit)) {
+		trig.state = TRIG_FIRED;
+		trig.fired = desc->tstamp;
+		flight_trigger();
+		notify_post(INJ_NOTIFY_TRIGGER, trig.sources, trig.fired.val);
+	}
+
+	return trig.state == TRIG_ARMED || trig.state == TRIG_DONE;
+}
+
+static void trigger_arm(uint8_t sources)
+{
+	trig.state = TRIG_OFF;
+	trig.sources = sources;
+	trig.vbus_hit = 0;
+	memset(bmc_dec, 0, sizeof(bmc_dec));
+	if (sources)
+		trig.state = TRIG_ARMED;
+}
+
+/* Report an idle run started before 'tstamp', returns 1 if one was sent */
+static int report_older_idle(timestamp_t tstamp)
+{
+	int ch;
+
+	for (ch = 0; ch < 2; ch++)
+		if (idle_run[ch].count &&
+		    idle_run[ch].tstamp.val < tstamp.val) {
+			report_idle(ch);
+			return 1;
+		}
+	return 0;
+}
+
+/*
+ * VBUS records : readings of the power monitor ring, timestamped against the
+ * same clock as the samples.
+ */
+static int vbus_records;
+
+void sniffer_power_sample(void)
+{
+	if (vbus_records)
+		task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
+}
+
+int sniffer_power_streaming(void)
+{
+	return vbus_records;
+}
+
+/*
+ * Send the oldest VBUS reading if it was done before the samples of 'desc'
+ * (or if there are no samples), returns 1 if a packet was sent.
+ */
+static int vbus_process(const struct rx_desc *desc)
+{
+	struct power_sample s;
+	timestamp_t tstamp;
+	uint16_t payload[3];
+
+	if (!vbus_records)
+		return 0;
+	/* nothing is streamed outside of the trigger window */
+	if (trig.state == TRIG_ARMED || trig.state == TRIG_DONE) {
+		while (powermon_read(&s, 1))
+			;
+		return 0;
+	}
+
+	if (!powermon_peek(&s) || (desc && desc->tstamp.val < s.ts))
+		return 0;
+
+	/* keep the timestamp order : report the older idle runs first */
+	tstamp.val = s.ts;
+	if (report_older_idle(tstamp))
+		return 1;
+
+	/* short payload : copied right away */
+	payload[0] = SNIFFER_REC_VBUS;
+	payload[1] = s.mv;
+	payload[2] = s.ma;
+	ep_send(SNIFFER_FLAG_RECORD, tstamp, payload, sizeof(payload));
+	powermon_read(&s, 1);
+
+	return 1;
+}
+
+/*
+ * CC voltage capture : the ADC converts CC1 and CC2 back to back, the DMA
+ * filling the two halves of a buffer. The sniffer task averages the pairs
+ * into the samples of the CC records as the halves are completed.
+ */
+#define CC_HALF_PAIRS 32
+#define CC_REC_PAIRS 10
+static uint16_t cc_buf[2 * CC_HALF_PAIRS * 2];
+/* Pairs averaged into a sample, 0 when the capture is off */
+static int cc_avg;
+/* ADC sample time (STM32_ADC_SMPR_x) */
+static int cc_smpr = STM32_ADC_SMPR_239_5_CY;
+/* Duration of a pair of conversions in ns */
+static int cc_pair_ns;
+/* Half-buffer reported by the DMA interrupt and not taken yet, or -1 */
+static volatile int cc_pending = -1;
+static uint32_t cc_pending_end;
+/* Half-buffers overwritten before being sent */
+static uint32_t cc_overruns;
+
+/* Half-buffer being averaged and the record being filled */
+static int cc_half;
+static int cc_pos = CC_HALF_PAIRS;
+static timestamp_t cc_half_end;
+static struct {
+	timestamp_t tstamp;
+	uint32_t acc[2]; /* sums of the pairs being averaged */
+	int n;           /* pairs summed */
+	int count;       /* samples */
+	uint16_t payload[3 + 2 * CC_REC_PAIRS];
+} cc_rec;
+
+static void cc_half_done(int half)
+{
+	if (cc_pending >= 0)
+		cc_overruns++;
+	cc_pending_end = ts_raw();
+	cc_pending = half;
+	task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
+}
+
+static void cc_reset(void)
+{
+	cc_pending = -1;
+	cc_pos = CC_HALF_PAIRS;
+	memset(&cc_rec, 0, sizeof(cc_rec));
+}
+
+/* Average the captured pairs into 'cc_rec', returns 1 once it is full */
+static int cc_fill(void)
+{
+	const uint16_t *p;
+
+	while (cc_rec.count < CC_REC_PAIRS) {
+		if (cc_pos == CC_HALF_PAIRS) {
+			interrupt_disable();
+			cc_half = cc_pending;
+			cc_half_end.val = ts_extend(cc_pending_end);
+			cc_pending = -1;
+			interrupt_enable();
+			if (cc_half < 0)
+				return 0;
+			cc_pos = 0;
+		}
+		if (!cc_rec.n && !cc_rec.count)
+			cc_rec.tstamp.val = cc_half_end.val -
+				(CC_HALF_PAIRS - 1 - cc_pos) * cc_pair_ns /
+				1000;
+		p = cc_buf + (cc_half * CC_HALF_PAIRS + cc_pos++) * 2;
+		cc_rec.acc[0] += p[0];
+		cc_rec.acc[1] += p[1];
+		if (++cc_rec.n < cc_avg)
+			continue;
+		cc_rec.payload[3 + 2 * cc_rec.count] = cc_rec.acc[0] / cc_avg;
+		cc_rec.payload[4 + 2 * cc_rec.count] = cc_rec.acc[1] / cc_avg;
+		cc_rec.acc[0] = cc_rec.acc[1] = 0;
+		cc_rec.n = 0;
+		cc_rec.count++;
+	}
+	return 1;
+}
+
+/*
+ * Send the oldest CC record if its first sample is older than the samples
+ * of 'desc' (or if there are no samples), returns 1 if a packet was sent.
+ */
+static int cc_process(const struct rx_desc *desc)
+{
+	if (!cc_avg || !cc_fill())
+		return 0;
+	/* nothing is streamed outside of the trigger window */
+	if (trig.state == TRIG_ARMED || trig.state == TRIG_DONE) {
+		cc_rec.count = 0;
+		return 0;
+	}
+	if (desc && desc->tstamp.val < cc_rec.tstamp.val)
+		return 0;
+	if (report_older_idle(cc_rec.tstamp))
+		return 1;
+
+	cc_rec.payload[0] = SNIFFER_REC_CC;
+	cc_rec.payload[1] = cc_pair_ns * cc_avg / 125;
+	cc_rec.payload[2] = cc_rec.count;
+	ep_send(SNIFFER_FLAG_RECORD, cc_rec.tstamp, cc_rec.payload,
+		sizeof(cc_rec.payload));
+	cc_rec.count = 0;
+	return 1;
+}
+
+static int cc_capture(int avg, int smpr)
+{
+	uint32_t mask = (1 << adc_channels[ADC_CH_CC1_PD].channel) |
+			(1 << adc_channels[ADC_CH_CC2_PD].channel);
+	int rv;
+
+	adc_capture_stop();
+	cc_avg = 0;
+	if (!avg)
+		return EC_SUCCESS;
+
+	cc_pair_ns = 2 * adc_conversion_ns(smpr);
+	/* the sample period must fit the record field */
+	if (avg < 0 || cc_pair_ns * avg / 125 > 0xffff)
+		return EC_ERROR_INVAL;
+	cc_reset();
+	cc_overruns = 0;
+	cc_smpr = smpr;
+	cc_avg = avg;
+	rv = adc_capture_start(mask, smpr, cc_buf, ARRAY_SIZE(cc_buf),
+			       cc_half_done);
+	if (rv)
+		cc_avg = 0;
+	return rv;
+}
+
+/* Start of frame latched by the USB interrupt or sync pulse edge */
+struct sync_rec {
+	timestamp_t tstamp;
+	uint16_t type;  /* SNIFFER_REC_SYNC, _PULSE or _POWER */
+	uint16_t value; /* frame or pulse number, or power limit type */
+	uint16_t arg;   /* SNIFFER_PULSE_x of a pulse record, power limit */
+};
+
+/*
+ * Records of the interrupt handlers and the other tasks, in time order :
+ * adding one wakes up the sniffer task, the queue consumer.
+ */
+static void sync_written(struct consumer const *consumer, size_t count)
+{
+	task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
+}
+
+static struct consumer const sync_consumer = {
+	.queue = NULL,
+	.ops   = &((struct consumer_ops const) {
+		.written = sync_written,
+	}),
+};
+
+/* a few more for the bursts of trigger input edges */
+static struct queue const sync_queue =
+	QUEUE_DIRECT(8, struct sync_rec, null_producer, sync_consumer);
+/* Sync records period in us, 0 when disabled */
+static int sync_period = 100 * MSEC;
+
+/* Role of the device on the SYNC pin */
+enum sniffer_pulse {
+	SNIFFER_PULSE_OFF = 0,
+	SNIFFER_PULSE_MASTER,
+	SNIFFER_PULSE_SLAVE,
+	SNIFFER_PULSE_INPUT, /* trigger input from other equipment */
+};
+static enum sniffer_pulse pulse_role;
+/* Pulse width : PULSE_WIDTH_BASE + (number % PULSE_CODES) * PULSE_WIDTH_STEP */
+#define PULSE_WIDTH_BASE 100
+#define PULSE_WIDTH_STEP 50
+#define PULSE_CODES 32
+/* Pulses sent as a master or received as a slave, or input edges */
+static uint16_t pulse_count;
+static uint32_t pulse_errors;
+
+static void sync_add(const struct sync_rec *rec)
+{
+	/* a pending record is enough, drop this one if the queue is full */
+	queue_add_unit(&sync_queue, rec);
+}
+
+/* Record the comparator settings in the stream */
+static void comp_record(void)
+{
+	struct sync_rec rec = {
+		.tstamp = get_time(),
+		.type = SNIFFER_REC_COMP,
+		.value = comp_setting[0],
+		.arg = comp_setting[1],
+	};
+
+	sync_add(&rec);
+}
+
+/* Apply the comparator setting 's' to the channel 'ch' while capturing */
+static void comp_set(int ch, int s)
+{
+	comp_setting[ch] = s & 0xF;
+	STM32_COMP_CSR = (STM32_COMP_CSR & ~COMP_CSR_BITS(ch, 0xF)) |
+			 COMP_CSR_BITS(ch, comp_setting[ch]);
+}
+
+/* Send a numbered pulse on the SYNC pin, timestamping its rising edge */
+static void pulse_send(void)
+{
+	struct sync_rec rec = {
+		.type = SNIFFER_REC_PULSE,
+		.value = pulse_count++,
+		.arg = SNIFFER_PULSE_MASTER,
+	};
+
+	interrupt_disable();
+	rec.tstamp = get_time();
+	gpio_set_level(GPIO_SYNC, 1);
+	interrupt_enable();
+	udelay(PULSE_WIDTH_BASE + (rec.value % PULSE_CODES) * PULSE_WIDTH_STEP);
+	gpio_set_level(GPIO_SYNC, 0);
+	sync_add(&rec);
+}
+
+/* Width of the SYNC pin pulse of sniffer_sync_trigger() */
+#define TRIGGER_WIDTH 10
+
+int sniffer_sync_trigger(void)
+{
+	if (pulse_role != SNIFFER_PULSE_OFF)
+		return EC_ERROR_BUSY;
+	/* an input with a pull-down while the sync pulses are off */
+	gpio_set_flags(GPIO_SYNC, GPIO_OUT_HIGH);
+	udelay(TRIGGER_WIDTH);
+	gpio_set_flags(GPIO_SYNC, GPIO_INPUT | GPIO_PULL_DOWN | GPIO_INT_BOTH);
+	return EC_SUCCESS;
+}
+
+void sniffer_sync_event(void)
+{
+	static timestamp_t rise;
+	timestamp_t now = get_time();
+	struct sync_rec rec = {
+		.type = SNIFFER_REC_PULSE,
+		.arg = SNIFFER_PULSE_SLAVE,
+	};
+	int code;
+
+	/* no timer channel on the pin : the edge at the interrupt time */
+	if (!SYNC_CAPTURE && pulse_role == SNIFFER_PULSE_INPUT) {
+		rec.tstamp = now;
+		rec.type = SNIFFER_REC_INPUT;
+		rec.value = gpio_get_level(GPIO_SYNC);
+		rec.arg = 0;
+		pulse_count++;
+		sync_add(&rec);
+		return;
+	}
+	if (pulse_role != SNIFFER_PULSE_SLAVE)
+		return;
+	if (gpio_get_level(GPIO_SYNC)) {
+		rise = now;
+		return;
+	}
+	if (!rise.val)
+		return;
+
+	/* round the width to the nearest code */
+	code = (int)(now.val - rise.val) - PULSE_WIDTH_BASE +
+	       PULSE_WIDTH_STEP / 2;
+	if (code < 0 || code >= PULSE_CODES * PULSE_WIDTH_STEP) {
+		pulse_errors++;
+	} else {
+		rec.tstamp = rise;
+		rec.value = code / PULSE_WIDTH_STEP;
+		pulse_count++;
+		sync_add(&rec);
+	}
+	rise.val = 0;
+}
+
+void sniffer_power_alert(uint64_t ts)
+{
+	struct sync_rec rec = {
+		.tstamp.val = ts,
+		.type = SNIFFER_REC_POWER,
+	};
+	int limit;
+
+	rec.value = powermon_get_limit(&limit);
+	rec.arg = limit;
+	if (trig.state == TRIG_ARMED && (trig.sources & TRIG_SRC_VBUS))
+		trig.vbus_hit = 1;
+	sync_add(&rec);
+}
+
+#if !SYNC_CAPTURE
+static void input_timer_init(void)
+{
+}
+#else
+/*
+ * Trigger input latched by TIM2_CH3 (SYNC_CAPTURE), a spare channel of the
+ * CC2 RX timer, at the resolution of the CC captures.
+ */
+#define TIM_CC3IE (1 << 3)  /* DIER */
+#define TIM_CC3IF (1 << 3)  /* SR */
+#define TIM_CC3OF (1 << 11) /* SR */
+
+static void input_timer_init(void)
+{
+	timer_ctlr_t *tim = (void *)STM32_TIM_BASE(TIM_RX2);
+
+	if (pulse_role != SNIFFER_PULSE_INPUT) {
+		tim->dier &= ~TIM_CC3IE;
+		tim->ccer &= ~(0xB << 8);
+		task_disable_irq(STM32_IRQ_TIM2);
+		return;
+	}
+	/* IC3 on TI3 without filter, both edges, and its interrupt */
+	tim->ccmr2 = (tim->ccmr2 & ~0x00FF) | 1;
+	tim->ccer |= 0xB << 8;
+	tim->sr = ~(TIM_CC3IF | TIM_CC3OF);
+	tim->dier |= TIM_CC3IE;
+	task_enable_irq(STM32_IRQ_TIM2);
+}
+
+static void input_interrupt(void)
+{
+	timer_ctlr_t *tim = (void *)STM32_TIM_BASE(TIM_RX2);
+	timestamp_t now = get_time();
+	uint16_t cnt = tim->cnt;
+	struct sync_rec rec = {
+		.type = SNIFFER_REC_INPUT,
+	};
+	uint32_t t48, back;
+
+	if (!(tim->sr & TIM_CC3IF))
+		return;
+	/* an edge was lost while this one was latched */
+	if (tim->sr & TIM_CC3OF) {
+		tim->sr = ~TIM_CC3OF;
+		pulse_errors++;
+	}
+	/* counter ticks since the edge, in 1/48 us : reading CCR3 clears it */
+	t48 = ((cnt - tim->ccr[3]) & tim->arr) * res_table[rx_res].div;
+	back = DIV_ROUND_UP(t48, 48);
+	rec.tstamp.val = now.val - back;
+	rec.value = gpio_get_level(GPIO_SYNC);
+	rec.arg = back * 48 - t48;
+	pulse_count++;
+	sync_add(&rec);
+}
+DECLARE_IRQ(STM32_IRQ_TIM2, input_interrupt, 2);
+#endif
+
+static void pulse_set_role(enum sniffer_pulse role)
+{
+	gpio_disable_interrupt(GPIO_SYNC);
+	pulse_role = role;
+	pulse_count = 0;
+	pulse_errors = 0;
+	if (role == SNIFFER_PULSE_MASTER) {
+		gpio_set_flags(GPIO_SYNC, GPIO_OUT_LOW);
+	} else {
+		gpio_set_flags(GPIO_SYNC, GPIO_INPUT | GPIO_PULL_DOWN |
+				  GPIO_INT_BOTH);
+		/* TIM2_CH3 latches the trigger input */
+		if (SYNC_CAPTURE && role == SNIFFER_PULSE_INPUT)
+			gpio_set_alternate_function(gpio_list[GPIO_SYNC].port,
+						    gpio_list[GPIO_SYNC].mask,
+						    SYNC_CAPTURE_AF);
+		else if (role != SNIFFER_PULSE_OFF)
+			gpio_enable_interrupt(GPIO_SYNC);
+	}
+	input_timer_init();
+}
+
+/*
+ * HSI48 discipline : the Clock Recovery System trims the oscillator on the
+ * USB start of frames (chip clock setup), the sniffer reports its state.
+ */
+#define CLOCK_REPORT_US SECOND
+static struct {
+	uint64_t last;   /* time of the last clock record */
+	uint8_t trim;    /* trim of the last clock record */
+	uint32_t errors; /* start of frames missed or out of the trim range */
+} crs;
+
+/* HSI48 error at the last start of frame, 48000 cycles per ms */
+static int crs_error_ppm(uint32_t isr)
+{
+	int err = isr >> 16;
+
+	/* FEDIR : the counter went down, the frequency is below the target */
+	if (isr & STM32_CRS_ISR_FEDIR)
+		err = -err;
+	return err * 125 / 6;
+}
+
+static void clock_report(void)
+{
+	uint32_t isr = STM32_CRS_ISR;
+	struct sync_rec rec = {
+		.tstamp = get_time(),
+		.type = SNIFFER_REC_CLOCK,
+		.value = (STM32_CRS_CR >> 8) & 0x3f,
+	};
+
+	if (isr & STM32_CRS_ISR_ERRF) {
+		crs.errors++;
+		STM32_CRS_ICR = STM32_CRS_ICR_ERRC;
+	}
+	if (rec.value == crs.trim &&
+	    rec.tstamp.val - crs.last < CLOCK_REPORT_US)
+		return;
+	rec.arg = crs_error_ppm(isr);
+	crs.trim = rec.value;
+	crs.last = rec.tstamp.val;
+	sync_add(&rec);
+}
+
+static void sync_arm(void);
+DECLARE_DEFERRED(sync_arm);
+
+static void sync_arm(void)
+{
+	if (!sync_period)
+		return;
+	hook_call_deferred(&sync_arm_data, sync_period);
+	usb_sof_arm();
+	clock_report();
+	if (pulse_role == SNIFFER_PULSE_MASTER)
+		pulse_send();
+}
+DECLARE_HOOK(HOOK_INIT, sync_arm, HOOK_PRIO_DEFAULT);
+
+void usb_sof_latched(uint16_t frame, timestamp_t tstamp)
+{
+	struct sync_rec rec = {
+		.tstamp = tstamp,
+		.type = SNIFFER_REC_SYNC,
+		.value = frame,
+	};
+
+	sync_add(&rec);
+}
+
+/*
+ * Send the oldest sync record if it was latched before the samples of 'desc'
+ * (or if there are no samples), returns 1 if a packet was sent.
+ */
+static int sync_process(const struct rx_desc *desc)
+{
+	struct sync_rec rec;
+	uint16_t payload[3];
+
+	while (trig.state == TRIG_ARMED || trig.state == TRIG_DONE) {
+		if (!queue_peek_units(&sync_queue, &rec, 0, 1))
+			return 0;
+		/* the alert firing the trigger is sent with its window */
+		if (rec.type == SNIFFER_REC_POWER && trig.vbus_hit)
+			return 0;
+		queue_advance_head(&sync_queue, 1);
+	}
+
+	if (!queue_peek_units(&sync_queue, &rec, 0, 1) ||
+	    (desc && desc->tstamp.val < rec.tstamp.val))
+		return 0;
+
+	if (report_older_idle(rec.tstamp))
+		return 1;
+
+	payload[0] = rec.type;
+	payload[1] = rec.value;
+	payload[2] = rec.arg;
+	ep_send(SNIFFER_FLAG_RECORD, rec.tstamp, payload,
+		rec.type == SNIFFER_REC_SYNC ? 4 : 6);
+	queue_advance_head(&sync_queue, 1);
+
+	return 1;
+}
+
+/* Count the captures of 'desc' within a quarter of UI of the previous one */
+static void glitch_scan(const struct rx_desc *desc)
+{
+	int min = PACK_TICKS_SHORT / 2;
+	int i;
+
+	if (RX_WIDE()) {
+		const uint16_t *in = (const uint16_t *)desc->samples;
+
+		for (i = 1; i < HALF_BUF_SIZE / 2; i++) {
+			uint16_t delta = in[i] - in[i - 1];
+
+			if (delta && delta < min)
+				rx_glitches++;
+		}
+	} else {
+		const uint8_t *in = desc->samples;
+
+		for (i = 1; i < HALF_BUF_SIZE; i++) {
+			uint8_t delta = in[i] - in[i - 1];
+
+			if (delta && delta < min)
+				rx_glitches++;
+		}
+	}
+}
+
+/* Edges counted in the captured samples, for the soak test */
+static int edge_counting;
+static uint32_t rx_edges;
+
+/* Count the captures of 'desc' differing from the previous one */
+static void edge_scan(const struct rx_desc *desc)
+{
+	int i;
+
+	if (RX_WIDE()) {
+		const uint16_t *in = (const uint16_t *)desc->samples;
+
+		for (i = 1; i < HALF_BUF_SIZE / 2; i++)
+			if (in[i] != in[i - 1])
+				rx_edges++;
+	} else {
+		const uint8_t *in = desc->samples;
+
+		for (i = 1; i < HALF_BUF_SIZE; i++)
+			if (in[i] != in[i - 1])
+				rx_edges++;
+	}
+}
+
+void sniffer_count_edges(int enable)
+{
+	edge_counting = enable;
+}
+
+void sniffer_get_counters(struct sniffer_counters *c)
+{
+	c->edges = rx_edges;
+	c->usb_bytes = ep_bytes;
+	c->packets = ep_packets;
+	c->oflow = oflow;
+	c->decoded = decode_count;
+	c->decode_errors = decode_errors;
+}
+
+/*
+ * Send the half-buffer 'desc' from its sub-buffer 'sub' into at most one
+ * USB packet, returns the next sub-buffer index to send or SUB_BUF_COUNT if
+ * the half-buffer is done.
+ */
+static int rx_process(const struct rx_desc *desc, int sub)
+{
+	if (trig.state != TRIG_OFF && trigger_hold(desc, sub))
+		return SUB_BUF_COUNT;
+
+	/* the DMA is writing these samples again : drop what is left */
+	if (rx_torn(desc, SUB_IDX(sub))) {
+		rx_tear(desc->channel);
+		return SUB_BUF_COUNT;
+	}
+
+	/* replace half-buffers without any edge by a marker */
+	if (!sub && half_buf_idle(desc))
+		return add_idle(desc) ? SUB_BUF_COUNT : sub;
+	if (!sub && !idle_run[0].count && !idle_run[1].count)
+		glitch_scan(desc);
+	/* the line woke up : report the idle run first */
+	if (idle_run[desc->channel].count) {
+		report_idle(desc->channel);
+		return sub;
+	}
+	/* the idle run of the other line started before these samples */
+	if (idle_run[!desc->channel].count) {
+		send_idle(!desc->channel);
+		return sub;
+	}
+
+	if (sniffer_format == SNIFFER_FORMAT_PACKED && !RX_WIDE())
+		return send_packed(desc, sub);
+	else
+		return send_raw(desc, sub);
+}
+
+/* Drop all the queued half-buffers */
+static void rx_flush(void)
+{
+	queue_advance_head(&rx_queue, queue_count(&rx_queue));
+	rx_released[SNIFFER_CHANNEL_CC1] = rx_queued[SNIFFER_CHANNEL_CC1];
+	rx_released[SNIFFER_CHANNEL_CC2] = rx_queued[SNIFFER_CHANNEL_CC2];
+}
+
+/*
+ * Peek the oldest filled half-buffer. The first of two half-buffers
+ * completed together gets its completion time back from the samples of the
+ * second one : the ticks between their last samples, one more counter
+ * period for each overflow capture.
+ */
+static int rx_peek(struct rx_desc *desc)
+{
+	int count = HALF_BUF_SIZE >> RX_WIDE();
+	int32_t ticks;
+	int i;
+
+	if (!queue_peek_units(&rx_queue, desc, 0, 1))
+		return 0;
+	if (!desc->lead)
+		return 1;
+
+	ticks = sample_get(desc->samples, 2 * count - 1) -
+		sample_get(desc->samples, count - 1);
+	for (i = count; i < 2 * count; i++)
+		if (sample_get(desc->samples, i) ==
+		    sample_get(desc->samples, i - 1))
+			ticks += RX_WIDE() ? 0x10000 : 0x100;
+	/* the counters run at 48 Mhz / div */
+	desc->tstamp.val -= (uint32_t)ticks * res_table[rx_res].div / 48;
+	desc->lead = 0;
+	/* only done once */
+	memcpy(queue_get_read_chunk(&rx_queue).buffer, desc, sizeof(*desc));
+	return 1;
+}
+
+/*
+ * Single-line capture selection, from the half-buffers with edges on each
+ * line : the busy line gets the whole sample buffer once the other one has
+ * been quiet for LINE_QUIET_US, and the capture goes back to both lines as
+ * soon as the RX timer of the quiet one captures an edge.
+ */
+#define LINE_QUIET_US (2 * SECOND)
+static uint8_t line_auto;
+static uint32_t line_switches;
+
+/* Did the RX timer of the channel 'ch' capture an edge since the last call */
+static int line_edge(int ch)
+{
+	timer_ctlr_t *tim = ch == SNIFFER_CHANNEL_CC2 ?
+		(void *)STM32_TIM_BASE(TIM_RX2) :
+		(void *)STM32_TIM_BASE(TIM_RX1);
+	uint32_t ccif = 1 << (ch == SNIFFER_CHANNEL_CC2 ? TIM_RX2_CCR_IDX :
+							  TIM_RX1_CCR_IDX);
+	int edge = tim->sr & ccif;
+
+	/* rc_w0 flags */
+	tim->sr = ~ccif;
+	return !!edge;
+}
+
+static void line_update(void)
+{
+	uint64_t now = get_time().val;
+	int ch;
+
+	if (!line_auto || channel_mask != 0x3) {
+		if (line_auto)
+			rx_line_next = RX_LINE_BOTH;
+		return;
+	}
+	if (rx_line != RX_LINE_BOTH) {
+		if (line_edge(!rx_line)) {
+			line_busy[!rx_line] = now;
+			rx_line_next = RX_LINE_BOTH;
+		}
+		return;
+	}
+	for (ch = 0; ch < 2; ch++)
+		if (now - line_busy[ch] < LINE_QUIET_US &&
+		    now - line_busy[!ch] > LINE_QUIET_US)
+			rx_line_next = ch;
+}
+
+/*
+ * Restart the RX DMA for 'rx_line_next', dropping the queued half-buffers
+ * and the samples of the ones in progress.
+ */
+static void rx_set_line(void)
+{
+	interrupt_disable();
+	dma_disable(DMAC_TIM_RX1);
+	dma_disable(DMAC_TIM_RX2);
+	dma_clear_isr(DMAC_TIM_RX1);
+	dma_clear_isr(DMAC_TIM_RX2);
+	rx_flush();
+	if (rx_line_next != rx_line)
+		line_switches++;
+	rx_line = rx_line_next;
+	/* the quiet line is only watched for edges from now on */
+	if (rx_line != RX_LINE_BOTH)
+		line_edge(!rx_line);
+	rx_dma_start();
+	interrupt_enable();
+	memset(bmc_dec, 0, sizeof(bmc_dec));
+	rx_gap[0] = rx_gap[1] = 1;
+}
+
+static void qos_set(int level, timestamp_t now)
+{
+	if (level > qos.level) {
+		qos.downs++;
+		/* the samples of the idle runs are not streamed either */
+		memset(idle_run, 0, sizeof(idle_run));
+	}
+	if (level == SNIFFER_QOS_SAMPLES)
+		rx_gap[0] = rx_gap[1] = 1;
+	qos.level = level;
+	qos.since = now;
+	qos.calm.val = 0;
+	qos.pending = 1;
+	notify_post(INJ_NOTIFY_MODE, INJ_NOTIFY_MODE_QOS << 16 | level,
+		    now.val);
+}
+
+/* Step the stream level down under USB back-pressure, up once it is gone */
+static void qos_update(void)
+{
+	timestamp_t now = get_time();
+	int level = qos.level;
+
+	if (!qos.enabled)
+		level = SNIFFER_QOS_SAMPLES;
+	else if (level == SNIFFER_QOS_SAMPLES &&
+		 (queue_count(&rx_queue) >= QOS_DOWN_DEPTH ||
+		  oflow != qos.oflow))
+		level = SNIFFER_QOS_PACKETS;
+	/* the records themselves are lost for lack of USB buffers */
+	else if (level == SNIFFER_QOS_PACKETS && decode_drops != qos.drops &&
+		 ep_ring_full())
+		level = SNIFFER_QOS_EVENTS;
+	qos.oflow = oflow;
+	qos.drops = decode_drops;
+	if (level != qos.level) {
+		qos_set(level, now);
+		return;
+	}
+
+	if (level == SNIFFER_QOS_SAMPLES)
+		return;
+	/* no step up while the host sleeps, even with an empty ring */
+	if (ep_ring_used() > EP_BUF_COUNT / 4 || susp.active) {
+		qos.calm.val = 0;
+	} else if (!qos.calm.val) {
+		qos.calm = now;
+	} else if (now.val - qos.calm.val > QOS_RECOVER_US) {
+		qos_set(level - 1, now);
+	}
+}
+
+/* Ask the sleeping host to resume the bus, once per suspend */
+static void suspend_wake(int reason)
+{
+	if (susp.reason != SNIFFER_WAKE_HOST)
+		return;
+	susp.reason = reason;
+	susp.wakes++;
+	usb_wake();
+}
+
+/* Follow the suspend state of the bus */
+static void suspend_update(void)
+{
+	timestamp_t now;
+	uint32_t n;
+
+	if (usb_is_suspended() == susp.active) {
+		if (susp.active && (susp.wake_on & SUSP_WAKE_ON_FULL) &&
+		    flight_written() - susp.written >= SUSP_WAKE_RECS)
+			suspend_wake(SNIFFER_WAKE_FULL);
+		return;
+	}
+
+	now = get_time();
+	susp.active = !susp.active;
+	if (susp.active) {
+		susp.since = now;
+		susp.written = flight_written();
+		susp.reason = SNIFFER_WAKE_HOST;
+		susp.count++;
+		/* nothing drains the ring : give the half-buffers back */
+		if (qos.enabled && qos.level != SNIFFER_QOS_EVENTS)
+			qos_set(SNIFFER_QOS_EVENTS, now);
+		return;
+	}
+	n = flight_written() - susp.written;
+	susp.kept = MIN(n, FLIGHT_RECS);
+	susp.lost = MIN(n - susp.kept, 0xffff);
+	susp.ms = (now.val - susp.since.val) / MSEC;
+	susp.pending = 1;
+}
+
+/*
+ * Decode the queued half-buffers and give them back without streaming them,
+ * the head one went through the decoder already if 'scanned'.
+ */
+static void qos_drain(int scanned)
+{
+	struct rx_desc desc;
+
+	while (rx_peek(&desc)) {
+		queue_advance_head(&rx_queue, 1);
+		if (!scanned) {
+			rx_scan(&desc);
+			if (edge_counting)
+				edge_scan(&desc);
+		}
+		if (susp.active && trig.state == TRIG_ARMED &&
+		    (trig.hit || trig.vbus_hit))
+			suspend_wake(SNIFFER_WAKE_TRIGGER);
+		scanned = 0;
+		rx_release(&desc);
+		if (qos.dropped < 0xffff)
+			qos.dropped++;
+		/* make room for the records of the next one */
+		if (!ep_copying && !ep_ring_full())
+			pkt_process(NULL);
+	}
+}
+
+/* Send the suspend record once the bus is resumed, returns 1 if it was */
+static int suspend_process(const struct rx_desc *desc)
+{
+	/* static : the DMA copy may still be reading it after we return */
+	static uint16_t payload[6];
+
+	if (!susp.pending)
+		return 0;
+	payload[0] = SNIFFER_REC_SUSPEND;
+	payload[1] = susp.ms;
+	payload[2] = susp.ms >> 16;
+	payload[3] = susp.kept;
+	payload[4] = susp.lost;
+	payload[5] = susp.reason;
+	ep_send(SNIFFER_FLAG_RECORD, susp.since, payload, sizeof(payload));
+	susp.pending = 0;
+	return 1;
+}
+
+/* Send the pending QoS record, returns 1 if it was sent */
+static int qos_process(const struct rx_desc *desc)
+{
+	/* static : the DMA copy may still be reading it after we return */
+	static uint16_t payload[3];
+
+	if (!qos.pending)
+		return 0;
+	payload[0] = SNIFFER_REC_QOS;
+	payload[1] = qos.level;
+	payload[2] = qos.dropped;
+	ep_send(SNIFFER_FLAG_RECORD, qos.since, payload, sizeof(payload));
+	qos.pending = 0;
+	qos.dropped = 0;
+	return 1;
+}
+
+/* Health record, posted every second by the hook task */
+static struct {
+	uint8_t enabled;
+	uint8_t pending;
+	timestamp_t tstamp;
+	uint32_t idle;       /* idle_time_get() at the previous record */
+	uint32_t oflow[2];   /* oflow_ch[] at the previous record */
+	uint32_t errors;     /* decode_errors at the previous record */
+} health = {
+	.enabled = 1,
+};
+
+static void health_tick(void)
+{
+	if (!health.enabled)
+		return;
+	health.tstamp = get_time();
+	health.pending = 1;
+	task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
+}
+DECLARE_HOOK(HOOK_SECOND, health_tick, HOOK_PRIO_DEFAULT);
+
+static uint16_t health_delta(uint32_t now, uint32_t *last)
+{
+	uint32_t d = now - *last;
+
+	*last = now;
+	return MIN(d, 0xffff);
+}
+
+/* Send the pending health record, returns 1 if it was sent */
+static int health_process(const struct rx_desc *desc)
+{
+	/* static : the DMA copy may still be reading it after we return */
+	static uint16_t payload[9];
+	uint32_t idle;
+
+	if (!health.pending || (desc && desc->tstamp.val < health.tstamp.val))
+		return 0;
+	/* nothing is streamed outside of the trigger window */
+	if (trig.state == TRIG_ARMED || trig.state == TRIG_DONE) {
+		health.pending = 0;
+		return 0;
+	}
+	if (report_older_idle(health.tstamp))
+		return 1;
+
+	idle = idle_time_get() - health.idle;
+	health.idle += idle;
+	payload[0] = SNIFFER_REC_HEALTH;
+	/* the records are a second apart */
+	payload[1] = MIN(idle / (SECOND / 100), 100);
+	payload[2] = health_delta(oflow_ch[0], &health.oflow[0]);
+	payload[3] = health_delta(oflow_ch[1], &health.oflow[1]);
+	payload[4] = EP_BUF_COUNT - ep_ring_used();
+	payload[5] = ep_hwm;
+	payload[6] = rx_queue_hwm;
+	payload[7] = health_delta(decode_errors, &health.errors);
+	payload[8] = SNIFFER_HEALTH_RES(rx_res) |
+		     (sniffer_format == SNIFFER_FORMAT_PACKED ?
+		      SNIFFER_HEALTH_PACKED : 0) |
+		     SNIFFER_HEALTH_CH(channel_mask) |
+		     SNIFFER_HEALTH_QOS(qos.level) |
+		     (ep_alt == SNIFFER_ALT_ISO ? SNIFFER_HEALTH_ISO : 0) |
+		     (decode_enabled ? SNIFFER_HEALTH_DECODE : 0);
+	ep_send(SNIFFER_FLAG_RECORD, health.tstamp, payload, sizeof(payload));
+	ep_hwm = 0;
+	rx_queue_hwm = 0;
+	health.pending = 0;
+	return 1;
+}
+
+/* Power transition record, posted by the hook task */
+static struct {
+	uint8_t pending;
+	timestamp_t tstamp;
+	struct power_transition rec;
+} trans;
+
+void sniffer_power_transition(uint64_t ts, const struct power_transition *t)
+{
+	/* one every few hundred ms at most, the previous one is long gone */
+	if (trans.pending)
+		return;
+	trans.tstamp.val = ts;
+	trans.rec = *t;
+	trans.pending = 1;
+	task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
+}
+
+/* Send the pending transition record, returns 1 if it was sent */
+static int trans_process(const struct rx_desc *desc)
+{
+	/* static : the DMA copy may still be reading it after we return */
+	static uint16_t payload[1 + sizeof(struct power_transition) / 2];
+
+	if (!trans.pending || (desc && desc->tstamp.val < trans.tstamp.val))
+		return 0;
+	/* nothing is streamed outside of the trigger window */
+	if (trig.state == TRIG_ARMED || trig.state == TRIG_DONE) {
+		trans.pending = 0;
+		return 0;
+	}
+	if (report_older_idle(trans.tstamp))
+		return 1;
+
+	payload[0] = SNIFFER_REC_TRANSITION;
+	memcpy(payload + 1, &trans.rec, sizeof(trans.rec));
+	ep_send(SNIFFER_FLAG_RECORD, trans.tstamp, payload, sizeof(payload));
+	trans.pending = 0;
+	return 1;
+}
+
+/*
+ * Bookmarks posted by the command endpoint : a few of them wait for the
+ * stream, the next ones are dropped (the host sees the gap in its 'seq').
+ */
+#define BOOKMARK_COUNT 8
+static struct {
+	struct {
+		uint32_t ts; /* hardware timer */
+		uint32_t tag;
+		uint16_t seq;
+	} q[BOOKMARK_COUNT];
+	/* free running indexes */
+	volatile uint32_t head;
+	uint32_t tail;
+} bmk;
+
+void sniffer_bookmark(uint32_t ts, uint32_t tag, uint16_t seq)
+{
+	/* posted by the USB interrupt and the console task */
+	interrupt_disable();
+	if (bmk.head - bmk.tail < BOOKMARK_COUNT) {
+		bmk.q[bmk.head % BOOKMARK_COUNT].ts = ts;
+		bmk.q[bmk.head % BOOKMARK_COUNT].tag = tag;
+		bmk.q[bmk.head % BOOKMARK_COUNT].seq = seq;
+		bmk.head++;
+	}
+	interrupt_enable();
+	task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
+}
+
+/* Send the oldest bookmark, returns 1 if it was sent */
+static int bookmark_process(const struct rx_desc *desc)
+{
+	/* static : the DMA copy may still be reading it after we return */
+	static uint16_t payload[4];
+	timestamp_t ts;
+	int i = bmk.tail % BOOKMARK_COUNT;
+
+	if (bmk.head == bmk.tail)
+		return 0;
+	ts.val = ts_extend(bmk.q[i].ts);
+	if (desc && desc->tstamp.val < ts.val)
+		return 0;
+	/* nothing is streamed outside of the trigger window */
+	if (trig.state == TRIG_ARMED || trig.state == TRIG_DONE) {
+		bmk.tail = bmk.head;
+		return 0;
+	}
+	if (report_older_idle(ts))
+		return 1;
+
+	payload[0] = SNIFFER_REC_BOOKMARK;
+	payload[1] = bmk.q[i].tag;
+	payload[2] = bmk.q[i].tag >> 16;
+	payload[3] = bmk.q[i].seq;
+	ep_send(SNIFFER_FLAG_RECORD, ts, payload, sizeof(payload));
+	bmk.tail++;
+	return 1;
+}
+
+/*
+ * Sources of typed records, from the highest priority : each one sends at
+ * most one packet of its own records, older than the half-buffer 'desc' of
+ * samples to send next (NULL if there are none), and returns 1 if it did.
+ * A new source only needs its entry here.
+ */
+static const struct {
+	const char *name;
+	int (*process)(const struct rx_desc *desc);
+} rec_sources[] = {
+	{ "qos",     qos_process },
+	{ "suspend", suspend_process },
+	{ "bookmark", bookmark_process },
+	{ "packet",  pkt_process },
+	{ "vbus",    vbus_process },
+	{ "cc",      cc_process },
+	{ "sync",    sync_process },
+	{ "trans",   trans_process },
+	{ "health",  health_process },
+};
+/* Packets sent by each source */
+static uint32_t rec_sent[ARRAY_SIZE(rec_sources)];
+
+/* Send a packet of the first source having one, returns 1 if it did */
+static int rec_process(const struct rx_desc *desc)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(rec_sources); i++) {
+		if (rec_sources[i].process(desc)) {
+			rec_sent[i]++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Restart the sampling at the resolution requested by the console, the
+ * samples captured at the previous resolution and not sent yet are dropped.
+ */
+static void rx_set_resolution(void)
+{
+	/* stop the sniffer DMA configuration as the tracer does */
+	dma_disable(DMAC_TIM_RX1);
+	dma_disable(DMAC_TIM_RX2);
+	task_disable_irq(STM32_IRQ_DMA_CHANNEL_4_7);
+	rx_flush();
+	memset(idle_run, 0, sizeof(idle_run));
+	memset(bmc_dec, 0, sizeof(bmc_dec));
+
+	rx_res = rx_res_next;
+	bmc_scan = bmc_scans[rx_res];
+	sniffer_init();
+}
+
+/* Back the trace records with the shared memory for the tracing session */
+static void trace_start(void)
+{
+	if (shared_mem_acquire(trace_depth * TRACE_REC_SIZE,
+			       &trace_mem) == EC_SUCCESS) {
+		trace_queue.buffer = (uint8_t *)trace_mem;
+		trace_queue.buffer_units = trace_depth;
+	} else {
+		/* the sampling is stopped while tracing */
+		trace_mem = NULL;
+		trace_queue.buffer = samples[0];
+		trace_queue.buffer_units = TRACE_DEPTH_FALLBACK;
+	}
+	queue_init(&trace_queue);
+	trace_sending = 0;
+	trace_dropped = 0;
+	trace_drop_total = 0;
+}
+
+static void trace_stop(void)
+{
+	/* the DMA might still be reading the head record */
+	while (ep_copying)
+		;
+	trace_sending = 0;
+	queue_advance_head(&trace_queue, queue_count(&trace_queue));
+	if (trace_mem)
+		shared_mem_release(trace_mem);
+	trace_mem = NULL;
+}
+
+/*
+ * Dual-line trace : decode the samples of both CC lines into text trace
+ * records rather than streaming them, until the trace mode changes.
+ */
+static void trace_lines(void)
+{
+	struct rx_desc desc;
+
+	/* both lines are decoded */
+	rx_line_next = RX_LINE_BOTH;
+	rx_set_line();
+	memset(bmc_dec, 0, sizeof(bmc_dec));
+	while (trace_mode == TRACE_MODE_DUAL) {
+		while (queue_remove_unit(&rx_queue, &desc)) {
+			rx_scan(&desc);
+			rx_release(&desc);
+		}
+		task_wait_event(-1);
+	}
+	memset(bmc_dec, 0, sizeof(bmc_dec));
+}
+
+#ifdef SNIFFER_ZERO_COPY
+/* Stop the RX DMA of both lines */
+static void zc_dma_stop(void)
+{
+	dma_disable(DMAC_TIM_RX1);
+	dma_disable(DMAC_TIM_RX2);
+	dma_clear_isr(DMAC_TIM_RX1);
+	dma_clear_isr(DMAC_TIM_RX2);
+}
+
+/*
+ * Zero-copy capture of 'zc_line' until it changes : the packets of the ring
+ * go out first, the endpoint gets back to the ring once the zero-copy ones
+ * are sent. The RX DMA is left stopped.
+ */
+static void zero_copy(void)
+{
+	int ch = zc_line;
+	const struct dma_option *dma = ch == SNIFFER_CHANNEL_CC2 ?
+				       &dma_tim_cc2 : &dma_tim_cc1;
+	int i;
+
+	/* woken by every USB transfer */
+	ep_wait_room(0);
+	while (zc_line == ch && (ep_copying || !ep_ring_empty()))
+		task_wait_event(-1);
+	if (zc_line != ch || ep_alt != SNIFFER_ALT_BULK)
+		return;
+
+	interrupt_disable();
+	zc_dma_stop();
+	rx_flush();
+	zc_flush();
+	for (i = EP_PACKET_HEADER_SIZE / 2; i < EP_BUF_SIZE / 2; i++)
+		ep_buf[0][i] = ep_buf[1][i] = 0;
+	/* the samples before are not contiguous with these */
+	zc_gap = SNIFFER_FLAG_OFLOW;
+	zc_active = 1;
+	dma_start_rx(dma, (2 * ZC_HALF_SIZE) >> RX_WIDE(),
+		     ep_buf[ZC_RING_SLOT]);
+	interrupt_enable();
+	notify_post(INJ_NOTIFY_MODE, INJ_NOTIFY_MODE_ZEROCOPY << 16 | (ch + 1),
+		    get_time().val);
+
+	while (zc_line == ch && ep_alt == SNIFFER_ALT_BULK)
+		task_wait_event(-1);
+
+	interrupt_disable();
+	zc_dma_stop();
+	interrupt_enable();
+	/* a bus reset or a new alternate setting drops them */
+	while (zc_tail != zc_head)
+		msleep(1);
+	zc_active = 0;
+	notify_post(INJ_NOTIFY_MODE, INJ_NOTIFY_MODE_ZEROCOPY << 16,
+		    get_time().val);
+}
+#endif
+
+/* Task to post-process the samples and copy them the USB endpoint buffer */
+void sniffer_task(void)
+{
+	struct rx_desc desc; /* oldest half-buffer filled by the DMA */
+	int sub = 0; /* its next sub-buffer to send */
+	int scanned = 0; /* it went through the decoder */
+
+	while (1) {
+		/* Wait for a new buffer of samples or a new USB free buffer */
+		ep_wait_room(ep_wake_slots > 1);
+		task_wait_event(-1);
+		if (rx_res_next != rx_res) {
+			rx_set_resolution();
+			sub = 0;
+			scanned = 0;
+		}
+		line_update();
+		if (rx_line_next != rx_line && !queue_count(&rx_queue) &&
+		    !scanned && !ep_copying) {
+			rx_set_line();
+			sub = 0;
+		}
+		suspend_update();
+		qos_update();
+		if (qos.level != SNIFFER_QOS_SAMPLES) {
+			qos_drain(scanned);
+			sub = 0;
+			scanned = 0;
+		}
+		/* send the available samples over USB if we have a buffer*/
+		while (!ep_copying && !ep_ring_full()) {
+			int rx = rx_peek(&desc);
+
+			/* the records go between the half-buffers */
+			if (!scanned && rec_process(rx ? &desc : NULL))
+				continue;
+			if (!rx)
+				break;
+			if (!scanned) {
+				TRACEPOINT(TP_SNIFFER_DEQUEUE,
+					   desc.channel << 16 | desc.gen);
+				rx_scan(&desc);
+				if (edge_counting)
+					edge_scan(&desc);
+				scanned = 1;
+			}
+			sub = rx_process(&desc, sub);
+			if (sub < SUB_BUF_COUNT)
+				continue;
+			/* give the half-buffer back to the DMA */
+			queue_advance_head(&rx_queue, 1);
+			rx_release(&desc);
+			sub = 0;
+			scanned = 0;
+		}
+		led_kick();
+		/* the tracer loops wait for every USB transfer */
+		if (trace_mode != TRACE_MODE_OFF)
+			ep_wait_room(0);
+
+		if (trace_mode == TRACE_MODE_DUAL) {
+			uint8_t curr = recording_enable(3);
+			trace_lines();
+			rx_flush();
+			sub = 0;
+			scanned = 0;
+			recording_enable(curr);
+		}
+		if (trace_mode == TRACE_MODE_ON ||
+		    trace_mode == TRACE_MODE_RAW) {
+			uint8_t curr = recording_enable(0);
+			trace_start();
+			trace_packets();
+			trace_stop();
+			rx_flush();
+			sub = 0;
+			scanned = 0;
+			recording_enable(curr);
+		}
+#ifdef SNIFFER_ZERO_COPY
+		if (zc_line >= 0 && ep_alt == SNIFFER_ALT_BULK) {
+			zero_copy();
+			rx_set_line();
+			sub = 0;
+			scanned = 0;
+		}
+#endif
+	}
+}
+
+/* Number of payload words left in the record 'rec' once packed */
+static int trace_pack_words(const uint32_t *rec)
+{
+	int n = TRACE_REC_PAYLOAD / sizeof(uint32_t);
+
+	while (n && !rec[2 + n])
+		n--;
+	return n;
+}
+
+/* Move the records fitting in a USB packet to trace_pack_buf, in bytes */
+static int trace_pack(void)
+{
+	struct queue_chunk chunk;
+	const uint32_t *rec;
+	uint32_t *out;
+	int len = 0, n;
+
+	while (1) {
+		chunk = queue_get_read_chunk(&trace_queue);
+		if (!chunk.length)
+			break;
+		rec = (const uint32_t *)chunk.buffer;
+		n = trace_pack_words(rec);
+		if (len + (4 + n) * sizeof(uint32_t) > EP_BUF_SIZE)
+			break;
+		out = trace_pack_buf + len / sizeof(uint32_t);
+		out[0] = rec[0];
+		out[1] = rec[1] | TRACE_TAG_PACKED;
+		out[2] = rec[2];
+		out[3] = rec[10] | (n << 12);
+		memcpy(out + 4, rec + 3, n * sizeof(uint32_t));
+		len += (4 + n) * sizeof(uint32_t);
+		queue_advance_head(&trace_queue, 1);
+	}
+	return len;
+}
+
+void sniffer_trace_reload(void)
+{
+	struct queue_chunk chunk;
+	int len;
 
 	while (1) {
-		uint32_t t = __hw_clock_source_read();
-		uint32_t c = chan->cndtr;
-		if (t - t0 > timeout_us) /* Timeout */
+		/* the record at the head has reached the USB memory */
+		if (trace_sending && !ep_copying) {
+			queue_advance_head(&trace_queue, 1);
+			trace_sending = 0;
+		}
+		if (ep_copying || ep_ring_full())
+			break;
+		/* copy a new buffer to send over USB if needed */
+		chunk = queue_get_read_chunk(&trace_queue);
+		if (!chunk.length)
 			break;
-		if (min_edges) { /* real packet detection */
-			int nb = (int)c_gap - (int)c;
-			if (nb < 0)
-				nb = RX_COUNT - nb;
-			if (nb > 3) { /* NOT IDLE */
-				t_gap = t;
-				c_gap = c;
-				total_edges += nb;
-			} else {
-				if ((t - t_gap) > 20 &&
-				    (total_edges - (t - t0)/256) >= min_edges)
-					/* real gap after the packet */
-					break;
+		if (trace_packed) {
+			len = trace_pack();
+			ep_ring_fill(0, trace_pack_buf, len, len);
+			continue;
+		}
+		trace_sending = 1;
+		/* it's faster to let some junk at the end of the buffer */
+		ep_ring_fill(0, chunk.buffer, TRACE_REC_SIZE, EP_BUF_SIZE);
+	}
+}
+
+/*
+ * Queue a record with the second word 'tag' and 'hi' in the bits 31:16 of
+ * the last one, returns 0 if it was dropped.
+ */
+static int trace_put(uint64_t ts, uint32_t tag, uint16_t hi,
+		     struct rx_header rx, const uint32_t *payload, int line)
+{
+	uint32_t buf[TRACE_REC_SIZE / sizeof(uint32_t)];
+
+	/* every record is still waiting for USB : drop the new one */
+	if (queue_is_full(&trace_queue)) {
+		trace_dropped++;
+		trace_drop_total++;
+		return 0;
+	}
+
+	buf[0] = ts;
+	buf[1] = tag;
+	buf[2] = *(uint32_t *)&rx;
+	memcpy(buf + 3, payload, TRACE_REC_PAYLOAD);
+	buf[10] = ((ts >> 32) & 0xff) | (line << 8) | (hi << 16);
+	queue_add_unit(&trace_queue, buf);
+
+	/* copy a new buffer to send over USB if starved */
+	if (ep_ring_empty())
+		sniffer_trace_reload();
+	return 1;
+}
+
+void sniffer_trace_packet(uint64_t ts, uint16_t eop16, struct rx_header rx,
+			  uint32_t *payload, int line)
+{
+	/* records lost before this one, saturated to 16 bits */
+	if (trace_put(ts, MIN(trace_dropped, 0xffff) | 0xfada0000, eop16,
+		      rx, payload, line))
+		trace_dropped = 0;
+}
+
+void sniffer_trace_tx(uint64_t ts, uint16_t us, struct rx_header rx,
+		      const uint32_t *payload, int line)
+{
+	/* the next received packet reports the drops */
+	trace_put(ts, us | 0xfadc0000, 0, rx, payload, line);
+}
+
+void sniffer_trace_viol(uint64_t ts, int kind, struct rx_header rx,
+			uint32_t value, int line)
+{
+	uint32_t payload[7] = { value };
+
+	trace_put(ts, kind | 0xfadd0000, 0, rx, payload, line);
+}
+
+void sniffer_trace_repeat(uint64_t ts, struct rx_header rx, uint32_t count,
+			  int line)
+{
+	uint32_t payload[7] = { count };
+
+	trace_put(ts, 0xfade0000, 0, rx, payload, line);
+}
+
+/*
+ * Queue a reassembled extended message : the first record is laid out as
+ * its first chunk (extended header and 26 bytes), the next ones are tagged
+ * 0xfadb<seq> and carry 28 more bytes each. The records are queued all
+ * together or not at all.
+ */
+void sniffer_trace_ext(struct rx_header rx, uint16_t ext_head,
+		       const uint8_t *data, int len, int line)
+{
+	uint32_t buf[TRACE_REC_SIZE / sizeof(uint32_t)];
+	uint8_t *rec = (uint8_t *)(buf + 3);
+	int rec_len = TRACE_REC_PAYLOAD;
+	timestamp_t now = get_time();
+	int nb = 1 + DIV_ROUND_UP(MAX(len - (rec_len - 2), 0), rec_len);
+	int seq, n;
+
+	if (queue_space(&trace_queue) < nb) {
+		trace_dropped++;
+		trace_drop_total++;
+		return;
+	}
+
+	buf[0] = now.le.lo;
+	buf[2] = *(uint32_t *)&rx;
+	buf[10] = (now.le.hi & 0xff) | (line << 8);
+	for (seq = 0; seq < nb; seq++) {
+		memset(rec, 0, rec_len);
+		if (seq == 0) {
+			buf[1] = MIN(trace_dropped, 0xffff) | 0xfada0000;
+			memcpy(rec, &ext_head, 2);
+			n = MIN(len, rec_len - 2);
+			memcpy(rec + 2, data, n);
+		} else {
+			buf[1] = seq | 0xfadb0000;
+			n = MIN(len, rec_len);
+			memcpy(rec, data, n);
+		}
+		data += n;
+		len -= n;
+		queue_add_unit(&trace_queue, buf);
+	}
+	trace_dropped = 0;
+
+	if (ep_ring_empty())
+		sniffer_trace_reload();
+}
+
+/*
+ * Edge window of the packets which fail to decode ('sniffer trace errwin'),
+ * following their record : the RX timer values (2.4 MHz, 8 bits) of their
+ * last TRACE_ERRWIN_EDGES edges, 28 per record, or with 'packed' the
+ * intervals between them in 4 bits (saturated, 15 is a gap), 56 per record.
+ * The tracer latches them before the next packet overwrites the buffer.
+ */
+#define TRACE_ERRWIN_EDGES 112
+#define TRACE_ERRWIN_OFF    0
+#define TRACE_ERRWIN_RAW    1
+#define TRACE_ERRWIN_PACKED 2
+/* tag bits 15:0 of an edge window record */
+#define TRACE_ERRWIN_TAG(fmt, seq, cnt) (((fmt) << 14) | ((seq) << 8) | (cnt))
+
+static int trace_errwin;
+static struct {
+	uint8_t edges[TRACE_ERRWIN_EDGES];
+	uint16_t first; /* index of edges[0] in the capture */
+	uint8_t count;
+} errwin;
+
+void sniffer_trace_errwin_latch(int count)
+{
+	int n = MIN(count, TRACE_ERRWIN_EDGES);
+
+	errwin.count = 0;
+	if (!trace_errwin || trace_mode != TRACE_MODE_RAW)
+		return;
+	errwin.first = count - n;
+	errwin.count = n;
+	memcpy(errwin.edges, (const uint8_t *)pd_get_raw_samples(0) +
+	       errwin.first, n);
+}
+
+void sniffer_trace_errwin(uint64_t ts, struct rx_header rx, int line)
+{
+	uint32_t buf[TRACE_REC_SIZE / sizeof(uint32_t)];
+	uint8_t *rec = (uint8_t *)(buf + 3);
+	int packed = trace_errwin == TRACE_ERRWIN_PACKED;
+	/* edges per record, an interval per edge but the first one */
+	int per_rec = packed ? 2 * TRACE_REC_PAYLOAD : TRACE_REC_PAYLOAD;
+	int first = errwin.first + packed;
+	int count = errwin.count - packed;
+	int seq, i, n, d;
+
+	if (count <= 0)
+		return;
+	if (queue_space(&trace_queue) < DIV_ROUND_UP(count, per_rec)) {
+		trace_dropped++;
+		trace_drop_total++;
+		return;
+	}
+
+	buf[0] = ts;
+	buf[2] = *(uint32_t *)&rx;
+	for (seq = 0; count > 0; seq++) {
+		n = MIN(count, per_rec);
+		buf[1] = 0xfadf0000 | TRACE_ERRWIN_TAG(trace_errwin, seq, n);
+		buf[10] = ((ts >> 32) & 0xff) | (line << 8) | (first << 16);
+		memset(rec, 0, TRACE_REC_PAYLOAD);
+		for (i = 0; i < n; i++) {
+			if (!packed) {
+				rec[i] = errwin.edges[first - errwin.first + i];
+				continue;
 			}
+			/* the interval ending at the edge 'first + i' */
+			d = (uint8_t)(errwin.edges[first - errwin.first + i] -
+				      errwin.edges[first - errwin.first + i - 1]);
+			rec[i / 2] |= MIN(d, 15) << (i & 1 ? 4 : 0);
+		}
+		queue_add_unit(&trace_queue, buf);
+		first += n;
+		count -= n;
+	}
+	errwin.count = 0;
+
+	if (ep_ring_empty())
+		sniffer_trace_reload();
+}
+
+/*
+ * wait_packet() : the waiting task sleeps while the interrupt of a one-shot
+ * timer samples the DMA counter of the RX channel, every WAIT_IDLE_US until
+ * the first edges then every WAIT_GAP_US to find the gap after the packet.
+ */
+/* Idle time ending a packet in us */
+#define WAIT_GAP_US 20
+/* Sampling period before the packet in us, shorter than the shortest one */
+#define WAIT_IDLE_US 100
+
+static struct {
+	stm32_dma_chan_t *chan;
+	task_id_t task;
+	uint32_t min_edges;
+	uint32_t t0;
+	uint32_t t_gap;
+	uint32_t c_gap;
+	uint32_t total_edges;
+	volatile int done;
+} waiter;
+
+static void wait_timer_arm(int us)
+{
+	STM32_TIM_ARR(TIM_WAIT) = us - 1;
+	STM32_TIM_CNT(TIM_WAIT) = 0;
+	/* one-pulse mode, update event on overflow only */
+	STM32_TIM_CR1(TIM_WAIT) = 0x000D;
+}
+
+void wait_timer_interrupt(void)
+{
+	uint32_t t = ts_raw();
+	uint32_t c = waiter.chan->cndtr;
+	int nb = (int)waiter.c_gap - (int)c;
+
+	STM32_TIM_SR(TIM_WAIT) = 0;
+	if (waiter.done)
+		return;
+	/* the counter went through the end of the circular buffer */
+	if (nb < 0)
+		nb += rx_total();
+	if (nb > 3) { /* NOT IDLE */
+		waiter.t_gap = t;
+		waiter.c_gap = c;
+		waiter.total_edges += nb;
+	} else if (t - waiter.t_gap > WAIT_GAP_US &&
+		   (int)(waiter.total_edges - (t - waiter.t0) / 256) >=
+		   (int)waiter.min_edges) {
+		/* real gap after the packet */
+		waiter.done = 1;
+		task_wake(waiter.task);
+		return;
+	}
+	wait_timer_arm(waiter.total_edges ? WAIT_GAP_US : WAIT_IDLE_US);
+}
+DECLARE_IRQ(STM32_IRQ_TIM7, wait_timer_interrupt, 2);
+
+int wait_packet(int pol, uint32_t min_edges, uint32_t timeout_us)
+{
+	uint32_t t0 = ts_raw();
+	int32_t left;
+
+	waiter.done = 0;
+	if (min_edges) {
+		waiter.chan = dma_get_channel(pol ? DMAC_TIM_RX2
+						  : DMAC_TIM_RX1);
+		waiter.task = task_get_current();
+		waiter.min_edges = min_edges;
+		waiter.t0 = waiter.t_gap = t0;
+		waiter.c_gap = waiter.chan->cndtr;
+		waiter.total_edges = 0;
+
+		/* 1us ticks */
+		__hw_timer_enable_clock(TIM_WAIT, 1);
+		STM32_TIM_PSC(TIM_WAIT) = clock_get_freq() / 1000000 - 1;
+		STM32_TIM_CR1(TIM_WAIT) = 0x0004;
+		/* reload the pre-scaler, then clear the update event */
+		STM32_TIM_EGR(TIM_WAIT) = 0x0001;
+		STM32_TIM_SR(TIM_WAIT) = 0;
+		STM32_TIM_DIER(TIM_WAIT) = 0x0001;
+		task_enable_irq(STM32_IRQ_TIM7);
+		wait_timer_arm(WAIT_IDLE_US);
+	}
+
+	/* the other events of the task are kept for its own loop */
+	while (!waiter.done &&
+	       (left = timeout_us - (ts_raw() - t0)) > 0)
+		task_wait_event_mask(TASK_EVENT_WAKE, left);
+
+	if (min_edges) {
+		STM32_TIM_CR1(TIM_WAIT) = 0;
+		task_disable_irq(STM32_IRQ_TIM7);
+		STM32_TIM_SR(TIM_WAIT) = 0;
+		task_clear_pending_irq(STM32_IRQ_TIM7);
+	}
+	/* Timeout */
+	return !waiter.done;
+}
+
+int wait_bus_idle(int pol, uint32_t idle_us, uint32_t timeout_us)
+{
+	stm32_dma_chan_t *chan = dma_get_channel(pol ? DMAC_TIM_RX2
+						     : DMAC_TIM_RX1);
+	uint32_t t0 = ts_raw();
+	uint32_t quiet = t0;
+	uint32_t cnt = chan->cndtr;
+	uint32_t now;
+
+	/* the line is not captured : no way to tell */
+	if (!(chan->ccr & STM32_DMA_CCR_EN))
+		return 0;
+	/* each edge is a sample written by the RX DMA */
+	while ((now = ts_raw()) - quiet < idle_us) {
+		if (chan->cndtr != cnt) {
+			cnt = chan->cndtr;
+			quiet = now;
 		}
+		if (now - t0 >= timeout_us)
+			return -1;
 	}
-	return (__hw_clock_source_read() - t0 > timeout_us);
+	return quiet - t0;
 }
 
 uint8_t recording_enable(uint8_t new_mask)
@@ -427,6 +3870,9 @@ uint8_t recording_enable(uint8_t new_mask)
 			STM32_TIM_CR1(TIM_RX2) &= ~1;
 	}
 	channel_mask = new_mask;
+	/* the settings the capture starts with */
+	if (!old_mask && new_mask)
+		comp_record();
 	return old_mask;
 }
 
@@ -437,11 +3883,698 @@ static void sniffer_sysjump(void)
 }
 DECLARE_HOOK(HOOK_SYSJUMP, sniffer_sysjump, HOOK_PRIO_DEFAULT);
 
+/*
+ * Vendor control requests to the sniffer interface, so a capture driver
+ * (e.g. libsigrok) can set up and describe the stream without the console :
+ * - SNIFFER_REQ_GET_INFO (IN) : struct sniffer_info
+ * - SNIFFER_REQ_SET_FORMAT (OUT) : wValue is SNIFFER_FORMAT_x
+ * - SNIFFER_REQ_SET_RES (OUT) : wValue is the resolution (sniffer_res)
+ * - SNIFFER_REQ_SET_CHANNELS (OUT) : wValue is the bitmap of the captured
+ *   CC lines, 0 stops the capture
+ * - SNIFFER_REQ_SET_PULSE (OUT) : wValue is the SYNC pin role
+ *   (SNIFFER_PULSE_x)
+ * - SNIFFER_REQ_SET_COMP (OUT) : wValue bits 3:0 and 7:4 are the CC1 and
+ *   CC2 comparator settings (SNIFFER_COMP)
+ * Every RX timer capture of the raw format is an edge of its CC line (or a
+ * counter overflow when equal to the previous one) : with the tick rate,
+ * a driver turns each packet into logic samples without any other state.
+ */
+#define SNIFFER_REQ_GET_INFO     0x01
+#define SNIFFER_REQ_SET_FORMAT   0x02
+#define SNIFFER_REQ_SET_RES      0x03
+#define SNIFFER_REQ_SET_CHANNELS 0x04
+#define SNIFFER_REQ_SET_PULSE    0x05
+#define SNIFFER_REQ_SET_COMP     0x06
+
+struct sniffer_info {
+	uint8_t version;      /* SNIFFER_USB_PROTOCOL */
+	uint8_t format;       /* SNIFFER_FORMAT_x */
+	uint8_t res;          /* current resolution (sniffer_res) */
+	uint8_t channels;     /* bitmap of the captured CC lines */
+	uint32_t tick_hz;     /* RX timer counter frequency */
+	uint8_t sample_bits;  /* width of a raw capture : 8 or 16 */
+	uint8_t payload_size; /* largest packet payload */
+	uint8_t sub_count;    /* sub-buffers in a DMA half-buffer */
+	uint8_t comp;         /* CC1 and CC2 comparator settings, as in */
+			      /* SNIFFER_REQ_SET_COMP */
+} __packed;
+
+/* GET_INTERFACE and SET_INTERFACE : bulk or isochronous endpoint */
+static int sniffer_std_request(struct usb_setup_packet *setup,
+			       usb_uint *ep0_buf_tx)
+{
+	uint16_t alt = ep_alt;
+
+	if (setup->bmRequestType == (USB_DIR_IN | USB_RECIP_INTERFACE) &&
+	    setup->bRequest == USB_REQ_GET_INTERFACE) {
+		memcpy_to_usbram((void *)usb_sram_addr(ep0_buf_tx), &alt,
+				 sizeof(alt));
+		btable_ep[0].tx_count = MIN(setup->wLength, 1);
+		STM32_TOGGLE_EP(0, EP_TX_RX_MASK, EP_TX_RX_VALID,
+				EP_STATUS_OUT);
+		return 0;
+	}
+	if (setup->bmRequestType != (USB_DIR_OUT | USB_RECIP_INTERFACE) ||
+	    setup->bRequest != USB_REQ_SET_INTERFACE ||
+	    setup->wValue > SNIFFER_ALT_ISO)
+		return -1;
+	ep_setup(setup->wValue);
+	btable_ep[0].tx_count = 0;
+	STM32_TOGGLE_EP(0, EP_TX_RX_MASK, EP_TX_RX_VALID, EP_STATUS_OUT);
+	return 0;
+}
+
+static int sniffer_iface_request(usb_uint *ep0_buf_rx, usb_uint *ep0_buf_tx)
+{
+	struct usb_setup_packet setup;
+	struct sniffer_info info;
+
+	if (!ep0_buf_rx)
+		return -1;
+	usb_read_setup_packet(ep0_buf_rx, &setup);
+	if ((setup.bmRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD)
+		return sniffer_std_request(&setup, ep0_buf_tx);
+	if ((setup.bmRequestType & USB_TYPE_MASK) != USB_TYPE_VENDOR)
+		return -1;
+
+	if (setup.bmRequestType & USB_DIR_IN) {
+		if (setup.bRequest != SNIFFER_REQ_GET_INFO)
+			return -1;
+		info.version = SNIFFER_USB_PROTOCOL;
+		info.format = sniffer_format;
+		info.res = rx_res_next;
+		info.channels = channel_mask;
+		info.tick_hz = 48000000 / res_table[rx_res_next].div;
+		info.sample_bits = res_table[rx_res_next].wide ? 16 : 8;
+		info.payload_size = EP_PAYLOAD_SIZE;
+		info.sub_count = SUB_BUF_COUNT;
+		info.comp = comp_setting[0] | (comp_setting[1] << 4);
+		memcpy_to_usbram((void *)usb_sram_addr(ep0_buf_tx), &info,
+				 sizeof(info));
+		btable_ep[0].tx_count = MIN(setup.wLength, sizeof(info));
+		STM32_TOGGLE_EP(0, EP_TX_RX_MASK, EP_TX_RX_VALID,
+				EP_STATUS_OUT);
+		return 0;
+	}
+
+	if (setup.wLength)
+		return -1;
+	switch (setup.bRequest) {
+	case SNIFFER_REQ_SET_FORMAT:
+		if (setup.wValue > SNIFFER_FORMAT_PACKED)
+			return -1;
+		sniffer_format = setup.wValue;
+		break;
+	case SNIFFER_REQ_SET_RES:
+		if (setup.wValue >= SNIFFER_RES_COUNT)
+			return -1;
+		/* the sniffer task restarts the sampling */
+		rx_res_next = setup.wValue;
+		task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
+		break;
+	case SNIFFER_REQ_SET_CHANNELS:
+		if (setup.wValue > 3)
+			return -1;
+		recording_enable(setup.wValue);
+		break;
+	case SNIFFER_REQ_SET_PULSE:
+		if (setup.wValue > SNIFFER_PULSE_INPUT)
+			return -1;
+		pulse_set_role(setup.wValue);
+		break;
+	case SNIFFER_REQ_SET_COMP:
+		if (setup.wValue > 0xff)
+			return -1;
+		comp_set(SNIFFER_CHANNEL_CC1, setup.wValue);
+		comp_set(SNIFFER_CHANNEL_CC2, setup.wValue >> 4);
+		comp_record();
+		break;
+	default:
+		return -1;
+	}
+	btable_ep[0].tx_count = 0;
+	STM32_TOGGLE_EP(0, EP_TX_RX_MASK, EP_TX_RX_VALID, EP_STATUS_OUT);
+	return 0;
+}
+USB_DECLARE_IFACE(USB_IFACE_VENDOR, sniffer_iface_request);
+
+static int cmd_trigger(int argc, char **argv)
+{
+	static const char * const state_name[] = {
+		[TRIG_OFF] = "off",
+		[TRIG_ARMED] = "armed",
+		[TRIG_FIRED] = "fired",
+		[TRIG_DONE] = "done",
+	};
+	char *e;
+	int mv;
+
+	if (argc < 1) {
+		ccprintf("Trigger: %s sources %x header %04x/%04x "
+			 "post %d ms\n", state_name[trig.state],
+			 trig.sources, trig.hdr_mask, trig.hdr_value,
+			 trig.post_us / MSEC);
+		return EC_SUCCESS;
+	}
+
+	if (!strcasecmp(argv[0], "off")) {
+		trigger_arm(0);
+	} else if (!strcasecmp(argv[0], "arm")) {
+		trigger_arm(trig.sources);
+	} else if (!strcasecmp(argv[0], "hrst")) {
+		trigger_arm(trig.sources | TRIG_SRC_RESET);
+	} else if (!strcasecmp(argv[0], "header")) {
+		if (argc < 3)
+			return EC_ERROR_PARAM_COUNT;
+		trig.hdr_mask = strtoi(argv[1], &e, 16);
+		if (*e)
+			return EC_ERROR_PARAM3;
+		trig.hdr_value = strtoi(argv[2], &e, 16) & trig.hdr_mask;
+		if (*e)
+			return EC_ERROR_PARAM4;
+		trigger_arm(trig.sources | TRIG_SRC_HEADER);
+	} else if (!strcasecmp(argv[0], "vbus")) {
+		if (argc < 2)
+			return EC_ERROR_PARAM_COUNT;
+		mv = strtoi(argv[1], &e, 10);
+		if (*e || powermon_set_limit(POWER_LIMIT_V_OVER, mv))
+			return EC_ERROR_PARAM3;
+		trigger_arm(trig.sources | TRIG_SRC_VBUS);
+	} else if (!strcasecmp(argv[0], "power")) {
+		/* on the limit set by 'powermon limit' */
+		trigger_arm(trig.sources | TRIG_SRC_VBUS);
+	} else if (!strcasecmp(argv[0], "post")) {
+		if (argc < 2)
+			return EC_ERROR_PARAM_COUNT;
+		trig.post_us = strtoi(argv[1], &e, 10) * MSEC;
+		if (*e)
+			return EC_ERROR_PARAM3;
+	} else {
+		return EC_ERROR_PARAM2;
+	}
+
+	return EC_SUCCESS;
+}
+
+static int cmd_resolution(int argc, char **argv)
+{
+	int i;
+
+	if (argc >= 1) {
+		for (i = 0; i < SNIFFER_RES_COUNT; i++)
+			if (!strcasecmp(argv[0], res_table[i].name))
+				break;
+		if (i == SNIFFER_RES_COUNT)
+			return EC_ERROR_PARAM2;
+		/* the sniffer task restarts the sampling */
+		rx_res_next = i;
+		task_set_event(TASK_ID_SNIFFER, SNIFFER_EVENT_DMA, 0);
+	}
+
+	ccprintf("Resolution: %s %d ns %d-bit\n", res_table[rx_res_next].name,
+		 res_table[rx_res_next].div * 1000 / 48,
+		 res_table[rx_res_next].wide ? 16 : 8);
+	return EC_SUCCESS;
+}
+
+static int cmd_vbus(int argc, char **argv)
+{
+	char *e;
+	int ms;
+
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "off")) {
+			ms = 0;
+		} else {
+			ms = strtoi(argv[0], &e, 10);
+			if (*e || ms <= 0)
+				return EC_ERROR_PARAM2;
+		}
+		vbus_records = !!ms;
+		powermon_set_period(ms * MSEC, 0);
+	}
+
+	if (vbus_records && powermon_get_period())
+		ccprintf("VBUS records: every %d ms, %d dropped\n",
+			 powermon_get_period() / MSEC, powermon_overruns());
+	else
+		ccprintf("VBUS records: off\n");
+	return EC_SUCCESS;
+}
+
+static int cmd_sync(int argc, char **argv)
+{
+	char *e;
+	int ms;
+
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "off")) {
+			ms = 0;
+		} else {
+			ms = strtoi(argv[0], &e, 10);
+			if (*e || ms <= 0)
+				return EC_ERROR_PARAM2;
+		}
+		sync_period = ms * MSEC;
+		hook_call_deferred(&sync_arm_data, ms ? 0 : -1);
+	}
+
+	if (sync_period)
+		ccprintf("Sync records: every %d ms\n", sync_period / MSEC);
+	else
+		ccprintf("Sync records: off\n");
+	ccprintf("HSI48: trim %d, error %d ppm, %d SOF errors\n",
+		 (STM32_CRS_CR >> 8) & 0x3f, crs_error_ppm(STM32_CRS_ISR),
+		 crs.errors);
+	return EC_SUCCESS;
+}
+
+static int cmd_pulse(int argc, char **argv)
+{
+	static const char * const role_name[] = {
+		[SNIFFER_PULSE_OFF] = "off",
+		[SNIFFER_PULSE_MASTER] = "master",
+		[SNIFFER_PULSE_SLAVE] = "slave",
+		[SNIFFER_PULSE_INPUT] = "input",
+	};
+	int i;
+
+	if (argc >= 1) {
+		for (i = 0; i < ARRAY_SIZE(role_name); i++)
+			if (!strcasecmp(argv[0], role_name[i]))
+				break;
+		if (i == ARRAY_SIZE(role_name))
+			return EC_ERROR_PARAM2;
+		pulse_set_role(i);
+	}
+
+	ccprintf("Sync pulse: %s, %d pulses, %d errors\n",
+		 role_name[pulse_role], pulse_count, pulse_errors);
+	if (pulse_role == SNIFFER_PULSE_MASTER && !sync_period)
+		ccprintf("Sync records are off : no pulse sent\n");
+	return EC_SUCCESS;
+}
+
+static int cmd_cc(int argc, char **argv)
+{
+	int avg, smpr = cc_smpr;
+	char *e;
+
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "off")) {
+			avg = 0;
+		} else {
+			avg = strtoi(argv[0], &e, 10);
+			if (*e || avg <= 0)
+				return EC_ERROR_PARAM2;
+		}
+		if (argc >= 2) {
+			smpr = strtoi(argv[1], &e, 10);
+			if (*e || smpr < 0 || smpr > STM32_ADC_SMPR_239_5_CY)
+				return EC_ERROR_PARAM3;
+		}
+		if (cc_capture(avg, smpr))
+			return EC_ERROR_PARAM2;
+	}
+
+	if (cc_avg)
+		ccprintf("CC records: %d.%03d us per sample (%d pairs of "
+			 "sample time %d), %d overruns\n",
+			 cc_pair_ns * cc_avg / 1000,
+			 cc_pair_ns * cc_avg % 1000, cc_avg, cc_smpr,
+			 cc_overruns);
+	else
+		ccprintf("CC records: off\n");
+	return EC_SUCCESS;
+}
+
+static void lat_print(const char *name, const struct lat_hist *h,
+		      const char *unit)
+{
+	int b;
+
+	ccprintf("%-4s: %d max %d %s\n ", name, h->count, h->max, unit);
+	for (b = 0; b < LAT_BINS; b++)
+		ccprintf(" %d", h->bins[b]);
+	ccputs("\n");
+	cflush();
+}
+
+static int cmd_latency(int argc, char **argv)
+{
+	if (argc >= 1) {
+		if (strcasecmp(argv[0], "reset"))
+			return EC_ERROR_PARAM2;
+		interrupt_disable();
+		memset(&rx_lag, 0, sizeof(rx_lag));
+		memset(&rx_wait, 0, sizeof(rx_wait));
+		interrupt_enable();
+	}
+
+	ccprintf("Half-buffer: %d samples, log2 bins\n",
+		 (RX_COUNT >> RX_WIDE()) / 2);
+	lat_print("ISR", &rx_lag, "samples late");
+	lat_print("Task", &rx_wait, "us after the ISR");
+
+	return EC_SUCCESS;
+}
+
+static void boot_print(const char *name, uint32_t ts)
+{
+	if (ts)
+		ccprintf("%-10s: %d.%03d ms\n", name, ts / 1000, ts % 1000);
+	else
+		ccprintf("%-10s: -\n", name);
+}
+
+static int cmd_boot(int argc, char **argv)
+{
+	boot_print("Capture", boot_ts.capture);
+	boot_print("First DMA", boot_ts.first_dma);
+	boot_print("USB reset", boot_ts.usb_reset);
+	boot_print("Host read", boot_ts.first_in);
+	return EC_SUCCESS;
+}
+
+static int cmd_decode(int argc, char **argv)
+{
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "on"))
+			decode_enabled = 1;
+		else if (!strcasecmp(argv[0], "off"))
+			decode_enabled = 0;
+		else
+			return EC_ERROR_PARAM2;
+	}
+
+	ccprintf("Decode: %s, %d packets %d errors %d dropped\n",
+		 decode_enabled ? "on" : "off", decode_count, decode_errors,
+		 decode_drops);
+	return EC_SUCCESS;
+}
+
+static int cmd_qos(int argc, char **argv)
+{
+	static const char * const level_name[] = {
+		[SNIFFER_QOS_SAMPLES] = "samples",
+		[SNIFFER_QOS_PACKETS] = "packets",
+		[SNIFFER_QOS_EVENTS]  = "events",
+	};
+
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "on"))
+			qos.enabled = 1;
+		else if (!strcasecmp(argv[0], "off"))
+			qos.enabled = 0;
+		else
+			return EC_ERROR_PARAM2;
+		/* applied by the task */
+		task_wake(TASK_ID_SNIFFER);
+	}
+
+	ccprintf("QoS: %s, streaming %s for %d ms, %d step downs\n",
+		 qos.enabled ? "on" : "off", level_name[qos.level],
+		 (uint32_t)(get_time().val - qos.since.val) / MSEC, qos.downs);
+	return EC_SUCCESS;
+}
+
+static int cmd_suspend(int argc, char **argv)
+{
+	uint8_t wake_on = 0;
+	int i;
+
+	if (argc >= 1) {
+		if (strcasecmp(argv[0], "wake"))
+			return EC_ERROR_PARAM2;
+		for (i = 1; i < argc; i++) {
+			if (!strcasecmp(argv[i], "trigger"))
+				wake_on |= SUSP_WAKE_ON_TRIGGER;
+			else if (!strcasecmp(argv[i], "full"))
+				wake_on |= SUSP_WAKE_ON_FULL;
+			else if (strcasecmp(argv[i], "off"))
+				return EC_ERROR_PARAM3;
+		}
+		susp.wake_on = wake_on;
+	}
+
+	ccprintf("Suspend: %s, %d suspends, %d wake-ups, wake on:%s%s\n",
+		 susp.active ? "suspended" : "running", susp.count,
+		 susp.wakes,
+		 susp.wake_on & SUSP_WAKE_ON_TRIGGER ? " trigger" : "",
+		 susp.wake_on & SUSP_WAKE_ON_FULL ? " full" : "");
+	return EC_SUCCESS;
+}
+
+static int cmd_line(int argc, char **argv)
+{
+	static const char * const line_name[] = { "CC1", "CC2", "both" };
+
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "cc1"))
+			rx_line_next = SNIFFER_CHANNEL_CC1;
+		else if (!strcasecmp(argv[0], "cc2"))
+			rx_line_next = SNIFFER_CHANNEL_CC2;
+		else if (!strcasecmp(argv[0], "both") ||
+			 !strcasecmp(argv[0], "auto"))
+			rx_line_next = RX_LINE_BOTH;
+		else
+			return EC_ERROR_PARAM2;
+		line_auto = !strcasecmp(argv[0], "auto");
+		/* applied by the task */
+		task_wake(TASK_ID_SNIFFER);
+	}
+
+	ccprintf("Line: %s%s, %d samples per line, %d switches\n",
+		 line_name[rx_line], line_auto ? " (auto)" : "", rx_total(),
+		 line_switches);
+	return EC_SUCCESS;
+}
+
+#ifdef SNIFFER_ZERO_COPY
+static int cmd_zerocopy(int argc, char **argv)
+{
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "cc1"))
+			zc_line = SNIFFER_CHANNEL_CC1;
+		else if (!strcasecmp(argv[0], "cc2"))
+			zc_line = SNIFFER_CHANNEL_CC2;
+		else if (!strcasecmp(argv[0], "off"))
+			zc_line = -1;
+		else
+			return EC_ERROR_PARAM2;
+		/* applied by the task */
+		task_wake(TASK_ID_SNIFFER);
+	}
+
+	ccprintf("Zero-copy: %s%s, %d packets, %d dropped, %d late\n",
+		 zc_line < 0 ? "off" : zc_line ? "CC2" : "CC1",
+		 zc_line >= 0 && !zc_active ? " (pending)" : "",
+		 zc_packets, zc_dropped, zc_late);
+	return EC_SUCCESS;
+}
+#endif
+
+static int cmd_comp(int argc, char **argv)
+{
+	static const char * const hyst_name[] = {
+		"no", "low", "medium", "high"
+	};
+	static const char * const mode_name[] = {
+		"high speed", "medium speed", "low power", "ultra-low power"
+	};
+	int ch, hyst, mode;
+	char *e;
+
+	if (argc >= 2) {
+		if (!strcasecmp(argv[0], "cc1"))
+			ch = SNIFFER_CHANNEL_CC1;
+		else if (!strcasecmp(argv[0], "cc2"))
+			ch = SNIFFER_CHANNEL_CC2;
+		else if (!strcasecmp(argv[0], "both"))
+			ch = RX_LINE_BOTH;
+		else
+			return EC_ERROR_PARAM2;
+		hyst = strtoi(argv[1], &e, 10);
+		if (*e || hyst < 0 || hyst > 3)
+			return EC_ERROR_PARAM3;
+		mode = 0;
+		if (argc >= 3) {
+			mode = strtoi(argv[2], &e, 10);
+			if (*e || mode < 0 || mode > 3)
+				return EC_ERROR_PARAM4;
+		}
+		if (ch != SNIFFER_CHANNEL_CC2)
+			comp_set(SNIFFER_CHANNEL_CC1, SNIFFER_COMP(hyst, mode));
+		if (ch != SNIFFER_CHANNEL_CC1)
+			comp_set(SNIFFER_CHANNEL_CC2, SNIFFER_COMP(hyst, mode));
+		comp_record();
+	} else if (argc >= 1) {
+		return EC_ERROR_PARAM_COUNT;
+	}
+
+	for (ch = 0; ch < 2; ch++)
+		ccprintf("CC%d comparator: %s hysteresis, %s\n", ch + 1,
+			 hyst_name[SNIFFER_COMP_HYST(comp_setting[ch])],
+			 mode_name[SNIFFER_COMP_MODE(comp_setting[ch])]);
+	return EC_SUCCESS;
+}
+
+static int cmd_health(int argc, char **argv)
+{
+	if (argc >= 1) {
+		if (!strcasecmp(argv[0], "on"))
+			health.enabled = 1;
+		else if (!strcasecmp(argv[0], "off"))
+			health.enabled = 0;
+		else
+			return EC_ERROR_PARAM2;
+	}
+
+	ccprintf("Health records: %s\n", health.enabled ? "on" : "off");
+	return EC_SUCCESS;
+}
+
+static int cmd_wake(int argc, char **argv)
+{
+	char *e;
+	int slots;
+
+	if (argc >= 1) {
+		slots = strtoi(argv[0], &e, 0);
+		if (*e || slots < 1 || slots > EP_BUF_COUNT)
+			return EC_ERROR_PARAM2;
+		ep_wake_slots = slots;
+	}
+
+	ccprintf("USB wake-ups: %d, coalesced %d, at %d free slots of %d\n",
+		 ep_wakeups, ep_coalesced, ep_wake_slots, EP_BUF_COUNT);
+	return EC_SUCCESS;
+}
+
+static int cmd_trace(int argc, char **argv)
+{
+	char *e;
+	int depth;
+
+	if (argc >= 1 && !strcasecmp(argv[0], "packed")) {
+		trace_packed = 1;
+	} else if (argc >= 1 && !strcasecmp(argv[0], "full")) {
+		trace_packed = 0;
+	} else if (argc >= 1 && !strcasecmp(argv[0], "errwin")) {
+		if (argc < 2)
+			return EC_ERROR_PARAM_COUNT;
+		if (!strcasecmp(argv[1], "off"))
+			trace_errwin = TRACE_ERRWIN_OFF;
+		else if (!strcasecmp(argv[1], "raw"))
+			trace_errwin = TRACE_ERRWIN_RAW;
+		else if (!strcasecmp(argv[1], "packed"))
+			trace_errwin = TRACE_ERRWIN_PACKED;
+		else
+			return EC_ERROR_PARAM3;
+	} else if (argc >= 1) {
+		depth = strtoi(argv[0], &e, 10);
+		if (*e || depth <= 0 || !POWER_OF_TWO(depth) ||
+		    depth * TRACE_REC_SIZE > shared_mem_size())
+			return EC_ERROR_PARAM2;
+		/* used at the next "trace raw" */
+		trace_depth = depth;
+	}
+
+	ccprintf("Trace depth: %d records, %d buffered, %d dropped\n",
+		 trace_depth, queue_count(&trace_queue), trace_drop_total);
+	ccprintf("Trace records: %s, error edges: %s\n",
+		 trace_packed ? "packed" : "full",
+		 trace_errwin == TRACE_ERRWIN_PACKED ? "packed" :
+		 trace_errwin == TRACE_ERRWIN_RAW ? "raw" : "off");
+	return EC_SUCCESS;
+}
+
 static int command_sniffer(int argc, char **argv)
 {
-	ccprintf("Seq number:%d Overflows: %d\n", seq, oflow);
+	int i;
+
+	if (argc >= 2 && !strcasecmp(argv[1], "trigger"))
+		return cmd_trigger(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "res"))
+		return cmd_resolution(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "vbus"))
+		return cmd_vbus(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "cc"))
+		return cmd_cc(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "sync"))
+		return cmd_sync(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "pulse"))
+		return cmd_pulse(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "decode"))
+		return cmd_decode(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "qos"))
+		return cmd_qos(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "line"))
+		return cmd_line(argc - 2, argv + 2);
+#ifdef SNIFFER_ZERO_COPY
+	if (argc >= 2 && !strcasecmp(argv[1], "zerocopy"))
+		return cmd_zerocopy(argc - 2, argv + 2);
+#endif
+	if (argc >= 2 && !strcasecmp(argv[1], "suspend"))
+		return cmd_suspend(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "trace"))
+		return cmd_trace(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "health"))
+		return cmd_health(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "wake"))
+		return cmd_wake(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "comp"))
+		return cmd_comp(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "latency"))
+		return cmd_latency(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "boot"))
+		return cmd_boot(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "stats"))
+		return stats_command(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "flight"))
+		return flight_command(argc - 2, argv + 2);
+	if (argc >= 2 && !strcasecmp(argv[1], "eye"))
+		return eye_command(argc - 2, argv + 2);
+
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "raw"))
+			sniffer_format = SNIFFER_FORMAT_RAW;
+		else if (!strcasecmp(argv[1], "packed"))
+			sniffer_format = SNIFFER_FORMAT_PACKED;
+		else
+			return EC_ERROR_PARAM1;
+	}
+
+	ccprintf("Format: %s Resolution: %s\n",
+		 sniffer_format == SNIFFER_FORMAT_PACKED ? "packed" : "raw",
+		 res_table[rx_res].name);
+	ccprintf("Seq number:%d Overflows: %d USB buffers: %d/%d %s\n",
+		 seq, oflow, ep_ring_used(), EP_BUF_COUNT,
+		 ep_alt == SNIFFER_ALT_ISO ? "isochronous" : "bulk");
+	ccprintf("Torn: %d sub-buffers, %d packets\n", torn, torn_pkts);
+	ccputs("Records:");
+	for (i = 0; i < ARRAY_SIZE(rec_sources); i++)
+		ccprintf(" %s %d", rec_sources[i].name, rec_sent[i]);
+	ccputs("\n");
 
 	return EC_SUCCESS;
 }
 DECLARE_CONSOLE_COMMAND(sniffer, command_sniffer,
-			"[]", "Buffering status");
+			"[raw|packed|res [normal|fine|coarse]|vbus [off|<ms>]"
+			"|cc [off|<avg> [<smpr 0-7>]]"
+			"|sync [off|<ms>]|pulse [off|master|slave|input]"
+			"|decode [on|off]|qos [on|off]|line [both|cc1|cc2|auto]"
+			"|zerocopy [off|cc1|cc2]"
+			"|suspend [wake [off|trigger|full]...]"
+			"|trace [<depth>|packed|full]|health [on|off]"
+			"|wake [<slots>]"
+			"|comp [cc1|cc2|both <hyst 0-3> [<mode 0-3>]]"
+			"|latency [reset]|boot"
+			"|stats [clear]"
+			"|flight [clear|freeze|auto [off|hrst|trigger]...]"
+			"|eye [on|off|clear|cal [track]]"
+			"|trigger [off|arm|hrst|header <mask> <val>|vbus <mV>"
+			"|power|post <ms>]]",
+			"Sample stream format, resolution, VBUS, CC, sync and "
+			"packet records, trigger, buffering status, "
+			"latency, traffic statistics, flight recorder and eye");
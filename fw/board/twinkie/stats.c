@@ -0,0 +1,157 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Traffic statistics : counters per SOP* type, message type and decoding
+ * error, and the CC bus utilization over sliding windows, kept from the
+ * packets decoded on the RX path (the sniffer decoder, or the tracer while
+ * it runs) so the health of a link can be sampled without any trace.
+ *
+ * The bus is busy for the estimated time on the line of each frame. The
+ * utilization windows add up per-second buckets of that busy time.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "injector.h"
+#include "task.h"
+#include "timer.h"
+#include "usb_pd.h"
+#include "usb_pd_tcpm.h"
+#include "util.h"
+
+/* Busy time unit in the buckets, 1 s fits in 16 bits */
+#define BUSY_UNIT_US 16
+#define BUCKETS 60
+
+static const uint8_t windows[INJ_STATS_WINDOW_COUNT] = INJ_STATS_WINDOWS;
+
+static struct inj_stats stats;
+/* busy time of each second, the current one is still filling */
+static uint16_t busy[BUCKETS];
+static uint32_t busy_sec;
+static uint32_t busy_rem;
+
+const char * const inj_stats_err_name[INJ_STATS_ERR_COUNT] = {
+	[INJ_STATS_ERR_PREAMBLE] = "preamble",
+	[INJ_STATS_ERR_SOP]      = "SOP",
+	[INJ_STATS_ERR_DATA]     = "data",
+	[INJ_STATS_ERR_CRC]      = "CRC",
+	[INJ_STATS_ERR_EOP]      = "EOP",
+};
+const char * const inj_stats_sop_name[7] = {
+	"SOP", "SOP'", "SOP''", "SOP'D", "SOP''D", "HRST", "CRST",
+};
+BUILD_ASSERT(ARRAY_SIZE(stats.sop) == TCPC_TX_CABLE_RESET + 1);
+BUILD_ASSERT(ARRAY_SIZE(inj_stats_sop_name) == ARRAY_SIZE(stats.sop));
+
+/* Move the current bucket to the second 'sec', clearing the skipped ones */
+static void busy_advance(uint32_t sec)
+{
+	uint32_t n = MIN(sec - busy_sec, BUCKETS);
+
+	while (n--) {
+		busy_sec++;
+		busy[busy_sec % BUCKETS] = 0;
+	}
+	busy_sec = sec;
+}
+
+static void busy_add(uint32_t us)
+{
+	busy_advance(get_time().val / SECOND);
+	us += busy_rem;
+	busy_rem = us % BUSY_UNIT_US;
+	busy[busy_sec % BUCKETS] += us / BUSY_UNIT_US;
+}
+
+void stats_packet(int sop, uint16_t head)
+{
+	int cnt = PD_HEADER_CNT(head);
+	int type = PD_HEADER_TYPE(head);
+
+	if (sop < 0 || sop > TCPC_TX_CABLE_RESET)
+		return;
+	stats.sop[sop]++;
+	if (sop > TCPC_TX_SOP_DEBUG_PRIME_PRIME) {
+		/* preamble and ordered set only */
+		busy_add((64 + 20) * 10 / 3);
+		return;
+	}
+	/* preamble, SOP, header, payload, CRC and EOP */
+	busy_add((64 + 20 + 20 + cnt * 40 + 40 + 5) * 10 / 3);
+
+	if (!cnt)
+		stats.ctrl[type]++;
+	else if (!PD_HEADER_EXT(head))
+		stats.data[type]++;
+	else if (type < ARRAY_SIZE(stats.ext))
+		stats.ext[type]++;
+}
+
+void stats_error(int err)
+{
+	if (err >= 0 && err < INJ_STATS_ERR_COUNT)
+		stats.errors[err]++;
+}
+
+void stats_get(struct inj_stats *out)
+{
+	uint32_t sum = 0;
+	int i, w;
+
+	/* complete seconds only */
+	interrupt_disable();
+	busy_advance(get_time().val / SECOND);
+	*out = stats;
+	for (i = 1, w = 0; i <= BUCKETS && w < INJ_STATS_WINDOW_COUNT; i++) {
+		sum += busy[(busy_sec + BUCKETS - i) % BUCKETS];
+		if (i == windows[w]) {
+			/* in 1/100 % of the window */
+			out->util[w] = sum * BUSY_UNIT_US / (windows[w] * 100);
+			w++;
+		}
+	}
+	interrupt_enable();
+	out->uptime = get_time().val / SECOND;
+}
+
+int stats_command(int argc, char **argv)
+{
+	struct inj_stats s;
+	int i;
+
+	if (argc >= 1) {
+		if (strcasecmp(argv[0], "clear"))
+			return EC_ERROR_PARAM2;
+		interrupt_disable();
+		memset(&stats, 0, sizeof(stats));
+		memset(busy, 0, sizeof(busy));
+		interrupt_enable();
+	}
+
+	stats_get(&s);
+	for (i = 0; i < ARRAY_SIZE(s.sop); i++)
+		ccprintf("%s %d ", inj_stats_sop_name[i], s.sop[i]);
+	ccputs("\nErrors:");
+	for (i = 0; i < INJ_STATS_ERR_COUNT; i++)
+		ccprintf(" %s %d", inj_stats_err_name[i], s.errors[i]);
+	ccputs("\nCC busy:");
+	for (i = 0; i < INJ_STATS_WINDOW_COUNT; i++)
+		ccprintf(" %ds %d.%02d%%", windows[i], s.util[i] / 100,
+			 s.util[i] % 100);
+	ccputs("\nctrl:");
+	for (i = 0; i < ARRAY_SIZE(s.ctrl); i++)
+		if (s.ctrl[i])
+			ccprintf(" %d:%d", i, s.ctrl[i]);
+	ccputs("\ndata:");
+	for (i = 0; i < ARRAY_SIZE(s.data); i++)
+		if (s.data[i])
+			ccprintf(" %d:%d", i, s.data[i]);
+	ccputs("\next:");
+	for (i = 0; i < ARRAY_SIZE(s.ext); i++)
+		if (s.ext[i])
+			ccprintf(" %d:%d", i, s.ext[i]);
+	ccputs("\n");
+	return EC_SUCCESS;
+}
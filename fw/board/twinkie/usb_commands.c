@@ -6,20 +6,30 @@
 #include "common.h"
 #include "config.h"
 #include "console.h"
+#include "crc.h"
+#include "ec_commands.h"
+#include "flash.h"
+#include "hooks.h"
+#include "hwtimer.h"
+#include "injector.h"
 #include "link_defs.h"
 #include "printf.h"
 #include "registers.h"
+#include "shared_mem.h"
+#include "system.h"
 #include "task.h"
 #include "timer.h"
+#include "token_log.h"
+#include "tracepoint.h"
 #include "util.h"
 #include "usb_api.h"
 #include "usb_descriptor.h"
 #include "usb_hw.h"
+#include "usb_pd.h"
 
 /* Console output macro */
 #define CPRINTF(format, args...) cprintf(CC_USB, format, ## args)
 
-#define USB_COMMAND_TX_SIZE  512
 #define USB_COMMAND_BUF_COUNT (DIV_ROUND_UP(USB_COMMAND_TX_SIZE, \
 					    USB_MAX_PACKET_SIZE))
 #define USB_COMMAND_TX_WORD_COUNT (USB_COMMAND_BUF_COUNT * \
@@ -30,7 +40,7 @@ const struct usb_interface_descriptor USB_IFACE_DESC(USB_IFACE_COMMAND) = {
 	.bDescriptorType    = USB_DT_INTERFACE,
 	.bInterfaceNumber   = USB_IFACE_COMMAND,
 	.bAlternateSetting  = 0,
-	.bNumEndpoints      = 2,
+	.bNumEndpoints      = 3, /* and the notifications (notify.c) */
 	.bInterfaceClass    = USB_CLASS_VENDOR_SPEC,
 	.bInterfaceSubClass = 0,
 	.bInterfaceProtocol = 0,
@@ -58,15 +68,120 @@ static usb_uint ep_buf_rx[USB_MAX_PACKET_SIZE / sizeof(usb_uint)] __usb_ram;
 
 static volatile unsigned tx_idx;
 static volatile usb_uint tx_next_buf;
-static volatile unsigned rx_count;
 static int processing;
 
+/*
+ * Pipelined commands : the OUT packets are queued by the RX interrupt and
+ * reception stays enabled while a slot is free, the host submits the next
+ * packets without waiting for the responses. A packet holds one or several
+ * newline separated commands, their outputs go in one response, sent once
+ * the previous one has been read.
+ */
+BUILD_ASSERT(POWER_OF_TWO(USB_COMMAND_QUEUE));
+static struct {
+	char data[USB_MAX_PACKET_SIZE];
+	unsigned len;
+	uint32_t ts; /* hardware timer at the reception */
+} cmd_q[USB_COMMAND_QUEUE];
+/* free running indexes : written by the RX interrupt, read by the console */
+static volatile uint32_t cmd_q_head;
+static volatile uint32_t cmd_q_tail;
+/* offset of the next command in the packet at the tail, 0 if none */
+static int batch_pos;
+/* '@<tag> <command>' : its output ends with '@<tag> <status>' */
+#define CMD_TAG_LEN 8
+static char cmd_tag[CMD_TAG_LEN + 1];
+/* the response is armed and the host has not read it all yet */
+static volatile int tx_busy;
+static timestamp_t tx_deadline;
+
+/*
+ * Streaming of the responses larger than the TX buffer : the console task
+ * sends the full buffer and waits for the host to drain it before going on.
+ */
+#define TASK_EVENT_CMD_TX_DONE TASK_EVENT_CUSTOM(1)
+/* give up the streaming if the host is not reading */
+#define CMD_STREAM_TIMEOUT_US (1 * SECOND)
+static volatile int tx_streaming;
+/* the host stopped reading : the rest of the response is dropped */
+static int tx_dropping;
+
+/*
+ * Binary write of the FSM buffer (or the replay ring, or the RW image) in
+ * progress
+ */
+static struct {
+	struct inj_bin_req req;
+	int next;  /* index (or ring offset) of the next word to receive */
+	int left;  /* words still to receive */
+	int err;   /* the words are still received but no longer written */
+	uint32_t crc;
+	timestamp_t deadline; /* for the next packet */
+} bin_wr;
+/* the host gave up the transfer if no packet comes for that long */
+#define BIN_WR_TIMEOUT_US (2 * SECOND)
+
+/* Wake-up the console task once the binary write timeout expires */
+static void bin_wr_wait(void)
+{
+	console_has_input();
+}
+DECLARE_DEFERRED(bin_wr_wait);
+
+/* INJ_BIN_UPDATE : flash offset of the image and bytes of it erased */
+static struct {
+	int base;
+	int erased;
+} update;
+
+/* INJ_BIN_DECODE : samples received, in the shared memory */
+static uint32_t *decode_buf;
+
+/*
+ * Flash content streamed after the first packet of a response : the TX
+ * interrupt copies each packet straight from the mapped flash to the USB
+ * RAM, the console task is not involved.
+ */
+static struct {
+	const uint8_t *ptr;
+	volatile int left;
+} flash_rd;
+
 static void cmd_ep_tx(void)
 {
 	unsigned txlen;
 
+	if (flash_rd.left) {
+		txlen = MIN(flash_rd.left, USB_MAX_PACKET_SIZE);
+		memcpy_to_usbram((void *)usb_sram_addr(ep_buf_tx),
+				 flash_rd.ptr, txlen);
+		flash_rd.ptr += txlen;
+		flash_rd.left -= txlen;
+		btable_ep[USB_EP_COMMAND].tx_addr  = usb_sram_addr(ep_buf_tx);
+		btable_ep[USB_EP_COMMAND].tx_count = txlen;
+		/* a full last packet is followed by a null one */
+		tx_idx = 0;
+		tx_next_buf = txlen == USB_MAX_PACKET_SIZE ?
+			btable_ep[USB_EP_COMMAND].tx_addr + txlen : 0;
+		/* the host is reading : the response is not stale */
+		tx_deadline.val = get_time().val + CMD_STREAM_TIMEOUT_US;
+		STM32_TOGGLE_EP(USB_EP_COMMAND, EP_TX_MASK, EP_TX_VALID, 0);
+		return;
+	}
 	if (!tx_next_buf) { /* we are done, just clear IRQ */
 		STM32_TOGGLE_EP(USB_EP_COMMAND, 0, 0, 0);
+		/* the next queued packet can be answered now */
+		tx_busy = 0;
+		if (cmd_q_head != cmd_q_tail)
+			console_has_input();
+		return;
+	}
+	if (tx_streaming && !tx_idx) {
+		/* full buffer sent : no null packet, the response goes on */
+		tx_streaming = 0;
+		tx_next_buf = 0;
+		STM32_TOGGLE_EP(USB_EP_COMMAND, 0, 0, 0);
+		task_set_event(TASK_ID_CONSOLE, TASK_EVENT_CMD_TX_DONE, 0);
 		return;
 	}
 
@@ -82,12 +197,46 @@ static void cmd_ep_tx(void)
 	STM32_TOGGLE_EP(USB_EP_COMMAND, EP_TX_MASK, EP_TX_VALID, 0);
 }
 
+/* Post the bookmark request 'buf' received at 'ts', returns 0 if it is not */
+static int bin_bookmark(const char *buf, unsigned len, uint32_t ts)
+{
+	const struct inj_bin_req *req = (const struct inj_bin_req *)buf;
+
+	if (len != sizeof(*req) || req->magic != INJ_BIN_MAGIC ||
+	    req->op != INJ_BIN_BOOKMARK)
+		return 0;
+#ifdef HAS_TASK_SNIFFER
+	sniffer_bookmark(ts, req->crc, req->seq);
+#endif
+	return 1;
+}
+
 static void cmd_ep_rx(void)
 {
-	rx_count = btable_ep[USB_EP_COMMAND].rx_count & 0x3ff;
+	uint32_t head = cmd_q_head;
+	unsigned count = MIN(btable_ep[USB_EP_COMMAND].rx_count & 0x3ff,
+			     USB_MAX_PACKET_SIZE);
 
-	/* clear IT without re-enabling RX */
-	STM32_TOGGLE_EP(USB_EP_COMMAND, 0, 0, 0);
+	cmd_q[head % USB_COMMAND_QUEUE].ts = ts_raw();
+	memcpy_from_usbram(cmd_q[head % USB_COMMAND_QUEUE].data,
+			   (void *) usb_sram_addr(ep_buf_rx), count);
+	cmd_q[head % USB_COMMAND_QUEUE].len = count;
+	/*
+	 * A bookmark goes to the capture stream from here, unless packets
+	 * are waiting : it might be the data of a binary write queued.
+	 */
+	if (head == cmd_q_tail && !bin_wr.left &&
+	    bin_bookmark(cmd_q[head % USB_COMMAND_QUEUE].data, count,
+			 cmd_q[head % USB_COMMAND_QUEUE].ts)) {
+		STM32_TOGGLE_EP(USB_EP_COMMAND, EP_RX_MASK, EP_RX_VALID, 0);
+		return;
+	}
+	cmd_q_head = ++head;
+
+	if (head - cmd_q_tail < USB_COMMAND_QUEUE)
+		STM32_TOGGLE_EP(USB_EP_COMMAND, EP_RX_MASK, EP_RX_VALID, 0);
+	else /* queue full : clear IT, the host is NAKed until a slot is free */
+		STM32_TOGGLE_EP(USB_EP_COMMAND, 0, 0, 0);
 
 	/* wake-up the console task */
 	console_has_input();
@@ -98,6 +247,14 @@ static void cmd_ep_event(enum usb_ep_event evt)
 	if (evt != USB_EVENT_RESET)
 		return;
 
+	/* drop any pending binary transfer and the queued commands */
+	bin_wr.left = 0;
+	flash_rd.left = 0;
+	tx_streaming = 0;
+	tx_busy = 0;
+	cmd_q_tail = cmd_q_head;
+	batch_pos = 0;
+
 	btable_ep[USB_EP_COMMAND].tx_addr  = usb_sram_addr(ep_buf_tx);
 	btable_ep[USB_EP_COMMAND].tx_count = 0;
 
@@ -113,34 +270,818 @@ static void cmd_ep_event(enum usb_ep_event evt)
 
 USB_DECLARE_EP(USB_EP_COMMAND, cmd_ep_tx, cmd_ep_rx, cmd_ep_event);
 
+/* FSM word of the last vendor control request */
+static uint32_t ctrl_word;
+static int ctrl_in;
+static usb_uint *ctrl_buf_tx;
+
+/* Execute the control request word, then complete the transfer */
+static void ctrl_exec(void)
+{
+	uint32_t result;
+	int rv = injector_exec(ctrl_word, &result);
+
+	/* EP0 is NAKed in both directions until then */
+	interrupt_disable();
+	if (rv != EC_SUCCESS) {
+		STM32_TOGGLE_EP(0, EP_TX_RX_MASK, EP_RX_VALID | EP_TX_STALL,
+				EP_CTR_RX | EP_CTR_TX);
+	} else {
+		if (ctrl_in)
+			memcpy_to_usbram((void *)usb_sram_addr(ctrl_buf_tx),
+					 &result, sizeof(result));
+		btable_ep[0].tx_count = ctrl_in ? sizeof(result) : 0;
+		STM32_TOGGLE_EP(0, EP_TX_RX_MASK, EP_TX_RX_VALID,
+				EP_STATUS_OUT | EP_CTR_RX | EP_CTR_TX);
+	}
+	interrupt_enable();
+}
+DECLARE_DEFERRED(ctrl_exec);
+
+static int cmd_iface_request(usb_uint *ep0_buf_rx, usb_uint *ep0_buf_tx)
+{
+	struct usb_setup_packet setup;
+
+	if (!ep0_buf_rx)
+		return -1;
+	usb_read_setup_packet(ep0_buf_rx, &setup);
+	if ((setup.bmRequestType & USB_TYPE_MASK) != USB_TYPE_VENDOR ||
+	    setup.bRequest > INJ_CMD_NOP)
+		return -1;
+	ctrl_in = setup.bmRequestType & USB_DIR_IN;
+	if (ctrl_in ? setup.wLength < sizeof(uint32_t) : setup.wLength)
+		return -1;
+
+	ctrl_word = (setup.bRequest << 28) | ((setup.wIndex >> 12) << 24) |
+		    (((setup.wIndex >> 8) & 0xf) << 16) | setup.wValue;
+	ctrl_buf_tx = ep0_buf_tx;
+	/* out of the interrupt : some words read the ADC or send messages */
+	hook_call_deferred(&ctrl_exec_data, 0);
+	return 0;
+}
+USB_DECLARE_IFACE(USB_IFACE_COMMAND, cmd_iface_request);
+
 /* we have space to insert the null terminator */
 BUILD_ASSERT(CONFIG_CONSOLE_INPUT_LINE_SIZE > USB_MAX_PACKET_SIZE);
 
-int console_packet_get_command(char *buf)
+static int __tx_char(void *context, int c);
+
+/* Put the binary response header at the beginning of the reply */
+static void bin_put_resp(const struct inj_bin_req *req, int status,
+			 uint32_t crc, int count)
 {
-	unsigned count = rx_count;
+	struct inj_bin_resp resp = {
+		.magic = INJ_BIN_MAGIC,
+		.op = req->op,
+		.status = status,
+		.idx = req->idx,
+		.count = count,
+		.crc = crc,
+		.seq = req->seq,
+	};
+	const uint8_t *ptr = (const uint8_t *)&resp;
+	int i;
 
-	if (!rx_count)
-		return 0;
+	tx_idx = 0;
+	for (i = 0; i < sizeof(resp); i++)
+		__tx_char(NULL, ptr[i]);
+}
+
+static void bin_respond(const struct inj_bin_req *req, int status,
+			uint32_t crc, const uint32_t *data, int count)
+{
+	const uint8_t *ptr = (const uint8_t *)data;
+	int i;
+
+	bin_put_resp(req, status, crc, count);
+	for (i = 0; i < count * sizeof(uint32_t); i++)
+		__tx_char(NULL, ptr[i]);
+	console_packet_send_response(status);
+}
+
+/*
+ * Respond with the 'count' words of mapped flash at 'words', of any length :
+ * what does not fit in the first packet is streamed by the TX interrupt.
+ */
+static void bin_flash_stream(const struct inj_bin_req *req,
+			     const uint32_t *words, int count)
+{
+	int first = MIN(count * sizeof(uint32_t),
+			USB_MAX_PACKET_SIZE - sizeof(struct inj_bin_resp));
+	uint32_t crc;
+	int i;
+
+	crc32_ctx_init(&crc);
+	for (i = 0; i < count; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	bin_put_resp(req, EC_SUCCESS, crc32_ctx_result(&crc), count);
+	for (i = 0; i < first; i++)
+		__tx_char(NULL, ((const uint8_t *)words)[i]);
+	flash_rd.ptr = (const uint8_t *)words + first;
+	flash_rd.left = count * sizeof(uint32_t) - first;
+	console_packet_send_response(EC_SUCCESS);
+}
+
+/* Read 'count' words of the flash from the word 'idx' */
+static void bin_flash_read(const struct inj_bin_req *req)
+{
+	const char *p;
+
+	if (flash_dataptr(req->idx * sizeof(uint32_t),
+			  req->count * sizeof(uint32_t), 4, &p) < 0) {
+		bin_respond(req, EC_ERROR_OVERFLOW, 0, NULL, 0);
+		return;
+	}
+	bin_flash_stream(req, (const uint32_t *)p, req->count);
+}
+
+/* the CRC of the results is computed on their words */
+BUILD_ASSERT(sizeof(struct inj_result) % sizeof(uint32_t) == 0);
+
+/* Move up to 'count' GET results from the injector ring to the reply */
+static void bin_results(const struct inj_bin_req *req)
+{
+	struct inj_result res;
+	const uint8_t *ptr = (const uint8_t *)&res;
+	int max = (USB_COMMAND_TX_SIZE - sizeof(struct inj_bin_resp)) /
+		  sizeof(res);
+	uint32_t crc, w;
+	unsigned end;
+	int n, i;
+
+	crc32_ctx_init(&crc);
+	tx_idx = sizeof(struct inj_bin_resp);
+	for (n = 0; n < MIN(req->count, max) && injector_result_get(&res);
+	     n++) {
+		for (i = 0; i < sizeof(res); i += sizeof(w)) {
+			memcpy(&w, ptr + i, sizeof(w));
+			crc32_ctx_hash32(&crc, w);
+		}
+		for (i = 0; i < sizeof(res); i++)
+			__tx_char(NULL, ptr[i]);
+	}
+	end = tx_idx;
+	bin_put_resp(req, EC_SUCCESS, crc32_ctx_result(&crc), n);
+	tx_idx = end;
+	console_packet_send_response(EC_SUCCESS);
+}
+
+/*
+ * The RW image is updated from RO : RW would rewrite the RO image, the
+ * bootloader, which is left to DFU.
+ */
+static int bin_update_start(const struct inj_bin_req *req)
+{
+	if (system_get_image_copy() != SYSTEM_IMAGE_RO)
+		return EC_ERROR_ACCESS_DENIED;
+	if (req->idx || !req->count)
+		return EC_ERROR_INVAL;
+	if (req->count * sizeof(uint32_t) > CONFIG_RW_SIZE)
+		return EC_ERROR_OVERFLOW;
+	update.base = CONFIG_RW_MEM_OFF;
+	update.erased = 0;
+	return EC_SUCCESS;
+}
+
+/*
+ * Program 'cnt' words of the image at the word 'idx' : each page is erased
+ * when the stream reaches it, the erased (0xff) words at the ends of the
+ * packet are not programmed, most of the padding of an image.
+ */
+static int bin_update_write(int idx, const uint8_t *data, int cnt)
+{
+	int off = idx * sizeof(uint32_t);
+	int first = 0, last = cnt * sizeof(uint32_t);
+	int rv;
+
+	while (update.erased < off + last) {
+		rv = flash_erase(update.base + update.erased,
+				 CONFIG_FLASH_ERASE_SIZE);
+		if (rv)
+			return rv;
+		update.erased += CONFIG_FLASH_ERASE_SIZE;
+	}
+	while (first < last && data[first] == 0xff)
+		first++;
+	while (last > first && data[last - 1] == 0xff)
+		last--;
+	first &= ~(CONFIG_FLASH_WRITE_SIZE - 1);
+	last = (last + CONFIG_FLASH_WRITE_SIZE - 1) &
+	       ~(CONFIG_FLASH_WRITE_SIZE - 1);
+	if (first == last)
+		return EC_SUCCESS;
+	return flash_write(update.base + off + first, last - first,
+			   (const char *)data + first);
+}
+
+/* CRC-32 of the image as programmed */
+static uint32_t bin_update_crc(int count)
+{
+	const uint32_t *image = (const uint32_t *)
+		(CONFIG_PROGRAM_MEMORY_BASE + update.base);
+	uint32_t crc;
+	int i;
+
+	crc32_ctx_init(&crc);
+	for (i = 0; i < count; i++)
+		crc32_ctx_hash32(&crc, image[i]);
+	return crc32_ctx_result(&crc);
+}
+
+static int bin_decode_start(const struct inj_bin_req *req)
+{
+#ifdef CONFIG_USB_PD_RX_REPLAY
+	char *mem;
+
+	if (!req->idx || req->idx > INJ_DECODE_MAX_SAMPLES ||
+	    req->count != DIV_ROUND_UP(req->idx, sizeof(uint32_t)))
+		return EC_ERROR_INVAL;
+	if (shared_mem_acquire(req->count * sizeof(uint32_t), &mem))
+		return EC_ERROR_BUSY;
+	decode_buf = (uint32_t *)mem;
+	return EC_SUCCESS;
+#else
+	return EC_ERROR_UNIMPLEMENTED;
+#endif
+}
+
+/* Decode the samples received, then respond with the result */
+static void bin_decode(const struct inj_bin_req *req, uint32_t crc)
+{
+#ifdef CONFIG_USB_PD_RX_REPLAY
+	struct inj_decode res;
+	const uint32_t *words = (const uint32_t *)&res;
+	int rv = EC_ERROR_CRC, n = 0, i;
+
+	if (crc == req->crc && decode_buf) {
+		rv = bench_decode((const uint8_t *)decode_buf, req->idx, &res);
+		n = sizeof(res) / sizeof(uint32_t);
+	}
+	if (decode_buf)
+		shared_mem_release(decode_buf);
+	decode_buf = NULL;
+	crc32_ctx_init(&crc);
+	for (i = 0; i < n; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	bin_respond(req, rv, crc32_ctx_result(&crc), words, n);
+#endif
+}
+
+/* Drop the binary write in progress, with no response */
+static void bin_write_abort(void)
+{
+	bin_wr.left = 0;
+	if (decode_buf)
+		shared_mem_release(decode_buf);
+	decode_buf = NULL;
+}
+
+/*
+ * Append the words of a write packet to the FSM buffer (or the replay ring,
+ * or the image updated, or the samples decoded, or nowhere for a sink),
+ * 'full' : they came in a full packet, more may follow
+ */
+static void bin_write_data(const uint8_t *data, int len, int full)
+{
+	uint32_t *buf = injector_buffer();
+	int cnt = MIN(len / sizeof(uint32_t), bin_wr.left);
+	uint32_t crc, w;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		memcpy(&w, data + i * sizeof(uint32_t), sizeof(w));
+		crc32_ctx_hash32(&bin_wr.crc, w);
+	}
+	if (bin_wr.req.op == INJ_BIN_REPLAY)
+		injector_replay_write(bin_wr.next, data, cnt);
+	else if (bin_wr.req.op == INJ_BIN_DECODE)
+		memcpy(decode_buf + bin_wr.next, data, cnt * sizeof(uint32_t));
+	else if (bin_wr.req.op == INJ_BIN_UPDATE && !bin_wr.err)
+		bin_wr.err = bin_update_write(bin_wr.next, data, cnt);
+	else if (bin_wr.req.op != INJ_BIN_UPDATE &&
+		 bin_wr.req.op != INJ_BIN_SINK)
+		memcpy(buf + bin_wr.next, data, cnt * sizeof(uint32_t));
+	bin_wr.next += cnt;
+	bin_wr.left -= cnt;
+
+	if (bin_wr.left && !full) {
+		/* only the last packet can be short : abort the transfer */
+		bin_write_abort();
+		bin_respond(&bin_wr.req, EC_ERROR_PARAM_COUNT, 0, NULL, 0);
+		return;
+	}
+	if (bin_wr.left) { /* wait for the next packet of the transfer */
+		bin_wr.deadline.val = get_time().val + BIN_WR_TIMEOUT_US;
+		hook_call_deferred(&bin_wr_wait_data, BIN_WR_TIMEOUT_US);
+		return;
+	}
+	crc = crc32_ctx_result(&bin_wr.crc);
+	if (bin_wr.req.op == INJ_BIN_DECODE) {
+		bin_decode(&bin_wr.req, crc);
+		return;
+	}
+	if (bin_wr.req.op == INJ_BIN_UPDATE) {
+		/* the flash content is checked, not the words received */
+		if (!bin_wr.err && crc == bin_wr.req.crc)
+			crc = bin_update_crc(bin_wr.req.count);
+		bin_respond(&bin_wr.req, bin_wr.err ? bin_wr.err :
+			    crc == bin_wr.req.crc ? EC_SUCCESS : EC_ERROR_CRC,
+			    crc, NULL, 0);
+		return;
+	}
+	if (bin_wr.req.op == INJ_BIN_REPLAY) {
+		/* the records are played only once they are all valid */
+		if (crc == bin_wr.req.crc)
+			injector_replay_commit(bin_wr.req.count);
+		bin_wr.req.idx = MAX(injector_replay_space(), 0);
+	}
+	bin_respond(&bin_wr.req, crc == bin_wr.req.crc ? EC_SUCCESS :
+		    EC_ERROR_CRC, crc, NULL, 0);
+}
+
+/* Execute the FSM words following the request and return their results */
+static void bin_exec(const struct inj_bin_req *req, const uint8_t *words,
+		     int len)
+{
+	uint32_t res[(USB_MAX_PACKET_SIZE - sizeof(*req)) / sizeof(uint32_t)];
+	uint32_t crc, w;
+	int rv = EC_SUCCESS;
+	int n;
+
+	if (req->count > ARRAY_SIZE(res) ||
+	    len < req->count * sizeof(uint32_t)) {
+		bin_respond(req, EC_ERROR_PARAM_COUNT, 0, NULL, 0);
+		return;
+	}
+	crc32_ctx_init(&crc);
+	for (n = 0; n < req->count; n++) {
+		memcpy(&w, words + n * sizeof(w), sizeof(w));
+		crc32_ctx_hash32(&crc, w);
+	}
+	if (crc32_ctx_result(&crc) != req->crc) {
+		bin_respond(req, EC_ERROR_CRC, 0, NULL, 0);
+		return;
+	}
+
+	/* stop at the first failing word : 'count' tells how far we went */
+	crc32_ctx_init(&crc);
+	for (n = 0; n < req->count && rv == EC_SUCCESS; n++) {
+		memcpy(&w, words + n * sizeof(w), sizeof(w));
+		rv = injector_exec(w, res + n);
+		crc32_ctx_hash32(&crc, res[n]);
+	}
+	bin_respond(req, rv, crc32_ctx_result(&crc), res, n);
+}
+
+#ifdef HAS_TASK_SNIFFER
+/* Read 'count' words of the capture log from the word 'idx' */
+static void bin_log_read(const struct inj_bin_req *req)
+{
+	const uint32_t *words;
+	int rv;
+
+	rv = caplog_read(req->idx, req->count, &words);
+	if (rv != EC_SUCCESS) {
+		bin_respond(req, rv, 0, NULL, 0);
+		return;
+	}
+	bin_flash_stream(req, words, req->count);
+}
+
+/* Return the session summary */
+static void bin_session(const struct inj_bin_req *req)
+{
+	struct inj_session session;
+	const uint32_t *words = (const uint32_t *)&session;
+	int n = sizeof(session) / sizeof(uint32_t);
+	uint32_t crc;
+	int i;
+
+	session_get(&session);
+	crc32_ctx_init(&crc);
+	for (i = 0; i < n; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	bin_respond(req, EC_SUCCESS, crc32_ctx_result(&crc), words, n);
+}
+BUILD_ASSERT(sizeof(struct inj_session) % sizeof(uint32_t) == 0);
+BUILD_ASSERT(sizeof(struct inj_bin_resp) + sizeof(struct inj_session) <=
+	     USB_COMMAND_TX_SIZE);
+
+/* Return the traffic counters */
+static void bin_stats(const struct inj_bin_req *req)
+{
+	struct inj_stats stats;
+	const uint32_t *words = (const uint32_t *)&stats;
+	int n = sizeof(stats) / sizeof(uint32_t);
+	uint32_t crc;
+	int i;
 
-	memcpy_from_usbram(buf, (void *) usb_sram_addr(ep_buf_rx), count);
+	stats_get(&stats);
+	crc32_ctx_init(&crc);
+	for (i = 0; i < n; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	bin_respond(req, EC_SUCCESS, crc32_ctx_result(&crc), words, n);
+}
+BUILD_ASSERT(sizeof(struct inj_stats) % sizeof(uint32_t) == 0);
+BUILD_ASSERT(sizeof(struct inj_bin_resp) + sizeof(struct inj_stats) <=
+	     USB_COMMAND_TX_SIZE);
+
+/* Return up to 'count' words of flight recorder records from the 'idx' one */
+static void bin_flight(const struct inj_bin_req *req)
+{
+	struct inj_flight_rec recs[(USB_COMMAND_TX_SIZE -
+				    sizeof(struct inj_bin_resp)) /
+				   sizeof(struct inj_flight_rec)];
+	const uint32_t *words = (const uint32_t *)recs;
+	struct inj_bin_req resp = *req;
+	int max = MIN(req->count * sizeof(uint32_t) / sizeof(recs[0]),
+		      ARRAY_SIZE(recs));
+	int n, held;
+	uint32_t crc;
+	int i;
+
+	n = flight_read(req->idx, max, recs, &held);
+	n *= sizeof(recs[0]) / sizeof(uint32_t);
+	crc32_ctx_init(&crc);
+	for (i = 0; i < n; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	resp.idx = held;
+	bin_respond(&resp, EC_SUCCESS, crc32_ctx_result(&crc), words, n);
+}
+BUILD_ASSERT(sizeof(struct inj_flight_rec) % sizeof(uint32_t) == 0);
+#endif
+
+#ifdef CONFIG_TRACEPOINTS
+/* Return up to 'count' words of tracepoint records from the 'idx' one */
+static void bin_tracepoints(const struct inj_bin_req *req)
+{
+	struct tracepoint_rec recs[(USB_COMMAND_TX_SIZE -
+				    sizeof(struct inj_bin_resp)) /
+				   sizeof(struct tracepoint_rec)];
+	const uint32_t *words = (const uint32_t *)recs;
+	struct inj_bin_req resp = *req;
+	int max = MIN(req->count * sizeof(uint32_t) / sizeof(recs[0]),
+		      ARRAY_SIZE(recs));
+	int n, held;
+	uint32_t crc;
+	int i;
+
+	n = tracepoint_read(req->idx, max, recs, &held);
+	n *= sizeof(recs[0]) / sizeof(uint32_t);
+	crc32_ctx_init(&crc);
+	for (i = 0; i < n; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	resp.idx = held;
+	bin_respond(&resp, EC_SUCCESS, crc32_ctx_result(&crc), words, n);
+}
+#endif
+
+#ifdef CONFIG_TOKEN_LOG
+/* Drain up to 'count' words of token log records */
+static void bin_token_log(const struct inj_bin_req *req)
+{
+	uint32_t words[(USB_COMMAND_TX_SIZE - sizeof(struct inj_bin_resp)) /
+		       sizeof(uint32_t)];
+	int n = token_log_read(words, MIN(req->count, ARRAY_SIZE(words)));
+	uint32_t crc;
+	int i;
+
+	crc32_ctx_init(&crc);
+	for (i = 0; i < n; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	bin_respond(req, EC_SUCCESS, crc32_ctx_result(&crc), words, n);
+}
+#endif
+
+/* Send back the words following the request */
+static void bin_echo(const struct inj_bin_req *req, const uint8_t *words,
+		     int len)
+{
+	uint32_t data[(USB_MAX_PACKET_SIZE - sizeof(*req)) / sizeof(uint32_t)];
+	uint32_t crc;
+	int i;
+
+	if (req->count > ARRAY_SIZE(data) ||
+	    len < req->count * sizeof(uint32_t)) {
+		bin_respond(req, EC_ERROR_PARAM_COUNT, 0, NULL, 0);
+		return;
+	}
+	memcpy(data, words, req->count * sizeof(uint32_t));
+	crc32_ctx_init(&crc);
+	for (i = 0; i < req->count; i++)
+		crc32_ctx_hash32(&crc, data[i]);
+	bin_respond(req, EC_SUCCESS, crc32_ctx_result(&crc), data, req->count);
+}
+
+static void bin_bench(const struct inj_bin_req *req)
+{
+	struct inj_bench res[INJ_BENCH_COUNT];
+	const uint32_t *words = (const uint32_t *)res;
+	int runs = req->count ? req->count : INJ_BENCH_RUNS;
+	int rv = EC_SUCCESS, n = 1;
+	uint32_t crc;
+	int i;
+
+	if (req->idx == INJ_BENCH_ALL) {
+		/* the benchmarks which cannot run report 0 runs */
+		for (i = 0; i < INJ_BENCH_COUNT; i++)
+			bench_run(i, runs, res + i);
+		n = INJ_BENCH_COUNT;
+	} else {
+		rv = bench_run(req->idx, runs, res);
+	}
+	n *= sizeof(res[0]) / sizeof(uint32_t);
+	crc32_ctx_init(&crc);
+	for (i = 0; i < n; i++)
+		crc32_ctx_hash32(&crc, words[i]);
+	bin_respond(req, rv, crc32_ctx_result(&crc), words, n);
+}
+
+/* Process a binary request 'buf' of 'len' bytes */
+static void bin_command(const uint8_t *buf, int len)
+{
+	struct inj_bin_req req;
+	uint32_t crc;
+	int i, space;
+
+	if (bin_wr.left) {
+		bin_write_data(buf, len, len == USB_MAX_PACKET_SIZE);
+		return;
+	}
+
+	memset(&req, 0, sizeof(req));
+	memcpy(&req, buf, MIN(len, sizeof(req)));
+	if (len < sizeof(req)) {
+		bin_respond(&req, EC_ERROR_PARAM_COUNT, 0, NULL, 0);
+		return;
+	}
+	if (req.op == INJ_BIN_RESULTS) {
+		bin_results(&req);
+		return;
+	}
+	if (req.op == INJ_BIN_EXEC) {
+		bin_exec(&req, buf + sizeof(req), len - sizeof(req));
+		return;
+	}
+	if (req.op == INJ_BIN_BENCH) {
+		bin_bench(&req);
+		return;
+	}
+	if (req.op == INJ_BIN_ECHO) {
+		bin_echo(&req, buf + sizeof(req), len - sizeof(req));
+		return;
+	}
+#ifdef HAS_TASK_SNIFFER
+	if (req.op == INJ_BIN_LOG_READ) {
+		bin_log_read(&req);
+		return;
+	}
+	if (req.op == INJ_BIN_SESSION) {
+		bin_session(&req);
+		return;
+	}
+	if (req.op == INJ_BIN_STATS) {
+		bin_stats(&req);
+		return;
+	}
+	if (req.op == INJ_BIN_FLIGHT) {
+		bin_flight(&req);
+		return;
+	}
+#endif
+	if (req.op == INJ_BIN_TRACEPOINTS) {
+#ifdef CONFIG_TRACEPOINTS
+		bin_tracepoints(&req);
+#else
+		bin_respond(&req, EC_ERROR_UNIMPLEMENTED, 0, NULL, 0);
+#endif
+		return;
+	}
+	if (req.op == INJ_BIN_TOKEN_LOG) {
+#ifdef CONFIG_TOKEN_LOG
+		bin_token_log(&req);
+#else
+		bin_respond(&req, EC_ERROR_UNIMPLEMENTED, 0, NULL, 0);
+#endif
+		return;
+	}
+	if (req.op == INJ_BIN_FLASH_READ) {
+		bin_flash_read(&req);
+		return;
+	}
+	if (req.op == INJ_BIN_UPDATE || req.op == INJ_BIN_DECODE ||
+	    req.op == INJ_BIN_SINK) {
+		i = req.op == INJ_BIN_UPDATE ? bin_update_start(&req) :
+		    req.op == INJ_BIN_DECODE ? bin_decode_start(&req) :
+					       EC_SUCCESS;
+		if (i) {
+			bin_respond(&req, i, 0, NULL, 0);
+			return;
+		}
+		bin_wr.req = req;
+		bin_wr.next = 0;
+		bin_wr.left = req.count;
+		bin_wr.err = EC_SUCCESS;
+		crc32_ctx_init(&bin_wr.crc);
+		bin_write_data(buf + sizeof(req), len - sizeof(req),
+			       len == USB_MAX_PACKET_SIZE);
+		return;
+	}
+	if (req.idx + req.count > injector_buffer_size()) {
+		bin_respond(&req, EC_ERROR_OVERFLOW, 0, NULL, 0);
+		return;
+	}
+
+	switch (req.op) {
+	case INJ_BIN_REPLAY:
+		space = injector_replay_space();
+		if (space < 0 || req.idx) {
+			bin_respond(&req, EC_ERROR_INVAL, 0, NULL, 0);
+			break;
+		}
+		if (space < req.count) {
+			/* back-pressure : the host retries later */
+			req.idx = space;
+			bin_respond(&req, EC_ERROR_BUSY, 0, NULL, 0);
+			break;
+		}
+		/* fall through */
+	case INJ_BIN_WRITE:
+		bin_wr.req = req;
+		bin_wr.next = req.idx;
+		bin_wr.left = req.count;
+		bin_wr.err = EC_SUCCESS;
+		crc32_ctx_init(&bin_wr.crc);
+		bin_write_data(buf + sizeof(req), len - sizeof(req),
+			       len == USB_MAX_PACKET_SIZE);
+		break;
+	case INJ_BIN_READ:
+		if (sizeof(struct inj_bin_resp) + req.count * sizeof(uint32_t)
+		    > USB_COMMAND_TX_SIZE) {
+			bin_respond(&req, EC_ERROR_OVERFLOW, 0, NULL, 0);
+			break;
+		}
+		crc32_ctx_init(&crc);
+		for (i = 0; i < req.count; i++)
+			crc32_ctx_hash32(&crc, injector_buffer()[req.idx + i]);
+		bin_respond(&req, EC_SUCCESS, crc32_ctx_result(&crc),
+			    injector_buffer() + req.idx, req.count);
+		break;
+	default:
+		bin_respond(&req, EC_ERROR_INVAL, 0, NULL, 0);
+	}
+}
+
+/* Wake-up the console task once the response read timeout expires */
+static void cmd_tx_wait(void)
+{
+	console_has_input();
+}
+DECLARE_DEFERRED(cmd_tx_wait);
+
+/* Free the slot at the tail of the queue */
+static void cmd_q_release(void)
+{
+	interrupt_disable();
+	if (cmd_q_head - cmd_q_tail == USB_COMMAND_QUEUE)
+		STM32_TOGGLE_EP(USB_EP_COMMAND, EP_RX_MASK, EP_RX_VALID, 0);
+	cmd_q_tail++;
+	interrupt_enable();
+}
+
+/* Copy the command at 'batch_pos' of the tail packet, return its length */
+static int cmd_q_next_line(char *buf)
+{
+	const char *pkt = cmd_q[cmd_q_tail % USB_COMMAND_QUEUE].data;
+	unsigned len = cmd_q[cmd_q_tail % USB_COMMAND_QUEUE].len;
+	const char *line = pkt + batch_pos;
+	const char *end = pkt + len;
+	const char *nl;
+	char *sp;
+	int count;
+
+	while (line < end && (*line == '\n' || *line == '\r'))
+		line++;
+	nl = memchr(line, '\n', end - line);
+	count = (nl ? nl : end) - line;
+	memcpy(buf, line, count);
 	/* force a null termination */
 	buf[count] = 0;
-	rx_count = 0;
-	tx_idx = 0;
-	btable_ep[USB_EP_COMMAND].tx_count = 0;
-	tx_next_buf = 0;
-	processing = 1;
 
+	/* more commands after this one ? */
+	for (line += count; line < end; line++)
+		if (*line != '\n' && *line != '\r')
+			break;
+	if (line < end) {
+		batch_pos = line - pkt;
+	} else {
+		batch_pos = 0;
+		cmd_q_release();
+	}
+
+	cmd_tag[0] = 0;
+	if (buf[0] == '@') {
+		sp = memchr(buf, ' ', count);
+		len = MIN((sp ? sp : buf + count) - buf - 1, CMD_TAG_LEN);
+		memcpy(cmd_tag, buf + 1, len);
+		cmd_tag[len] = 0;
+		/* a tag alone is a fence : an empty command */
+		count = sp ? buf + count - (sp + 1) : 0;
+		memmove(buf, sp ? sp + 1 : buf + count, count);
+		buf[count] = 0;
+	}
 	return count;
 }
 
+int console_packet_get_command(char *buf)
+{
+	unsigned count;
+	int delay;
+
+	/* the host stopped sending the binary write : the next is a request */
+	if (bin_wr.left && timestamp_expired(bin_wr.deadline, NULL))
+		bin_write_abort();
+
+	/* the previous response must be read before writing the next one */
+	if (tx_busy) {
+		delay = tx_deadline.val - get_time().val;
+		if (delay > 0) {
+			hook_call_deferred(&cmd_tx_wait_data, delay);
+			return 0;
+		}
+		/* the host is not reading : drop the pending response */
+		interrupt_disable();
+		tx_next_buf = 0;
+		flash_rd.left = 0;
+		tx_busy = 0;
+		STM32_TOGGLE_EP(USB_EP_COMMAND, EP_TX_MASK, EP_TX_NAK, 0);
+		interrupt_enable();
+	}
+
+	if (!batch_pos) {
+		if (cmd_q_head == cmd_q_tail)
+			return 0;
+		/* a new packet : a new response */
+		tx_idx = 0;
+		tx_dropping = 0;
+		btable_ep[USB_EP_COMMAND].tx_count = 0;
+		tx_next_buf = 0;
+
+		/* binary transfer : answered here, nothing for the console */
+		count = cmd_q[cmd_q_tail % USB_COMMAND_QUEUE].len;
+		if (!bin_wr.left &&
+		    bin_bookmark(cmd_q[cmd_q_tail % USB_COMMAND_QUEUE].data,
+				 count, cmd_q[cmd_q_tail % USB_COMMAND_QUEUE].ts)) {
+			cmd_q_release();
+			goto next;
+		}
+		if (bin_wr.left || (count && (uint8_t)cmd_q[cmd_q_tail %
+				USB_COMMAND_QUEUE].data[0] == INJ_BIN_MAGIC)) {
+			memcpy(buf, cmd_q[cmd_q_tail % USB_COMMAND_QUEUE].data,
+			       count);
+			cmd_q_release();
+			bin_command((uint8_t *)buf, count);
+			goto next;
+		}
+	}
+
+	count = cmd_q_next_line(buf);
+	if (!count && !cmd_tag[0]) {
+		/* nothing to run, no response */
+		batch_pos = 0;
+		goto next;
+	}
+	processing = 1;
+
+	return count ? count : 1;
+next:
+	/* no response armed : go on with the queued packets */
+	if (!tx_busy && cmd_q_head != cmd_q_tail)
+		console_has_input();
+	return 0;
+}
+
 
 void console_packet_send_response(int rv)
 {
-	unsigned txlen = MIN(tx_idx, USB_MAX_PACKET_SIZE);
+	unsigned txlen;
+	char status[CMD_TAG_LEN + 16];
+	char *c;
 
+	if (cmd_tag[0] && processing) {
+		snprintf(status, sizeof(status), "@%s %d\n", cmd_tag, rv);
+		for (c = status; *c; c++)
+			__tx_char(NULL, *c);
+		cmd_tag[0] = 0;
+	}
 	processing = 0;
+	if (batch_pos) {
+		/* the next command of the packet adds to the response */
+		console_has_input();
+		return;
+	}
+
+	txlen = MIN(tx_idx, USB_MAX_PACKET_SIZE);
 	btable_ep[USB_EP_COMMAND].tx_addr  = usb_sram_addr(ep_buf_tx);
 	btable_ep[USB_EP_COMMAND].tx_count = txlen;
 	tx_idx -= txlen;
@@ -149,13 +1090,52 @@ void console_packet_send_response(int rv)
 				USB_MAX_PACKET_SIZE;
 	else
 		tx_next_buf = 0;
-	/* ready to answer and re-enable reception */
-	STM32_TOGGLE_EP(USB_EP_COMMAND, EP_TX_RX_MASK, EP_TX_RX_VALID, 0);
+	tx_deadline.val = get_time().val + CMD_STREAM_TIMEOUT_US;
+	tx_busy = 1;
+	/* ready to answer, reception is driven by the queue */
+	STM32_TOGGLE_EP(USB_EP_COMMAND, EP_TX_MASK, EP_TX_VALID, 0);
+}
+
+/* Send the full TX buffer while the command is still running */
+static int tx_stream_flush(void)
+{
+	uint32_t evt;
+
+	tx_streaming = 1;
+	btable_ep[USB_EP_COMMAND].tx_addr  = usb_sram_addr(ep_buf_tx);
+	btable_ep[USB_EP_COMMAND].tx_count = USB_MAX_PACKET_SIZE;
+	tx_idx -= USB_MAX_PACKET_SIZE;
+	tx_next_buf = btable_ep[USB_EP_COMMAND].tx_addr + USB_MAX_PACKET_SIZE;
+	STM32_TOGGLE_EP(USB_EP_COMMAND, EP_TX_MASK, EP_TX_VALID, 0);
+
+	evt = task_wait_event_mask(TASK_EVENT_CMD_TX_DONE,
+				   CMD_STREAM_TIMEOUT_US);
+	if (!(evt & TASK_EVENT_CMD_TX_DONE)) {
+		/* stop the chaining after the packet in flight */
+		interrupt_disable();
+		tx_streaming = 0;
+		tx_next_buf = 0;
+		interrupt_enable();
+		/* the buffer was streamed already : not part of the response */
+		tx_idx = 0;
+		tx_dropping = 1;
+		return EC_ERROR_TIMEOUT;
+	}
+	tx_idx = 0;
+	return EC_SUCCESS;
 }
 
 static int __tx_char(void *context, int c)
 {
-	if (tx_idx >= USB_COMMAND_TX_SIZE)
+	if (tx_dropping)
+		return 1;
+	/*
+	 * Buffer full : stream it to the host if we are running the command
+	 * in the console task, else truncate the response.
+	 */
+	if (tx_idx >= USB_COMMAND_TX_SIZE &&
+	    (!processing || task_get_current() != TASK_ID_CONSOLE ||
+	     tx_stream_flush()))
 		return 1;
 	if (!(tx_idx & 1))
 		ep_buf_tx[tx_idx/2] = c;
@@ -166,6 +1146,27 @@ static int __tx_char(void *context, int c)
 	return 0;
 }
 
+static int __tx_str(void *context, const char *str, int len)
+{
+	while (len) {
+		int n = MIN(len, USB_COMMAND_TX_SIZE - tx_idx) & ~1;
+
+		/* pack the character pairs straight into the USB RAM words */
+		if (tx_dropping || (tx_idx & 1) || !n) {
+			if (__tx_char(context, *str++))
+				return 1;
+			len--;
+			continue;
+		}
+		len -= n;
+		for (; n; n -= 2, str += 2, tx_idx += 2)
+			ep_buf_tx[tx_idx/2] = (uint8_t)str[0] |
+					      ((uint8_t)str[1] << 8);
+	}
+
+	return 0;
+}
+
 static int in_command(enum console_channel channel)
 {
 	return (channel == CC_COMMAND) && processing;
@@ -177,13 +1178,11 @@ int console_packet_puts(enum console_channel channel, const char *outstr)
 		return EC_ERROR_UNIMPLEMENTED; /* Fallback */
 
 	/* Put all characters in the output buffer */
-	while (*outstr) {
-		if (__tx_char(NULL, *outstr++) != 0)
-			break;
-	}
+	if (__tx_str(NULL, outstr, strlen(outstr)))
+		return EC_ERROR_OVERFLOW;
 
 	/* Successful if we consumed all output */
-	return *outstr ? EC_ERROR_OVERFLOW : EC_SUCCESS;
+	return EC_SUCCESS;
 }
 
 int console_packet_vprintf(enum console_channel channel, const char *format,
@@ -192,5 +1191,40 @@ int console_packet_vprintf(enum console_channel channel, const char *format,
 	if (!in_command(channel))
 		return EC_ERROR_UNIMPLEMENTED; /* Fallback */
 
-	return vfnprintf(__tx_char, NULL, format, args);
+	return vfnprintf_span(__tx_str, NULL, format, args);
+}
+
+#ifdef CONFIG_USB_PD_LOGGING
+/*
+ * Move the PD log entries into the response of the USB command as binary
+ * struct ec_response_pd_log (followed by their payload) until it is full
+ * or the log is empty : the host polls it to get a continuous feed.
+ * On the serial console, the entries are printed as text.
+ */
+static int command_pdlog(int argc, char **argv)
+{
+	/* largest entry : header and 31 bytes of payload */
+	struct ec_response_pd_log r[5];
+	int len, i;
+
+	while (!processing ||
+	       USB_COMMAND_TX_SIZE - tx_idx >= sizeof(r)) {
+		len = pd_log_dequeue(r);
+		if (r->type == PD_EVENT_NO_ENTRY)
+			break;
+		if (!processing) {
+			ccprintf("-%d ms type %02x port %d data %04x\n",
+				 r->timestamp, r->type,
+				 PD_LOG_PORT(r->size_port), r->data);
+			continue;
+		}
+		for (i = 0; i < len; i++)
+			__tx_char(NULL, ((uint8_t *)r)[i]);
+	}
+
+	return EC_SUCCESS;
 }
+DECLARE_CONSOLE_COMMAND(pdlog, command_pdlog,
+			NULL,
+			"Dump the PD events log");
+#endif /* CONFIG_USB_PD_LOGGING */
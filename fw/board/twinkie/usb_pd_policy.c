@@ -3,6 +3,8 @@
  * found in the LICENSE file.
  */
 
+#include "adc.h"
+#include "adc_chip.h"
 #include "common.h"
 #include "config.h"
 #include "console.h"
@@ -42,6 +44,9 @@ void pd_set_input_current_limit(int port, uint32_t max_ma,
 	gpio_set_level(GPIO_LED_R_L, !red);
 	gpio_set_level(GPIO_LED_G_L, !green);
 	gpio_set_level(GPIO_LED_B_L, !blue);
+#ifdef HAS_TASK_PD_C0
+	pdsweep_contract(supply_voltage);
+#endif
 }
 
 int pd_is_valid_input_voltage(int mv)
@@ -74,6 +79,46 @@ int pd_board_checks(void)
 	return EC_SUCCESS;
 }
 
+#ifdef CONFIG_USB_PD_CC_WATCHDOG
+/* CC watch state : off, armed, or fired and waiting to be armed again */
+static enum {
+	CC_WATCH_OFF,
+	CC_WATCH_ARMED,
+	CC_WATCH_FIRED,
+} cc_watch;
+
+static void cc_watch_fired(void)
+{
+	cc_watch = CC_WATCH_FIRED;
+	task_wake(PD_PORT_TO_TASK_ID(0));
+}
+
+int board_cc_watch(int port, int enable)
+{
+	/* a pull-up above the sink open voltage on either line */
+	const int high = PD_SNK_VA_MV * 4096 / 3300;
+	uint32_t mask = (1 << adc_channels[ADC_CH_CC1_PD].channel) |
+			(1 << adc_channels[ADC_CH_CC2_PD].channel);
+
+	if (enable && cc_watch == CC_WATCH_ARMED)
+		return EC_SUCCESS;
+	/* the conversions keep running after the watchdog fired */
+	if (cc_watch != CC_WATCH_OFF) {
+		cc_watch = CC_WATCH_OFF;
+		adc_disable_watchdog();
+	}
+	if (!enable)
+		return EC_SUCCESS;
+
+	cc_watch = CC_WATCH_ARMED;
+	if (adc_enable_watchdog_mask(mask, high, 0, cc_watch_fired)) {
+		cc_watch = CC_WATCH_OFF;
+		return EC_ERROR_UNKNOWN;
+	}
+	return EC_SUCCESS;
+}
+#endif
+
 int pd_check_power_swap(int port)
 {
 	/* Always refuse power swap */
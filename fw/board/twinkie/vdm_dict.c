@@ -0,0 +1,90 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Field dictionaries of the structured VDM objects (vdm_dict.h)
+ */
+
+#include "common.h"
+#include "usb_pd.h"
+#include "util.h"
+#include "vdm_dict.h"
+
+#define VDM_DICT(svid, cmd, sop, first, last, fields) \
+	{ svid, cmd, sop, first, last, ARRAY_SIZE(fields), fields }
+
+/* Discover Identity : ID Header, Cert Stat and Product VDOs */
+static const struct vdo_field vdo_id_header[] = {
+	{31, 1, "host"}, {30, 1, "dev"}, {27, 3, "ufp"}, {26, 1, "modal"},
+	{23, 3, "dfp"}, {0, 16, "vid"},
+};
+static const struct vdo_field vdo_cert_stat[] = {
+	{0, 32, "xid"},
+};
+static const struct vdo_field vdo_product[] = {
+	{16, 16, "pid"}, {0, 16, "bcd"},
+};
+/* Discover SVIDs : 2 SVIDs per VDO */
+static const struct vdo_field vdo_svids[] = {
+	{16, 16, "svid"}, {0, 16, "svid"},
+};
+
+/* DisplayPort Capabilities, Status and Configurations */
+static const struct vdo_field vdo_dp_caps[] = {
+	{0, 2, "port"}, {2, 4, "sig"}, {6, 1, "rcpt"}, {7, 1, "nousb2"},
+	{8, 8, "dfp_pins"}, {16, 8, "ufp_pins"},
+};
+static const struct vdo_field vdo_dp_status[] = {
+	{0, 2, "conn"}, {2, 1, "lowpwr"}, {3, 1, "en"}, {4, 1, "mf"},
+	{5, 1, "usb"}, {6, 1, "exit"}, {7, 1, "hpd"}, {8, 1, "irq"},
+};
+static const struct vdo_field vdo_dp_config[] = {
+	{0, 2, "cfg"}, {2, 4, "sig"}, {8, 8, "pins"},
+};
+
+/* Thunderbolt 3 Discover Mode, device and cable */
+static const struct vdo_field vdo_tbt_dev[] = {
+	{0, 16, "mode"}, {16, 1, "tbt3"}, {26, 1, "intel_b0"},
+	{30, 1, "vs_b0"}, {31, 1, "vs_b1"},
+};
+static const struct vdo_field vdo_tbt_cable[] = {
+	{0, 16, "mode"}, {16, 3, "speed"}, {19, 2, "rounded"},
+	{21, 1, "optical"}, {22, 1, "retimer"}, {23, 1, "lsrx"},
+	{25, 1, "active"},
+};
+
+static const struct vdm_dict vdm_dicts[] = {
+	VDM_DICT(USB_SID_PD, CMD_DISCOVER_IDENT, VDM_DICT_ANY_SOP, 1, 1,
+		 vdo_id_header),
+	VDM_DICT(USB_SID_PD, CMD_DISCOVER_IDENT, VDM_DICT_ANY_SOP, 2, 2,
+		 vdo_cert_stat),
+	VDM_DICT(USB_SID_PD, CMD_DISCOVER_IDENT, VDM_DICT_ANY_SOP, 3, 3,
+		 vdo_product),
+	VDM_DICT(USB_SID_PD, CMD_DISCOVER_SVID, VDM_DICT_ANY_SOP, 1, 6,
+		 vdo_svids),
+	VDM_DICT(USB_SID_DISPLAYPORT, CMD_DISCOVER_MODES, VDM_DICT_ANY_SOP,
+		 1, 6, vdo_dp_caps),
+	VDM_DICT(USB_SID_DISPLAYPORT, CMD_ATTENTION, VDM_DICT_SOP, 1, 1,
+		 vdo_dp_status),
+	VDM_DICT(USB_SID_DISPLAYPORT, CMD_DP_STATUS, VDM_DICT_SOP, 1, 1,
+		 vdo_dp_status),
+	VDM_DICT(USB_SID_DISPLAYPORT, CMD_DP_CONFIG, VDM_DICT_SOP, 1, 1,
+		 vdo_dp_config),
+	VDM_DICT(USB_VID_INTEL, CMD_DISCOVER_MODES, VDM_DICT_SOP, 1, 6,
+		 vdo_tbt_dev),
+	VDM_DICT(USB_VID_INTEL, CMD_DISCOVER_MODES, VDM_DICT_SOP_PRIME, 1, 6,
+		 vdo_tbt_cable),
+};
+
+const struct vdm_dict *vdm_dict_find(int sop, uint32_t head, int idx)
+{
+	const struct vdm_dict *d;
+
+	for (d = vdm_dicts; d < vdm_dicts + ARRAY_SIZE(vdm_dicts); d++)
+		if (d->svid == PD_VDO_VID(head) &&
+		    d->cmd == PD_VDO_CMD(head) &&
+		    (d->sop_mask & (1 << sop)) &&
+		    idx >= d->first && idx <= d->last)
+			return d;
+	return NULL;
+}
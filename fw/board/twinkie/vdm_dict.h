@@ -0,0 +1,46 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef __CROS_EC_VDM_DICT_H
+#define __CROS_EC_VDM_DICT_H
+
+/*
+ * Field dictionaries of the structured VDM objects, keyed on the SVID and
+ * the command of the VDM header : the tracer prints the VDOs they match as
+ * their named fields. The tables are in vdm_dict.c.
+ *
+ * A dictionary applies to the VDOs [first, last] following the VDM header
+ * (index 1 is the first VDO), sent on one of the SOP* in 'sop_mask'.
+ * The 1-bit fields are named only when set. The VDOs of the SVIDs with no
+ * dictionary stay raw hex.
+ */
+
+struct vdo_field {
+	uint8_t shift;
+	uint8_t width;
+	const char *name;
+};
+
+struct vdm_dict {
+	uint16_t svid;
+	uint8_t cmd;       /* CMD_x of the VDM header */
+	uint8_t sop_mask;  /* 1 << SOP type */
+	uint8_t first;
+	uint8_t last;
+	uint8_t count;
+	const struct vdo_field *fields;
+};
+
+#define VDM_DICT_SOP       (1 << 0)
+#define VDM_DICT_SOP_PRIME (1 << 1)
+#define VDM_DICT_ANY_SOP   0x7
+
+/*
+ * Dictionary of the VDO 'idx' (1 : first VDO) of the structured VDM of header
+ * 'head' sent on the SOP type 'sop', NULL if there is none.
+ */
+const struct vdm_dict *vdm_dict_find(int sop, uint32_t head, int idx);
+
+#endif /* __CROS_EC_VDM_DICT_H */
@@ -69,23 +69,30 @@ static const struct adc_profile_t profile = {
 };
 #endif
 
-static void adc_configure(int ain_id)
+static void adc_configure_mask(uint32_t ain_mask)
 {
-	/* Select channel to convert */
-	STM32_ADC_CHSELR = 1 << ain_id;
+	/* Select channels to convert */
+	STM32_ADC_CHSELR = ain_mask;
 
 	/* Disable DMA */
 	STM32_ADC_CFGR1 &= ~STM32_ADC_CFGR1_DMAEN;
 }
 
+static void adc_configure(int ain_id)
+{
+	adc_configure_mask(1 << ain_id);
+}
+
 #ifdef CONFIG_ADC_WATCHDOG
 
-static int watchdog_ain_id;
+/* Channels watched : a single one, or a sequence for the mask watchdog */
+static uint32_t watchdog_ain_mask;
 static int watchdog_delay_ms;
+static void (*watchdog_fired)(void);
 
-static void adc_continuous_read(int ain_id)
+static void adc_continuous_read(uint32_t ain_mask)
 {
-	adc_configure(ain_id);
+	adc_configure_mask(ain_mask);
 
 	/* CONT=1 -> continuous mode on */
 	STM32_ADC_CFGR1 |= STM32_ADC_CFGR1_CONT;
@@ -107,9 +114,9 @@ static void adc_continuous_stop(void)
 	STM32_ADC_CFGR1 &= ~STM32_ADC_CFGR1_CONT;
 }
 
-static void adc_interval_read(int ain_id, int interval_ms)
+static void adc_interval_read(uint32_t ain_mask, int interval_ms)
 {
-	adc_configure(ain_id);
+	adc_configure_mask(ain_mask);
 
 	/* EXTEN=01 -> hardware trigger detection on rising edge */
 	STM32_ADC_CFGR1 = (STM32_ADC_CFGR1 & ~STM32_ADC_CFGR1_EXTEN_MASK)
@@ -164,33 +171,46 @@ static int adc_watchdog_enabled(void)
 
 static int adc_enable_watchdog_no_lock(void)
 {
-	/* Select channel */
-	STM32_ADC_CFGR1 = (STM32_ADC_CFGR1 & ~STM32_ADC_CFGR1_AWDCH_MASK) |
-			  (watchdog_ain_id << 26);
-	adc_configure(watchdog_ain_id);
+	if (watchdog_ain_mask & (watchdog_ain_mask - 1)) {
+		/* Watch all the channels of the sequence */
+		STM32_ADC_CFGR1 &= ~(STM32_ADC_CFGR1_AWDCH_MASK |
+				     STM32_ADC_CFGR1_AWDSGL);
+	} else {
+		/* Select channel */
+		STM32_ADC_CFGR1 = (STM32_ADC_CFGR1 &
+				   ~STM32_ADC_CFGR1_AWDCH_MASK) |
+				  (__builtin_ctz(watchdog_ain_mask) << 26) |
+				  STM32_ADC_CFGR1_AWDSGL;
+	}
+	adc_configure_mask(watchdog_ain_mask);
 
 	/* Clear AWD interrupt flag */
 	STM32_ADC_ISR = 0x80;
-	/* Set Watchdog enable bit on a single channel */
-	STM32_ADC_CFGR1 |= STM32_ADC_CFGR1_AWDEN | STM32_ADC_CFGR1_AWDSGL;
+	/* Set Watchdog enable bit */
+	STM32_ADC_CFGR1 |= STM32_ADC_CFGR1_AWDEN;
 	/* Enable interrupt */
 	STM32_ADC_IER |= STM32_ADC_IER_AWDIE;
 
 	if (watchdog_delay_ms)
-		adc_interval_read(watchdog_ain_id, watchdog_delay_ms);
+		adc_interval_read(watchdog_ain_mask, watchdog_delay_ms);
 	else
-		adc_continuous_read(watchdog_ain_id);
+		adc_continuous_read(watchdog_ain_mask);
 
 	return EC_SUCCESS;
 }
 
-int adc_enable_watchdog(int ain_id, int high, int low)
+int adc_enable_watchdog_mask(uint32_t ain_mask, int high, int low,
+			     void (*fired)(void))
 {
 	int ret;
 
+	if (!ain_mask)
+		return EC_ERROR_INVAL;
+
 	mutex_lock(&adc_lock);
 
-	watchdog_ain_id = ain_id;
+	watchdog_ain_mask = ain_mask;
+	watchdog_fired = fired;
 
 	/* Set thresholds */
 	STM32_ADC_TR = ((high & 0xfff) << 16) | (low & 0xfff);
@@ -200,6 +220,26 @@ int adc_enable_watchdog(int ain_id, int high, int low)
 	return ret;
 }
 
+int adc_enable_watchdog(int ain_id, int high, int low)
+{
+	return adc_enable_watchdog_mask(1 << ain_id, high, low, NULL);
+}
+
+#ifdef CONFIG_ADC_WATCHDOG_COMP_IRQ
+void adc_watchdog_interrupt(void)
+{
+	if (!(STM32_ADC_IER & STM32_ADC_IER_AWDIE) ||
+	    !(STM32_ADC_ISR & 0x80))
+		return;
+
+	/* One event per arming : the conversions keep running */
+	STM32_ADC_IER &= ~STM32_ADC_IER_AWDIE;
+	STM32_ADC_ISR = 0x80;
+	if (watchdog_fired)
+		watchdog_fired();
+}
+#endif
+
 static int adc_disable_watchdog_no_lock(void)
 {
 	if (watchdog_delay_ms)
@@ -251,17 +291,146 @@ static int adc_disable_watchdog_no_lock(void) { return 0; }
 
 #endif /* CONFIG_ADC_WATCHDOG */
 
+#ifdef CONFIG_ADC_CAPTURE
+#ifdef CONFIG_DMA_DEFAULT_HANDLERS
+#error "CONFIG_ADC_CAPTURE needs the ADC DMA channel interrupt"
+#endif
+
+static const struct dma_option dma_capture = {
+	STM32_DMAC_ADC, (void *)&STM32_ADC_DR,
+	STM32_DMA_CCR_MSIZE_16_BIT | STM32_DMA_CCR_PSIZE_16_BIT |
+	STM32_DMA_CCR_CIRC,
+};
+
+static struct {
+	uint32_t chselr; /* 0 when no capture is running */
+	int smpr;
+	uint16_t *buf;
+	int count;
+	void (*half_done)(int half);
+} capture;
+
+static int adc_capture_running(void)
+{
+	return capture.chselr != 0;
+}
+
+static void adc_capture_go(void)
+{
+	stm32_dma_chan_t *chan = dma_get_channel(STM32_DMAC_ADC);
+
+	STM32_ADC_CHSELR = capture.chselr;
+	STM32_ADC_SMPR = capture.smpr;
+	dma_start_rx(&dma_capture, capture.count, capture.buf);
+	chan->ccr |= STM32_DMA_CCR_HTIE | STM32_DMA_CCR_TCIE;
+	STM32_ADC_CFGR1 = (STM32_ADC_CFGR1 & ~STM32_ADC_CFGR1_EXTEN_MASK) |
+			  STM32_ADC_CFGR1_CONT | STM32_ADC_CFGR1_DMACFG |
+			  STM32_ADC_CFGR1_DMAEN;
+	/* Clear flags then start the conversions */
+	STM32_ADC_ISR = 0x1e;
+	STM32_ADC_CR |= 1 << 2; /* ADSTART */
+}
+
+static void adc_capture_halt(void)
+{
+	/* Stop on-going conversion */
+	STM32_ADC_CR |= 1 << 4; /* ADSTP */
+	while (STM32_ADC_CR & (1 << 4))
+		;
+	dma_disable(STM32_DMAC_ADC);
+	STM32_ADC_CFGR1 &= ~(STM32_ADC_CFGR1_CONT | STM32_ADC_CFGR1_DMACFG |
+			     STM32_ADC_CFGR1_DMAEN);
+	STM32_ADC_SMPR = profile.smpr_reg;
+}
+
+static void adc_dma_interrupt(void)
+{
+	uint32_t isr = STM32_DMA1_REGS->isr;
+
+	dma_clear_isr(STM32_DMAC_ADC);
+	if (!capture.half_done)
+		return;
+	/* both halves done : the handler is late, report the last one */
+	if (isr & STM32_DMA_ISR_TCIF(STM32_DMAC_ADC))
+		capture.half_done(1);
+	else if (isr & STM32_DMA_ISR_HTIF(STM32_DMAC_ADC))
+		capture.half_done(0);
+}
+DECLARE_IRQ(STM32_IRQ_DMA_CHANNEL_1, adc_dma_interrupt, 1);
+
+int adc_capture_start(uint32_t ain_mask, int smpr, uint16_t *buf, int count,
+		      void (*half_done)(int half))
+{
+	int inputs = __builtin_popcount(ain_mask);
+
+	if (!inputs || smpr < STM32_ADC_SMPR_1_5_CY ||
+	    smpr > STM32_ADC_SMPR_239_5_CY || !count ||
+	    count % (2 * inputs))
+		return EC_ERROR_INVAL;
+
+	mutex_lock(&adc_lock);
+	if (adc_watchdog_enabled() || adc_capture_running()) {
+		mutex_unlock(&adc_lock);
+		return EC_ERROR_BUSY;
+	}
+	capture.smpr = smpr;
+	capture.buf = buf;
+	capture.count = count;
+	capture.half_done = half_done;
+	capture.chselr = ain_mask;
+	adc_capture_go();
+	task_enable_irq(STM32_IRQ_DMA_CHANNEL_1);
+	mutex_unlock(&adc_lock);
+
+	return EC_SUCCESS;
+}
+
+void adc_capture_stop(void)
+{
+	mutex_lock(&adc_lock);
+	if (adc_capture_running()) {
+		task_disable_irq(STM32_IRQ_DMA_CHANNEL_1);
+		adc_capture_halt();
+		capture.chselr = 0;
+		capture.half_done = NULL;
+	}
+	mutex_unlock(&adc_lock);
+}
+
+int adc_conversion_ns(int smpr)
+{
+	/* sample times in half cycles, 12.5 more cycles for the conversion */
+	static const uint16_t smp_half_cycles[] = {
+		3, 15, 27, 57, 83, 111, 143, 479
+	};
+
+	return (smp_half_cycles[smpr & 7] + 25) * 1000 / 28;
+}
+
+#else /* CONFIG_ADC_CAPTURE */
+
+static int adc_capture_running(void) { return 0; }
+static void adc_capture_go(void) { }
+static void adc_capture_halt(void) { }
+
+#endif /* CONFIG_ADC_CAPTURE */
+
 int adc_read_channel(enum adc_channel ch)
 {
 	const struct adc_t *adc = adc_channels + ch;
 	int value;
 	int restore_watchdog = 0;
+	int restore_capture = 0;
 
 	mutex_lock(&adc_lock);
 	if (adc_watchdog_enabled()) {
 		restore_watchdog = 1;
 		adc_disable_watchdog_no_lock();
 	}
+	if (adc_capture_running()) {
+		restore_capture = 1;
+		adc_capture_halt();
+	}
 
 	adc_configure(adc->channel);
 
@@ -279,11 +448,80 @@ int adc_read_channel(enum adc_channel ch)
 
 	if (restore_watchdog)
 		adc_enable_watchdog_no_lock();
+	if (restore_capture)
+		adc_capture_go();
 	mutex_unlock(&adc_lock);
 
 	return value * adc->factor_mul / adc->factor_div + adc->shift;
 }
 
+/* Samples converted per DMA transfer of a burst */
+#define BURST_CHUNK 32
+
+int adc_read_burst_sum(uint32_t ain_mask, int smpr, int count, uint32_t *sum)
+{
+	static const struct dma_option dma_burst = {
+		STM32_DMAC_ADC, (void *)&STM32_ADC_DR,
+		STM32_DMA_CCR_MSIZE_16_BIT | STM32_DMA_CCR_PSIZE_16_BIT,
+	};
+	uint16_t buf[BURST_CHUNK];
+	int inputs = __builtin_popcount(ain_mask);
+	int restore_watchdog = 0;
+	int restore_capture = 0;
+	int i, n;
+
+	if (!inputs || smpr < STM32_ADC_SMPR_1_5_CY ||
+	    smpr > STM32_ADC_SMPR_239_5_CY || count <= 0)
+		return EC_ERROR_INVAL;
+	for (i = 0; i < inputs; i++)
+		sum[i] = 0;
+
+	mutex_lock(&adc_lock);
+	if (adc_watchdog_enabled()) {
+		restore_watchdog = 1;
+		adc_disable_watchdog_no_lock();
+	}
+	if (adc_capture_running()) {
+		restore_capture = 1;
+		adc_capture_halt();
+	}
+
+	adc_configure_mask(ain_mask);
+	STM32_ADC_SMPR = smpr;
+	while (count) {
+		n = MIN(count, BURST_CHUNK / inputs);
+
+		/* One-shot DMA : the conversions overrun once it is done */
+		dma_start_rx(&dma_burst, n * inputs, buf);
+		STM32_ADC_CFGR1 |= STM32_ADC_CFGR1_CONT | STM32_ADC_CFGR1_DMAEN;
+		STM32_ADC_ISR = 0x1e;
+		STM32_ADC_CR |= 1 << 2; /* ADSTART */
+		while (!(STM32_DMA1_REGS->isr &
+			 STM32_DMA_ISR_TCIF(STM32_DMAC_ADC)))
+			;
+		STM32_ADC_CR |= 1 << 4; /* ADSTP */
+		while (STM32_ADC_CR & (1 << 4))
+			;
+		dma_disable(STM32_DMAC_ADC);
+		dma_clear_isr(STM32_DMAC_ADC);
+		STM32_ADC_CFGR1 &= ~(STM32_ADC_CFGR1_CONT |
+				     STM32_ADC_CFGR1_DMAEN);
+
+		for (i = 0; i < n * inputs; i++)
+			sum[i % inputs] += buf[i];
+		count -= n;
+	}
+	STM32_ADC_SMPR = profile.smpr_reg;
+
+	if (restore_watchdog)
+		adc_enable_watchdog_no_lock();
+	if (restore_capture)
+		adc_capture_go();
+	mutex_unlock(&adc_lock);
+
+	return EC_SUCCESS;
+}
+
 static void adc_init(void)
 {
 	/*
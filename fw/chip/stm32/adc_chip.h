@@ -31,4 +31,62 @@ extern const struct adc_t adc_channels[];
 /* Just plain id mapping for code readability */
 #define STM32_AIN(x) (x)
 
+/**
+ * Convert the inputs of 'ain_mask' 'count' times in a row with the sample
+ * time 'smpr' (STM32_ADC_SMPR_x), the DMA gathering the samples (STM32F0
+ * only). 'sum' gets the raw sum of each input, in increasing AIN ID order.
+ *
+ * The watchdog and the capture are suspended during the burst.
+ *
+ * @return EC_SUCCESS or EC_ERROR_INVAL.
+ */
+int adc_read_burst_sum(uint32_t ain_mask, int smpr, int count, uint32_t *sum);
+
+#ifdef CONFIG_ADC_WATCHDOG
+/**
+ * Enable the ADC watchdog on all the inputs of 'ain_mask' (STM32F0 only) :
+ * they are converted in a loop and 'fired' is called from the ADC interrupt
+ * the first time one of them goes outside of [low, high] (raw values).
+ * The watchdog interrupt is then masked until the watchdog is enabled again,
+ * it cannot tell which input crossed the thresholds.
+ *
+ * The interrupt must be served by calling adc_watchdog_interrupt(), see
+ * CONFIG_ADC_WATCHDOG_COMP_IRQ.
+ *
+ * @return EC_SUCCESS or EC_ERROR_INVAL.
+ */
+int adc_enable_watchdog_mask(uint32_t ain_mask, int high, int low,
+			     void (*fired)(void));
+
+/* Serve the ADC watchdog part of the shared ADC / comparator interrupt */
+void adc_watchdog_interrupt(void);
+#endif
+
+#ifdef CONFIG_ADC_CAPTURE
+/**
+ * Start converting the inputs of 'ain_mask' in a loop, the DMA filling the
+ * circular buffer 'buf' of 'count' samples (the inputs in increasing AIN ID
+ * order, 'count' a multiple of twice their number).
+ *
+ * The conversions run back to back at the ADC clock (14 MHz) pace : a
+ * sample takes the 'smpr' sample time (STM32_ADC_SMPR_x) plus 12.5 cycles.
+ *
+ * 'half_done' is called from the DMA interrupt when the first (0) or the
+ * second (1) half of the buffer has been filled.
+ *
+ * adc_read_channel() suspends the capture during its conversion.
+ *
+ * @return EC_SUCCESS, EC_ERROR_BUSY if the watchdog or another capture is
+ * running, or EC_ERROR_INVAL.
+ */
+int adc_capture_start(uint32_t ain_mask, int smpr, uint16_t *buf, int count,
+		      void (*half_done)(int half));
+
+/* Stop the capture */
+void adc_capture_stop(void);
+
+/* Duration of a conversion with the sample time 'smpr' in ns */
+int adc_conversion_ns(int smpr);
+#endif
+
 #endif /* __CROS_EC_ADC_CHIP_H */
@@ -9,6 +9,7 @@
 
 #include "clock.h"
 #include "registers.h"
+#include "task.h"
 
 static inline void crc32_init(void)
 {
@@ -38,4 +39,76 @@ static inline uint32_t crc32_result(void)
 	return STM32_CRC_DR ^ 0xFFFFFFFF;
 }
 
+/*
+ * Reentrant CRC-32 : each context keeps its own raw CRC register value and
+ * the CRC unit is loaded with it only for the duration of one call, with
+ * the interrupts disabled, so the stateful interface above and any number
+ * of contexts can be used concurrently without a mutex. The interrupt state
+ * of the caller is restored, they can run with the interrupts disabled.
+ */
+
+/* Load the raw CRC register with 'state', returns its previous value */
+static inline uint32_t crc32_hw_exchange(uint32_t state)
+{
+	uint32_t old;
+
+	if (!(STM32_RCC_AHBENR & (1 << 6))) {
+		STM32_RCC_AHBENR |= 1 << 6; /* switch on CRC controller */
+		clock_wait_bus_cycles(BUS_AHB, 1);
+	}
+	/* read the register without the output bit reversal */
+	STM32_CRC_CR = STM32_CRC_CR_REV_IN_WORD;
+	old = STM32_CRC_DR;
+	/* the reset loads the CRC register with the INIT value */
+	STM32_CRC_INIT = state;
+	STM32_CRC_CR = STM32_CRC_CR_RESET | STM32_CRC_CR_REV_OUT
+		     | STM32_CRC_CR_REV_IN_WORD;
+	while (STM32_CRC_CR & STM32_CRC_CR_RESET)
+		;
+	STM32_CRC_INIT = 0xFFFFFFFF;
+	return old;
+}
+
+static inline void crc32_ctx_init(uint32_t *ctx)
+{
+	*ctx = 0xFFFFFFFF;
+}
+
+static inline void crc32_ctx_hash32(uint32_t *ctx, uint32_t val)
+{
+	uint32_t int_mask = get_int_mask();
+	uint32_t shared;
+
+	interrupt_disable();
+	shared = crc32_hw_exchange(*ctx);
+	STM32_CRC_DR = val;
+	*ctx = crc32_hw_exchange(shared);
+	set_int_mask(int_mask);
+}
+
+static inline void crc32_ctx_hash16(uint32_t *ctx, uint16_t val)
+{
+	uint32_t int_mask = get_int_mask();
+	uint32_t shared;
+
+	interrupt_disable();
+	shared = crc32_hw_exchange(*ctx);
+	STM32_CRC_DR16 = val;
+	*ctx = crc32_hw_exchange(shared);
+	set_int_mask(int_mask);
+}
+
+static inline uint32_t crc32_ctx_result(uint32_t *ctx)
+{
+	uint32_t int_mask = get_int_mask();
+	uint32_t shared, crc;
+
+	interrupt_disable();
+	shared = crc32_hw_exchange(*ctx);
+	crc = crc32_result();
+	crc32_hw_exchange(shared);
+	set_int_mask(int_mask);
+	return crc;
+}
+
 #endif /* __CROS_EC_CRC_HW_H */
@@ -110,7 +110,7 @@ void dma_disable_all(void)
 /**
  * Prepare a channel for use and start it
  *
- * @param chan		Channel to read
+ * @param channel	Channel to read
  * @param count		Number of bytes to transfer
  * @param periph	Pointer to peripheral data register
  * @param memory	Pointer to memory address for receive/transmit
@@ -118,10 +118,15 @@ void dma_disable_all(void)
  *				STM32_DMA_CCR_MINC | STM32_DMA_CCR_DIR for tx
  *				0 for rx
  */
-static void prepare_channel(stm32_dma_chan_t *chan, unsigned count,
+static void prepare_channel(enum dma_channel channel, unsigned count,
 		void *periph, void *memory, unsigned flags)
 {
+	stm32_dma_chan_t *chan = dma_get_channel(channel);
+#ifdef CONFIG_DMA_CHANNEL_PRIORITY
+	uint32_t ccr = dma_channel_priority[channel];
+#else
 	uint32_t ccr = STM32_DMA_CCR_PL_VERY_HIGH;
+#endif
 
 	if (chan->ccr & STM32_DMA_CCR_EN)
 		chan->ccr &= ~STM32_DMA_CCR_EN;
@@ -147,13 +152,11 @@ void dma_go(stm32_dma_chan_t *chan)
 void dma_prepare_tx(const struct dma_option *option, unsigned count,
 		    const void *memory)
 {
-	stm32_dma_chan_t *chan = dma_get_channel(option->channel);
-
 	/*
 	 * Cast away const for memory pointer; this is ok because we know
 	 * we're preparing the channel for transmit.
 	 */
-	prepare_channel(chan, count, option->periph, (void *)memory,
+	prepare_channel(option->channel, count, option->periph, (void *)memory,
 			STM32_DMA_CCR_MINC | STM32_DMA_CCR_DIR |
 			option->flags);
 }
@@ -161,11 +164,9 @@ void dma_prepare_tx(const struct dma_option *option, unsigned count,
 void dma_start_rx(const struct dma_option *option, unsigned count,
 		  void *memory)
 {
-	stm32_dma_chan_t *chan = dma_get_channel(option->channel);
-
-	prepare_channel(chan, count, option->periph, memory,
+	prepare_channel(option->channel, count, option->periph, memory,
 			STM32_DMA_CCR_MINC | option->flags);
-	dma_go(chan);
+	dma_go(dma_get_channel(option->channel));
 }
 
 int dma_bytes_done(stm32_dma_chan_t *chan, int orig_count)
@@ -40,6 +40,7 @@
 struct i2c_port_data {
 	uint32_t timeout_us;    /* Transaction timeout, or 0 to use default */
 	enum i2c_freq freq;	/* Port clock speed */
+	uint8_t src;		/* Port input clock (enum stm32_i2c_clk_src) */
 };
 static struct i2c_port_data pdata[I2C_PORT_COUNT];
 
@@ -98,7 +99,11 @@ enum stm32_i2c_clk_src {
 	I2C_CLK_SRC_COUNT,
 };
 
-/* timingr register values for supported input clks / i2c clk rates */
+/*
+ * timingr register values for supported input clks / i2c clk rates, from
+ * the reference manual timing tables (SCL period including the
+ * synchronization delays, rise time up to 120 ns in FM+).
+ */
 static const uint32_t timingr_regs[I2C_CLK_SRC_COUNT][I2C_FREQ_COUNT] = {
 	[I2C_CLK_SRC_48MHZ] = {
 		[I2C_FREQ_1000KHZ] = 0x50100103,
@@ -124,10 +129,74 @@ static void i2c_set_freq_port(const struct i2c_port_t *p,
 	STM32_I2C_CR2(port) = 0;
 	/* Set clock frequency */
 	STM32_I2C_TIMINGR(port) = regs[freq];
+	/* The 1 MHz bus needs the Fast-mode Plus drive of the pins */
+	if (port <= STM32_I2C2_PORT) {
+		STM32_RCC_APB2ENR |= STM32_RCC_SYSCFGEN;
+		if (freq == I2C_FREQ_1000KHZ)
+			STM32_SYSCFG_CFGR1 |= STM32_SYSCFG_CFGR1_I2C_FMP(port);
+		else
+			STM32_SYSCFG_CFGR1 &= ~STM32_SYSCFG_CFGR1_I2C_FMP(port);
+	}
 	/* Enable port */
 	STM32_I2C_CR1(port) = STM32_I2C_CR1_PE;
 
 	pdata[port].freq = freq;
+	pdata[port].src = src;
+}
+
+static const uint16_t freq_khz[I2C_FREQ_COUNT] = {
+	[I2C_FREQ_1000KHZ] = 1000,
+	[I2C_FREQ_400KHZ] = 400,
+	[I2C_FREQ_100KHZ] = 100,
+};
+
+int i2c_freq_to_khz(enum i2c_freq freq)
+{
+	return freq < I2C_FREQ_COUNT ? freq_khz[freq] : 0;
+}
+
+/* Returns the enum i2c_freq of a speed in kHz, or -1 if not supported */
+static int i2c_khz_to_freq(int khz)
+{
+	int i;
+
+	for (i = 0; i < I2C_FREQ_COUNT; i++)
+		if (freq_khz[i] == khz)
+			return i;
+	return -1;
+}
+
+static const struct i2c_port_t *find_port(int port)
+{
+	int i;
+
+	for (i = 0; i < i2c_ports_used; i++)
+		if (i2c_ports[i].port == port)
+			return i2c_ports + i;
+	return NULL;
+}
+
+int i2c_set_freq(int port, enum i2c_freq freq)
+{
+	const struct i2c_port_t *p = find_port(port);
+
+	if (!p || freq >= I2C_FREQ_COUNT)
+		return EC_ERROR_INVAL;
+#ifdef CONFIG_HOSTCMD_I2C_SLAVE_ADDR
+	/* the slave setup would be lost */
+	if (port == I2C_PORT_EC)
+		return EC_ERROR_INVAL;
+#endif
+
+	i2c_lock(port, 1);
+	i2c_set_freq_port(p, pdata[port].src, freq);
+	i2c_lock(port, 0);
+	return EC_SUCCESS;
+}
+
+enum i2c_freq i2c_get_freq(int port)
+{
+	return pdata[port].freq;
 }
 
 /**
@@ -139,7 +208,7 @@ static void i2c_init_port(const struct i2c_port_t *p)
 {
 	int port = p->port;
 	enum stm32_i2c_clk_src src = I2C_CLK_SRC_48MHZ;
-	enum i2c_freq freq;
+	int freq;
 
 	/* Enable clocks to I2C modules if necessary */
 	if (!(STM32_RCC_APB1ENR & (1 << (21 + port))))
@@ -166,17 +235,9 @@ defined(CONFIG_LOW_POWER_IDLE) && \
 	gpio_config_module(MODULE_I2C, 1);
 
 	/* Set clock frequency */
-	switch (p->kbps) {
-	case 1000:
-		freq = I2C_FREQ_1000KHZ;
-		break;
-	case 400:
-		freq = I2C_FREQ_400KHZ;
-		break;
-	case 100:
-		freq = I2C_FREQ_100KHZ;
-		break;
-	default: /* unknown speed, defaults to 100kBps */
+	freq = i2c_khz_to_freq(p->kbps);
+	if (freq < 0) {
+		/* unknown speed, defaults to 100kBps */
 		CPRINTS("I2C bad speed %d kBps", p->kbps);
 		freq = I2C_FREQ_100KHZ;
 	}
@@ -550,6 +611,124 @@ xfer_exit:
 	return rv;
 }
 
+#ifdef CONFIG_I2C_ASYNC
+#if defined(CONFIG_HOSTCMD_I2C_SLAVE_ADDR) && (I2C_PORT_EC == STM32_I2C1_PORT)
+#error "CONFIG_I2C_ASYNC needs the I2C1 interrupt"
+#endif
+
+/* Asynchronous transfer on I2C1 */
+static struct {
+	const uint8_t *out;
+	uint8_t *in;
+	int out_size;
+	int in_size;
+	int pos;
+	int slave_addr;
+	i2c_async_cb cb; /* NULL when no transfer is pending */
+	void *priv;
+} async;
+
+#define ASYNC_IRQ_MASK (STM32_I2C_CR1_TXIE | STM32_I2C_CR1_RXIE | \
+			STM32_I2C_CR1_NACKIE | STM32_I2C_CR1_STOPIE | \
+			STM32_I2C_CR1_TCIE | STM32_I2C_CR1_ERRIE)
+
+static void async_done(int rv)
+{
+	int port = STM32_I2C1_PORT;
+	i2c_async_cb cb = async.cb;
+
+	STM32_I2C_CR1(port) &= ~ASYNC_IRQ_MASK;
+	if (rv) {
+		/* no busy wait here : let the controller reset free the bus */
+		STM32_I2C_CR2(port) |= STM32_I2C_CR2_STOP;
+		STM32_I2C_CR1(port) &= ~STM32_I2C_CR1_PE;
+		STM32_I2C_CR2(port) = 0;
+		STM32_I2C_CR1(port) |= STM32_I2C_CR1_PE;
+	}
+	STM32_I2C_ICR(port) = STM32_I2C_ICR_ALL;
+	async.cb = NULL;
+	if (cb)
+		cb(async.priv, rv);
+}
+
+static void i2c1_async_interrupt(void)
+{
+	int port = STM32_I2C1_PORT;
+	int isr = STM32_I2C_ISR(port);
+
+	if (!async.cb) {
+		STM32_I2C_CR1(port) &= ~ASYNC_IRQ_MASK;
+		return;
+	}
+	if (isr & (STM32_I2C_ISR_ARLO | STM32_I2C_ISR_BERR |
+		   STM32_I2C_ISR_NACK)) {
+		async_done(EC_ERROR_UNKNOWN);
+		return;
+	}
+
+	if (isr & STM32_I2C_ISR_TXIS)
+		STM32_I2C_TXDR(port) = async.out[async.pos++];
+	if (isr & STM32_I2C_ISR_RXNE)
+		async.in[async.pos++] = STM32_I2C_RXDR(port);
+	if (isr & STM32_I2C_ISR_TC) {
+		/* write done : restart for the read, the START clears TC */
+		async.pos = 0;
+		STM32_I2C_CR2(port) = (async.in_size << 16)
+			| STM32_I2C_CR2_RD_WRN | async.slave_addr
+			| STM32_I2C_CR2_AUTOEND | STM32_I2C_CR2_START;
+	}
+	if (isr & STM32_I2C_ISR_STOP)
+		async_done(EC_SUCCESS);
+}
+DECLARE_IRQ(STM32_IRQ_I2C1, i2c1_async_interrupt, 3);
+
+int i2c_xfer_async(int port, int slave_addr, const uint8_t *out, int out_size,
+		   uint8_t *in, int in_size, i2c_async_cb cb, void *priv)
+{
+	if (port != STM32_I2C1_PORT || out_size > 0xff || in_size > 0xff ||
+	    (!out_size && !in_size))
+		return EC_ERROR_INVAL;
+	if (async.cb)
+		return EC_ERROR_BUSY;
+
+	ASSERT(out || !out_size);
+	ASSERT(in || !in_size);
+	ASSERT(cb);
+
+	async.out = out;
+	async.in = in;
+	async.out_size = out_size;
+	async.in_size = in_size;
+	async.pos = 0;
+	async.slave_addr = slave_addr;
+	async.priv = priv;
+	async.cb = cb;
+
+	STM32_I2C_ICR(port) = STM32_I2C_ICR_ALL;
+	if (out_size)
+		STM32_I2C_CR2(port) = (out_size << 16) | slave_addr
+			| (in_size ? 0 : STM32_I2C_CR2_AUTOEND)
+			| STM32_I2C_CR2_START;
+	else
+		STM32_I2C_CR2(port) = (in_size << 16)
+			| STM32_I2C_CR2_RD_WRN | slave_addr
+			| STM32_I2C_CR2_AUTOEND | STM32_I2C_CR2_START;
+	STM32_I2C_CR1(port) |= ASYNC_IRQ_MASK;
+
+	return EC_SUCCESS;
+}
+
+void i2c_xfer_async_cancel(int port)
+{
+	if (port != STM32_I2C1_PORT)
+		return;
+	interrupt_disable();
+	if (async.cb)
+		async_done(EC_ERROR_TIMEOUT);
+	interrupt_enable();
+}
+#endif /* CONFIG_I2C_ASYNC */
+
 int i2c_raw_get_scl(int port)
 {
 	enum gpio_signal g;
@@ -586,6 +765,10 @@ static void i2c_init(void)
 	for (i = 0; i < i2c_ports_used; i++, p++)
 		i2c_init_port(p);
 
+#ifdef CONFIG_I2C_ASYNC
+	task_enable_irq(STM32_IRQ_I2C1);
+#endif
+
 #ifdef CONFIG_HOSTCMD_I2C_SLAVE_ADDR
 	STM32_I2C_CR1(I2C_PORT_EC) |= STM32_I2C_CR1_RXIE | STM32_I2C_CR1_ERRIE
 			| STM32_I2C_CR1_ADDRIE | STM32_I2C_CR1_STOPIE
@@ -611,3 +794,31 @@ static void i2c_init(void)
 }
 DECLARE_HOOK(HOOK_INIT, i2c_init, HOOK_PRIO_INIT_I2C);
 
+#ifdef CONFIG_CMD_I2C_SPEED
+static int command_i2cspeed(int argc, char **argv)
+{
+	int port = I2C_PORT_MASTER;
+	int freq;
+	char *e;
+
+	if (argc >= 2) {
+		port = strtoi(argv[1], &e, 0);
+		if (*e || !find_port(port))
+			return EC_ERROR_PARAM1;
+	}
+	if (argc >= 3) {
+		freq = i2c_khz_to_freq(strtoi(argv[2], &e, 0));
+		if (*e || freq < 0)
+			return EC_ERROR_PARAM2;
+		if (i2c_set_freq(port, freq))
+			return EC_ERROR_PARAM1;
+	}
+	ccprintf("Port %d: %d kHz\n", port,
+		 i2c_freq_to_khz(i2c_get_freq(port)));
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(i2cspeed, command_i2cspeed,
+			"[port] [100|400|1000]",
+			"Get/set the I2C bus speed in kHz");
+#endif
+
@@ -487,6 +487,7 @@ typedef volatile struct timer_ctlr timer_ctlr_t;
 #define STM32_I2C_CR1_ADDRIE        (1 << 3)
 #define STM32_I2C_CR1_NACKIE        (1 << 4)
 #define STM32_I2C_CR1_STOPIE        (1 << 5)
+#define STM32_I2C_CR1_TCIE          (1 << 6)
 #define STM32_I2C_CR1_ERRIE         (1 << 7)
 #define STM32_I2C_CR1_WUPEN         (1 << 18)
 #define STM32_I2C_CR2(n)            REG32(stm32_i2c_reg(n, 0x04))
@@ -934,6 +935,8 @@ typedef volatile struct timer_ctlr timer_ctlr_t;
 #define STM32_SYSCFG_BASE           0x40010000
 
 #define STM32_SYSCFG_CFGR1          REG32(STM32_SYSCFG_BASE + 0x00)
+/* Fast-mode Plus drive of the pins of the I2C port */
+#define STM32_SYSCFG_CFGR1_I2C_FMP(port) (1 << (20 + (port)))
 #define STM32_SYSCFG_EXTICR(n)      REG32(STM32_SYSCFG_BASE + 8 + 4 * (n))
 #define STM32_SYSCFG_CFGR2          REG32(STM32_SYSCFG_BASE + 0x18)
 
@@ -2264,6 +2267,7 @@ typedef volatile struct stm32_dma_regs stm32_dma_regs_t;
 
 #define STM32_USB_FNR              REG16(STM32_USB_FS_BASE + 0x48)
 
+#define STM32_USB_FNR_FN_MASK         (0x7ff)
 #define STM32_USB_FNR_RXDP_RXDM_SHIFT (14)
 #define STM32_USB_FNR_RXDP_RXDM_MASK  (3 << STM32_USB_FNR_RXDP_RXDM_SHIFT)
 
@@ -2296,6 +2300,14 @@ typedef volatile struct stm32_dma_regs stm32_dma_regs_t;
 #define EP_RX_DISAB 0x0000
 
 #define EP_STATUS_OUT 0x0100
+/* EP_KIND of a bulk endpoint : hardware double-buffering */
+#define EP_DBL_BUF    0x0100
+/* Double-buffered IN endpoint : buffer owned by the software */
+#define EP_TX_SWBUF   EP_RX_DTOG
+
+/* Transfer completion flags, left untouched when written with 1 */
+#define EP_CTR_RX     0x8000
+#define EP_CTR_TX     0x0080
 
 #define EP_TX_RX_MASK (EP_TX_MASK | EP_RX_MASK)
 #define EP_TX_RX_VALID (EP_TX_VALID | EP_RX_VALID)
@@ -10,6 +10,7 @@
 #include "flash.h"
 #include "gpio.h"
 #include "hooks.h"
+#include "hwtimer.h"
 #include "link_defs.h"
 #include "registers.h"
 #include "system.h"
@@ -176,6 +177,13 @@ static void ep0_rx(void)
 			ep0_send_descriptor(webusb_url, len, 0);
 			return;
 		}
+#ifdef CONFIG_WEBUSB_WINUSB_GUID
+		if (b_req == 0x02 && idx == MS_OS_20_REQ_GET_DESCRIPTOR) {
+			ep0_send_descriptor(ms_os_20_ctx.descp,
+					    ms_os_20_ctx.size, 0);
+			return;
+		}
+#endif
 #endif
 		goto unknown_req;
 	}
@@ -447,9 +455,37 @@ int usb_is_suspended(void)
 }
 #endif /* CONFIG_USB_SUSPEND */
 
+#ifdef CONFIG_USB_SOF_LATCH
+void usb_sof_arm(void)
+{
+	interrupt_disable();
+	/* forget the frames seen before being armed */
+	STM32_USB_ISTR = ~STM32_USB_ISTR_SOF;
+	STM32_USB_CNTR |= STM32_USB_CNTR_SOFM;
+	interrupt_enable();
+}
+#endif
+
+/* Completed transfers served per interrupt at most */
+#define USB_CTR_DRAIN_MAX (2 * USB_EP_COUNT)
+
 void usb_interrupt(void)
 {
 	uint16_t status = STM32_USB_ISTR;
+	uint16_t istr = status;
+	int i;
+
+#ifdef CONFIG_USB_SOF_LATCH
+	/* latch the clock first to keep the SOF latency short */
+	if ((status & STM32_USB_ISTR_SOF) &&
+	    (STM32_USB_CNTR & STM32_USB_CNTR_SOFM)) {
+		timestamp_t t = get_time();
+
+		/* one-shot : no interrupt on every frame */
+		STM32_USB_CNTR &= ~STM32_USB_CNTR_SOFM;
+		usb_sof_latched(STM32_USB_FNR & STM32_USB_FNR_FN_MASK, t);
+	}
+#endif
 
 	if (status & STM32_USB_ISTR_RESET)
 		usb_reset();
@@ -497,16 +533,24 @@ void usb_interrupt(void)
 		usb_resume();
 #endif
 
-	if (status & STM32_USB_ISTR_CTR) {
-		int ep = status & STM32_USB_ISTR_EP_ID_MASK;
+	/*
+	 * Serve the completed transfers until none is pending rather than
+	 * one per interrupt : with the sniffer, console and command endpoints
+	 * all busy, each exception entry and exit would cost a transaction.
+	 * The handlers clear the CTR bits of their endpoint, the bound stops
+	 * on one which does not.
+	 */
+	for (i = 0; (istr & STM32_USB_ISTR_CTR) && i < USB_CTR_DRAIN_MAX;
+	     i++) {
+		int ep = istr & STM32_USB_ISTR_EP_ID_MASK;
+
 		if (ep < USB_EP_COUNT) {
-			if (status & STM32_USB_ISTR_DIR)
+			if (istr & STM32_USB_ISTR_DIR)
 				usb_ep_rx[ep]();
 			else
 				usb_ep_tx[ep]();
 		}
-		/* TODO: do it in a USB task */
-		/* task_set_event(, 1 << ep_task); */
+		istr = STM32_USB_ISTR;
 	}
 
 	/* ack only interrupts that we handled */
@@ -613,6 +657,35 @@ void *memcpy_to_usbram(void *dest, const void *src, size_t n)
 		d++;
 	}
 
+	/*
+	 * Word-aligned source (the packets of the sniffer and the console):
+	 * one load for 2 half-words, unrolled for the 64-byte packets.
+	 */
+	if (!((uintptr_t) s & 3)) {
+		const uint32_t *s32 = (const uint32_t *) s;
+
+		for (; n >= 16; n -= 16, s32 += 4, d += 8) {
+			uint32_t w0 = s32[0], w1 = s32[1];
+			uint32_t w2 = s32[2], w3 = s32[3];
+
+			d[0] = w0 & 0xffff;
+			d[1] = w0 >> 16;
+			d[2] = w1 & 0xffff;
+			d[3] = w1 >> 16;
+			d[4] = w2 & 0xffff;
+			d[5] = w2 >> 16;
+			d[6] = w3 & 0xffff;
+			d[7] = w3 >> 16;
+		}
+		for (; n >= 4; n -= 4, d += 2) {
+			uint32_t w = *s32++;
+
+			d[0] = w & 0xffff;
+			d[1] = w >> 16;
+		}
+		s = (uint8_t *) s32;
+	}
+
 	for (i = 0; i < n / 2; i++, s += 2)
 		*d++ = (s[1] << 8) | s[0];
 
@@ -640,6 +713,21 @@ void *memcpy_from_usbram(void *dest, const void *src, size_t n)
 		d++;
 	}
 
+	/* Word-aligned destination : one store for 2 half-words */
+	if (!((uintptr_t) d & 3)) {
+		uint32_t *d32 = (uint32_t *) d;
+
+		for (; n >= 16; n -= 16, s += 8, d32 += 4) {
+			d32[0] = (s[0] & 0xffff) | ((uint32_t) s[1] << 16);
+			d32[1] = (s[2] & 0xffff) | ((uint32_t) s[3] << 16);
+			d32[2] = (s[4] & 0xffff) | ((uint32_t) s[5] << 16);
+			d32[3] = (s[6] & 0xffff) | ((uint32_t) s[7] << 16);
+		}
+		for (; n >= 4; n -= 4, s += 2)
+			*d32++ = (s[0] & 0xffff) | ((uint32_t) s[1] << 16);
+		d = (uint8_t *) d32;
+	}
+
 	for (i = 0; i < n / 2; i++) {
 		usb_uint value = *s++;
 
@@ -653,6 +741,49 @@ void *memcpy_from_usbram(void *dest, const void *src, size_t n)
 	return dest;
 }
 
+#ifdef CONFIG_CMD_USB_MEMCPY
+static int command_usb_memcpy(int argc, char **argv)
+{
+	/* one full packet, word-aligned */
+	static uint32_t buf[USB_MAX_PACKET_SIZE / 4 + 1];
+	void *pma = (void *) usb_sram_addr(ep0_buf_tx);
+	const int loops = 1000;
+	uint32_t t0, t[3];
+	int i;
+
+	/* the EP0 TX buffer is our scratch area : no control transfer */
+	if ((STM32_USB_EP(0) & EP_TX_MASK) == EP_TX_VALID)
+		return EC_ERROR_BUSY;
+
+	interrupt_disable();
+	t0 = __hw_clock_source_read();
+	for (i = 0; i < loops; i++)
+		memcpy_to_usbram(pma, buf, USB_MAX_PACKET_SIZE);
+	t[0] = __hw_clock_source_read() - t0;
+	t0 = __hw_clock_source_read();
+	for (i = 0; i < loops; i++)
+		memcpy_to_usbram(pma, (uint8_t *) buf + 1,
+				 USB_MAX_PACKET_SIZE);
+	t[1] = __hw_clock_source_read() - t0;
+	t0 = __hw_clock_source_read();
+	for (i = 0; i < loops; i++)
+		memcpy_from_usbram(buf, pma, USB_MAX_PACKET_SIZE);
+	t[2] = __hw_clock_source_read() - t0;
+	interrupt_enable();
+
+	/* us for 'loops' copies to cycles per packet */
+	for (i = 0; i < ARRAY_SIZE(t); i++)
+		t[i] = t[i] * (clock_get_freq() / 1000) / (1000 * loops);
+	ccprintf("%d-byte packet cycles : to %d (unaligned %d) from %d\n",
+		 USB_MAX_PACKET_SIZE, t[0], t[1], t[2]);
+
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(usbmemcpy, command_usb_memcpy,
+			NULL,
+			"Benchmark the copies to/from the USB packet RAM");
+#endif /* CONFIG_CMD_USB_MEMCPY */
+
 #ifdef CONFIG_USB_SERIALNO
 /* This will be subbed into USB_STR_SERIALNO. */
 struct usb_string_desc *usb_serialno_desc =
@@ -6,8 +6,10 @@
 #include "common.h"
 #include "config.h"
 #include "console.h"
+#include "hooks.h"
 #include "link_defs.h"
 #include "printf.h"
+#include "queue.h"
 #include "registers.h"
 #include "task.h"
 #include "timer.h"
@@ -19,15 +21,21 @@
 /* Console output macro */
 #define CPRINTF(format, args...) cprintf(CC_USB, format, ## args)
 
-#define USB_CONSOLE_TIMEOUT_US (30 * MSEC)
 #define USB_CONSOLE_RX_BUF_SIZE 64
 #define RX_BUF_NEXT(i) (((i) + 1) & (USB_CONSOLE_RX_BUF_SIZE - 1))
+/* Output waiting for the host (power of 2) */
+#define USB_CONSOLE_TX_BUF_SIZE 256
 
 static volatile char rx_buf[USB_CONSOLE_RX_BUF_SIZE];
 static volatile int rx_buf_head;
 static volatile int rx_buf_tail;
 
-static int last_tx_ok = 1;
+/*
+ * The producers only append to the TX queue : the hook task starts the
+ * transfer and the end of each packet sends the next one from the endpoint
+ * interrupt, so printing never waits for the host.
+ */
+static struct queue const tx_q = QUEUE_NULL(USB_CONSOLE_TX_BUF_SIZE, uint8_t);
 
 static int is_reset;
 static int is_enabled = 1;
@@ -65,10 +73,14 @@ const struct usb_endpoint_descriptor USB_EP_DESC(USB_IFACE_CONSOLE, 1) = {
 static usb_uint ep_buf_tx[USB_MAX_PACKET_SIZE / 2] __usb_ram;
 static usb_uint ep_buf_rx[USB_MAX_PACKET_SIZE / 2] __usb_ram;
 
+static void tx_fill(void);
+
 static void con_ep_tx(void)
 {
 	/* clear IT */
 	STM32_TOGGLE_EP(USB_EP_CONSOLE, 0, 0, 0);
+	/* the host took the packet : send the next one at once */
+	tx_fill();
 }
 
 static void con_ep_rx(void)
@@ -114,26 +126,6 @@ static void ep_event(enum usb_ep_event evt)
 
 USB_DECLARE_EP(USB_EP_CONSOLE, con_ep_tx, con_ep_rx, ep_event);
 
-static int __tx_char(void *context, int c)
-{
-	usb_uint *buf = (usb_uint *)ep_buf_tx;
-	int *tx_idx = context;
-
-	/* Do newline to CRLF translation */
-	if (c == '\n' && __tx_char(context, '\r'))
-		return 1;
-
-	if (*tx_idx > 63)
-		return 1;
-	if (!(*tx_idx & 1))
-		buf[*tx_idx/2] = c;
-	else
-		buf[*tx_idx/2] |= c << 8;
-	(*tx_idx)++;
-
-	return 0;
-}
-
 static void usb_enable_tx(int len)
 {
 	if (!is_enabled)
@@ -148,42 +140,80 @@ static inline int usb_console_tx_valid(void)
 	return (STM32_USB_EP(USB_EP_CONSOLE) & EP_TX_MASK) == EP_TX_VALID;
 }
 
-static int usb_wait_console(void)
+/* Move the next packet from the TX queue to the endpoint if it is free */
+static void tx_fill(void)
 {
-	timestamp_t deadline = get_time();
-	int wait_time_us = 1;
-
-	if (!is_enabled || !usb_is_enabled())
-		return EC_SUCCESS;
-
-	deadline.val += USB_CONSOLE_TIMEOUT_US;
-
-	/*
-	 * If the USB console is not used, Tx buffer would never free up.
-	 * In this case, let's drop characters immediately instead of sitting
-	 * for some time just to time out. On the other hand, if the last
-	 * Tx is good, it's likely the host is there to receive data, and
-	 * we should wait so that we don't clobber the buffer.
-	 */
-	if (last_tx_ok) {
-		while (usb_console_tx_valid() || !is_reset) {
-			if (timestamp_expired(deadline, NULL) ||
-			    in_interrupt_context()) {
-				last_tx_ok = 0;
-				return EC_ERROR_TIMEOUT;
-			}
-			if (wait_time_us < MSEC)
-				udelay(wait_time_us);
-			else
-				usleep(wait_time_us);
-			wait_time_us *= 2;
-		}
+	uint8_t buf[USB_MAX_PACKET_SIZE];
+	int len;
 
-		return EC_SUCCESS;
-	} else {
-		last_tx_ok = !usb_console_tx_valid();
-		return EC_SUCCESS;
+	if (!is_reset || !is_enabled || usb_console_tx_valid())
+		return;
+
+	len = queue_remove_units(&tx_q, buf, sizeof(buf));
+	if (!len)
+		return;
+	memcpy_to_usbram((void *) usb_sram_addr(ep_buf_tx), buf, len);
+	usb_enable_tx(len);
+}
+
+static void tx_flush(void)
+{
+	/* the endpoint interrupt is the other consumer of the queue */
+	interrupt_disable();
+	tx_fill();
+	interrupt_enable();
+}
+DECLARE_DEFERRED(tx_flush);
+
+static size_t tx_add(const void *src, size_t count)
+{
+	size_t added;
+
+	/* several tasks and interrupts might be printing */
+	interrupt_disable();
+	added = queue_add_units(&tx_q, src, count);
+	interrupt_enable();
+
+	return added;
+}
+
+static int __tx_char(void *context, int c)
+{
+	uint8_t ch = c;
+
+	/* Do newline to CRLF translation */
+	if (c == '\n' && __tx_char(context, '\r'))
+		return 1;
+
+	return !tx_add(&ch, 1);
+}
+
+static int __tx_str(void *context, const char *str, int len)
+{
+	const char *end = str + len;
+
+	/* queue the runs between the newlines in one go */
+	while (str < end) {
+		const char *nl = memchr(str, '\n', end - str);
+		size_t n = (nl ? nl : end) - str;
+
+		if (tx_add(str, n) != n)
+			return 1;
+		if (!nl)
+			break;
+		/* Do newline to CRLF translation */
+		if (tx_add("\r\n", 2) != 2)
+			return 1;
+		str = nl + 1;
 	}
+
+	return 0;
+}
+
+static int tx_done(int ret)
+{
+	hook_call_deferred(&tx_flush_data, 0);
+	return ret;
 }
 
 /*
@@ -206,53 +236,21 @@ int usb_getc(void)
 
 int usb_putc(int c)
 {
-	int ret;
-	int tx_idx = 0;
-
-	ret = usb_wait_console();
-	if (ret)
-		return ret;
-
-	ret = __tx_char(&tx_idx, c);
-	usb_enable_tx(tx_idx);
-
-	return ret;
+	return tx_done(__tx_char(NULL, c) ? EC_ERROR_OVERFLOW : EC_SUCCESS);
 }
 
 int usb_puts(const char *outstr)
 {
-	int ret;
-	int tx_idx = 0;
-
-	ret = usb_wait_console();
-	if (ret)
-		return ret;
-
 	/* Put all characters in the output buffer */
-	while (*outstr) {
-		if (__tx_char(&tx_idx, *outstr++) != 0)
-			break;
-	}
-
-	usb_enable_tx(tx_idx);
+	int dropped = __tx_str(NULL, outstr, strlen(outstr));
 
 	/* Successful if we consumed all output */
-	return *outstr ? EC_ERROR_OVERFLOW : EC_SUCCESS;
+	return tx_done(dropped ? EC_ERROR_OVERFLOW : EC_SUCCESS);
 }
 
 int usb_vprintf(const char *format, va_list args)
 {
-	int ret;
-	int tx_idx = 0;
-
-	ret = usb_wait_console();
-	if (ret)
-		return ret;
-
-	ret = vfnprintf(__tx_char, &tx_idx, format, args);
-
-	usb_enable_tx(tx_idx);
-	return ret;
+	return tx_done(vfnprintf_span(__tx_str, NULL, format, args));
 }
 
 void usb_console_enable(int enabled, int readonly)
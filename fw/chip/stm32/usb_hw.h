@@ -6,6 +6,8 @@
 #ifndef __CROS_EC_USB_HW_H
 #define __CROS_EC_USB_HW_H
 
+#include "timer.h"
+
 /* Event types for the endpoint event handler. */
 enum usb_ep_event {
 	USB_EVENT_RESET,
@@ -91,6 +93,16 @@ void *memcpy_from_usbram(void *dest, const void *src, size_t n);
 	(*_EP_EVENT_HANDLER_TYPECHECK(num))(enum usb_ep_event evt)\
 			= evt_handler
 
+#ifdef CONFIG_USB_SOF_LATCH
+/*
+ * Latch the clock at the next USB start of frame : usb_sof_latched(), which
+ * the board provides, is then called from the USB interrupt with the 11-bit
+ * frame number and the time of the interrupt.
+ */
+void usb_sof_arm(void);
+void usb_sof_latched(uint16_t frame, timestamp_t tstamp);
+#endif
+
 /* arrays with all endpoint callbacks */
 extern void (*usb_ep_tx[]) (void);
 extern void (*usb_ep_rx[]) (void);
@@ -4,6 +4,7 @@
  */
 
 #include "adc.h"
+#include "adc_chip.h"
 #include "clock.h"
 #include "common.h"
 #include "console.h"
@@ -16,9 +17,12 @@
 #include "system.h"
 #include "task.h"
 #include "timer.h"
+#include "token_log.h"
+#include "tracepoint.h"
 #include "util.h"
 #include "usb_pd.h"
 #include "usb_pd_config.h"
+#include "usb_pd_decode.h"
 
 #ifdef CONFIG_COMMON_RUNTIME
 #define CPRINTF(format, args...) cprintf(CC_USBPD, format, ## args)
@@ -27,6 +31,12 @@
 #define CPRINTF(format, args...)
 #define CPRINTS(format, args...)
 #endif
+/* Messages of the RX path, tokenized in the token log build */
+#ifdef CONFIG_TOKEN_LOG
+#define CPRINTS_HOT(format, args...) TOKEN_LOG(format, ## args)
+#else
+#define CPRINTS_HOT(format, args...) CPRINTS(format, ## args)
+#endif
 
 #define PD_DATARATE 300000 /* Hz */
 
@@ -49,19 +59,23 @@
 #define TX_CLOCK_DIV ((clock_get_freq() / (2*PD_DATARATE)))
 
 /* threshold for 1 300-khz period */
-#define PERIOD 4
+#define PERIOD PD_DECODE_PERIOD
 #define NB_PERIOD(from, to) ((((to) - (from) + (PERIOD/2)) & 0xFF) / PERIOD)
-#define PERIOD_THRESHOLD ((PERIOD + 2*PERIOD) / 2)
 
 static struct pd_physical {
 	/* samples for the PD messages */
 	uint32_t raw_samples[DIV_ROUND_UP(PD_MAX_RAW_SIZE, sizeof(uint32_t))];
 
-	/* state of the bit decoder */
-	int d_toggle;
-	int d_lastlen;
-	uint32_t d_last;
+	/* bit decoder reading raw_samples */
+	struct pd_decoder dec;
 	int b_toggle;
+#ifdef CONFIG_USB_PD_RX_REPLAY
+	int replay; /* samples loaded by pd_rx_load_x(), 0 for the DMA */
+#endif
+	/* byte repeated by pd_start_tx_fill() */
+	uint8_t tx_fill;
+	/* duration of the transmission started last */
+	uint32_t tx_us;
 
 	/* DMA structures for each PD port */
 	struct dma_option dma_tx_option;
@@ -79,112 +93,80 @@ static int rx_edge_ts_idx[CONFIG_USB_PD_PORT_COUNT];
 /* keep track of transmit polarity for DMA interrupt */
 static int tx_dma_polarities[CONFIG_USB_PD_PORT_COUNT];
 
+struct pd_decoder *pd_get_decoder(int port)
+{
+	return &pd_phy[port].dec;
+}
+
+void pd_set_rx_period(int port, int period16)
+{
+	pd_decode_set_period(&pd_phy[port].dec, period16);
+}
+
+int pd_get_rx_period(int port)
+{
+	return pd_phy[port].dec.period16;
+}
+
 void pd_init_dequeue(int port)
 {
-	/* preamble ends with 1 */
-	pd_phy[port].d_toggle = 0;
-	pd_phy[port].d_last = 0;
-	pd_phy[port].d_lastlen = 0;
+	pd_decode_init(&pd_phy[port].dec);
 }
 
-static int wait_bits(int port, int nb)
+/* Edges captured while the decoder sleeps : 16 take at least 26us */
+#define RX_CHUNK_SAMPLES 16
+#define RX_CHUNK_US (RX_CHUNK_SAMPLES * SECOND / (2 * PD_DATARATE))
+
+/*
+ * The decoder has caught up with the DMA : let the other tasks run while
+ * the next chunk of edges is captured rather than spinning on the counter.
+ * The decoding state is kept in pd_phy, so it resumes where it stopped.
+ */
+static void rx_yield(int port)
+{
+	if (task_start_called() && !in_interrupt_context() &&
+	    !(pd_phy[port].tim_rx->sr & 4))
+		usleep(RX_CHUNK_US);
+}
+
+/*
+ * Decoder sample source : wait for at least 'nb' samples captured by the DMA,
+ * returns the number of samples received.
+ */
+static int wait_bits(struct pd_decoder *dec, int nb)
 {
+	int port = (int)dec->priv;
 	int avail;
 	stm32_dma_chan_t *rx = dma_get_channel(DMAC_TIM_RX(port));
 
+#ifdef CONFIG_USB_PD_RX_REPLAY
+	/* every replayed sample is there already */
+	if (pd_phy[port].replay)
+		return pd_phy[port].replay >= nb ? pd_phy[port].replay : -1;
+#endif
 	avail = dma_bytes_done(rx, PD_MAX_RAW_SIZE);
 	if (avail < nb) { /* no received yet ... */
+		rx_yield(port);
 		while ((dma_bytes_done(rx, PD_MAX_RAW_SIZE) < nb)
 			&& !(pd_phy[port].tim_rx->sr & 4))
-			; /* optimized for latency, not CPU usage ... */
-		if (dma_bytes_done(rx, PD_MAX_RAW_SIZE) < nb) {
-			CPRINTS("PD TMOUT RX %d/%d",
-				dma_bytes_done(rx, PD_MAX_RAW_SIZE), nb);
+			; /* the end of the chunk is close : spin */
+		avail = dma_bytes_done(rx, PD_MAX_RAW_SIZE);
+		if (avail < nb) {
+			CPRINTS_HOT("PD TMOUT RX %d/%d", avail, nb);
 			return -1;
 		}
 	}
-	return nb;
+	return avail;
 }
 
-int pd_dequeue_bits(int port, int off, int len, uint32_t *val)
+int __ram_code pd_dequeue_bits(int port, int off, int len, uint32_t *val)
 {
-	int w;
-	uint8_t cnt = 0xff;
-	uint8_t *samples = (uint8_t *)pd_phy[port].raw_samples;
-
-	while ((pd_phy[port].d_lastlen < len) && (off < PD_MAX_RAW_SIZE - 1)) {
-		w = wait_bits(port, off + 2);
-		if (w < 0)
-			goto stream_err;
-		cnt = samples[off] - samples[off-1];
-		if (!cnt || (cnt > 3*PERIOD))
-			goto stream_err;
-		off++;
-		if (cnt <= PERIOD_THRESHOLD) {
-			/*
-			w = wait_bits(port, off + 1);
-			if (w < 0)
-				goto stream_err;
-			*/
-			cnt = samples[off] - samples[off-1];
-			if (cnt >  PERIOD_THRESHOLD)
-				goto stream_err;
-			off++;
-		}
-
-		/* enqueue the bit of the last period */
-		pd_phy[port].d_last = (pd_phy[port].d_last >> 1)
-		       | (cnt <= PERIOD_THRESHOLD ? 0x80000000 : 0);
-		pd_phy[port].d_lastlen++;
-	}
-	if (off < PD_MAX_RAW_SIZE) {
-		*val = (pd_phy[port].d_last << (pd_phy[port].d_lastlen - len))
-				>> (32 - len);
-		pd_phy[port].d_lastlen -= len;
-		return off;
-	} else {
-		return -1;
-	}
-stream_err:
-	/* CPRINTS("PD Invalid %d @%d", cnt, off); */
-	return -1;
+	return pd_decode_bits(&pd_phy[port].dec, off, len, val);
 }
 
-int pd_find_preamble(int port)
+int __ram_code pd_find_preamble(int port)
 {
-	int bit;
-	uint8_t *vals = (uint8_t *)pd_phy[port].raw_samples;
-
-	/*
-	 * Detect preamble
-	 * Alternate 1-period 1-period & 2-period.
-	 */
-	uint32_t all = 0;
-	stm32_dma_chan_t *rx = dma_get_channel(DMAC_TIM_RX(port));
-
-	for (bit = 1; bit < PD_MAX_RAW_SIZE - 1; bit++) {
-		uint8_t cnt;
-		/* wait if the bit is not received yet ... */
-		if (PD_MAX_RAW_SIZE - rx->cndtr < bit + 1) {
-			while ((PD_MAX_RAW_SIZE - rx->cndtr < bit + 1) &&
-				!(pd_phy[port].tim_rx->sr & 4))
-				;
-			if (pd_phy[port].tim_rx->sr & 4) {
-				CPRINTS("PD TMOUT RX %d/%d",
-					PD_MAX_RAW_SIZE - rx->cndtr, bit);
-				return -1;
-			}
-		}
-		cnt = vals[bit] - vals[bit-1];
-		all = (all >> 1) | (cnt <= PERIOD_THRESHOLD ? 1 << 31 : 0);
-		if (all == 0x36db6db6)
-			return bit - 1; /* should be SYNC-1 */
-		if (all == 0xF33F3F3F)
-			return PD_RX_ERR_HARD_RESET; /* got HARD-RESET */
-		if (all == 0x3c7fe0ff)
-			return PD_RX_ERR_CABLE_RESET; /* got CABLE-RESET */
-	}
-	return -1;
+	return pd_decode_preamble(&pd_phy[port].dec);
 }
 
 int pd_write_preamble(int port)
@@ -297,6 +279,7 @@ static void tx_dma_done(void *data)
 
 	/* Stop counting */
 	pd_phy[port].tim_tx->cr1 &= ~1;
+	TRACEPOINT(TP_PD_TX_DONE, port);
 
 	/* put TX pins and reference in Hi-Z */
 	pd_tx_disable(port, polarity);
@@ -306,7 +289,38 @@ static void tx_dma_done(void *data)
 #endif
 }
 
-int pd_start_tx(int port, int polarity, int bit_len)
+const uint32_t *pd_get_raw_samples(int port)
+{
+	return pd_phy[port].raw_samples;
+}
+
+uint32_t *pd_get_tx_spare(int port, int bit_len, int *bits)
+{
+	/* pd_write_last_edge() clears the word after the image */
+	int off = DIV_ROUND_UP(bit_len, 32) + 1;
+
+	*bits = (ARRAY_SIZE(pd_phy[port].raw_samples) - off) * 32;
+	return pd_phy[port].raw_samples + off;
+}
+
+int pd_phy_busy(int port)
+{
+	/* the TX timer runs until the end of the transmission */
+	if (pd_phy[port].tim_tx->cr1 & 1)
+		return 1;
+#ifndef CONFIG_USB_PD_TX_PHY_ONLY
+	return pd_rx_started(port);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Send 'count' bytes from 'buf', or the byte at 'buf' 'count' times if
+ * 'fixed' is set : the DMA counts the bytes, its end stops the SPI clock.
+ */
+static int tx_start(int port, int polarity, const void *buf, int count,
+		    int fixed)
 {
 	stm32_dma_chan_t *tx = dma_get_channel(DMAC_SPI_TX(port));
 
@@ -329,9 +343,11 @@ int pd_start_tx(int port, int polarity, int bit_len)
 	pd_phy[port].tim_tx->cnt = TX_CLOCK_DIV - 1;
 
 	/* update DMA configuration */
-	dma_prepare_tx(&(pd_phy[port].dma_tx_option),
-			DIV_ROUND_UP(bit_len, 8),
-			pd_phy[port].raw_samples);
+	dma_prepare_tx(&(pd_phy[port].dma_tx_option), count, buf);
+	if (fixed)
+		tx->ccr &= ~STM32_DMA_CCR_MINC;
+	/* 8 bits at 600kHz per byte */
+	pd_phy[port].tx_us = count * 40 / 3;
 	/* Flush data in write buffer so that DMA can get the latest data */
 	asm volatile("dmb;");
 
@@ -359,15 +375,39 @@ int pd_start_tx(int port, int polarity, int bit_len)
 
 	/* Start counting at 300Khz*/
 	pd_phy[port].tim_tx->cr1 |= 1;
+	TRACEPOINT(TP_PD_TX_START, count * 8);
+
+	return 0;
+}
 
-	return bit_len;
+int pd_start_tx_buf(int port, int polarity, const uint32_t *buf, int bit_len)
+{
+	int rv = tx_start(port, polarity, buf, DIV_ROUND_UP(bit_len, 8), 0);
+
+	return rv < 0 ? rv : bit_len;
+}
+
+int pd_start_tx_fill(int port, int polarity, uint8_t byte, int count)
+{
+	/* the DMA counter is 16-bit */
+	if (count <= 0 || count > 0xffff)
+		return -1;
+	pd_phy[port].tx_fill = byte;
+	return tx_start(port, polarity, &pd_phy[port].tx_fill, count, 1);
+}
+
+int pd_start_tx(int port, int polarity, int bit_len)
+{
+	return pd_start_tx_buf(port, polarity, pd_phy[port].raw_samples,
+			       bit_len);
 }
 
 void pd_tx_done(int port, int polarity)
 {
 #if defined(CONFIG_COMMON_RUNTIME) && defined(CONFIG_DMA_DEFAULT_HANDLERS)
 	/* wait for DMA, DMA interrupt will stop the SPI clock */
-	task_wait_event_mask(TASK_EVENT_DMA_TC, DMA_TRANSFER_TIMEOUT_US);
+	task_wait_event_mask(TASK_EVENT_DMA_TC, DMA_TRANSFER_TIMEOUT_US +
+			     pd_phy[port].tx_us);
 	dma_disable_tc_interrupt(DMAC_SPI_TX(port));
 #else
 	tx_dma_polarities[port] = polarity;
@@ -405,6 +445,7 @@ void pd_rx_start(int port)
 	pd_phy[port].tim_rx->egr = 0x0001; /* reset counter / reload PSC */;
 	pd_phy[port].tim_rx->sr = 0; /* clear overflows */
 	pd_phy[port].tim_rx->cr1 |= 1;
+	TRACEPOINT(TP_PD_RX_START, port);
 }
 
 void pd_rx_complete(int port)
@@ -415,12 +456,80 @@ void pd_rx_complete(int port)
 	dma_disable(DMAC_TIM_RX(port));
 }
 
+int pd_rx_last_edge(int port)
+{
+	uint8_t *vals = (uint8_t *)pd_phy[port].raw_samples;
+	stm32_dma_chan_t *rx = dma_get_channel(DMAC_TIM_RX(port));
+	int nb = dma_bytes_done(rx, PD_MAX_RAW_SIZE);
+	int ticks, i;
+
+	if (!nb)
+		return 0;
+	/* the counter is reset on start : unwrap the 8-bit samples */
+	ticks = vals[0];
+	for (i = 1; i < nb; i++)
+		ticks += (uint8_t)(vals[i] - vals[i-1]);
+	return ticks;
+}
+
+int pd_rx_edge_count(int port)
+{
+	return dma_bytes_done(dma_get_channel(DMAC_TIM_RX(port)),
+			      PD_MAX_RAW_SIZE);
+}
+
 int pd_rx_started(int port)
 {
 	/* is the sampling timer running ? */
 	return pd_phy[port].tim_rx->cr1 & 1;
 }
 
+#ifdef CONFIG_USB_PD_RX_REPLAY
+int pd_rx_load_image(int port, int bit_len)
+{
+	uint32_t image[DIV_ROUND_UP(PD_MAX_RAW_SIZE, 32)];
+	uint8_t *samples = (uint8_t *)pd_phy[port].raw_samples;
+	int i, n = 0, level = 0;
+
+	if (bit_len <= 0) {
+		pd_phy[port].replay = 0;
+		return 0;
+	}
+	if (bit_len > PD_MAX_RAW_SIZE)
+		return -EC_ERROR_INVAL;
+	if (pd_phy_busy(port))
+		return -EC_ERROR_BUSY;
+
+	/* the TX image and the RX samples share the buffer */
+	memcpy(image, pd_phy[port].raw_samples,
+	       DIV_ROUND_UP(bit_len, 32) * sizeof(uint32_t));
+	/* an edge on every level change, PERIOD timer ticks per half-bit */
+	for (i = 0; i < bit_len; i++)
+		if (((image[i / 32] >> (i % 32)) & 1) != level) {
+			level = !level;
+			samples[n++] = i * PERIOD;
+		}
+	pd_phy[port].replay = n;
+	return n;
+}
+
+int pd_rx_load_samples(int port, const uint8_t *samples, int count)
+{
+	if (count <= 0) {
+		pd_phy[port].replay = 0;
+		return 0;
+	}
+	if (pd_phy_busy(port))
+		return -EC_ERROR_BUSY;
+
+	/* the RX DMA stops at the end of the buffer too */
+	count = MIN(count, PD_MAX_RAW_SIZE);
+	memcpy(pd_phy[port].raw_samples, samples, count);
+	pd_phy[port].replay = count;
+	return count;
+}
+#endif
+
 void pd_rx_enable_monitoring(int port)
 {
 	/* clear comparator external interrupt */
@@ -494,6 +603,9 @@ defined(CONFIG_USB_PD_LOW_POWER_IDLE_WHEN_CONNECTED)
 			rx_edge_ts_idx[i] = next_idx;
 		}
 	}
+#ifdef CONFIG_ADC_WATCHDOG_COMP_IRQ
+	adc_watchdog_interrupt();
+#endif
 }
 #ifdef CONFIG_USB_PD_RX_COMP_IRQ
 DECLARE_IRQ(STM32_IRQ_COMP, pd_rx_handler, 1);
@@ -516,6 +628,12 @@ void pd_hw_init_rx(int port)
 	/* configure registers used for timers */
 	phy->tim_rx = (void *)TIM_REG_RX(port);
 
+	/* the decoder reads the edges captured by the RX DMA */
+	phy->dec.samples = (uint8_t *)phy->raw_samples;
+	phy->dec.size = PD_MAX_RAW_SIZE;
+	phy->dec.wait = wait_bits;
+	phy->dec.priv = (void *)port;
+
 	/* configure RX DMA */
 	phy->dma_tim_option.channel = DMAC_TIM_RX(port);
 	phy->dma_tim_option.periph = (void *)(TIM_RX_CCR_REG(port));
@@ -666,3 +784,8 @@ void pd_set_clock(int port, int freq)
 {
 	pd_phy[port].tim_tx->arr = clock_get_freq() / (2*freq);
 }
+
+int pd_get_clock(int port)
+{
+	return clock_get_freq() / (2 * pd_phy[port].tim_tx->arr);
+}
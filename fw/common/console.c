@@ -122,30 +122,44 @@ static int split_words(char *input, int *argc, char **argv)
  * command.  So "foo" will match "foobar" as long as there isn't also a
  * command "food".
  *
+ * The linker sorts the commands by name (SORT(.rodata.cmds*)), and the names
+ * are lowercase : look the input up by binary search, folded to lowercase.
+ *
  * @param name		Command name to find.
  *
  * @return A pointer to the command structure, or NULL if no match found.
  */
-static const struct console_command *find_command(char *name)
+const struct console_command *console_find_command(char *name)
 {
-	const struct console_command *cmd, *match = NULL;
-	int match_length = strlen(name);
-
-	for (cmd = __cmds; cmd < __cmds_end; cmd++) {
-		if (!strncasecmp(name, cmd->name, match_length)) {
-			if (match)
-				return NULL;
-			/*
-			 * Check if 'cmd->name' is of the same length as
-			 * 'name'. If yes, then we have a full match.
-			 */
-			if (cmd->name[match_length] == '\0')
-				return cmd;
-			match = cmd;
-		}
-	}
+	const struct console_command *lo = __cmds, *hi = __cmds_end, *mid;
+	char key[16];
+	int len = strlen(name);
+	int i;
 
-	return match;
+	/* the names are shorter than the key, see _DCL_CON_CMD_ALL() */
+	if (len >= sizeof(key))
+		return NULL;
+	for (i = 0; i <= len; i++)
+		key[i] = tolower(name[i]);
+
+	/* first command not lower than the key */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(mid->name, key, sizeof(key)) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == __cmds_end || strncmp(lo->name, key, len))
+		return NULL;
+	/* a full match sorts before the longer names it is a prefix of */
+	if (lo->name[len] == '\0')
+		return lo;
+	/* a prefix match must be unique */
+	if (lo + 1 < __cmds_end && !strncmp(lo[1].name, key, len))
+		return NULL;
+
+	return lo;
 }
 
 
@@ -234,7 +248,7 @@ command_has_error:
 	if (!argc)
 		return EC_SUCCESS;
 
-	cmd = find_command(argv[0]);
+	cmd = console_find_command(argv[0]);
 	if (!cmd) {
 		ccprintf("Command '%s' not found or ambiguous.\n", argv[0]);
 		return EC_ERROR_UNKNOWN;
@@ -714,7 +728,7 @@ static int command_help(int argc, char **argv)
 			ccputs("HELP CMD = help on CMD.\n");
 			return EC_SUCCESS;
 		}
-		cmd = find_command(argv[1]);
+		cmd = console_find_command(argv[1]);
 		if (!cmd) {
 			ccprintf("Command '%s' not found or ambiguous.\n",
 				 argv[1]);
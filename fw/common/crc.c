@@ -73,22 +73,42 @@ static uint32_t crc32_hash(uint32_t crc, const void *buf, int size)
 	return crc;
 }
 
+void crc32_ctx_init(uint32_t *ctx)
+{
+	*ctx = CRC32_INITIAL;
+}
+
+void crc32_ctx_hash32(uint32_t *ctx, uint32_t val)
+{
+	*ctx = crc32_hash(*ctx, &val, sizeof(uint32_t));
+}
+
+void crc32_ctx_hash16(uint32_t *ctx, uint16_t val)
+{
+	*ctx = crc32_hash(*ctx, &val, sizeof(uint16_t));
+}
+
+uint32_t crc32_ctx_result(uint32_t *ctx)
+{
+	return *ctx ^ 0xFFFFFFFF;
+}
+
 void crc32_init(void)
 {
-	crc_ = CRC32_INITIAL;
+	crc32_ctx_init(&crc_);
 }
 
 void crc32_hash32(uint32_t val)
 {
-	crc_ = crc32_hash(crc_, &val, sizeof(uint32_t));
+	crc32_ctx_hash32(&crc_, val);
 }
 
 void crc32_hash16(uint16_t val)
 {
-	crc_ = crc32_hash(crc_, &val, sizeof(uint16_t));
+	crc32_ctx_hash16(&crc_, val);
 }
 
 uint32_t crc32_result(void)
 {
-	return crc_ ^ 0xFFFFFFFF;
+	return crc32_ctx_result(&crc_);
 }
@@ -9,6 +9,7 @@
 #include "console.h"
 #include "hooks.h"
 #include "link_defs.h"
+#include "task.h"
 #include "timer.h"
 #include "util.h"
 
@@ -55,6 +56,104 @@ static const struct hook_ptrs hook_list[] = {
 static int defer_new_call;
 static int hook_task_started;
 
+/*
+ * Pending deferred functions : min-heap of their indexes on the firing time,
+ * with the heap position + 1 of each function (0 when it is not pending).
+ * Both are only accessed with the interrupts masked, hook_call_deferred()
+ * may be called from an interrupt.
+ */
+#define deferred_heap __deferred_heap
+#define deferred_pos (__deferred_heap + DEFERRED_FUNCS_COUNT)
+static int deferred_count;
+
+static void heap_set(int p, int i)
+{
+	deferred_heap[p] = i;
+	deferred_pos[i] = p + 1;
+}
+
+static void heap_up(int p, int i)
+{
+	while (p) {
+		int parent = (p - 1) / 2;
+
+		if (__deferred_until[deferred_heap[parent]] <=
+		    __deferred_until[i])
+			break;
+		heap_set(p, deferred_heap[parent]);
+		p = parent;
+	}
+	heap_set(p, i);
+}
+
+static void heap_down(int p, int i)
+{
+	while (1) {
+		int c = 2 * p + 1;
+
+		if (c >= deferred_count)
+			break;
+		if (c + 1 < deferred_count &&
+		    __deferred_until[deferred_heap[c + 1]] <
+		    __deferred_until[deferred_heap[c]])
+			c++;
+		if (__deferred_until[i] <= __deferred_until[deferred_heap[c]])
+			break;
+		heap_set(p, deferred_heap[c]);
+		p = c;
+	}
+	heap_set(p, i);
+}
+
+static void heap_remove(int i)
+{
+	int p = deferred_pos[i] - 1;
+	int last;
+
+	deferred_pos[i] = 0;
+	__deferred_until[i] = 0;
+	if (--deferred_count == p)
+		return;
+	/* move the last function to the hole */
+	last = deferred_heap[deferred_count];
+	if (p && __deferred_until[last] <
+		 __deferred_until[deferred_heap[(p - 1) / 2]])
+		heap_up(p, last);
+	else
+		heap_down(p, last);
+}
+
+/*
+ * Take the pending deferred function with the earliest firing time if it is
+ * before 't', return its index or -1.
+ */
+static int deferred_pop_expired(uint64_t t)
+{
+	uint32_t int_mask = get_int_mask();
+	int i = -1;
+
+	interrupt_disable();
+	if (deferred_count && __deferred_until[deferred_heap[0]] < t) {
+		i = deferred_heap[0];
+		heap_remove(i);
+	}
+	set_int_mask(int_mask);
+	return i;
+}
+
+/* Earliest firing time of the pending deferred functions, 0 if none */
+static uint64_t deferred_next(void)
+{
+	uint32_t int_mask = get_int_mask();
+	uint64_t until = 0;
+
+	interrupt_disable();
+	if (deferred_count)
+		until = __deferred_until[deferred_heap[0]];
+	set_int_mask(int_mask);
+	return until;
+}
+
 #ifdef CONFIG_HOOK_DEBUG
 /* Stats for hooks */
 static uint64_t max_hook_tick_delay;
@@ -134,16 +233,25 @@ void hook_notify(enum hook_type type)
 int hook_call_deferred(const struct deferred_data *data, int us)
 {
 	int i = data - __deferred_funcs;
+	uint64_t until;
+	uint32_t int_mask;
 
 	if (data < __deferred_funcs || data >= __deferred_funcs_end)
 		return EC_ERROR_INVAL;  /* Routine not registered */
 
-	if (us == -1) {
-		/* Cancel */
-		__deferred_until[i] = 0;
-	} else {
+	until = get_time().val + us;
+	int_mask = get_int_mask();
+	interrupt_disable();
+	if (deferred_pos[i])
+		heap_remove(i);
+	if (us != -1) {
 		/* Set alarm */
-		__deferred_until[i] = get_time().val + us;
+		__deferred_until[i] = until;
+		heap_up(deferred_count++, i);
+	}
+	set_int_mask(int_mask);
+
+	if (us != -1) {
 		/*
 		 * Flag that hook_call_deferred() has been called.  If the hook
 		 * task is already active, this will allow it to go through the
@@ -175,21 +283,18 @@ void hook_task(void)
 
 	while (1) {
 		uint64_t t = get_time().val;
+		uint64_t until;
 		int next = 0;
 		int i;
 
-		/* Handle deferred routines */
-		for (i = 0; i < DEFERRED_FUNCS_COUNT; i++) {
-			if (__deferred_until[i] && __deferred_until[i] < t) {
-				CPRINTS("hook call deferred 0x%p",
-					__deferred_funcs[i].routine);
-				/*
-				 * Call deferred function.  Clear timer first,
-				 * so it can request itself be called later.
-				 */
-				__deferred_until[i] = 0;
-				__deferred_funcs[i].routine();
-			}
+		/*
+		 * Handle deferred routines.  Each one leaves the heap before
+		 * its call, so it can request itself be called later.
+		 */
+		while ((i = deferred_pop_expired(t)) >= 0) {
+			CPRINTS("hook call deferred 0x%p",
+				__deferred_funcs[i].routine);
+			__deferred_funcs[i].routine();
 		}
 
 		if (t - last_tick >= HOOK_TICK_INTERVAL) {
@@ -220,14 +325,12 @@ void hook_task(void)
 		/* Wake earlier if needed by a deferred routine */
 		defer_new_call = 0;
 
-		for (i = 0; i < DEFERRED_FUNCS_COUNT && next > 0; i++) {
-			if (!__deferred_until[i])
-				continue;
-
-			if (__deferred_until[i] < t)
+		until = deferred_next();
+		if (until && next > 0) {
+			if (until < t)
 				next = 0;
-			else if (__deferred_until[i] - t < next)
-				next = __deferred_until[i] - t;
+			else if (until - t < next)
+				next = until - t;
 		}
 
 		/*
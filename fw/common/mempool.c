@@ -0,0 +1,59 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Fixed-size block pool implementation.
+ */
+#include "mempool.h"
+#include "task.h"
+#include "util.h"
+
+int mempool_init(struct mempool *pool, void *buf, size_t size,
+		 size_t block_size)
+{
+	block_size = (MAX(block_size, sizeof(void *)) + 3) & ~3;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->start = buf;
+	pool->block_size = block_size;
+	pool->count = MIN(size / block_size, 0xffff);
+	return pool->count;
+}
+
+void *mempool_alloc(struct mempool *pool)
+{
+	uint32_t int_mask = get_int_mask();
+	void *block = NULL;
+
+	interrupt_disable();
+	if (pool->free_list) {
+		block = pool->free_list;
+		pool->free_list = *(void **)block;
+	} else if (pool->fresh < pool->count) {
+		block = pool->start + pool->fresh++ * pool->block_size;
+	}
+	if (block) {
+		if (++pool->used > pool->max_used)
+			pool->max_used = pool->used;
+	} else {
+		pool->failures++;
+	}
+	set_int_mask(int_mask);
+
+	return block;
+}
+
+void mempool_free(struct mempool *pool, void *block)
+{
+	uint32_t int_mask;
+
+	if (!block)
+		return;
+
+	int_mask = get_int_mask();
+	interrupt_disable();
+	*(void **)block = pool->free_list;
+	pool->free_list = block;
+	pool->used--;
+	set_int_mask(int_mask);
+}
@@ -95,7 +95,7 @@ void pd_log_event(uint8_t type, uint8_t size_port,
 	log_add_event(type, size_port, data, payload, timestamp);
 }
 
-static int pd_log_dequeue(struct ec_response_pd_log *r)
+int pd_log_dequeue(struct ec_response_pd_log *r)
 {
 	uint32_t now = get_time().val >> PD_LOG_TIMESTAMP_SHIFT;
 	unsigned total_size, first;
@@ -50,8 +50,58 @@ static int hexdigit(int c)
 #define PF_SIGN		(1 << 2)  /* Add sign (+) for a positive number */
 #define PF_64BIT	(1 << 3)  /* Number is 64-bit */
 
-int vfnprintf(int (*addchar)(void *context, int c), void *context,
-	      const char *format, va_list args)
+/* Output of the formatting, a character or a span at a time */
+struct printf_sink {
+	int (*addchar)(void *context, int c);
+	int (*addstr)(void *context, const char *str, int len);
+	void *context;
+};
+
+static int put_char(const struct printf_sink *sink, int c)
+{
+	char ch = c;
+
+	if (sink->addchar)
+		return sink->addchar(sink->context, c);
+	return sink->addstr(sink->context, &ch, 1);
+}
+
+static int put_span(const struct printf_sink *sink, const char *str, int len)
+{
+	if (len <= 0)
+		return 0;
+	if (sink->addstr)
+		return sink->addstr(sink->context, str, len);
+	while (len--)
+		if (sink->addchar(sink->context, *str++))
+			return 1;
+	return 0;
+}
+
+static int put_pad(const struct printf_sink *sink, int c, int len)
+{
+	static const char zeros[] = "0000000000000000";
+	static const char spaces[] = "                ";
+	const char *pad = c == '0' ? zeros : spaces;
+
+	while (len > 0) {
+		int n = MIN(len, (int)sizeof(zeros) - 1);
+
+		if (put_span(sink, pad, n))
+			return 1;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Powers of ten for the fraction of the fixed point numbers */
+static const uint32_t pow10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+	1000000000
+};
+
+static int do_printf(const struct printf_sink *sink, const char *format,
+		     va_list args)
 {
 	/*
 	 * Longest uint64 in decimal = 20
@@ -67,12 +117,15 @@ int vfnprintf(int (*addchar)(void *context, int c), void *context,
 	int vlen;
 
 	while (*format) {
+		const char *start = format;
 		int c = *format++;
 		char sign = 0;
 
-		/* Copy normal characters */
+		/* Copy normal characters, up to the next format */
 		if (c != '%') {
-			if (addchar(context, c))
+			while (*format && *format != '%')
+				format++;
+			if (put_span(sink, start, format - start))
 				return EC_ERROR_OVERFLOW;
 			continue;
 		}
@@ -85,7 +138,7 @@ int vfnprintf(int (*addchar)(void *context, int c), void *context,
 
 		/* Send "%" for "%%" input */
 		if (c == '%' || c == '\0') {
-			if (addchar(context, '%'))
+			if (put_char(sink, '%'))
 				return EC_ERROR_OVERFLOW;
 			continue;
 		}
@@ -93,7 +146,7 @@ int vfnprintf(int (*addchar)(void *context, int c), void *context,
 		/* Handle %c */
 		if (c == 'c') {
 			c = va_arg(args, int);
-			if (addchar(context, c))
+			if (put_char(sink, c))
 				return EC_ERROR_OVERFLOW;
 			continue;
 		}
@@ -167,15 +220,23 @@ int vfnprintf(int (*addchar)(void *context, int c), void *context,
 				continue;
 			}
 
-			for (; precision; precision--, vstr++) {
-				if (addchar(context, hexdigit(*vstr >> 4)) ||
-				    addchar(context, hexdigit(*vstr)))
+			/* Dump as many bytes as fit in intbuf at a time */
+			while (precision) {
+				int n = MIN(precision, (int)sizeof(intbuf) / 2);
+
+				for (vlen = 0; vlen < n; vlen++, vstr++) {
+					intbuf[2 * vlen] = hexdigit(*vstr >> 4);
+					intbuf[2 * vlen + 1] = hexdigit(*vstr);
+				}
+				if (put_span(sink, intbuf, 2 * n))
 					return EC_ERROR_OVERFLOW;
+				precision -= n;
 			}
 
 			continue;
 		} else {
 			int base = 10;
+			int shift = 0;
 #ifdef NO_UINT64_SUPPORT
 			uint32_t v;
 
@@ -233,9 +294,11 @@ int vfnprintf(int (*addchar)(void *context, int c), void *context,
 			case 'x':
 			case 'p':
 				base = 16;
+				shift = 4;
 				break;
 			case 'b':
 				base = 2;
+				shift = 1;
 				break;
 			default:
 				format = error_str;
@@ -259,26 +322,43 @@ int vfnprintf(int (*addchar)(void *context, int c), void *context,
 
 			/*
 			 * Handle digits to right of decimal for fixed point
-			 * numbers.
+			 * numbers. Split the fraction off with a single
+			 * division when it fits in 32 bits, the digits then
+			 * come from 32-bit arithmetic (e.g. the timestamps).
 			 */
-			for (vlen = 0; vlen < precision; vlen++)
-				*(--vstr) = '0' + divmod(&v, 10);
+			if (precision && precision < ARRAY_SIZE(pow10)) {
+				uint32_t frac = divmod(&v, pow10[precision]);
+
+				for (vlen = 0; vlen < precision; vlen++) {
+					*(--vstr) = '0' + frac % 10;
+					frac /= 10;
+				}
+			} else {
+				for (vlen = 0; vlen < precision; vlen++)
+					*(--vstr) = '0' + divmod(&v, 10);
+			}
 			if (precision)
 				*(--vstr) = '.';
 
 			if (!v)
 				*(--vstr) = '0';
 
-			while (v) {
-				int digit = divmod(&v, base);
-				if (digit < 10)
-					*(--vstr) = '0' + digit;
-				else if (c == 'X')
-					*(--vstr) = 'A' + digit - 10;
-				else
-					*(--vstr) = 'a' + digit - 10;
+			if (shift) {
+				/* Power of 2 bases : no division at all */
+				const char a = c == 'X' ? 'A' : 'a';
+
+				while (v) {
+					int digit = v & (base - 1);
+
+					*(--vstr) = digit < 10 ? '0' + digit :
+							a + digit - 10;
+					v >>= shift;
+				}
 			}
 
+			while (v)
+				*(--vstr) = '0' + divmod(&v, 10);
+
 			if (sign)
 				*(--vstr) = sign;
 
@@ -296,29 +376,48 @@ int vfnprintf(int (*addchar)(void *context, int c), void *context,
 		if (precision > 0 && pad_width > precision)
 			pad_width = precision;
 
-		/* If precision is zero, print everything */
-		if (!precision)
-			precision = MAX(vlen, pad_width);
+		/* Padding is counted on the whole string */
+		pad_width -= vlen;
 
-		while (vlen < pad_width && !(flags & PF_LEFT)) {
-			if (addchar(context, flags & PF_PADZERO ? '0' : ' '))
-				return EC_ERROR_OVERFLOW;
-			vlen++;
-		}
-		while (*vstr && --precision >= 0)
-			if (addchar(context, *vstr++))
-				return EC_ERROR_OVERFLOW;
-		while (vlen < pad_width && flags & PF_LEFT) {
-			if (addchar(context, ' '))
-				return EC_ERROR_OVERFLOW;
-			vlen++;
-		}
+		/* Print at most precision characters, everything if zero */
+		if (precision > 0 && vlen > precision)
+			vlen = precision;
+
+		if (!(flags & PF_LEFT) &&
+		    put_pad(sink, flags & PF_PADZERO ? '0' : ' ', pad_width))
+			return EC_ERROR_OVERFLOW;
+		if (put_span(sink, vstr, vlen))
+			return EC_ERROR_OVERFLOW;
+		if ((flags & PF_LEFT) && put_pad(sink, ' ', pad_width))
+			return EC_ERROR_OVERFLOW;
 	}
 
 	/* If we're still here, we consumed all output */
 	return EC_SUCCESS;
 }
 
+int vfnprintf(int (*addchar)(void *context, int c), void *context,
+	      const char *format, va_list args)
+{
+	const struct printf_sink sink = {
+		.addchar = addchar,
+		.context = context,
+	};
+
+	return do_printf(&sink, format, args);
+}
+
+int vfnprintf_span(int (*addstr)(void *context, const char *str, int len),
+		   void *context, const char *format, va_list args)
+{
+	const struct printf_sink sink = {
+		.addstr = addstr,
+		.context = context,
+	};
+
+	return do_printf(&sink, format, args);
+}
+
 /* Context for snprintf() */
 struct snprintf_context {
 	char *str;
@@ -0,0 +1,94 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Tokenized logging : TOKEN_LOG() records a token and its raw arguments in a
+ * RAM ring, the host turns them back into text with the format strings of
+ * the ELF file (util/detokenize.py). A record which does not fit in the ring
+ * is dropped, the reader frees it.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "hwtimer.h"
+#include "task.h"
+#include "token_log.h"
+#include "util.h"
+
+BUILD_ASSERT(POWER_OF_TWO(CONFIG_TOKEN_LOG_WORDS));
+
+static uint32_t ring[CONFIG_TOKEN_LOG_WORDS];
+/* free running word indexes : written by the loggers, read by the reader */
+static uint32_t head;
+static uint32_t tail;
+static uint32_t records;
+static uint32_t dropped;
+
+void token_log(uint32_t token, const uint32_t *args, int nargs)
+{
+	uint32_t mask = get_int_mask();
+	int i;
+
+	interrupt_disable();
+	if (head - tail + 2 + nargs > CONFIG_TOKEN_LOG_WORDS) {
+		dropped++;
+		set_int_mask(mask);
+		return;
+	}
+	ring[head++ % CONFIG_TOKEN_LOG_WORDS] = TOKEN_LOG_HDR(token, nargs);
+	ring[head++ % CONFIG_TOKEN_LOG_WORDS] = __hw_clock_source_read();
+	for (i = 0; i < nargs; i++)
+		ring[head++ % CONFIG_TOKEN_LOG_WORDS] = args[i];
+	records++;
+	set_int_mask(mask);
+}
+
+int token_log_read(uint32_t *out, int max)
+{
+	int n = 0, len, i;
+
+	interrupt_disable();
+	while (tail != head) {
+		len = 2 + TOKEN_LOG_NARGS(ring[tail % CONFIG_TOKEN_LOG_WORDS]);
+		if (n + len > max)
+			break;
+		for (i = 0; i < len; i++)
+			out[n++] = ring[tail++ % CONFIG_TOKEN_LOG_WORDS];
+	}
+	interrupt_enable();
+	return n;
+}
+
+/* The records as hex words, one per line, for util/detokenize.py */
+static void token_log_dump(void)
+{
+	uint32_t rec[2 + TOKEN_LOG_MAX_ARGS];
+	int n, i;
+
+	while ((n = token_log_read(rec, ARRAY_SIZE(rec))) > 0) {
+		ccputs("tok");
+		for (i = 0; i < n; i++)
+			ccprintf(" %08x", rec[i]);
+		ccputs("\n");
+		cflush();
+	}
+}
+
+static int command_toklog(int argc, char **argv)
+{
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "dump"))
+			token_log_dump();
+		else if (!strcasecmp(argv[1], "clear"))
+			records = dropped = 0;
+		else
+			return EC_ERROR_PARAM1;
+	}
+
+	ccprintf("Token log: %u records, %u dropped, %u words held\n",
+		 records, dropped, head - tail);
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(toklog, command_toklog,
+			"[dump|clear]",
+			"Tokenized log, decoded by util/detokenize.py");
@@ -0,0 +1,94 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Firmware event tracepoints : TRACEPOINT() writes the time, the event and
+ * its argument into a RAM ring, the interrupt handlers and the tasks
+ * interleaved at microsecond granularity. The ring is read by the console
+ * or in binary by the host.
+ */
+
+#include "common.h"
+#include "console.h"
+#include "task.h"
+#include "tracepoint.h"
+#include "util.h"
+
+BUILD_ASSERT(POWER_OF_TWO(CONFIG_TRACEPOINT_RECS));
+
+struct tracepoint_rec tracepoint_ring[CONFIG_TRACEPOINT_RECS];
+uint32_t tracepoint_next;
+uint8_t tracepoint_on;
+
+static const char * const tp_name[] = {
+	[TP_RX_HALF]         = "rx-half",
+	[TP_EP_TX]           = "ep-tx",
+	[TP_SNIFFER_DEQUEUE] = "dequeue",
+	[TP_PD_RX_START]     = "rx-start",
+	[TP_PD_RX_DONE]      = "rx-done",
+	[TP_PD_TX_START]     = "tx-start",
+	[TP_PD_TX_DONE]      = "tx-done",
+};
+BUILD_ASSERT(ARRAY_SIZE(tp_name) == TP_COUNT);
+
+int tracepoint_read(int first, int max, struct tracepoint_rec *out,
+		    int *held)
+{
+	uint32_t next;
+	int n, i;
+
+	interrupt_disable();
+	next = tracepoint_next;
+	n = MIN(next, CONFIG_TRACEPOINT_RECS);
+	*held = n;
+	n = first < n ? MIN(n - first, max) : 0;
+	for (i = 0; i < n; i++)
+		out[i] = tracepoint_ring[(next - *held + first + i) &
+					 (CONFIG_TRACEPOINT_RECS - 1)];
+	interrupt_enable();
+	return n;
+}
+
+/* The records with their delta from the previous one */
+static void tracepoint_dump(void)
+{
+	struct tracepoint_rec rec;
+	uint32_t prev = 0;
+	int i, held;
+
+	for (i = 0; tracepoint_read(i, 1, &rec, &held); i++) {
+		ccprintf("%10u %+6d %-8s %08x\n", rec.ts,
+			 i ? rec.ts - prev : 0,
+			 rec.id < TP_COUNT && tp_name[rec.id] ?
+			 tp_name[rec.id] : "?", rec.arg);
+		prev = rec.ts;
+		cflush();
+	}
+}
+
+static int command_tracepoint(int argc, char **argv)
+{
+	if (argc >= 2) {
+		if (!strcasecmp(argv[1], "on")) {
+			tracepoint_on = 1;
+		} else if (!strcasecmp(argv[1], "off")) {
+			tracepoint_on = 0;
+		} else if (!strcasecmp(argv[1], "clear")) {
+			interrupt_disable();
+			tracepoint_next = 0;
+			interrupt_enable();
+		} else if (!strcasecmp(argv[1], "dump")) {
+			tracepoint_dump();
+		} else {
+			return EC_ERROR_PARAM1;
+		}
+	}
+
+	ccprintf("Tracepoints: %s, %u records of %d\n",
+		 tracepoint_on ? "on" : "off", tracepoint_next,
+		 CONFIG_TRACEPOINT_RECS);
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(tracepoint, command_tracepoint,
+			"[on|off|clear|dump]",
+			"Firmware event tracepoints");
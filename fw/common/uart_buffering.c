@@ -95,6 +95,83 @@ static int __tx_char(void *context, int c)
 	return 0;
 }
 
+/**
+ * Put a run of characters into the transmit buffer.
+ *
+ * Same as __tx_char() without the newline translation, the characters
+ * which do not fit are dropped.
+ *
+ * @param src		Characters to write.
+ * @param len		Number of characters.
+ * @return 0 if all the characters were transmitted, 1 if some were dropped.
+ */
+static int __tx_run(const char *src, int len)
+{
+#if defined CONFIG_POLLING_UART
+	while (len-- > 0)
+		uart_write_char(*src++);
+	return 0;
+#else
+	int head = tx_buf_head;
+	int count = MIN(len, TX_BUF_DIFF(tx_buf_tail, head + 1));
+	int first = MIN(count, CONFIG_UART_TX_BUF_SIZE - head);
+	int new_head = TX_BUF_DIFF(head + count, 0);
+	int d;
+
+	/*
+	 * Keep the READ_RECENT marks ahead of the new head, as above. The
+	 * last snapshot mark stops on the snapshot head if it reaches it.
+	 */
+	d = TX_BUF_DIFF(tx_last_snapshot_head, head);
+	if (d && d <= count && tx_last_snapshot_head != tx_snapshot_head) {
+		if (TX_BUF_DIFF(tx_snapshot_head, tx_last_snapshot_head) <=
+		    count - d + 1)
+			tx_last_snapshot_head = tx_snapshot_head;
+		else
+			tx_last_snapshot_head = TX_BUF_NEXT(new_head);
+	}
+	d = TX_BUF_DIFF(tx_next_snapshot_head, head);
+	if (d && d <= count)
+		tx_next_snapshot_head = TX_BUF_NEXT(new_head);
+
+	memcpy((char *)tx_buf + head, src, first);
+	memcpy((char *)tx_buf, src + first, count - first);
+	tx_buf_head = new_head;
+
+	return count != len;
+#endif
+}
+
+/**
+ * Put a span of characters into the transmit buffer.
+ *
+ * Does not enable the transmit interrupt; assumes that happens elsewhere.
+ *
+ * @param context	Context; ignored.
+ * @param str		Characters to write.
+ * @param len		Number of characters.
+ * @return 0 if the characters were transmitted, 1 if some were dropped.
+ */
+static int __tx_str(void *context, const char *str, int len)
+{
+	/* Copy the runs between the newlines in one go */
+	while (len > 0) {
+		const char *nl = memchr(str, '\n', len);
+		int n = nl ? nl - str : len;
+
+		if (__tx_run(str, n))
+			return 1;
+		if (!nl)
+			break;
+		/* Do newline to CRLF translation */
+		if (__tx_run("\r\n", 2))
+			return 1;
+		str += n + 1;
+		len -= n + 1;
+	}
+	return 0;
+}
+
 #ifdef CONFIG_UART_TX_DMA
 
 /**
@@ -232,20 +309,17 @@ int uart_putc(int c)
 int uart_puts(const char *outstr)
 {
 	/* Put all characters in the output buffer */
-	while (*outstr) {
-		if (__tx_char(NULL, *outstr++) != 0)
-			break;
-	}
+	int rv = __tx_str(NULL, outstr, strlen(outstr));
 
 	uart_tx_start();
 
 	/* Successful if we consumed all output */
-	return *outstr ? EC_ERROR_OVERFLOW : EC_SUCCESS;
+	return rv ? EC_ERROR_OVERFLOW : EC_SUCCESS;
 }
 
 int uart_vprintf(const char *format, va_list args)
 {
-	int rv = vfnprintf(__tx_char, NULL, format, args);
+	int rv = vfnprintf_span(__tx_str, NULL, format, args);
 
 	uart_tx_start();
 
@@ -73,6 +73,58 @@ static uint8_t usb_i2c_executable(struct usb_i2c_config const *config)
 	return 1;
 }
 
+#ifdef CONFIG_USB_I2C_BATCH
+static void usb_i2c_execute_batch(struct usb_i2c_config const *config,
+				  int count)
+{
+	uint8_t *buf = (uint8_t *)config->buffer;
+	uint8_t read[USB_I2C_MAX_READ_COUNT];
+	int transactions = buf[1];
+	int status = USB_I2C_SUCCESS;
+	int pos = 4;
+	int len = 0;
+	int done, portindex, write_count, read_count, port;
+
+	for (done = 0; done < transactions; done++) {
+		if (pos + 4 > count) {
+			status = USB_I2C_WRITE_COUNT_INVALID;
+			break;
+		}
+		portindex   = buf[pos];
+		write_count = buf[pos + 2];
+		read_count  = buf[pos + 3];
+		if (pos + 4 + write_count > count) {
+			status = USB_I2C_WRITE_COUNT_INVALID;
+			break;
+		} else if (len + read_count > USB_I2C_MAX_READ_COUNT) {
+			status = USB_I2C_READ_COUNT_INVALID;
+			break;
+		} else if (portindex >= i2c_ports_used) {
+			status = USB_I2C_PORT_INVALID;
+			break;
+		}
+		port = i2c_ports[portindex].port;
+		i2c_lock(port, 1);
+		/* Convert 7-bit slave address to chromium EC 8-bit address. */
+		status = usb_i2c_map_error(
+			i2c_xfer(port, (buf[pos + 1] << 1) & 0xfe,
+				 buf + pos + 4, write_count,
+				 read + len, read_count, I2C_XFER_SINGLE));
+		i2c_lock(port, 0);
+		if (status != USB_I2C_SUCCESS)
+			break;
+		pos += 4 + write_count;
+		len += read_count;
+	}
+
+	config->buffer[0] = status;
+	buf[2] = done;
+	buf[3] = 0;
+	memcpy(buf + 4, read, len);
+	usb_i2c_write_packet(config, len + 4);
+}
+#endif
+
 void usb_i2c_execute(struct usb_i2c_config const *config)
 {
 	/* Payload is ready to execute. */
@@ -84,6 +136,12 @@ void usb_i2c_execute(struct usb_i2c_config const *config)
 	int read_count      = (config->buffer[1] >> 8) & 0xff;
 	int port;
 
+#ifdef CONFIG_USB_I2C_BATCH
+	if (count && portindex == USB_I2C_BATCH) {
+		usb_i2c_execute_batch(config, count);
+		return;
+	}
+#endif
 	config->buffer[0] = 0;
 	config->buffer[1] = 0;
 
@@ -99,12 +157,15 @@ void usb_i2c_execute(struct usb_i2c_config const *config)
 		config->buffer[0] = USB_I2C_PORT_INVALID;
 	} else {
 		port = i2c_ports[portindex].port;
+		/* the board may share the port with its own transfers */
+		i2c_lock(port, 1);
 		config->buffer[0] = usb_i2c_map_error(
 			i2c_xfer(port, slave_addr,
 				 (uint8_t *)(config->buffer + 2),
 				 write_count,
 				 (uint8_t *)(config->buffer + 2),
 				 read_count, I2C_XFER_SINGLE));
+		i2c_lock(port, 0);
 	}
 	usb_i2c_write_packet(config, read_count + 4);
 }
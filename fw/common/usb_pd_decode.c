@@ -0,0 +1,451 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* USB Power Delivery packet decoder, independent of the capture hardware */
+
+#include "common.h"
+#include "compile_time_macros.h"
+#ifdef HOST_TOOLS_BUILD
+#include <string.h>
+/* the host build links the table-driven CRC-32 of common/crc.c */
+#undef CONFIG_HW_CRC
+#else
+#include "util.h"
+#endif
+#include "crc.h"
+#include "usb_pd.h"
+#include "usb_pd_decode.h"
+#include "usb_pd_tcpm.h"
+
+const uint8_t dec4b5b[] = {
+/* Error    */ 0x10 /* 00000 */,
+/* Error    */ 0x10 /* 00001 */,
+/* Error    */ 0x10 /* 00010 */,
+/* Error    */ 0x10 /* 00011 */,
+/* Error    */ 0x10 /* 00100 */,
+/* Error    */ 0x10 /* 00101 */,
+/* Error    */ 0x10 /* 00110 */,
+/* RST-1    */ 0x13 /* 00111 K-code: Hard Reset #1 */,
+/* Error    */ 0x10 /* 01000 */,
+/* 1 = 0001 */ 0x01 /* 01001 */,
+/* 4 = 0100 */ 0x04 /* 01010 */,
+/* 5 = 0101 */ 0x05 /* 01011 */,
+/* Error    */ 0x10 /* 01100 */,
+/* EOP      */ 0x15 /* 01101 K-code: EOP End Of Packet */,
+/* 6 = 0110 */ 0x06 /* 01110 */,
+/* 7 = 0111 */ 0x07 /* 01111 */,
+/* Error    */ 0x10 /* 10000 */,
+/* Sync-2   */ 0x12 /* 10001 K-code: Startsynch #2 */,
+/* 8 = 1000 */ 0x08 /* 10010 */,
+/* 9 = 1001 */ 0x09 /* 10011 */,
+/* 2 = 0010 */ 0x02 /* 10100 */,
+/* 3 = 0011 */ 0x03 /* 10101 */,
+/* A = 1010 */ 0x0A /* 10110 */,
+/* B = 1011 */ 0x0B /* 10111 */,
+/* Sync-1   */ 0x11 /* 11000 K-code: Startsynch #1 */,
+/* RST-2    */ 0x14 /* 11001 K-code: Hard Reset #2 */,
+/* C = 1100 */ 0x0C /* 11010 */,
+/* D = 1101 */ 0x0D /* 11011 */,
+/* E = 1110 */ 0x0E /* 11100 */,
+/* F = 1111 */ 0x0F /* 11101 */,
+/* 0 = 0000 */ 0x00 /* 11110 */,
+/* Error    */ 0x10 /* 11111 */,
+};
+
+#ifdef CONFIG_USB_PD_4B5B_TABLE
+/* data value of a 5-bit code as in dec4b5b[], 0x10 if it is not data */
+#define DEC5(c) ((c) == 0x1E ? 0x0 : (c) == 0x09 ? 0x1 : (c) == 0x14 ? 0x2 : \
+		 (c) == 0x15 ? 0x3 : (c) == 0x0A ? 0x4 : (c) == 0x0B ? 0x5 : \
+		 (c) == 0x0E ? 0x6 : (c) == 0x0F ? 0x7 : (c) == 0x12 ? 0x8 : \
+		 (c) == 0x13 ? 0x9 : (c) == 0x16 ? 0xA : (c) == 0x17 ? 0xB : \
+		 (c) == 0x1A ? 0xC : (c) == 0x1B ? 0xD : (c) == 0x1C ? 0xE : \
+		 (c) == 0x1D ? 0xF : 0x10)
+
+/* set in the dec10b8b[] entries where a symbol is a K-code or invalid */
+#define DEC10_INVALID 0x100
+#define DEC10(s) ((DEC5((s) & 0x1f) & 0xf) | ((DEC5((s) >> 5) & 0xf) << 4) | \
+		  ((DEC5((s) & 0x1f) | DEC5((s) >> 5)) & 0x10 ? \
+		   DEC10_INVALID : 0))
+#define DEC10_4(s)   DEC10(s), DEC10((s) + 1), DEC10((s) + 2), DEC10((s) + 3)
+#define DEC10_16(s)  DEC10_4(s), DEC10_4((s) + 4), DEC10_4((s) + 8), \
+		     DEC10_4((s) + 12)
+#define DEC10_64(s)  DEC10_16(s), DEC10_16((s) + 16), DEC10_16((s) + 32), \
+		     DEC10_16((s) + 48)
+#define DEC10_256(s) DEC10_64(s), DEC10_64((s) + 64), DEC10_64((s) + 128), \
+		     DEC10_64((s) + 192)
+
+/*
+ * Decoding of 2 consecutive 5-bit symbols (the first one in the LSBs) into
+ * a byte, in flash unless CONFIG_USB_PD_4B5B_TABLE_RAM is defined.
+ */
+#ifdef CONFIG_USB_PD_4B5B_TABLE_RAM
+#define DEC10_CONST
+#else
+#define DEC10_CONST const
+#endif
+static DEC10_CONST uint16_t dec10b8b[1024] = {
+	DEC10_256(0), DEC10_256(256), DEC10_256(512), DEC10_256(768)
+};
+#endif /* CONFIG_USB_PD_4B5B_TABLE */
+
+/* threshold for 1 300-khz period */
+#define PERIOD PD_DECODE_PERIOD
+#define PERIOD_THRESHOLD ((PERIOD + 2*PERIOD) / 2)
+
+/* Class of the interval between 2 edges : */
+#define BMC_ZERO  0 /* no interval, the same edge captured twice */
+#define BMC_SHORT 1 /* half of a '1' bit */
+#define BMC_LONG  2 /* a '0' bit */
+#define BMC_ERR   3 /* longer than any valid interval */
+
+BUILD_ASSERT(3*PERIOD < PD_DECODE_CLASS_COUNT);
+#define BMC_CLASS(dec, cnt) ((cnt) < PD_DECODE_CLASS_COUNT ? \
+			     (dec)->class[cnt] : BMC_ERR)
+
+/*
+ * Preamble intervals used to measure the bit period : the 32 ones matching
+ * the SYNC-1 search pattern add up to 44 half-periods.
+ */
+#define PREAMBLE_INTERVALS 32
+#define PREAMBLE_HALF_PERIODS 44
+
+/*
+ * Decoding step for the classes of 2 consecutive intervals : number of
+ * samples consumed (0 for invalid sequences) and BMC_STEP_ONE if the
+ * decoded bit is a '1'.
+ */
+#define BMC_STEP_ONE 0x80
+#define BMC_STEP(c0, c1) (((c0) << 2) | (c1))
+static const uint8_t bmc_step[16] = {
+	[BMC_STEP(BMC_SHORT, BMC_ZERO)]  = 2 | BMC_STEP_ONE,
+	[BMC_STEP(BMC_SHORT, BMC_SHORT)] = 2 | BMC_STEP_ONE,
+	[BMC_STEP(BMC_LONG, BMC_ZERO)]   = 1,
+	[BMC_STEP(BMC_LONG, BMC_SHORT)]  = 1,
+	[BMC_STEP(BMC_LONG, BMC_LONG)]   = 1,
+	[BMC_STEP(BMC_LONG, BMC_ERR)]    = 1,
+};
+
+void pd_decode_set_period(struct pd_decoder *dec, int period16)
+{
+	/* the same thresholds as PERIOD_THRESHOLD and 3*PERIOD */
+	int short_max = period16 * 3 / 32;
+	int long_max = period16 * 3 / 16;
+	int i;
+
+	dec->period16 = period16;
+	dec->class[0] = BMC_ZERO;
+	for (i = 1; i < PD_DECODE_CLASS_COUNT; i++)
+		dec->class[i] = i <= short_max ? BMC_SHORT :
+				i <= long_max ? BMC_LONG : BMC_ERR;
+}
+
+void pd_decode_init(struct pd_decoder *dec)
+{
+	/* preamble ends with 1 */
+	dec->last = 0;
+	dec->lastlen = 0;
+	dec->avail = 0;
+	pd_decode_set_period(dec, PERIOD * 16);
+}
+
+int __ram_code pd_decode_bits(struct pd_decoder *dec, int off, int len,
+				 uint32_t *val)
+{
+	uint8_t step, c0, c1, d0, d1;
+	const uint8_t *samples = dec->samples;
+
+	while ((dec->lastlen < len) && (off < dec->size - 1)) {
+		/* only ask the source once the received chunk is consumed */
+		if (dec->avail < off + 2) {
+			dec->avail = dec->wait(dec, off + 2);
+			if (dec->avail < 0)
+				return -1;
+		}
+		d0 = samples[off] - samples[off-1];
+		d1 = samples[off+1] - samples[off];
+		c0 = BMC_CLASS(dec, d0);
+		c1 = BMC_CLASS(dec, d1);
+		step = bmc_step[BMC_STEP(c0, c1)];
+		if (!step)
+			return -1;
+		off += step & ~BMC_STEP_ONE;
+
+		/* valid classes are shorter than PD_DECODE_CLASS_COUNT */
+		if (dec->hist && (step & BMC_STEP_ONE)) {
+			dec->hist->half[d0]++;
+			if (c1 == BMC_SHORT)
+				dec->hist->half[d1]++;
+		} else if (dec->hist) {
+			dec->hist->full[d0]++;
+		}
+
+		/* enqueue the bit of the last period */
+		dec->last = (dec->last >> 1) | (step & BMC_STEP_ONE ?
+						0x80000000 : 0);
+		dec->lastlen++;
+	}
+	if (off >= dec->size)
+		return -1;
+
+	*val = (dec->last << (dec->lastlen - len)) >> (32 - len);
+	dec->lastlen -= len;
+	return off;
+}
+
+int __ram_code pd_decode_preamble(struct pd_decoder *dec)
+{
+	int bit;
+	const uint8_t *vals = dec->samples;
+
+	/*
+	 * Detect preamble
+	 * Alternate 1-period 1-period & 2-period.
+	 */
+	uint32_t all = 0;
+
+	for (bit = 1; bit < dec->size - 1; bit++) {
+		uint8_t cnt;
+
+		/* wait if the bit is not received yet ... */
+		if (dec->avail < bit + 1) {
+			dec->avail = dec->wait(dec, bit + 1);
+			if (dec->avail < 0)
+				return -1;
+		}
+		cnt = vals[bit] - vals[bit-1];
+		all = (all >> 1) | (cnt <= PERIOD_THRESHOLD ? 1 << 31 : 0);
+		if (all == 0x36db6db6) {
+			/* decode the message at the transmitter bit rate */
+			if (bit >= PREAMBLE_INTERVALS)
+				pd_decode_set_period(dec, (uint8_t)(vals[bit] -
+					vals[bit - PREAMBLE_INTERVALS]) * 16 /
+					PREAMBLE_HALF_PERIODS);
+			return bit - 1; /* should be SYNC-1 */
+		}
+		if (all == 0xF33F3F3F)
+			return PD_RX_ERR_HARD_RESET; /* got HARD-RESET */
+		if (all == 0x3c7fe0ff)
+			return PD_RX_ERR_CABLE_RESET; /* got CABLE-RESET */
+	}
+	return -1;
+}
+
+/* Ordered sets and the SOP* or reset type they start */
+static const struct {
+	uint32_t set;
+	int8_t type;
+} ordered_sets[] = {
+	{PD_SOP,                   TCPC_TX_SOP},
+	{PD_SOP_PRIME,             TCPC_TX_SOP_PRIME},
+	{PD_SOP_PRIME_PRIME,       TCPC_TX_SOP_PRIME_PRIME},
+	{PD_SOP_DEBUG_PRIME,       TCPC_TX_SOP_DEBUG_PRIME},
+	{PD_SOP_DEBUG_PRIME_PRIME, TCPC_TX_SOP_DEBUG_PRIME_PRIME},
+	{PD_HARD_RESET,            TCPC_TX_HARD_RESET},
+	{PD_CABLE_RESET,           TCPC_TX_CABLE_RESET},
+};
+
+int pd_decode_ordered_set(uint32_t val, uint8_t *partial)
+{
+	int type = -1, i, k, match;
+	uint32_t diff;
+
+	for (i = 0; i < ARRAY_SIZE(ordered_sets); i++) {
+		diff = val ^ ordered_sets[i].set;
+		if (!diff) {
+			if (partial)
+				*partial = 0;
+			return ordered_sets[i].type;
+		}
+		for (match = 0, k = 0; k < 20; k += 5)
+			match += !((diff >> k) & 0x1f);
+		if (match < 3)
+			continue;
+		/* a corrupted K-code could belong to 2 ordered sets */
+		if (type >= 0)
+			return -1;
+		type = ordered_sets[i].type;
+	}
+	if (partial)
+		*partial = type >= 0;
+	return type;
+}
+
+int pd_decode_short(struct pd_decoder *dec, int off, uint16_t *val16)
+{
+	uint32_t w;
+	int end;
+
+	end = pd_decode_bits(dec, off, 20, &w);
+
+#ifdef CONFIG_USB_PD_4B5B_TABLE
+	if (end >= 0) {
+		uint16_t lo = dec10b8b[w & 0x3ff];
+		uint16_t hi = dec10b8b[(w >> 10) & 0x3ff];
+
+		*val16 = (lo & 0xff) | ((hi & 0xff) << 8);
+		/* K-code or invalid symbol in the data */
+		if ((lo | hi) & DEC10_INVALID)
+			return -1;
+	}
+#else
+	*val16 = dec4b5b[w & 0x1f] |
+		(dec4b5b[(w >>  5) & 0x1f] << 4) |
+		(dec4b5b[(w >> 10) & 0x1f] << 8) |
+		(dec4b5b[(w >> 15) & 0x1f] << 12);
+#endif
+	return end;
+}
+
+int pd_decode_word(struct pd_decoder *dec, int off, uint32_t *val32)
+{
+	off = pd_decode_short(dec, off, (uint16_t *)val32);
+	return pd_decode_short(dec, off, ((uint16_t *)val32 + 1));
+}
+
+/*
+ * Decode the header and the data objects starting at 'off', and compute
+ * their CRC in 'res'.
+ *
+ * @return new position in the samples or -1.
+ */
+static int decode_msg(struct pd_decoder *dec, int off,
+		      struct pd_decode_result *res, uint32_t *payload)
+{
+	uint32_t crc;
+	int p, bit;
+
+	bit = pd_decode_short(dec, off, &res->header);
+	crc32_ctx_init(&crc);
+	crc32_ctx_hash16(&crc, res->header);
+
+	/* read payload data */
+	for (p = 0; p < PD_HEADER_CNT(res->header) && bit > 0; p++) {
+		bit = pd_decode_word(dec, bit, payload+p);
+		crc32_ctx_hash32(&crc, payload[p]);
+	}
+	res->crc = crc32_ctx_result(&crc);
+	return bit;
+}
+
+/*
+ * Shifts of the bit period, in 16th of the measured one, tried in turn on
+ * the samples when the CRC does not match : the intervals of a marginal
+ * transmitter straddle the default classification thresholds.
+ */
+static const int8_t retry_shift[] = {-2, 2, -4, 4, -6, 6};
+
+/*
+ * Decode again the message starting at 'off' (after the SOP) with shifted
+ * bit periods, until its CRC matches.
+ *
+ * @return new position in the samples or -1 if no pass succeeded.
+ */
+static int retry_crc(struct pd_decoder *dec, int off,
+		     struct pd_decode_result *res, uint32_t *payload)
+{
+	struct pd_decode_hist *hist = dec->hist;
+	int period16 = dec->period16;
+	int i, bit;
+
+	/* the intervals were counted by the first pass */
+	dec->hist = NULL;
+	res->retried = 1;
+	for (i = 0; i < ARRAY_SIZE(retry_shift); i++) {
+		dec->last = 0;
+		dec->lastlen = 0;
+		pd_decode_set_period(dec, period16 +
+				     period16 * retry_shift[i] / 16);
+
+		bit = decode_msg(dec, off, res, payload);
+		if (bit < 0)
+			continue;
+		bit = pd_decode_word(dec, bit, &res->crc_rx);
+		if (bit >= 0 && res->crc_rx == res->crc) {
+			res->retry_shift = retry_shift[i];
+			dec->hist = hist;
+			return bit;
+		}
+	}
+	dec->hist = hist;
+	return -1;
+}
+
+enum pd_decode_err pd_decode_packet(struct pd_decoder *dec,
+				    struct pd_decode_result *res,
+				    uint32_t *payload)
+{
+	enum pd_decode_err err = PD_DECODE_OK;
+	uint32_t val = 0;
+	uint32_t eop = 0;
+	int bit, type;
+
+	memset(res, 0, sizeof(*res));
+	res->type = TCPC_TX_SOP;
+	pd_decode_init(dec);
+
+	/* Detect preamble */
+	bit = pd_decode_preamble(dec);
+	if (bit == PD_RX_ERR_HARD_RESET) {
+		res->type = TCPC_TX_HARD_RESET;
+		return PD_DECODE_OK;
+	} else if (bit == PD_RX_ERR_CABLE_RESET) {
+		res->type = TCPC_TX_CABLE_RESET;
+		return PD_DECODE_OK;
+	} else if (bit < 0) {
+		res->end = -1;
+		return PD_DECODE_ERR_PREAMBLE;
+	}
+
+	/* Classify the ordered set following the preamble */
+	bit = pd_decode_bits(dec, bit, 20, &val);
+	res->end = bit;
+	if (bit < 0)
+		return PD_DECODE_ERR_SOP;
+	type = pd_decode_ordered_set(val, &res->partial);
+	if (type < 0)
+		return PD_DECODE_ERR_SOP;
+	res->type = type;
+	res->sop_end = bit;
+	if (type > TCPC_TX_SOP_DEBUG_PRIME_PRIME)
+		return PD_DECODE_OK;
+	/* nobody wants it : spare the decoding of the message */
+	if (dec->sop_skip & (1 << type))
+		return PD_DECODE_SKIPPED;
+
+	/* read header and payload data */
+	bit = decode_msg(dec, bit, res, payload);
+	if (bit < 0) {
+		res->end = bit;
+		return PD_DECODE_ERR_LEN;
+	}
+
+	/* check transmitted CRC */
+	bit = pd_decode_word(dec, bit, &res->crc_rx);
+	if (bit < 0 || res->crc_rx != res->crc) {
+		if (dec->retry) {
+			/* the samples are still there : decode them again */
+			bit = retry_crc(dec, res->sop_end, res, payload);
+			if (bit < 0) {
+				res->end = bit;
+				return PD_DECODE_ERR_CRC;
+			}
+		} else if (res->crc_rx != res->crc) {
+			err = PD_DECODE_ERR_CRC;
+		}
+	}
+
+	/*
+	 * Check EOP. EOP is 5 bits, but last bit may not be able to
+	 * be dequeued, depending on ending state of CC line, so stop
+	 * at 4 bits (assumes last bit is 0).
+	 */
+	if (bit >= 0)
+		bit = pd_decode_bits(dec, bit, 4, &eop);
+	res->end = bit;
+	if (bit < 0 || eop != PD_EOP)
+		return PD_DECODE_ERR_EOP;
+
+	return err;
+}
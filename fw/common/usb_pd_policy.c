@@ -83,6 +83,8 @@ int pd_board_check_request(uint32_t, int)
 #ifdef CONFIG_USB_PD_DUAL_ROLE
 /* Cap on the max voltage requested as a sink (in millivolts) */
 static unsigned max_request_mv = PD_MAX_VOLTAGE_MV; /* no cap */
+/* PDO forced by pd_set_request_pdo(), -1 when none */
+static int request_pdo = -1;
 
 /**
  * Find PDO index that offers the most amount of power and stays within
@@ -189,6 +191,8 @@ int pd_build_request(int cnt, uint32_t *src_caps, uint32_t *rdo,
 	if (req_type == PD_REQUEST_VSAFE5V)
 		/* src cap 0 should be vSafe5V */
 		pdo_index = 0;
+	else if (request_pdo >= 0)
+		pdo_index = request_pdo < cnt ? request_pdo : -1;
 	else
 		/* find pdo index for max voltage we can request */
 		pdo_index = pd_find_pdo_index(cnt, src_caps, max_request_mv);
@@ -264,6 +268,11 @@ unsigned pd_get_max_voltage(void)
 	return max_request_mv;
 }
 
+void pd_set_request_pdo(int index)
+{
+	request_pdo = index;
+}
+
 int pd_charge_from_device(uint16_t vid, uint16_t pid)
 {
 	/* TODO: rewrite into table if we get more of these */
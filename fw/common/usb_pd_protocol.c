@@ -308,6 +308,11 @@ static inline void set_state(int port, enum pd_states next_state)
 	if (last_state == next_state)
 		return;
 
+#ifdef CONFIG_USB_PD_CC_WATCHDOG
+	if (last_state == PD_STATE_SNK_DISCONNECTED)
+		board_cc_watch(port, 0);
+#endif
+
 #ifdef CONFIG_USB_PD_DUAL_ROLE
 #ifdef CONFIG_USB_PD_DUAL_ROLE_AUTO_TOGGLE
 	/* Clear flag to allow DRP auto toggle when possible */
@@ -375,6 +380,10 @@ static inline void set_state(int port, enum pd_states next_state)
 					 pd_state_names[next_state]);
 	else
 		CPRINTF("C%d st%d\n", port, next_state);
+#ifdef CONFIG_USB_PD_LOG_STATES
+	pd_log_event(PD_EVENT_MCU_STATE, PD_LOG_PORT_SIZE(port, 0),
+		     (last_state << 8) | next_state, NULL);
+#endif
 }
 
 /* increment message ID counter */
@@ -642,15 +651,18 @@ static void pd_store_src_cap(int port, int cnt, uint32_t *src_caps)
 		pd_src_caps[port][i] = *src_caps++;
 }
 
+int pd_get_src_caps(int port, const uint32_t **src_caps)
+{
+	*src_caps = pd_src_caps[port];
+	return pd_src_cap_cnt[port];
+}
+
 /*
- * Request desired charge voltage from source.
- * Returns EC_SUCCESS on success or non-zero on failure.
+ * If this port is not actively charging or we are not allowed to
+ * request the max voltage, then select vSafe5V
  */
-static int pd_send_request_msg(int port, int always_send_request)
+static enum pd_request_type pd_request_type(int port)
 {
-	uint32_t rdo, curr_limit, supply_voltage;
-	int res;
-
 #ifdef CONFIG_CHARGE_MANAGER
 	int charging = (charge_manager_get_active_charge_port() == port);
 #else
@@ -663,18 +675,81 @@ static int pd_send_request_msg(int port, int always_send_request)
 	const int max_request_allowed = 1;
 #endif
 
+	return charging && max_request_allowed ?
+		PD_REQUEST_MAX : PD_REQUEST_VSAFE5V;
+}
+
+/* Source_Capabilities are expected in the current state */
+static int pd_snk_wants_src_cap(int port)
+{
+	return (pd[port].task_state == PD_STATE_SNK_DISCOVERY)
+		|| (pd[port].task_state == PD_STATE_SNK_TRANSITION)
+#ifdef CONFIG_USB_PD_VBUS_DETECT_NONE
+		|| (pd[port].task_state == PD_STATE_SNK_HARD_RESET_RECOVER)
+#endif
+		|| (pd[port].task_state == PD_STATE_SNK_READY);
+}
+
+#ifdef CONFIG_USB_PD_FAST_RESPONSE
+/*
+ * Request already sent by the TCPC from the RX completion of the
+ * Source_Capabilities, the protocol layer only records the new contract.
+ */
+static uint32_t fast_rdo[CONFIG_USB_PD_PORT_COUNT];
+static uint8_t fast_state[CONFIG_USB_PD_PORT_COUNT];
+#define FAST_PENDING 1 /* built, not sent yet */
+#define FAST_SENT    2 /* got its GoodCRC */
+
+uint16_t pd_fast_response(int port, uint16_t head, uint32_t *payload,
+			  const uint32_t **data)
+{
+	uint32_t curr_limit, supply_voltage;
+	int cnt = PD_HEADER_CNT(head);
+
+	if (PD_HEADER_TYPE(head) != PD_DATA_SOURCE_CAP || !cnt ||
+	    pd[port].power_role != PD_ROLE_SINK || !pd_comm_is_enabled(port) ||
+	    !pd_snk_wants_src_cap(port) || fast_state[port])
+		return 0;
+
+	/* same RDO as the one the protocol layer builds from the store */
+	if (pd_build_request(cnt, payload, &fast_rdo[port], &curr_limit,
+			     &supply_voltage, pd_request_type(port)))
+		return 0;
+
+	fast_state[port] = FAST_PENDING;
+	*data = &fast_rdo[port];
+	return PD_HEADER(PD_DATA_REQUEST, pd[port].power_role,
+			 pd[port].data_role, pd[port].msg_id, 1);
+}
+
+void pd_fast_response_done(int port, int success)
+{
+	if (success) {
+		inc_id(port);
+		fast_state[port] = FAST_SENT;
+	} else {
+		/* the protocol layer sends it again */
+		fast_state[port] = 0;
+	}
+}
+#endif
+
+/*
+ * Request desired charge voltage from source.
+ * Returns EC_SUCCESS on success or non-zero on failure.
+ */
+static int pd_send_request_msg(int port, int always_send_request)
+{
+	uint32_t rdo, curr_limit, supply_voltage;
+	int res;
+
 	/* Clear new power request */
 	pd[port].new_power_request = 0;
 
 	/* Build and send request RDO */
-	/*
-	 * If this port is not actively charging or we are not allowed to
-	 * request the max voltage, then select vSafe5V
-	 */
 	res = pd_build_request(pd_src_cap_cnt[port], pd_src_caps[port],
 			       &rdo, &curr_limit, &supply_voltage,
-			       charging && max_request_allowed ?
-					PD_REQUEST_MAX : PD_REQUEST_VSAFE5V);
+			       pd_request_type(port));
 
 	if (res != EC_SUCCESS)
 		/*
@@ -703,6 +778,11 @@ static int pd_send_request_msg(int port, int always_send_request)
 	pd[port].curr_limit = curr_limit;
 	pd[port].supply_voltage = supply_voltage;
 	pd[port].prev_request_mv = supply_voltage;
+#ifdef CONFIG_USB_PD_FAST_RESPONSE
+	if (fast_state[port] == FAST_SENT && fast_rdo[port] == rdo)
+		res = 1;
+	else
+#endif
 	res = send_request(port, rdo);
 	if (res < 0)
 		return res;
@@ -775,13 +855,7 @@ static void handle_data_request(int port, uint16_t head,
 	switch (type) {
 #ifdef CONFIG_USB_PD_DUAL_ROLE
 	case PD_DATA_SOURCE_CAP:
-		if ((pd[port].task_state == PD_STATE_SNK_DISCOVERY)
-			|| (pd[port].task_state == PD_STATE_SNK_TRANSITION)
-#ifdef CONFIG_USB_PD_VBUS_DETECT_NONE
-			|| (pd[port].task_state ==
-			    PD_STATE_SNK_HARD_RESET_RECOVER)
-#endif
-			|| (pd[port].task_state == PD_STATE_SNK_READY)) {
+		if (pd_snk_wants_src_cap(port)) {
 			/* Port partner is now known to be PD capable */
 			pd[port].flags |= PD_FLAGS_PREVIOUS_PD_CONN;
 
@@ -794,6 +868,9 @@ static void handle_data_request(int port, uint16_t head,
 			/* Source will resend source cap on failure */
 			pd_send_request_msg(port, 1);
 		}
+#ifdef CONFIG_USB_PD_FAST_RESPONSE
+		fast_state[port] = 0;
+#endif
 		break;
 #endif /* CONFIG_USB_PD_DUAL_ROLE */
 	case PD_DATA_REQUEST:
@@ -2382,6 +2459,12 @@ void pd_task(void)
 				/* Swap states quickly */
 				timeout = 2*MSEC;
 			}
+#ifdef CONFIG_USB_PD_CC_WATCHDOG
+			/* Nothing to poll until a source shows up on CC */
+			else if (drp_state != PD_DRP_TOGGLE_ON &&
+				 board_cc_watch(port, 1) == EC_SUCCESS)
+				timeout = -1;
+#endif
 			break;
 		case PD_STATE_SNK_DISCONNECTED_DEBOUNCE:
 			tcpm_get_cc(port, &cc1, &cc2);
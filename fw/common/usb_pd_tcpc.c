@@ -18,9 +18,12 @@
 #include "tcpci.h"
 #include "tcpm.h"
 #include "timer.h"
+#include "token_log.h"
+#include "tracepoint.h"
 #include "util.h"
 #include "usb_pd.h"
 #include "usb_pd_config.h"
+#include "usb_pd_decode.h"
 #include "usb_pd_tcpm.h"
 
 #ifdef CONFIG_COMMON_RUNTIME
@@ -37,12 +40,16 @@
  * performance.
  */
 static int debug_level;
-
-static struct mutex pd_crc_lock;
 #else
 #define CPRINTF(format, args...)
 static const int debug_level;
 #endif
+/* Messages of the RX path, tokenized in the token log build */
+#ifdef CONFIG_TOKEN_LOG
+#define CPRINTF_HOT(format, args...) TOKEN_LOG(format, ## args)
+#else
+#define CPRINTF_HOT(format, args...) CPRINTF(format, ## args)
+#endif
 
 /* Encode 5 bits using Biphase Mark Coding */
 #define BMC(x)   ((x &  1 ? 0x001 : 0x3FF) \
@@ -87,52 +94,6 @@ static const uint16_t bmc4b5b[] = {
 /* Reserved    Error        11111 */
 };
 
-static const uint8_t dec4b5b[] = {
-/* Error    */ 0x10 /* 00000 */,
-/* Error    */ 0x10 /* 00001 */,
-/* Error    */ 0x10 /* 00010 */,
-/* Error    */ 0x10 /* 00011 */,
-/* Error    */ 0x10 /* 00100 */,
-/* Error    */ 0x10 /* 00101 */,
-/* Error    */ 0x10 /* 00110 */,
-/* RST-1    */ 0x13 /* 00111 K-code: Hard Reset #1 */,
-/* Error    */ 0x10 /* 01000 */,
-/* 1 = 0001 */ 0x01 /* 01001 */,
-/* 4 = 0100 */ 0x04 /* 01010 */,
-/* 5 = 0101 */ 0x05 /* 01011 */,
-/* Error    */ 0x10 /* 01100 */,
-/* EOP      */ 0x15 /* 01101 K-code: EOP End Of Packet */,
-/* 6 = 0110 */ 0x06 /* 01110 */,
-/* 7 = 0111 */ 0x07 /* 01111 */,
-/* Error    */ 0x10 /* 10000 */,
-/* Sync-2   */ 0x12 /* 10001 K-code: Startsynch #2 */,
-/* 8 = 1000 */ 0x08 /* 10010 */,
-/* 9 = 1001 */ 0x09 /* 10011 */,
-/* 2 = 0010 */ 0x02 /* 10100 */,
-/* 3 = 0011 */ 0x03 /* 10101 */,
-/* A = 1010 */ 0x0A /* 10110 */,
-/* B = 1011 */ 0x0B /* 10111 */,
-/* Sync-1   */ 0x11 /* 11000 K-code: Startsynch #1 */,
-/* RST-2    */ 0x14 /* 11001 K-code: Hard Reset #2 */,
-/* C = 1100 */ 0x0C /* 11010 */,
-/* D = 1101 */ 0x0D /* 11011 */,
-/* E = 1110 */ 0x0E /* 11100 */,
-/* F = 1111 */ 0x0F /* 11101 */,
-/* 0 = 0000 */ 0x00 /* 11110 */,
-/* Error    */ 0x10 /* 11111 */,
-};
-
-/* Start of Packet sequence : three Sync-1 K-codes, then one Sync-2 K-code */
-#define PD_SOP (PD_SYNC1 | (PD_SYNC1<<5) | (PD_SYNC1<<10) | (PD_SYNC2<<15))
-#define PD_SOP_PRIME	(PD_SYNC1 | (PD_SYNC1<<5) | \
-			(PD_SYNC3<<10) | (PD_SYNC3<<15))
-#define PD_SOP_PRIME_PRIME	(PD_SYNC1 | (PD_SYNC3<<5) | \
-				(PD_SYNC1<<10) | (PD_SYNC3<<15))
-
-/* Hard Reset sequence : three RST-1 K-codes, then one RST-2 K-code */
-#define PD_HARD_RESET (PD_RST1 | (PD_RST1 << 5) |\
-		      (PD_RST1 << 10) | (PD_RST2 << 15))
-
 /*
  * Polarity based on 'DFP Perspective' (see table USB Type-C Cable and Connector
  * Specification)
@@ -216,7 +177,9 @@ enum pd_tx_errors {
  * be retrieved from TCPM. The last slot is a temporary buffer for collecting
  * a message before deciding whether or not to keep it.
  */
-#ifdef CONFIG_USB_POWER_DELIVERY
+#if defined(CONFIG_USB_PD_TCPC_RX_DEPTH)
+#define RX_BUFFER_SIZE CONFIG_USB_PD_TCPC_RX_DEPTH
+#elif defined(CONFIG_USB_POWER_DELIVERY)
 #define RX_BUFFER_SIZE 1
 #else
 #define RX_BUFFER_SIZE 2
@@ -249,8 +212,13 @@ static struct pd_port_controller {
 
 	/* Last received */
 	int rx_head[RX_BUFFER_SIZE+1];
+	uint8_t rx_type[RX_BUFFER_SIZE+1];
 	uint32_t rx_payload[RX_BUFFER_SIZE+1][7];
 	int rx_buf_head, rx_buf_tail;
+	/* messages not acknowledged because the buffer was full */
+	uint32_t rx_dropped;
+	/* most messages held at once */
+	uint8_t rx_max;
 
 	/* Next transmit */
 	enum tcpm_transmit_type tx_type;
@@ -277,6 +245,13 @@ static void rx_buf_increment(int port, int *buf_ptr)
 	*buf_ptr = *buf_ptr == RX_BUFFER_SIZE ? 0 : *buf_ptr + 1;
 }
 
+static int rx_buf_count(int port)
+{
+	int diff = pd[port].rx_buf_head - pd[port].rx_buf_tail;
+
+	return diff < 0 ? diff + RX_BUFFER_SIZE + 1 : diff;
+}
+
 static inline int encode_short(int port, int off, uint16_t val16)
 {
 	off = pd_write_sym(port, off, bmc4b5b[(val16 >> 0) & 0xF]);
@@ -291,20 +266,22 @@ int encode_word(int port, int off, uint32_t val32)
 	return encode_short(port, off, (val32 >> 16) & 0xFFFF);
 }
 
-/* prepare a 4b/5b-encoded PD message to send */
-int prepare_message(int port, uint16_t header, uint8_t cnt,
-		   const uint32_t *data)
+/* encode a PD message with the ordered set of 'type' */
+static int encode_message(int port, enum tcpm_transmit_type type,
+			  uint16_t header, uint8_t cnt, const uint32_t *data,
+			  uint32_t crc_xor)
 {
 	int off, i;
+	uint32_t crc;
 	/* 64-bit preamble */
 	off = pd_write_preamble(port);
-	if (pd[port].tx_type == TCPC_TX_SOP_PRIME) {
+	if (type == TCPC_TX_SOP_PRIME) {
 		/* SOP': 2x Sync-1 + 2x Sync-3 */
 		off = pd_write_sym(port, off, BMC(PD_SYNC1));
 		off = pd_write_sym(port, off, BMC(PD_SYNC1));
 		off = pd_write_sym(port, off, BMC(PD_SYNC3));
 		off = pd_write_sym(port, off, BMC(PD_SYNC3));
-	} else if (pd[port].tx_type == TCPC_TX_SOP_PRIME_PRIME) {
+	} else if (type == TCPC_TX_SOP_PRIME_PRIME) {
 		/* SOP'': Sync-1, Sync-3, Sync-1, Sync-3 */
 		off = pd_write_sym(port, off, BMC(PD_SYNC1));
 		off = pd_write_sym(port, off, BMC(PD_SYNC3));
@@ -320,23 +297,15 @@ int prepare_message(int port, uint16_t header, uint8_t cnt,
 	/* header */
 	off = encode_short(port, off, header);
 
-#ifdef CONFIG_COMMON_RUNTIME
-	mutex_lock(&pd_crc_lock);
-#endif
-
-	crc32_init();
-	crc32_hash16(header);
+	crc32_ctx_init(&crc);
+	crc32_ctx_hash16(&crc, header);
 	/* data payload */
 	for (i = 0; i < cnt; i++) {
 		off = encode_word(port, off, data[i]);
-		crc32_hash32(data[i]);
+		crc32_ctx_hash32(&crc, data[i]);
 	}
 	/* CRC */
-	off = encode_word(port, off, crc32_result());
-
-#ifdef CONFIG_COMMON_RUNTIME
-	mutex_unlock(&pd_crc_lock);
-#endif
+	off = encode_word(port, off, crc32_ctx_result(&crc) ^ crc_xor);
 
 	/* End Of Packet */
 	off = pd_write_sym(port, off, BMC(PD_EOP));
@@ -344,6 +313,28 @@ int prepare_message(int port, uint16_t header, uint8_t cnt,
 	return pd_write_last_edge(port, off);
 }
 
+/* prepare a 4b/5b-encoded PD message whose CRC is XORed with crc_xor */
+int prepare_message_crc(int port, uint16_t header, uint8_t cnt,
+			const uint32_t *data, uint32_t crc_xor)
+{
+	return encode_message(port, pd[port].tx_type, header, cnt, data,
+			      crc_xor);
+}
+
+/* prepare a 4b/5b-encoded PD message to send */
+int prepare_message(int port, uint16_t header, uint8_t cnt,
+		   const uint32_t *data)
+{
+	return prepare_message_crc(port, header, cnt, data, 0);
+}
+
+/* prepare a 4b/5b-encoded PD message to send with the ordered set 'type' */
+int prepare_message_sop(int port, int type, uint16_t header, uint8_t cnt,
+			const uint32_t *data)
+{
+	return encode_message(port, type, header, cnt, data, 0);
+}
+
 static int send_hard_reset(int port)
 {
 	int off;
@@ -448,7 +439,7 @@ static int send_validate_message(int port, uint16_t header,
 	}
 	/* we failed all the re-transmissions */
 	if (debug_level >= 1)
-		CPRINTF("TX NOACK%d %04x/%d\n", port, header, cnt);
+		CPRINTF_HOT("TX NOACK%d %04x/%d\n", port, header, cnt);
 	return PD_TX_ERR_GOODCRC;
 }
 
@@ -466,58 +457,6 @@ static void send_goodcrc(int port, int id)
 	pd_rx_enable_monitoring(port);
 }
 
-#if 0
-/* TODO: when/how do we trigger this ? */
-static int analyze_rx_bist(int port);
-
-void bist_mode_2_rx(int port)
-{
-	int analyze_bist = 0;
-	int num_bits;
-	timestamp_t start_time;
-
-	/* monitor for incoming packet */
-	pd_rx_enable_monitoring(port);
-
-	/* loop until we start receiving data */
-	start_time.val = get_time().val;
-	while ((get_time().val - start_time.val) < (500*MSEC)) {
-		task_wait_event(10*MSEC);
-		/* incoming packet ? */
-		if (pd_rx_started(port)) {
-			analyze_bist = 1;
-			break;
-		}
-	}
-
-	if (analyze_bist) {
-		/*
-		 * once we start receiving bist data, analyze 40 bytes
-		 * every 10 msec. Continue analyzing until BIST data
-		 * is no longer received. The standard limits the max
-		 * BIST length to 60 msec.
-		 */
-		start_time.val = get_time().val;
-		while ((get_time().val - start_time.val)
-			< (PD_T_BIST_RECEIVE)) {
-			num_bits = analyze_rx_bist(port);
-			pd_rx_complete(port);
-			/*
-			 * If no data was received, then analyze_rx_bist()
-			 * will return a -1 and there is no need to stay
-			 * in this mode
-			 */
-			if (num_bits == -1)
-				break;
-			msleep(10);
-			pd_rx_enable_monitoring(port);
-		}
-	} else {
-		CPRINTF("BIST RX TO\n");
-	}
-}
-#endif
-
 static void bist_mode_2_tx(int port)
 {
 	int bit;
@@ -544,188 +483,192 @@ static void bist_mode_2_tx(int port)
 	pd_tx_done(port, pd[port].polarity);
 }
 
-static inline int decode_short(int port, int off, uint16_t *val16)
-{
-	uint32_t w;
-	int end;
-
-	end = pd_dequeue_bits(port, off, 20, &w);
-
-#if 0 /* DEBUG */
-	CPRINTS("%d-%d: %05x %x:%x:%x:%x\n",
-		off, end, w,
-		dec4b5b[(w >> 15) & 0x1f], dec4b5b[(w >> 10) & 0x1f],
-		dec4b5b[(w >>  5) & 0x1f], dec4b5b[(w >>  0) & 0x1f]);
-#endif
-	*val16 = dec4b5b[w & 0x1f] |
-		(dec4b5b[(w >>  5) & 0x1f] << 4) |
-		(dec4b5b[(w >> 10) & 0x1f] << 8) |
-		(dec4b5b[(w >> 15) & 0x1f] << 12);
-	return end;
-}
-
-static inline int decode_word(int port, int off, uint32_t *val32)
+#ifdef CONFIG_USB_PD_RX_BER
+/* Interval between 2 reports of the bit error rate totals */
+#define BER_REPORT_INTERVAL SECOND
+
+/* Bit error rate measurement on the BIST Carrier Mode 2 traffic */
+static struct pd_ber {
+	uint8_t enabled;
+	/* frames decoded / without the alternating pattern */
+	uint32_t frames;
+	uint32_t invalid;
+	/* lost or extra edges, shifting the pattern by one bit */
+	uint32_t slips;
+	uint64_t bits;
+	uint64_t errors;
+	timestamp_t next_report;
+} ber[CONFIG_USB_PD_PORT_COUNT];
+
+static inline int count_set_bits(uint32_t n)
 {
-	off = decode_short(port, off, (uint16_t *)val32);
-	return decode_short(port, off, ((uint16_t *)val32 + 1));
+	n = n - ((n >> 1) & 0x55555555);
+	n = (n & 0x33333333) + ((n >> 2) & 0x33333333);
+	n = (n + (n >> 4)) & 0x0f0f0f0f;
+	return (n * 0x01010101) >> 24;
 }
 
-#ifdef CONFIG_COMMON_RUNTIME
-#if 0
 /*
- * TODO: when/how do we trigger this ? Could add custom vendor command
- * to TCPCI to enter bist verification? Is there an easier way?
+ * Decode the whole captured frame and count the bits which differ from
+ * the alternating 1's and 0's of BIST Carrier Mode 2.
+ *
+ * @return number of bits analyzed or -1 if no pattern was found.
  */
-static int count_set_bits(int n)
-{
-	int count = 0;
-	while (n) {
-		n &= (n - 1);
-		count++;
-	}
-	return count;
-}
-
 static int analyze_rx_bist(int port)
 {
-	int i = 0, bit = -1;
-	uint32_t w, match;
-	int invalid_bits = 0;
-	int bits_analyzed = 0;
-	static int total_invalid_bits;
+	int i = 1, bit = -1;
+	uint32_t w = 0, match;
+	int errors, bits = 0;
+
+	pd_init_dequeue(port);
 
 	/* dequeue bits until we see a full byte of alternating 1's and 0's */
 	while (i < 10 && (bit < 0 || (w != 0xaa && w != 0x55)))
 		bit = pd_dequeue_bits(port, i++, 8, &w);
 
-	/* if we didn't find any bytes that match criteria, display error */
-	if (i == 10) {
-		CPRINTF("invalid pattern\n");
+	if (bit < 0 || (w != 0xaa && w != 0x55)) {
+		ber[port].invalid++;
 		return -1;
 	}
 	/*
-	 * now we know what matching byte we are looking for, dequeue a bunch
-	 * more data and count how many bits differ from expectations.
+	 * now we know what matching byte we are looking for, dequeue the rest
+	 * of the frame and count how many bits differ from expectations.
 	 */
-	match = w;
-	bit = i - 1;
-	for (i = 0; i < 40; i++) {
-		bit = pd_dequeue_bits(port, bit, 8, &w);
-		if (i && (i % 20 == 0))
-			CPRINTF("\n");
-		CPRINTF("%02x ", w);
-		bits_analyzed += 8;
-		invalid_bits += count_set_bits(w ^ match);
+	match = w * 0x01010101;
+	while ((bit = pd_dequeue_bits(port, bit, 32, &w)) >= 0) {
+		errors = count_set_bits(w ^ match);
+		if (errors > 16) {
+			/* the decoder slipped by one bit : re-lock on it */
+			match = ~match;
+			errors = 32 - errors;
+			ber[port].slips++;
+		}
+		ber[port].errors += errors;
+		bits += 32;
 	}
 
-	total_invalid_bits += invalid_bits;
-
-	CPRINTF("\nInvalid: %d/%d\n",
-		invalid_bits, total_invalid_bits);
-	return bits_analyzed;
+	ber[port].frames++;
+	ber[port].bits += bits;
+	return bits;
 }
-#endif
-#endif
 
-struct rx_header pd_analyze_rx(int port, uint32_t *payload)
+static void ber_report(int port)
 {
-	int bit;
-	char *msg = "---";
-	uint32_t val = 0;
-	uint16_t header;
-	uint16_t rx_type = TCPC_TX_SOP;
-	uint32_t pcrc, ccrc;
-	int p, cnt;
-	uint32_t eop;
-
-	pd_init_dequeue(port);
+	CPRINTS("BER C%d: %ld/%ld bits, %d slips, %d/%d frames", port,
+		ber[port].errors, ber[port].bits, ber[port].slips,
+		ber[port].frames, ber[port].frames + ber[port].invalid);
+}
 
-	/* Detect preamble */
-	bit = pd_find_preamble(port);
-	if (bit == PD_RX_ERR_HARD_RESET) {
-		return RX_HEADER(TCPC_TX_HARD_RESET, 0);
-	} else if (bit == PD_RX_ERR_CABLE_RESET) {
-		return RX_HEADER(TCPC_TX_HARD_RESET, 0);
-	} else if (bit < 0) {
-		msg = "Preamble";
-		goto packet_err;
+static void ber_enable(int port, int enable)
+{
+	if (enable) {
+		memset(&ber[port], 0, sizeof(ber[port]));
+		ber[port].next_report.val = get_time().val +
+					    BER_REPORT_INTERVAL;
 	}
+	ber[port].enabled = enable;
+	task_wake(PD_PORT_TO_TASK_ID(port));
+}
 
-	/* Find the Start Of Packet sequence */
-	while (bit > 0) {
-		bit = pd_dequeue_bits(port, bit, 20, &val);
-		if (val == PD_SOP || val == PD_SOP_PRIME ||
-		    val == PD_SOP_PRIME_PRIME)
-			break;
-	}
-	if (bit < 0) {
-		msg = "SOP";
-		goto packet_err;
+/*
+ * Bit error rate mode : the port receives BIST frames only, every capture
+ * is analyzed and re-armed at once, the totals are reported periodically.
+ */
+static void ber_run(int port)
+{
+	if (pd_rx_started(port)) {
+		analyze_rx_bist(port);
+		pd_rx_complete(port);
 	}
-	switch (val) {
-	case PD_SOP_PRIME:
-		rx_type = TCPC_TX_SOP_PRIME;
-		break;
-	case PD_SOP_PRIME_PRIME:
-		rx_type = TCPC_TX_SOP_PRIME_PRIME;
-		break;
+
+	if (get_time().val >= ber[port].next_report.val) {
+		ber_report(port);
+		ber[port].next_report.val += BER_REPORT_INTERVAL;
 	}
 
-	/* read header */
-	bit = decode_short(port, bit, &header);
+	pd_rx_enable_monitoring(port);
+}
+#endif /* CONFIG_USB_PD_RX_BER */
 
-#ifdef CONFIG_COMMON_RUNTIME
-	mutex_lock(&pd_crc_lock);
+#ifdef CONFIG_USB_PD_RX_RETRY
+/* Outcome of the second decoding passes */
+static uint32_t rx_retry_ok[CONFIG_USB_PD_PORT_COUNT];
+static uint32_t rx_retry_fail[CONFIG_USB_PD_PORT_COUNT];
 #endif
 
-	crc32_init();
-	crc32_hash16(header);
-	cnt = PD_HEADER_CNT(header);
+/* Where the decoding of the last packet stopped (PD_DECODE_x) */
+static uint8_t rx_last_err[CONFIG_USB_PD_PORT_COUNT];
 
-	/* read payload data */
-	for (p = 0; p < cnt && bit > 0; p++) {
-		bit = decode_word(port, bit, payload+p);
-		crc32_hash32(payload[p]);
-	}
-	ccrc = crc32_result();
+int pd_rx_last_error(int port)
+{
+	return rx_last_err[port];
+}
 
-#ifdef CONFIG_COMMON_RUNTIME
-	mutex_unlock(&pd_crc_lock);
+static struct rx_header analyze_rx(int port, uint32_t *payload)
+{
+	static const char * const err_msg[] = {
+		[PD_DECODE_ERR_PREAMBLE] = "Preamble",
+		[PD_DECODE_ERR_SOP] = "SOP",
+		[PD_DECODE_ERR_LEN] = "len",
+		[PD_DECODE_ERR_CRC] = "CRC",
+		[PD_DECODE_ERR_EOP] = "EOP",
+	};
+	struct pd_decoder *dec = pd_get_decoder(port);
+	struct pd_decode_result res;
+	enum pd_decode_err err;
+
+#ifdef CONFIG_USB_PD_RX_RETRY
+	dec->retry = 1;
 #endif
-
-	if (bit < 0) {
-		msg = "len";
-		goto packet_err;
-	}
-
-	/* check transmitted CRC */
-	bit = decode_word(port, bit, &pcrc);
-	if (bit < 0 || pcrc != ccrc) {
-		msg = "CRC";
-		if (pcrc != ccrc)
-			rx_type = PD_RX_ERR_CRC;
+	err = pd_decode_packet(dec, &res, payload);
+	rx_last_err[port] = err;
+	if (res.type == TCPC_TX_HARD_RESET || res.type == TCPC_TX_CABLE_RESET)
+		return RX_HEADER(res.type, 0);
+	if (err == PD_DECODE_SKIPPED)
+		return RX_HEADER(PD_RX_ERR_UNSUPPORTED_SOP, 0);
+	if (res.partial && debug_level >= 1)
+		CPRINTF_HOT("RX%d partial ordered set, SOP%d\n", port,
+			    res.type);
+
+	if (err == PD_DECODE_ERR_CRC && debug_level >= 1)
+		CPRINTF_HOT("CRC%d %08x <> %08x\n", port, res.crc_rx,
+			    res.crc);
+#ifdef CONFIG_USB_PD_RX_RETRY
+	if (res.retried) {
+		if (err == PD_DECODE_ERR_CRC) {
+			rx_retry_fail[port]++;
+			return RX_HEADER(PD_RX_ERR_CRC, res.header);
+		}
+		rx_retry_ok[port]++;
 		if (debug_level >= 1)
-			CPRINTF("CRC%d %08x <> %08x\n", port, pcrc, ccrc);
+			CPRINTF_HOT("CRC%d recovered %d/16\n", port,
+				    res.retry_shift);
 	}
-
-	/*
-	 * Check EOP. EOP is 5 bits, but last bit may not be able to
-	 * be dequeued, depending on ending state of CC line, so stop
-	 * at 4 bits (assumes last bit is 0).
-	 */
-	bit = pd_dequeue_bits(port, bit, 4, &eop);
-	if (bit < 0 || eop != PD_EOP) {
-		msg = "EOP";
-		goto packet_err;
+#endif
+	if (err == PD_DECODE_ERR_CRC)
+		return RX_HEADER(PD_RX_ERR_CRC, res.header);
+	if (err != PD_DECODE_OK) {
+		if (debug_level >= 2)
+			pd_dump_packet(port, err_msg[err]);
+		else
+#ifdef CONFIG_TOKEN_LOG
+			/* no strings in the token log : the PD_DECODE_ERR_x */
+			TOKEN_LOG("RXERR%d err %d\n", port, err);
+#else
+			CPRINTF("RXERR%d %s\n", port, err_msg[err]);
+#endif
+		return RX_HEADER(PD_RX_ERR_INVAL, 0);
 	}
 
-	return RX_HEADER(rx_type, header);
-packet_err:
-	if (debug_level >= 2)
-		pd_dump_packet(port, msg);
-	else
-		CPRINTF("RXERR%d %s\n", port, msg);
-	return RX_HEADER(bit, 0);
+	return RX_HEADER(res.type, res.header);
+}
+
+struct rx_header pd_analyze_rx(int port, uint32_t *payload)
+{
+	struct rx_header rx = analyze_rx(port, payload);
+
+	TRACEPOINT(TP_PD_RX_DONE, (uint16_t)rx.packet_type << 16 | rx.head);
+	return rx;
 }
 
 static void handle_request(int port, uint16_t head)
@@ -739,6 +682,83 @@ static void handle_request(int port, uint16_t head)
 		pd_rx_enable_monitoring(port);
 }
 
+#ifdef CONFIG_USB_PD_FAST_RESPONSE
+/* Latency of the sink Requests, from the end of the Source_Capabilities */
+static struct {
+	uint8_t slow; /* fast path disabled from the console */
+	uint8_t src_cap;
+	uint32_t src_cap_ts;
+	uint32_t count, fast, late;
+	uint32_t last, min, max, sum; /* us */
+} resp[CONFIG_USB_PD_PORT_COUNT];
+
+/* a Request is about to be sent */
+static void resp_tx(int port, uint16_t header, int fast)
+{
+	uint32_t dt;
+
+	if (!resp[port].src_cap || PD_HEADER_TYPE(header) != PD_DATA_REQUEST ||
+	    !PD_HEADER_CNT(header))
+		return;
+
+	dt = get_time().le.lo - resp[port].src_cap_ts;
+	resp[port].src_cap = 0;
+	if (!resp[port].count || dt < resp[port].min)
+		resp[port].min = dt;
+	if (dt > resp[port].max)
+		resp[port].max = dt;
+	if (dt > PD_T_RECEIVER_RESPONSE)
+		resp[port].late++;
+	resp[port].last = dt;
+	resp[port].sum += dt;
+	resp[port].count++;
+	resp[port].fast += fast;
+}
+
+/*
+ * A message has been received and acknowledged : send the response built by
+ * the protocol layer right away, unless we are already in the middle of a
+ * transmission of the protocol layer.
+ */
+static void resp_rx(int port, uint16_t head, uint32_t *payload, uint32_t eop,
+		    int evt)
+{
+	const uint32_t *data;
+	uint16_t header;
+	int res;
+
+	if (PD_HEADER_TYPE(head) != PD_DATA_SOURCE_CAP ||
+	    !PD_HEADER_CNT(head) || pd[port].power_role != PD_ROLE_SINK)
+		return;
+
+	resp[port].src_cap = 1;
+	resp[port].src_cap_ts = eop;
+	if (resp[port].slow || (evt & PD_EVENT_TX))
+		return;
+
+	header = pd_fast_response(port, head, payload, &data);
+	if (!header)
+		return;
+
+	pd[port].tx_type = TCPC_TX_SOP;
+	resp_tx(port, header, 1);
+	res = send_validate_message(port, header, data);
+	pd_fast_response_done(port, res >= 0);
+}
+
+static void resp_report(int port)
+{
+	ccprintf("Fast path %s\n", resp[port].slow ? "off" : "on");
+	if (!resp[port].count)
+		return;
+	ccprintf("Requests: %d (%d fast), %d over %d us\n"
+		 "Latency: last %d min %d avg %d max %d us\n",
+		 resp[port].count, resp[port].fast, resp[port].late,
+		 PD_T_RECEIVER_RESPONSE, resp[port].last, resp[port].min,
+		 resp[port].sum / resp[port].count, resp[port].max);
+}
+#endif /* CONFIG_USB_PD_FAST_RESPONSE */
+
 /* Convert CC voltage to CC status */
 static int cc_voltage_to_status(int port, int cc_volt, int cc_sel)
 {
@@ -788,12 +808,24 @@ int tcpc_run(int port, int evt)
 {
 	int cc, i;
 
+#ifdef CONFIG_USB_PD_RX_BER
+	if (ber[port].enabled) {
+		ber_run(port);
+		return 10*MSEC;
+	}
+#endif
+
 	/* incoming packet ? */
 	if (pd_rx_started(port) && pd[port].rx_enabled) {
 		/* Get message and place at RX buffer head */
-		struct rx_header rx = pd_analyze_rx(port,
-				pd[port].rx_payload[pd[port].rx_buf_head]);
+		uint32_t *payload = pd[port].rx_payload[pd[port].rx_buf_head];
+		struct rx_header rx = pd_analyze_rx(port, payload);
+#ifdef CONFIG_USB_PD_FAST_RESPONSE
+		/* the decoding follows the DMA, it ends with the message */
+		uint32_t eop = get_time().le.lo;
+#endif
 		pd[port].rx_head[pd[port].rx_buf_head] = rx.head;
+		pd[port].rx_type[pd[port].rx_buf_head] = rx.packet_type;
 		pd_rx_complete(port);
 
 		/*
@@ -803,12 +835,26 @@ int tcpc_run(int port, int evt)
 		 * no space in buffer, then do not send goodCRC and drop
 		 * message.
 		 */
+		/* a Cable Reset and the debug SOP* are for the cable plugs */
 		if (rx.packet_type == TCPC_TX_HARD_RESET) {
 			alert(port, TCPC_REG_ALERT_RX_HARD_RST);
-		} else if (rx.packet_type >= 0 && !rx_buf_is_full(port)) {
+		} else if (rx.packet_type >= 0 &&
+			   rx.packet_type <= TCPC_TX_SOP_PRIME_PRIME &&
+			   rx_buf_is_full(port)) {
+			/* no GoodCRC : the sender retries it */
+			pd[port].rx_dropped++;
+		} else if (rx.packet_type >= 0 &&
+			   rx.packet_type <= TCPC_TX_SOP_PRIME_PRIME) {
 			rx_buf_increment(port, &pd[port].rx_buf_head);
-			handle_request(port, rx.head);
+			/* the TCPM can fetch it while the GoodCRC goes out */
 			alert(port, TCPC_REG_ALERT_RX_STATUS);
+			pd[port].rx_max = MAX(pd[port].rx_max,
+					      rx_buf_count(port));
+			handle_request(port, rx.head);
+#ifdef CONFIG_USB_PD_FAST_RESPONSE
+			if (rx.packet_type == TCPC_TX_SOP)
+				resp_rx(port, rx.head, payload, eop, evt);
+#endif
 		}
 	}
 
@@ -820,6 +866,10 @@ int tcpc_run(int port, int evt)
 		case TCPC_TX_SOP:
 		case TCPC_TX_SOP_PRIME:
 		case TCPC_TX_SOP_PRIME_PRIME:
+#ifdef CONFIG_USB_PD_FAST_RESPONSE
+			if (pd[port].tx_type == TCPC_TX_SOP)
+				resp_tx(port, pd[port].tx_head, 0);
+#endif
 			res = send_validate_message(port,
 					pd[port].tx_head,
 					pd[port].tx_data);
@@ -931,9 +981,14 @@ int tcpc_alert_status_clear(int port, uint16_t mask)
 	if (mask & TCPC_REG_ALERT_RX_STATUS) {
 		if (!rx_buf_is_empty(port)) {
 			rx_buf_increment(port, &pd[port].rx_buf_tail);
-			if (!rx_buf_is_empty(port))
+			if (!rx_buf_is_empty(port)) {
 				/* buffer is not empty, keep alert active */
 				mask &= ~TCPC_REG_ALERT_RX_STATUS;
+#ifdef CONFIG_USB_POWER_DELIVERY
+				/* the PD task reads one per RX event */
+				pd_rx_event(port);
+#endif
+			}
 		}
 	}
 
@@ -1241,6 +1296,8 @@ static int tcpc_i2c_read(int port, int reg, uint8_t *payload)
 {
 	int cc1, cc2;
 	int alert;
+	int tail = pd[port].rx_buf_tail;
+	int cnt = PD_HEADER_CNT(pd[port].rx_head[tail]);
 
 	switch (reg) {
 	case TCPC_REG_VENDOR_ID:
@@ -1278,18 +1335,29 @@ static int tcpc_i2c_read(int port, int reg, uint8_t *payload)
 		payload[1] = (pd[port].alert_mask >> 8) & 0xff;
 		return 2;
 	case TCPC_REG_RX_BYTE_CNT:
-		payload[0] = 3 + 4 *
-			PD_HEADER_CNT(pd[port].rx_head[pd[port].rx_buf_tail]);
+		/*
+		 * The whole RX buffer follows, as the registers are laid out :
+		 * the frame type, header and data objects come in the same
+		 * block read, the master stops after the byte count if it
+		 * only wants it.
+		 */
+		payload[0] = 3 + 4 * cnt;
+		payload[1] = pd[port].rx_type[tail];
+		payload[2] = pd[port].rx_head[tail] & 0xff;
+		payload[3] = (pd[port].rx_head[tail] >> 8) & 0xff;
+		memcpy(payload + 4, pd[port].rx_payload[tail], 4 * cnt);
+		return 4 + 4 * cnt;
+	case TCPC_REG_RX_BUF_FRAME_TYPE:
+		payload[0] = pd[port].rx_type[tail];
 		return 1;
 	case TCPC_REG_RX_HDR:
-		payload[0] = pd[port].rx_head[pd[port].rx_buf_tail] & 0xff;
-		payload[1] =
-			(pd[port].rx_head[pd[port].rx_buf_tail] >> 8) & 0xff;
+		payload[0] = pd[port].rx_head[tail] & 0xff;
+		payload[1] = (pd[port].rx_head[tail] >> 8) & 0xff;
 		return 2;
 	case TCPC_REG_RX_DATA:
-		memcpy(payload, pd[port].rx_payload[pd[port].rx_buf_tail],
-		       sizeof(pd[port].rx_payload[pd[port].rx_buf_tail]));
-		return sizeof(pd[port].rx_payload[pd[port].rx_buf_tail]);
+		memcpy(payload, pd[port].rx_payload[tail],
+		       sizeof(pd[port].rx_payload[tail]));
+		return sizeof(pd[port].rx_payload[tail]);
 	case TCPC_REG_POWER_STATUS:
 		payload[0] = pd[port].power_status;
 		return 1;
@@ -1390,6 +1458,36 @@ static int command_tcpc(int argc, char **argv)
 		pd_set_clock(port, freq);
 		ccprintf("set TX frequency to %d Hz\n", freq);
 		return EC_SUCCESS;
+#ifdef CONFIG_USB_PD_RX_BER
+	} else if (!strcasecmp(argv[2], "ber")) {
+		if (argc >= 4) {
+			if (!strcasecmp(argv[3], "on"))
+				ber_enable(port, 1);
+			else if (!strcasecmp(argv[3], "off"))
+				ber_enable(port, 0);
+			else
+				return EC_ERROR_PARAM3;
+		}
+		ccprintf("BER %s\n", ber[port].enabled ? "on" : "off");
+		ber_report(port);
+#endif
+#ifdef CONFIG_USB_PD_FAST_RESPONSE
+	} else if (!strcasecmp(argv[2], "resp")) {
+		if (argc >= 4) {
+			if (!strcasecmp(argv[3], "on"))
+				resp[port].slow = 0;
+			else if (!strcasecmp(argv[3], "off"))
+				resp[port].slow = 1;
+			else if (!strcasecmp(argv[3], "clear")) {
+				int slow = resp[port].slow;
+
+				memset(&resp[port], 0, sizeof(resp[port]));
+				resp[port].slow = slow;
+			} else
+				return EC_ERROR_PARAM3;
+		}
+		resp_report(port);
+#endif
 	} else if (!strncasecmp(argv[2], "state", 5)) {
 		ccprintf("Port C%d, %s - CC:%d, CC0:%d, CC1:%d\n"
 			 "Alert: 0x%02x Mask: 0x%04x\n"
@@ -1399,11 +1497,23 @@ static int command_tcpc(int argc, char **argv)
 			 pd[port].cc_status[0], pd[port].cc_status[1],
 			 pd[port].alert, pd[port].alert_mask,
 			 pd[port].power_status, pd[port].power_status_mask);
+#ifdef CONFIG_USB_PD_RX_RETRY
+		ccprintf("CRC retries: %d ok, %d failed\n",
+			 rx_retry_ok[port], rx_retry_fail[port]);
+#endif
+		ccprintf("RX buffer: %d held, %d max of %d, %u dropped\n",
+			 rx_buf_count(port), pd[port].rx_max, RX_BUFFER_SIZE,
+			 pd[port].rx_dropped);
+		if (argc >= 4 && !strcasecmp(argv[3], "clear")) {
+			pd[port].rx_max = 0;
+			pd[port].rx_dropped = 0;
+		}
 	}
 
 	return EC_SUCCESS;
 }
 DECLARE_CONSOLE_COMMAND(tcpc, command_tcpc,
-			"dump [0|1]\n\t<port> [clock|state]",
+			"dump [0|1]\n\t<port> [clock|state [clear]|ber [on|off]|"
+			"resp [on|off|clear]]",
 			"Type-C Port Controller");
 #endif
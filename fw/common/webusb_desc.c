@@ -5,6 +5,7 @@
 /* WebUSB platform descriptor */
 
 #include "common.h"
+#include "hooks.h"
 #include "usb_descriptor.h"
 #include "util.h"
 
@@ -14,6 +15,68 @@
 
 const void *webusb_url = USB_URL_DESC(HTTPS, CONFIG_WEBUSB_URL);
 
+#ifdef CONFIG_WEBUSB_WINUSB_GUID
+/* Vendor request code of the Microsoft OS 2.0 descriptor set */
+#define MS_OS_20_VENDOR_CODE 0x02
+
+/* "{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}" */
+BUILD_ASSERT(sizeof(CONFIG_WEBUSB_WINUSB_GUID) == 39);
+
+/* Every interface is bound to WinUSB */
+static struct {
+	struct ms_os_20_set_header header;
+	struct ms_os_20_config_subset config;
+	struct ms_os_20_winusb_function function[USB_IFACE_COUNT];
+} __packed ms_os_20_desc = {
+	.header = {
+		.wLength = sizeof(struct ms_os_20_set_header),
+		.wDescriptorType = MS_OS_20_SET_HEADER_DESCRIPTOR,
+		.dwWindowsVersion = MS_OS_20_WINDOWS_8_1,
+		.wTotalLength = sizeof(ms_os_20_desc),
+	},
+	.config = {
+		.wLength = sizeof(struct ms_os_20_config_subset),
+		.wDescriptorType = MS_OS_20_SUBSET_HEADER_CONFIG,
+		.bConfigurationValue = 0,
+		.wTotalLength = sizeof(ms_os_20_desc) -
+				sizeof(struct ms_os_20_set_header),
+	},
+	.function = {
+		[0 ... USB_IFACE_COUNT - 1] = {
+			.wLength = 8,
+			.wDescriptorType = MS_OS_20_SUBSET_HEADER_FUNCTION,
+			.wSubsetLength = sizeof(struct ms_os_20_winusb_function),
+			.wCompatLength = 20,
+			.wCompatType = MS_OS_20_FEATURE_COMPATIBLE_ID,
+			.CompatibleID = "WINUSB",
+			.wPropLength = 132,
+			.wPropType = MS_OS_20_FEATURE_REG_PROPERTY,
+			.wPropertyDataType = MS_OS_20_REG_MULTI_SZ,
+			.wPropertyNameLength = 42,
+			.PropertyName = L"DeviceInterfaceGUIDs",
+			.wPropertyDataLength = 80,
+			/* REG_MULTI_SZ : double null termination */
+			.PropertyData = WIDESTR(CONFIG_WEBUSB_WINUSB_GUID) L"\0",
+		},
+	},
+};
+BUILD_ASSERT(sizeof(struct ms_os_20_winusb_function) == 8 + 20 + 132);
+
+const struct bos_context ms_os_20_ctx = {
+	.descp = (void *)&ms_os_20_desc,
+	.size = sizeof(ms_os_20_desc),
+};
+
+static void ms_os_20_init(void)
+{
+	int i;
+
+	for (i = 0; i < USB_IFACE_COUNT; i++)
+		ms_os_20_desc.function[i].bFirstInterface = i;
+}
+DECLARE_HOOK(HOOK_INIT, ms_os_20_init, HOOK_PRIO_FIRST);
+#endif /* CONFIG_WEBUSB_WINUSB_GUID */
+
 /*
  * Platform Descriptor in the device Binary Object Store
  * as defined by USB 3.1 spec chapter 9.6.2.
@@ -21,12 +84,19 @@ const void *webusb_url = USB_URL_DESC(HTTPS, CONFIG_WEBUSB_URL);
 static struct {
 	struct usb_bos_hdr_descriptor bos;
 	struct usb_platform_descriptor platform;
-} bos_desc = {
+#ifdef CONFIG_WEBUSB_WINUSB_GUID
+	struct usb_ms_os_20_platform_descriptor winusb;
+#endif
+} __packed bos_desc = {
 	.bos = {
 		.bLength = USB_DT_BOS_SIZE,
 		.bDescriptorType = USB_DT_BOS,
-		.wTotalLength = (USB_DT_BOS_SIZE + USB_DT_PLATFORM_SIZE),
+		.wTotalLength = sizeof(bos_desc),
+#ifdef CONFIG_WEBUSB_WINUSB_GUID
+		.bNumDeviceCaps = 2,  /* WebUSB and Microsoft OS 2.0 */
+#else
 		.bNumDeviceCaps = 1,  /* platform caps */
+#endif
 	},
 	.platform = {
 		.bLength = USB_DT_PLATFORM_SIZE,
@@ -38,6 +108,19 @@ static struct {
 		.bVendorCode = 0x01,
 		.iLandingPage = 1,
 	},
+#ifdef CONFIG_WEBUSB_WINUSB_GUID
+	.winusb = {
+		.bLength = USB_DT_MS_OS_20_PLATFORM_SIZE,
+		.bDescriptorType = USB_DT_DEVICE_CAPABILITY,
+		.bDevCapabilityType = USB_DC_DTYPE_PLATFORM,
+		.bReserved = 0,
+		.PlatformCapUUID = USB_PLAT_CAP_MS_OS_20,
+		.dwWindowsVersion = MS_OS_20_WINDOWS_8_1,
+		.wMSOSDescriptorSetTotalLength = sizeof(ms_os_20_desc),
+		.bMS_VendorCode = MS_OS_20_VENDOR_CODE,
+		.bAltEnumCode = 0,
+	},
+#endif
 };
 
 const struct bos_context bos_ctx = {
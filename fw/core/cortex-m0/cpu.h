@@ -33,6 +33,16 @@
 
 #define CPU_NVIC_CCR_UNALIGN_TRAP (1 << 3)
 
+/* SysTick timer */
+#define CPU_SYSTICK_CSR        CPUREG(0xe000e010)
+#define CPU_SYSTICK_RVR        CPUREG(0xe000e014)
+#define CPU_SYSTICK_CVR        CPUREG(0xe000e018)
+
+#define CPU_SYSTICK_CSR_ENABLE    (1 << 0)
+#define CPU_SYSTICK_CSR_TICKINT   (1 << 1)
+#define CPU_SYSTICK_CSR_CLKSOURCE (1 << 2)
+#define CPU_SYSTICK_MASK          0x00ffffff
+
 /* Set up the cpu to detect faults */
 void cpu_init(void);
 
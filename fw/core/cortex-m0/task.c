@@ -6,9 +6,11 @@
 /* Task scheduling / events module for Chrome EC operating system */
 
 #include "atomic.h"
+#include "clock.h"
 #include "common.h"
 #include "console.h"
 #include "cpu.h"
+#include "hwtimer.h"
 #include "link_defs.h"
 #include "panic.h"
 #include "task.h"
@@ -31,6 +33,9 @@ typedef union {
 /* Value to store in unused stack */
 #define STACK_UNUSED_VALUE 0xdeadd00d
 
+/* Bottom of the system stack */
+extern uint32_t stack_start[];
+
 /* declare task routine prototypes */
 #define TASK(n, r, d, s) void r(void);
 void __idle(void);
@@ -59,18 +64,76 @@ static uint32_t task_switches;   /* Number of times active task changed */
 static uint32_t irq_dist[CONFIG_IRQ_COUNT];  /* Distribution of IRQ calls */
 #endif
 
+#ifdef CONFIG_TASK_PROFILING_CYCLES
+static uint32_t irq_start[CONFIG_IRQ_COUNT]; /* Start of the current call */
+static uint64_t irq_total[CONFIG_IRQ_COUNT]; /* Time in each IRQ handler */
+static uint32_t irq_max[CONFIG_IRQ_COUNT];   /* Longest call of each IRQ */
+static uint32_t task_switch_in[TASK_ID_COUNT]; /* Times each task got the CPU */
+
+/*
+ * Core clock cycles from the free running SysTick down-counter. The 24-bit
+ * counter wraps every 350 ms at 48 MHz, its interrupt extends it on every
+ * wrap.
+ */
+static uint64_t prof_time(void)
+{
+	static uint32_t last;
+	static uint64_t cycles;
+	uint32_t int_mask, now;
+
+	/* called at every exception priority */
+	int_mask = get_int_mask();
+	interrupt_disable();
+	now = CPU_SYSTICK_CVR;
+	cycles += (last - now) & CPU_SYSTICK_MASK;
+	last = now;
+	set_int_mask(int_mask);
+
+	return cycles;
+}
+#define PROF_TO_US(t) ((t) / (clock_get_freq() / SECOND))
+
+void sys_tick_handler(void)
+{
+	prof_time();
+}
+#else
+#define prof_time() (get_time().val)
+#define PROF_TO_US(t) (t)
+#endif
+
 extern int __task_start(int *task_stack_ready);
 
 #ifndef CONFIG_LOW_POWER_IDLE
+#ifdef CONFIG_IDLE_TIME
+static uint32_t idle_time;
+
+uint32_t idle_time_get(void)
+{
+	return idle_time;
+}
+#endif
+
 /* Idle task.  Executed when no tasks are ready to be scheduled. */
 void __idle(void)
 {
 	while (1) {
+#ifdef CONFIG_IDLE_TIME
+		uint32_t t;
+
+		/* the pending interrupt wakes up the core all the same */
+		interrupt_disable();
+		t = __hw_clock_source_read();
+		asm("wfi");
+		idle_time += __hw_clock_source_read() - t;
+		interrupt_enable();
+#else
 		/*
 		 * Wait for the next irq event.  This stops the CPU clock
 		 * (sleep / deep sleep, depending on chip config).
 		 */
 		asm("wfi");
+#endif
 	}
 }
 #endif /* !CONFIG_LOW_POWER_IDLE */
@@ -157,6 +220,19 @@ void interrupt_enable(void)
 	asm("cpsie i");
 }
 
+uint32_t get_int_mask(void)
+{
+	uint32_t primask;
+
+	asm volatile("mrs %0, primask" : "=r"(primask));
+	return primask;
+}
+
+void set_int_mask(uint32_t val)
+{
+	asm volatile("msr primask, %0" : : "r"(val));
+}
+
 inline int in_interrupt_context(void)
 {
 	int ret;
@@ -211,7 +287,7 @@ task_  __attribute__((noinline)) *__svc_handler(int desched, task_id_t resched)
 	 * start time explicitly.
 	 */
 	if (exc == 0xb) {
-		t = get_time().val;
+		t = prof_time();
 		current_task->runtime += (t - exc_end_time);
 		exc_end_time = t;
 		svc_calls++;
@@ -244,7 +320,7 @@ task_  __attribute__((noinline)) *__svc_handler(int desched, task_id_t resched)
 
 #ifdef CONFIG_TASK_PROFILING
 	/* Track additional time in re-sched exception context */
-	t = get_time().val;
+	t = prof_time();
 	exc_total_time += (t - exc_end_time);
 
 	exc_end_time = t;
@@ -252,8 +328,12 @@ task_  __attribute__((noinline)) *__svc_handler(int desched, task_id_t resched)
 
 	/* Switch to new task */
 #ifdef CONFIG_TASK_PROFILING
-	if (next != current)
+	if (next != current) {
 		task_switches++;
+#ifdef CONFIG_TASK_PROFILING_CYCLES
+		task_switch_in[next - tasks]++;
+#endif
+	}
 #endif
 	current_task = next;
 	return current;
@@ -274,15 +354,19 @@ void task_start_irq_handler(void *excep_return)
 	 * Get time before checking depth, in case this handler is
 	 * pre-empted.
 	 */
-	uint64_t t = get_time().val;
+	uint64_t t = prof_time();
 	int irq = get_interrupt_context() - 16;
 
 	/*
 	 * Track IRQ distribution.  No need for atomic add, because an IRQ
 	 * can't pre-empt itself.
 	 */
-	if (irq < ARRAY_SIZE(irq_dist))
+	if (irq < ARRAY_SIZE(irq_dist)) {
 		irq_dist[irq]++;
+#ifdef CONFIG_TASK_PROFILING_CYCLES
+		irq_start[irq] = t;
+#endif
+	}
 
 	/*
 	 * Continue iff the tasks are ready and we are not called from another
@@ -301,7 +385,19 @@ void task_start_irq_handler(void *excep_return)
 
 void task_end_irq_handler(void *excep_return)
 {
-	uint64_t t = get_time().val;
+	uint64_t t = prof_time();
+#ifdef CONFIG_TASK_PROFILING_CYCLES
+	int irq = get_interrupt_context() - 16;
+
+	/* Service time, with the higher priority IRQs nested in it */
+	if (irq < ARRAY_SIZE(irq_total)) {
+		uint32_t d = (uint32_t)t - irq_start[irq];
+
+		irq_total[irq] += d;
+		if (d > irq_max[irq])
+			irq_max[irq] = d;
+	}
+#endif
 	/*
 	 * Continue iff the tasks are ready and we are not called from another
 	 * exception (as the time accouting is done in the outer irq).
@@ -550,12 +646,60 @@ void task_print_list(void)
 			stackused -= sizeof(uint32_t);
 
 		ccprintf("%4d %c %-16s %08x %11.6ld  %3d/%3d\n", i, is_ready,
-			 task_names[i], tasks[i].events, tasks[i].runtime,
+			 task_names[i], tasks[i].events,
+			 PROF_TO_US(tasks[i].runtime),
 			 stackused, tasks_init[i].stack_size);
 		cflush();
 	}
 }
 
+#ifdef CONFIG_CMD_STACKINFO
+/* Bytes of the stack [start, end[ written so far : its high-water mark */
+static int stack_used(const uint32_t *start, const uint32_t *end)
+{
+	const uint32_t *sp = start;
+
+	while (sp < end && *sp == STACK_UNUSED_VALUE)
+		sp++;
+	return (end - sp) * sizeof(uint32_t);
+}
+
+static void print_stack(int id, const char *name, const uint32_t *start,
+			int size)
+{
+	int used = stack_used(start, start + size / sizeof(uint32_t));
+
+	/* the lowest word is the canary checked on every context switch */
+	ccprintf("%4d %-16s %5d %5d %5d%s\n", id, name, size, used,
+		 size - used, *start != STACK_UNUSED_VALUE ? " OVERFLOW" : "");
+	cflush();
+}
+
+static int command_stack_info(int argc, char **argv)
+{
+	int spare = 0;
+	int i;
+
+	ccputs("Task Name              Size  Used  Free\n");
+	for (i = 0; i < TASK_ID_COUNT; i++) {
+		print_stack(i, task_names[i], tasks[i].stack,
+			    tasks_init[i].stack_size);
+		spare += tasks_init[i].stack_size -
+			 stack_used(tasks[i].stack, tasks[i].stack +
+				    tasks_init[i].stack_size /
+				    sizeof(uint32_t));
+	}
+	/* interrupts and exceptions run on the system stack */
+	print_stack(-1, "<< system >>", stack_start, CONFIG_STACK_SIZE);
+	ccprintf("Never used in the task stacks: %d bytes\n", spare);
+
+	return EC_SUCCESS;
+}
+DECLARE_CONSOLE_COMMAND(stackinfo, command_stack_info,
+			NULL,
+			"Print the stack high-water marks");
+#endif
+
 int command_task_info(int argc, char **argv)
 {
 #ifdef CONFIG_TASK_PROFILING
@@ -566,21 +710,37 @@ int command_task_info(int argc, char **argv)
 	task_print_list();
 
 #ifdef CONFIG_TASK_PROFILING
+#ifdef CONFIG_TASK_PROFILING_CYCLES
+	ccputs("Task switches in by task:\n");
+	for (i = 0; i < TASK_ID_COUNT; i++)
+		ccprintf("%4d %-16s %8d\n", i, task_names[i],
+			 task_switch_in[i]);
+	ccputs("IRQ counts by type, total and max service time:\n");
+#else
 	ccputs("IRQ counts by type:\n");
+#endif
 	cflush();
 	for (i = 0; i < ARRAY_SIZE(irq_dist); i++) {
 		if (irq_dist[i]) {
+#ifdef CONFIG_TASK_PROFILING_CYCLES
+			ccprintf("%4d %8d %11.6ld s %6d us\n", i, irq_dist[i],
+				 PROF_TO_US(irq_total[i]),
+				 (int)PROF_TO_US(irq_max[i]));
+#else
 			ccprintf("%4d %8d\n", i, irq_dist[i]);
+#endif
 			total += irq_dist[i];
 		}
 	}
 	ccprintf("Service calls:          %11d\n", svc_calls);
 	ccprintf("Total exceptions:       %11d\n", total + svc_calls);
 	ccprintf("Task switches:          %11d\n", task_switches);
-	ccprintf("Task switching started: %11.6ld s\n", task_start_time);
+	ccprintf("Task switching started: %11.6ld s\n",
+		 PROF_TO_US(task_start_time));
 	ccprintf("Time in tasks:          %11.6ld s\n",
-		 get_time().val - task_start_time);
-	ccprintf("Time in exceptions:     %11.6ld s\n", exc_total_time);
+		 PROF_TO_US(prof_time() - task_start_time));
+	ccprintf("Time in exceptions:     %11.6ld s\n",
+		 PROF_TO_US(exc_total_time));
 #endif
 
 	return EC_SUCCESS;
@@ -612,6 +772,16 @@ void task_pre_init(void)
 	uint32_t *stack_next = (uint32_t *)task_stacks;
 	int i;
 
+#ifdef CONFIG_CMD_STACKINFO
+	uint32_t *sp;
+
+	/* Fill the unused system stack, below what is running now */
+	asm volatile("mov %0, sp" : "=r"(sp));
+	for (stack_next = stack_start; stack_next < sp - 8; stack_next++)
+		*stack_next = STACK_UNUSED_VALUE;
+	stack_next = (uint32_t *)task_stacks;
+#endif
+
 	/* Fill the task memory with initial values */
 	for (i = 0; i < TASK_ID_COUNT; i++) {
 		uint32_t *sp;
@@ -657,7 +827,13 @@ void task_pre_init(void)
 int task_start(void)
 {
 #ifdef CONFIG_TASK_PROFILING
-	task_start_time = exc_end_time = get_time().val;
+#ifdef CONFIG_TASK_PROFILING_CYCLES
+	CPU_SYSTICK_RVR = CPU_SYSTICK_MASK;
+	CPU_SYSTICK_CVR = 0;
+	CPU_SYSTICK_CSR = CPU_SYSTICK_CSR_CLKSOURCE | CPU_SYSTICK_CSR_TICKINT |
+			  CPU_SYSTICK_CSR_ENABLE;
+#endif
+	task_start_time = exc_end_time = prof_time();
 #endif
 
 	return __task_start(&start_called);
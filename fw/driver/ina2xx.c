@@ -2,7 +2,7 @@
  * Use of this source code is governed by a BSD-style license that can be
  * found in the LICENSE file.
  *
- * TI INA219/231 Current/Power monitor driver.
+ * TI INA219/231/260 Current/Power monitor driver.
  */
 
 #include "console.h"
@@ -45,17 +45,89 @@ int ina2xx_write(uint8_t idx, uint8_t reg, uint16_t val)
 	return res;
 }
 
+#ifdef CONFIG_I2C_ASYNC
+int ina2xx_read_async(uint8_t idx, uint8_t reg, uint8_t *buf,
+		      i2c_async_cb cb, void *priv)
+{
+	/* register pointers outliving the call : regs[reg] == reg */
+	static const uint8_t regs[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	uint8_t addr = INA2XX_I2C_ADDR | (idx << 1);
+
+	if (reg >= ARRAY_SIZE(regs))
+		return EC_ERROR_INVAL;
+	return i2c_xfer_async(I2C_PORT_MASTER, addr, regs + reg, 1, buf, 2,
+			      cb, priv);
+}
+#endif
+
 int ina2xx_init(uint8_t idx, uint16_t config, uint16_t calib)
 {
 	int res;
 
 	res = ina2xx_write(idx, INA2XX_REG_CONFIG, config);
+#ifndef CONFIG_INA260
 	/* TODO(crosbug.com/p/29730): assume 1mA/LSB, revisit later */
 	res |= ina2xx_write(idx, INA2XX_REG_CALIB, calib);
+#endif
 
 	return res;
 }
 
+int ina2xx_conv_time_us(enum ina2xx_conv_time t)
+{
+	static const uint16_t us[] = {
+		140, 204, 332, 588, 1100, 2116, 4156, 8244
+	};
+
+	return us[t & INA2XX_CONV_TIME_MASK];
+}
+
+int ina2xx_set_timing(uint8_t idx, enum ina2xx_conv_time bus,
+		      enum ina2xx_conv_time shunt, uint16_t avg)
+{
+	uint16_t cfg = ina2xx_read(idx, INA2XX_REG_CONFIG);
+
+	if (cfg == 0x0bad)
+		return EC_ERROR_UNKNOWN;
+	cfg &= INA2XX_CONFIG_MODE_MASK;
+	return ina2xx_write(idx, INA2XX_REG_CONFIG, cfg |
+			    INA2XX_CONFIG_BUS_CONV_TIME(bus) |
+			    INA2XX_CONFIG_SHUNT_CONV_TIME(shunt) |
+			    (avg & INA2XX_CONFIG_AVG_MASK));
+}
+
+static const struct {
+	uint8_t conv_time;
+	uint8_t avg_log2; /* INA2XX_CONFIG_AVG_x field is not linear */
+	uint16_t avg;
+} presets[INA2XX_PRESET_COUNT] = {
+	[INA2XX_PRESET_FAST] = {INA2XX_CONV_TIME_140, 0, INA2XX_CONFIG_AVG_1},
+	[INA2XX_PRESET_DEFAULT] = {INA2XX_CONV_TIME_1100, 0,
+				   INA2XX_CONFIG_AVG_1},
+	[INA2XX_PRESET_SMOOTH] = {INA2XX_CONV_TIME_1100, 4,
+				  INA2XX_CONFIG_AVG_16},
+	[INA2XX_PRESET_PRECISE] = {INA2XX_CONV_TIME_8244, 6,
+				   INA2XX_CONFIG_AVG_64},
+};
+
+int ina2xx_set_preset(uint8_t idx, enum ina2xx_preset preset)
+{
+	if (preset >= INA2XX_PRESET_COUNT)
+		return EC_ERROR_INVAL;
+	return ina2xx_set_timing(idx, presets[preset].conv_time,
+				 presets[preset].conv_time,
+				 presets[preset].avg);
+}
+
+int ina2xx_preset_period(enum ina2xx_preset preset)
+{
+	if (preset >= INA2XX_PRESET_COUNT)
+		return 0;
+	/* a bus and a shunt conversion per averaged sample */
+	return 2 * ina2xx_conv_time_us(presets[preset].conv_time) <<
+	       presets[preset].avg_log2;
+}
+
 int ina2xx_get_voltage(uint8_t idx)
 {
 	uint16_t bv = ina2xx_read(idx, INA2XX_REG_BUS_VOLT);
@@ -65,8 +137,7 @@ int ina2xx_get_voltage(uint8_t idx)
 int ina2xx_get_current(uint8_t idx)
 {
 	int16_t curr = ina2xx_read(idx, INA2XX_REG_CURRENT);
-	/* Current calibration: LSB = 1mA/bit */
-	return (int)curr;
+	return INA2XX_CURR_MA((int)curr);
 }
 
 int ina2xx_get_power(uint8_t idx)
@@ -79,23 +150,30 @@ int ina2xx_get_power(uint8_t idx)
 static void ina2xx_dump(uint8_t idx)
 {
 	uint16_t cfg = ina2xx_read(idx, INA2XX_REG_CONFIG);
-	int16_t sv = ina2xx_read(idx, INA2XX_REG_SHUNT_VOLT);
 	uint16_t bv = ina2xx_read(idx, INA2XX_REG_BUS_VOLT);
 	uint16_t pow = ina2xx_read(idx, INA2XX_REG_POWER);
 	int16_t curr = ina2xx_read(idx, INA2XX_REG_CURRENT);
-	uint16_t calib = ina2xx_read(idx, INA2XX_REG_CALIB);
 	uint16_t mask = ina2xx_read(idx, INA2XX_REG_MASK);
 	uint16_t alert = ina2xx_read(idx, INA2XX_REG_ALERT);
+#ifndef CONFIG_INA260
+	int16_t sv = ina2xx_read(idx, INA2XX_REG_SHUNT_VOLT);
+	uint16_t calib = ina2xx_read(idx, INA2XX_REG_CALIB);
+#endif
 
 	ccprintf("Configuration: %04x\n", cfg);
+#ifndef CONFIG_INA260
 	ccprintf("Shunt voltage: %04x => %d uV\n", sv,
 						   INA2XX_SHUNT_UV((int)sv));
+#endif
 	ccprintf("Bus voltage  : %04x => %d mV\n", bv,
 						   INA2XX_BUS_MV((int)bv));
 	ccprintf("Power        : %04x => %d mW\n", pow,
 						   INA2XX_POW_MW((int)pow));
-	ccprintf("Current      : %04x => %d mA\n", curr, curr);
+	ccprintf("Current      : %04x => %d mA\n", curr,
+						   INA2XX_CURR_MA((int)curr));
+#ifndef CONFIG_INA260
 	ccprintf("Calibration  : %04x\n", calib);
+#endif
 	ccprintf("Mask/Enable  : %04x\n", mask);
 	ccprintf("Alert limit  : %04x\n", alert);
 }
@@ -126,8 +204,10 @@ static int command_ina(int argc, char **argv)
 
 		if (!strcasecmp(argv[2], "config")) {
 			ina2xx_write(idx, INA2XX_REG_CONFIG, val);
+#ifndef CONFIG_INA260
 		} else if (!strcasecmp(argv[2], "calib")) {
 			ina2xx_write(idx, INA2XX_REG_CALIB, val);
+#endif
 		} else if (!strcasecmp(argv[2], "mask")) {
 			ina2xx_write(idx, INA2XX_REG_MASK, val);
 		} else if (!strcasecmp(argv[2], "alert")) {
@@ -2,18 +2,25 @@
  * Use of this source code is governed by a BSD-style license that can be
  * found in the LICENSE file.
  *
- * TI INA219/231 Current/Power monitor driver.
+ * TI INA219/231/260 Current/Power monitor driver.
  */
 
 #ifndef __CROS_EC_INA2XX_H
 #define __CROS_EC_INA2XX_H
 
 #define INA2XX_REG_CONFIG     0x00
+#ifdef CONFIG_INA260
+/* internal shunt : no shunt voltage nor calibration register */
+#define INA2XX_REG_CURRENT    0x01
+#define INA2XX_REG_BUS_VOLT   0x02
+#define INA2XX_REG_POWER      0x03
+#else
 #define INA2XX_REG_SHUNT_VOLT 0x01
 #define INA2XX_REG_BUS_VOLT   0x02
 #define INA2XX_REG_POWER      0x03
 #define INA2XX_REG_CURRENT    0x04
 #define INA2XX_REG_CALIB      0x05
+#endif
 #define INA2XX_REG_MASK       0x06
 #define INA2XX_REG_ALERT      0x07
 
@@ -47,6 +54,16 @@ enum ina2xx_conv_time {
 #define INA2XX_CONFIG_AVG_256      (5 << 9)
 #define INA2XX_CONFIG_AVG_512      (6 << 9)
 #define INA2XX_CONFIG_AVG_1024     (7 << 9)
+#define INA2XX_CONFIG_AVG_MASK     (7 << 9)
+
+/* Conversion times and averaging, from the fastest to the least noisy */
+enum ina2xx_preset {
+	INA2XX_PRESET_FAST,    /* 140us, no averaging : fast transients */
+	INA2XX_PRESET_DEFAULT, /* 1.1ms, no averaging : power-on default */
+	INA2XX_PRESET_SMOOTH,  /* 1.1ms, 16 averaged */
+	INA2XX_PRESET_PRECISE, /* 8.2ms, 64 averaged : precise average */
+	INA2XX_PRESET_COUNT
+};
 
 #define INA2XX_MASK_EN_LEN         (1 << 0)
 #define INA2XX_MASK_EN_APOL        (1 << 1)
@@ -61,11 +78,12 @@ enum ina2xx_conv_time {
 #define INA2XX_MASK_EN_SOL        (1 << 15)
 
 
-#if defined(CONFIG_INA231) && defined(CONFIG_INA219)
-#error CONFIG_INA231 and CONFIG_INA219 must not be both defined.
+#if defined(CONFIG_INA231) + defined(CONFIG_INA219) + \
+	defined(CONFIG_INA260) > 1
+#error Only one of CONFIG_INA219, CONFIG_INA231 and CONFIG_INA260 may be defined.
 #endif
 
-#ifdef CONFIG_INA231
+#if defined(CONFIG_INA231)
 
 /* Calibration value to get current LSB = 1mA */
 #define INA2XX_CALIB_1MA(rsense_mohm) (5120/(rsense_mohm))
@@ -73,8 +91,25 @@ enum ina2xx_conv_time {
 #define INA2XX_BUS_MV(reg) ((reg) * 125 / 100)
 /* Shunt voltage: uV per LSB */
 #define INA2XX_SHUNT_UV(reg) ((reg) * 25 / 10)
+/* Current: mA per LSB, as calibrated */
+#define INA2XX_CURR_MA(reg) (reg)
 /* Power LSB: mW per current LSB */
 #define INA2XX_POW_MW(reg) ((reg) * 25 * 1/*Current mA/LSB*/)
+/* Current alert limit: shunt voltage, 2.5 uV per LSB */
+#define INA2XX_ALERT_MA(ma, rsense_mohm) ((ma) * (rsense_mohm) * 10 / 25)
+
+#elif defined(CONFIG_INA260)
+
+/* No calibration : the current register has a fixed LSB */
+#define INA2XX_CALIB_1MA(rsense_mohm) 0
+/* Bus voltage: mV per LSB */
+#define INA2XX_BUS_MV(reg) ((reg) * 125 / 100)
+/* Current: 1.25 mA per LSB */
+#define INA2XX_CURR_MA(reg) ((reg) * 125 / 100)
+/* Power: 10 mW per LSB */
+#define INA2XX_POW_MW(reg) ((reg) * 10)
+/* Current alert limit: current register, 1.25 mA per LSB */
+#define INA2XX_ALERT_MA(ma, rsense_mohm) ((ma) * 100 / 125)
 
 #else /* CONFIG_INA219 */
 
@@ -84,8 +119,12 @@ enum ina2xx_conv_time {
 #define INA2XX_BUS_MV(reg) ((reg) / 2)
 /* Shunt voltage: uV per LSB */
 #define INA2XX_SHUNT_UV(reg) ((reg) * 2)
+/* Current: mA per LSB, as calibrated */
+#define INA2XX_CURR_MA(reg) (reg)
 /* Power LSB: mW per current LSB */
 #define INA2XX_POW_MW(reg) ((reg) * 20 * 1/*Current mA/LSB*/)
+/* Current alert limit: shunt voltage, 10 uV per LSB */
+#define INA2XX_ALERT_MA(ma, rsense_mohm) ((ma) * (rsense_mohm) / 10)
 
 #endif
 
@@ -96,9 +135,36 @@ uint16_t ina2xx_read(uint8_t idx, uint8_t reg);
 /* Write INA2XX register. */
 int ina2xx_write(uint8_t idx, uint8_t reg, uint16_t val);
 
+#ifdef CONFIG_I2C_ASYNC
+#include "i2c.h"
+/*
+ * Start reading an INA2XX register into 'buf' (2 bytes, big-endian), 'cb'
+ * is called from the I2C interrupt when done. The caller holds the I2C
+ * master port lock (see i2c_xfer_async()).
+ */
+int ina2xx_read_async(uint8_t idx, uint8_t reg, uint8_t *buf,
+		      i2c_async_cb cb, void *priv);
+#endif
+
 /* Set measurement parameters */
 int ina2xx_init(uint8_t idx, uint16_t config, uint16_t calib);
 
+/* Conversion time in us of INA2XX_CONV_TIME_x */
+int ina2xx_conv_time_us(enum ina2xx_conv_time t);
+
+/*
+ * Set the bus and shunt conversion times (INA2XX_CONV_TIME_x) and the
+ * averaging (INA2XX_CONFIG_AVG_x), keeping the operating mode.
+ */
+int ina2xx_set_timing(uint8_t idx, enum ina2xx_conv_time bus,
+		      enum ina2xx_conv_time shunt, uint16_t avg);
+
+/* Apply the timing of 'preset' to the INA */
+int ina2xx_set_preset(uint8_t idx, enum ina2xx_preset preset);
+
+/* Time in us between 2 fresh readings with 'preset' */
+int ina2xx_preset_period(enum ina2xx_preset preset);
+
 /* Return bus voltage in milliVolts */
 int ina2xx_get_voltage(uint8_t idx);
 
@@ -199,26 +199,34 @@ int tcpci_tcpm_get_vbus_level(int port)
 
 int tcpci_tcpm_get_message(int port, uint32_t *payload, int *head)
 {
-	int rv, cnt, reg = TCPC_REG_RX_DATA;
+	uint8_t reg = TCPC_REG_RX_BYTE_CNT;
+	uint8_t buf[4];
+	uint8_t pad;
+	int rv, cnt;
 
-	rv = tcpc_read(port, TCPC_REG_RX_BYTE_CNT, &cnt);
+	/*
+	 * One read from RX_BYTE_CNT : the byte count, frame type and header
+	 * first, then as many data bytes as the count says (at least one,
+	 * ignored, so that the transfer ends with a read).
+	 */
+	tcpc_lock(port, 1);
+	rv = tcpc_xfer(port, &reg, 1, buf, sizeof(buf), I2C_XFER_START);
+	if (rv == EC_SUCCESS) {
+		/* RX_BYTE_CNT includes 3 bytes for frame type and header */
+		cnt = MIN(buf[0] - 3, 4 * 7);
+		if (cnt > 0)
+			rv = tcpc_xfer(port, NULL, 0, (uint8_t *)payload, cnt,
+				       I2C_XFER_STOP);
+		else
+			rv = tcpc_xfer(port, NULL, 0, &pad, 1, I2C_XFER_STOP);
+	}
+	tcpc_lock(port, 0);
 
-	/* RX_BYTE_CNT includes 3 bytes for frame type and header */
-	if (rv != EC_SUCCESS || cnt < 3) {
+	if (rv != EC_SUCCESS || buf[0] < 3) {
 		rv = EC_ERROR_UNKNOWN;
 		goto clear;
 	}
-
-	rv = tcpc_read16(port, TCPC_REG_RX_HDR, (int *)head);
-
-	cnt = cnt - 3;
-	if (rv == EC_SUCCESS && cnt > 0) {
-		tcpc_lock(port, 1);
-		rv = tcpc_xfer(port,
-			       (uint8_t *)&reg, 1, (uint8_t *)payload,
-			       cnt, I2C_XFER_SINGLE);
-		tcpc_lock(port, 0);
-	}
+	*head = buf[2] | (buf[3] << 8);
 
 clear:
 	/* Read complete, clear RX status alert bit */
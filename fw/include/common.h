@@ -85,6 +85,17 @@
 #define __bss_slow __attribute__((section(".bss.slow")))
 #endif
 
+/*
+ * Run the function from RAM : it is copied there at startup with the data.
+ * For the hot paths of the boards with CONFIG_RAM_CODE, when the flash wait
+ * states cost more than the RAM taken by the code.
+ */
+#if defined(CONFIG_RAM_CODE) && !defined(HOST_TOOLS_BUILD)
+#define __ram_code __attribute__((section(".iram.text"), noinline))
+#else
+#define __ram_code
+#endif
+
 /* There isn't really a better place for this */
 #define C_TO_K(temp_c) ((temp_c) + 273)
 #define K_TO_C(temp_c) ((temp_c) - 273)
@@ -118,6 +118,16 @@
 /* Include the ADC analog watchdog feature in the ADC code */
 #define CONFIG_ADC_WATCHDOG
 
+/*
+ * The ADC watchdog interrupt is shared with the comparator one and served by
+ * its handler calling adc_watchdog_interrupt() (STM32F0 with
+ * CONFIG_USB_PD_RX_COMP_IRQ).
+ */
+#undef CONFIG_ADC_WATCHDOG_COMP_IRQ
+
+/* Continuous DMA capture of ADC inputs, adc_capture_start() (STM32F0 only) */
+#undef CONFIG_ADC_CAPTURE
+
 /*
  * Chip-dependent ADC configuration - select one.
  * SINGLE - Sample all inputs once when requested.
@@ -686,6 +696,7 @@
 #undef  CONFIG_CMD_I2CWEDGE
 #undef  CONFIG_CMD_I2C_PROTECT
 #define CONFIG_CMD_I2C_SCAN
+#undef  CONFIG_CMD_I2C_SPEED
 #undef  CONFIG_CMD_I2C_STRESS_TEST
 #undef  CONFIG_CMD_I2C_STRESS_TEST_ACCEL
 #undef  CONFIG_CMD_I2C_STRESS_TEST_ALS
@@ -724,6 +735,7 @@
 #undef  CONFIG_CMD_SPI_FLASH
 #undef  CONFIG_CMD_SPI_NOR
 #undef  CONFIG_CMD_SPI_XFER
+#undef  CONFIG_CMD_STACKINFO
 #undef  CONFIG_CMD_STACKOVERFLOW
 #define CONFIG_CMD_SYSINFO
 #define CONFIG_CMD_SYSJUMP
@@ -734,6 +746,7 @@
 #define CONFIG_CMD_TYPEC
 #undef  CONFIG_CMD_USART_INFO
 #define CONFIG_CMD_USBMUX
+#undef  CONFIG_CMD_USB_MEMCPY
 #undef  CONFIG_CMD_USB_PD_PE
 #define CONFIG_CMD_WAITMS
 
@@ -937,6 +950,12 @@
 /* Compile extra debugging and tests for the DMA module */
 #undef CONFIG_DMA_HELP
 
+/*
+ * The board sets the priority level of each DMA channel
+ * (dma_channel_priority[]) instead of the highest one for all of them.
+ */
+#undef CONFIG_DMA_CHANNEL_PRIORITY
+
 /* Support EC to Internal bus bridge. */
 #undef CONFIG_EC2I
 
@@ -1469,6 +1488,12 @@
 /* EC uses an I2C slave interface */
 #undef CONFIG_I2C_SLAVE
 
+/*
+ * Interrupt-driven i2c_xfer_async() transfers on the master port
+ * (STM32F0 only).
+ */
+#undef CONFIG_I2C_ASYNC
+
 /* Defines I2C operation retry count when slave nack'd(EC_ERROR_BUSY) */
 #define CONFIG_I2C_NACK_RETRY_COUNT 0
 /*
@@ -1504,11 +1529,13 @@
 /* Current/Power monitor */
 
 /*
- * Compile driver for INA219 or INA231. These two flags may not be both
- * defined.
+ * Compile driver for INA219, INA231 or INA260. Only one of these flags may
+ * be defined. The INA260 has an internal shunt and reads the current with a
+ * fixed LSB, without calibration.
  */
 #undef CONFIG_INA219
 #undef CONFIG_INA231
+#undef CONFIG_INA260
 
 /*****************************************************************************/
 /* Inductive charging */
@@ -1707,6 +1734,13 @@
 #undef CONFIG_LOW_POWER_IDLE
 #undef CONFIG_LOW_POWER_USE_LFIOSC
 
+/*
+ * Count the time the idle task spends waiting for an interrupt, read with
+ * idle_time_get(). The interrupts wait until the count is updated, a few
+ * cycles after the wake-up.
+ */
+#undef CONFIG_IDLE_TIME
+
 /*
  * Enable deep sleep during S0 (ignores SLEEP_MASK_AP_RUN).
  */
@@ -1745,6 +1779,12 @@
 /* Microchip EC SRAM size */
 #undef CONFIG_MEC_SRAM_SIZE
 
+/*
+ * Fixed-size block pools (include/mempool.h) : O(1) allocation and free,
+ * usable from interrupt context.
+ */
+#undef CONFIG_MEMPOOL
+
 /*
  * Define Megachips DisplayPort to HDMI protocol converter/level shifter serial
  * interface.
@@ -1884,6 +1924,18 @@
 /* Size of RAM available on the chip, in bytes */
 #undef CONFIG_RAM_SIZE
 
+/*
+ * Print the RAM usage of each image when it is linked : the RAM taken by the
+ * data, bss and stacks, and what is left for the shared memory buffer.
+ */
+#undef CONFIG_RAM_REPORT
+
+/*
+ * Run the functions marked __ram_code from RAM, without the flash wait
+ * states. They take RAM out of the shared memory buffer.
+ */
+#undef CONFIG_RAM_CODE
+
 /* Enable rbox peripheral */
 #undef CONFIG_RBOX
 
@@ -1948,6 +2000,12 @@
 #undef CONFIG_RW_SIG_ADDR
 #undef CONFIG_RW_SIG_SIZE
 
+/*
+ * Minimum size in bytes of the shared memory buffer, which takes all the RAM
+ * left after the data, bss and stacks : the link fails if less remains.
+ */
+#undef CONFIG_SHAREDMEM_MINIMUM_SIZE
+
 /****************************************************************************/
 /* Shared objects library. */
 
@@ -2163,6 +2221,30 @@
  */
 #define CONFIG_TASK_PROFILING
 
+/*
+ * Profile in core clock cycles from the SysTick counter rather than in
+ * microseconds, and also record the total and longest service time of each
+ * IRQ and the number of times each task got the CPU (Cortex-M0 only).
+ */
+#undef CONFIG_TASK_PROFILING_CYCLES
+
+/*
+ * Firmware event tracepoints (see tracepoint.h) : TRACEPOINT() records an
+ * event into a RAM ring of CONFIG_TRACEPOINT_RECS records (a power of two,
+ * 64 by default), and compiles to nothing without this option.
+ */
+#undef CONFIG_TRACEPOINTS
+#undef CONFIG_TRACEPOINT_RECS
+
+/*
+ * Tokenized logging (see token_log.h) : TOKEN_LOG() keeps its format string
+ * out of the image, in the .tokens section of the ELF file, and writes its
+ * offset there and the raw arguments into a RAM ring of
+ * CONFIG_TOKEN_LOG_WORDS words (a power of two, 64 by default), decoded by the host.
+ */
+#undef CONFIG_TOKEN_LOG
+#undef CONFIG_TOKEN_LOG_WORDS
+
 /*****************************************************************************/
 /* Temperature sensor config */
 
@@ -2392,9 +2474,27 @@
 /* The size in bytes of the FIFO used for PD events logging */
 #undef CONFIG_USB_PD_LOG_SIZE
 
+/* Record the PD state machine transitions in the PD event log */
+#undef CONFIG_USB_PD_LOG_STATES
+
+/*
+ * Decode the received 4b5b symbols two at a time with a 1024-entry table
+ * (2kB) which also rejects K-codes inside the message data.
+ */
+#undef CONFIG_USB_PD_4B5B_TABLE
+
+/* Place that table in SRAM rather than flash */
+#undef CONFIG_USB_PD_4B5B_TABLE_RAM
+
 /* Save power by waking up on VBUS rather than polling CC */
 #define CONFIG_USB_PD_LOW_POWER
 
+/*
+ * Disconnected sink not toggling : sleep until board_cc_watch() wakes up the
+ * task on a CC pull-up rather than polling the CC lines.
+ */
+#undef CONFIG_USB_PD_CC_WATCHDOG
+
 /* Allow chip to go into low power idle even when a PD device is attached */
 #undef CONFIG_USB_PD_LOW_POWER_IDLE_WHEN_CONNECTED
 
@@ -2407,6 +2507,34 @@
 /* Simple DFP, such as power adapter, will not send discovery VDM on connect */
 #undef CONFIG_USB_PD_SIMPLE_DFP
 
+/*
+ * Measure the bit error rate of the BIST Carrier Mode 2 frames received by
+ * the TCPC ('tcpc <port> ber' console command).
+ */
+#undef CONFIG_USB_PD_RX_BER
+
+/*
+ * On a CRC mismatch, decode the retained samples again with shifted bit
+ * periods before reporting the packet as corrupted.
+ */
+#undef CONFIG_USB_PD_RX_RETRY
+
+/*
+ * Sink fast path : the TCPC sends the Request right after the GoodCRC of the
+ * Source_Capabilities, from the RX completion, rather than waiting for the
+ * protocol layer. The response latency is reported by 'tcpc <port> resp'.
+ * Requires a dual-role port with the TCPC on the same CPU
+ * (CONFIG_USB_PD_TCPC).
+ */
+#undef CONFIG_USB_PD_FAST_RESPONSE
+
+/*
+ * Let the RX decoder run on an encoded TX packet image or on uploaded
+ * samples rather than on the DMA samples, see pd_rx_load_image() and
+ * pd_rx_load_samples(). Used by the decoder benchmark and replay.
+ */
+#undef CONFIG_USB_PD_RX_REPLAY
+
 /* Use comparator module for PD RX interrupt */
 #define CONFIG_USB_PD_RX_COMP_IRQ
 
@@ -2416,6 +2544,13 @@
 /* Enable TCPC to enter low power mode */
 #undef CONFIG_USB_PD_TCPC_LOW_POWER
 
+/*
+ * Messages the internal TCPC holds until the TCPM reads them, a message
+ * arriving when they are all taken is not acknowledged. Defaults to 1 with
+ * the TCPM in the same image (CONFIG_USB_POWER_DELIVERY), 2 otherwise.
+ */
+#undef CONFIG_USB_PD_TCPC_RX_DEPTH
+
 /*
  * Track VBUS level in TCPC module. This will only be needed if we're acting
  * as an external TCPC.
@@ -2604,6 +2739,12 @@
  */
 #undef CONFIG_USB_REMOTE_WAKEUP
 
+/*
+ * Support latching the system clock on a USB start of frame, to correlate
+ * the device timestamps with the host frame counter (usb_sof_arm()).
+ */
+#undef CONFIG_USB_SOF_LATCH
+
 /* Support programmable USB device iSerial field. */
 #undef CONFIG_USB_SERIALNO
 
@@ -2666,6 +2807,9 @@
 /* Allowed write count for USB over I2C */
 #define CONFIG_USB_I2C_MAX_WRITE_COUNT 60
 
+/* Accept batches of I2C transactions in one USB packet (USB_I2C_BATCH) */
+#undef CONFIG_USB_I2C_BATCH
+
 /*****************************************************************************/
 /* USB Power monitoring interface config */
 #undef CONFIG_USB_POWER
@@ -2720,6 +2864,14 @@
  */
 #undef CONFIG_WEBUSB_URL
 
+/*
+ * Bind all the interfaces to the Windows WinUSB driver through Microsoft OS
+ * 2.0 descriptors, so WebUSB clients work on Windows without installing a
+ * driver. Define it as the "{...}" DeviceInterfaceGUID string of the device.
+ * This requires CONFIG_WEBUSB_URL.
+ */
+#undef CONFIG_WEBUSB_WINUSB_GUID
+
 /*****************************************************************************/
 
 /*
@@ -116,6 +116,15 @@ void cflush(void);
  */
 void console_has_input(void);
 
+/**
+ * Find a console command by name, as the console input does.
+ *
+ * @param name		Command name, or a unique prefix of it.
+ *
+ * @return A pointer to the command structure, or NULL if no match found.
+ */
+const struct console_command *console_find_command(char *name);
+
 /**
  * Register a console command handler.
  *
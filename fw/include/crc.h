@@ -22,6 +22,16 @@ void crc32_hash16(uint16_t val);
 
 uint32_t crc32_result(void);
 
+/* Reentrant interface : the CRC state is kept in the caller context 'ctx' */
+
+void crc32_ctx_init(uint32_t *ctx);
+
+void crc32_ctx_hash32(uint32_t *ctx, uint32_t val);
+
+void crc32_ctx_hash16(uint32_t *ctx, uint16_t val);
+
+uint32_t crc32_ctx_result(uint32_t *ctx);
+
 #endif /* CONFIG_HW_CRC */
 
 #endif /* __CROS_EC_CRC_H */
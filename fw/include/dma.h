@@ -21,6 +21,14 @@ struct dma_option {
 				   used to select memory size. */
 };
 
+#ifdef CONFIG_DMA_CHANNEL_PRIORITY
+/*
+ * Priority level (STM32_DMA_CCR_PL_x) of each channel, defined by the board.
+ * dma_prepare_tx() and dma_start_rx() program it.
+ */
+extern const uint32_t dma_channel_priority[];
+#endif
+
 #define DMA_POLLING_INTERVAL_US	100	/* us */
 #define DMA_TRANSFER_TIMEOUT_US	(100 * MSEC) /* us */
 
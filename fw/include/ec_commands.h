@@ -4011,6 +4011,8 @@ struct __ec_align4 ec_response_pd_log {
 #define PD_EVENT_MCU_CONNECT            (PD_EVENT_MCU_BASE+1)
 /* Reserved for custom board event */
 #define PD_EVENT_MCU_BOARD_CUSTOM       (PD_EVENT_MCU_BASE+2)
+/* Policy engine state change : data is [15:8] previous [7:0] new state */
+#define PD_EVENT_MCU_STATE              (PD_EVENT_MCU_BASE+3)
 /* PD generic accessory events */
 #define PD_EVENT_ACC_BASE       0x20
 #define PD_EVENT_ACC_RW_FAIL   (PD_EVENT_ACC_BASE+0)
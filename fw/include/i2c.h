@@ -129,6 +129,36 @@ int i2c_xfer(int port, int slave_addr, const uint8_t *out, int out_size,
 int chip_i2c_xfer(int port, int slave_addr, const uint8_t *out, int out_size,
 		  uint8_t *in, int in_size, int flags);
 
+/**
+ * Completion of an asynchronous transfer, called from the I2C interrupt.
+ *
+ * @param priv		Argument given to i2c_xfer_async()
+ * @param rv		EC_SUCCESS, or non-zero if error
+ */
+typedef void (*i2c_async_cb)(void *priv, int rv);
+
+/**
+ * Send one block of raw data then receive one block of raw data as a single
+ * transaction, without blocking : the transfer is driven by the I2C
+ * interrupt which calls 'cb' once done. A new transfer may be started from
+ * the callback.
+ *
+ * The caller holds the port lock (i2c_lock()) from the start of the transfer
+ * to its completion and takes care of the timeout (i2c_xfer_async_cancel()).
+ * The buffers must stay valid until the completion.
+ *
+ * @return EC_SUCCESS, EC_ERROR_BUSY if a transfer is pending on the port,
+ * EC_ERROR_INVAL if the port has no asynchronous support.
+ */
+int i2c_xfer_async(int port, int slave_addr, const uint8_t *out, int out_size,
+		   uint8_t *in, int in_size, i2c_async_cb cb, void *priv);
+
+/**
+ * Abort the pending asynchronous transfer of 'port' (if any) and recover the
+ * bus, its callback is called with EC_ERROR_TIMEOUT.
+ */
+void i2c_xfer_async_cancel(int port);
+
 /**
  * Return raw I/O line levels (I2C_LINE_*) for a port when port is in alternate
  * function mode.
@@ -219,6 +249,27 @@ void i2c_prepare_sysjump(void);
  */
 void i2c_set_timeout(int port, uint32_t timeout);
 
+/**
+ * Change the clock speed of an I2C port at runtime.
+ *
+ * Waits for the ongoing transaction on the port to complete.
+ *
+ * @param port		Port to reconfigure
+ * @param freq		New bus speed
+ * @return EC_SUCCESS, or EC_ERROR_INVAL if the port cannot be reconfigured.
+ */
+int i2c_set_freq(int port, enum i2c_freq freq);
+
+/**
+ * Return the current clock speed of an I2C port.
+ */
+enum i2c_freq i2c_get_freq(int port);
+
+/**
+ * Return the bus speed in kHz matching enum i2c_freq 'freq'.
+ */
+int i2c_freq_to_khz(enum i2c_freq freq);
+
 /**
  * Read a 32-bit register from the slave at 8-bit slave address <slaveaddr>, at
  * the specified 8-bit <offset> in the slave's address space.
@@ -64,6 +64,8 @@ extern const struct deferred_data __deferred_funcs[];
 extern const struct deferred_data __deferred_funcs_end[];
 extern uint64_t __deferred_until[];
 extern uint64_t __deferred_until_end[];
+extern uint8_t __deferred_heap[];
+extern uint8_t __deferred_heap_end[];
 
 /* I2C fake devices for unit testing */
 extern const struct test_i2c_xfer __test_i2c_xfer[];
@@ -93,8 +95,14 @@ extern uint8_t *__data_libtpm2_end;
 
 /* Image sections. */
 extern const void *__ro_end;
+/* Code in flash */
+extern const void *__text_start;
+extern const void *__text_end;
 extern const void *__data_start;
 extern const void *__data_end;
+/* Functions copied to RAM with the data (__ram_code) */
+extern const void *__iram_text_start;
+extern const void *__iram_text_end;
 
 /* Helper for special chip-specific memory sections */
 #ifdef CONFIG_CHIP_MEMORY_REGIONS
@@ -0,0 +1,72 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Fixed-size block pool.
+ */
+#ifndef __CROS_EC_MEMPOOL_H
+#define __CROS_EC_MEMPOOL_H
+
+#include "common.h"
+
+#include <stddef.h>
+
+/*
+ * Pool of fixed-size blocks carved from a buffer : a static array (MEMPOOL)
+ * or memory taken with shared_mem_acquire() (mempool_init).
+ *
+ * The freed blocks are chained through their first word and the blocks never
+ * allocated yet are taken in order, so allocating and freeing are O(1) and
+ * need no initialization pass. Both can be called from interrupt context.
+ */
+struct mempool {
+	void *free_list;     /* last freed block, NULL if none */
+	uint8_t *start;      /* first block */
+	uint16_t block_size; /* bytes per block, multiple of 4 */
+	uint16_t count;      /* number of blocks */
+	uint16_t fresh;      /* blocks taken from the buffer so far */
+	uint16_t used;       /* blocks currently allocated */
+	uint16_t max_used;   /* highest number of blocks allocated */
+	uint32_t failures;   /* allocations refused because the pool was empty */
+};
+
+/*
+ * Pool 'name' of 'n' blocks of 'type' in a static array, ready to use.
+ */
+#define MEMPOOL(name, type, n) \
+	static uint32_t name##_blocks[(n) * ((sizeof(type) + 3) / 4)]; \
+	static struct mempool name = { \
+		.start = (uint8_t *)name##_blocks, \
+		.block_size = (sizeof(type) + 3) & ~3, \
+		.count = (n), \
+	}
+
+/**
+ * Carve a pool out of a buffer.
+ *
+ * @param pool		Pool to initialize
+ * @param buf		Buffer, 32-bit aligned
+ * @param size		Size of the buffer in bytes
+ * @param block_size	Size of the blocks in bytes, rounded up to 4
+ * @return the number of blocks, 0 if the buffer cannot hold one.
+ */
+int mempool_init(struct mempool *pool, void *buf, size_t size,
+		 size_t block_size);
+
+/**
+ * Allocate a block.
+ *
+ * @param pool		Pool to allocate from
+ * @return the block, or NULL if the pool is empty.
+ */
+void *mempool_alloc(struct mempool *pool);
+
+/**
+ * Give a block back to its pool.
+ *
+ * @param pool		Pool the block was allocated from
+ * @param block		Block to free, NULL is ignored
+ */
+void mempool_free(struct mempool *pool, void *block);
+
+#endif  /* __CROS_EC_MEMPOOL_H */
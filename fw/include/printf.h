@@ -70,6 +70,25 @@
 int vfnprintf(int (*addchar)(void *context, int c), void *context,
 	      const char *format, va_list args);
 
+/**
+ * Print formatted output to a function, a span of characters at a time
+ *
+ * Same as vfnprintf(), but the literal text and each formatted field are
+ * passed as a whole, so the output to a buffer costs one call per span.
+ *
+ * @param addstr	Function to be called for each span of characters.
+ *			Will be passed the context, the characters and their
+ *			count (not null-terminated).  Should return 0 if all
+ *			the characters were accepted or non-zero if some were
+ *			dropped due to overflow.
+ * @param context	Context pointer to pass to addstr()
+ * @param format	Format string (see above for acceptable formats)
+ * @param args		Parameters
+ * @return EC_SUCCESS, or non-zero if output was truncated.
+ */
+int vfnprintf_span(int (*addstr)(void *context, const char *str, int len),
+		   void *context, const char *format, va_list args);
+
 /**
  * Print formatted outut to a string.
  *
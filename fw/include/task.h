@@ -112,6 +112,14 @@ static inline void task_wake(task_id_t tskid)
  */
 task_id_t task_get_current(void);
 
+#ifdef CONFIG_IDLE_TIME
+/**
+ * Return the time spent by the idle task waiting for interrupts, in us
+ * (wrapping).
+ */
+uint32_t idle_time_get(void);
+#endif
+
 /**
  * Return a pointer to the bitmap of events of the task.
  */
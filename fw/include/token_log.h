@@ -0,0 +1,55 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Tokenized logging */
+
+#ifndef __CROS_EC_TOKEN_LOG_H
+#define __CROS_EC_TOKEN_LOG_H
+
+#include "common.h"
+
+/*
+ * Record in the ring : a header word, the timestamp, then the arguments.
+ * The token is the offset of the format string in the .tokens section of
+ * the ELF file, which is not loaded in the flash.
+ */
+#define TOKEN_LOG_HDR(token, nargs) (((token) & 0xffffff) | ((nargs) << 24))
+#define TOKEN_LOG_TOKEN(hdr) ((hdr) & 0xffffff)
+#define TOKEN_LOG_NARGS(hdr) ((hdr) >> 24)
+#define TOKEN_LOG_MAX_ARGS 6
+
+#ifdef CONFIG_TOKEN_LOG
+
+#ifndef CONFIG_TOKEN_LOG_WORDS
+#define CONFIG_TOKEN_LOG_WORDS 64
+#endif
+
+/**
+ * Log the format string 'fmt' with up to TOKEN_LOG_MAX_ARGS integer
+ * arguments (no %s), written raw : no formatting on the device.
+ */
+#define TOKEN_LOG(fmt, args...) do {					\
+		static const char __tok_fmt[]				\
+		__attribute__((section(".tokens"), used)) = fmt;	\
+		const uint32_t __tok_args[] = { 0, ## args };		\
+		BUILD_ASSERT(ARRAY_SIZE(__tok_args) <=			\
+			     TOKEN_LOG_MAX_ARGS + 1);			\
+		token_log((uint32_t)__tok_fmt, __tok_args + 1,		\
+			  ARRAY_SIZE(__tok_args) - 1);			\
+	} while (0)
+
+void token_log(uint32_t token, const uint32_t *args, int nargs);
+
+/**
+ * Move up to 'max' words of whole records from the ring to 'out', oldest
+ * first.
+ *
+ * @return the number of words moved
+ */
+int token_log_read(uint32_t *out, int max);
+
+#endif  /* CONFIG_TOKEN_LOG */
+
+#endif  /* __CROS_EC_TOKEN_LOG_H */
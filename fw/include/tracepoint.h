@@ -0,0 +1,82 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Firmware event tracepoints */
+
+#ifndef __CROS_EC_TRACEPOINT_H
+#define __CROS_EC_TRACEPOINT_H
+
+#include "common.h"
+
+/* Events, the argument of each one follows its name */
+enum tracepoint_id {
+	TP_RX_HALF = 1,     /* RX DMA half-buffer done : line << 16 | half */
+	TP_EP_TX,           /* sniffer endpoint transfer done : buffers armed */
+	TP_SNIFFER_DEQUEUE, /* sniffer task takes a half-buffer : line << 16 |
+			     * its generation */
+	TP_PD_RX_START,     /* RX edge capture started : port */
+	TP_PD_RX_DONE,      /* pd_analyze_rx() returns : type << 16 | header */
+	TP_PD_TX_START,     /* TX DMA started : bits */
+	TP_PD_TX_DONE,      /* TX DMA done : port */
+	TP_COUNT
+};
+
+/* Ring record, all fields little-endian */
+struct tracepoint_rec {
+	uint32_t ts;  /* __hw_clock_source_read(), in us */
+	uint32_t id;  /* TP_x */
+	uint32_t arg;
+};
+
+#ifdef CONFIG_TRACEPOINTS
+
+#ifndef CONFIG_TRACEPOINT_RECS
+#define CONFIG_TRACEPOINT_RECS 64
+#endif
+
+extern struct tracepoint_rec tracepoint_ring[CONFIG_TRACEPOINT_RECS];
+extern uint32_t tracepoint_next;
+extern uint8_t tracepoint_on;
+
+uint32_t __hw_clock_source_read(void);
+
+/*
+ * Record the event 'id' with 'arg' : a slot taken with the interrupts masked
+ * (any interrupt handler may record too), no formatting.
+ */
+static inline void tracepoint(uint32_t id, uint32_t arg)
+{
+	struct tracepoint_rec *rec;
+	uint32_t primask;
+
+	if (!tracepoint_on)
+		return;
+	asm volatile("mrs %0, primask\n"
+		     "cpsid i" : "=r"(primask) : : "memory");
+	rec = tracepoint_ring + (tracepoint_next++ &
+				 (CONFIG_TRACEPOINT_RECS - 1));
+	rec->ts = __hw_clock_source_read();
+	rec->id = id;
+	rec->arg = arg;
+	asm volatile("msr primask, %0" : : "r"(primask) : "memory");
+}
+#define TRACEPOINT(id, arg) tracepoint(id, arg)
+
+/**
+ * Copy up to 'max' records of the ring from the record 'first', oldest
+ * first.
+ *
+ * @param held  set to the number of records held
+ * @return the number of records copied
+ */
+int tracepoint_read(int first, int max, struct tracepoint_rec *out,
+		    int *held);
+
+#else
+/* Nothing is compiled, the arguments are not evaluated */
+#define TRACEPOINT(id, arg) do {} while (0)
+#endif
+
+#endif  /* __CROS_EC_TRACEPOINT_H */
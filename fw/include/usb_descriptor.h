@@ -104,6 +104,72 @@ struct usb_platform_descriptor {
 	{0x38, 0xB6, 0x08, 0x34, 0xA9, 0x09, 0xA0, 0x47,               \
 	 0x8B, 0xFD, 0xA0, 0x76, 0x88, 0x15, 0xB6, 0x65}
 
+#define USB_PLAT_CAP_MS_OS_20 /*{d8dd60df-4589-4cc7-9cd2-659d9e648a9f}*/ \
+	{0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C,               \
+	 0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F}
+
+/* Microsoft OS 2.0 Platform Descriptor (for Windows 8.1 and later) */
+struct usb_ms_os_20_platform_descriptor {
+	uint8_t  bLength;
+	uint8_t  bDescriptorType;     /* USB_DT_DEVICE_CAPABILITY */
+	uint8_t  bDevCapabilityType;  /* USB_DC_DTYPE_PLATFORM */
+	uint8_t  bReserved;           /* SBZ */
+	uint8_t  PlatformCapUUID[16]; /* USB_PLAT_CAP_MS_OS_20 */
+	uint32_t dwWindowsVersion;
+	uint16_t wMSOSDescriptorSetTotalLength;
+	uint8_t  bMS_VendorCode;
+	uint8_t  bAltEnumCode;
+} __packed;
+#define USB_DT_MS_OS_20_PLATFORM_SIZE 28
+
+/* Microsoft OS 2.0 descriptor set, returned by a vendor request */
+#define MS_OS_20_WINDOWS_8_1             0x06030000
+#define MS_OS_20_REQ_GET_DESCRIPTOR      0x07
+#define MS_OS_20_SET_HEADER_DESCRIPTOR   0x00
+#define MS_OS_20_SUBSET_HEADER_CONFIG    0x01
+#define MS_OS_20_SUBSET_HEADER_FUNCTION  0x02
+#define MS_OS_20_FEATURE_COMPATIBLE_ID   0x03
+#define MS_OS_20_FEATURE_REG_PROPERTY    0x04
+#define MS_OS_20_REG_MULTI_SZ            7
+
+struct ms_os_20_set_header {
+	uint16_t wLength;
+	uint16_t wDescriptorType;     /* MS_OS_20_SET_HEADER_DESCRIPTOR */
+	uint32_t dwWindowsVersion;
+	uint16_t wTotalLength;
+} __packed;
+
+struct ms_os_20_config_subset {
+	uint16_t wLength;
+	uint16_t wDescriptorType;     /* MS_OS_20_SUBSET_HEADER_CONFIG */
+	uint8_t  bConfigurationValue;
+	uint8_t  bReserved;
+	uint16_t wTotalLength;
+} __packed;
+
+/* Function subset binding one interface to the WinUSB driver */
+struct ms_os_20_winusb_function {
+	/* function subset header */
+	uint16_t wLength;
+	uint16_t wDescriptorType;     /* MS_OS_20_SUBSET_HEADER_FUNCTION */
+	uint8_t  bFirstInterface;
+	uint8_t  bReserved;
+	uint16_t wSubsetLength;
+	/* compatible ID descriptor */
+	uint16_t wCompatLength;
+	uint16_t wCompatType;         /* MS_OS_20_FEATURE_COMPATIBLE_ID */
+	uint8_t  CompatibleID[8];
+	uint8_t  SubCompatibleID[8];
+	/* registry property descriptor : DeviceInterfaceGUIDs */
+	uint16_t wPropLength;
+	uint16_t wPropType;           /* MS_OS_20_FEATURE_REG_PROPERTY */
+	uint16_t wPropertyDataType;   /* MS_OS_20_REG_MULTI_SZ */
+	uint16_t wPropertyNameLength;
+	wchar_t  PropertyName[21];
+	uint16_t wPropertyDataLength;
+	wchar_t  PropertyData[40];
+} __packed;
+
 /* Qualifier Descriptor */
 struct usb_qualifier_descriptor {
 	uint8_t  bLength;
@@ -343,5 +409,7 @@ extern const uint8_t usb_string_desc[];
 extern const void * const usb_fw_version;
 extern const struct bos_context bos_ctx;
 extern const void *webusb_url;
+/* Microsoft OS 2.0 descriptor set */
+extern const struct bos_context ms_os_20_ctx;
 
 #endif /* __CROS_EC_USB_DESCRIPTOR_H */
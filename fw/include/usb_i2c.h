@@ -51,6 +51,30 @@
  *
  *     read payload: up to 60 bytes of data read from I2C, length will match
  *                   requested read count
+ *
+ * Batch command (CONFIG_USB_I2C_BATCH):
+ *     +-----------+-----------+---+---+------------------------------------+
+ *     | 0xff : 1B | count: 1B | 0 | 0 | transactions : <= 60B              |
+ *     +-----------+-----------+---+---+------------------------------------+
+ *
+ *     count:         1 byte, number of transactions in the packet
+ *
+ *     transactions:  'count' times port, slave address, write count and
+ *                    read count (1 byte each) followed by the data to
+ *                    write, all in a single packet. They are run in order,
+ *                    the first error stops the batch.
+ *
+ * Batch response:
+ *     +-------------+----------+---+-----------------------+
+ *     | status : 2B | done: 1B | 0 | read payload : <= 60B |
+ *     +-------------+----------+---+-----------------------+
+ *
+ *     status:        status of the first failed transaction, or success
+ *
+ *     done:          1 byte, number of transactions completed
+ *
+ *     read payload:  data read by the completed transactions, one after
+ *                    the other. The total read count is at most 60 bytes.
  */
 
 enum usb_i2c_error {
@@ -65,6 +89,8 @@ enum usb_i2c_error {
 
 
 #define USB_I2C_MAX_READ_COUNT  60
+/* Port index of a batch command */
+#define USB_I2C_BATCH 0xff
 #define USB_I2C_CONFIG_BUFFER_SIZE \
 	((CONFIG_USB_I2C_MAX_WRITE_COUNT+4) > USB_MAX_PACKET_SIZE ?	\
 		(CONFIG_USB_I2C_MAX_WRITE_COUNT+4) : USB_MAX_PACKET_SIZE)
@@ -98,6 +98,16 @@ enum pd_rx_errors {
 				 PDO_BATT_OP_POWER(op_mw) | \
 				 PDO_TYPE_BATTERY)
 
+/* Augmented PDO (PD 3.0) : Programmable Power Supply */
+#define PDO_AUG_TYPE_MASK   (3 << 28)
+#define PDO_AUG_TYPE_PPS    (0 << 28)
+#define PDO_AUG_MAX_MV(pdo) ((((pdo) >> 17) & 0xFF) * 100)
+#define PDO_AUG_MIN_MV(pdo) ((((pdo) >> 8) & 0xFF) * 100)
+#define PDO_AUG_MAX_MA(pdo) (((pdo) & 0x7F) * 50)
+#define PDO_IS_PPS(pdo) \
+	(((pdo) & (PDO_TYPE_MASK | PDO_AUG_TYPE_MASK)) == \
+	 (PDO_TYPE_AUGMENTED | PDO_AUG_TYPE_PPS))
+
 /* RDO : Request Data Object */
 #define RDO_OBJ_POS(n)             (((n) & 0x7) << 28)
 #define RDO_POS(rdo)               (((rdo) >> 28) & 0x7)
@@ -111,6 +121,10 @@ enum pd_rx_errors {
 #define RDO_BATT_OP_POWER(mw)      ((((mw) / 250) & 0x3FF) << 10)
 #define RDO_BATT_MAX_POWER(mw)     ((((mw) / 250) & 0x3FF) << 10)
 
+/* Programmable RDO : output voltage in 20 mV, operating current in 50 mA */
+#define RDO_PPS_MV(rdo)            ((((rdo) >> 9) & 0x7FF) * 20)
+#define RDO_PPS_MA(rdo)            (((rdo) & 0x7F) * 50)
+
 #define RDO_FIXED(n, op_ma, max_ma, flags) \
 				(RDO_OBJ_POS(n) | (flags) | \
 				RDO_FIXED_VAR_OP_CURR(op_ma) | \
@@ -131,6 +145,7 @@ enum pd_rx_errors {
 #define BDO_MODE_CARRIER2   (5 << 28)
 #define BDO_MODE_CARRIER3   (6 << 28)
 #define BDO_MODE_EYE        (7 << 28)
+#define BDO_MODE_TEST_DATA  (8 << 28)
 
 #define BDO(mode, cnt)      ((mode) | ((cnt) & 0xFFFF))
 
@@ -142,6 +157,7 @@ enum pd_rx_errors {
 #define PD_T_SINK_TRANSITION   (35*MSEC) /* between 20ms and 35ms */
 #define PD_T_SOURCE_ACTIVITY   (45*MSEC) /* between 40ms and 50ms */
 #define PD_T_SENDER_RESPONSE   (30*MSEC) /* between 24ms and 30ms */
+#define PD_T_RECEIVER_RESPONSE (15*MSEC) /* max of 15ms */
 #define PD_T_PS_TRANSITION    (500*MSEC) /* between 450ms and 550ms */
 #define PD_T_PS_SOURCE_ON     (480*MSEC) /* between 390ms and 480ms */
 #define PD_T_PS_SOURCE_OFF    (920*MSEC) /* between 750ms and 920ms */
@@ -627,6 +643,7 @@ struct pd_policy {
 
 /* Other Vendor IDs */
 #define USB_VID_APPLE  0x05ac
+#define USB_VID_INTEL  0x8087
 
 /* Timeout for message receive in microseconds */
 #define USB_PD_RX_TMOUT_US 1800
@@ -801,9 +818,30 @@ enum pd_data_msg_type {
 	PD_DATA_VENDOR_DEF = 15,
 };
 
+/* Extended message type (PD 3.0) */
+enum pd_ext_msg_type {
+	/* 0 Reserved */
+	PD_EXT_SOURCE_CAP = 1,
+	PD_EXT_STATUS = 2,
+	PD_EXT_GET_BATTERY_CAP = 3,
+	PD_EXT_GET_BATTERY_STATUS = 4,
+	PD_EXT_BATTERY_CAP = 5,
+	PD_EXT_GET_MANUFACTURER_INFO = 6,
+	PD_EXT_MANUFACTURER_INFO = 7,
+	PD_EXT_SECURITY_REQUEST = 8,
+	PD_EXT_SECURITY_RESPONSE = 9,
+	PD_EXT_FW_UPDATE_REQUEST = 10,
+	PD_EXT_FW_UPDATE_RESPONSE = 11,
+	PD_EXT_PPS_STATUS = 12,
+	PD_EXT_COUNTRY_INFO = 13,
+	PD_EXT_COUNTRY_CODES = 14,
+	/* 15 Reserved */
+};
+
 /* Protocol revision */
 #define PD_REV10 0
 #define PD_REV20 1
+#define PD_REV30 2
 
 /* Power role */
 #define PD_ROLE_SINK   0
@@ -842,6 +880,17 @@ enum pd_data_msg_type {
 #define PD_HEADER_CNT(header)  (((header) >> 12) & 7)
 #define PD_HEADER_TYPE(header) ((header) & 0xF)
 #define PD_HEADER_ID(header)   (((header) >> 9) & 7)
+#define PD_HEADER_EXT(header)  (((header) >> 15) & 1)
+
+/* Extended message header, first 16 bits of the payload (PD 3.0) */
+#define PD_EXT_HEADER_CHUNKED(ext)   (((ext) >> 15) & 1)
+#define PD_EXT_HEADER_CHUNK_NUM(ext) (((ext) >> 11) & 0xF)
+#define PD_EXT_HEADER_REQ_CHUNK(ext) (((ext) >> 10) & 1)
+#define PD_EXT_HEADER_DATA_SIZE(ext) ((ext) & 0x1FF)
+
+/* Maximum size of an extended message data and of each of its chunks */
+#define PD_MAX_EXTENDED_MSG_LEN       260
+#define PD_MAX_EXTENDED_MSG_CHUNK_LEN 26
 
 /* K-codes for special symbols */
 #define PD_SYNC1 0x18
@@ -851,6 +900,30 @@ enum pd_data_msg_type {
 #define PD_RST2  0x19
 #define PD_EOP   0x0D
 
+/* Start of Packet sequence : three Sync-1 K-codes, then one Sync-2 K-code */
+#define PD_SOP (PD_SYNC1 | (PD_SYNC1<<5) | (PD_SYNC1<<10) | (PD_SYNC2<<15))
+#define PD_SOP_PRIME	(PD_SYNC1 | (PD_SYNC1<<5) | \
+			(PD_SYNC3<<10) | (PD_SYNC3<<15))
+#define PD_SOP_PRIME_PRIME	(PD_SYNC1 | (PD_SYNC3<<5) | \
+				(PD_SYNC1<<10) | (PD_SYNC3<<15))
+#define PD_SOP_DEBUG_PRIME	(PD_SYNC1 | (PD_RST2<<5) | \
+				(PD_RST2<<10) | (PD_SYNC3<<15))
+#define PD_SOP_DEBUG_PRIME_PRIME	(PD_SYNC1 | (PD_RST2<<5) | \
+					(PD_SYNC3<<10) | (PD_SYNC2<<15))
+
+/* Hard Reset sequence : three RST-1 K-codes, then one RST-2 K-code */
+#define PD_HARD_RESET (PD_RST1 | (PD_RST1 << 5) |\
+		      (PD_RST1 << 10) | (PD_RST2 << 15))
+/* Cable Reset sequence : RST-1, Sync-1, RST-1, Sync-3 K-codes */
+#define PD_CABLE_RESET (PD_RST1 | (PD_SYNC1 << 5) |\
+		       (PD_RST1 << 10) | (PD_SYNC3 << 15))
+
+/*
+ * 4b5b decoding table : 5-bit symbol to 4-bit value,
+ * K-codes and invalid symbols are decoded as values >= 0x10.
+ */
+extern const uint8_t dec4b5b[];
+
 /* Minimum PD supply current  (mA) */
 #define PD_MIN_MA	500
 
@@ -930,6 +1003,14 @@ void pd_set_max_voltage(unsigned mv);
  */
 unsigned pd_get_max_voltage(void);
 
+/**
+ * Request the given source capability rather than the best one under the
+ * max voltage.
+ * @param index index of the PDO in the source capabilities, -1 to go back
+ * to the max voltage selection.
+ */
+void pd_set_request_pdo(int index);
+
 /**
  * Check if this board supports the given input voltage.
  *
@@ -1003,6 +1084,15 @@ void pd_request_source_voltage(int port, int mv);
  */
 void pd_set_external_voltage_limit(int port, int mv);
 
+/**
+ * Get the source capabilities received last.
+ *
+ * @param port USB-C port number
+ * @param src_caps set to the power data objects
+ * @return number of power data objects, 0 if none received
+ */
+int pd_get_src_caps(int port, const uint32_t **src_caps);
+
 /**
  * Set the PD input current limit.
  *
@@ -1046,6 +1136,18 @@ void typec_set_source_current_limit(int port, int rp);
  */
 int pd_board_checks(void);
 
+/**
+ * Wake up the PD task when a source pulls up one of the CC lines, so that the
+ * disconnected sink can sleep rather than poll them.
+ * See CONFIG_USB_PD_CC_WATCHDOG.
+ *
+ * @param port USB-C port number
+ * @param enable 1 to arm the watch, 0 to stop it
+ * @return EC_SUCCESS if the task will be woken up (or the watch is stopped),
+ * an error code if it must keep polling.
+ */
+int board_cc_watch(int port, int enable);
+
 /**
  * Return if VBUS is detected on type-C port
  *
@@ -1297,6 +1399,14 @@ extern const struct deferred_data pd_usb_billboard_deferred_data;
 
 /* Packet preparation/retrieval */
 
+/**
+ * Get the packet decoder reading the RX samples of the port.
+ *
+ * @param port USB-C port number
+ * @return decoder, see usb_pd_decode.h
+ */
+struct pd_decoder *pd_get_decoder(int port);
+
 /**
  * Prepare packet reading state machine.
  *
@@ -1315,6 +1425,24 @@ void pd_init_dequeue(int port);
  */
 int pd_dequeue_bits(int port, int off, int len, uint32_t *val);
 
+/**
+ * Set the bit period used to classify the received edge intervals.
+ *
+ * Reset to the nominal period by pd_init_dequeue().
+ *
+ * @param port USB-C port number
+ * @param period16 half bit period in 16th of RX timer ticks.
+ */
+void pd_set_rx_period(int port, int period16);
+
+/**
+ * Get the bit period used to classify the received edge intervals.
+ *
+ * @param port USB-C port number
+ * @return half bit period in 16th of RX timer ticks.
+ */
+int pd_get_rx_period(int port);
+
 /**
  * Advance until the end of the preamble.
  *
@@ -1377,6 +1505,33 @@ int encode_word(int port, int off, uint32_t val32);
 int prepare_message(int port, uint16_t header, uint8_t cnt,
 		    const uint32_t *data);
 
+/**
+ * Same as prepare_message() but corrupt the packet CRC.
+ *
+ * @param port USB-C port number
+ * @param header PD packet header
+ * @param cnt number of payload words
+ * @param data payload content
+ * @param crc_xor bits to flip in the CRC (0 for a valid packet)
+ * @return length of the message in bits.
+ */
+int prepare_message_crc(int port, uint16_t header, uint8_t cnt,
+			const uint32_t *data, uint32_t crc_xor);
+
+/**
+ * Same as prepare_message() with the ordered set of 'type' (SOP, SOP' or
+ * SOP'') rather than the one of the last transmit request.
+ *
+ * @param port USB-C port number
+ * @param type TCPC_TX_SOP, TCPC_TX_SOP_PRIME or TCPC_TX_SOP_PRIME_PRIME
+ * @param header PD packet header
+ * @param cnt number of payload words
+ * @param data payload content
+ * @return length of the message in bits.
+ */
+int prepare_message_sop(int port, int type, uint16_t header, uint8_t cnt,
+			const uint32_t *data);
+
 /**
  * Dump the current PD packet on the console for debug.
  *
@@ -1393,6 +1548,14 @@ void pd_dump_packet(int port, const char *msg);
  */
 void pd_set_clock(int port, int freq);
 
+/**
+ * Get the TX data clock frequency.
+ *
+ * @param port USB-C port number
+ * @return frequency in hertz.
+ */
+int pd_get_clock(int port);
+
 /* TX/RX callbacks */
 
 /**
@@ -1405,6 +1568,84 @@ void pd_set_clock(int port, int freq);
  */
 int pd_start_tx(int port, int polarity, int bit_len);
 
+/**
+ * Start sending over the wire a packet already encoded in another buffer.
+ *
+ * The buffer must stay untouched until pd_tx_done() returns.
+ *
+ * @param port USB-C port number
+ * @param polarity plug polarity (0=CC1, 1=CC2).
+ * @param buf packet bit image, as built by prepare_message().
+ * @param bit_len size of the packet in bits.
+ * @return length transmitted or negative if error
+ */
+int pd_start_tx_buf(int port, int polarity, const uint32_t *buf, int bit_len);
+
+/**
+ * Start sending the same byte of bit image 'count' times over the wire.
+ *
+ * The DMA counts the bytes, so the transmission stops after exactly
+ * 'count' * 8 bits (up to 65535 bytes, 874ms at 600kHz), without the
+ * software timing of a circular transfer.
+ *
+ * @param port USB-C port number
+ * @param polarity plug polarity (0=CC1, 1=CC2).
+ * @param byte 8 bits of image, sent LSB first.
+ * @param count number of bytes to send.
+ * @return 0 or negative if error
+ */
+int pd_start_tx_fill(int port, int polarity, uint8_t byte, int count);
+
+/**
+ * Get the packet buffer filled by prepare_message() and pd_write_sym().
+ *
+ * @param port USB-C port number
+ * @return pointer to the encoded packet bit image.
+ */
+const uint32_t *pd_get_raw_samples(int port);
+
+/**
+ * Get the part of the packet buffer left free by a bit image.
+ *
+ * @param port USB-C port number
+ * @param bit_len length of the bit image at the start of the buffer
+ * @param bits size of the free part in bits
+ * @return pointer to the free part, word aligned.
+ */
+uint32_t *pd_get_tx_spare(int port, int bit_len, int *bits);
+
+/**
+ * Check whether the PHY is transmitting or receiving a packet.
+ *
+ * @param port USB-C port number
+ * @return non-zero while the packet buffer is in use by the DMA.
+ */
+int pd_phy_busy(int port);
+
+/**
+ * Turn the packet image encoded by prepare_message() into RX edge samples,
+ * so that the next pd_analyze_rx() decodes it rather than the DMA capture.
+ * The port must be idle and the interrupts disabled until the replay ends.
+ *
+ * @param port USB-C port number
+ * @param bit_len length of the packet image in bits, 0 ends the replay.
+ * @return number of samples, or -EC_ERROR_x.
+ */
+int pd_rx_load_image(int port, int bit_len);
+
+/**
+ * Load RX edge samples recorded from the line (8-bit RX timer values, as
+ * captured by the DMA), so that the next pd_analyze_rx() decodes them rather
+ * than the DMA capture. Same conditions as pd_rx_load_image().
+ *
+ * @param port USB-C port number
+ * @param samples the samples, from the first edge of the preamble
+ * @param count number of samples, 0 ends the replay. The samples beyond the
+ *        RX buffer are dropped.
+ * @return number of samples loaded, or -EC_ERROR_x.
+ */
+int pd_rx_load_samples(int port, const uint8_t *samples, int count);
+
 /**
  * Set PD TX DMA to use circular mode. Call this before pd_start_tx() to
  * continually loop over the transmit buffer given in pd_start_tx().
@@ -1449,6 +1690,13 @@ void pd_rx_event(int port);
 void pd_rx_start(int port);
 /* Call when we are done reading a packet */
 void pd_rx_complete(int port);
+/* RX timer ticks (2.4 MHz) from pd_rx_start() to the last captured edge */
+int pd_rx_last_edge(int port);
+/*
+ * Edges captured since pd_rx_start(), their 8-bit RX timer values are at the
+ * start of pd_get_raw_samples() : 0 once pd_rx_complete() stopped the DMA.
+ */
+int pd_rx_edge_count(int port);
 
 /* restart listening to the CC wire */
 void pd_rx_enable_monitoring(int port);
@@ -1502,6 +1750,14 @@ struct rx_header {
  */
 struct rx_header pd_analyze_rx(int port, uint32_t *payload);
 
+/**
+ * Where the decoding of the last packet by pd_analyze_rx() stopped.
+ *
+ * @param port USB-C port number
+ * @return PD_DECODE_OK or the failed step (enum pd_decode_err)
+ */
+int pd_rx_last_error(int port);
+
 /**
  * Get connected state
  *
@@ -1525,6 +1781,27 @@ void pd_execute_hard_reset(int port);
  */
 void pd_transmit_complete(int port, int status);
 
+/**
+ * Get the response the TCPC sends right after the GoodCRC of a received
+ * message, without waiting for the protocol layer.
+ *
+ * @param port USB-C port number
+ * @param head header of the received message
+ * @param payload data objects of the received message
+ * @param data set to the data objects of the response
+ * @return header of the response, 0 if there is nothing to send
+ */
+uint16_t pd_fast_response(int port, uint16_t head, uint32_t *payload,
+			  const uint32_t **data);
+
+/**
+ * Signal to protocol layer that the fast response has been sent
+ *
+ * @param port USB-C port number
+ * @param success the response got its GoodCRC
+ */
+void pd_fast_response_done(int port, int success);
+
 /**
  * Get port polarity.
  *
@@ -1607,6 +1884,16 @@ void pd_set_new_power_request(int port);
 void pd_log_event(uint8_t type, uint8_t size_port,
 		  uint16_t data, void *payload);
 
+struct ec_response_pd_log;
+
+/**
+ * Remove the oldest event from the PD logging FIFO.
+ *
+ * @param r buffer for the entry and its payload (must be 5 entries long)
+ * @return size of the entry in bytes, a PD_EVENT_NO_ENTRY entry if empty.
+ */
+int pd_log_dequeue(struct ec_response_pd_log *r);
+
 /**
  * Retrieve one logged event and prepare a VDM with it.
  *
@@ -0,0 +1,170 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * USB Power Delivery packet decoder : BMC edge samples to PD messages.
+ *
+ * It only reads the samples through struct pd_decoder, without touching
+ * the capture hardware, so the same code runs on the device and on the
+ * host (util/pd_decode_bench.c).
+ */
+
+#ifndef __CROS_EC_USB_PD_DECODE_H
+#define __CROS_EC_USB_PD_DECODE_H
+
+#include "common.h"
+
+/* Nominal half bit period of the samples : 4 ticks of the 2.4MHz RX timer */
+#define PD_DECODE_PERIOD 4
+
+/* Classes of the intervals up to that length, longer ones are errors */
+#define PD_DECODE_CLASS_COUNT 16
+
+/*
+ * Edge intervals of the decoded bits, by length in RX timer ticks : the
+ * halves of the '1' bits (1 UI / 2) and the '0' bits (1 UI).
+ */
+struct pd_decode_hist {
+	uint32_t half[PD_DECODE_CLASS_COUNT];
+	uint32_t full[PD_DECODE_CLASS_COUNT];
+};
+
+struct pd_decoder {
+	/* 8-bit RX timer value at each edge of the CC line */
+	const uint8_t *samples;
+	/* size of the samples buffer */
+	int size;
+	/*
+	 * Wait for at least 'nb' samples.
+	 * Returns the number of samples received, or -1 if the packet ended
+	 * before, e.g. on the RX timeout.
+	 */
+	int (*wait)(struct pd_decoder *dec, int nb);
+	/* owner of the sample source, for 'wait' */
+	void *priv;
+	/* Try shifted bit periods when the CRC does not match */
+	int retry;
+	/*
+	 * SOP* types (1 << TCPC_TX_x) whose messages are not decoded past
+	 * their ordered set, e.g. because the trace filter drops them.
+	 */
+	uint8_t sop_skip;
+	/* Edge intervals histogram updated by pd_decode_bits(), or NULL */
+	struct pd_decode_hist *hist;
+
+	/* samples known to be received */
+	int avail;
+	/* bits decoded but not read yet */
+	uint32_t last;
+	int lastlen;
+	/* measured half bit period, in 16th of RX timer ticks */
+	int period16;
+	/* class of each interval length for that period */
+	uint8_t class[PD_DECODE_CLASS_COUNT];
+};
+
+/* Where the decoding of a packet stopped */
+enum pd_decode_err {
+	PD_DECODE_OK = 0,
+	PD_DECODE_ERR_PREAMBLE,
+	PD_DECODE_ERR_SOP,
+	PD_DECODE_ERR_LEN,
+	PD_DECODE_ERR_CRC,
+	PD_DECODE_ERR_EOP,
+	PD_DECODE_SKIPPED, /* the SOP* type is in 'sop_skip' */
+};
+
+struct pd_decode_result {
+	/* TCPC_TX_SOP*, TCPC_TX_HARD_RESET or TCPC_TX_CABLE_RESET */
+	int type;
+	uint16_t header;
+	/* CRC received and computed, when they were decoded */
+	uint32_t crc_rx;
+	uint32_t crc;
+	/* position after the SOP and after the last symbol in the samples */
+	int sop_end;
+	int end;
+	/* 1 when only 3 of the 4 K-codes of the ordered set matched */
+	uint8_t partial;
+	/* 1 when the CRC was retried, period shift of the pass that matched */
+	uint8_t retried;
+	int8_t retry_shift;
+};
+
+/**
+ * Reset the decoder for a new packet, at the nominal bit period.
+ *
+ * The sample source (samples, size, wait and priv) is kept.
+ *
+ * @param dec decoder
+ */
+void pd_decode_init(struct pd_decoder *dec);
+
+/**
+ * Set the bit period used to classify the edge intervals.
+ *
+ * @param dec decoder
+ * @param period16 half bit period in 16th of RX timer ticks.
+ */
+void pd_decode_set_period(struct pd_decoder *dec, int period16);
+
+/**
+ * Advance until the end of the preamble, and measure its bit period.
+ *
+ * @param dec decoder
+ * @return position of the SYNC-1 in the samples, PD_RX_ERR_HARD_RESET,
+ *         PD_RX_ERR_CABLE_RESET or -1 if no preamble was found.
+ */
+int pd_decode_preamble(struct pd_decoder *dec);
+
+/**
+ * Classify an ordered set : an exact match, or 3 of its 4 K-codes matching
+ * a single one of the ordered sets.
+ *
+ * @param val the 20 bits following the preamble, the first one in the LSB.
+ * @param partial set to 1 if only 3 K-codes matched (may be NULL).
+ * @return TCPC_TX_SOP* (debug ones included), TCPC_TX_HARD_RESET,
+ *         TCPC_TX_CABLE_RESET or -1 if no ordered set matched.
+ */
+int pd_decode_ordered_set(uint32_t val, uint8_t *partial);
+
+/**
+ * Decode bits.
+ *
+ * @param dec decoder
+ * @param off current position in the samples.
+ * @param len number of bits to read, up to 32.
+ * @param val the read bits, the first one in the LSB.
+ * @return new position in the samples, or -1 on an invalid interval.
+ */
+int pd_decode_bits(struct pd_decoder *dec, int off, int len, uint32_t *val);
+
+/**
+ * Decode 4 4b5b symbols into 16 bits of data.
+ *
+ * @return new position in the samples, or -1 on an invalid symbol.
+ */
+int pd_decode_short(struct pd_decoder *dec, int off, uint16_t *val16);
+
+/**
+ * Decode 8 4b5b symbols into 32 bits of data.
+ *
+ * @return new position in the samples, or -1 on an invalid symbol.
+ */
+int pd_decode_word(struct pd_decoder *dec, int off, uint32_t *val32);
+
+/**
+ * Decode a whole packet : preamble, SOP, header, data objects, CRC and EOP.
+ *
+ * @param dec decoder, its state is reset first.
+ * @param res header, SOP type and positions of the packet.
+ * @param payload buffer for the data objects (must be 7x 32-bit)
+ * @return PD_DECODE_OK or the step where the decoding failed.
+ */
+enum pd_decode_err pd_decode_packet(struct pd_decoder *dec,
+				    struct pd_decode_result *res,
+				    uint32_t *payload);
+
+#endif /* __CROS_EC_USB_PD_DECODE_H */
@@ -0,0 +1,12 @@
+# -*- makefile -*-
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Host tools build
+#
+
+host-util-bin=pd_decode_bench
+
+# firmware packet decoder running on the host
+pd_decode_bench-objs=../common/usb_pd_decode.o ../common/crc.o
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Decode the token log (TWINKIE_TOKEN_LOG build) with the format strings of
+# the .tokens section of the ELF file of the image:
+#
+#   detokenize.py build/twonkie/RO/ec.RO.elf < console.txt
+#       the 'toklog dump' lines of a console capture
+#   detokenize.py --usb build/twonkie/RO/ec.RO.elf
+#       drain the ring with INJ_BIN_TOKEN_LOG requests on the commands
+#       interface until it is empty
+
+import re
+import struct
+from sys import argv, stdin, stdout
+
+INJ_BIN_MAGIC = 0xB1
+INJ_BIN_TOKEN_LOG = 12
+COMMANDS_IFACE = 2
+
+
+def token_db(path):
+    """Token (offset in .tokens) -> format string"""
+    with open(path, "rb") as f:
+        elf = f.read()
+    if elf[:4] != b"\x7fELF" or elf[4] != 1:
+        raise SystemExit("%s: not a 32-bit ELF file" % path)
+    shoff, = struct.unpack_from("<I", elf, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2E)
+
+    def section(i):
+        # name, type, flags, addr, offset, size
+        return struct.unpack_from("<IIIIII", elf, shoff + i * shentsize)
+
+    names = section(shstrndx)[4]
+    for i in range(shnum):
+        name, _, _, _, off, size = section(i)
+        end = elf.index(b"\0", names + name)
+        if elf[names + name:end] != b".tokens":
+            continue
+        data = elf[off:off + size]
+        db, start = {}, 0
+        while start < len(data):
+            end = data.index(b"\0", start)
+            db[start] = data[start:end].decode(errors="replace")
+            start = end + 1
+            # the next string may be aligned
+            while start < len(data) and data[start] == 0:
+                start += 1
+        return db
+    raise SystemExit("%s: no .tokens section, not a token log build" % path)
+
+
+def py_format(fmt, args):
+    """Format with the C format string, integer arguments only"""
+    # no length modifiers in Python
+    fmt = re.sub(r"%([-+ 0#]*\d*(?:\.\d+)?)(?:hh|h|ll|l)?([diuxXc])",
+                 lambda m: "%" + m.group(1) +
+                 ("d" if m.group(2) in "iu" else m.group(2)), fmt)
+    conv = re.findall(r"%[-+ 0#]*\d*(?:\.\d+)?([dxXc])", fmt)
+    vals = []
+    for c, a in zip(conv, args):
+        vals.append(a - (1 << 32) if c == "d" and a & 0x80000000 else a)
+    try:
+        return fmt % tuple(vals)
+    except (TypeError, ValueError):
+        return "%s %s" % (fmt, " ".join("%08x" % a for a in args))
+
+
+def decode(db, words):
+    """Print the records of the word list, return the words left over"""
+    while len(words) >= 2:
+        hdr, ts = words[0], words[1]
+        nargs = hdr >> 24
+        if len(words) < 2 + nargs:
+            break
+        args = words[2:2 + nargs]
+        fmt = db.get(hdr & 0xFFFFFF)
+        if fmt is None:
+            text = "unknown token %06x" % (hdr & 0xFFFFFF)
+        else:
+            text = py_format(fmt, args)
+        stdout.write("%10u %s\n" % (ts, text.rstrip("\n")))
+        words = words[2 + nargs:]
+    return words
+
+
+def from_console(db):
+    for line in stdin:
+        m = re.search(r"\btok((?: [0-9a-fA-F]{8})+)", line)
+        if m:
+            decode(db, [int(w, 16) for w in m.group(1).split()])
+
+
+def from_usb(db):
+    import usb1
+
+    context = usb1.USBContext()
+    handle = context.openByVendorIDAndProductID(0x18D1, 0x500A)
+    with handle.claimInterface(COMMANDS_IFACE):
+        seq = 0
+        while True:
+            req = struct.pack("<BBHHHI", INJ_BIN_MAGIC, INJ_BIN_TOKEN_LOG,
+                              0, 0xFFFF, seq, 0)
+            handle.bulkWrite(0x1 + COMMANDS_IFACE, req)
+            data = b""
+            while len(data) < 16:
+                data += bytes(handle.bulkRead(0x81 + COMMANDS_IFACE, 64))
+            _, _, status, _, count, _, _, _ = struct.unpack_from(
+                "<BBHHHIHH", data)
+            if status:
+                raise SystemExit("INJ_BIN_TOKEN_LOG error %d" % status)
+            while len(data) < 16 + 4 * count:
+                data += bytes(handle.bulkRead(0x81 + COMMANDS_IFACE, 64))
+            if not count:
+                break
+            decode(db, list(struct.unpack_from("<%dI" % count, data, 16)))
+            seq += 1
+
+
+if __name__ == "__main__":
+    usb = "--usb" in argv[1:]
+    files = [a for a in argv[1:] if a != "--usb"]
+    if len(files) != 1:
+        raise SystemExit("usage: %s [--usb] <ec.RO.elf|ec.RW.elf>" % argv[0])
+    db = token_db(files[0])
+    if usb:
+        from_usb(db)
+    else:
+        from_console(db)
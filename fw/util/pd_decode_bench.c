@@ -0,0 +1,329 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * pd_decode_bench : run the firmware USB-PD packet decoder
+ * (common/usb_pd_decode.c) on the host, over a corpus of RX edge samples.
+ *
+ * Built by `make BOARD=<board> utils-host`, with the configuration of that
+ * board, as build/<board>/util/pd_decode_bench.
+ *
+ * The corpus is a text file of 8-bit RX timer samples (the edges of the CC
+ * line at 2.4MHz) as 2-digit hex numbers. Packets are separated by a blank
+ * line or "||", '#' starts a comment and other words are ignored, so the
+ * sample dump of a decoding error (debug level 2) can be pasted as is.
+ * Without a file, it decodes synthetic packets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "compile_time_macros.h"
+#undef CONFIG_HW_CRC
+#include "crc.h"
+#include "usb_pd.h"
+#include "usb_pd_decode.h"
+
+/* Synthetic corpus */
+#define SYNTH_PACKETS 64
+/* Samples of the longest packet, with the trailing edges */
+#define PACKET_MAX_SAMPLES 1024
+
+struct packet {
+	int count;
+	uint8_t samples[PACKET_MAX_SAMPLES];
+};
+
+static struct packet *packets;
+static int packet_count;
+
+static struct packet *packet_add(void)
+{
+	struct packet *pk;
+
+	packets = realloc(packets, (packet_count + 1) * sizeof(*packets));
+	if (!packets) {
+		perror("realloc");
+		exit(1);
+	}
+	pk = &packets[packet_count++];
+	pk->count = 0;
+	return pk;
+}
+
+static int load_corpus(const char *name)
+{
+	FILE *f = fopen(name, "r");
+	char line[512];
+	struct packet *pk = NULL;
+
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *tok, *save;
+		char *hash = strchr(line, '#');
+
+		if (hash)
+			*hash = '\0';
+		tok = strtok_r(line, " \t\r\n", &save);
+		if (!tok && pk && pk->count) {
+			/* blank line : end of packet */
+			pk = NULL;
+			continue;
+		}
+		for (; tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+			char *end, *colon = strchr(tok, ':');
+			unsigned long v;
+
+			/* "NNN:" offset at the start of a dump line */
+			if (colon)
+				tok = colon + 1;
+			if (!strcmp(tok, "||")) {
+				pk = NULL;
+				continue;
+			}
+			/* end of the interval block of a dump */
+			if (!strcmp(tok, "><")) {
+				if (pk)
+					pk->count = 0;
+				continue;
+			}
+			if (strlen(tok) != 2)
+				continue;
+			v = strtoul(tok, &end, 16);
+			if (*end)
+				continue;
+			if (!pk)
+				pk = packet_add();
+			if (pk->count < PACKET_MAX_SAMPLES)
+				pk->samples[pk->count++] = v;
+		}
+	}
+	fclose(f);
+	/* drop an empty last packet */
+	if (packet_count && !packets[packet_count - 1].count)
+		packet_count--;
+	return packet_count;
+}
+
+/* 4b5b encoding of a nibble */
+static const uint8_t enc4b5b[16] = {
+	0x1E, 0x09, 0x14, 0x15, 0x0A, 0x0B, 0x0E, 0x0F,
+	0x12, 0x13, 0x16, 0x17, 0x1A, 0x1B, 0x1C, 0x1D,
+};
+
+/* BMC encoder state, in half-bit units */
+struct synth {
+	struct packet *pk;
+	int half;
+	int jitter;
+};
+
+static void synth_edge(struct synth *s)
+{
+	int j = s->jitter ? rand() % (2 * s->jitter + 1) - s->jitter : 0;
+
+	if (s->pk->count < PACKET_MAX_SAMPLES)
+		s->pk->samples[s->pk->count++] =
+			s->half * PD_DECODE_PERIOD + j;
+}
+
+static void synth_bit(struct synth *s, int bit)
+{
+	/* a transition at every bit start, another one in the middle of 1s */
+	synth_edge(s);
+	s->half++;
+	if (bit)
+		synth_edge(s);
+	s->half++;
+}
+
+static void synth_sym(struct synth *s, int sym)
+{
+	int i;
+
+	for (i = 0; i < 5; i++)
+		synth_bit(s, (sym >> i) & 1);
+}
+
+static void synth_data(struct synth *s, uint32_t val, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes * 2; i++, val >>= 4)
+		synth_sym(s, enc4b5b[val & 0xf]);
+}
+
+/* Encode a message with 'cnt' data objects as its RX edge samples */
+static void synth_packet(struct packet *pk, int cnt, int id, int jitter)
+{
+	struct synth s = { .pk = pk, .jitter = jitter };
+	uint16_t header = PD_HEADER(PD_DATA_SOURCE_CAP, PD_ROLE_SOURCE,
+				    PD_ROLE_DFP, id, cnt);
+	uint32_t crc;
+	int i;
+
+	/* 64-bit preamble starting with 0 */
+	for (i = 0; i < 64; i++)
+		synth_bit(&s, i & 1);
+	synth_sym(&s, PD_SYNC1);
+	synth_sym(&s, PD_SYNC1);
+	synth_sym(&s, PD_SYNC1);
+	synth_sym(&s, PD_SYNC2);
+
+	crc32_ctx_init(&crc);
+	crc32_ctx_hash16(&crc, header);
+	synth_data(&s, header, 2);
+	for (i = 0; i < cnt; i++) {
+		uint32_t obj = rand();
+
+		crc32_ctx_hash32(&crc, obj);
+		synth_data(&s, obj, 4);
+	}
+	synth_data(&s, crc32_ctx_result(&crc), 4);
+	synth_sym(&s, PD_EOP);
+
+	/* last edge, then the line goes idle */
+	synth_edge(&s);
+	s.half += 8;
+	synth_edge(&s);
+}
+
+static void synth_corpus(int jitter)
+{
+	int i;
+
+	for (i = 0; i < SYNTH_PACKETS; i++)
+		synth_packet(packet_add(), i % 8, i % 8, jitter);
+}
+
+/* Decoder sample source : the whole packet is there already */
+static int packet_wait(struct pd_decoder *dec, int nb)
+{
+	struct packet *pk = dec->priv;
+
+	return pk->count >= nb ? pk->count : -1;
+}
+
+static enum pd_decode_err decode(struct pd_decoder *dec, struct packet *pk,
+				 struct pd_decode_result *res,
+				 uint32_t *payload)
+{
+	dec->samples = pk->samples;
+	dec->size = pk->count;
+	dec->priv = pk;
+	return pd_decode_packet(dec, res, payload);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-n runs] [-j ticks] [-r] [-v] [corpus]\n"
+		"  -n : decoding passes over the corpus (default 1000)\n"
+		"  -j : jitter of the synthetic edges, in RX timer ticks\n"
+		"  -r : decode again with shifted periods on a CRC error\n"
+		"  -v : print the decoded packets\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	static const char * const err_name[] = {
+		[PD_DECODE_OK] = "OK",
+		[PD_DECODE_ERR_PREAMBLE] = "Preamble",
+		[PD_DECODE_ERR_SOP] = "SOP",
+		[PD_DECODE_ERR_LEN] = "len",
+		[PD_DECODE_ERR_CRC] = "CRC",
+		[PD_DECODE_ERR_EOP] = "EOP",
+		[PD_DECODE_SKIPPED] = "skipped",
+	};
+	struct pd_decoder dec = { .wait = packet_wait };
+	struct pd_decode_result res;
+	uint32_t payload[7];
+	int errors[ARRAY_SIZE(err_name)] = { 0 };
+	int runs = 1000, jitter = 0, verbose = 0;
+	long long samples = 0;
+	double t0, ns;
+	int opt, i, r;
+
+	while ((opt = getopt(argc, argv, "n:j:rvh")) != -1) {
+		switch (opt) {
+		case 'n':
+			runs = atoi(optarg);
+			if (runs <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'j':
+			jitter = atoi(optarg);
+			break;
+		case 'r':
+			dec.retry = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc) {
+		if (load_corpus(argv[optind]) <= 0) {
+			fprintf(stderr, "%s: no packet\n", argv[optind]);
+			return 1;
+		}
+	} else {
+		synth_corpus(jitter);
+	}
+
+	/* check pass */
+	for (i = 0; i < packet_count; i++) {
+		enum pd_decode_err err = decode(&dec, &packets[i], &res,
+						payload);
+		int p;
+
+		errors[err]++;
+		samples += packets[i].count;
+		if (!verbose)
+			continue;
+		printf("%3d: %-8s type %d header %04x", i, err_name[err],
+		       res.type, res.header);
+		for (p = 0; !err && p < PD_HEADER_CNT(res.header); p++)
+			printf(" %08x", payload[p]);
+		if (res.retried)
+			printf(" (retried %d/16)", res.retry_shift);
+		printf("\n");
+	}
+
+	t0 = now_ns();
+	for (r = 0; r < runs; r++)
+		for (i = 0; i < packet_count; i++)
+			decode(&dec, &packets[i], &res, payload);
+	ns = (now_ns() - t0) / ((double)runs * packet_count);
+
+	printf("%d packets, %lld samples:", packet_count, samples);
+	for (i = 0; i < ARRAY_SIZE(err_name); i++)
+		if (errors[i])
+			printf(" %s %d", err_name[i], errors[i]);
+	printf("\n%.0f ns/packet, %.0f packets/s, %.1f Msamples/s\n",
+	       ns, 1e9 / ns, samples * 1e3 / (ns * packet_count));
+	return errors[PD_DECODE_OK] + errors[PD_DECODE_ERR_CRC] ==
+		packet_count ? 0 : 2;
+}
@@ -0,0 +1,804 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libusb.h>
+
+#include "capture.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+/* Devices tracked by the rescans, without hotplug support */
+#define CTX_DEVICES 128
+/* Hotplug events waiting for tc_ctx_poll() */
+#define CTX_EVENTS 128
+/* Interval between two rescans of the devices, in seconds */
+#define CTX_RESCAN 1
+
+struct tc_ctx {
+	libusb_context *ctx;
+	uint16_t vid;
+	uint16_t pid;
+	tc_hotplug_cb cb;
+	void *priv;
+	/* libusb callback registered, else 'seen' is updated by rescans */
+	int hotplug;
+	libusb_hotplug_callback_handle handle;
+	struct {
+		uint8_t bus;
+		uint8_t addr;
+		uint8_t arrived;
+	} events[CTX_EVENTS];
+	int count;
+	uint16_t seen[CTX_DEVICES]; /* bus << 8 | address */
+	int seen_count;
+	time_t last_scan;
+};
+
+struct tc_capture {
+	libusb_context *ctx;
+	/* context created for this capture alone, released with it */
+	int own_ctx;
+	libusb_device_handle *dev;
+	int iface;
+	uint8_t ep;
+	/* isochronous packets per transfer, 0 for bulk transfers */
+	int iso_packets;
+	int count;
+	int size;
+	struct libusb_transfer **xfer;
+	/* transfers still owned by libusb */
+	int pending;
+	int running;
+	tc_data_cb cb;
+	void *priv;
+	int last_seq;
+	struct tc_stats stats;
+	/* commands interface, claimed by the first command (-1 before) */
+	int cmd_iface;
+	struct libusb_transfer *cmd_xfer;
+	int cmd_busy;
+	tc_cmd_cb cmd_cb;
+	void *cmd_priv;
+	uint8_t *cmd_out;
+	int cmd_len;
+};
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? 0xedb88320 : 0);
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *p, int len)
+{
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/*
+ * CRC-32 of the header words 0 to 5 then the payload, padded with a zero
+ * byte if its length is odd.
+ */
+static int packet_crc_ok(const uint8_t *pkt, int len)
+{
+	static const uint8_t pad;
+	uint32_t crc = crc32(0xffffffff, pkt, 12);
+	uint32_t ref = tc_get32(pkt + 12);
+
+	crc = crc32(crc, pkt + TC_HEADER_SIZE, len);
+	if (len & 1)
+		crc = crc32(crc, &pad, 1);
+	return (crc ^ 0xffffffff) == ref;
+}
+
+static int is_trace_tag(uint16_t tag)
+{
+	return tag == TC_TRACE_FIRST || tag == TC_TRACE_NEXT ||
+	       tag == TC_TRACE_TX || tag == TC_TRACE_VIOL ||
+	       tag == TC_TRACE_REPEAT || tag == TC_TRACE_ERRWIN;
+}
+
+enum tc_kind tc_packet(const uint8_t *data, int len, int *size)
+{
+	if (len >= TC_TRACE_PACKED_HDR &&
+	    (tc_get16(data + 6) & TC_TRACE_PACKED) &&
+	    is_trace_tag(tc_trace_tag(data))) {
+		/* packed trace record : the next one follows */
+		*size = TC_TRACE_PACKED_HDR + (data[13] >> 4) * 4;
+		if (*size <= len && *size <= TC_TRACE_SIZE)
+			return TC_TRACE;
+	}
+	if (len >= TC_TRACE_SIZE && is_trace_tag(tc_get16(data + 6))) {
+		/* trace record : always sent as a full packet */
+		*size = MIN(len, TC_PACKET_SIZE);
+		return TC_TRACE;
+	}
+	if (len >= TC_HEADER_SIZE && data[0] == TC_SNIFFER_MAGIC) {
+		*size = TC_HEADER_SIZE + data[6];
+		if (*size <= len && (*size <= TC_PACKET_SIZE ||
+				     (tc_get16(data + 2) & TC_FLAG_PAD)))
+			return TC_SNIFFER;
+	}
+	return TC_UNKNOWN;
+}
+
+void tc_trace_unpack(const uint8_t *rec, uint8_t *out)
+{
+	if (!(tc_get16(rec + 6) & TC_TRACE_PACKED)) {
+		memcpy(out, rec, TC_TRACE_SIZE);
+		return;
+	}
+	memset(out, 0, TC_TRACE_SIZE);
+	memcpy(out, rec, 12);
+	out[7] &= ~(TC_TRACE_PACKED >> 8);
+	memcpy(out + 12, rec + TC_TRACE_PACKED_HDR, (rec[13] >> 4) * 4);
+	memcpy(out + 40, rec + 12, 4);
+	/* the CC line only */
+	out[41] &= 0x0f;
+}
+
+void tc_parse(struct tc_stats *stats, int *last_seq, const uint8_t *data,
+	      int len)
+{
+	uint8_t rec[TC_TRACE_SIZE];
+	int size;
+
+	while (len > 0) {
+		switch (tc_packet(data, len, &size)) {
+		case TC_TRACE:
+			tc_trace_unpack(data, rec);
+			stats->records++;
+			if (tc_get16(rec + 6) == TC_TRACE_FIRST)
+				stats->trace_dropped += tc_get16(rec + 4);
+			if (tc_get16(rec + 6) == TC_TRACE_VIOL)
+				stats->violations++;
+			if (tc_get16(rec + 6) == TC_TRACE_REPEAT)
+				stats->repeats += tc_get32(rec + 12);
+			break;
+		case TC_SNIFFER: {
+			uint16_t seq = tc_get16(data + 4);
+			const uint8_t *rec = data + TC_HEADER_SIZE;
+
+			stats->packets++;
+			if (tc_get16(data + 2) & TC_FLAG_OFLOW)
+				stats->oflow++;
+			if ((tc_get16(data + 2) & TC_FLAG_RECORD) ==
+			    TC_FLAG_RECORD && data[6] >= 4 &&
+			    tc_get16(rec) == TC_REC_QOS &&
+			    tc_get16(rec + 2) != TC_QOS_SAMPLES)
+				stats->degraded++;
+			if ((tc_get16(data + 2) & TC_FLAG_RECORD) ==
+			    TC_FLAG_RECORD && data[6] >= 6 &&
+			    tc_get16(rec) == TC_REC_INPUT)
+				stats->inputs++;
+			if ((tc_get16(data + 2) & TC_FLAG_RECORD) ==
+			    TC_FLAG_RECORD && data[6] >= 18 &&
+			    tc_get16(rec) == TC_REC_HEALTH) {
+				stats->health++;
+				stats->cpu_idle = tc_get16(rec + 2);
+				stats->dev_oflow[0] += tc_get16(rec + 4);
+				stats->dev_oflow[1] += tc_get16(rec + 6);
+				stats->usb_free = tc_get16(rec + 8);
+			}
+			if ((tc_get16(data + 2) & TC_FLAG_RECORD) ==
+			    TC_FLAG_RECORD && data[6] >= 12 &&
+			    tc_get16(rec) == TC_REC_SUSPEND) {
+				stats->suspends++;
+				stats->susp_lost += tc_get16(rec + 8);
+			}
+			if ((tc_get16(data + 2) & TC_FLAG_RECORD) ==
+			    TC_FLAG_RECORD && data[6] >= 6 &&
+			    tc_get16(rec) == TC_REC_CLOCK) {
+				stats->clock_ppm = (int16_t)tc_get16(rec + 4);
+				if (abs(stats->clock_ppm) >
+				    abs(stats->clock_ppm_max))
+					stats->clock_ppm_max = stats->clock_ppm;
+			}
+			if (!packet_crc_ok(data, data[6]))
+				stats->crc_errors++;
+			if (*last_seq >= 0 &&
+			    seq != (uint16_t)(*last_seq + 1)) {
+				stats->seq_gaps++;
+				stats->seq_lost +=
+					(uint16_t)(seq - *last_seq - 1);
+			}
+			*last_seq = seq;
+			break;
+		}
+		default:
+			/* lost the packet boundaries, drop the transfer */
+			stats->unknown++;
+			return;
+		}
+		/* only the last packet of a transfer can be a short one */
+		data += size;
+		len -= size;
+	}
+}
+
+/* Parse the 'len' bytes of data received in 'buf', then hand them over */
+static void data_done(struct tc_capture *c, const uint8_t *buf, int len)
+{
+	if (!len) {
+		c->stats.empty++;
+		return;
+	}
+	c->stats.transfers++;
+	c->stats.bytes += len;
+	tc_parse(&c->stats, &c->last_seq, buf, len);
+	if (c->cb && c->running && c->cb(c->priv, buf, len))
+		c->running = 0;
+}
+
+/* Every isochronous packet holds whole device packets */
+static void iso_done(struct tc_capture *c, struct libusb_transfer *xfer)
+{
+	int i;
+
+	for (i = 0; i < xfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *d =
+			xfer->iso_packet_desc + i;
+
+		if (d->status != LIBUSB_TRANSFER_COMPLETED) {
+			c->stats.iso_lost++;
+			continue;
+		}
+		data_done(c, libusb_get_iso_packet_buffer_simple(xfer, i),
+			  d->actual_length);
+	}
+}
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *xfer)
+{
+	struct tc_capture *c = xfer->user_data;
+
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (c->iso_packets)
+			iso_done(c, xfer);
+		else
+			data_done(c, xfer->buffer, xfer->actual_length);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_OVERFLOW:
+		c->stats.errors++;
+		break;
+	default:
+		/* stall, device gone ... */
+		c->stats.errors++;
+		c->running = 0;
+		break;
+	}
+
+	if (c->running && !libusb_submit_transfer(xfer))
+		return;
+	c->pending--;
+	if (c->running) {
+		c->stats.errors++;
+		c->running = 0;
+	}
+}
+
+/*
+ * Find the IN endpoint of the transfer type 'type' in the alternate setting
+ * 'setting' of the interface 'iface'
+ */
+static int find_endpoint(libusb_device_handle *dev, int iface, int setting,
+			 int type, uint8_t *ep)
+{
+	struct libusb_config_descriptor *conf;
+	const struct libusb_interface_descriptor *alt;
+	int i, rv = -1;
+
+	if (libusb_get_active_config_descriptor(libusb_get_device(dev), &conf))
+		return -1;
+	if (iface < conf->bNumInterfaces &&
+	    setting < conf->interface[iface].num_altsetting) {
+		alt = conf->interface[iface].altsetting + setting;
+		for (i = 0; i < alt->bNumEndpoints; i++) {
+			const struct libusb_endpoint_descriptor *d =
+				alt->endpoint + i;
+
+			if ((d->bEndpointAddress & LIBUSB_ENDPOINT_IN) &&
+			    (d->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+			    type) {
+				*ep = d->bEndpointAddress;
+				rv = 0;
+				break;
+			}
+		}
+	}
+	libusb_free_config_descriptor(conf);
+	return rv;
+}
+
+static libusb_device_handle *open_device(libusb_context *ctx, uint16_t vid,
+					 uint16_t pid, int bus, int addr)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *dev = NULL;
+	libusb_device **list;
+	ssize_t i, n;
+
+	if (bus < 0)
+		return libusb_open_device_with_vid_pid(ctx, vid, pid);
+
+	n = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < n; i++) {
+		if (libusb_get_bus_number(list[i]) != bus ||
+		    libusb_get_device_address(list[i]) != addr ||
+		    libusb_get_device_descriptor(list[i], &desc) ||
+		    desc.idVendor != vid || desc.idProduct != pid)
+			continue;
+		if (libusb_open(list[i], &dev))
+			dev = NULL;
+		break;
+	}
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+	return dev;
+}
+
+static struct tc_capture *open_capture(libusb_context *ctx, uint16_t vid,
+				       uint16_t pid, int bus, int addr,
+				       int iface, int iso, int transfers,
+				       int size)
+{
+	struct tc_capture *c;
+	int i, maxp = 0;
+
+	/* keep the device packet boundaries inside the transfers */
+	if (transfers <= 0 || size <= 0 || size % TC_PACKET_SIZE)
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	crc_init();
+	c->iface = -1;
+	c->cmd_iface = -1;
+	c->count = transfers;
+	c->size = size;
+	c->last_seq = -1;
+
+	c->ctx = ctx;
+	if (!ctx) {
+		if (libusb_init(&c->ctx)) {
+			free(c);
+			return NULL;
+		}
+		c->own_ctx = 1;
+	}
+	c->dev = open_device(c->ctx, vid, pid, bus, addr);
+	if (!c->dev) {
+		fprintf(stderr, "no device %04x:%04x\n", vid, pid);
+		goto error;
+	}
+	if (find_endpoint(c->dev, iface, iso ? TC_ALT_ISO : 0,
+			  iso ? LIBUSB_TRANSFER_TYPE_ISOCHRONOUS :
+				LIBUSB_TRANSFER_TYPE_BULK, &c->ep)) {
+		fprintf(stderr, "no %s IN endpoint on interface %d\n",
+			iso ? "isochronous" : "bulk", iface);
+		goto error;
+	}
+	libusb_set_auto_detach_kernel_driver(c->dev, 1);
+	if (libusb_claim_interface(c->dev, iface)) {
+		fprintf(stderr, "cannot claim interface %d\n", iface);
+		goto error;
+	}
+	c->iface = iface;
+	if (iso) {
+		if (libusb_set_interface_alt_setting(c->dev, iface,
+						     TC_ALT_ISO)) {
+			fprintf(stderr, "cannot select the isochronous "
+				"endpoint\n");
+			goto error;
+		}
+		maxp = libusb_get_max_iso_packet_size(libusb_get_device(c->dev),
+						      c->ep);
+		if (maxp <= 0)
+			goto error;
+		c->iso_packets = size / maxp ? size / maxp : 1;
+	}
+
+	c->xfer = calloc(transfers, sizeof(*c->xfer));
+	if (!c->xfer)
+		goto error;
+	for (i = 0; i < transfers; i++) {
+		uint8_t *buf;
+
+		c->xfer[i] = libusb_alloc_transfer(c->iso_packets);
+		if (!c->xfer[i])
+			goto error;
+		buf = malloc(c->iso_packets ? c->iso_packets * maxp : size);
+		if (!buf)
+			goto error;
+		/* the buffer is released by libusb_free_transfer() */
+		c->xfer[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		if (!c->iso_packets) {
+			libusb_fill_bulk_transfer(c->xfer[i], c->dev, c->ep,
+						  buf, size, transfer_done, c,
+						  0);
+			continue;
+		}
+		libusb_fill_iso_transfer(c->xfer[i], c->dev, c->ep, buf,
+					 c->iso_packets * maxp,
+					 c->iso_packets, transfer_done, c, 0);
+		libusb_set_iso_packet_lengths(c->xfer[i], maxp);
+	}
+	return c;
+
+error:
+	tc_close(c);
+	return NULL;
+}
+
+struct tc_capture *tc_open(uint16_t vid, uint16_t pid, int bus, int addr,
+			   int iface, int iso, int transfers, int size)
+{
+	return open_capture(NULL, vid, pid, bus, addr, iface, iso, transfers,
+			    size);
+}
+
+struct tc_capture *tc_ctx_open(struct tc_ctx *x, uint16_t vid, uint16_t pid,
+			       int bus, int addr, int iface, int iso,
+			       int transfers, int size)
+{
+	return open_capture(x->ctx, vid, pid, bus, addr, iface, iso,
+			    transfers, size);
+}
+
+int tc_start(struct tc_capture *c, tc_data_cb cb, void *priv)
+{
+	int i;
+
+	memset(&c->stats, 0, sizeof(c->stats));
+	c->last_seq = -1;
+	c->cb = cb;
+	c->priv = priv;
+	c->running = 1;
+	for (i = 0; i < c->count; i++) {
+		if (libusb_submit_transfer(c->xfer[i])) {
+			tc_stop(c);
+			return -1;
+		}
+		c->pending++;
+	}
+	return 0;
+}
+
+int tc_poll(struct tc_capture *c, int timeout_ms)
+{
+	struct timeval tv = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_usec = (timeout_ms % 1000) * 1000,
+	};
+
+	if (!c->running) {
+		tc_stop(c);
+		return 0;
+	}
+	if (libusb_handle_events_timeout_completed(c->ctx, &tv, NULL))
+		return -1;
+	return c->running || c->pending;
+}
+
+void tc_stop(struct tc_capture *c)
+{
+	int i;
+
+	c->running = 0;
+	for (i = 0; i < c->count; i++)
+		if (c->xfer && c->xfer[i])
+			libusb_cancel_transfer(c->xfer[i]);
+	if (c->cmd_busy && c->cmd_xfer)
+		libusb_cancel_transfer(c->cmd_xfer);
+	/* wait for libusb to give the transfers back */
+	while (c->pending > 0 || c->cmd_busy)
+		if (libusb_handle_events(c->ctx))
+			break;
+}
+
+void tc_close(struct tc_capture *c)
+{
+	int i;
+
+	if (!c)
+		return;
+	if (c->xfer || c->cmd_xfer) {
+		tc_stop(c);
+		for (i = 0; i < c->count; i++) {
+			if (c->xfer[i])
+				libusb_free_transfer(c->xfer[i]);
+		}
+		free(c->xfer);
+	}
+	if (c->cmd_xfer)
+		libusb_free_transfer(c->cmd_xfer);
+	free(c->cmd_out);
+	if (c->cmd_iface >= 0)
+		libusb_release_interface(c->dev, c->cmd_iface);
+	/* give the reserved bandwidth back */
+	if (c->iface >= 0 && c->iso_packets)
+		libusb_set_interface_alt_setting(c->dev, c->iface, 0);
+	if (c->iface >= 0)
+		libusb_release_interface(c->dev, c->iface);
+	if (c->dev)
+		libusb_close(c->dev);
+	if (c->own_ctx)
+		libusb_exit(c->ctx);
+	free(c);
+}
+
+int tc_control(struct tc_capture *c, uint8_t request, uint16_t value)
+{
+	int rv = libusb_control_transfer(c->dev, LIBUSB_ENDPOINT_OUT |
+					 LIBUSB_REQUEST_TYPE_VENDOR |
+					 LIBUSB_RECIPIENT_INTERFACE,
+					 request, value, c->iface, NULL, 0,
+					 1000);
+
+	return rv < 0 ? -1 : 0;
+}
+
+const struct tc_stats *tc_get_stats(const struct tc_capture *c)
+{
+	return &c->stats;
+}
+
+int tc_running(const struct tc_capture *c)
+{
+	return c->running;
+}
+
+int tc_serial(struct tc_capture *c, char *buf, int len)
+{
+	struct libusb_device_descriptor desc;
+
+	if (libusb_get_device_descriptor(libusb_get_device(c->dev), &desc) ||
+	    !desc.iSerialNumber ||
+	    libusb_get_string_descriptor_ascii(c->dev, desc.iSerialNumber,
+					       (unsigned char *)buf, len) <= 0)
+		return -1;
+	return 0;
+}
+
+/* Interface of the bulk OUT endpoint 'ep', -1 if none */
+static int find_interface(libusb_device_handle *dev, uint8_t ep)
+{
+	struct libusb_config_descriptor *conf;
+	const struct libusb_interface_descriptor *alt;
+	int i, k, rv = -1;
+
+	if (libusb_get_active_config_descriptor(libusb_get_device(dev), &conf))
+		return -1;
+	for (i = 0; i < conf->bNumInterfaces && rv < 0; i++) {
+		alt = conf->interface[i].altsetting;
+		for (k = 0; k < alt->bNumEndpoints; k++)
+			if (alt->endpoint[k].bEndpointAddress == ep)
+				rv = alt->bInterfaceNumber;
+	}
+	libusb_free_config_descriptor(conf);
+	return rv;
+}
+
+static void cmd_finish(struct tc_capture *c, int len)
+{
+	c->cmd_busy = 0;
+	if (c->cmd_cb)
+		c->cmd_cb(c->cmd_priv, c->cmd_out, len);
+}
+
+static void LIBUSB_CALL cmd_done(struct libusb_transfer *xfer)
+{
+	struct tc_capture *c = xfer->user_data;
+	int room = TC_CMD_OUTPUT_MAX - c->cmd_len;
+
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		cmd_finish(c, -1);
+		return;
+	}
+	if (xfer->endpoint == TC_EP_COMMAND) {
+		/* commands sent : read their output */
+		c->cmd_len = 0;
+	} else {
+		c->cmd_len += xfer->actual_length;
+		room -= xfer->actual_length;
+		/* a short packet ends the output */
+		if (xfer->actual_length < xfer->length || !room) {
+			cmd_finish(c, c->cmd_len);
+			return;
+		}
+	}
+	libusb_fill_bulk_transfer(xfer, c->dev,
+				  LIBUSB_ENDPOINT_IN | TC_EP_COMMAND,
+				  c->cmd_out + c->cmd_len,
+				  MIN(room, TC_TRANSFER_SIZE), cmd_done, c,
+				  1000);
+	if (libusb_submit_transfer(xfer))
+		cmd_finish(c, -1);
+}
+
+int tc_command(struct tc_capture *c, const uint8_t *cmd, int len,
+	       tc_cmd_cb cb, void *priv)
+{
+	int iface;
+
+	if (c->cmd_busy || len <= 0 || len > TC_CMD_SIZE)
+		return -1;
+	if (c->cmd_iface < 0) {
+		iface = find_interface(c->dev, TC_EP_COMMAND);
+		if (iface < 0 || libusb_claim_interface(c->dev, iface))
+			return -1;
+		c->cmd_iface = iface;
+	}
+	if (!c->cmd_xfer)
+		c->cmd_xfer = libusb_alloc_transfer(0);
+	if (!c->cmd_out)
+		c->cmd_out = malloc(TC_CMD_OUTPUT_MAX);
+	if (!c->cmd_xfer || !c->cmd_out)
+		return -1;
+	/* the output buffer holds the request until it is sent */
+	memcpy(c->cmd_out, cmd, len);
+	libusb_fill_bulk_transfer(c->cmd_xfer, c->dev, TC_EP_COMMAND,
+				  c->cmd_out, len, cmd_done, c, 1000);
+	if (libusb_submit_transfer(c->cmd_xfer))
+		return -1;
+	c->cmd_cb = cb;
+	c->cmd_priv = priv;
+	c->cmd_busy = 1;
+	return 0;
+}
+
+struct tc_ctx *tc_ctx_new(void)
+{
+	struct tc_ctx *x = calloc(1, sizeof(*x));
+
+	if (!x)
+		return NULL;
+	if (libusb_init(&x->ctx)) {
+		free(x);
+		return NULL;
+	}
+	return x;
+}
+
+void tc_ctx_free(struct tc_ctx *x)
+{
+	if (!x)
+		return;
+	if (x->hotplug)
+		libusb_hotplug_deregister_callback(x->ctx, x->handle);
+	libusb_exit(x->ctx);
+	free(x);
+}
+
+/* Queue a device event, handed over by tc_ctx_poll() */
+static void ctx_event(struct tc_ctx *x, int bus, int addr, int arrived)
+{
+	if (x->count == CTX_EVENTS) {
+		fprintf(stderr, "hotplug event of %d:%d lost\n", bus, addr);
+		return;
+	}
+	x->events[x->count].bus = bus;
+	x->events[x->count].addr = addr;
+	x->events[x->count].arrived = arrived;
+	x->count++;
+}
+
+/*
+ * Called from the event handling of libusb, where the devices cannot be
+ * opened yet : the event is only queued.
+ */
+static int LIBUSB_CALL hotplug_done(libusb_context *ctx,
+				    libusb_device *dev,
+				    libusb_hotplug_event event, void *priv)
+{
+	ctx_event(priv, libusb_get_bus_number(dev),
+		  libusb_get_device_address(dev),
+		  event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	return 0;
+}
+
+/* Compare the matching devices to those of the last scan */
+static void ctx_rescan(struct tc_ctx *x)
+{
+	struct libusb_device_descriptor desc;
+	uint16_t now[CTX_DEVICES];
+	libusb_device **list;
+	ssize_t i, n;
+	int count = 0, k;
+
+	n = libusb_get_device_list(x->ctx, &list);
+	if (n < 0)
+		return;
+	for (i = 0; i < n && count < CTX_DEVICES; i++)
+		if (!libusb_get_device_descriptor(list[i], &desc) &&
+		    desc.idVendor == x->vid && desc.idProduct == x->pid)
+			now[count++] = libusb_get_bus_number(list[i]) << 8 |
+				       libusb_get_device_address(list[i]);
+	libusb_free_device_list(list, 1);
+
+	for (i = 0; i < x->seen_count; i++) {
+		for (k = 0; k < count && now[k] != x->seen[i]; k++)
+			;
+		if (k == count)
+			ctx_event(x, x->seen[i] >> 8, x->seen[i] & 0xff, 0);
+	}
+	for (k = 0; k < count; k++) {
+		for (i = 0; i < x->seen_count && x->seen[i] != now[k]; i++)
+			;
+		if (i == x->seen_count)
+			ctx_event(x, now[k] >> 8, now[k] & 0xff, 1);
+	}
+	memcpy(x->seen, now, count * sizeof(now[0]));
+	x->seen_count = count;
+}
+
+int tc_ctx_hotplug(struct tc_ctx *x, uint16_t vid, uint16_t pid,
+		   tc_hotplug_cb cb, void *priv)
+{
+	x->vid = vid;
+	x->pid = pid;
+	x->cb = cb;
+	x->priv = priv;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		/* rescanned by tc_ctx_poll() */
+		ctx_rescan(x);
+		x->last_scan = time(NULL);
+		return 0;
+	}
+	if (libusb_hotplug_register_callback(x->ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_ENUMERATE, vid, pid,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_done, x,
+			&x->handle))
+		return -1;
+	x->hotplug = 1;
+	return 0;
+}
+
+int tc_ctx_poll(struct tc_ctx *x, int timeout_ms)
+{
+	struct timeval tv = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_usec = (timeout_ms % 1000) * 1000,
+	};
+	int i, count;
+
+	if (libusb_handle_events_timeout_completed(x->ctx, &tv, NULL))
+		return -1;
+	if (x->cb && !x->hotplug && time(NULL) - x->last_scan >= CTX_RESCAN) {
+		ctx_rescan(x);
+		x->last_scan = time(NULL);
+	}
+	/* the callbacks may handle events again, and queue new ones */
+	count = x->count;
+	for (i = 0; i < count; i++)
+		x->cb(x->priv, x->events[i].bus, x->events[i].addr,
+		      x->events[i].arrived);
+	memmove(x->events, x->events + count,
+		(x->count - count) * sizeof(x->events[0]));
+	x->count -= count;
+	return 0;
+}
@@ -0,0 +1,323 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Host capture of the twinkie sniffer stream.
+ *
+ * A pool of libusb asynchronous bulk transfers is kept queued on the sniffer
+ * IN endpoint, so the host always has a request pending when the device
+ * arms its next packet. Every completed transfer is handed as is to the
+ * data callback (no copy), parsed for the statistics, then resubmitted.
+ */
+
+#ifndef __TWINKIE_CAPTURE_H
+#define __TWINKIE_CAPTURE_H
+
+#include <stdint.h>
+
+/* Default USB IDs and sniffer interface of the twinkie */
+#define TC_VID 0x18d1
+#define TC_PID 0x500a
+#define TC_IFACE_SNIFFER 1
+/*
+ * Bulk endpoints of the commands interface (USB_EP_COMMAND), its interface
+ * number depends on the image running
+ */
+#define TC_EP_COMMAND 2
+/* Commands of a request, up to one USB packet, and their whole output */
+#define TC_CMD_SIZE 64
+#define TC_CMD_OUTPUT_MAX (64 * 1024)
+/*
+ * Alternate setting of the sniffer interface with an isochronous endpoint :
+ * the same packets, several per isochronous packet, in reserved bandwidth.
+ */
+#define TC_ALT_ISO 1
+
+/*
+ * Default transfer queue : 32 transfers of 63 full-speed packets, a whole
+ * number of zero-copy device packets (3 full-speed packets each)
+ */
+#define TC_TRANSFERS 32
+#define TC_TRANSFER_SIZE (63 * 64)
+
+/* Device stream format, see board/twinkie/sniffer.c */
+#define TC_PACKET_SIZE 64
+#define TC_HEADER_SIZE 16
+#define TC_SNIFFER_MAGIC 0xD5
+#define TC_FLAG_OFLOW  0x8000
+#define TC_FLAG_PACKED 0x4000
+#define TC_FLAG_IDLE   0x2000
+#define TC_FLAG_CC2    0x1000
+#define TC_FLAG_TRIGGER 0x0800 /* sent in the trigger post window */
+/* zero-copy samples : TC_PAD_SIZE bytes of padding before them */
+#define TC_FLAG_PAD    0x0100
+#define TC_PAD_SIZE    48
+/* Longest device packet : the zero-copy ones span several USB packets */
+#define TC_PACKET_MAX  (TC_HEADER_SIZE + 255)
+#define TC_FLAG_RECORD (TC_FLAG_PACKED | TC_FLAG_IDLE)
+/* RX timer resolution of the raw samples, TC_RES_x */
+#define TC_FLAG_RES(flags) (((flags) >> 9) & 3)
+#define TC_RES_NORMAL  0 /* 2.4 MHz counter, 8-bit samples */
+#define TC_RES_FINE    1 /* 48 MHz counter, 16-bit samples */
+#define TC_RES_COARSE  2 /* 1.2 MHz counter, 8-bit samples */
+#define TC_REC_PACKET  2
+#define TC_REC_SYNC    3
+#define TC_REC_PULSE   4
+#define TC_REC_POWER   5
+#define TC_REC_CC      6
+/* QoS record : 16-bit stream level (TC_QOS_x), 16-bit half-buffers dropped */
+#define TC_REC_QOS     7
+#define TC_REC_EVENT   8
+/* Comparator record : 16-bit CC1 then CC2 hysteresis and mode settings */
+#define TC_REC_COMP    9
+/* Clock record : 16-bit HSI48 trim, 16-bit signed frequency error in ppm */
+#define TC_REC_CLOCK   10
+/* Trigger input record : 16-bit pin level, 16-bit edge time in 1/48 us */
+#define TC_REC_INPUT   11
+/*
+ * Health record, every second : 16-bit CPU idle %, CC1 and CC2 overflows,
+ * free USB buffers, highest USB buffers and DMA half-buffers waiting,
+ * decoding errors, then the modes (SNIFFER_HEALTH_x in the device sources)
+ */
+#define TC_REC_HEALTH  12
+/*
+ * Suspend record, after a host suspend : 32-bit time suspended in ms, 16-bit
+ * flight recorder records held and overwritten, 16-bit wake-up reason
+ */
+#define TC_REC_SUSPEND 13
+/*
+ * Power transition record, after each contract change or hard reset : the
+ * struct power_transition of the device sources, 32-bit Accept time before
+ * the header timestamp then 16-bit flags, voltages and times in 100 us
+ */
+#define TC_REC_TRANSITION 14
+/*
+ * Bookmark record : 32-bit tag then 16-bit sequence number of the host
+ * request (INJ_BIN_BOOKMARK), the header timestamp is its reception
+ */
+#define TC_REC_BOOKMARK 15
+#define TC_QOS_SAMPLES 0
+/* Role of a device on the SYNC pin, in the pulse records */
+#define TC_PULSE_MASTER 1
+#define TC_PULSE_SLAVE  2
+/* Not a pulse role : the pin is a trigger input (TC_REC_INPUT records) */
+#define TC_PULSE_INPUT  3
+/* The slaves get the master pulse numbers modulo TC_PULSE_CODES */
+#define TC_PULSE_CODES 32
+/* Sniffer interface vendor request setting the SYNC pin role */
+#define TC_REQ_SET_PULSE 0x05
+/* Trace records : tag in the bits 31:16 of the second word */
+#define TC_TRACE_FIRST 0xfada
+#define TC_TRACE_NEXT  0xfadb
+/* Frame sent by the device injector, bits 15:0 : its time on the line in us */
+#define TC_TRACE_TX    0xfadc
+/*
+ * Protocol violation found by the device checker, bits 15:0 : its kind
+ * (CHECK_x in board/twinkie/injector.h), then the message and a 32-bit value
+ */
+#define TC_TRACE_VIOL  0xfadd
+/*
+ * Repeats of a message coalesced by the device tracer : the message, then
+ * their 32-bit count, the timestamp being the last repeat
+ */
+#define TC_TRACE_REPEAT 0xfade
+/*
+ * Edges of a packet which failed to decode, after its record : bits 15:14
+ * format (1 : 8-bit RX timer values, 2 : 4-bit intervals), bits 13:8 record
+ * number, bits 7:0 edges in the payload, the bits 31:16 of the last word
+ * being the index of the first one in the capture
+ */
+#define TC_TRACE_ERRWIN 0xfadf
+#define TC_TRACE_SIZE  44
+/*
+ * Received packets are timestamped at their first preamble edge, the bits
+ * 31:16 of the last word hold their EOP in 1/16 us after it (0 : unknown).
+ */
+#define TC_TRACE_EOP   42
+/*
+ * Packed trace records ('sniffer trace packed') : TC_TRACE_PACKED is set in
+ * their tag, the last word follows the RX header with the number of payload
+ * words in its bits 15:12, then only these words. A packet holds as many
+ * whole records as fit.
+ */
+#define TC_TRACE_PACKED 0x0100
+#define TC_TRACE_PACKED_HDR 16
+
+enum tc_kind {
+	TC_UNKNOWN = 0, /* lost the packet boundaries */
+	TC_SNIFFER,     /* sniffer packet with a v4 header */
+	TC_TRACE,       /* trace record */
+};
+
+static inline uint16_t tc_get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t tc_get32(const uint8_t *p)
+{
+	return tc_get16(p) | ((uint32_t)tc_get16(p + 2) << 16);
+}
+
+/* Tag of a trace record, packed or not */
+static inline uint16_t tc_trace_tag(const uint8_t *rec)
+{
+	return tc_get16(rec + 6) & ~TC_TRACE_PACKED;
+}
+
+/*
+ * Kind of the device packet at the start of the 'len' bytes of 'data',
+ * its size is stored in 'size'.
+ */
+enum tc_kind tc_packet(const uint8_t *data, int len, int *size);
+
+/* 40-bit device timestamp in us of a packet of the kind 'kind' */
+static inline uint64_t tc_packet_time(const uint8_t *pkt, enum tc_kind kind)
+{
+	if (kind == TC_TRACE && (tc_get16(pkt + 6) & TC_TRACE_PACKED))
+		return tc_get32(pkt) | (uint64_t)pkt[12] << 32;
+	if (kind == TC_TRACE)
+		return tc_get32(pkt) | (uint64_t)pkt[40] << 32;
+	return tc_get32(pkt + 8) | (uint64_t)pkt[7] << 32;
+}
+
+/*
+ * Copy the trace record 'rec' to 'out' (TC_TRACE_SIZE bytes) in the full
+ * layout, the payload words trimmed from a packed one being zeros.
+ */
+void tc_trace_unpack(const uint8_t *rec, uint8_t *out);
+
+struct tc_stats {
+	uint64_t bytes;          /* bytes received */
+	uint64_t transfers;      /* completed transfers with data */
+	uint64_t empty;          /* zero-length transfers (idle device) */
+	uint64_t packets;        /* sniffer packets */
+	uint64_t records;        /* trace records */
+	uint64_t seq_gaps;       /* discontinuities of the packet sequence */
+	uint64_t seq_lost;       /* packets missing from the sequence */
+	uint64_t oflow;          /* packets flagged with a device overflow */
+	uint64_t crc_errors;     /* packets with a bad CRC-32 */
+	uint64_t trace_dropped;  /* trace records dropped by the device */
+	uint64_t violations;     /* protocol violations found by the device */
+	uint64_t repeats;        /* repeated messages coalesced by the device */
+	uint64_t degraded;       /* QoS step downs of the device stream */
+	uint64_t inputs;         /* trigger input edges */
+	uint64_t health;         /* health records */
+	uint64_t suspends;       /* host suspends seen by the device */
+	uint64_t susp_lost;      /* flight records overwritten meanwhile */
+	int cpu_idle;            /* last device CPU idle time in % */
+	int usb_free;            /* last free device USB buffers */
+	uint64_t dev_oflow[2];   /* CC1 and CC2 overflows in health records */
+	int clock_ppm;           /* last device clock error, in ppm */
+	int clock_ppm_max;       /* largest one in absolute value */
+	uint64_t unknown;        /* unparsable data */
+	uint64_t errors;         /* failed transfers */
+	uint64_t iso_lost;       /* isochronous packets lost on the bus */
+};
+
+/*
+ * Data callback : called from tc_poll() with the content of each completed
+ * transfer, or of each isochronous packet, a whole number of device packets. 'data' is only valid during
+ * the call. A non-zero return value stops the capture.
+ */
+typedef int (*tc_data_cb)(void *priv, const uint8_t *data, int len);
+
+struct tc_capture;
+
+/*
+ * Open the first device matching 'vid':'pid' and claim the interface
+ * 'iface', with a queue of 'transfers' transfers of 'size' bytes.
+ * If 'bus' is not negative, only the device at the USB address 'bus':'addr'
+ * matches. If 'iso' is set, the interface is switched to its alternate
+ * setting TC_ALT_ISO and the transfers are isochronous ones, of as many
+ * packets as fit in 'size'. Returns NULL on error.
+ */
+struct tc_capture *tc_open(uint16_t vid, uint16_t pid, int bus, int addr,
+			   int iface, int iso, int transfers, int size);
+
+/* Vendor OUT request without data to the interface, returns 0 on success */
+int tc_control(struct tc_capture *c, uint8_t request, uint16_t value);
+
+/* Submit all the transfers, returns 0 on success */
+int tc_start(struct tc_capture *c, tc_data_cb cb, void *priv);
+
+/*
+ * Handle the completed transfers for up to 'timeout_ms' milliseconds.
+ * Returns 1 while the capture is running, 0 once stopped, < 0 on error.
+ */
+int tc_poll(struct tc_capture *c, int timeout_ms);
+
+/* Request the capture to stop, the pending transfers are cancelled */
+void tc_stop(struct tc_capture *c);
+
+/* Cancel the transfers, release the interface and close the device */
+void tc_close(struct tc_capture *c);
+
+/*
+ * Command callback : 'out' holds the 'len' bytes of output of the commands,
+ * 'len' is negative if the request failed.
+ */
+typedef void (*tc_cmd_cb)(void *priv, const uint8_t *out, int len);
+
+/*
+ * Send the newline separated console commands 'cmd' (up to TC_CMD_SIZE
+ * bytes) on the commands interface, claimed on the first call. The
+ * transfers complete in tc_poll() like the capture ones, then 'cb' gets the
+ * output. A single request at a time : returns -1 if one is in progress
+ * or on error, else 0.
+ */
+int tc_command(struct tc_capture *c, const uint8_t *cmd, int len,
+	       tc_cmd_cb cb, void *priv);
+
+/* Statistics since tc_start() */
+const struct tc_stats *tc_get_stats(const struct tc_capture *c);
+
+/* Is the capture still running (not stopped by an error or the callback) ? */
+int tc_running(const struct tc_capture *c);
+
+/*
+ * USB serial number of the device (board_read_serial() of the firmware),
+ * into the 'len' bytes of 'buf'. Returns 0 on success.
+ */
+int tc_serial(struct tc_capture *c, char *buf, int len);
+
+/*
+ * USB context shared by several captures : the transfers of all of them
+ * complete in a single event loop, tc_ctx_poll(), instead of one per
+ * capture. tc_open() gives each capture a context of its own.
+ */
+struct tc_ctx;
+
+struct tc_ctx *tc_ctx_new(void);
+
+/* Release the context, once all its captures are closed */
+void tc_ctx_free(struct tc_ctx *x);
+
+/* tc_open() in the shared context 'x' */
+struct tc_capture *tc_ctx_open(struct tc_ctx *x, uint16_t vid, uint16_t pid,
+			       int bus, int addr, int iface, int iso,
+			       int transfers, int size);
+
+/* Hotplug callback : the device 'bus':'addr' arrived or left */
+typedef void (*tc_hotplug_cb)(void *priv, int bus, int addr, int arrived);
+
+/*
+ * Call 'cb' from tc_ctx_poll() for the devices 'vid':'pid' attached, then
+ * each time one arrives or leaves. Without hotplug support on the host, the
+ * devices are scanned again every second. Returns 0 on success.
+ */
+int tc_ctx_hotplug(struct tc_ctx *x, uint16_t vid, uint16_t pid,
+		   tc_hotplug_cb cb, void *priv);
+
+/*
+ * Handle the completed transfers of all the captures of 'x' for up to
+ * 'timeout_ms' milliseconds, then the hotplug events. Returns 0 or -1 on
+ * error.
+ */
+int tc_ctx_poll(struct tc_ctx *x, int timeout_ms);
+
+/* Update 'stats' with the device packets of 'data' */
+void tc_parse(struct tc_stats *stats, int *last_seq, const uint8_t *data,
+	      int len);
+
+#endif /* __TWINKIE_CAPTURE_H */
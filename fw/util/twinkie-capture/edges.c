@@ -0,0 +1,1117 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#if defined(__GNUC__)
+/* built for the target at run time if the CPU has it */
+#define EDGES_AVX2
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define EDGES_NEON
+#endif
+
+#include "capture.h"
+#include "edges.h"
+
+/* RX timer ticks of a half bit period, by TC_RES_x */
+static const int res_ticks[] = {
+	[TC_RES_NORMAL] = 4,
+	[TC_RES_COARSE] = 2,
+};
+
+/* Largest packet in bits : ordered set, header, data objects, CRC, EOP */
+#define PKT_BITS (20 + 20 + 7 * 40 + 40 + 5)
+/* and in intervals, some of them captured twice */
+#define PKT_SPAN (3 * PKT_BITS)
+/* Preamble intervals matched and used to measure the bit period */
+#define PREAMBLE_INTERVALS 32
+#define PREAMBLE_HALF_PERIODS 44
+/* Intervals from the first edge of a preamble to its end */
+#define PREAMBLE_SPAN 96
+/* Samples held by a line : a batch, the packet carried over, a packet */
+#define LINE_CAP (TC_EDGES_BATCH + PKT_SPAN + PREAMBLE_SPAN + TC_PACKET_MAX)
+/* Room around the samples : the kernels read one before and a word after */
+#define LINE_PAD 64
+#define MAP_WORDS(n) ((n) / 64 + 2)
+
+/*
+ * Patterns of the 32 intervals up to the end of a preamble, or of a reset
+ * ordered set : 1 where the interval is not longer than 1.5 half periods,
+ * the first interval in the LSB (pd_decode_preamble()).
+ */
+#define PAT_PREAMBLE    0x36db6db6
+#define PAT_HARD_RESET  0xF33F3F3F
+#define PAT_CABLE_RESET 0x3c7fe0ff
+
+/* K-codes and ordered sets, the first symbol in the LSBs */
+#define SYNC1 0x18
+#define SYNC2 0x11
+#define SYNC3 0x06
+#define RST1  0x07
+#define RST2  0x19
+#define EOP   0x0D
+#define OSET(a, b, c, d) ((a) | ((b) << 5) | ((c) << 10) | ((d) << 15))
+
+static const struct {
+	uint32_t set;
+	int type;
+} ordered_sets[] = {
+	{OSET(SYNC1, SYNC1, SYNC1, SYNC2), 0},
+	{OSET(SYNC1, SYNC1, SYNC3, SYNC3), 1},
+	{OSET(SYNC1, SYNC3, SYNC1, SYNC3), 2},
+	{OSET(SYNC1, RST2, RST2, SYNC3), 3},
+	{OSET(SYNC1, RST2, SYNC3, SYNC2), 4},
+	{OSET(RST1, RST1, RST1, RST2), TC_EDGES_HARD_RESET},
+	{OSET(RST1, SYNC1, RST1, SYNC3), TC_EDGES_CABLE_RESET},
+};
+
+/* 4b5b decoding, 0x10 for the K-codes and the invalid codes */
+static const uint8_t dec5[32] = {
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x01, 0x04, 0x05, 0x10, 0x10, 0x06, 0x07,
+	0x10, 0x10, 0x08, 0x09, 0x02, 0x03, 0x0A, 0x0B,
+	0x10, 0x10, 0x0C, 0x0D, 0x0E, 0x0F, 0x00, 0x10,
+};
+
+/* 2 symbols to a byte, DEC10_INVALID if one of them is not data */
+#define DEC10_INVALID 0x100
+static uint16_t dec10[1024];
+
+/*
+ * Bits of 8 intervals at once, indexed by the long ones of the next 9
+ * intervals when none of them is zero or too long : a long interval is a
+ * '0', 2 short ones a '1', a short one followed by a long one is invalid.
+ */
+static struct step {
+	uint8_t bits;  /* the first one in the LSB */
+	uint8_t nbits;
+	uint8_t used;  /* intervals consumed, up to 9 */
+	uint8_t bad;
+} steps[512];
+
+/*
+ * Classification kernel : set the bit i of 'z', 'sh' and 'lg' when the
+ * interval s[i] - s[i - 1] is zero, short (up to 'smax') or long (up to
+ * 'lmax'), for i below 'n', a multiple of 64.
+ */
+typedef void (*classify_fn)(const uint8_t *s, int n, int smax, int lmax,
+			    uint64_t *z, uint64_t *sh, uint64_t *lg);
+
+static void classify_scalar(const uint8_t *s, int n, int smax, int lmax,
+			    uint64_t *z, uint64_t *sh, uint64_t *lg)
+{
+	uint64_t zw, sw, lw;
+	uint8_t d;
+	int w, i;
+
+	for (w = 0; w < n / 64; w++, s += 64) {
+		zw = sw = lw = 0;
+		for (i = 0; i < 64; i++) {
+			d = s[i] - s[i - 1];
+			zw |= (uint64_t)(d == 0) << i;
+			sw |= (uint64_t)(d && d <= smax) << i;
+			lw |= (uint64_t)(d > smax && d <= lmax) << i;
+		}
+		z[w] = zw;
+		sh[w] = sw;
+		lg[w] = lw;
+	}
+}
+
+#ifdef __SSE2__
+static void classify_sse2(const uint8_t *s, int n, int smax, int lmax,
+			  uint64_t *z, uint64_t *sh, uint64_t *lg)
+{
+	const __m128i vs = _mm_set1_epi8(smax);
+	const __m128i vl = _mm_set1_epi8(lmax);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i d, isz, les, lel;
+	uint64_t zw, sw, lw;
+	int w, i;
+
+	for (w = 0; w < n / 64; w++, s += 64) {
+		zw = sw = lw = 0;
+		for (i = 0; i < 64; i += 16) {
+			d = _mm_sub_epi8(
+				_mm_loadu_si128((const __m128i *)(s + i)),
+				_mm_loadu_si128((const __m128i *)(s + i - 1)));
+			/* unsigned d <= k : min(d, k) == d */
+			isz = _mm_cmpeq_epi8(d, zero);
+			les = _mm_cmpeq_epi8(_mm_min_epu8(d, vs), d);
+			lel = _mm_cmpeq_epi8(_mm_min_epu8(d, vl), d);
+			zw |= (uint64_t)(uint16_t)_mm_movemask_epi8(isz) << i;
+			sw |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+				_mm_andnot_si128(isz, les)) << i;
+			lw |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+				_mm_andnot_si128(les, lel)) << i;
+		}
+		z[w] = zw;
+		sh[w] = sw;
+		lg[w] = lw;
+	}
+}
+#endif
+
+#ifdef EDGES_AVX2
+__attribute__((target("avx2")))
+static void classify_avx2(const uint8_t *s, int n, int smax, int lmax,
+			  uint64_t *z, uint64_t *sh, uint64_t *lg)
+{
+	const __m256i vs = _mm256_set1_epi8(smax);
+	const __m256i vl = _mm256_set1_epi8(lmax);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i d, isz, les, lel;
+	uint64_t zw, sw, lw;
+	int w, i;
+
+	for (w = 0; w < n / 64; w++, s += 64) {
+		zw = sw = lw = 0;
+		for (i = 0; i < 64; i += 32) {
+			d = _mm256_sub_epi8(
+				_mm256_loadu_si256((const __m256i *)(s + i)),
+				_mm256_loadu_si256(
+					(const __m256i *)(s + i - 1)));
+			isz = _mm256_cmpeq_epi8(d, zero);
+			les = _mm256_cmpeq_epi8(_mm256_min_epu8(d, vs), d);
+			lel = _mm256_cmpeq_epi8(_mm256_min_epu8(d, vl), d);
+			zw |= (uint64_t)(uint32_t)_mm256_movemask_epi8(isz)
+			      << i;
+			sw |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+				_mm256_andnot_si256(isz, les)) << i;
+			lw |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+				_mm256_andnot_si256(les, lel)) << i;
+		}
+		z[w] = zw;
+		sh[w] = sw;
+		lg[w] = lw;
+	}
+}
+
+static int avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef EDGES_NEON
+/* Bit i set when the byte i is, as _mm_movemask_epi8() */
+static inline uint16_t neon_mask(uint8x16_t v)
+{
+	static const uint8_t weight[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+	};
+	uint8x16_t m = vandq_u8(v, vld1q_u8(weight));
+	uint8x8_t x = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+
+	x = vpadd_u8(x, x);
+	x = vpadd_u8(x, x);
+	return vget_lane_u16(vreinterpret_u16_u8(x), 0);
+}
+
+static void classify_neon(const uint8_t *s, int n, int smax, int lmax,
+			  uint64_t *z, uint64_t *sh, uint64_t *lg)
+{
+	const uint8x16_t vs = vdupq_n_u8(smax);
+	const uint8x16_t vl = vdupq_n_u8(lmax);
+	uint8x16_t d, isz, les, lel;
+	uint64_t zw, sw, lw;
+	int w, i;
+
+	for (w = 0; w < n / 64; w++, s += 64) {
+		zw = sw = lw = 0;
+		for (i = 0; i < 64; i += 16) {
+			d = vsubq_u8(vld1q_u8(s + i), vld1q_u8(s + i - 1));
+			isz = vceqq_u8(d, vdupq_n_u8(0));
+			les = vcleq_u8(d, vs);
+			lel = vcleq_u8(d, vl);
+			zw |= (uint64_t)neon_mask(isz) << i;
+			sw |= (uint64_t)neon_mask(vbicq_u8(les, isz)) << i;
+			lw |= (uint64_t)neon_mask(vbicq_u8(lel, les)) << i;
+		}
+		z[w] = zw;
+		sh[w] = sw;
+		lg[w] = lw;
+	}
+}
+#endif
+
+/* The kernels, best first */
+static const struct kernel {
+	const char *name;
+	classify_fn classify;
+	int (*supported)(void);
+} kernels[] = {
+#ifdef EDGES_AVX2
+	{"avx2", classify_avx2, avx2_supported},
+#endif
+#ifdef __SSE2__
+	{"sse2", classify_sse2, NULL},
+#endif
+#ifdef EDGES_NEON
+	{"neon", classify_neon, NULL},
+#endif
+	{"scalar", classify_scalar, NULL},
+};
+
+static const struct kernel *kernel;
+
+/* CRC-32 of the USB-PD messages, as zlib */
+static uint32_t crc_table[256];
+
+/* Not thread safe : called before any decoder thread starts */
+static void tables_init(void)
+{
+	uint32_t crc;
+	int i, m, nb, bits;
+
+	if (kernel)
+		return;
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+		if (!kernels[i].supported || kernels[i].supported())
+			break;
+	kernel = kernels + i;
+
+	for (i = 0; i < 1024; i++)
+		dec10[i] = (dec5[i & 0x1f] & 0xf) |
+			   ((dec5[i >> 5] & 0xf) << 4) |
+			   ((dec5[i & 0x1f] | dec5[i >> 5]) & 0x10 ?
+			    DEC10_INVALID : 0);
+	for (m = 0; m < 512; m++) {
+		struct step *t = steps + m;
+
+		for (i = nb = bits = 0; i < 8; nb++) {
+			if (m & (1 << i)) {
+				i++;
+			} else if (m & (2 << i)) {
+				t->bad = 1;
+				break;
+			} else {
+				bits |= 1 << nb;
+				i += 2;
+			}
+		}
+		t->bits = bits;
+		t->nbits = nb;
+		t->used = i;
+	}
+	for (i = 0; i < 256; i++) {
+		for (crc = i, m = 0; m < 8; m++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		crc_table[i] = crc;
+	}
+}
+
+const char *tc_edges_kernel(void)
+{
+	tables_init();
+	return kernel->name;
+}
+
+int tc_edges_set_kernel(const char *name)
+{
+	int i;
+
+	tables_init();
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+		if (!strcmp(kernels[i].name, name) &&
+		    (!kernels[i].supported || kernels[i].supported())) {
+			kernel = kernels + i;
+			return 0;
+		}
+	return -1;
+}
+
+/* Samples of one CC line */
+struct line {
+	uint8_t *buf;
+	uint8_t *s;       /* s[0] is the sample before the first interval */
+	int n;            /* samples held */
+	int res;          /* their TC_RES_x, -1 if none */
+	int from;         /* first interval not searched for a pattern yet */
+	/* stream packets : first sample and timestamp */
+	struct mark {
+		int idx;
+		uint64_t ts;
+	} *marks;
+	int nmarks;
+	/* interval classes at the nominal period, then of a packet */
+	uint64_t *z, *sh, *lg;
+	uint64_t *pz, *psh, *plg;
+};
+
+struct tc_edges {
+	tc_msg_cb cb;
+	void *priv;
+	int last_seq;
+	struct line line[2];
+	struct tc_edges_stats stats;
+};
+
+/* Interval classes of bit 0 at the interval 'base' */
+struct view {
+	const uint64_t *z, *sh, *lg;
+	int base;
+	int end;   /* intervals classified */
+};
+
+/* 64 bits of 'map' from the bit 'i' */
+static inline uint64_t bits_at(const uint64_t *map, int i)
+{
+	int w = i >> 6, b = i & 63;
+
+	return b ? (map[w] >> b) | (map[w + 1] << (64 - b)) : map[w];
+}
+
+struct reader {
+	const struct view *v;
+	int pos;        /* next interval */
+	uint64_t acc;   /* bits decoded but not read yet */
+	int acclen;
+};
+
+/*
+ * Read 'len' bits (up to 32), the first one in the LSB, as
+ * pd_decode_bits(). Returns 0, -1 on an invalid interval or 1 if the
+ * intervals end first.
+ */
+static int read_bits(struct reader *r, int len, uint32_t *val)
+{
+	const struct view *v = r->v;
+	const struct step *t;
+	uint32_t zc, sc, lc;
+	int i;
+
+	while (r->acclen < len) {
+		if (r->pos >= v->end)
+			return 1;
+		i = r->pos - v->base;
+		zc = bits_at(v->z, i);
+		sc = bits_at(v->sh, i);
+		lc = bits_at(v->lg, i);
+		if (r->pos + 9 <= v->end && ((sc | lc) & 0x1ff) == 0x1ff) {
+			t = steps + (lc & 0x1ff);
+			if (!t->bad) {
+				r->acc |= (uint64_t)t->bits << r->acclen;
+				r->acclen += t->nbits;
+				r->pos += t->used;
+				continue;
+			}
+		}
+		/* a single bit, as bmc_step[] */
+		if (lc & 1) {
+			r->pos++;
+		} else if (r->pos + 1 >= v->end) {
+			return 1;
+		} else if ((sc & 1) && ((sc | zc) & 2)) {
+			r->acc |= 1ULL << r->acclen;
+			r->pos += 2;
+		} else {
+			return -1;
+		}
+		r->acclen++;
+	}
+	*val = r->acc & ((1ULL << len) - 1);
+	r->acc >>= len;
+	r->acclen -= len;
+	return 0;
+}
+
+/* 4 symbols to 16 bits, -1 on a K-code or an invalid symbol */
+static int read_short(struct reader *r, uint16_t *val)
+{
+	uint32_t w;
+	uint16_t lo, hi;
+	int rv = read_bits(r, 20, &w);
+
+	if (rv)
+		return rv;
+	lo = dec10[w & 0x3ff];
+	hi = dec10[w >> 10];
+	*val = (lo & 0xff) | ((hi & 0xff) << 8);
+	return (lo | hi) & DEC10_INVALID ? -1 : 0;
+}
+
+/* As pd_decode_ordered_set() */
+static int ordered_set(uint32_t val)
+{
+	int type = -1, i, k, match;
+	uint32_t diff;
+
+	for (i = 0; i < sizeof(ordered_sets) / sizeof(ordered_sets[0]); i++) {
+		diff = val ^ ordered_sets[i].set;
+		if (!diff)
+			return ordered_sets[i].type;
+		for (match = 0, k = 0; k < 20; k += 5)
+			match += !((diff >> k) & 0x1f);
+		if (match < 3)
+			continue;
+		/* a corrupted K-code could belong to 2 ordered sets */
+		if (type >= 0)
+			return -1;
+		type = ordered_sets[i].type;
+	}
+	return type;
+}
+
+static uint32_t crc32_bytes(const uint8_t *p, int len)
+{
+	uint32_t crc;
+
+	for (crc = 0xffffffff; len; len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+/*
+ * Decode the packet whose ordered set starts at the interval 'start'.
+ * Returns 1 if the intervals end first, else 0 with 'msg' filled and 'end'
+ * set past the packet.
+ */
+static int decode_packet(const struct view *v, int start,
+			 struct tc_pd_msg *msg, int *end)
+{
+	struct reader r = { .v = v, .pos = start };
+	uint16_t head, lo, hi;
+	uint32_t w;
+	int rv, i, n;
+
+	msg->sop = -1;
+	msg->len = 0;
+	msg->err = TC_EDGES_ERR_SOP;
+	rv = read_bits(&r, 20, &w);
+	if (rv > 0)
+		return 1;
+	if (rv < 0 || (msg->sop = ordered_set(w)) < 0)
+		goto done;
+	msg->err = TC_EDGES_OK;
+	if (msg->sop >= TC_EDGES_HARD_RESET)
+		goto done;
+
+	/* header, data objects and CRC */
+	msg->err = TC_EDGES_ERR_LEN;
+	rv = read_short(&r, &head);
+	if (rv)
+		goto check;
+	put16(msg->data, head);
+	n = 2 + ((head >> 12) & 7) * 4;
+	for (i = 2; i < n + 4; i += 4) {
+		rv = read_short(&r, &lo);
+		if (!rv)
+			rv = read_short(&r, &hi);
+		if (rv)
+			goto check;
+		put16(msg->data + i, lo);
+		put16(msg->data + i + 2, hi);
+	}
+	msg->len = n + 4;
+	msg->err = crc32_bytes(msg->data, n) == (lo | (uint32_t)hi << 16) ?
+		   TC_EDGES_OK : TC_EDGES_ERR_CRC;
+	if (msg->err == TC_EDGES_OK) {
+		rv = read_bits(&r, 5, &w);
+		if (rv > 0)
+			return 1;
+		if (rv < 0 || w != EOP)
+			msg->err = TC_EDGES_ERR_EOP;
+	}
+	goto done;
+check:
+	if (rv > 0)
+		return 1;
+done:
+	*end = r.pos;
+	return 0;
+}
+
+/*
+ * Bit i set where the 32 intervals up to the interval 64 * w + i match
+ * 'pat', 'lo' and 'hi' being the words w - 1 and w of the short (or zero)
+ * intervals bitmap.
+ */
+static inline uint64_t pattern_mask(uint64_t lo, uint64_t hi, uint32_t pat)
+{
+	uint64_t m = ~0ULL, t;
+	int k, sh;
+
+	for (k = 31; k >= 0 && m; k--) {
+		sh = 33 + k;
+		t = sh == 64 ? hi : (lo >> sh) | (hi << (64 - sh));
+		m &= (pat >> k) & 1 ? t : ~t;
+	}
+	return m;
+}
+
+/* Next interval from 'from' ending a preamble or a reset, -1 if none */
+static int next_pattern(const struct line *l, int from)
+{
+	uint64_t lo, hi, m;
+	int w, pos;
+
+	for (w = from >> 6; w << 6 < l->n; w++) {
+		lo = w ? l->z[w - 1] | l->sh[w - 1] : 0;
+		hi = l->z[w] | l->sh[w];
+		m = pattern_mask(lo, hi, PAT_PREAMBLE) |
+		    pattern_mask(lo, hi, PAT_HARD_RESET) |
+		    pattern_mask(lo, hi, PAT_CABLE_RESET);
+		if (w == from >> 6)
+			m &= ~0ULL << (from & 63);
+		if (m) {
+			pos = (w << 6) + __builtin_ctzll(m);
+			return pos < l->n ? pos : -1;
+		}
+	}
+	return -1;
+}
+
+/* Timestamp of the stream packet holding the sample 'idx' */
+static uint64_t mark_ts(const struct line *l, int idx)
+{
+	int lo = 0, hi = l->nmarks - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (l->marks[mid].idx <= idx)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return l->nmarks ? l->marks[lo].ts : 0;
+}
+
+static int emit(struct tc_edges *e, struct tc_pd_msg *msg)
+{
+	if (msg->sop >= TC_EDGES_HARD_RESET)
+		e->stats.resets++;
+	else if (msg->err == TC_EDGES_OK)
+		e->stats.messages++;
+	else
+		e->stats.errors++;
+	return e->cb(e->priv, msg);
+}
+
+/*
+ * Decode the samples of the line 'ch'. Unless 'final', the samples of a
+ * packet not received in full and the last preamble window are kept for
+ * the next batch.
+ */
+static int decode_line(struct tc_edges *e, int ch, int final)
+{
+	struct line *l = e->line + ch;
+	int ticks = res_ticks[l->res];
+	int smax = ticks * 3 / 2, lmax = ticks * 3;
+	struct tc_pd_msg msg = { .line = ch + 1 };
+	struct view v = { l->z, l->sh, l->lg, 0, l->n };
+	struct view pv;
+	int pos, keep = -1, end, period16, c, i, rv = 0;
+	uint32_t win;
+
+	if (l->n < 2)
+		goto carry;
+	kernel->classify(l->s, (l->n + 63) & ~63, smax, lmax,
+			 l->z, l->sh, l->lg);
+	while (!rv && (pos = next_pattern(l, l->from)) >= 0) {
+		l->from = pos + 1;
+		msg.ts = mark_ts(l, pos - PREAMBLE_SPAN);
+		win = bits_at(l->z, pos - 31) | bits_at(l->sh, pos - 31);
+		if (win != PAT_PREAMBLE) {
+			msg.sop = win == PAT_HARD_RESET ?
+				  TC_EDGES_HARD_RESET : TC_EDGES_CABLE_RESET;
+			msg.err = TC_EDGES_OK;
+			msg.len = 0;
+			rv = emit(e, &msg);
+			continue;
+		}
+
+		/* classify the packet again at the period of its preamble */
+		pv = v;
+		period16 = (uint8_t)(l->s[pos] - l->s[pos -
+				     PREAMBLE_INTERVALS]) * 16 /
+			   PREAMBLE_HALF_PERIODS;
+		if (period16 * 3 / 32 != smax || period16 * 3 / 16 != lmax) {
+			pv.z = l->pz;
+			pv.sh = l->psh;
+			pv.lg = l->plg;
+			pv.base = pos - 1;
+			pv.end = pos - 1 + PKT_SPAN < l->n ?
+				 pos - 1 + PKT_SPAN : l->n;
+			kernel->classify(l->s + pv.base,
+					 (pv.end - pv.base + 63) & ~63,
+					 period16 * 3 / 32, period16 * 3 / 16,
+					 l->pz, l->psh, l->plg);
+		}
+		if (decode_packet(&pv, pos - 1, &msg, &end)) {
+			if (!final && pv.end == l->n) {
+				/* the rest comes with the next batch */
+				keep = pos;
+				l->from = pos;
+				break;
+			}
+			/* the samples ended within the packet */
+			if (!msg.len)
+				msg.err = TC_EDGES_ERR_LEN;
+			else if (msg.err == TC_EDGES_OK)
+				msg.err = TC_EDGES_ERR_EOP;
+			end = pos;
+		}
+		/* past a message, else search from the next interval */
+		if (msg.err == TC_EDGES_OK && end > pos)
+			l->from = end;
+		rv = emit(e, &msg);
+	}
+
+carry:
+	e->stats.samples += l->n > 0 ? l->n - 1 : 0;
+	if (final) {
+		l->n = 0;
+		l->nmarks = 0;
+		l->res = -1;
+		return rv;
+	}
+	/* keep from the sample before the interval 'c' */
+	if (keep >= 0)
+		c = keep - PREAMBLE_SPAN;
+	else
+		c = l->n - (PREAMBLE_SPAN + PREAMBLE_INTERVALS);
+	if (c < 1)
+		c = 1;
+	/* those samples are counted again */
+	e->stats.samples -= l->n - c;
+	memmove(l->s, l->s + c - 1, l->n - c + 1);
+	l->n -= c - 1;
+	l->from = l->from - (c - 1) > PREAMBLE_INTERVALS ?
+		  l->from - (c - 1) : PREAMBLE_INTERVALS;
+	for (i = 0; i < l->nmarks && l->marks[i].idx < c - 1; i++)
+		;
+	if (i)
+		i--;
+	memmove(l->marks, l->marks + i, (l->nmarks - i) * sizeof(*l->marks));
+	l->nmarks -= i;
+	for (i = 0; i < l->nmarks; i++)
+		l->marks[i].idx = l->marks[i].idx > c - 1 ?
+				  l->marks[i].idx - (c - 1) : 0;
+	return rv;
+}
+
+/* Append the samples of a stream packet to its line */
+static int line_add(struct tc_edges *e, int ch, int res, uint64_t ts,
+		    const uint8_t *samples, int len)
+{
+	struct line *l = e->line + ch;
+	int rv = 0;
+
+	if (l->res != res && l->n)
+		rv = decode_line(e, ch, 1);
+	if (!l->n)
+		l->from = PREAMBLE_INTERVALS;
+	l->res = res;
+	l->marks[l->nmarks].idx = l->n;
+	l->marks[l->nmarks++].ts = ts;
+	memcpy(l->s + l->n, samples, len);
+	l->n += len;
+	if (!rv && l->n >= TC_EDGES_BATCH)
+		rv = decode_line(e, ch, 0);
+	return rv;
+}
+
+/* Do the samples of a stream packet with these flags get decoded ? */
+static int raw_format(uint16_t flags)
+{
+	return !(flags & TC_FLAG_PACKED) &&
+	       (TC_FLAG_RES(flags) == TC_RES_NORMAL ||
+		TC_FLAG_RES(flags) == TC_RES_COARSE);
+}
+
+/* Lost samples before the stream packet 'pkt' ? */
+static int stream_gap(const uint8_t *pkt, int last_seq)
+{
+	return (last_seq >= 0 &&
+		tc_get16(pkt + 4) != (uint16_t)(last_seq + 1)) ||
+	       (tc_get16(pkt + 2) & TC_FLAG_OFLOW);
+}
+
+static int stream_packet(struct tc_edges *e, const uint8_t *pkt)
+{
+	uint16_t flags = tc_get16(pkt + 2);
+	int ch = flags & TC_FLAG_CC2 ? 1 : 0;
+	int gap = stream_gap(pkt, e->last_seq);
+	int pad = flags & TC_FLAG_PAD ? TC_PAD_SIZE : 0;
+	int rv;
+
+	e->last_seq = tc_get16(pkt + 4);
+	/* lost samples : the packets in progress end there */
+	if (gap && (rv = tc_edges_flush(e)))
+		return rv;
+	if ((flags & TC_FLAG_RECORD) == TC_FLAG_RECORD)
+		return 0;
+	if (flags & TC_FLAG_IDLE)
+		/* no edge for a while : the line is between packets */
+		return e->line[ch].n ? decode_line(e, ch, 1) : 0;
+	if (!raw_format(flags)) {
+		e->stats.skipped++;
+		return 0;
+	}
+	return line_add(e, ch, TC_FLAG_RES(flags),
+			tc_packet_time(pkt, TC_SNIFFER),
+			pkt + TC_HEADER_SIZE + pad, pkt[6] - pad);
+}
+
+int tc_edges_data(struct tc_edges *e, const uint8_t *data, int len)
+{
+	enum tc_kind kind;
+	int size, rv = 0;
+
+	while (len > 0 && !rv) {
+		kind = tc_packet(data, len, &size);
+		if (kind == TC_UNKNOWN) {
+			/* lost the packet boundaries : find the next one */
+			data++;
+			len--;
+			continue;
+		}
+		if (kind == TC_SNIFFER)
+			rv = stream_packet(e, data);
+		data += size;
+		len -= size;
+	}
+	return rv;
+}
+
+int tc_edges_flush(struct tc_edges *e)
+{
+	int ch, rv = 0;
+
+	for (ch = 0; ch < 2 && !rv; ch++)
+		if (e->line[ch].n)
+			rv = decode_line(e, ch, 1);
+	return rv;
+}
+
+const struct tc_edges_stats *tc_edges_get_stats(const struct tc_edges *e)
+{
+	return &e->stats;
+}
+
+struct tc_edges *tc_edges_new(tc_msg_cb cb, void *priv)
+{
+	struct tc_edges *e = calloc(1, sizeof(*e));
+	struct line *l;
+	int ch;
+
+	if (!e)
+		return NULL;
+	tables_init();
+	e->cb = cb;
+	e->priv = priv;
+	e->last_seq = -1;
+	for (ch = 0; ch < 2; ch++) {
+		l = e->line + ch;
+		l->res = -1;
+		l->buf = calloc(1, LINE_CAP + 2 * LINE_PAD);
+		l->marks = calloc(LINE_CAP / 2 + 2, sizeof(*l->marks));
+		l->z = calloc(MAP_WORDS(LINE_CAP + LINE_PAD), 8);
+		l->sh = calloc(MAP_WORDS(LINE_CAP + LINE_PAD), 8);
+		l->lg = calloc(MAP_WORDS(LINE_CAP + LINE_PAD), 8);
+		l->pz = calloc(MAP_WORDS(PKT_SPAN + LINE_PAD), 8);
+		l->psh = calloc(MAP_WORDS(PKT_SPAN + LINE_PAD), 8);
+		l->plg = calloc(MAP_WORDS(PKT_SPAN + LINE_PAD), 8);
+		if (!l->buf || !l->marks || !l->z || !l->sh || !l->lg ||
+		    !l->pz || !l->psh || !l->plg) {
+			tc_edges_free(e);
+			return NULL;
+		}
+		l->s = l->buf + LINE_PAD;
+	}
+	return e;
+}
+
+void tc_edges_free(struct tc_edges *e)
+{
+	struct line *l;
+	int ch;
+
+	for (ch = 0; ch < 2; ch++) {
+		l = e->line + ch;
+		free(l->buf);
+		free(l->marks);
+		free(l->z);
+		free(l->sh);
+		free(l->lg);
+		free(l->pz);
+		free(l->psh);
+		free(l->plg);
+	}
+	free(e);
+}
+
+/*
+ * Parallel decoding of a whole capture : the lines only carry state across
+ * a packet, so the capture is cut where neither line is within one.
+ */
+
+/* Intervals without an edge (counter overflows only) ending any packet */
+#define QUIET_INTERVALS 3
+
+/* Messages of a chunk on one line, in timestamp order */
+struct msg_list {
+	struct tc_pd_msg *msgs;
+	int count;
+	int size;
+};
+
+struct chunk {
+	const uint8_t *data;
+	size_t len;
+	struct msg_list list[2];
+	struct tc_edges_stats stats;
+	int err;   /* out of memory */
+	int done;
+};
+
+struct pool {
+	struct chunk *chunks;
+	int count;
+	int next;  /* next chunk to decode */
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static int collect(void *priv, const struct tc_pd_msg *msg)
+{
+	struct msg_list *l = (struct msg_list *)priv + (msg->line - 1);
+	struct tc_pd_msg *m;
+
+	if (l->count == l->size) {
+		m = realloc(l->msgs, (l->size * 2 + 64) * sizeof(*m));
+		if (!m)
+			return -1;
+		l->msgs = m;
+		l->size = l->size * 2 + 64;
+	}
+	l->msgs[l->count++] = *msg;
+	return 0;
+}
+
+/* Is the line still within a packet after the raw samples of 'pkt' ? */
+static int line_busy(const uint8_t *pkt)
+{
+	const uint8_t *end = pkt + TC_HEADER_SIZE + pkt[6];
+	int i;
+
+	if (pkt[6] <= QUIET_INTERVALS)
+		return 1;
+	for (i = 1; i <= QUIET_INTERVALS; i++)
+		if (end[-i] != end[-i - 1])
+			return 1;
+	return 0;
+}
+
+/*
+ * Cut the capture into chunks of at least 'target' bytes, returns their
+ * number or -1 if out of memory.
+ */
+static int cut_chunks(const uint8_t *data, size_t len, size_t target,
+		      struct chunk **chunks)
+{
+	struct chunk *c = NULL, *t;
+	size_t pos = 0, start = 0;
+	int n = 0, size = 0, busy[2] = {0, 0}, last_seq = -1, sz, ch;
+	enum tc_kind kind = TC_UNKNOWN;
+	const uint8_t *pkt;
+	uint16_t flags;
+
+	for (;;) {
+		pkt = data + pos;
+		if (pos < len) {
+			kind = tc_packet(pkt, len - pos < INT_MAX ?
+					 len - pos : INT_MAX, &sz);
+			if (kind == TC_UNKNOWN) {
+				pos++;
+				continue;
+			}
+		}
+		if (pos == len || (pos - start >= target &&
+		    ((!busy[0] && !busy[1]) ||
+		     (kind == TC_SNIFFER && stream_gap(pkt, last_seq))))) {
+			if (n == size) {
+				t = realloc(c, (size * 2 + 16) * sizeof(*c));
+				if (!t) {
+					free(c);
+					return -1;
+				}
+				c = t;
+				size = size * 2 + 16;
+			}
+			memset(c + n, 0, sizeof(*c));
+			c[n].data = data + start;
+			c[n++].len = pos - start;
+			start = pos;
+		}
+		if (pos == len)
+			break;
+		if (kind == TC_SNIFFER) {
+			flags = tc_get16(pkt + 2);
+			ch = flags & TC_FLAG_CC2 ? 1 : 0;
+			last_seq = tc_get16(pkt + 4);
+			if (flags & TC_FLAG_OFLOW)
+				busy[0] = busy[1] = 0;
+			if ((flags & TC_FLAG_RECORD) == TC_FLAG_IDLE)
+				busy[ch] = 0;
+			else if (!(flags & TC_FLAG_IDLE) && raw_format(flags))
+				busy[ch] = line_busy(pkt);
+		}
+		pos += sz;
+	}
+	*chunks = c;
+	return n;
+}
+
+static void *worker(void *arg)
+{
+	struct pool *pool = arg;
+	struct tc_edges *e;
+	struct chunk *c;
+	size_t off;
+	int step;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		c = pool->stop || pool->next >= pool->count ? NULL :
+		    pool->chunks + pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (!c)
+			return NULL;
+
+		e = tc_edges_new(collect, c->list);
+		if (e) {
+			for (off = 0; off < c->len && !c->err; off += step) {
+				step = c->len - off < INT_MAX ? c->len - off :
+				       INT_MAX;
+				c->err = tc_edges_data(e, c->data + off, step);
+			}
+			c->err = c->err || tc_edges_flush(e);
+			c->stats = *tc_edges_get_stats(e);
+			tc_edges_free(e);
+		} else {
+			c->err = 1;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		c->done = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/* Hand the messages of both lines to 'cb' in timestamp order */
+static int deliver(struct chunk *c, tc_msg_cb cb, void *priv)
+{
+	struct msg_list *l = c->list;
+	int i = 0, k = 0, rv = 0;
+
+	while (!rv && (i < l[0].count || k < l[1].count)) {
+		if (k == l[1].count ||
+		    (i < l[0].count && l[0].msgs[i].ts <= l[1].msgs[k].ts))
+			rv = cb(priv, l[0].msgs + i++);
+		else
+			rv = cb(priv, l[1].msgs + k++);
+	}
+	return rv;
+}
+
+static void add_stats(struct tc_edges_stats *s,
+		      const struct tc_edges_stats *c)
+{
+	s->samples += c->samples;
+	s->messages += c->messages;
+	s->resets += c->resets;
+	s->errors += c->errors;
+	s->skipped += c->skipped;
+}
+
+int tc_edges_decode(const uint8_t *data, size_t len, int threads,
+		    tc_msg_cb cb, void *priv, struct tc_edges_stats *stats)
+{
+	struct pool pool = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t *tid;
+	size_t target;
+	int i, started = 0, rv = 0;
+
+	tables_init();
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	/* several chunks per thread, the chunk sizes are uneven */
+	target = len / (threads * 8);
+	if (target < TC_EDGES_CHUNK)
+		target = TC_EDGES_CHUNK;
+	pool.count = cut_chunks(data, len, target, &pool.chunks);
+	if (pool.count < 0)
+		return -1;
+	if (threads > pool.count)
+		threads = pool.count;
+	tid = calloc(threads ? threads : 1, sizeof(*tid));
+	if (!tid) {
+		free(pool.chunks);
+		return -1;
+	}
+	for (i = 0; i < threads; i++)
+		if (!pthread_create(tid + started, NULL, worker, &pool))
+			started++;
+	/* no thread : decode in this one */
+	if (!started)
+		worker(&pool);
+
+	for (i = 0; i < pool.count; i++) {
+		struct chunk *c = pool.chunks + i;
+
+		pthread_mutex_lock(&pool.lock);
+		while (!c->done)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+		if (!rv && c->err)
+			rv = -1;
+		if (!rv)
+			rv = deliver(c, cb, priv);
+		if (rv) {
+			pthread_mutex_lock(&pool.lock);
+			pool.stop = 1;
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+		if (stats)
+			add_stats(stats, &c->stats);
+		free(c->list[0].msgs);
+		free(c->list[1].msgs);
+		c->list[0].msgs = c->list[1].msgs = NULL;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+	for (i = 0; i < pool.count; i++) {
+		free(pool.chunks[i].list[0].msgs);
+		free(pool.chunks[i].list[1].msgs);
+	}
+	free(tid);
+	free(pool.chunks);
+	return rv;
+}
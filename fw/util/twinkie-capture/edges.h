@@ -0,0 +1,106 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Host decoder of the raw edge samples of the sniffer stream.
+ *
+ * The samples of each CC line (raw format, 8-bit normal or coarse
+ * resolution) are gathered across the stream packets and decoded in large
+ * batches instead of one interval at a time :
+ * - a vector kernel (AVX2, SSE2 or NEON, else scalar code) turns the samples
+ *   into bitmaps of the interval classes, 16 or 32 samples per instruction,
+ * - the preamble and the reset patterns are searched 64 intervals at a time
+ *   in these bitmaps,
+ * - the bits of a packet are read 8 intervals per table lookup, and its
+ *   symbols 2 per lookup.
+ * The classes, patterns and checks are the ones of the firmware decoder
+ * (common/usb_pd_decode.c), the bit period being measured on each preamble.
+ */
+
+#ifndef __TWINKIE_EDGES_H
+#define __TWINKIE_EDGES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Samples of a line decoded at once */
+#define TC_EDGES_BATCH (64 * 1024)
+/* Smallest chunk of a capture decoded by a thread, in bytes */
+#define TC_EDGES_CHUNK (1024 * 1024)
+
+/* Where the decoding of a packet stopped, as enum pd_decode_err */
+enum tc_edges_err {
+	TC_EDGES_OK = 0,
+	TC_EDGES_ERR_PREAMBLE,
+	TC_EDGES_ERR_SOP,
+	TC_EDGES_ERR_LEN,
+	TC_EDGES_ERR_CRC,
+	TC_EDGES_ERR_EOP,
+};
+
+/* Packet types, as enum tcpm_transmit_type */
+#define TC_EDGES_HARD_RESET  5
+#define TC_EDGES_CABLE_RESET 6
+
+struct tc_pd_msg {
+	uint64_t ts;  /* device time of the stream packet of its preamble */
+	int line;     /* CC line : 1 or 2 */
+	int sop;      /* SOP* type, TC_EDGES_x reset, -1 if not found */
+	int err;      /* TC_EDGES_OK or the step where the decoding failed */
+	int len;      /* bytes of 'data' */
+	uint8_t data[2 + 7 * 4 + 4]; /* header, data objects, CRC-32 */
+};
+
+/*
+ * Message callback : called for each packet found, 'msg' is only valid
+ * during the call. A non-zero return value is returned by the function
+ * feeding the data.
+ */
+typedef int (*tc_msg_cb)(void *priv, const struct tc_pd_msg *msg);
+
+struct tc_edges_stats {
+	uint64_t samples;    /* raw samples decoded */
+	uint64_t messages;   /* messages with a valid CRC */
+	uint64_t resets;     /* hard and cable resets */
+	uint64_t errors;     /* packets which failed after their preamble */
+	uint64_t skipped;    /* stream packets of an unsupported format */
+};
+
+struct tc_edges;
+
+struct tc_edges *tc_edges_new(tc_msg_cb cb, void *priv);
+
+/* Decode the raw sample packets among the device packets of 'data' */
+int tc_edges_data(struct tc_edges *e, const uint8_t *data, int len);
+
+/* Decode the samples still held, at the end of the capture */
+int tc_edges_flush(struct tc_edges *e);
+
+const struct tc_edges_stats *tc_edges_get_stats(const struct tc_edges *e);
+
+void tc_edges_free(struct tc_edges *e);
+
+/*
+ * Decode the whole capture 'data' (device packets back to back) with
+ * 'threads' threads, all the online CPUs if 0. The capture is cut into
+ * chunks where neither line can be within a packet : before an overflow,
+ * after an idle marker or after samples without an edge for a while. Each
+ * chunk is decoded on its own, and 'cb' gets the messages from the calling
+ * thread in the order of the chunks, each chunk in timestamp order. The
+ * statistics of all the chunks are added into 'stats' if not NULL.
+ * Returns the non-zero value of 'cb' which stopped the decoding, -1 if out
+ * of memory or 0.
+ */
+int tc_edges_decode(const uint8_t *data, size_t len, int threads,
+		    tc_msg_cb cb, void *priv, struct tc_edges_stats *stats);
+
+/*
+ * Classification kernel in use : "avx2", "sse2", "neon" or "scalar", the
+ * best one the CPU runs by default.
+ */
+const char *tc_edges_kernel(void);
+
+/* Force the kernel 'name', returns -1 if the CPU or the build lacks it */
+int tc_edges_set_kernel(const char *name);
+
+#endif /* __TWINKIE_EDGES_H */
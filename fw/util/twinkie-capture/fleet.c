@@ -0,0 +1,191 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "fleet.h"
+
+/* Event loop wake-up, for the stop flag and the statistics */
+#define POLL_MS 100
+
+struct device {
+	struct tc_capture *c;  /* NULL for a free slot */
+	int bus;
+	int addr;
+	char serial[32];
+	void *out;
+	double t0;
+};
+
+struct fleet {
+	const struct tc_fleet_config *cfg;
+	struct tc_ctx *x;
+	struct device dev[TC_FLEET_MAX];
+	int count;
+	/* statistics of the devices gone */
+	struct tc_stats gone;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void add_stats(struct tc_stats *sum, const struct tc_stats *s)
+{
+	sum->bytes += s->bytes;
+	sum->packets += s->packets;
+	sum->records += s->records;
+	sum->seq_gaps += s->seq_gaps;
+	sum->seq_lost += s->seq_lost;
+	sum->oflow += s->oflow;
+	sum->crc_errors += s->crc_errors;
+	sum->trace_dropped += s->trace_dropped;
+	sum->unknown += s->unknown;
+	sum->errors += s->errors;
+	sum->iso_lost += s->iso_lost;
+}
+
+/* Stop the capture of 'd' and close its output */
+static void retire(struct fleet *f, struct device *d)
+{
+	const struct tc_fleet_config *cfg = f->cfg;
+
+	tc_stop(d->c);
+	add_stats(&f->gone, tc_get_stats(d->c));
+	cfg->close(cfg->priv, d->out, d->serial, tc_get_stats(d->c),
+		   now() - d->t0);
+	tc_close(d->c);
+	d->c = NULL;
+	f->count--;
+}
+
+static void arrived(struct fleet *f, int bus, int addr)
+{
+	const struct tc_fleet_config *cfg = f->cfg;
+	struct device *d = NULL;
+	int i;
+
+	for (i = 0; i < TC_FLEET_MAX; i++) {
+		if (f->dev[i].c && f->dev[i].bus == bus &&
+		    f->dev[i].addr == addr)
+			return;
+		if (!f->dev[i].c && !d)
+			d = f->dev + i;
+	}
+	if (!d) {
+		fprintf(stderr, "%d:%d: more than %d devices\n", bus, addr,
+			TC_FLEET_MAX);
+		return;
+	}
+	d->c = tc_ctx_open(f->x, cfg->vid, cfg->pid, bus, addr, cfg->iface,
+			   cfg->iso, cfg->transfers, cfg->size);
+	if (!d->c) {
+		/* not running the sniffer image, or busy */
+		fprintf(stderr, "%d:%d: cannot open the capture\n", bus, addr);
+		return;
+	}
+	d->bus = bus;
+	d->addr = addr;
+	if (tc_serial(d->c, d->serial, sizeof(d->serial)) || !d->serial[0])
+		snprintf(d->serial, sizeof(d->serial), "%d-%d", bus, addr);
+	d->out = cfg->open(cfg->priv, d->serial);
+	if (!d->out || tc_start(d->c, cfg->data, d->out)) {
+		if (d->out)
+			cfg->close(cfg->priv, d->out, d->serial,
+				   tc_get_stats(d->c), 0);
+		tc_close(d->c);
+		d->c = NULL;
+		return;
+	}
+	d->t0 = now();
+	f->count++;
+	fprintf(stderr, "%s: capturing (%d:%d)\n", d->serial, bus, addr);
+}
+
+static void hotplug(void *priv, int bus, int addr, int arrive)
+{
+	struct fleet *f = priv;
+	int i;
+
+	if (arrive) {
+		arrived(f, bus, addr);
+		return;
+	}
+	for (i = 0; i < TC_FLEET_MAX; i++)
+		if (f->dev[i].c && f->dev[i].bus == bus &&
+		    f->dev[i].addr == addr)
+			retire(f, f->dev + i);
+}
+
+static void print_total(struct fleet *f, double secs, uint64_t *last)
+{
+	struct tc_stats sum = f->gone;
+	int i;
+
+	for (i = 0; i < TC_FLEET_MAX; i++)
+		if (f->dev[i].c)
+			add_stats(&sum, tc_get_stats(f->dev[i].c));
+	fprintf(stderr,
+		"%d devices %llu bytes (%.0f kB/s) %llu packets %llu records "
+		"seq lost %llu oflow %llu crc %llu trace dropped %llu "
+		"errors %llu iso lost %llu\n",
+		f->count, (unsigned long long)sum.bytes,
+		(sum.bytes - *last) / secs / 1e3,
+		(unsigned long long)sum.packets,
+		(unsigned long long)sum.records,
+		(unsigned long long)sum.seq_lost,
+		(unsigned long long)sum.oflow,
+		(unsigned long long)sum.crc_errors,
+		(unsigned long long)sum.trace_dropped,
+		(unsigned long long)sum.errors,
+		(unsigned long long)sum.iso_lost);
+	*last = sum.bytes;
+}
+
+int tc_fleet_run(const struct tc_fleet_config *cfg,
+		 volatile sig_atomic_t *stop)
+{
+	struct fleet f = { .cfg = cfg };
+	double last = now(), t;
+	uint64_t last_bytes = 0;
+	int i, rv = 0;
+
+	f.x = tc_ctx_new();
+	if (!f.x)
+		return -1;
+	if (tc_ctx_hotplug(f.x, cfg->vid, cfg->pid, hotplug, &f)) {
+		tc_ctx_free(f.x);
+		return -1;
+	}
+
+	while (!*stop) {
+		if (tc_ctx_poll(f.x, POLL_MS)) {
+			rv = -1;
+			break;
+		}
+		/* output errors, or the device gone before its event */
+		for (i = 0; i < TC_FLEET_MAX; i++)
+			if (f.dev[i].c && !tc_running(f.dev[i].c))
+				retire(&f, f.dev + i);
+		t = now();
+		if (!cfg->quiet && t - last >= 1.0) {
+			print_total(&f, t - last, &last_bytes);
+			last = t;
+		}
+	}
+
+	for (i = 0; i < TC_FLEET_MAX; i++)
+		if (f.dev[i].c)
+			retire(&f, f.dev + i);
+	print_total(&f, now() - last, &last_bytes);
+	tc_ctx_free(f.x);
+	return rv;
+}
@@ -0,0 +1,49 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Capture of all the twinkies attached to the host, in a single process.
+ *
+ * The devices share a USB context : the transfer queues of all of them are
+ * served by one event loop in one thread, a device costs its transfers and
+ * its output but no thread nor poll of its own. The devices are found and
+ * lost by hotplug, each one named by its USB serial number (the chip unique
+ * ID, see board_read_serial()) and recorded to an output of its own.
+ */
+
+#ifndef __TWINKIE_FLEET_H
+#define __TWINKIE_FLEET_H
+
+#include <signal.h>
+
+#include "capture.h"
+
+/* Devices captured at once */
+#define TC_FLEET_MAX 64
+
+struct tc_fleet_config {
+	uint16_t vid;
+	uint16_t pid;
+	int iface;
+	int iso;
+	int transfers;
+	int size;
+	int quiet;           /* no periodic aggregate statistics */
+	/* Output of the device 'serial', NULL to leave the device alone */
+	void *(*open)(void *priv, const char *serial);
+	/* Data callback of the devices, with their output as 'priv' */
+	tc_data_cb data;
+	/* Close the output of the device once it is stopped or gone */
+	void (*close)(void *priv, void *out, const char *serial,
+		      const struct tc_stats *stats, double secs);
+	void *priv;
+};
+
+/*
+ * Capture the devices of 'cfg' as they come and go until 'stop' is set.
+ * Returns 0, or -1 if the USB context or hotplug cannot be set up.
+ */
+int tc_fleet_run(const struct tc_fleet_config *cfg,
+		 volatile sig_atomic_t *stop);
+
+#endif /* __TWINKIE_FLEET_H */
@@ -0,0 +1,926 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * twinkie-capture : record the sniffer stream to a file.
+ *
+ * Build with :
+ *   cc -O2 -pthread -o twinkie-capture main.c capture.c pcapng.c sync.c \
+ *      edges.c tcap.c server.c fleet.c \
+ *      $(pkg-config --cflags --libs libusb-1.0)
+ *
+ * The file holds the device packets back to back, as sent on the sniffer
+ * endpoint (each one gives its own length in its header). With -p, the
+ * decoded PD messages are also exported to a pcapng file. With -x, the file
+ * is an indexed container instead (see tcap.h), which -L queries by time
+ * and event. The other modes read both kinds of files.
+ *
+ * With -m, the raw files of several twinkies wired together by their SYNC
+ * pin (see sync.h) are merged into a single pcapng file on the clock of the
+ * first one, the master, instead of capturing.
+ *
+ * With -D, the raw edge samples of a raw file ('sniffer raw') are decoded
+ * on the host (see edges.h) instead of capturing, on all the CPUs unless
+ * -j limits the threads.
+ *
+ * With -l, the stream is served on a TCP port to any number of clients
+ * (see server.h) instead of being recorded. With -r, the file is recorded
+ * from such a server instead of a local device.
+ *
+ * With -F, all the twinkies attached are recorded, as they come and go, to
+ * files named by their serial number in a directory (see fleet.h).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "edges.h"
+#include "fleet.h"
+#include "pcapng.h"
+#include "server.h"
+#include "sync.h"
+#include "tcap.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#define ARRAY_SIZE(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+struct output {
+	int fd;              /* raw device packets, -1 if none */
+	struct tc_cap_writer *cap; /* or indexed container */
+	struct tc_pcapng *pcap;
+};
+
+/* Write the transfer buffer straight to the output file */
+static int write_data(void *priv, const uint8_t *data, int len)
+{
+	struct output *out = priv;
+	int fd = out->fd;
+	ssize_t n;
+
+	if (out->pcap && tc_pcapng_data(out->pcap, 0, data, len)) {
+		perror("pcapng");
+		return 1;
+	}
+	if (out->cap && tc_cap_write(out->cap, data, len)) {
+		perror("write");
+		return 1;
+	}
+
+	while (fd >= 0 && len > 0) {
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("write");
+			return 1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void print_stats(const struct tc_stats *s, double secs)
+{
+	fprintf(stderr,
+		"%.1fs %llu bytes (%.0f kB/s) %llu packets %llu records "
+		"%llu idle\n"
+		"  seq gaps %llu (%llu lost) oflow %llu crc %llu "
+		"trace dropped %llu violations %llu repeats %llu "
+		"degraded %llu unknown %llu errors %llu\n"
+		"  clock error %d ppm (worst %d ppm) trigger inputs %llu "
+		"iso lost %llu\n"
+		"  health %llu: idle %d%% usb free %d oflow cc1 %llu cc2 %llu\n"
+		"  suspends %llu (%llu flight records lost)\n",
+		secs, (unsigned long long)s->bytes,
+		secs > 0 ? s->bytes / secs / 1000 : 0,
+		(unsigned long long)s->packets,
+		(unsigned long long)s->records,
+		(unsigned long long)s->empty,
+		(unsigned long long)s->seq_gaps,
+		(unsigned long long)s->seq_lost,
+		(unsigned long long)s->oflow,
+		(unsigned long long)s->crc_errors,
+		(unsigned long long)s->trace_dropped,
+		(unsigned long long)s->violations,
+		(unsigned long long)s->repeats,
+		(unsigned long long)s->degraded,
+		(unsigned long long)s->unknown,
+		(unsigned long long)s->errors,
+		s->clock_ppm, s->clock_ppm_max,
+		(unsigned long long)s->inputs,
+		(unsigned long long)s->iso_lost,
+		(unsigned long long)s->health, s->cpu_idle, s->usb_free,
+		(unsigned long long)s->dev_oflow[0],
+		(unsigned long long)s->dev_oflow[1],
+		(unsigned long long)s->suspends,
+		(unsigned long long)s->susp_lost);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Whole content of a raw capture file */
+struct raw_file {
+	uint8_t *data;
+	size_t len;
+	size_t pos;   /* next device packet */
+	uint64_t ts;  /* its timestamp on the common timebase */
+	struct tc_clock clk;
+};
+
+/* Keep only the device packets of the container read in 'f' */
+static int unpack_cap(const char *path, struct raw_file *f)
+{
+	struct tc_cap *c = tc_cap_open(path);
+	const struct tc_cap_index *idx;
+	size_t pos = 0;
+	int i;
+
+	if (!c)
+		return -1;
+	/* the chunks are in file order : move them down in place */
+	for (i = 0; i < tc_cap_count(c); i++) {
+		idx = tc_cap_index(c, i);
+		memmove(f->data + pos, f->data + idx->offset, idx->len);
+		pos += idx->len;
+	}
+	f->len = pos;
+	tc_cap_close(c);
+	return 0;
+}
+
+static int read_file(const char *path, struct raw_file *f)
+{
+	FILE *in = fopen(path, "rb");
+	long size;
+	int rv = -1;
+
+	if (!in)
+		return -1;
+	if (!fseek(in, 0, SEEK_END) && (size = ftell(in)) >= 0 &&
+	    !fseek(in, 0, SEEK_SET)) {
+		f->data = malloc(size ? size : 1);
+		f->len = size;
+		if (f->data && fread(f->data, 1, size, in) == (size_t)size)
+			rv = 0;
+	}
+	fclose(in);
+	if (!rv && tc_cap_probe(f->data, f->len))
+		rv = unpack_cap(path, f);
+	return rv;
+}
+
+/*
+ * Move to the next device packet of 'f' at or after 'pos', returns its size
+ * or 0 at the end of the file.
+ */
+static int next_packet(struct raw_file *f)
+{
+	enum tc_kind kind;
+	int size;
+
+	for (; f->pos < f->len; f->pos++) {
+		kind = tc_packet(f->data + f->pos, MIN(f->len - f->pos, INT_MAX),
+				 &size);
+		if (kind != TC_UNKNOWN) {
+			f->ts = tc_clock_map(&f->clk, tc_packet_time(
+					f->data + f->pos, kind));
+			return size;
+		}
+	}
+	return 0;
+}
+
+/* Merge the raw files on the clock of the first one into 'path' */
+static int merge(const char *path, char **names, int count)
+{
+	struct raw_file *f = calloc(count, sizeof(*f));
+	int *size = calloc(count, sizeof(*size));
+	struct tc_pulses *pulses = calloc(count, sizeof(*pulses));
+	struct tc_pcapng *pcap = NULL;
+	int i, n, rv = 1;
+
+	if (!f || !size || !pulses)
+		goto exit;
+	for (i = 0; i < count; i++) {
+		if (read_file(names[i], f + i) ||
+		    tc_pulses_parse(pulses + i, f[i].data, f[i].len)) {
+			perror(names[i]);
+			goto exit;
+		}
+	}
+	if (pulses[0].role != TC_PULSE_MASTER)
+		fprintf(stderr, "%s: no master pulse record\n", names[0]);
+	f[0].clk.rate = 1.0;
+	for (i = 1; i < count; i++) {
+		n = tc_clock_fit(&f[i].clk, pulses + i, pulses);
+		if (n)
+			fprintf(stderr, "%s: %d pulses, offset %lld us, "
+				"drift %.2f ppm\n", names[i], n,
+				(long long)(f[i].clk.ref - f[i].clk.dev_ref),
+				(f[i].clk.rate - 1.0) * 1e6);
+		else
+			fprintf(stderr, "%s: no pulse paired with the master, "
+				"left on its own clock\n", names[i]);
+	}
+
+	pcap = tc_pcapng_open(path, (const char * const *)names, count);
+	if (!pcap) {
+		perror(path);
+		goto exit;
+	}
+	for (i = 0; i < count; i++) {
+		tc_pcapng_set_clock(pcap, i, &f[i].clk);
+		size[i] = next_packet(f + i);
+	}
+	/* the packets of each file are in time order : merge them */
+	for (;;) {
+		n = -1;
+		for (i = 0; i < count; i++)
+			if (size[i] && (n < 0 || f[i].ts < f[n].ts))
+				n = i;
+		if (n < 0)
+			break;
+		if (tc_pcapng_data(pcap, n, f[n].data + f[n].pos, size[n])) {
+			perror(path);
+			goto exit;
+		}
+		f[n].pos += size[n];
+		size[n] = next_packet(f + n);
+	}
+	fprintf(stderr, "%llu PD messages exported\n",
+		(unsigned long long)tc_pcapng_count(pcap));
+	rv = 0;
+
+exit:
+	if (pcap && tc_pcapng_close(pcap))
+		rv = 1;
+	for (i = 0; f && i < count; i++) {
+		free(f[i].data);
+		tc_pulses_free(pulses + i);
+	}
+	free(pulses);
+	free(size);
+	free(f);
+	return rv;
+}
+
+static const char * const err_names[] = {
+	[TC_EDGES_OK] = "ok",
+	[TC_EDGES_ERR_PREAMBLE] = "preamble",
+	[TC_EDGES_ERR_SOP] = "sop",
+	[TC_EDGES_ERR_LEN] = "length",
+	[TC_EDGES_ERR_CRC] = "crc",
+	[TC_EDGES_ERR_EOP] = "eop",
+};
+
+/* Print a message decoded on the host, and export it if there is a file */
+static int print_msg(void *priv, const struct tc_pd_msg *msg)
+{
+	struct tc_pcapng *pcap = priv;
+	struct tc_pd_pseudo pseudo = {
+		.version = TC_PD_PSEUDO_VERSION,
+		.line = msg->line,
+		.flags = TC_PD_FLAG_STREAM,
+	};
+	int i;
+
+	if (msg->sop >= TC_EDGES_HARD_RESET) {
+		printf("%llu CC%d %s reset\n", (unsigned long long)msg->ts,
+		       msg->line,
+		       msg->sop == TC_EDGES_HARD_RESET ? "hard" : "cable");
+		return 0;
+	}
+	printf("%llu CC%d SOP%d %s", (unsigned long long)msg->ts, msg->line,
+	       msg->sop, err_names[msg->err]);
+	for (i = 0; i < msg->len; i++)
+		printf(" %02x", msg->data[i]);
+	printf("\n");
+	/* the messages with their CRC, as the device decoder */
+	if (!pcap || msg->len < 6 ||
+	    (msg->err != TC_EDGES_OK && msg->err != TC_EDGES_ERR_CRC))
+		return 0;
+	pseudo.sop = msg->err == TC_EDGES_OK ? msg->sop : TC_PD_SOP_ERROR;
+	pseudo.flags |= TC_PD_FLAG_CRC;
+	if (tc_pcapng_msg(pcap, 0, msg->ts, &pseudo, msg->data, msg->len)) {
+		perror("pcapng");
+		return 1;
+	}
+	return 0;
+}
+
+/* Decode the raw samples of the file 'path' on the host */
+static int decode(const char *path, const char *pcap_path,
+		  const char *kernel, int threads)
+{
+	static const char * const name = "twinkie";
+	struct raw_file f = {};
+	struct tc_pcapng *pcap = NULL;
+	struct tc_edges_stats s = {};
+	double t0, secs;
+	int rv = 1;
+
+	if (kernel && tc_edges_set_kernel(kernel)) {
+		fprintf(stderr, "kernel %s not supported\n", kernel);
+		return 1;
+	}
+	if (read_file(path, &f)) {
+		perror(path);
+		goto exit;
+	}
+	if (pcap_path) {
+		pcap = tc_pcapng_open(pcap_path, &name, 1);
+		if (!pcap) {
+			perror(pcap_path);
+			goto exit;
+		}
+	}
+	t0 = now();
+	if (tc_edges_decode(f.data, f.len, threads, print_msg, pcap, &s)) {
+		fprintf(stderr, "decoding failed\n");
+		goto exit;
+	}
+	secs = now() - t0;
+	fprintf(stderr,
+		"%llu samples in %.3fs (%.0f MB/s, %s kernel)\n"
+		"  messages %llu resets %llu errors %llu skipped %llu\n",
+		(unsigned long long)s.samples, secs,
+		secs > 0 ? s.samples / secs / 1e6 : 0, tc_edges_kernel(),
+		(unsigned long long)s.messages,
+		(unsigned long long)s.resets,
+		(unsigned long long)s.errors,
+		(unsigned long long)s.skipped);
+	rv = 0;
+
+exit:
+	if (pcap && tc_pcapng_close(pcap))
+		rv = 1;
+	free(f.data);
+	return rv;
+}
+
+static const char * const event_names[] = {
+	"hard", "cable", "error", "oflow", "gap", "violation", "tx",
+	"trigger", "input", "suspend", "dropped", "bookmark",
+};
+
+/* Events of the comma separated list 'list', -1 if one is unknown */
+static int parse_events(const char *list)
+{
+	char buf[128], *tok, *save;
+	int i, events = 0;
+
+	snprintf(buf, sizeof(buf), "%s", list);
+	for (tok = strtok_r(buf, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < ARRAY_SIZE(event_names); i++)
+			if (!strcmp(tok, event_names[i]))
+				break;
+		if (i == ARRAY_SIZE(event_names))
+			return -1;
+		events |= 1 << i;
+	}
+	return events;
+}
+
+/*
+ * List the chunks of the container 'path' overlapping the device time
+ * window 'from'..'to' (us) with one of 'events' (all if 0), and export
+ * their PD messages of the window to 'pcap_path' if not NULL.
+ */
+static int query(const char *path, uint64_t from, uint64_t to, int events,
+		 const char *pcap_path)
+{
+	static const char * const name = "twinkie";
+	struct tc_cap_index mask = { .events = events };
+	const struct tc_cap_index *idx;
+	struct tc_pcapng *pcap = NULL;
+	struct tc_cap *c = tc_cap_open(path);
+	const uint8_t *data;
+	size_t len;
+	uint64_t ts;
+	int i, k, size, rv = 1;
+	enum tc_kind kind;
+
+	if (!c) {
+		fprintf(stderr, "%s: not a capture container\n", path);
+		return 1;
+	}
+	if (pcap_path) {
+		pcap = tc_pcapng_open(pcap_path, &name, 1);
+		if (!pcap) {
+			perror(pcap_path);
+			goto exit;
+		}
+	}
+	for (i = tc_cap_seek(c, from); i < tc_cap_count(c); i++) {
+		if (events && (i = tc_cap_find(c, i, &mask)) < 0)
+			break;
+		idx = tc_cap_index(c, i);
+		if (idx->ts_min > to)
+			break;
+		printf("chunk %d @%llu: %.6f-%.6f s, %u packets %u messages",
+		       i, (unsigned long long)idx->offset,
+		       idx->ts_min / 1e6, idx->ts_max / 1e6, idx->packets,
+		       idx->messages);
+		for (k = 0; k < ARRAY_SIZE(event_names); k++)
+			if (idx->events & (1 << k))
+				printf(" %s", event_names[k]);
+		printf("\n");
+		if (!pcap)
+			continue;
+		/* the packets of the window only */
+		data = tc_cap_chunk(c, i, &len);
+		while (len > 0) {
+			kind = tc_packet(data, MIN(len, INT_MAX), &size);
+			if (kind == TC_UNKNOWN) {
+				data++;
+				len--;
+				continue;
+			}
+			ts = tc_packet_time(data, kind);
+			if (ts >= from && ts <= to &&
+			    tc_pcapng_data(pcap, 0, data, size)) {
+				perror(pcap_path);
+				goto exit;
+			}
+			data += size;
+			len -= size;
+		}
+	}
+	if (pcap)
+		fprintf(stderr, "%llu PD messages exported\n",
+			(unsigned long long)tc_pcapng_count(pcap));
+	rv = 0;
+
+exit:
+	if (pcap && tc_pcapng_close(pcap))
+		rv = 1;
+	tc_cap_close(c);
+	return rv;
+}
+
+static int read_all(int fd, uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR && !stop)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Record the whole stream of the server 'host:port' */
+static int remote(const char *server, struct output *out, double duration)
+{
+	/* everything the device sends */
+	static const uint8_t filter[] = {
+		TC_NET_FILTER, 0, 0, 0, 4, 0, 0, 0, TC_NET_F_ALL, 0, 0, 0
+	};
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai, *a;
+	uint8_t hdr[TC_NET_HDR_SIZE], *buf = NULL;
+	char host[256], port[16];
+	uint32_t len, size = 0;
+	unsigned long long bytes = 0;
+	double t0 = now();
+	int fd = -1, rv = 0;
+
+	if (sscanf(server, "%255[^:]:%15s", host, port) != 2) {
+		snprintf(host, sizeof(host), "%s", server);
+		snprintf(port, sizeof(port), "%d", TC_NET_PORT);
+	}
+	if (getaddrinfo(host, port, &hints, &ai)) {
+		fprintf(stderr, "%s: unknown host\n", host);
+		return 1;
+	}
+	for (a = ai; a && fd < 0; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(ai);
+	if (fd < 0) {
+		perror(server);
+		return 1;
+	}
+
+	if (write(fd, filter, sizeof(filter)) != sizeof(filter)) {
+		perror(server);
+		close(fd);
+		return 1;
+	}
+
+	while (!stop && !(duration > 0 && now() - t0 >= duration)) {
+		if (read_all(fd, hdr, sizeof(hdr)))
+			break;
+		len = tc_get32(hdr + 4);
+		if (len > size) {
+			free(buf);
+			size = len;
+			buf = malloc(size);
+			if (!buf) {
+				rv = 1;
+				break;
+			}
+		}
+		if (read_all(fd, buf, len))
+			break;
+		if (tc_get16(hdr) == TC_NET_LOST && len >= 4)
+			fprintf(stderr, "%u bytes lost by the server\n",
+				tc_get32(buf));
+		if (tc_get16(hdr) != TC_NET_DATA)
+			continue;
+		if (write_data(out, buf, len)) {
+			rv = 1;
+			break;
+		}
+		bytes += len;
+	}
+	fprintf(stderr, "%.1fs %llu bytes\n", now() - t0, bytes);
+	free(buf);
+	close(fd);
+	return rv;
+}
+
+struct fleet_out {
+	const char *dir;
+	int indexed;
+};
+
+static void *fleet_open(void *priv, const char *serial)
+{
+	struct fleet_out *f = priv;
+	struct output *out = calloc(1, sizeof(*out));
+	char path[PATH_MAX];
+
+	if (!out)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/%s.%s", f->dir, serial,
+		 f->indexed ? "tcap" : "bin");
+	if (f->indexed)
+		out->cap = tc_cap_create(path);
+	else
+		out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f->indexed ? !out->cap : out->fd < 0) {
+		perror(path);
+		free(out);
+		return NULL;
+	}
+	if (f->indexed)
+		out->fd = -1;
+	return out;
+}
+
+static void fleet_close(void *priv, void *data, const char *serial,
+			const struct tc_stats *s, double secs)
+{
+	struct output *out = data;
+
+	if (out->fd >= 0)
+		close(out->fd);
+	if (out->cap && tc_cap_finish(out->cap))
+		perror(serial);
+	free(out);
+	fprintf(stderr, "%s: ", serial);
+	print_stats(s, secs);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-n transfers] [-s size] [-i iface] [-d vid:pid] "
+		"[-t seconds] [-q] [-p file.pcapng] [-b bus:addr]\n"
+		"       [-S off|master|slave|input] [-I] [-x] [-r host:port] "
+		"<file|->\n"
+		"       %s [-d vid:pid] [-b bus:addr] [-S role] -l port\n"
+		"       %s [-n transfers] [-s size] [-d vid:pid] [-I] [-x] "
+		"[-q] -F <dir>\n"
+		"       %s -m out.pcapng <master file> <slave file>...\n"
+		"       %s -D <raw file> [-p file.pcapng] "
+		"[-K avx2|sse2|neon|scalar] [-j threads]\n"
+		"       %s -L <file> [-T start:end] [-E event,...] "
+		"[-p file.pcapng]\n"
+		"  -n : number of queued transfers (default %d)\n"
+		"  -s : transfer size in bytes, multiple of 64 (default %d)\n"
+		"  -t : stop after this duration\n"
+		"  -q : no periodic statistics\n"
+		"  -p : export the decoded PD messages to a pcapng file, the\n"
+		"       raw file is then optional\n"
+		"  -b : USB bus and address of the device\n"
+		"  -S : role of the device on the SYNC pin\n"
+		"  -I : isochronous endpoint, with reserved bandwidth\n"
+		"  -x : write an indexed container instead of a flat file\n"
+		"  -r : record from a server instead of a device\n"
+		"  -l : serve the stream and the console on this TCP port\n"
+		"  -F : record all the devices attached, one file each\n"
+		"  -m : merge the raw files on a common timebase\n"
+		"  -D : decode the raw edge samples of a file on the host\n"
+		"  -K : vector kernel of the decoder (default: best supported)\n"
+		"  -j : decoding threads (default: one per CPU)\n"
+		"  -L : list the chunks of an indexed container\n"
+		"  -T : device time window in seconds\n"
+		"  -E : chunks with one of the events hard, cable, error, "
+		"oflow, gap,\n"
+		"       violation, tx, trigger, input, suspend, dropped, "
+		"bookmark\n",
+		name, name, name, name, name, name, TC_TRANSFERS, TC_TRANSFER_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int vid = TC_VID, pid = TC_PID;
+	int transfers = TC_TRANSFERS;
+	int size = TC_TRANSFER_SIZE;
+	int iface = TC_IFACE_SNIFFER;
+	int iso = 0;
+	double duration = 0, t0, last;
+	int quiet = 0;
+	const char *pcap_path = NULL;
+	const char *merge_path = NULL;
+	const char *decode_path = NULL;
+	const char *kernel = NULL;
+	int threads = 0;
+	const char *query_path = NULL;
+	double win_from = 0, win_to = -1;
+	int events = 0, indexed = 0;
+	int bus = -1, addr = -1, role = -1;
+	const char *server = NULL;
+	int port = 0;
+	const char *fleet_dir = NULL;
+	struct output out = { .fd = -1 };
+	struct tc_capture *c;
+	int opt, rv;
+
+	while ((opt = getopt(argc, argv, "n:s:i:d:t:qp:b:S:Im:D:K:j:xL:T:E:l:r:F:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			transfers = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'i':
+			iface = atoi(optarg);
+			break;
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'p':
+			pcap_path = optarg;
+			break;
+		case 'b':
+			if (sscanf(optarg, "%d:%d", &bus, &addr) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'S':
+			if (!strcmp(optarg, "off"))
+				role = 0;
+			else if (!strcmp(optarg, "master"))
+				role = TC_PULSE_MASTER;
+			else if (!strcmp(optarg, "slave"))
+				role = TC_PULSE_SLAVE;
+			else if (!strcmp(optarg, "input"))
+				role = TC_PULSE_INPUT;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'I':
+			iso = 1;
+			break;
+		case 'm':
+			merge_path = optarg;
+			break;
+		case 'D':
+			decode_path = optarg;
+			break;
+		case 'K':
+			kernel = optarg;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'x':
+			indexed = 1;
+			break;
+		case 'L':
+			query_path = optarg;
+			break;
+		case 'T':
+			if (sscanf(optarg, "%lf:%lf", &win_from, &win_to) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'E':
+			events = parse_events(optarg);
+			if (events < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'l':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			server = optarg;
+			break;
+		case 'F':
+			fleet_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (merge_path) {
+		if (optind >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		return merge(merge_path, argv + optind, argc - optind);
+	}
+	if (query_path) {
+		if (optind != argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		return query(query_path, win_from * 1e6,
+			     win_to < 0 ? UINT64_MAX : win_to * 1e6, events,
+			     pcap_path);
+	}
+	if (decode_path) {
+		if (optind != argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		return decode(decode_path, pcap_path, kernel, threads);
+	}
+	if (fleet_dir) {
+		struct fleet_out fo = { fleet_dir, indexed };
+		struct tc_fleet_config cfg = {
+			.vid = vid, .pid = pid, .iface = iface, .iso = iso,
+			.transfers = transfers, .size = size, .quiet = quiet,
+			.open = fleet_open, .data = write_data,
+			.close = fleet_close, .priv = &fo,
+		};
+
+		if (optind != argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+		if (tc_fleet_run(&cfg, &stop)) {
+			fprintf(stderr, "cannot watch the USB devices\n");
+			return 1;
+		}
+		return 0;
+	}
+	if (port) {
+		if (optind != argc) {
+			usage(argv[0]);
+			return 1;
+		}
+	} else if (optind != argc - 1 && !(pcap_path && optind == argc)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (optind < argc && indexed) {
+		out.cap = tc_cap_create(argv[optind]);
+		if (!out.cap) {
+			perror(argv[optind]);
+			return 1;
+		}
+	} else if (optind < argc) {
+		if (!strcmp(argv[optind], "-"))
+			out.fd = STDOUT_FILENO;
+		else
+			out.fd = open(argv[optind],
+				      O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out.fd < 0) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+	if (pcap_path) {
+		static const char * const name = "twinkie";
+
+		out.pcap = tc_pcapng_open(pcap_path, &name, 1);
+		if (!out.pcap) {
+			perror(pcap_path);
+			return 1;
+		}
+	}
+
+	if (server) {
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+		rv = remote(server, &out, duration);
+		goto close_output;
+	}
+
+	c = tc_open(vid, pid, bus, addr, iface, iso, transfers, size);
+	if (!c) {
+		fprintf(stderr, "cannot open the capture\n");
+		return 1;
+	}
+	if (role >= 0 && tc_control(c, TC_REQ_SET_PULSE, role)) {
+		fprintf(stderr, "cannot set the SYNC pin role\n");
+		tc_close(c);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (port) {
+		t0 = now();
+		rv = tc_serve(c, port, &stop);
+		print_stats(tc_get_stats(c), now() - t0);
+		tc_close(c);
+		return rv < 0;
+	}
+	if (tc_start(c, write_data, &out)) {
+		fprintf(stderr, "cannot submit the transfers\n");
+		tc_close(c);
+		return 1;
+	}
+
+	t0 = last = now();
+	do {
+		double t;
+
+		if (stop || (duration > 0 && now() - t0 >= duration))
+			tc_stop(c);
+		rv = tc_poll(c, 100);
+		t = now();
+		if (!quiet && t - last >= 1.0) {
+			print_stats(tc_get_stats(c), t - t0);
+			last = t;
+		}
+	} while (rv > 0);
+
+	print_stats(tc_get_stats(c), now() - t0);
+	rv = rv < 0 || tc_get_stats(c)->errors;
+	tc_close(c);
+close_output:
+	if (out.fd >= 0 && out.fd != STDOUT_FILENO)
+		close(out.fd);
+	if (out.cap && tc_cap_finish(out.cap)) {
+		perror("write");
+		rv = 1;
+	}
+	if (out.pcap) {
+		fprintf(stderr, "%llu PD messages exported\n",
+			(unsigned long long)tc_pcapng_count(out.pcap));
+		if (tc_pcapng_close(out.pcap))
+			rv = 1;
+	}
+	return rv;
+}
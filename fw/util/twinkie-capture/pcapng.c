@@ -0,0 +1,336 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "pcapng.h"
+#include "sync.h"
+
+/* pcapng block types and options */
+#define BT_SHB 0x0A0D0D0A
+#define BT_IDB 0x00000001
+#define BT_EPB 0x00000006
+#define BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define OPT_ENDOFOPT 0
+#define OPT_COMMENT 1
+#define OPT_IF_NAME 2
+#define OPT_IF_TSRESOL 9
+
+/* Largest PD message : header, extended header and 260 bytes of data */
+#define PD_MAX_BYTES (2 + 2 + 260)
+#define SNAPLEN (sizeof(struct tc_pd_pseudo) + PD_MAX_BYTES + 4)
+
+/* Trace record : offsets of its words */
+#define TRACE_TS_LO 0
+#define TRACE_TAG 4
+#define TRACE_RX 8
+#define TRACE_PAYLOAD 12
+#define TRACE_PAYLOAD_SIZE 28
+#define TRACE_TS_HI 40
+
+struct pcap_if {
+	struct tc_clock clk;
+	/* extended message being reassembled from the trace records */
+	struct {
+		uint64_t ts;
+		struct tc_pd_pseudo pseudo;
+		int len;    /* bytes gathered (with the 2 header bytes) */
+		int total;  /* expected bytes */
+		int seq;    /* next continuation record */
+		uint8_t data[PD_MAX_BYTES];
+	} ext;
+};
+
+struct tc_pcapng {
+	FILE *f;
+	uint64_t count;
+	int if_count;
+	struct pcap_if *ifs;
+};
+
+static int put(struct tc_pcapng *p, const void *data, size_t len)
+{
+	return fwrite(data, 1, len, p->f) == len ? 0 : -1;
+}
+
+static int put32(struct tc_pcapng *p, uint32_t v)
+{
+	return put(p, &v, sizeof(v));
+}
+
+static int put16(struct tc_pcapng *p, uint16_t v)
+{
+	return put(p, &v, sizeof(v));
+}
+
+static int put_option(struct tc_pcapng *p, uint16_t code, const void *val,
+		      uint16_t len)
+{
+	static const uint8_t zero[3];
+
+	return put16(p, code) || put16(p, len) || put(p, val, len) ||
+	       put(p, zero, (4 - (len & 3)) & 3);
+}
+
+/* Interface Description Block */
+static int write_interface(struct tc_pcapng *p, const char *name)
+{
+	static const uint8_t tsresol = 6; /* microseconds */
+	uint16_t name_len = strlen(name);
+	/* block + if_name + if_tsresol + end of options */
+	uint32_t idb_len = 20 + 4 + ((name_len + 3) & ~3) + 8 + 4;
+
+	return put32(p, BT_IDB) || put32(p, idb_len) ||
+	       put16(p, TC_PCAPNG_LINKTYPE) || put16(p, 0) ||
+	       put32(p, SNAPLEN) ||
+	       put_option(p, OPT_IF_NAME, name, name_len) ||
+	       put_option(p, OPT_IF_TSRESOL, &tsresol, 1) ||
+	       put_option(p, OPT_ENDOFOPT, NULL, 0) ||
+	       put32(p, idb_len);
+}
+
+static int write_headers(struct tc_pcapng *p, const char * const *names)
+{
+	int i;
+
+	/* Section Header Block, section length unknown */
+	if (put32(p, BT_SHB) || put32(p, 28) || put32(p, BYTE_ORDER_MAGIC) ||
+	    put16(p, 1) || put16(p, 0) ||
+	    put32(p, 0xffffffff) || put32(p, 0xffffffff) || put32(p, 28))
+		return -1;
+	for (i = 0; i < p->if_count; i++)
+		if (write_interface(p, names[i]))
+			return -1;
+	return 0;
+}
+
+/*
+ * Enhanced Packet Block with the pseudo-header then the message, and the
+ * 'eop' of a received packet in 1/16 us after its timestamp (0 : unknown) as
+ * a comment.
+ */
+static int write_packet(struct tc_pcapng *p, int iface, uint64_t ts,
+			const struct tc_pd_pseudo *pseudo,
+			const uint8_t *msg, int len, uint16_t eop)
+{
+	static const uint8_t zero[3];
+	uint32_t cap = sizeof(*pseudo) + len;
+	uint32_t pad = (4 - (cap & 3)) & 3;
+	uint32_t blk_len = 32 + cap + pad;
+	char comment[32];
+	int comment_len = 0;
+
+	if (eop) {
+		comment_len = snprintf(comment, sizeof(comment),
+				       "eop +%u.%04u us", eop >> 4,
+				       (eop & 15) * 625);
+		/* comment + end of options */
+		blk_len += 4 + ((comment_len + 3) & ~3) + 4;
+	}
+	ts = tc_clock_map(&p->ifs[iface].clk, ts);
+	p->count++;
+	return put32(p, BT_EPB) || put32(p, blk_len) || put32(p, iface) ||
+	       put32(p, ts >> 32) || put32(p, ts) ||
+	       put32(p, cap) || put32(p, cap) ||
+	       put(p, pseudo, sizeof(*pseudo)) || put(p, msg, len) ||
+	       put(p, zero, pad) ||
+	       (eop && (put_option(p, OPT_COMMENT, comment, comment_len) ||
+			put_option(p, OPT_ENDOFOPT, NULL, 0))) ||
+	       put32(p, blk_len);
+}
+
+/* Write the extended message being reassembled, complete or not */
+static int flush_ext(struct tc_pcapng *p, int iface)
+{
+	struct pcap_if *pif = p->ifs + iface;
+	int rv = 0;
+
+	if (pif->ext.total)
+		rv = write_packet(p, iface, pif->ext.ts, &pif->ext.pseudo,
+				  pif->ext.data, pif->ext.len, 0);
+	pif->ext.total = 0;
+	return rv;
+}
+
+static int trace_record(struct tc_pcapng *p, int iface, const uint8_t *rec)
+{
+	struct pcap_if *pif = p->ifs + iface;
+	const uint8_t *payload = rec + TRACE_PAYLOAD;
+	uint16_t head = tc_get16(rec + TRACE_RX);
+	int16_t type = tc_get16(rec + TRACE_RX + 2);
+	struct tc_pd_pseudo pseudo = {
+		.version = TC_PD_PSEUDO_VERSION,
+		.sop = type < 0 ? TC_PD_SOP_ERROR : type,
+		.line = rec[TRACE_TS_HI + 1],
+	};
+	uint64_t ts = tc_packet_time(rec, TC_TRACE);
+	uint8_t msg[2 + TRACE_PAYLOAD_SIZE];
+	uint16_t ext = tc_get16(payload);
+	int tx = tc_get16(rec + TRACE_TAG + 2) == TC_TRACE_TX;
+	int n;
+
+	/* not a message */
+	if (tc_get16(rec + TRACE_TAG + 2) == TC_TRACE_VIOL ||
+	    tc_get16(rec + TRACE_TAG + 2) == TC_TRACE_REPEAT ||
+	    tc_get16(rec + TRACE_TAG + 2) == TC_TRACE_ERRWIN)
+		return 0;
+	if (tc_get16(rec + TRACE_TAG + 2) == TC_TRACE_NEXT) {
+		/* continuation of the reassembled message */
+		if (!pif->ext.total ||
+		    tc_get16(rec + TRACE_TAG) != pif->ext.seq)
+			return 0;
+		n = pif->ext.total - pif->ext.len;
+		if (n > TRACE_PAYLOAD_SIZE)
+			n = TRACE_PAYLOAD_SIZE;
+		memcpy(pif->ext.data + pif->ext.len, payload, n);
+		pif->ext.len += n;
+		pif->ext.seq++;
+		return pif->ext.len < pif->ext.total ? 0 : flush_ext(p, iface);
+	}
+
+	/* a new message : the previous one will not be completed */
+	if (flush_ext(p, iface))
+		return -1;
+
+	if (tx)
+		pseudo.flags |= TC_PD_FLAG_TX;
+	msg[0] = head;
+	msg[1] = head >> 8;
+	/* the frames we sent are traced as a single chunk */
+	if (!tx && type >= 0 && (head & 0x8000) && (ext & 0x8000)) {
+		/*
+		 * Chunked extended message reassembled by the device : the
+		 * extended header then its whole data, over several records.
+		 */
+		pif->ext.ts = ts;
+		pif->ext.pseudo = pseudo;
+		pif->ext.total = 2 + 2 + (ext & 0x1ff);
+		memcpy(pif->ext.data, msg, 2);
+		n = pif->ext.total - 2;
+		if (n > TRACE_PAYLOAD_SIZE)
+			n = TRACE_PAYLOAD_SIZE;
+		memcpy(pif->ext.data + 2, payload, n);
+		pif->ext.len = 2 + n;
+		pif->ext.seq = 1;
+		return pif->ext.len < pif->ext.total ? 0 : flush_ext(p, iface);
+	}
+
+	/* data objects of the header, nothing to trust on decoding errors */
+	n = type < 0 ? 0 : ((head >> 12) & 7) * 4;
+	memcpy(msg + 2, payload, n);
+	return write_packet(p, iface, ts, &pseudo, msg, 2 + n,
+			    tx ? 0 : tc_get16(rec + TC_TRACE_EOP));
+}
+
+static int stream_record(struct tc_pcapng *p, int iface, const uint8_t *pkt)
+{
+	uint16_t flags = tc_get16(pkt + 2);
+	const uint8_t *rec = pkt + TC_HEADER_SIZE;
+	int len = pkt[6];
+	struct tc_pd_pseudo pseudo = {
+		.version = TC_PD_PSEUDO_VERSION,
+		.line = flags & TC_FLAG_CC2 ? 2 : 1,
+		.flags = TC_PD_FLAG_CRC | TC_PD_FLAG_STREAM,
+	};
+
+	/* record type, SOP type, last sample index, then the message */
+	if ((flags & TC_FLAG_RECORD) != TC_FLAG_RECORD || len < 6 + 2 ||
+	    tc_get16(rec) != TC_REC_PACKET)
+		return 0;
+	pseudo.sop = tc_get16(rec + 2);
+	return write_packet(p, iface, tc_packet_time(pkt, TC_SNIFFER),
+			    &pseudo, rec + 6, len - 6, 0);
+}
+
+int tc_pcapng_data(struct tc_pcapng *p, int iface, const uint8_t *data,
+		   int len)
+{
+	uint8_t rec[TC_TRACE_SIZE];
+	int size, rv = 0;
+
+	while (len > 0 && !rv) {
+		switch (tc_packet(data, len, &size)) {
+		case TC_TRACE:
+			tc_trace_unpack(data, rec);
+			rv = trace_record(p, iface, rec);
+			break;
+		case TC_SNIFFER:
+			rv = stream_record(p, iface, data);
+			break;
+		default:
+			/* lost the packet boundaries, skip the transfer */
+			return 0;
+		}
+		data += size;
+		len -= size;
+	}
+	return rv;
+}
+
+int tc_pcapng_msg(struct tc_pcapng *p, int iface, uint64_t ts,
+		  const struct tc_pd_pseudo *pseudo, const uint8_t *msg,
+		  int len)
+{
+	return write_packet(p, iface, ts, pseudo, msg, len, 0);
+}
+
+struct tc_pcapng *tc_pcapng_open(const char *path, const char * const *names,
+				 int count)
+{
+	struct tc_pcapng *p = calloc(1, sizeof(*p));
+	int i;
+
+	if (!p)
+		return NULL;
+	p->ifs = calloc(count, sizeof(*p->ifs));
+	if (!p->ifs) {
+		free(p);
+		return NULL;
+	}
+	p->if_count = count;
+	for (i = 0; i < count; i++)
+		p->ifs[i].clk.rate = 1.0;
+	p->f = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+	if (!p->f) {
+		free(p->ifs);
+		free(p);
+		return NULL;
+	}
+	if (write_headers(p, names)) {
+		tc_pcapng_close(p);
+		return NULL;
+	}
+	return p;
+}
+
+void tc_pcapng_set_clock(struct tc_pcapng *p, int iface,
+			 const struct tc_clock *clk)
+{
+	p->ifs[iface].clk = *clk;
+}
+
+uint64_t tc_pcapng_count(const struct tc_pcapng *p)
+{
+	return p->count;
+}
+
+int tc_pcapng_close(struct tc_pcapng *p)
+{
+	int rv = 0;
+	int i;
+
+	for (i = 0; i < p->if_count; i++)
+		rv |= flush_ext(p, i);
+	if (p->f == stdout)
+		rv |= fflush(p->f);
+	else
+		rv |= fclose(p->f);
+	free(p->ifs);
+	free(p);
+	return rv ? -1 : 0;
+}
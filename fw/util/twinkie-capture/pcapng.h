@@ -0,0 +1,80 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * pcapng export of the USB-PD packets decoded by the twinkie.
+ *
+ * There is no registered link type for USB-PD, the interface uses
+ * LINKTYPE_USER0 (147) and every packet starts with the pseudo-header below,
+ * followed by the PD message as sent on the wire : 16-bit header, extended
+ * header if any, then the data objects, all little-endian. The timestamps
+ * are the device clock in microseconds (if_tsresol 6).
+ *
+ * The packets come from the trace records ('trace raw', extended messages
+ * reassembled from their continuation records) and from the decoded packet
+ * records of the sniffer stream ('sniffer decode on'), the other samples
+ * are skipped. Each capture merged into the file gets its own interface.
+ */
+
+#ifndef __TWINKIE_PCAPNG_H
+#define __TWINKIE_PCAPNG_H
+
+#include <stdint.h>
+
+#define TC_PCAPNG_LINKTYPE 147 /* LINKTYPE_USER0 */
+
+/* Pseudo-header, 4 bytes */
+struct tc_pd_pseudo {
+	uint8_t version; /* TC_PD_PSEUDO_VERSION */
+	uint8_t sop;     /* 0 SOP, 1 SOP', 2 SOP'', ... TC_PD_SOP_ERROR */
+	uint8_t line;    /* CC line : 1 or 2, 0 if unknown */
+	uint8_t flags;   /* TC_PD_FLAG_x */
+} __attribute__((packed));
+
+#define TC_PD_PSEUDO_VERSION 0
+/* Packet type of the messages the device could not decode */
+#define TC_PD_SOP_ERROR 0xff
+/* The message ends with its 4-byte CRC-32 */
+#define TC_PD_FLAG_CRC 0x01
+/* The packet comes from a sniffer stream record, else from a trace record */
+#define TC_PD_FLAG_STREAM 0x02
+/* The device sent the message itself (injector), timestamp of its first edge */
+#define TC_PD_FLAG_TX 0x04
+
+struct tc_pcapng;
+struct tc_clock;
+
+/*
+ * Create the file 'path' ("-" for stdout) with 'count' interfaces named
+ * 'names', returns NULL on error.
+ */
+struct tc_pcapng *tc_pcapng_open(const char *path, const char * const *names,
+				 int count);
+
+/*
+ * Convert the device packets of the 'len' bytes of 'data' captured on the
+ * interface 'iface', returns 0 on success or -1 if the file cannot be
+ * written.
+ */
+int tc_pcapng_data(struct tc_pcapng *p, int iface, const uint8_t *data,
+		   int len);
+
+/*
+ * Write the PD message 'msg' of 'len' bytes decoded on the host, at the
+ * device time 'ts', returns 0 on success or -1 if the file cannot be written.
+ */
+int tc_pcapng_msg(struct tc_pcapng *p, int iface, uint64_t ts,
+		  const struct tc_pd_pseudo *pseudo, const uint8_t *msg,
+		  int len);
+
+/* Map the device clock of the interface 'iface' to the file timebase */
+void tc_pcapng_set_clock(struct tc_pcapng *p, int iface,
+			 const struct tc_clock *clk);
+
+/* Number of PD messages written so far */
+uint64_t tc_pcapng_count(const struct tc_pcapng *p);
+
+/* Flush and close the file, returns 0 on success */
+int tc_pcapng_close(struct tc_pcapng *p);
+
+#endif /* __TWINKIE_PCAPNG_H */
@@ -0,0 +1,490 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/* Longest wait for the clients before handling the USB transfers again */
+#define POLL_MS 2
+/* Buffers handed to sendmsg() at once */
+#define IOV_COUNT 64
+
+/* Transfer shared by the queues of the clients */
+struct block {
+	int refs;
+	int len;
+	uint8_t data[];
+};
+
+/* Frame queued for a client */
+struct item {
+	struct item *next;
+	struct block *blk;    /* holding the payload, NULL if it follows */
+	const uint8_t *data;
+	uint32_t len;         /* payload bytes */
+	uint32_t sent;        /* bytes of header and payload sent */
+	uint8_t hdr[TC_NET_HDR_SIZE];
+};
+
+struct client {
+	int fd;               /* -1 for a free slot */
+	int gen;              /* incremented when the slot is freed */
+	uint32_t filter;      /* TC_NET_F_x, 0 until the client sets it */
+	uint8_t in[TC_NET_HDR_SIZE + TC_CMD_SIZE];
+	int in_len;
+	struct item *head;
+	struct item **tail;
+	size_t queued;        /* payload bytes of the data frames queued */
+	uint32_t lost;        /* data bytes dropped, not reported yet */
+};
+
+/* Command waiting for the device */
+struct cmd {
+	struct cmd *next;
+	int client;
+	int gen;
+	int len;
+	uint8_t text[TC_CMD_SIZE];
+};
+
+struct server {
+	struct tc_capture *c;
+	int fd;
+	struct client clients[TC_NET_CLIENTS];
+	struct cmd *cmds;     /* the first one runs on the device */
+	int cmd_running;
+};
+
+static void block_put(struct block *blk)
+{
+	if (blk && !--blk->refs)
+		free(blk);
+}
+
+static void put_header(uint8_t *hdr, uint16_t type, uint32_t len)
+{
+	hdr[0] = type;
+	hdr[1] = type >> 8;
+	hdr[2] = hdr[3] = 0;
+	hdr[4] = len;
+	hdr[5] = len >> 8;
+	hdr[6] = len >> 16;
+	hdr[7] = len >> 24;
+}
+
+static void enqueue(struct client *cl, struct item *it, uint16_t type)
+{
+	put_header(it->hdr, type, it->len);
+	it->next = NULL;
+	it->sent = 0;
+	*cl->tail = it;
+	cl->tail = &it->next;
+	if (type == TC_NET_DATA)
+		cl->queued += it->len;
+}
+
+/* Queue a frame with a copy of its payload */
+static int send_copy(struct client *cl, uint16_t type, const void *data,
+		     uint32_t len)
+{
+	struct item *it = malloc(sizeof(*it) + len);
+
+	if (!it)
+		return -1;
+	memcpy(it + 1, data, len);
+	it->blk = NULL;
+	it->data = (const uint8_t *)(it + 1);
+	it->len = len;
+	enqueue(cl, it, type);
+	return 0;
+}
+
+/* Queue the 'len' bytes of packets at 'data' in the block 'blk' */
+static void send_data(struct client *cl, struct block *blk,
+		      const uint8_t *data, uint32_t len)
+{
+	struct item *it;
+	uint8_t lost[4];
+
+	if (cl->queued + len > TC_NET_QUEUE_MAX) {
+		cl->lost += len;
+		return;
+	}
+	if (cl->lost) {
+		lost[0] = cl->lost;
+		lost[1] = cl->lost >> 8;
+		lost[2] = cl->lost >> 16;
+		lost[3] = cl->lost >> 24;
+		if (send_copy(cl, TC_NET_LOST, lost, sizeof(lost)))
+			return;
+		cl->lost = 0;
+	}
+	it = malloc(sizeof(*it));
+	if (!it) {
+		cl->lost += len;
+		return;
+	}
+	blk->refs++;
+	it->blk = blk;
+	it->data = data;
+	it->len = len;
+	enqueue(cl, it, TC_NET_DATA);
+}
+
+/* Does the filter 'f' take the device packet 'pkt' ? */
+static int wanted(uint32_t f, const uint8_t *pkt, enum tc_kind kind)
+{
+	uint16_t flags;
+
+	if (kind == TC_TRACE)
+		return f & TC_NET_F_TRACE;
+	flags = tc_get16(pkt + 2);
+	if ((flags & TC_FLAG_RECORD) == TC_FLAG_RECORD)
+		return f & TC_NET_F_RECORDS;
+	if (!(f & (flags & TC_FLAG_CC2 ? TC_NET_F_CC2 : TC_NET_F_CC1)))
+		return 0;
+	return f & (flags & TC_FLAG_IDLE ? TC_NET_F_IDLE : TC_NET_F_SAMPLES);
+}
+
+/* Queue the packets of the block 'blk' the client wants */
+static void fan_out(struct client *cl, struct block *blk)
+{
+	const uint8_t *data = blk->data, *run = NULL;
+	int len = blk->len, size;
+	enum tc_kind kind;
+
+	if (cl->filter == TC_NET_F_ALL) {
+		send_data(cl, blk, data, len);
+		return;
+	}
+	/* a frame per run of consecutive packets taken */
+	while (len > 0) {
+		kind = tc_packet(data, len, &size);
+		if (kind == TC_UNKNOWN)
+			/* lost the packet boundaries, drop the rest */
+			break;
+		if (wanted(cl->filter, data, kind)) {
+			if (!run)
+				run = data;
+		} else if (run) {
+			send_data(cl, blk, run, data - run);
+			run = NULL;
+		}
+		data += size;
+		len -= size;
+	}
+	if (run)
+		send_data(cl, blk, run, data - run);
+}
+
+/* Data callback : a single copy of the transfer for all the clients */
+static int serve_data(void *priv, const uint8_t *data, int len)
+{
+	struct server *s = priv;
+	struct block *blk = malloc(sizeof(*blk) + len);
+	int i;
+
+	if (!blk)
+		return 0;
+	blk->refs = 1;
+	blk->len = len;
+	memcpy(blk->data, data, len);
+	for (i = 0; i < TC_NET_CLIENTS; i++)
+		if (s->clients[i].fd >= 0 && s->clients[i].filter)
+			fan_out(s->clients + i, blk);
+	block_put(blk);
+	return 0;
+}
+
+static void close_client(struct client *cl)
+{
+	struct item *it, *next;
+
+	for (it = cl->head; it; it = next) {
+		next = it->next;
+		block_put(it->blk);
+		free(it);
+	}
+	close(cl->fd);
+	cl->fd = -1;
+	cl->gen++;
+	cl->head = NULL;
+	cl->tail = &cl->head;
+	cl->queued = 0;
+	cl->lost = 0;
+	cl->in_len = 0;
+	cl->filter = 0;
+}
+
+static void run_command(struct server *s);
+
+static void command_done(void *priv, const uint8_t *out, int len)
+{
+	struct server *s = priv;
+	struct cmd *cmd = s->cmds;
+	struct client *cl = s->clients + cmd->client;
+
+	if (cl->fd >= 0 && cl->gen == cmd->gen &&
+	    send_copy(cl, TC_NET_OUTPUT, out, len > 0 ? len : 0))
+		close_client(cl);
+	s->cmds = cmd->next;
+	s->cmd_running = 0;
+	free(cmd);
+	run_command(s);
+}
+
+/* Start the first command waiting, if the device is free */
+static void run_command(struct server *s)
+{
+	while (s->cmds && !s->cmd_running) {
+		s->cmd_running = 1;
+		if (tc_command(s->c, s->cmds->text, s->cmds->len,
+			       command_done, s))
+			/* answered as failed, then the next one */
+			command_done(s, NULL, -1);
+	}
+}
+
+/* Handle a whole frame received from the client 'i' */
+static int client_frame(struct server *s, int i, uint16_t type,
+			const uint8_t *data, int len)
+{
+	struct client *cl = s->clients + i;
+	struct cmd *cmd, **last;
+
+	switch (type) {
+	case TC_NET_FILTER:
+		if (len < 4)
+			return -1;
+		cl->filter = tc_get32(data) & TC_NET_F_ALL;
+		return 0;
+	case TC_NET_COMMAND:
+		cmd = malloc(sizeof(*cmd));
+		if (!cmd)
+			return -1;
+		cmd->next = NULL;
+		cmd->client = i;
+		cmd->gen = cl->gen;
+		cmd->len = len;
+		memcpy(cmd->text, data, len);
+		for (last = &s->cmds; *last; last = &(*last)->next)
+			;
+		*last = cmd;
+		run_command(s);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int client_read(struct server *s, int i)
+{
+	struct client *cl = s->clients + i;
+	uint32_t len;
+	ssize_t n;
+
+	n = read(cl->fd, cl->in + cl->in_len, cl->in_len < TC_NET_HDR_SIZE ?
+		 TC_NET_HDR_SIZE - cl->in_len :
+		 TC_NET_HDR_SIZE + tc_get32(cl->in + 4) - cl->in_len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return -1;
+	cl->in_len += n;
+	if (cl->in_len < TC_NET_HDR_SIZE)
+		return 0;
+	len = tc_get32(cl->in + 4);
+	if (len > TC_CMD_SIZE)
+		return -1;
+	if (cl->in_len < TC_NET_HDR_SIZE + len)
+		return 0;
+	cl->in_len = 0;
+	return client_frame(s, i, tc_get16(cl->in), cl->in + TC_NET_HDR_SIZE,
+			    len);
+}
+
+/* Send what the socket takes of the queue of 'cl' */
+static int client_write(struct client *cl)
+{
+	struct iovec iov[IOV_COUNT];
+	struct msghdr msg = { .msg_iov = iov };
+	struct item *it;
+	uint32_t off;
+	ssize_t n;
+	int k = 0;
+
+	for (it = cl->head; it && k + 2 <= IOV_COUNT; it = it->next) {
+		off = it->sent;
+		if (off < TC_NET_HDR_SIZE) {
+			iov[k].iov_base = it->hdr + off;
+			iov[k++].iov_len = TC_NET_HDR_SIZE - off;
+			off = TC_NET_HDR_SIZE;
+		}
+		if (it->len) {
+			iov[k].iov_base = (void *)(it->data + off -
+						   TC_NET_HDR_SIZE);
+			iov[k++].iov_len = it->len + TC_NET_HDR_SIZE - off;
+		}
+	}
+	msg.msg_iovlen = k;
+	n = sendmsg(cl->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	while ((it = cl->head) && n > 0) {
+		off = TC_NET_HDR_SIZE + it->len - it->sent;
+		if (n < off) {
+			it->sent += n;
+			break;
+		}
+		n -= off;
+		cl->head = it->next;
+		if (!cl->head)
+			cl->tail = &cl->head;
+		if (tc_get16(it->hdr) == TC_NET_DATA)
+			cl->queued -= it->len;
+		block_put(it->blk);
+		free(it);
+	}
+	return 0;
+}
+
+static void accept_client(struct server *s)
+{
+	struct client *cl = NULL;
+	int fd, one = 1, i;
+
+	fd = accept(s->fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	for (i = 0; i < TC_NET_CLIENTS && !cl; i++)
+		if (s->clients[i].fd < 0)
+			cl = s->clients + i;
+	if (!cl) {
+		fprintf(stderr, "too many clients\n");
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	cl->fd = fd;
+}
+
+/* Are frames waiting for a client ? */
+static int queued(const struct server *s)
+{
+	int i;
+
+	for (i = 0; i < TC_NET_CLIENTS; i++)
+		if (s->clients[i].fd >= 0 && s->clients[i].head)
+			return 1;
+	return 0;
+}
+
+static int listen_on(int port)
+{
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(port),
+		.sin6_addr = IN6ADDR_ANY_INIT,
+	};
+	int fd = socket(AF_INET6, SOCK_STREAM, 0), one = 1, zero = 0;
+
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* IPv4 clients too */
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, TC_NET_CLIENTS)) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+int tc_serve(struct tc_capture *c, int port, volatile sig_atomic_t *stop)
+{
+	struct server s = { .c = c };
+	struct pollfd fds[1 + TC_NET_CLIENTS];
+	int slot[1 + TC_NET_CLIENTS];
+	int i, n, rv = 0, running = 1;
+	struct cmd *cmd;
+
+	for (i = 0; i < TC_NET_CLIENTS; i++) {
+		s.clients[i].fd = -1;
+		s.clients[i].tail = &s.clients[i].head;
+	}
+	s.fd = listen_on(port);
+	if (s.fd < 0) {
+		perror("listen");
+		return -1;
+	}
+	if (tc_start(c, serve_data, &s)) {
+		fprintf(stderr, "cannot submit the transfers\n");
+		close(s.fd);
+		return -1;
+	}
+
+	while (!*stop) {
+		/* the device first : its transfers hold the data */
+		if (running) {
+			rv = tc_poll(c, 0);
+			running = rv > 0;
+		}
+		/* once the capture ends, until the clients got everything */
+		if (!running && !queued(&s))
+			break;
+
+		fds[0].fd = s.fd;
+		fds[0].events = POLLIN;
+		for (i = 0, n = 1; i < TC_NET_CLIENTS; i++) {
+			if (s.clients[i].fd < 0)
+				continue;
+			fds[n].fd = s.clients[i].fd;
+			fds[n].events = POLLIN |
+					(s.clients[i].head ? POLLOUT : 0);
+			slot[n++] = i;
+		}
+		if (poll(fds, n, POLL_MS) < 0) {
+			if (errno == EINTR)
+				continue;
+			rv = -1;
+			break;
+		}
+		if (fds[0].revents & POLLIN)
+			accept_client(&s);
+		for (i = 1; i < n; i++) {
+			struct client *cl = s.clients + slot[i];
+
+			if (((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+			     client_read(&s, slot[i])) ||
+			    ((fds[i].revents & POLLOUT) && client_write(cl)))
+				close_client(cl);
+		}
+	}
+
+	tc_stop(c);
+	for (i = 0; i < TC_NET_CLIENTS; i++)
+		if (s.clients[i].fd >= 0)
+			close_client(s.clients + i);
+	while ((cmd = s.cmds)) {
+		s.cmds = cmd->next;
+		free(cmd);
+	}
+	close(s.fd);
+	return rv < 0 ? -1 : 0;
+}
@@ -0,0 +1,57 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Network server of the sniffer stream and of the console commands.
+ *
+ * The server owns the device : the sniffer endpoint is read once and each
+ * transfer is copied once into a shared block, which every client queue
+ * references (no copy per client). Each client picks the device packets it
+ * wants with a filter, the frames sent to it point at the packets kept in
+ * the shared blocks. A client which does not keep up loses data frames
+ * (reported with TC_NET_LOST) instead of holding back the others.
+ *
+ * The protocol runs over TCP, both ways as frames : a 8-byte header (16-bit
+ * type, 16-bit reserved, 32-bit payload length, little-endian) followed by
+ * the payload.
+ */
+
+#ifndef __TWINKIE_SERVER_H
+#define __TWINKIE_SERVER_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "capture.h"
+
+#define TC_NET_PORT 9500
+#define TC_NET_HDR_SIZE 8
+
+/* Client to server */
+#define TC_NET_FILTER   1 /* 32-bit TC_NET_F_x, no data before the first */
+#define TC_NET_COMMAND  2 /* console commands, up to TC_CMD_SIZE bytes */
+/* Server to client */
+#define TC_NET_DATA     3 /* whole device packets, as a flat capture */
+#define TC_NET_OUTPUT   4 /* output of a command, empty if it failed */
+#define TC_NET_LOST     5 /* 32-bit bytes of data dropped for the client */
+
+/* Device packets sent to a client */
+#define TC_NET_F_SAMPLES (1 << 0) /* raw or packed edge samples */
+#define TC_NET_F_IDLE    (1 << 1) /* idle markers */
+#define TC_NET_F_RECORDS (1 << 2) /* typed records (TC_REC_x) */
+#define TC_NET_F_TRACE   (1 << 3) /* trace records */
+#define TC_NET_F_CC1     (1 << 4) /* samples and markers of CC1 ... */
+#define TC_NET_F_CC2     (1 << 5) /* ... and of CC2 */
+#define TC_NET_F_ALL     0x3f
+
+/* Data queued for a client before its frames get dropped */
+#define TC_NET_QUEUE_MAX (4 * 1024 * 1024)
+#define TC_NET_CLIENTS 16
+
+/*
+ * Capture with 'c' and serve the stream on the TCP port 'port' until
+ * 'stop' is set or the capture stops. Returns 0 or -1 on error.
+ */
+int tc_serve(struct tc_capture *c, int port, volatile sig_atomic_t *stop);
+
+#endif /* __TWINKIE_SERVER_H */
@@ -0,0 +1,136 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "sync.h"
+
+static int pulse_add(struct tc_pulses *pulses, uint64_t ts, int role,
+		     uint16_t raw)
+{
+	struct tc_pulse *p;
+	uint32_t num;
+
+	if (pulses->count == pulses->size) {
+		int size = pulses->size ? pulses->size * 2 : 256;
+
+		p = realloc(pulses->p, size * sizeof(*p));
+		if (!p)
+			return -1;
+		pulses->p = p;
+		pulses->size = size;
+	}
+
+	if (!pulses->count) {
+		num = raw;
+	} else if (role == TC_PULSE_MASTER) {
+		num = pulses->p[pulses->count - 1].num +
+		      (uint16_t)(raw - pulses->last_raw);
+	} else {
+		/* a repeated code is a full round of missed pulses */
+		int diff = (raw - pulses->last_raw) & (TC_PULSE_CODES - 1);
+
+		num = pulses->p[pulses->count - 1].num +
+		      (diff ? diff : TC_PULSE_CODES);
+	}
+	pulses->last_raw = raw;
+	pulses->role = role;
+	p = pulses->p + pulses->count++;
+	p->ts = ts;
+	p->num = num;
+	return 0;
+}
+
+int tc_pulses_parse(struct tc_pulses *pulses, const uint8_t *data, int len)
+{
+	const uint8_t *rec;
+	int size;
+
+	while (len > 0) {
+		switch (tc_packet(data, len, &size)) {
+		case TC_SNIFFER:
+			rec = data + TC_HEADER_SIZE;
+			if ((tc_get16(data + 2) & TC_FLAG_RECORD) ==
+			    TC_FLAG_RECORD && data[6] >= 6 &&
+			    tc_get16(rec) == TC_REC_PULSE &&
+			    pulse_add(pulses, tc_packet_time(data, TC_SNIFFER),
+				      tc_get16(rec + 4), tc_get16(rec + 2)))
+				return -1;
+			break;
+		case TC_TRACE:
+			break;
+		default:
+			/* look for the next packet boundary */
+			size = 1;
+			break;
+		}
+		data += size;
+		len -= size;
+	}
+	return 0;
+}
+
+void tc_pulses_free(struct tc_pulses *pulses)
+{
+	free(pulses->p);
+	memset(pulses, 0, sizeof(*pulses));
+}
+
+int tc_clock_fit(struct tc_clock *clk, const struct tc_pulses *slave,
+		 const struct tc_pulses *master)
+{
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	uint64_t x0 = 0, y0 = 0;
+	int64_t shift;
+	int i = 0, j = 0, n = 0;
+
+	clk->dev_ref = clk->ref = 0;
+	clk->rate = 1.0;
+	if (!slave->count || !master->count)
+		return 0;
+
+	/* the slave numbers closest to the master ones at the start */
+	shift = (int64_t)master->p[0].num - slave->p[0].num;
+	shift = (shift + (shift >= 0 ? 1 : -1) * TC_PULSE_CODES / 2) /
+		TC_PULSE_CODES * TC_PULSE_CODES;
+
+	while (i < slave->count && j < master->count) {
+		int64_t d = (int64_t)slave->p[i].num + shift -
+			    master->p[j].num;
+		double x, y;
+
+		if (d < 0) {
+			i++;
+			continue;
+		}
+		if (d > 0) {
+			j++;
+			continue;
+		}
+		if (!n) {
+			x0 = slave->p[i].ts;
+			y0 = master->p[j].ts;
+		}
+		x = (double)(int64_t)(slave->p[i].ts - x0);
+		y = (double)(int64_t)(master->p[j].ts - y0);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+		n++;
+		i++;
+		j++;
+	}
+	if (!n)
+		return 0;
+
+	clk->dev_ref = x0 + (int64_t)(sx / n);
+	clk->ref = y0 + (int64_t)(sy / n);
+	if (n > 1 && sxx - sx * sx / n > 0)
+		clk->rate = (sxy - sx * sy / n) / (sxx - sx * sx / n);
+	return n;
+}
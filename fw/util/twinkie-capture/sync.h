@@ -0,0 +1,60 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Common timebase of several twinkies wired together by their SYNC pin.
+ *
+ * The master sends a pulse on every sync period ('sniffer pulse master'),
+ * each device records the rising edge on its own clock ('sniffer pulse
+ * slave' on the others). The pulse numbers pair the records of a slave
+ * with the master ones, a least-squares fit over the pairs then maps the
+ * slave clock (offset and drift) to the master clock.
+ *
+ * The slaves only get the pulse number modulo TC_PULSE_CODES : the
+ * captures must be started within half of that many sync periods (1.6 s
+ * with the default 100 ms period) of each other.
+ */
+
+#ifndef __TWINKIE_SYNC_H
+#define __TWINKIE_SYNC_H
+
+#include <stdint.h>
+
+/* Device clock mapping : t = ref + (ts - dev_ref) * rate */
+struct tc_clock {
+	uint64_t dev_ref;
+	uint64_t ref;
+	double rate;
+};
+
+static inline uint64_t tc_clock_map(const struct tc_clock *clk, uint64_t ts)
+{
+	return clk->ref + (int64_t)((double)(int64_t)(ts - clk->dev_ref) *
+				    clk->rate);
+}
+
+/* Pulse records of a capture */
+struct tc_pulses {
+	int role;  /* TC_PULSE_x of the device, 0 until a record is seen */
+	uint16_t last_raw; /* pulse number of the last record */
+	int count;
+	int size;
+	struct tc_pulse {
+		uint64_t ts;
+		uint32_t num; /* unwrapped pulse number */
+	} *p;
+};
+
+/* Add the pulse records of the device packets of 'data' */
+int tc_pulses_parse(struct tc_pulses *pulses, const uint8_t *data, int len);
+
+void tc_pulses_free(struct tc_pulses *pulses);
+
+/*
+ * Fit the clock of the 'slave' pulses to the 'master' ones.
+ * Returns the number of paired pulses, the clock is the identity if none.
+ */
+int tc_clock_fit(struct tc_clock *clk, const struct tc_pulses *slave,
+		 const struct tc_pulses *master);
+
+#endif /* __TWINKIE_SYNC_H */
@@ -0,0 +1,415 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "tcap.h"
+
+/* Packet types of the trace and packet records, as tcpm_transmit_type */
+#define SOP_HARD_RESET  5
+#define SOP_CABLE_RESET 6
+
+/* Trace record : offsets of its words */
+#define TRACE_TAG 4
+#define TRACE_RX 8
+
+struct tc_cap_writer {
+	FILE *f;
+	uint64_t pos;       /* bytes written */
+	uint8_t *buf;       /* packets of the chunk being gathered */
+	int len;
+	int last_seq;
+	uint64_t ts_max;
+	struct tc_cap_index *dir;
+	int count;
+	int size;
+};
+
+struct tc_cap {
+	const uint8_t *map;
+	size_t map_len;
+	const struct tc_cap_index *dir;
+	struct tc_cap_index *own_dir; /* rebuilt from the chunk headers */
+	int count;
+};
+
+/* zlib CRC-32 */
+static uint32_t crc32(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t crc = 0xffffffff;
+	int k;
+
+	while (len--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+	}
+	return ~crc;
+}
+
+/* Account the PD message header 'head' of the SOP* type 'sop' */
+static void index_msg(struct tc_cap_index *idx, int sop, uint16_t head)
+{
+	if (sop < 0 || sop == 0xff) {
+		idx->events |= TC_CAP_EV_DECODE_ERROR;
+		return;
+	}
+	if (sop == SOP_HARD_RESET) {
+		idx->events |= TC_CAP_EV_HARD_RESET;
+		return;
+	}
+	if (sop == SOP_CABLE_RESET) {
+		idx->events |= TC_CAP_EV_CABLE_RESET;
+		return;
+	}
+	idx->messages++;
+	if (head & 0x8000)
+		idx->ext_types |= 1 << (head & 0x1f);
+	else if (head & 0x7000)
+		idx->data_types |= 1 << (head & 0x1f);
+	else
+		idx->ctrl_types |= 1 << (head & 0x1f);
+}
+
+static void index_trace(struct tc_cap_index *idx, const uint8_t *pkt)
+{
+	uint8_t rec[TC_TRACE_SIZE];
+	uint16_t tag;
+
+	tc_trace_unpack(pkt, rec);
+	tag = tc_get16(rec + TRACE_TAG + 2);
+	if (tag == TC_TRACE_VIOL)
+		idx->events |= TC_CAP_EV_VIOLATION;
+	else if (tag == TC_TRACE_REPEAT)
+		idx->messages += tc_get32(rec + 12);
+	else if (tag == TC_TRACE_FIRST && tc_get16(rec + 4))
+		idx->events |= TC_CAP_EV_DROPPED;
+	if (tag == TC_TRACE_TX)
+		idx->events |= TC_CAP_EV_TX;
+	/* the continuation records carry no header */
+	if (tag == TC_TRACE_FIRST || tag == TC_TRACE_TX)
+		index_msg(idx, (int16_t)tc_get16(rec + TRACE_RX + 2),
+			  tc_get16(rec + TRACE_RX));
+}
+
+static void index_stream(struct tc_cap_index *idx, const uint8_t *pkt,
+			 int *last_seq)
+{
+	uint16_t flags = tc_get16(pkt + 2);
+	uint16_t seq = tc_get16(pkt + 4);
+	const uint8_t *rec = pkt + TC_HEADER_SIZE;
+	int len = pkt[6];
+
+	if (*last_seq >= 0 && seq != (uint16_t)(*last_seq + 1))
+		idx->events |= TC_CAP_EV_SEQ_GAP;
+	*last_seq = seq;
+	if (flags & TC_FLAG_OFLOW)
+		idx->events |= TC_CAP_EV_OFLOW;
+	if (flags & TC_FLAG_TRIGGER)
+		idx->events |= TC_CAP_EV_TRIGGER;
+	if ((flags & TC_FLAG_RECORD) != TC_FLAG_RECORD || len < 4)
+		return;
+	switch (tc_get16(rec)) {
+	case TC_REC_PACKET:
+		index_msg(idx, tc_get16(rec + 2),
+			  len >= 6 + 2 ? tc_get16(rec + 6) : 0);
+		break;
+	case TC_REC_EVENT:
+		/* a reset, else a packet the device failed to decode */
+		if (tc_get16(rec + 2) == SOP_HARD_RESET)
+			idx->events |= TC_CAP_EV_HARD_RESET;
+		else if (tc_get16(rec + 2) == SOP_CABLE_RESET)
+			idx->events |= TC_CAP_EV_CABLE_RESET;
+		else
+			idx->events |= TC_CAP_EV_DECODE_ERROR;
+		break;
+	case TC_REC_INPUT:
+		idx->events |= TC_CAP_EV_INPUT;
+		break;
+	case TC_REC_SUSPEND:
+		idx->events |= TC_CAP_EV_SUSPEND;
+		break;
+	case TC_REC_BOOKMARK:
+		idx->events |= TC_CAP_EV_BOOKMARK;
+		break;
+	}
+}
+
+/* Index the 'len' bytes of packets of 'data' */
+static void index_chunk(struct tc_cap_writer *w, const uint8_t *data,
+			int len, struct tc_cap_index *idx)
+{
+	enum tc_kind kind;
+	uint64_t ts;
+	int size;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->magic = TC_CAP_CHUNK_MAGIC;
+	idx->len = len;
+	idx->ts_min = UINT64_MAX;
+	while (len > 0) {
+		kind = tc_packet(data, len, &size);
+		if (kind == TC_UNKNOWN) {
+			data++;
+			len--;
+			continue;
+		}
+		idx->packets++;
+		ts = tc_packet_time(data, kind);
+		if (ts < idx->ts_min)
+			idx->ts_min = ts;
+		if (ts > w->ts_max)
+			w->ts_max = ts;
+		if (kind == TC_TRACE)
+			index_trace(idx, data);
+		else
+			index_stream(idx, data, &w->last_seq);
+		data += size;
+		len -= size;
+	}
+	if (!idx->packets)
+		idx->ts_min = w->ts_max;
+	idx->ts_max = w->ts_max;
+}
+
+static int put(struct tc_cap_writer *w, const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, w->f) != len)
+		return -1;
+	w->pos += len;
+	return 0;
+}
+
+static int write_chunk(struct tc_cap_writer *w, const uint8_t *data, int len)
+{
+	struct tc_cap_index *idx;
+
+	if (!len)
+		return 0;
+	if (w->count == w->size) {
+		idx = realloc(w->dir, (w->size * 2 + 64) * sizeof(*idx));
+		if (!idx)
+			return -1;
+		w->dir = idx;
+		w->size = w->size * 2 + 64;
+	}
+	idx = w->dir + w->count++;
+	index_chunk(w, data, len, idx);
+	idx->offset = w->pos + sizeof(*idx);
+	return put(w, idx, sizeof(*idx)) || put(w, data, len);
+}
+
+static int flush_chunk(struct tc_cap_writer *w)
+{
+	int rv = write_chunk(w, w->buf, w->len);
+
+	w->len = 0;
+	return rv;
+}
+
+struct tc_cap_writer *tc_cap_create(const char *path)
+{
+	struct tc_cap_writer *w = calloc(1, sizeof(*w));
+	struct tc_cap_header hdr = {
+		.magic = TC_CAP_MAGIC,
+		.chunk_size = TC_CAP_CHUNK_SIZE,
+	};
+
+	if (!w)
+		return NULL;
+	w->last_seq = -1;
+	w->buf = malloc(TC_CAP_CHUNK_SIZE);
+	w->f = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+	if (!w->buf || !w->f || put(w, &hdr, sizeof(hdr))) {
+		if (w->f && w->f != stdout)
+			fclose(w->f);
+		free(w->buf);
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+int tc_cap_write(struct tc_cap_writer *w, const uint8_t *data, int len)
+{
+	/* the chunks end on the boundaries of the transfers */
+	if (w->len + len > TC_CAP_CHUNK_SIZE && flush_chunk(w))
+		return -1;
+	/* a larger transfer makes a chunk of its own */
+	if (len > TC_CAP_CHUNK_SIZE)
+		return write_chunk(w, data, len);
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+	return 0;
+}
+
+int tc_cap_finish(struct tc_cap_writer *w)
+{
+	struct tc_cap_trailer trailer = { .magic = TC_CAP_DIR_MAGIC };
+	int rv;
+
+	rv = flush_chunk(w);
+	trailer.dir_offset = w->pos;
+	trailer.count = w->count;
+	trailer.crc = crc32(w->dir, w->count * sizeof(*w->dir));
+	rv = rv || put(w, w->dir, w->count * sizeof(*w->dir)) ||
+	     put(w, &trailer, sizeof(trailer));
+	if (w->f == stdout)
+		rv = fflush(w->f) || rv;
+	else
+		rv = fclose(w->f) || rv;
+	free(w->dir);
+	free(w->buf);
+	free(w);
+	return rv ? -1 : 0;
+}
+
+int tc_cap_probe(const uint8_t *data, size_t len)
+{
+	return len >= sizeof(struct tc_cap_header) &&
+	       !memcmp(data, TC_CAP_MAGIC, 8);
+}
+
+/* Rebuild the directory of a file without trailer from the chunk headers */
+static int rebuild_dir(struct tc_cap *c)
+{
+	size_t pos = sizeof(struct tc_cap_header);
+	struct tc_cap_index idx, *dir;
+	int size = 0;
+
+	while (pos + sizeof(idx) <= c->map_len) {
+		memcpy(&idx, c->map + pos, sizeof(idx));
+		if (idx.magic != TC_CAP_CHUNK_MAGIC ||
+		    idx.offset != pos + sizeof(idx) ||
+		    idx.len > c->map_len - idx.offset)
+			break;
+		if (c->count == size) {
+			dir = realloc(c->own_dir,
+				      (size * 2 + 64) * sizeof(*dir));
+			if (!dir)
+				return -1;
+			c->own_dir = dir;
+			size = size * 2 + 64;
+		}
+		c->own_dir[c->count++] = idx;
+		pos = idx.offset + idx.len;
+	}
+	c->dir = c->own_dir;
+	return 0;
+}
+
+struct tc_cap *tc_cap_open(const char *path)
+{
+	struct tc_cap *c = calloc(1, sizeof(*c));
+	struct tc_cap_trailer trailer;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (!c)
+		return NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) || !st.st_size) {
+		if (fd >= 0)
+			close(fd);
+		free(c);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		free(c);
+		return NULL;
+	}
+	c->map = map;
+	c->map_len = st.st_size;
+	if (!tc_cap_probe(c->map, c->map_len)) {
+		tc_cap_close(c);
+		return NULL;
+	}
+
+	if (c->map_len >= sizeof(struct tc_cap_header) + sizeof(trailer)) {
+		memcpy(&trailer, c->map + c->map_len - sizeof(trailer),
+		       sizeof(trailer));
+		if (!memcmp(trailer.magic, TC_CAP_DIR_MAGIC, 8) &&
+		    trailer.dir_offset + (uint64_t)trailer.count *
+		    sizeof(struct tc_cap_index) + sizeof(trailer) ==
+		    c->map_len &&
+		    crc32(c->map + trailer.dir_offset, trailer.count *
+			  sizeof(struct tc_cap_index)) == trailer.crc) {
+			c->dir = (const struct tc_cap_index *)
+				 (c->map + trailer.dir_offset);
+			c->count = trailer.count;
+			return c;
+		}
+	}
+	if (rebuild_dir(c)) {
+		tc_cap_close(c);
+		return NULL;
+	}
+	return c;
+}
+
+void tc_cap_close(struct tc_cap *c)
+{
+	munmap((void *)c->map, c->map_len);
+	free(c->own_dir);
+	free(c);
+}
+
+int tc_cap_count(const struct tc_cap *c)
+{
+	return c->count;
+}
+
+const struct tc_cap_index *tc_cap_index(const struct tc_cap *c, int i)
+{
+	return c->dir + i;
+}
+
+const uint8_t *tc_cap_chunk(const struct tc_cap *c, int i, size_t *len)
+{
+	*len = c->dir[i].len;
+	return c->map + c->dir[i].offset;
+}
+
+int tc_cap_seek(const struct tc_cap *c, uint64_t ts)
+{
+	int lo = 0, hi = c->count, mid;
+
+	/* ts_max never decreases */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->dir[mid].ts_max < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int tc_cap_find(const struct tc_cap *c, int from,
+		const struct tc_cap_index *mask)
+{
+	const struct tc_cap_index *idx;
+
+	for (; from < c->count; from++) {
+		idx = c->dir + from;
+		if ((idx->ctrl_types & mask->ctrl_types) ||
+		    (idx->data_types & mask->data_types) ||
+		    (idx->ext_types & mask->ext_types) ||
+		    (idx->events & mask->events))
+			return from;
+	}
+	return -1;
+}
@@ -0,0 +1,115 @@
+/* Copyright 2017 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Indexed capture container.
+ *
+ * The device packets are stored as in a flat capture, back to back, but in
+ * chunks of about TC_CAP_CHUNK_SIZE bytes, each one preceded by its index
+ * entry : timestamp range, types of the PD messages and events it holds.
+ * A trailer at the end of the file repeats all the index entries, so a
+ * reader maps the file and finds a time or an event from the directory
+ * alone (binary search on the time), then only touches the chunks it
+ * needs. A file without its trailer (capture interrupted) is indexed again
+ * from the chunk headers. All the fields are little-endian.
+ *
+ *   file header | chunk header, packets | ... | directory | trailer
+ */
+
+#ifndef __TWINKIE_TCAP_H
+#define __TWINKIE_TCAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TC_CAP_MAGIC       "TWKCAP01"
+#define TC_CAP_CHUNK_MAGIC 0x4b4e4843 /* "CHNK" */
+#define TC_CAP_DIR_MAGIC   "TWKCAPIX"
+/* Packets gathered in a chunk before it is written */
+#define TC_CAP_CHUNK_SIZE (1024 * 1024)
+
+/* Events of a chunk */
+#define TC_CAP_EV_HARD_RESET   (1 << 0)
+#define TC_CAP_EV_CABLE_RESET  (1 << 1)
+#define TC_CAP_EV_DECODE_ERROR (1 << 2)  /* message the device failed */
+#define TC_CAP_EV_OFLOW        (1 << 3)  /* samples lost by the device */
+#define TC_CAP_EV_SEQ_GAP      (1 << 4)  /* packets lost on the way */
+#define TC_CAP_EV_VIOLATION    (1 << 5)  /* protocol checker */
+#define TC_CAP_EV_TX           (1 << 6)  /* frame sent by the injector */
+#define TC_CAP_EV_TRIGGER      (1 << 7)  /* trigger post window */
+#define TC_CAP_EV_INPUT        (1 << 8)  /* trigger input edge */
+#define TC_CAP_EV_SUSPEND      (1 << 9)  /* host suspend */
+#define TC_CAP_EV_DROPPED      (1 << 10) /* trace records dropped */
+#define TC_CAP_EV_BOOKMARK     (1 << 11) /* host bookmark */
+
+struct tc_cap_header {
+	char magic[8];       /* TC_CAP_MAGIC */
+	uint32_t chunk_size; /* TC_CAP_CHUNK_SIZE of the writer */
+	uint32_t reserved;
+} __attribute__((packed));
+
+/* Index entry of a chunk, 64 bytes */
+struct tc_cap_index {
+	uint32_t magic;      /* TC_CAP_CHUNK_MAGIC */
+	uint32_t len;        /* bytes of device packets */
+	uint64_t offset;     /* of the packets in the file */
+	uint64_t ts_min;     /* lowest device time in the chunk, in us */
+	uint64_t ts_max;     /* highest one up to the end of the chunk */
+	uint32_t packets;    /* device packets */
+	uint32_t messages;   /* PD messages, from trace or packet records */
+	uint32_t ctrl_types; /* bit n : control message of type n */
+	uint32_t data_types; /* bit n : data message of type n */
+	uint32_t ext_types;  /* bit n : extended message of type n */
+	uint32_t events;     /* TC_CAP_EV_x */
+	uint32_t reserved[2];
+} __attribute__((packed));
+
+struct tc_cap_trailer {
+	char magic[8];       /* TC_CAP_DIR_MAGIC */
+	uint64_t dir_offset; /* of the first of the 'count' index entries */
+	uint32_t count;
+	uint32_t crc;        /* CRC-32 of the directory */
+} __attribute__((packed));
+
+struct tc_cap_writer;
+struct tc_cap;
+
+/* Create the container 'path' ("-" for stdout), NULL on error */
+struct tc_cap_writer *tc_cap_create(const char *path);
+
+/*
+ * Add the 'len' bytes of device packets of 'data' (whole packets),
+ * returns 0 on success or -1 if the file cannot be written.
+ */
+int tc_cap_write(struct tc_cap_writer *w, const uint8_t *data, int len);
+
+/* Write the last chunk and the directory, returns 0 on success */
+int tc_cap_finish(struct tc_cap_writer *w);
+
+/* Is 'data' the start of a container ? */
+int tc_cap_probe(const uint8_t *data, size_t len);
+
+/* Map the container 'path', NULL on error */
+struct tc_cap *tc_cap_open(const char *path);
+
+void tc_cap_close(struct tc_cap *c);
+
+/* Number of chunks */
+int tc_cap_count(const struct tc_cap *c);
+
+const struct tc_cap_index *tc_cap_index(const struct tc_cap *c, int i);
+
+/* Device packets of the chunk 'i', 'len' bytes */
+const uint8_t *tc_cap_chunk(const struct tc_cap *c, int i, size_t *len);
+
+/* First chunk which may hold a packet at or after 'ts', count if none */
+int tc_cap_seek(const struct tc_cap *c, uint64_t ts);
+
+/*
+ * First chunk from 'from' with one of the message types or events of
+ * 'mask' (its bitmaps), -1 if none.
+ */
+int tc_cap_find(const struct tc_cap *c, int from,
+		const struct tc_cap_index *mask);
+
+#endif /* __TWINKIE_TCAP_H */
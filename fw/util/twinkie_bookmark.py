@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Insert a bookmark in the sniffer stream (INJ_BIN_BOOKMARK):
+#
+#   twinkie_bookmark.py <tag> [<seq>]
+#
+# The tag is a 32-bit number, the device timestamps the bookmark record
+# when the request reaches its command endpoint. There is no response.
+
+import struct
+from sys import argv
+
+INJ_BIN_MAGIC = 0xB1
+INJ_BIN_BOOKMARK = 16
+# USB_EP_COMMAND, its interface number depends on the image running
+COMMANDS_EP = 2
+TIMEOUT_MS = 1000
+
+
+def commands_iface(handle):
+    for setting in handle.getDevice().iterSettings():
+        for ep in setting:
+            if ep.getAddress() == COMMANDS_EP:
+                return setting.getNumber()
+    raise SystemExit("no commands interface")
+
+
+def main(args):
+    import usb1
+
+    if len(args) not in (1, 2):
+        raise SystemExit("usage: %s <tag> [<seq>]" % argv[0])
+    tag = int(args[0], 0) & 0xFFFFFFFF
+    seq = int(args[1], 0) & 0xFFFF if len(args) == 2 else 0
+
+    context = usb1.USBContext()
+    handle = context.openByVendorIDAndProductID(0x18D1, 0x500A)
+    with handle.claimInterface(commands_iface(handle)):
+        req = struct.pack("<BBHHHI", INJ_BIN_MAGIC, INJ_BIN_BOOKMARK, 0, 0,
+                          seq, tag)
+        handle.bulkWrite(COMMANDS_EP, req, timeout=TIMEOUT_MS)
+
+
+if __name__ == "__main__":
+    main(argv[1:])
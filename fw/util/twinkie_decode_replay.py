@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Decode a corpus of recorded packets with the decoder of the device, from
+# its RX buffer (INJ_BIN_DECODE, PD sink image):
+#
+#   twinkie_decode_replay.py corpus.txt
+#       print the outcome and the core cycles of each packet
+#   twinkie_decode_replay.py --save golden.txt corpus.txt
+#       also save the results as the reference of a firmware build
+#   twinkie_decode_replay.py --check golden.txt [--slower <pct>] corpus.txt
+#       exit with 2 if a packet decodes differently from the reference, or
+#       if the corpus takes <pct> % more cycles than it (default 10)
+#
+# The corpus has the format of util/pd_decode_bench.c : 8-bit RX timer
+# samples as 2-digit hex numbers, packets separated by a blank line or "||",
+# '#' starts a comment, so 'tcpc dump 2' output can be pasted as is.
+
+import struct
+import zlib
+from sys import argv
+
+INJ_BIN_MAGIC = 0xB1
+INJ_BIN_DECODE = 15
+# USB_EP_COMMAND, its interface number depends on the image running
+COMMANDS_EP = 2
+TIMEOUT_MS = 2000
+MAX_SAMPLES = 1024
+DECODE_FMT = "<hHHHII7I"
+EC_ERROR_UNIMPLEMENTED = 2
+ERR_NAMES = ["OK", "Preamble", "SOP", "len", "CRC", "EOP", "skipped"]
+
+
+def load_corpus(path):
+    packets, cur = [], []
+    with open(path) as f:
+        for line in f:
+            line = line.split("#")[0]
+            toks = line.split()
+            if not toks and cur:
+                packets.append(cur)
+                cur = []
+            for tok in toks:
+                tok = tok.rpartition(":")[2]
+                if tok == "||":
+                    if cur:
+                        packets.append(cur)
+                    cur = []
+                elif tok == "><":
+                    cur = []
+                elif len(tok) == 2:
+                    try:
+                        cur.append(int(tok, 16))
+                    except ValueError:
+                        pass
+    if cur:
+        packets.append(cur)
+    return [bytes(p[:MAX_SAMPLES]) for p in packets]
+
+
+def commands_iface(handle):
+    for setting in handle.getDevice().iterSettings():
+        for ep in setting:
+            if ep.getAddress() == COMMANDS_EP:
+                return setting.getNumber()
+    raise SystemExit("no commands interface")
+
+
+def decode(handle, samples, seq):
+    """Decode 'samples' on the device, returns the inj_decode fields"""
+    words = samples + b"\0" * (-len(samples) % 4)
+    req = struct.pack("<BBHHHI", INJ_BIN_MAGIC, INJ_BIN_DECODE, len(samples),
+                      len(words) // 4, seq, zlib.crc32(words) & 0xFFFFFFFF)
+    handle.bulkWrite(COMMANDS_EP, req + words, timeout=TIMEOUT_MS)
+    resp = bytes(handle.bulkRead(0x80 | COMMANDS_EP, 64, timeout=TIMEOUT_MS))
+    _, _, status, _, count, crc, rseq, _ = struct.unpack_from("<BBHHHIHH",
+                                                              resp)
+    if status == EC_ERROR_UNIMPLEMENTED:
+        raise SystemExit("INJ_BIN_DECODE needs the PD sink image")
+    if status or rseq != seq or count * 4 != struct.calcsize(DECODE_FMT):
+        raise SystemExit("decode request failed: error %d" % status)
+    data = resp[16:16 + count * 4]
+    if zlib.crc32(data) & 0xFFFFFFFF != crc:
+        raise SystemExit("bad CRC of the result")
+    return struct.unpack(DECODE_FMT, data)
+
+
+def result_line(i, res):
+    ptype, head, err, samples, cycles, clock = res[:6]
+    line = "%3d: %-8s type %d header %04x" % (
+        i, ERR_NAMES[err] if err < len(ERR_NAMES) else err, ptype, head)
+    if ptype >= 0:
+        line += "".join(" %08x" % w for w in res[6:6 + ((head >> 12) & 7)])
+    return line, cycles
+
+
+def main(args):
+    import usb1
+
+    save = check = None
+    slower = 10.0
+    while len(args) > 1 and args[0].startswith("--"):
+        opt, val = args[0], args[1]
+        if opt == "--save":
+            save = val
+        elif opt == "--check":
+            check = val
+        elif opt == "--slower":
+            slower = float(val)
+        else:
+            break
+        args = args[2:]
+    if len(args) != 1:
+        raise SystemExit("usage: %s [--save|--check golden.txt] "
+                         "[--slower pct] corpus.txt" % argv[0])
+    packets = load_corpus(args[0])
+    if not packets:
+        raise SystemExit("%s: no packet" % args[0])
+
+    context = usb1.USBContext()
+    handle = context.openByVendorIDAndProductID(0x18D1, 0x500A)
+    lines, total, clock = [], 0, 0
+    with handle.claimInterface(commands_iface(handle)):
+        for i, samples in enumerate(packets):
+            res = decode(handle, samples, i & 0xFFFF)
+            line, cycles = result_line(i, res)
+            clock = res[5]
+            print("%s  %d cycles" % (line, cycles))
+            lines.append((line, cycles))
+            total += cycles
+    nsamples = sum(len(p) for p in packets)
+    print("%d packets, %d samples: %d cycles/packet, %.0f ns/packet, "
+          "%.2f Msamples/s" % (len(packets), nsamples, total // len(packets),
+                               total * 1e9 / clock / len(packets),
+                               nsamples * clock / max(total, 1) / 1e6))
+
+    if save:
+        with open(save, "w") as f:
+            for line, cycles in lines:
+                f.write("%s  %d cycles\n" % (line, cycles))
+    if check:
+        with open(check) as f:
+            ref = [l.rsplit("  ", 1) for l in f.read().splitlines()]
+        bad = [i for i, (line, _) in enumerate(lines)
+               if i >= len(ref) or ref[i][0] != line]
+        ref_total = sum(int(r[1].split()[0]) for r in ref)
+        for i in bad:
+            print("mismatch: %s" % lines[i][0])
+            if i < len(ref):
+                print("   was:   %s" % ref[i][0])
+        pct = (total - ref_total) * 100.0 / max(ref_total, 1)
+        print("%+.1f %% cycles against %s" % (pct, check))
+        if bad or len(ref) != len(lines) or pct > slower:
+            raise SystemExit(2)
+
+
+if __name__ == "__main__":
+    main(argv[1:])
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Print the event notifications of a twinkie (struct inj_notify in
+# board/twinkie/injector.h) as they come :
+#
+#   twinkie_events.py
+#       one line per event, with its timestamp in us
+#   twinkie_events.py --until trigger|fsm|oflow|mode|check
+#       exit at the first event of that type (e.g. to wait for a script)
+
+import struct
+from sys import argv
+
+NOTIFY_EP = 0x84
+NOTIFY_FMT = "<BBHIII"
+TYPES = {1: "trigger", 2: "fsm", 3: "oflow", 4: "mode", 5: "check"}
+JOBS = ["FSM", "fuzz", "margin", "replay", "soak", "wave", "BIST"]
+MODES = ["trace", "qos", "zerocopy"]
+CHECKS = ["ok", "msgid", "no-goodcrc", "retries", "goodcrc", "response"]
+INJ_NOTIFY_ABORTED = 0x80
+
+
+def notify_iface(handle):
+    for setting in handle.getDevice().iterSettings():
+        for ep in setting:
+            if ep.getAddress() == NOTIFY_EP:
+                return setting.getNumber()
+    raise SystemExit("no notification endpoint, old firmware ?")
+
+
+def describe(etype, arg):
+    if etype == 1:
+        return "sources %02x" % arg
+    if etype == 2:
+        job = arg & 0x7F
+        res = struct.unpack("<h", struct.pack("<H", arg >> 16))[0]
+        return "%s %s%s" % (JOBS[job] if job < len(JOBS) else job,
+                            "aborted" if arg & INJ_NOTIFY_ABORTED else "done",
+                            " at %d" % res if job == 0 else "")
+    if etype == 3:
+        return "%d half-buffers" % arg
+    if etype == 4:
+        kind = arg >> 16
+        return "%s %d" % (MODES[kind] if kind < len(MODES) else kind,
+                          arg & 0xFFFF)
+    if etype == 5:
+        kind = arg & 0xFF
+        return "%s on CC%d" % (CHECKS[kind] if kind < len(CHECKS) else kind,
+                               arg >> 8)
+    return "%08x" % arg
+
+
+def main(args):
+    import usb1
+
+    until = None
+    if len(args) == 2 and args[0] == "--until" and args[1] in TYPES.values():
+        until = args[1]
+    elif args:
+        raise SystemExit("usage: %s [--until %s]" %
+                         (argv[0], "|".join(TYPES.values())))
+
+    context = usb1.USBContext()
+    handle = context.openByVendorIDAndProductID(0x18D1, 0x500A)
+    with handle.claimInterface(notify_iface(handle)):
+        while True:
+            try:
+                data = handle.interruptRead(NOTIFY_EP, 16, timeout=0)
+            except usb1.USBErrorInterrupted:
+                break
+            etype, lost, seq, ts_lo, ts_hi, arg = struct.unpack(NOTIFY_FMT,
+                                                                data)
+            name = TYPES.get(etype, str(etype))
+            print("%16d #%-5d %-7s %s%s" % (ts_hi << 32 | ts_lo, seq, name,
+                                           describe(etype, arg),
+                                           " (%d lost before)" % lost
+                                           if lost else ""), flush=True)
+            if name == until:
+                break
+
+
+if __name__ == "__main__":
+    main(argv[1:])
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Read the flash back over the commands interface at the full USB rate:
+#
+#   twinkie_flash_read.py --log caplog.bin
+#       the offline capture log region (INJ_BIN_LOG_READ), sniffer only
+#   twinkie_flash_read.py flash.bin [<offset> <bytes>]
+#       any range of the flash (INJ_BIN_FLASH_READ), the whole of it by
+#       default
+#
+# A chunk which times out or fails its CRC is requested again from its
+# first word, the chunks already received are kept.
+
+import struct
+import zlib
+from sys import argv
+
+INJ_BIN_MAGIC = 0xB1
+INJ_BIN_LOG_READ = 6
+INJ_BIN_FLASH_READ = 14
+# USB_EP_COMMAND, its interface number depends on the image running
+COMMANDS_EP = 2
+CAPLOG_SIZE = 3 * 2048
+FLASH_SIZE = 128 * 1024
+# words per request, a stalled read only loses that much
+CHUNK_WORDS = 4096
+RETRIES = 3
+TIMEOUT_MS = 2000
+
+
+def commands_iface(handle):
+    for setting in handle.getDevice().iterSettings():
+        for ep in setting:
+            if ep.getAddress() == COMMANDS_EP:
+                return setting.getNumber()
+    raise SystemExit("no commands interface")
+
+
+def read_chunk(handle, op, idx, count, seq):
+    import usb1
+
+    req = struct.pack("<BBHHHI", INJ_BIN_MAGIC, op, idx, count, seq, 0)
+    handle.bulkWrite(COMMANDS_EP, req, timeout=TIMEOUT_MS)
+    want = 16 + 4 * count
+    data = b""
+    try:
+        while len(data) < want:
+            data += bytes(handle.bulkRead(0x80 | COMMANDS_EP, 64 * 64,
+                                          timeout=TIMEOUT_MS))
+            status = struct.unpack_from("<H", data, 2)[0]
+            if status:
+                raise SystemExit("request failed: error %d" % status)
+    except usb1.USBErrorTimeout:
+        return None
+    _, _, _, _, _, crc, rseq, _ = struct.unpack_from("<BBHHHIHH", data)
+    words = data[16:want]
+    if rseq != seq or zlib.crc32(words) & 0xFFFFFFFF != crc:
+        return None
+    return words
+
+
+def main(args):
+    import usb1
+
+    op = INJ_BIN_FLASH_READ
+    if "--log" in args:
+        args.remove("--log")
+        op = INJ_BIN_LOG_READ
+    if len(args) not in (1, 3):
+        raise SystemExit("usage: %s [--log] <out> [<offset> <bytes>]"
+                         % argv[0])
+    if len(args) == 3:
+        off, size = int(args[1], 0), int(args[2], 0)
+    else:
+        off, size = 0, CAPLOG_SIZE if op == INJ_BIN_LOG_READ else FLASH_SIZE
+    if off % 4 or size % 4:
+        raise SystemExit("offset and size must be multiples of 4")
+
+    context = usb1.USBContext()
+    handle = context.openByVendorIDAndProductID(0x18D1, 0x500A)
+    out = b""
+    seq = 0
+    with handle.claimInterface(commands_iface(handle)):
+        while len(out) < size:
+            idx = (off + len(out)) // 4
+            count = min(CHUNK_WORDS, (size - len(out)) // 4)
+            for _ in range(RETRIES):
+                seq = (seq + 1) & 0xFFFF
+                words = read_chunk(handle, op, idx, count, seq)
+                if words is not None:
+                    break
+            else:
+                raise SystemExit("no valid data at offset 0x%x" % (idx * 4))
+            out += words
+    with open(args[0], "wb") as f:
+        f.write(out)
+
+
+if __name__ == "__main__":
+    main(argv[1:])
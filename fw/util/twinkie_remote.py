@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Console of a twinkie served by 'twinkie-capture -l port' (see
+# twinkie-capture/server.h), from another machine:
+#
+#   twinkie_remote.py host[:port]
+#       each line of stdin is sent as a command, its output printed
+
+import socket
+import struct
+from sys import argv, stdin, stdout
+
+NET_PORT = 9500
+NET_COMMAND = 2
+NET_OUTPUT = 4
+CMD_SIZE = 64
+
+
+def read_all(sock, size):
+    data = b""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise SystemExit("connection closed")
+        data += chunk
+    return data
+
+
+def command(sock, line):
+    """Output of the console command 'line', None if it failed"""
+    sock.sendall(struct.pack("<HHI", NET_COMMAND, 0, len(line)) + line)
+    while True:
+        ftype, _, size = struct.unpack("<HHI", read_all(sock, 8))
+        data = read_all(sock, size)
+        # no filter set : the server sends nothing but the outputs
+        if ftype == NET_OUTPUT:
+            return data or None
+
+
+def main(args):
+    if len(args) != 1:
+        raise SystemExit("usage: %s host[:port]" % argv[0])
+    host, _, port = args[0].partition(":")
+    sock = socket.create_connection((host, int(port or NET_PORT)))
+    for line in stdin:
+        line = line.encode()
+        if len(line) > CMD_SIZE:
+            stdout.write("command longer than %d bytes\n" % CMD_SIZE)
+            continue
+        out = command(sock, line)
+        stdout.write(out.decode(errors="replace") if out else
+                     "command failed\n")
+        stdout.flush()
+
+
+if __name__ == "__main__":
+    main(argv[1:])
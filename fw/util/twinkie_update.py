@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Program the PD sink image (RW) with the INJ_BIN_UPDATE binary request on
+# the commands interface, no DFU mode needed:
+#
+#   twinkie_update.py build/twonkie/RW/ec.RW.bin
+#       from the sniffer (RO), then 'tw sink' runs it
+#
+# The RO image is only updated with DFU.
+# The image goes in a single bulk transfer, the device programs it as it
+# arrives and answers once with the CRC-32 of the flash content.
+
+import struct
+import time
+import zlib
+from sys import argv
+
+INJ_BIN_MAGIC = 0xB1
+INJ_BIN_UPDATE = 13
+EC_ERROR_ACCESS_DENIED = 7
+# USB_EP_COMMAND, its interface number depends on the image running
+COMMANDS_EP = 2
+TIMEOUT_MS = 30000
+
+
+def commands_iface(handle):
+    for setting in handle.getDevice().iterSettings():
+        for ep in setting:
+            if ep.getAddress() == COMMANDS_EP:
+                return setting.getNumber()
+    raise SystemExit("no commands interface")
+
+
+def main(path):
+    import usb1
+
+    with open(path, "rb") as f:
+        image = f.read()
+    # whole words, the padding is left erased
+    image += b"\xff" * (-len(image) % 4)
+    words = len(image) // 4
+    if words > 0xFFFF:
+        raise SystemExit("%s: image too large" % path)
+    crc = zlib.crc32(image) & 0xFFFFFFFF
+    req = struct.pack("<BBHHHI", INJ_BIN_MAGIC, INJ_BIN_UPDATE, 0, words,
+                      0, crc)
+
+    context = usb1.USBContext()
+    handle = context.openByVendorIDAndProductID(0x18D1, 0x500A)
+    with handle.claimInterface(commands_iface(handle)):
+        start = time.time()
+        handle.bulkWrite(COMMANDS_EP, req + image, timeout=TIMEOUT_MS)
+        data = b""
+        while len(data) < 16:
+            data += bytes(handle.bulkRead(0x80 | COMMANDS_EP, 64,
+                                          timeout=TIMEOUT_MS))
+        _, _, status, _, _, dev_crc, _, _ = struct.unpack_from(
+            "<BBHHHIHH", data)
+    if status == EC_ERROR_ACCESS_DENIED:
+        raise SystemExit("update refused: run the sniffer first "
+                         "('tw sniffer')")
+    if status:
+        raise SystemExit("update failed: error %d, crc %08x (expected %08x)"
+                         % (status, dev_crc, crc))
+    print("%d bytes programmed in %.1fs, crc %08x" %
+          (len(image), time.time() - start, dev_crc))
+
+
+if __name__ == "__main__":
+    if len(argv) != 2:
+        raise SystemExit("usage: %s <ec.RW.bin>" % argv[0])
+    main(argv[1])
@@ -0,0 +1,249 @@
+#!/usr/bin/env python3
+# Copyright 2017 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+#
+# Round trips and sustained bandwidth of the USB interfaces of the device:
+#
+#   twinkie_usb_bench.py [-n <runs>] [-t <seconds>] [<test> ...]
+#
+# The tests, all of them by default (sniffer on the sniffer image only):
+#   ep0     vendor control request of an INJ_CMD_NOP word (injector.h)
+#   text    fence (a tag alone) on the commands interface
+#   binary  INJ_BIN_ECHO of 13 words on the commands interface
+#   console empty line on the console interface, until the prompt
+#   in      INJ_BIN_FLASH_READ of the whole flash, streamed
+#   out     INJ_BIN_SINK of 64 kB requests
+#   sniffer bytes read from the sniffer bulk endpoint, as they come
+#
+# The round trips print their percentiles and a log2 histogram in
+# microseconds, the streams their bytes per second. The sniffer only streams
+# what it captures : run it during a 'tw soak' or a live capture.
+
+import struct
+import time
+import zlib
+from sys import argv
+
+INJ_BIN_MAGIC = 0xB1
+INJ_BIN_FLASH_READ = 14
+INJ_BIN_ECHO = 17
+INJ_BIN_SINK = 18
+INJ_CMD_NOP = 0xF
+CONSOLE_EP = 1
+# USB_EP_COMMAND, its interface number depends on the image running
+COMMANDS_EP = 2
+SNIFFER_EP = 3
+SNIFFER_IFACE = 1
+CONSOLE_IFACE = 0
+FLASH_WORDS = 128 * 1024 // 4
+ECHO_WORDS = 13
+SINK_WORDS = 16384
+TIMEOUT_MS = 2000
+TESTS = ("ep0", "text", "binary", "console", "in", "out", "sniffer")
+
+
+def commands_iface(handle):
+    for setting in handle.getDevice().iterSettings():
+        for ep in setting:
+            if ep.getAddress() == COMMANDS_EP:
+                return setting.getNumber()
+    raise SystemExit("no commands interface")
+
+
+def has_sniffer(handle):
+    for setting in handle.getDevice().iterSettings():
+        for ep in setting:
+            if ep.getAddress() == 0x80 | SNIFFER_EP:
+                return True
+    return False
+
+
+def bin_req(op, idx, count, seq, crc=0):
+    return struct.pack("<BBHHHI", INJ_BIN_MAGIC, op, idx, count, seq, crc)
+
+
+def bin_resp(handle, want):
+    data = b""
+    while len(data) < want:
+        data += bytes(handle.bulkRead(0x80 | COMMANDS_EP, 64 * 64,
+                                      timeout=TIMEOUT_MS))
+        status = struct.unpack_from("<H", data, 2)[0]
+        if status:
+            raise SystemExit("request failed: error %d" % status)
+    return data
+
+
+def report_rtt(name, rtts):
+    rtts = sorted(rtts)
+    pct = [rtts[min(len(rtts) - 1, len(rtts) * p // 100)]
+           for p in (50, 90, 99)]
+    print("%-8s %d runs, min %d us, p50 %d, p90 %d, p99 %d, max %d" %
+          (name, len(rtts), rtts[0], pct[0], pct[1], pct[2], rtts[-1]))
+    hist = {}
+    for rtt in rtts:
+        b = max(rtt, 1).bit_length() - 1
+        hist[b] = hist.get(b, 0) + 1
+    for b in sorted(hist):
+        print("  %6d-%-6d us %6d %s" % (1 << b, (2 << b) - 1, hist[b],
+                                         "#" * (hist[b] * 50 // len(rtts))))
+
+
+def report_rate(name, nbytes, secs):
+    print("%-8s %d bytes in %.2f s, %d kB/s" %
+          (name, nbytes, secs, nbytes / secs / 1000))
+
+
+def timed(runs, func):
+    rtts = []
+    for i in range(runs):
+        start = time.perf_counter()
+        func(i)
+        rtts.append(int((time.perf_counter() - start) * 1e6))
+    return rtts
+
+
+def bench_ep0(handle, iface, runs):
+    # vendor, interface recipient, IN : wIndex is INJ_CTRL_INDEX(iface, 0, 0)
+    def run(i):
+        if len(handle.controlRead(0xC1, INJ_CMD_NOP, 0, iface, 4,
+                                  timeout=TIMEOUT_MS)) != 4:
+            raise SystemExit("short vendor request")
+    return timed(runs, run)
+
+
+def bench_text(handle, runs):
+    def run(i):
+        tag = b"@%d" % (i % 10000)
+        handle.bulkWrite(COMMANDS_EP, tag + b"\n", timeout=TIMEOUT_MS)
+        data = b""
+        while tag + b" " not in data:
+            data += bytes(handle.bulkRead(0x80 | COMMANDS_EP, 64 * 64,
+                                          timeout=TIMEOUT_MS))
+    return timed(runs, run)
+
+
+def bench_binary(handle, runs):
+    words = bytes(range(4 * ECHO_WORDS))
+    crc = zlib.crc32(words) & 0xFFFFFFFF
+
+    def run(i):
+        seq = i & 0xFFFF
+        handle.bulkWrite(COMMANDS_EP,
+                         bin_req(INJ_BIN_ECHO, 0, ECHO_WORDS, seq) + words,
+                         timeout=TIMEOUT_MS)
+        data = bin_resp(handle, 16 + len(words))
+        if struct.unpack_from("<IH", data, 8) != (crc, seq) or \
+           data[16:] != words:
+            raise SystemExit("bad echo")
+    return timed(runs, run)
+
+
+def bench_console(handle, runs):
+    import usb1
+
+    def run(i):
+        handle.bulkWrite(CONSOLE_EP, b"\n", timeout=TIMEOUT_MS)
+        data = b""
+        while b"> " not in data:
+            data += bytes(handle.bulkRead(0x80 | CONSOLE_EP, 64,
+                                          timeout=TIMEOUT_MS))
+    # drop what the console had to say before
+    try:
+        while handle.bulkRead(0x80 | CONSOLE_EP, 64, timeout=100):
+            pass
+    except usb1.USBErrorTimeout:
+        pass
+    return timed(runs, run)
+
+
+def bench_in(handle, secs):
+    nbytes, seq = 0, 0
+    start = time.perf_counter()
+    while time.perf_counter() - start < secs:
+        seq = (seq + 1) & 0xFFFF
+        handle.bulkWrite(COMMANDS_EP,
+                         bin_req(INJ_BIN_FLASH_READ, 0, FLASH_WORDS, seq),
+                         timeout=TIMEOUT_MS)
+        data = bin_resp(handle, 16 + 4 * FLASH_WORDS)
+        if zlib.crc32(data[16:]) & 0xFFFFFFFF != \
+           struct.unpack_from("<I", data, 8)[0]:
+            raise SystemExit("bad flash read CRC")
+        nbytes += len(data)
+    return nbytes, time.perf_counter() - start
+
+
+def bench_out(handle, secs):
+    words = bytes(i & 0xFF for i in range(4 * SINK_WORDS))
+    crc = zlib.crc32(words) & 0xFFFFFFFF
+    nbytes, seq = 0, 0
+    start = time.perf_counter()
+    while time.perf_counter() - start < secs:
+        seq = (seq + 1) & 0xFFFF
+        # the request and the words as a single stream of full packets
+        handle.bulkWrite(COMMANDS_EP,
+                         bin_req(INJ_BIN_SINK, 0, SINK_WORDS, seq, crc) +
+                         words, timeout=TIMEOUT_MS)
+        data = bin_resp(handle, 16)
+        if struct.unpack_from("<I", data, 8)[0] != crc:
+            raise SystemExit("bad sink CRC")
+        nbytes += 16 + len(words)
+    return nbytes, time.perf_counter() - start
+
+
+def bench_sniffer(handle, secs):
+    import usb1
+
+    nbytes = 0
+    start = time.perf_counter()
+    while time.perf_counter() - start < secs:
+        try:
+            nbytes += len(handle.bulkRead(0x80 | SNIFFER_EP, 64 * 64,
+                                          timeout=100))
+        except usb1.USBErrorTimeout:
+            pass
+    return nbytes, time.perf_counter() - start
+
+
+def main(args):
+    import usb1
+
+    runs, secs = 1000, 5.0
+    while args and args[0] in ("-n", "-t") and len(args) > 1:
+        if args[0] == "-n":
+            runs = int(args[1], 0)
+        else:
+            secs = float(args[1])
+        args = args[2:]
+    for name in args:
+        if name not in TESTS:
+            raise SystemExit("usage: %s [-n <runs>] [-t <seconds>] "
+                             "[%s ...]" % (argv[0], "|".join(TESTS)))
+
+    context = usb1.USBContext()
+    handle = context.openByVendorIDAndProductID(0x18D1, 0x500A)
+    tests = args or [t for t in TESTS
+                     if t != "sniffer" or has_sniffer(handle)]
+    iface = commands_iface(handle)
+    with handle.claimInterface(iface):
+        for name in tests:
+            if name == "ep0":
+                report_rtt(name, bench_ep0(handle, iface, runs))
+            elif name == "text":
+                report_rtt(name, bench_text(handle, runs))
+            elif name == "binary":
+                report_rtt(name, bench_binary(handle, runs))
+            elif name == "console":
+                with handle.claimInterface(CONSOLE_IFACE):
+                    report_rtt(name, bench_console(handle, runs))
+            elif name == "in":
+                report_rate(name, *bench_in(handle, secs))
+            elif name == "out":
+                report_rate(name, *bench_out(handle, secs))
+            elif name == "sniffer":
+                with handle.claimInterface(SNIFFER_IFACE):
+                    report_rate(name, *bench_sniffer(handle, secs))
+
+
+if __name__ == "__main__":
+    main(argv[1:])